@@ -0,0 +1,37 @@
+#pragma once
+#include <cstdint>
+
+// Tensors exchanged with other array libraries, e.g. PyTorch, as DLPack
+// capsules. Only the structs of the stable ABI of DLPack are declared, as
+// in its dlpack.h, since they are all that capsules hold.
+
+enum DLDeviceType : int32_t { kDLCPU = 1, kDLCUDA = 2 };
+
+struct DLDevice {
+  DLDeviceType device_type = kDLCPU;
+  int32_t      device_id   = 0;
+};
+
+enum DLDataTypeCode : uint8_t { kDLInt = 0, kDLUInt = 1, kDLFloat = 2 };
+
+struct DLDataType {
+  uint8_t  code  = kDLFloat;
+  uint8_t  bits  = 32;
+  uint16_t lanes = 1;
+};
+
+struct DLTensor {
+  void*      data        = nullptr;
+  DLDevice   device      = {};
+  int32_t    ndim        = 0;
+  DLDataType dtype       = {};
+  int64_t*   shape       = nullptr;
+  int64_t*   strides     = nullptr;  // in elements, compact if null
+  uint64_t   byte_offset = 0;
+};
+
+struct DLManagedTensor {
+  DLTensor dl_tensor   = {};
+  void*    manager_ctx = nullptr;
+  void (*deleter)(DLManagedTensor* self) = nullptr;
+};
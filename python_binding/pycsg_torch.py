@@ -0,0 +1,36 @@
+# Torch tensors evaluated by pycsg through DLPack, without copies for float32
+# tensors on the CPU. Tensors on other devices are moved to the CPU and the
+# values back, since the tape and the GPU backend of gpu.h read points from
+# host memory. Gradients with respect to the points flow through autograd.
+#
+#   compiled = CompiledCsg(csg)
+#   values = eval_torch(compiled, points)  # (N,), like points of (N, 3)
+#   values.sum().backward()                # points.grad from the gradients
+
+import torch
+from torch.utils import dlpack
+
+
+def _host(points):
+    return points.detach().to("cpu", torch.float32).contiguous()
+
+
+class CsgFunction(torch.autograd.Function):
+    @staticmethod
+    def forward(ctx, points, compiled):
+        if not ctx.needs_input_grad[0]:
+            values = compiled.eval_dlpack(_host(points))
+            return dlpack.from_dlpack(values).to(points.device)
+        values, grads = compiled.grad_dlpack(_host(points))
+        ctx.save_for_backward(dlpack.from_dlpack(grads).to(points.device))
+        return dlpack.from_dlpack(values).to(points.device)
+
+    @staticmethod
+    def backward(ctx, output):
+        (grads,) = ctx.saved_tensors
+        return (output[:, None] * grads).to(output.dtype), None
+
+
+def eval_torch(compiled, points):
+    """Values of a CompiledCsg at a tensor of points of shape (N, 3)."""
+    return CsgFunction.apply(points, compiled)
@@ -0,0 +1,121 @@
+# Notebook widget that renders trees with the headless renderer of pycsg, for
+# kernels that cannot open windows, e.g. remote ones. The kernel renders a
+# RenderSession, see session.h, and sends its JPEG tiles over the comm of
+# the widget as they converge; the browser draws them on a canvas and sends
+# back the drags, which orbit the camera around the center of the unit box,
+# and the wheel, which moves it closer. Views asked for while one renders
+# merge in the session, so the render keeps up with the mouse. Needs
+# anywidget.
+#
+#   widget = CsgWidget(csg, resolution=384, samples=64)
+#   widget                     # shows it as the last value of a cell
+#   widget.close()             # stops the render
+
+import math
+import threading
+
+import anywidget
+import traitlets
+
+import pycsg
+
+_ESM = """
+export default {
+  render({ model, el }) {
+    const canvas = document.createElement("canvas");
+    canvas.width = model.get("width");
+    canvas.height = model.get("height");
+    canvas.style.cursor = "grab";
+    canvas.style.touchAction = "none";
+    const context = canvas.getContext("2d");
+    // tiles are decoded in order, so later tiles cover earlier ones
+    let decoded = Promise.resolve();
+    let view = 0;
+    model.on("msg:custom", (tile, buffers) => {
+      if (tile.view < view) return;
+      view = tile.view;
+      const blob = new Blob([buffers[0]], { type: "image/jpeg" });
+      decoded = decoded.then(() => createImageBitmap(blob)).then((bitmap) => {
+        if (tile.view < view) return;
+        context.drawImage(bitmap, tile.x, tile.y, tile.width, tile.height);
+      }).catch(() => {});
+    });
+    let last = null;
+    canvas.addEventListener("pointerdown", (event) => {
+      last = [event.clientX, event.clientY];
+      canvas.setPointerCapture(event.pointerId);
+    });
+    canvas.addEventListener("pointermove", (event) => {
+      if (!last) return;
+      const dx = event.clientX - last[0], dy = event.clientY - last[1];
+      last = [event.clientX, event.clientY];
+      model.send({ type: "orbit", dx: dx / canvas.width,
+        dy: dy / canvas.height });
+    });
+    canvas.addEventListener("pointerup", () => { last = null; });
+    canvas.addEventListener("wheel", (event) => {
+      event.preventDefault();
+      model.send({ type: "zoom", delta: event.deltaY });
+    });
+    el.appendChild(canvas);
+  },
+};
+"""
+
+
+class CsgWidget(anywidget.AnyWidget):
+    """Progressive render of a tree that orbits with the mouse."""
+
+    _esm = _ESM
+    width = traitlets.Int(256).tag(sync=True)
+    height = traitlets.Int(256).tag(sync=True)
+
+    def __init__(self, csg, resolution=256, samples=64, quality=80):
+        self._session = pycsg.RenderSession(csg, resolution, samples, quality)
+        width, height = self._session.size
+        super().__init__(width=width, height=height)
+        # the camera of the viewer, as a distance and angles around the
+        # center of the unit box
+        self._center = [0.5, 0.5, 0.5]
+        self._distance = math.sqrt(3 * 1.5 ** 2)
+        self._azimuth = math.pi / 4
+        self._elevation = math.asin(1 / math.sqrt(3))
+        self._running = True
+        self._thread = threading.Thread(target=self._send_tiles, daemon=True)
+        self._thread.start()
+        self.on_msg(self._on_msg)
+        self._view()
+
+    def _view(self):
+        c = math.cos(self._elevation)
+        offset = [
+            self._distance * c * math.sin(self._azimuth),
+            self._distance * math.sin(self._elevation),
+            self._distance * c * math.cos(self._azimuth),
+        ]
+        eye = [self._center[k] + offset[k] for k in range(3)]
+        self._session.view(pycsg.look_at(eye, self._center, [0, 1, 0]))
+
+    def _on_msg(self, widget, content, buffers):
+        if content.get("type") == "orbit":
+            self._azimuth -= content["dx"] * math.pi
+            self._elevation += content["dy"] * math.pi
+            self._elevation = max(-1.5, min(1.5, self._elevation))
+        elif content.get("type") == "zoom":
+            self._distance *= math.exp(content["delta"] * 1e-3)
+        else:
+            return
+        self._view()
+
+    def _send_tiles(self):
+        while self._running:
+            for tile in self._session.poll(0.05):
+                jpeg = tile.pop("jpeg")
+                self.send(tile, [jpeg])
+
+    def close(self):
+        """Stops the render and closes the widget."""
+        self._running = False
+        self._thread.join()
+        self._session.close()
+        super().close()
@@ -1,27 +1,1187 @@
+#include <pybind11/numpy.h>
 #include <pybind11/pybind11.h>
+#include <pybind11/stl.h>
 
+#include "../source/batch.h"
 #include "../source/csg.h"
+#include "../source/fit.h"
+#include "../source/gpu.h"
+#include "../source/gradient.h"
+#include "../source/jit.h"
+#include "../source/mass.h"
+#include "../source/memory.h"
+#include "../source/overlap.h"
 #include "../source/parser.h"
+#include "../source/query.h"
+#include "../source/raymarch.h"
+#include "../source/sampling.h"
+#include "../source/session.h"
+#include "../source/sparse.h"
+#include "../source/spheres.h"
+#include "../source/surface.h"
+#include "../source/tape.h"
+#include "../source/tape_io.h"
+#include "../source/tree_io.h"
+#include "../source/tuner.h"
+#include "dlpack.h"
+#ifdef PYCSG_VIEWER
+#include "../source/viewer.h"
+#endif
 //
-#include "../source/main.cpp"
+#include <algorithm>
+#include <chrono>
+#include <future>
+#include <memory>
+using namespace std;
+using namespace std::chrono_literals;
+
+// Margins of the bindings: exact tapes for 0, the default, and guarded ones
+// for positive margins, exact only within them of the surface, see
+// compile_csg in tape.h.
+float tape_margin(float margin) { return margin > 0 ? margin : flt_max; }
+
+CsgTape compile_tape(const CsgTree& csg, float margin, bool prune) {
+  return compile_csg(csg, tape_margin(margin), prune);
+}
+
+// Key of the contents of a tree, its nodes and leaves, hashed as bytes
+// since Python edits the parameters in place, without the node hashes.
+uint64_t contents_key(const CsgTree& csg) {
+  auto hash = mix_hash((uint64_t)csg.root, (uint64_t)csg.nodes.size());
+  hash = mix_hash(hash, (uint64_t)(csg.bounds.size() == csg.nodes.size()));
+  hash = hash_bytes(
+      hash, csg.nodes.data(), csg.nodes.size() * sizeof(CsgNode));
+  for (auto& group : csg.groups) {
+    hash = hash_bytes(hash, group.centers.data(),
+        group.centers.size() * sizeof(vec3f));
+    hash = hash_bytes(
+        hash, group.radius.data(), group.radius.size() * sizeof(float));
+  }
+  for (auto& mesh : csg.meshes) {
+    hash = hash_bytes(
+        hash, mesh.positions.data(), mesh.positions.size() * sizeof(vec3f));
+    hash = hash_bytes(
+        hash, mesh.triangles.data(), mesh.triangles.size() * sizeof(vec3i));
+  }
+  for (auto& instance : csg.instances) {
+    hash = hash_bytes(hash, &instance.frame, sizeof(instance.frame));
+    hash = hash_bytes(hash, &instance.fold, sizeof(instance.fold));
+    if (instance.tree) hash = mix_hash(hash, contents_key(*instance.tree));
+  }
+  return hash;
+}
+
+// Exact tapes of the trees evaluated last at single points, most recent
+// first, so that calls in a loop compile their tree once. The GIL, held by
+// the calls, guards them.
+const CsgTape& cached_tape(const CsgTree& csg) {
+  static auto tapes = vector<pair<uint64_t, CsgTape>>{};
+  auto        key   = contents_key(csg);
+  auto        it    = std::find_if(tapes.begin(), tapes.end(),
+      [key](auto& entry) { return entry.first == key; });
+  if (it == tapes.end()) {
+    if (tapes.size() >= 4) tapes.pop_back();
+    tapes.insert(tapes.begin(), {key, compile_csg(csg, flt_max)});
+  } else {
+    std::rotate(tapes.begin(), it, it + 1);
+  }
+  return tapes.front().second;
+}
 
 float eval(const CsgTree& csg, float x, float y, float z) {
-  return eval_csg(csg, {x, y, z});
+  return eval_tape(cached_tape(csg), {x, y, z});
+}
+
+// Tapes are evaluated by the interpreter, since looking up their native
+// code costs as much as a point. CompiledCsg keeps it, see eval_point.
+float eval_compiled(const CsgTape& tape, float x, float y, float z) {
+  return eval_tape(tape, {x, y, z});
+}
+
+namespace py = pybind11;
+
+// Returns (value, (dx, dy, dz)).
+py::tuple eval_grad(const CsgTree& csg, float x, float y, float z) {
+  auto result = eval_tape_grad(cached_tape(csg), {x, y, z});
+  auto grad   = result.grad;
+  return py::make_tuple(result.value, py::make_tuple(grad.x, grad.y, grad.z));
+}
+
+// Sum of the parameter derivatives at the points, scaled by the weights.
+CsgGradient eval_params_grad(const CsgTree& csg,
+    const vector<array<float, 3>>& points, const vector<float>& weights) {
+  if (points.size() != weights.size())
+    throw std::invalid_argument{"points and weights differ in size"};
+  auto positions = vector<vec3f>(points.size());
+  for (auto i = 0; i < points.size(); i++)
+    positions[i] = {points[i][0], points[i][1], points[i][2]};
+  return eval_csg_params_grad(csg, positions, weights);
+}
+
+// Values at the points, evaluated in parallel with a single call.
+vector<float> eval_batch(
+    const CsgTree& csg, const vector<array<float, 3>>& points) {
+  auto positions = vector<vec3f>(points.size());
+  for (auto i = 0; i < points.size(); i++)
+    positions[i] = {points[i][0], points[i][1], points[i][2]};
+  auto values = vector<float>(points.size());
+  eval_csg_batch(csg, positions, values);
+  return values;
+}
+
+// Arrays of points as NumPy gives them, converted to contiguous floats only
+// if they are not already.
+using points_array =
+    py::array_t<float, py::array::c_style | py::array::forcecast>;
+
+// Points of an array of shape (N, 3), read in place.
+span<const vec3f> array_points(const points_array& points) {
+  if (points.ndim() != 2 || points.shape(1) != 3)
+    throw std::invalid_argument{"points should have shape (N, 3)"};
+  return {(const vec3f*)points.data(), (size_t)points.shape(0)};
+}
+
+// Values at the points of an array of shape (N, 3), evaluated in parallel
+// without the GIL.
+py::array_t<float> eval_many(const CsgTree& csg, const points_array& points) {
+  auto positions = array_points(points);
+  auto values    = py::array_t<float>((py::ssize_t)positions.size());
+  auto out       = span<float>{values.mutable_data(), positions.size()};
+  {
+    py::gil_scoped_release release;
+    eval_csg_batch(csg, positions, out);
+  }
+  return values;
 }
 
-void render(const CsgTree& csg) {
-  auto app = make_shared<app_state>();
-  app->csg = csg;
-  run_app(app);
+// Returns (values, gradients), of shapes (N,) and (N, 3).
+py::tuple eval_many_grad(const CsgTree& csg, const points_array& points) {
+  auto positions = array_points(points);
+  auto size      = (py::ssize_t)positions.size();
+  auto values    = py::array_t<float>(size);
+  auto grads     = py::array_t<float>(vector<py::ssize_t>{size, 3});
+  auto out       = span<float>{values.mutable_data(), positions.size()};
+  auto out_grads = span<vec3f>{(vec3f*)grads.mutable_data(), positions.size()};
+  {
+    py::gil_scoped_release release;
+    eval_csg_batch_grad(compile_csg(csg, flt_max), positions, out, out_grads);
+  }
+  return py::make_tuple(values, grads);
 }
 
+// Returns (values, nodes), the nodes of the primitives that win at the
+// points, -1 where none does, see label.h.
+py::tuple eval_many_labels(const CsgTree& csg, const points_array& points) {
+  auto positions = array_points(points);
+  auto size      = (py::ssize_t)positions.size();
+  auto values    = py::array_t<float>(size);
+  auto nodes     = py::array_t<int>(size);
+  auto out       = span<float>{values.mutable_data(), positions.size()};
+  auto out_nodes = span<int>{nodes.mutable_data(), positions.size()};
+  {
+    py::gil_scoped_release release;
+    eval_csg_batch_labels(
+        compile_csg(csg, flt_max), positions, out, out_nodes);
+  }
+  return py::make_tuple(values, nodes);
+}
+
+// Returns (hit, distances, positions, normals, nodes) of the hits, see
+// surface.h, with the shapes of a query per row.
+py::tuple hits_arrays(const vector<CsgHit>& hits) {
+  auto size      = (py::ssize_t)hits.size();
+  auto hit       = py::array_t<bool>(size);
+  auto distances = py::array_t<float>(size);
+  auto positions = py::array_t<float>(vector<py::ssize_t>{size, 3});
+  auto normals   = py::array_t<float>(vector<py::ssize_t>{size, 3});
+  auto nodes     = py::array_t<int>(size);
+  for (auto k = 0; k < hits.size(); k++) {
+    hit.mutable_data()[k]                 = hits[k].hit;
+    distances.mutable_data()[k]           = hits[k].distance;
+    ((vec3f*)positions.mutable_data())[k] = hits[k].position;
+    ((vec3f*)normals.mutable_data())[k]   = hits[k].normal;
+    nodes.mutable_data()[k]               = hits[k].node;
+  }
+  return py::make_tuple(hit, distances, positions, normals, nodes);
+}
+
+// Closest points of the surface to points of shape (N, 3).
+py::tuple closest_points_many(const CsgTree& csg, const points_array& points) {
+  auto positions = array_points(points);
+  auto hits      = vector<CsgHit>(positions.size());
+  {
+    py::gil_scoped_release release;
+    closest_points(compile_csg(csg), positions, hits);
+  }
+  return hits_arrays(hits);
+}
+
+// First hits of the rays with origins and directions of shape (N, 3).
+py::tuple intersect_rays_many(const CsgTree& csg, const points_array& origins,
+    const points_array& directions) {
+  auto from = array_points(origins);
+  auto to   = array_points(directions);
+  if (from.size() != to.size())
+    throw std::invalid_argument{"origins and directions should match"};
+  auto rays = vector<ray3f>(from.size());
+  for (auto k = 0; k < rays.size(); k++) rays[k] = {from[k], to[k]};
+  auto hits = vector<CsgHit>(rays.size());
+  {
+    py::gil_scoped_release release;
+    intersect_rays(csg, compile_csg(csg), rays, hits);
+  }
+  return hits_arrays(hits);
+}
+
+// Mass properties of unit density, see mass.h, as a dict.
+py::dict mass_properties(const CsgTree& csg, int levels, int samples) {
+  auto options    = CsgMassOptions{};
+  options.levels  = levels;
+  options.samples = samples;
+  auto mass       = CsgMass{};
+  {
+    py::gil_scoped_release release;
+    mass = integrate_csg(csg, options);
+  }
+  auto& i      = mass.inertia;
+  auto  result = py::dict{};
+  result["volume"]         = mass.volume;
+  result["volume_error"]   = mass.volume_error;
+  result["area"]           = mass.area;
+  result["centroid"]       = array<float, 3>{
+      mass.centroid.x, mass.centroid.y, mass.centroid.z};
+  result["centroid_error"] = mass.centroid_error;
+  result["inertia"]        = array<array<float, 3>, 3>{
+      array<float, 3>{i.x.x, i.x.y, i.x.z},
+      array<float, 3>{i.y.x, i.y.y, i.y.z},
+      array<float, 3>{i.z.x, i.z.y, i.z.z}};
+  return result;
+}
+
+// Overlap of two trees, see overlap.h, as a dict.
+py::dict overlap_trees(
+    const CsgTree& a, const CsgTree& b, int levels, bool depth) {
+  auto options   = CsgOverlapOptions{};
+  options.levels = levels;
+  options.depth  = depth;
+  auto overlap   = CsgOverlap{};
+  {
+    py::gil_scoped_release release;
+    overlap = overlap_csg(a, b, options);
+  }
+  auto result         = py::dict{};
+  result["overlap"]   = overlap.overlap;
+  result["separated"] = overlap.separated;
+  result["depth"]     = overlap.depth;
+  result["point"]     = array<float, 3>{
+      overlap.point.x, overlap.point.y, overlap.point.z};
+  return result;
+}
+
+// Returns (points, values), of shapes (N, 3) and (N,), drawn uniformly in
+// the bounds, "near" or on the "surface", see sample_csg. The bounds are
+// the ones of the meshes if not given.
+py::tuple sample_points(const CsgTree& csg, int num, const string& mode,
+    int resolution, uint64_t seed, const vector<array<float, 3>>& bounds) {
+  auto sampling = csg_sampling::uniform;
+  if (mode == "near") {
+    sampling = csg_sampling::near;
+  } else if (mode == "surface") {
+    sampling = csg_sampling::surface;
+  } else if (mode != "uniform") {
+    throw std::invalid_argument{"unknown sampling: " + mode};
+  }
+  if (!bounds.empty() && bounds.size() != 2)
+    throw std::invalid_argument{"bounds should be [min, max]"};
+  auto box = mesh_bounds(csg);
+  if (!bounds.empty())
+    box = {{bounds[0][0], bounds[0][1], bounds[0][2]},
+        {bounds[1][0], bounds[1][1], bounds[1][2]}};
+  auto points = py::array_t<float>(vector<py::ssize_t>{num, 3});
+  auto values = py::array_t<float>((py::ssize_t)num);
+  auto out    = span<vec3f>{(vec3f*)points.mutable_data(), (size_t)num};
+  {
+    py::gil_scoped_release release;
+    sample_csg(csg, box, sampling, out, {values.mutable_data(), (size_t)num},
+        resolution, seed);
+  }
+  return py::make_tuple(points, values);
+}
+
+// Takes `iterations` steps of the fit of the tree to the values at the
+// points, of shapes (N,) and (N, 3), see fit_step. Returns the last loss.
+float fit_points(CsgFit& fit, CsgTree& csg, const points_array& points,
+    const py::array_t<float, py::array::c_style | py::array::forcecast>&
+        values,
+    int iterations) {
+  auto positions = array_points(points);
+  if (values.ndim() != 1 || values.shape(0) != positions.size())
+    throw std::invalid_argument{"values should have shape (N,)"};
+  if (fit.mean.params.size() != csg.nodes.size())
+    throw std::invalid_argument{"the tree is not the one of the fit"};
+  auto targets = span<const float>{values.data(), positions.size()};
+  auto loss    = 0.0f;
+  {
+    py::gil_scoped_release release;
+    for (auto iteration = 0; iteration < iterations; iteration++)
+      loss = fit_step(fit, csg, positions, targets);
+  }
+  return loss;
+}
+
+// Client of a daemon serving the distances of a tree through shared memory,
+// see query.h. Points are copied into the slots of the daemon and the
+// distances out of them, without the GIL.
+struct CsgQueryClient {
+  CsgQueryRegion region = {};
+
+  CsgQueryClient(const string& name) {
+    auto error = string{};
+    if (!open_query_region(region, name, error))
+      throw std::runtime_error{error};
+  }
+  CsgQueryClient(const CsgQueryClient&) = delete;
+  ~CsgQueryClient() { close_query_region(region); }
+};
+
+py::array_t<float> eval_query(
+    const CsgQueryClient& client, const points_array& points) {
+  auto positions = array_points(points);
+  auto values    = py::array_t<float>((py::ssize_t)positions.size());
+  auto out       = span<float>{values.mutable_data(), positions.size()};
+  auto ok        = false;
+  {
+    py::gil_scoped_release release;
+    ok = query_csg(client.region, positions, out);
+  }
+  if (!ok) throw std::runtime_error{client.region.name + ": daemon stopped"};
+  return values;
+}
+
+// Tree compiled once to be evaluated many times: the tape, and its native
+// code with CSG_JIT. Registers are kept per thread by tape_registers, so
+// calls only allocate their results. The tree is kept to be pickled.
+struct CsgCompiled {
+  CsgTape                        tape   = {};
+  CsgJit                         jit    = {};
+  float                          margin = flt_max;
+  std::shared_ptr<const CsgTree> tree   = {};
+};
+
+CsgCompiled make_compiled(const CsgTree& csg, float margin) {
+  auto compiled   = CsgCompiled{};
+  compiled.margin = tape_margin(margin);
+  compiled.tape   = compile_csg_cached(csg, compiled.margin);
+  compiled.jit    = compile_jit(compiled.tape);
+  compiled.tree   = make_shared<const CsgTree>(csg);
+  return compiled;
+}
+
+// Compiles the tree again after its parameters are edited. The native code
+// only reads the parameters of the tape, so it is kept unless the structure
+// changed.
+void update_compiled(CsgCompiled& compiled, const CsgTree& csg) {
+  compiled.tape = compile_csg(csg, compiled.margin);
+  compiled.tree = make_shared<const CsgTree>(csg);
+  if (structure_hash(compiled.tape) != compiled.jit.hash)
+    compiled.jit = compile_jit(compiled.tape);
+}
+
+// Value at a point, with the native code if there is one.
+float eval_point(const CsgCompiled& compiled, float x, float y, float z) {
+  if (is_valid(compiled.jit))
+    return eval_jit(compiled.jit, compiled.tape, vec3f{x, y, z});
+  return eval_tape(compiled.tape, {x, y, z});
+}
+
+// Values at `num` points, by packets of 8 with the native code if there is
+// one, or with the batch kernel.
+void eval_compiled_block(
+    const CsgCompiled& compiled, const vec3f* points, float* out, int num) {
+  if (!is_valid(compiled.jit))
+    return get_kernel().eval(compiled.tape, points, out, num);
+  for (auto i = 0; i < num; i += 8) {
+    auto count  = yocto::min(8, num - i);
+    auto values = eval_jit(
+        compiled.jit, compiled.tape, load_points<float8>(points + i, count));
+    float buffer[8];
+    store8(buffer, values);
+    for (auto k = 0; k < count; k++) out[i + k] = buffer[k];
+  }
+}
+
+// Values at `num` points. Batches of a single block are evaluated on the
+// calling thread, so that small batches do not wait for the pool.
+void eval_compiled_points(
+    const CsgCompiled& compiled, const vec3f* points, float* out, int num) {
+  auto block      = CsgBatchOptions{}.block_size;
+  auto eval_block = [&](int begin, int end) {
+    eval_compiled_block(compiled, points + begin, out + begin, end - begin);
+  };
+  if (num <= block) {
+    eval_block(0, num);
+  } else {
+    parallel_for_chunks(num, eval_block, block);
+  }
+}
+
+// Values at the points of an array of shape (N, 3).
+py::array_t<float> eval_compiled_many(
+    const CsgCompiled& compiled, const points_array& points) {
+  auto positions = array_points(points);
+  auto values    = py::array_t<float>((py::ssize_t)positions.size());
+  auto out       = values.mutable_data();
+  {
+    py::gil_scoped_release release;
+    eval_compiled_points(
+        compiled, positions.data(), out, (int)positions.size());
+  }
+  return values;
+}
+
+// Values of each of the trees at the same points, of shape (T, N), see
+// parallel_for_trees.
+py::array_t<float> eval_trees(const vector<const CsgCompiled*>& trees,
+    const points_array& points) {
+  for (auto tree : trees)
+    if (!tree) throw std::invalid_argument{"trees should be CompiledCsg"};
+  auto positions = array_points(points);
+  auto num       = (py::ssize_t)positions.size();
+  auto values    = py::array_t<float>(
+      vector<py::ssize_t>{(py::ssize_t)trees.size(), num});
+  auto out = values.mutable_data();
+  {
+    py::gil_scoped_release release;
+    parallel_for_trees((int)trees.size(), (int)num,
+        [&](int tree, int begin, int end) {
+          eval_compiled_block(*trees[tree], positions.data() + begin,
+              out + tree * num + begin, end - begin);
+        });
+  }
+  return values;
+}
+
+// Returns (values, gradients), of shapes (N,) and (N, 3).
+py::tuple eval_compiled_many_grad(
+    const CsgCompiled& compiled, const points_array& points) {
+  auto positions = array_points(points);
+  auto size      = (py::ssize_t)positions.size();
+  auto values    = py::array_t<float>(size);
+  auto grads     = py::array_t<float>(vector<py::ssize_t>{size, 3});
+  auto out       = span<float>{values.mutable_data(), positions.size()};
+  auto out_grads = span<vec3f>{(vec3f*)grads.mutable_data(), positions.size()};
+  auto options   = CsgBatchOptions{};
+  options.parallel = positions.size() > options.block_size;
+  {
+    py::gil_scoped_release release;
+    eval_csg_batch_grad(compiled.tape, positions, out, out_grads, options);
+  }
+  return py::make_tuple(values, grads);
+}
+
+// Streams hold Python objects, which pybind11 hides, so they are kept in
+// this file.
+namespace {
+
+// Chunk of a stream of points being evaluated on the pool, with the arrays
+// that the task reads and writes.
+struct CsgStreamChunk {
+  points_array             points = {};
+  py::array_t<float>       values = {};
+  std::shared_future<void> future = {};
+};
+
+// Values at a stream of points, evaluated in chunks in bounded memory.
+// Points come from an array of shape (N, 3), e.g. a memory-mapped .npy
+// file, read `chunk` rows at a time, or from an iterable of such arrays,
+// e.g. a generator, taken as they come. Chunks are double buffered: while
+// the caller reads the values of a chunk, the next one is evaluated on the
+// pool without the GIL. Values are new arrays, or views of `out`, written
+// in order, e.g. to a memory-mapped output.
+struct CsgEvalStream {
+  py::object     compiled = {};  // of CsgCompiled, kept alive
+  py::object     source   = {};  // array or iterator
+  bool           rows     = false;
+  py::ssize_t    chunk    = 0;
+  py::ssize_t    read     = 0;  // rows of the array taken
+  py::object     out      = {};
+  py::ssize_t    written  = 0;  // values of out taken
+  CsgStreamChunk pending  = {};
+
+  ~CsgEvalStream() {
+    if (!pending.future.valid()) return;
+    py::gil_scoped_release release;
+    pending.future.wait();
+  }
+};
+
+// Takes the next points of the stream and starts evaluating them, or
+// leaves nothing pending at their end.
+void start_chunk(CsgEvalStream& stream) {
+  auto item = py::object{};
+  if (stream.rows) {
+    auto size = (py::ssize_t)py::len(stream.source);
+    if (stream.read >= size) return;
+    auto end    = std::min(stream.read + stream.chunk, size);
+    item        = stream.source[py::slice(stream.read, end, 1)];
+    stream.read = end;
+  } else {
+    auto next = PyIter_Next(stream.source.ptr());
+    if (!next) {
+      if (PyErr_Occurred()) throw py::error_already_set();
+      return;
+    }
+    item = py::reinterpret_steal<py::object>(next);
+  }
+  auto points = points_array::ensure(item);
+  if (!points) throw std::invalid_argument{"points should be float arrays"};
+  auto positions = array_points(points);
+  if (positions.size() > (size_t)std::numeric_limits<int>::max())
+    throw std::invalid_argument{"chunks of points are too large"};
+  auto num    = (py::ssize_t)positions.size();
+  auto values = py::array_t<float>{};
+  if (stream.out.is_none()) {
+    values = py::array_t<float>(num);
+  } else {
+    auto out = py::reinterpret_borrow<py::array_t<float>>(stream.out);
+    if (stream.written + num > out.size())
+      throw std::invalid_argument{"out is smaller than the points"};
+    values = py::array_t<float>(
+        {num}, {(py::ssize_t)sizeof(float)},
+        out.mutable_data() + stream.written, out);
+    stream.written += num;
+  }
+  auto& compiled = stream.compiled.cast<const CsgCompiled&>();
+  auto  data     = values.mutable_data();
+  stream.pending.points = points;
+  stream.pending.values = values;
+  stream.pending.future = async_task([&compiled, positions, data]() {
+    eval_compiled_points(
+        compiled, positions.data(), data, (int)positions.size());
+  }).share();
+}
+
+// Values of the next chunk, once the one after it is started.
+py::array_t<float> next_chunk(CsgEvalStream& stream) {
+  if (!stream.pending.future.valid()) throw py::stop_iteration();
+  auto chunk     = std::move(stream.pending);
+  stream.pending = {};
+  try {
+    start_chunk(stream);
+  } catch (...) {
+    {
+      py::gil_scoped_release release;
+      chunk.future.wait();
+    }
+    throw;
+  }
+  {
+    py::gil_scoped_release release;
+    chunk.future.get();
+  }
+  return chunk.values;
+}
+
+// Stream of the points of `source`, or of the arrays in a .npy file if it
+// is a filename, memory-mapped. `out` should be a contiguous float32 array.
+std::unique_ptr<CsgEvalStream> eval_stream(py::object compiled,
+    py::object source, py::ssize_t chunk, py::object out) {
+  if (chunk <= 0) throw std::invalid_argument{"chunk should be positive"};
+  if (!out.is_none() &&
+      !py::isinstance<py::array_t<float, py::array::c_style>>(out))
+    throw std::invalid_argument{"out should be a contiguous float32 array"};
+  if (py::isinstance<py::str>(source))
+    source = py::module::import("numpy").attr("load")(
+        source, py::arg("mmap_mode") = "r");
+  auto stream      = std::make_unique<CsgEvalStream>();
+  stream->compiled = compiled;
+  stream->rows     = py::isinstance<py::array>(source);
+  stream->source   = stream->rows ? source : py::iter(source);
+  stream->chunk    = chunk;
+  stream->out      = out;
+  start_chunk(*stream);
+  return stream;
+}
+
+// Writes the values at the points of `source` to `out`, as eval_stream, and
+// returns it.
+py::object eval_stream_to(py::object compiled, py::object source,
+    py::object out, py::ssize_t chunk) {
+  if (out.is_none()) throw std::invalid_argument{"out should be given"};
+  auto stream = eval_stream(compiled, source, chunk, out);
+  while (stream->pending.future.valid()) next_chunk(*stream);
+  return out;
+}
+
+}  // namespace
+
+// DLPack tensor taken from a capsule, e.g. of torch.utils.dlpack, or from
+// an object with __dlpack__. Capsules are marked as used, so the tensor is
+// released by the deleter here once it is no longer read.
+struct CsgDLDeleter {
+  void operator()(DLManagedTensor* managed) const {
+    if (managed->deleter) managed->deleter(managed);
+  }
+};
+using dlpack_handle = std::unique_ptr<DLManagedTensor, CsgDLDeleter>;
+
+dlpack_handle consume_dlpack(py::object tensor) {
+  if (py::hasattr(tensor, "__dlpack__")) tensor = tensor.attr("__dlpack__")();
+  if (!PyCapsule_IsValid(tensor.ptr(), "dltensor"))
+    throw std::invalid_argument{"points should be an unused DLPack tensor"};
+  auto managed = (DLManagedTensor*)PyCapsule_GetPointer(
+      tensor.ptr(), "dltensor");
+  PyCapsule_SetName(tensor.ptr(), "used_dltensor");
+  return dlpack_handle{managed};
+}
+
+// Points of a DLPack tensor of shape (N, 3), read in place. Only float32
+// tensors in host memory with contiguous rows are supported, since the tape
+// evaluates points there, see pycsg_torch.py for the others.
+span<const vec3f> dlpack_points(const DLManagedTensor& managed) {
+  auto& tensor = managed.dl_tensor;
+  if (tensor.device.device_type != kDLCPU)
+    throw std::invalid_argument{"points should be in host memory"};
+  if (tensor.dtype.code != kDLFloat || tensor.dtype.bits != 32 ||
+      tensor.dtype.lanes != 1)
+    throw std::invalid_argument{"points should be float32"};
+  if (tensor.ndim != 2 || tensor.shape[1] != 3)
+    throw std::invalid_argument{"points should have shape (N, 3)"};
+  if (tensor.strides && tensor.shape[0] > 1 &&
+      (tensor.strides[0] != 3 || tensor.strides[1] != 1))
+    throw std::invalid_argument{"points should be contiguous"};
+  auto data = (const char*)tensor.data + tensor.byte_offset;
+  return {(const vec3f*)data, (size_t)tensor.shape[0]};
+}
+
+// Float32 tensor owning its values, given out as a DLPack capsule, which
+// frees it unless a consumer took it.
+struct CsgDLTensor {
+  vector<float>   values  = {};
+  vector<int64_t> shape   = {};
+  DLManagedTensor managed = {};
+};
+
+py::capsule dlpack_tensor(vector<float>&& values, vector<int64_t> shape) {
+  auto  tensor = new CsgDLTensor{std::move(values), std::move(shape), {}};
+  auto& dl     = tensor->managed.dl_tensor;
+  dl.data      = tensor->values.data();
+  dl.ndim      = (int32_t)tensor->shape.size();
+  dl.shape     = tensor->shape.data();
+  tensor->managed.manager_ctx = tensor;
+  tensor->managed.deleter     = [](DLManagedTensor* self) {
+    delete (CsgDLTensor*)self->manager_ctx;
+  };
+  return py::capsule(&tensor->managed, "dltensor", [](PyObject* capsule) {
+    if (!PyCapsule_IsValid(capsule, "dltensor")) return;
+    auto managed = (DLManagedTensor*)PyCapsule_GetPointer(
+        capsule, "dltensor");
+    managed->deleter(managed);
+  });
+}
+
+// Values at the points of a DLPack tensor of shape (N, 3), as a tensor of
+// shape (N,), without copying the points.
+py::capsule eval_compiled_dlpack(
+    const CsgCompiled& compiled, py::object points) {
+  auto tensor    = consume_dlpack(points);
+  auto positions = dlpack_points(*tensor);
+  auto values    = vector<float>(positions.size());
+  {
+    py::gil_scoped_release release;
+    eval_compiled_points(
+        compiled, positions.data(), values.data(), (int)positions.size());
+  }
+  return dlpack_tensor(std::move(values), {(int64_t)positions.size()});
+}
+
+// Returns (values, gradients) as tensors of shapes (N,) and (N, 3).
+py::tuple eval_compiled_dlpack_grad(
+    const CsgCompiled& compiled, py::object points) {
+  auto tensor    = consume_dlpack(points);
+  auto positions = dlpack_points(*tensor);
+  auto size      = positions.size();
+  auto values    = vector<float>(size);
+  auto grads     = vector<float>(size * 3);
+  auto options   = CsgBatchOptions{};
+  options.parallel = size > options.block_size;
+  {
+    py::gil_scoped_release release;
+    eval_csg_batch_grad(compiled.tape, positions, {values.data(), size},
+        {(vec3f*)grads.data(), size}, options);
+  }
+  return py::make_tuple(dlpack_tensor(std::move(values), {(int64_t)size}),
+      dlpack_tensor(std::move(grads), {(int64_t)size, 3}));
+}
+
+// Values at the points, evaluated on the GPU without a window, see gpu.h.
+vector<float> eval_batch_gpu(
+    const CsgTree& csg, const vector<array<float, 3>>& points) {
+  auto positions = vector<vec3f>(points.size());
+  for (auto i = 0; i < points.size(); i++)
+    positions[i] = {points[i][0], points[i][1], points[i][2]};
+  auto  values = vector<float>(points.size());
+  auto& gpu    = get_gpu();
+  if (!eval_csg_batch_gpu(gpu, csg, positions, values))
+    throw std::runtime_error{gpu.error};
+  return values;
+}
+
+// Backends of the tree timed by tune_csg, with the GPU if it is available.
+// The tapes are owned by the caller.
+vector<CsgBackend> tune_backends(const CsgTree& csg, const CsgTape& tape,
+    const CsgTape& exact, const CsgJit& jit) {
+  auto backends = cpu_backends(csg, tape, jit);
+  if (is_valid(get_gpu()))
+    backends.push_back({"gpu", [&exact](auto points, auto out) {
+      if (!eval_csg_batch_gpu(get_gpu(), exact, points, out))
+        for (auto i = (size_t)0; i < out.size(); i++) out[i] = flt_max;
+    }});
+  return backends;
+}
+
+// Returns the backend picked for each consumer, and the ns per point of
+// each backend.
+py::dict tune(const CsgTree& csg, double budget) {
+  auto params   = CsgTuneParams{};
+  params.budget = budget;
+  auto tape     = compile_csg(csg);
+  auto exact    = compile_csg(csg, flt_max);
+  auto jit      = compile_jit(tape);
+  auto tuning   = tune_csg(csg, tune_backends(csg, tape, exact, jit), params);
+  auto result   = py::dict{};
+  auto timings  = py::dict{};
+  for (auto consumer = 0; consumer < 3; consumer++)
+    result[csg_consumer_names[consumer].c_str()] = tuning.choices[consumer];
+  for (auto& timing : tuning.timings) timings[timing.name.c_str()] = timing.ns;
+  result["timings"] = timings;
+  result["cached"]  = tuning.cached;
+  return result;
+}
+
+// Values at the points of an array of shape (N, 3), evaluated by the
+// backend picked for batch queries, see tune_csg.
+py::array_t<float> eval_tuned(const CsgTree& csg, const points_array& points) {
+  auto positions = array_points(points);
+  auto values    = py::array_t<float>((py::ssize_t)positions.size());
+  auto out       = span<float>{values.mutable_data(), positions.size()};
+  {
+    py::gil_scoped_release release;
+    auto tape     = compile_csg(csg);
+    auto exact    = compile_csg(csg, flt_max);
+    auto jit      = compile_jit(tape);
+    auto backends = tune_backends(csg, tape, exact, jit);
+    auto backend  = choice(tune_csg(csg, backends), csg_consumer::batch);
+    auto found    = false;
+    for (auto& candidate : backends) {
+      if (candidate.name != backend) continue;
+      candidate.eval(positions, out);
+      found = true;
+    }
+    if (!found) eval_csg_batch(exact, positions, out);
+  }
+  return values;
+}
+
+// Renders the tree from the initial camera of the viewer on the GPU, without
+// a window, and saves the image.
+void render_gpu(const CsgTree& csg, const string& filename, int resolution,
+    int samples) {
+  auto camera       = init_camera();
+  auto params       = trace_params{};
+  params.resolution = resolution;
+  auto march  = frame_march(march_params{}, csg, camera, params, false);
+  auto render = image<vec4f>{};
+  auto& gpu   = get_gpu();
+  if (!render_csg_gpu(gpu, compile_csg(csg), camera,
+          camera_size(camera, resolution), samples,
+          {march.bounds, march.relaxation, march.footprint, params.clamp},
+          render))
+    throw std::runtime_error{gpu.error};
+  save_image(filename, render);
+}
+
+// Camera at `eye` looking at `target`, with the lens of the viewer.
+trace_camera look_at(const array<float, 3>& eye, const array<float, 3>& target,
+    const array<float, 3>& up) {
+  auto camera  = init_camera();
+  auto from    = vec3f{eye[0], eye[1], eye[2]};
+  auto to      = vec3f{target[0], target[1], target[2]};
+  camera.frame = lookat_frame(from, to, {up[0], up[1], up[2]});
+  camera.focus = length(from - to);
+  return camera;
+}
+
+// Image of the tree from the camera, marched on the CPU as csg_render does.
+image<vec4f> render_csg(const CsgTree& csg, const trace_camera& camera,
+    int resolution, int samples) {
+  auto params       = trace_params{};
+  params.resolution = resolution;
+  params.samples    = samples;
+  auto tape         = compile_csg(csg);
+  auto jit          = compile_jit(tape);
+  auto march = frame_march(march_params{}, csg, camera, params, false);
+  return raymarch_image(camera, tape, jit, nullptr, march, params);
+}
+
+// Array of shape (H, W, 4) with the pixels of the image.
+py::array_t<float> image_array(const image<vec4f>& render) {
+  auto size  = render.size();
+  auto array = py::array_t<float>(vector<py::ssize_t>{size.y, size.x, 4});
+  memcpy(array.mutable_data(), render.data(), sizeof(vec4f) * render.count());
+  return array;
+}
+
+py::array_t<float> render_image(const CsgTree& csg,
+    const trace_camera& camera, int resolution, int samples) {
+  auto render = image<vec4f>{};
+  {
+    py::gil_scoped_release release;
+    render = render_csg(csg, camera, resolution, samples);
+  }
+  return image_array(render);
+}
+
+// Image of the tree with the passes named in `passes`, see march_aov_names,
+// as a dictionary of arrays by name, with the image as "image". Normals are
+// of shape (H, W, 3), the other passes (H, W).
+py::dict render_aovs(const CsgTree& csg, const trace_camera& camera,
+    int resolution, int samples, const vector<string>& passes) {
+  auto params       = trace_params{};
+  params.resolution = resolution;
+  params.samples    = samples;
+  auto aovs         = march_aovs{};
+  auto error        = string{};
+  if (!init_aovs(aovs, camera_size(camera, resolution), passes, error))
+    throw std::invalid_argument{error};
+  auto render = image<vec4f>{};
+  {
+    py::gil_scoped_release release;
+    auto tape  = compile_csg(csg);
+    auto jit   = compile_jit(tape);
+    auto march = frame_march(march_params{}, csg, camera, params, false);
+    render = raymarch_image(
+        camera, tape, jit, nullptr, march, params, nullptr, nullptr, &aovs);
+  }
+  auto size   = render.size();
+  auto result = py::dict{};
+  auto add    = [&](const char* name, const image<float>& pass) {
+    if (pass.empty()) return;
+    auto array = py::array_t<float>(vector<py::ssize_t>{size.y, size.x});
+    memcpy(array.mutable_data(), pass.data(), sizeof(float) * pass.count());
+    result[name] = array;
+  };
+  result["image"] = image_array(render);
+  add("depth", aovs.depth);
+  add("id", aovs.node);
+  add("steps", aovs.steps);
+  if (!aovs.normal.empty()) {
+    auto array = py::array_t<float>(vector<py::ssize_t>{size.y, size.x, 3});
+    memcpy(array.mutable_data(), aovs.normal.data(),
+        sizeof(vec3f) * aovs.normal.count());
+    result["normal"] = array;
+  }
+  return result;
+}
+
+// Images of the tree from the cameras, compiled once and rendered together,
+// see raymarch_images.
+vector<py::array_t<float>> render_images(const CsgTree& csg,
+    const vector<trace_camera>& cameras, int resolution, int samples) {
+  auto renders = vector<image<vec4f>>{};
+  {
+    py::gil_scoped_release release;
+    auto params       = trace_params{};
+    params.resolution = resolution;
+    params.samples    = samples;
+    auto tape         = compile_csg(csg);
+    auto jit          = compile_jit(tape);
+    auto marches      = vector<march_params>{};
+    for (auto& camera : cameras)
+      marches.push_back(
+          frame_march(march_params{}, csg, camera, params, false));
+    renders = raymarch_images(cameras, tape, jit, nullptr, marches, params);
+  }
+  auto arrays = vector<py::array_t<float>>{};
+  for (auto& render : renders) arrays.push_back(image_array(render));
+  return arrays;
+}
+
+// Render running on the thread pool, see render_image_async. Waiting for
+// the result releases the GIL, so other Python threads go on meanwhile.
+struct CsgRenderFuture {
+  std::shared_future<void> future = {};
+  shared_ptr<image<vec4f>> render = {};
+
+  bool done() const { return future.wait_for(0s) == std::future_status::ready; }
+  py::array_t<float> result() const {
+    {
+      py::gil_scoped_release release;
+      future.get();
+    }
+    return image_array(*render);
+  }
+};
+
+// Starts rendering a copy of the tree and returns at once.
+CsgRenderFuture render_image_async(const CsgTree& csg,
+    const trace_camera& camera, int resolution, int samples) {
+  auto result   = CsgRenderFuture{};
+  result.render = make_shared<image<vec4f>>();
+  result.future = async_task(
+      [csg, camera, resolution, samples, render = result.render]() {
+        *render = render_csg(csg, camera, resolution, samples);
+      },
+      csg_priority::background);
+  return result;
+}
+
+// Progressive render of a copy of the tree for notebooks, see session.h and
+// pycsg_widget.py. The session is closed when it is collected.
+shared_ptr<CsgSession> make_session(
+    const CsgTree& csg, int resolution, int samples, int quality) {
+  auto session = shared_ptr<CsgSession>(new CsgSession{}, [](auto session) {
+    close_session(*session);
+    delete session;
+  });
+  auto params       = trace_params{};
+  params.resolution = resolution;
+  params.samples    = samples;
+  session->quality  = yocto::clamp(quality, 1, 100);
+  start_session(*session, csg, params);
+  return session;
+}
+
+// Tiles of the latest view as dicts with the view, the first pixel, the size
+// and samples, whether they are done and their JPEG bytes.
+py::list poll_tiles(CsgSession& session, double timeout) {
+  auto tiles = vector<CsgSessionTile>{};
+  {
+    py::gil_scoped_release release;
+    tiles = poll_session(session, timeout);
+  }
+  auto result = py::list{};
+  for (auto& tile : tiles) {
+    auto item       = py::dict{};
+    item["view"]    = tile.view;
+    item["x"]       = tile.min.x;
+    item["y"]       = tile.min.y;
+    item["width"]   = tile.size.x;
+    item["height"]  = tile.size.y;
+    item["samples"] = tile.samples;
+    item["done"]    = tile.done;
+    item["jpeg"]    = py::bytes(
+        (const char*)tile.jpeg.data(), tile.jpeg.size());
+    result.append(item);
+  }
+  return result;
+}
+
+// Narrow-band grid over the box from `min` to `max`.
+CsgSparseGrid bake_sparse(const CsgTree& csg, const array<float, 3>& min,
+    const array<float, 3>& max, int resolution) {
+  auto bounds = bbox3f{{min[0], min[1], min[2]}, {max[0], max[1], max[2]}};
+  return bake_csg_sparse(csg, bounds, resolution);
+}
+
+vector<float> eval_sparse_batch(
+    const CsgSparseGrid& grid, const vector<array<float, 3>>& points) {
+  auto values = vector<float>(points.size());
+  for (auto i = 0; i < points.size(); i++)
+    values[i] = eval_sparse(grid, {points[i][0], points[i][1], points[i][2]});
+  return values;
+}
+
+// Bytes held by the tree, its tape and the grid cache, by name, see
+// memory.h.
+std::map<string, size_t> tree_memory(const CsgTree& csg) {
+  auto memory = std::map<string, size_t>{};
+  for (auto& [name, bytes] : memory_usage(csg, compile_csg(csg)))
+    memory[name] = bytes;
+  return memory;
+}
+
+// Budget of the grid cache, in MB.
+void set_grid_cache_budget(double megabytes) {
+  set_cache_budget(get_grid_cache(), (size_t)(megabytes * (1 << 20)));
+}
+
+// Limits of the calls of this thread from now on, as a job of their own,
+// see CsgJob: threads of their loops, MB of their renders and cached grids,
+// and seconds after which renders stop refining. Zeros remove the limits.
+void set_job_limits(int threads, double megabytes, double seconds) {
+  if (threads < 0 || megabytes < 0 || seconds < 0)
+    throw std::invalid_argument{"limits must not be negative"};
+  auto bytes = (size_t)(megabytes * (1 << 20));
+  pool_job() = threads || bytes || seconds
+                   ? make_job(threads, bytes, seconds)
+                   : nullptr;
+}
+
+// Bytes of the tree as a .csgb file, for pickle and for shared memory.
+py::bytes csg_bytes(const CsgTree& csg) {
+  auto data = vector<uint8_t>{};
+  if (!encode_csgb(csg, data))
+    throw std::invalid_argument{
+        "trees with instances or meshes cannot be encoded"};
+  return py::bytes((const char*)data.data(), data.size());
+}
+
+// Tree of bytes from csg_bytes in any buffer, e.g. the one of a
+// SharedMemory, which is copied once.
+CsgTree csg_from_buffer(const py::buffer& buffer) {
+  auto info = buffer.request();
+  auto csg  = CsgTree{};
+  if (!decode_csgb(info.ptr, info.size * info.itemsize, csg))
+    throw std::invalid_argument{"the buffer does not hold a tree"};
+  return csg;
+}
+
+// Writable view of a parameter of all the nodes, of shape (N,) or with
+// `count` parameters (N, count), strided over the nodes without copies. The
+// view keeps the tree alive, and is valid until nodes are added. Operations
+// store blend and softness where primitives store their first parameters.
+py::array_t<float> node_params(py::object self, size_t offset, int count) {
+  auto& csg  = self.cast<CsgTree&>();
+  auto  data = (float*)((char*)csg.nodes.data() + offset);
+  auto  size = (py::ssize_t)csg.nodes.size();
+  auto  node = (py::ssize_t)sizeof(CsgNode);
+  if (count == 0) return py::array_t<float>({size}, {node}, data, self);
+  return py::array_t<float>({size, (py::ssize_t)count},
+      {node, (py::ssize_t)sizeof(float)}, data, self);
+}
+
+// Primitive by the name of the .csg syntax, with its parameters.
+CsgPrimitve make_primitive(const string& type, const float* params, int num) {
+  auto primitive = CsgPrimitve{};
+  auto found     = false;
+  for_each_primitive([&](auto kind) {
+    if (type != decltype(kind)::name) return;
+    primitive.type = decltype(kind)::type;
+    found          = true;
+  });
+  if (!found) throw std::invalid_argument{"unknown primitive: " + type};
+  auto count = primitive_params(primitive.type);
+  if (num != count)
+    throw std::invalid_argument{
+        type + " takes " + std::to_string(count) + " parameters"};
+  for (auto k = 0; k < 16; k++) primitive.params[k] = k < num ? params[k] : 0;
+  return primitive;
+}
+
+// Edits append nodes after their children, as the parser does, so the last
+// node is the root. Bounds and hashes are computed by commit() once the tree
+// is done.
+int add_primitive_node(
+    CsgTree& csg, const string& type, const vector<float>& params) {
+  auto node = add_primitive(
+      csg, make_primitive(type, params.data(), (int)params.size()));
+  csg.root  = node;
+  return node;
+}
+
+int add_operation_node(
+    CsgTree& csg, float blend, float softness, int first, int second) {
+  auto size = (int)csg.nodes.size();
+  if (first < 0 || first >= size || second < 0 || second >= size)
+    throw std::invalid_argument{"children should be nodes of the tree"};
+  auto node = add_operation(csg, {blend, softness}, {first, second});
+  csg.root  = node;
+  return node;
+}
+
+// Indices of `num` nodes from `first`.
+py::array_t<int> node_range(int first, int num) {
+  auto indices = py::array_t<int>((py::ssize_t)num);
+  auto data    = indices.mutable_data();
+  for (auto k = 0; k < num; k++) data[k] = first + k;
+  return indices;
+}
+
+// Appends a primitive for each row of an array of shape (N, 4), e.g.
+// x y z radius for spheres. Returns their indices.
+py::array_t<int> add_primitive_nodes(CsgTree& csg, const string& type,
+    const py::array_t<float, py::array::c_style | py::array::forcecast>&
+        params) {
+  if (params.ndim() != 2)
+    throw std::invalid_argument{"params should have shape (N, 4)"};
+  auto num   = (int)params.shape(0);
+  auto width = (int)params.shape(1);
+  auto first = (int)csg.nodes.size();
+  auto data  = params.data();
+  csg.nodes.reserve(first + num);
+  for (auto k = 0; k < num; k++)
+    add_primitive(csg, make_primitive(type, data + k * width, width));
+  if (num > 0) csg.root = first + num - 1;
+  return node_range(first, num);
+}
+
+// Appends an operation for each row of `children`, of shape (M, 2), with
+// the blend and softness of the rows of `operations`, of shape (M, 2).
+// Children are nodes before the operation, which may have been added by the
+// same call. Returns their indices.
+py::array_t<int> add_operation_nodes(CsgTree& csg,
+    const py::array_t<int, py::array::c_style | py::array::forcecast>&
+        children,
+    const py::array_t<float, py::array::c_style | py::array::forcecast>&
+        operations) {
+  if (children.ndim() != 2 || children.shape(1) != 2 ||
+      operations.ndim() != 2 || operations.shape(1) != 2 ||
+      children.shape(0) != operations.shape(0))
+    throw std::invalid_argument{
+        "children and operations should have shape (M, 2)"};
+  auto num   = (int)children.shape(0);
+  auto first = (int)csg.nodes.size();
+  auto pairs = children.data();
+  auto ops   = operations.data();
+  csg.nodes.reserve(first + num);
+  for (auto k = 0; k < num; k++) {
+    auto node = first + k;
+    auto a = pairs[k * 2 + 0], b = pairs[k * 2 + 1];
+    if (a < 0 || a >= node || b < 0 || b >= node) {
+      csg.nodes.resize(first);
+      throw std::invalid_argument{
+          "children should be nodes before their operation"};
+    }
+    add_operation(csg, {ops[k * 2 + 0], ops[k * 2 + 1]}, {a, b});
+  }
+  if (num > 0) csg.root = first + num - 1;
+  return node_range(first, num);
+}
+
+// Spheres fitted to a mesh of positions and triangles, of shapes (N, 3) and
+// (M, 3), or to a point cloud with normals if there are no triangles, see
+// spheres.h.
+CsgTree fit_spheres_mesh(const points_array& positions,
+    const py::array_t<int, py::array::c_style | py::array::forcecast>&
+        triangles,
+    std::optional<points_array> normals, const CsgSphereFit& params) {
+  auto points = array_points(positions);
+  if (triangles.size() && (triangles.ndim() != 2 || triangles.shape(1) != 3))
+    throw std::invalid_argument{"triangles should have shape (M, 3)"};
+  auto indices = (const vec3i*)triangles.data();
+  auto mesh    = vector<vec3i>(indices, indices + triangles.size() / 3);
+  for (auto& triangle : mesh)
+    if (min(triangle) < 0 || max(triangle) >= points.size())
+      throw std::invalid_argument{"triangles should index the positions"};
+  auto vertices = vector<vec3f>(points.data(), points.data() + points.size());
+  auto given    = normals ? array_points(*normals) : span<const vec3f>{};
+  auto outward  = vector<vec3f>(given.data(), given.data() + given.size());
+  py::gil_scoped_release release;
+  return fit_spheres(vertices, mesh, outward, params);
+}
+
+#ifdef PYCSG_VIEWER
+void render(const CsgTree& csg) { run_viewer(csg); }
+#endif
+
 string print(const CsgTree& a) {
   string result = "";
   for (int i = 0; i < a.nodes.size(); i++) {
     auto& node = a.nodes[i];
     if (node.children == vec2i{-1, -1}) {
       for (int k = 0; k < 4; k++) {
-        result += std::to_string(node.primitive.params[i]) + " ";
+        result += std::to_string(node.primitive.params[k]) + " ";
       }
     } else {
       result += "[" + std::to_string(node.children.x) + " " +
@@ -34,14 +1194,203 @@ string print(const CsgTree& a) {
   return result;
 }
 
-namespace py = pybind11;
-
 PYBIND11_MODULE(pycsg, m) {
   m.doc() = "pybind11 csg plugin";
 
   m.def("eval", &eval);
-  m.def("load_csg", &load_csg);
-  m.def("render", &render);
+  m.def("eval", &eval_compiled);
+  m.def("eval", &eval_point);
+  m.def("eval_batch", &eval_batch);
+  m.def("eval_many", &eval_many, py::arg("csg"), py::arg("points"));
+  m.def("eval_many_grad", &eval_many_grad, py::arg("csg"), py::arg("points"));
+  m.def("eval_many_labels", &eval_many_labels, py::arg("csg"),
+      py::arg("points"));
+  m.def("overlap", &overlap_trees, py::arg("a"), py::arg("b"),
+      py::arg("levels") = 8, py::arg("depth") = false);
+  m.def("mass_properties", &mass_properties, py::arg("csg"),
+      py::arg("levels") = 7, py::arg("samples") = 2);
+  m.def("closest_points", &closest_points_many, py::arg("csg"),
+      py::arg("points"));
+  m.def("intersect_rays", &intersect_rays_many, py::arg("csg"),
+      py::arg("origins"), py::arg("directions"));
+  m.def("eval_trees", &eval_trees, py::arg("trees"), py::arg("points"));
+  m.def("sample", &::sample_points, py::arg("csg"), py::arg("num"),
+      py::arg("mode") = "near", py::arg("resolution") = 128,
+      py::arg("seed") = 7, py::arg("bounds") = vector<array<float, 3>>{});
+  m.def("eval_batch_gpu", &eval_batch_gpu);
+  m.def("tune", &tune, py::arg("csg"), py::arg("budget") = 0.25);
+  m.def("eval_tuned", &eval_tuned, py::arg("csg"), py::arg("points"));
+  m.def("eval_grad", &eval_grad);
+  m.def("eval_params_grad", &eval_params_grad);
+  m.def("compile_csg", &compile_tape, py::arg("csg"),
+      py::arg("margin") = 0.0f, py::arg("prune") = false);
+  m.def("load_csg", [](const string& filename) { return load_csg(filename); });
+  m.def("save_tree_dot", &save_tree_dot);
+  m.def("save_tree_png", &save_tree_png);
+  m.def("save_csgb", &save_csgb);
+  m.def("add_primitive", &add_primitive_node, py::arg("csg"),
+      py::arg("type"), py::arg("params"));
+  m.def("add_operation", &add_operation_node, py::arg("csg"),
+      py::arg("blend"), py::arg("softness"), py::arg("first"),
+      py::arg("second"));
+  m.def("add_primitives", &add_primitive_nodes, py::arg("csg"),
+      py::arg("type"), py::arg("params"));
+  m.def("add_operations", &add_operation_nodes, py::arg("csg"),
+      py::arg("children"), py::arg("operations"));
+  m.def("group_csg", &group_csg, py::arg("csg"), py::arg("min_size") = 64);
+  m.def(
+      "fit_spheres",
+      [](const string& filename, float error, int resolution, int max_spheres,
+          bool group) {
+        py::gil_scoped_release release;
+        return fit_shape_spheres(
+            filename, {error, resolution, max_spheres, group});
+      },
+      py::arg("filename"), py::arg("error") = 0.01f,
+      py::arg("resolution") = 128, py::arg("max_spheres") = 0,
+      py::arg("group") = true);
+  m.def(
+      "fit_spheres",
+      [](const points_array& positions,
+          const py::array_t<int, py::array::c_style | py::array::forcecast>&
+              triangles,
+          std::optional<points_array> normals, float error, int resolution,
+          int max_spheres, bool group) {
+        return fit_spheres_mesh(positions, triangles, normals,
+            {error, resolution, max_spheres, group});
+      },
+      py::arg("positions"), py::arg("triangles"),
+      py::arg("normals") = py::none(), py::arg("error") = 0.01f,
+      py::arg("resolution") = 128, py::arg("max_spheres") = 0,
+      py::arg("group") = true);
+  m.def("bake_sparse", &bake_sparse);
+  m.def("eval_sparse", &eval_sparse_batch);
+  m.def("memory_usage", &tree_memory, py::arg("csg"));
+  m.def("sparse_memory",
+      [](const CsgSparseGrid& grid) { return memory_bytes(grid); });
+  m.def("set_cache_budget", &set_grid_cache_budget, py::arg("megabytes"));
+  m.def("set_limits", &set_job_limits, py::arg("threads") = 0,
+      py::arg("megabytes") = 0, py::arg("seconds") = 0);
+#ifdef PYCSG_VIEWER
+  m.def("render", &render, py::call_guard<py::gil_scoped_release>());
+#endif
+  m.def("look_at", &look_at, py::arg("eye"), py::arg("target"),
+      py::arg("up") = array<float, 3>{0, 1, 0});
+  m.def("render_image", &render_image, py::arg("csg"),
+      py::arg("camera") = init_camera(), py::arg("resolution") = 720,
+      py::arg("samples") = 16);
+  m.def("render_aovs", &render_aovs, py::arg("csg"),
+      py::arg("camera") = init_camera(), py::arg("resolution") = 720,
+      py::arg("samples") = 16, py::arg("passes") = march_aov_names);
+  m.def("turntable_cameras", &turntable_cameras, py::arg("frames"));
+  m.def("render_images", &render_images, py::arg("csg"), py::arg("cameras"),
+      py::arg("resolution") = 720, py::arg("samples") = 16);
+  m.def("render_image_async", &render_image_async, py::arg("csg"),
+      py::arg("camera") = init_camera(), py::arg("resolution") = 720,
+      py::arg("samples") = 16);
+  m.def("render_gpu", &render_gpu, py::arg("csg"), py::arg("filename"),
+      py::arg("resolution") = 720, py::arg("samples") = 16);
 
-  py::class_<CsgTree>(m, "CsgTree").def(py::init<>()).def("__repr__", &print);
+  py::class_<CsgTree>(m, "CsgTree")
+      .def(py::init<>())
+      .def("__repr__", &print)
+      .def_property_readonly("params",
+          [](py::object self) {
+            return node_params(self, offsetof(CsgNode, primitive.params), 16);
+          })
+      .def_property_readonly("blend",
+          [](py::object self) {
+            return node_params(self, offsetof(CsgNode, operation.blend), 0);
+          })
+      .def_property_readonly("softness",
+          [](py::object self) {
+            return node_params(self, offsetof(CsgNode, operation.softness), 0);
+          })
+      .def_readwrite("root", &CsgTree::root)
+      .def("__len__", [](const CsgTree& csg) { return csg.nodes.size(); })
+      .def("commit",
+          [](CsgTree& csg) {
+            update_bounds(csg);
+            update_hashes(csg);
+          })
+      .def_property_readonly("hash", &root_hash)
+      .def("to_bytes", &csg_bytes)
+      .def_static("from_buffer", &csg_from_buffer, py::arg("buffer"))
+      .def(py::pickle(&csg_bytes,
+          [](const py::bytes& data) { return csg_from_buffer(data); }));
+  py::class_<CsgTape>(m, "CsgTape").def(py::init<>());
+  py::class_<CsgSparseGrid>(m, "CsgSparseGrid");
+  py::class_<CsgCompiled>(m, "CompiledCsg")
+      .def(py::init(&make_compiled), py::arg("csg"),
+          py::arg("margin") = 0.0f)
+      .def("__call__", &eval_compiled_many, py::arg("points"))
+      .def("__call__", &eval_point)
+      .def("grad", &eval_compiled_many_grad, py::arg("points"))
+      .def("stream", &eval_stream, py::arg("source"),
+          py::arg("chunk") = 1 << 20, py::arg("out") = py::none())
+      .def("stream_to", &eval_stream_to, py::arg("source"), py::arg("out"),
+          py::arg("chunk") = 1 << 20)
+      .def("eval_dlpack", &eval_compiled_dlpack, py::arg("points"))
+      .def("grad_dlpack", &eval_compiled_dlpack_grad, py::arg("points"))
+      .def("update", &update_compiled, py::arg("csg"))
+      .def(py::pickle(
+          [](const CsgCompiled& compiled) {
+            return py::make_tuple(csg_bytes(*compiled.tree), compiled.margin);
+          },
+          [](const py::tuple& state) {
+            return make_compiled(csg_from_buffer(state[0].cast<py::buffer>()),
+                state[1].cast<float>());
+          }))
+      .def_property_readonly(
+          "tape", [](const CsgCompiled& compiled) { return compiled.tape; });
+  py::class_<CsgQueryClient>(m, "QueryClient")
+      .def(py::init<const string&>(), py::arg("name"))
+      .def("__call__", &eval_query, py::arg("points"))
+      .def_property_readonly("slot_points", [](const CsgQueryClient& client) {
+        return client.region.slot_points;
+      });
+  py::class_<CsgFit>(m, "Fitter")
+      .def(py::init([](const CsgTree& csg, int batch, float rate,
+                        bool operations, uint64_t seed) {
+        auto params       = CsgFitParams{};
+        params.batch      = batch;
+        params.rate       = rate;
+        params.operations = operations;
+        params.seed       = seed;
+        return make_fit(csg, params);
+      }),
+          py::arg("csg"), py::arg("batch") = 4096, py::arg("rate") = 1e-3f,
+          py::arg("operations") = false, py::arg("seed") = 7)
+      .def("step", &fit_points, py::arg("csg"), py::arg("points"),
+          py::arg("values"), py::arg("iterations") = 1)
+      .def_readonly("steps", &CsgFit::steps);
+  py::class_<trace_camera>(m, "Camera")
+      .def(py::init(&init_camera))
+      .def_readwrite("lens", &trace_camera::lens)
+      .def_readwrite("focus", &trace_camera::focus)
+      .def_readwrite("aperture", &trace_camera::aperture)
+      .def_readwrite("orthographic", &trace_camera::orthographic);
+  py::class_<CsgEvalStream>(m, "EvalStream")
+      .def("__iter__", [](py::object self) { return self; })
+      .def("__next__", &next_chunk);
+  py::class_<CsgRenderFuture>(m, "RenderFuture")
+      .def("done", &CsgRenderFuture::done)
+      .def("result", &CsgRenderFuture::result);
+  py::class_<CsgSession, shared_ptr<CsgSession>>(m, "RenderSession")
+      .def(py::init(&make_session), py::arg("csg"), py::arg("resolution") = 256,
+          py::arg("samples") = 64, py::arg("quality") = 80)
+      .def("view", &view_session, py::arg("camera"))
+      .def("poll", &poll_tiles, py::arg("timeout") = 0.05)
+      .def("close", [](CsgSession& session) {
+        py::gil_scoped_release release;
+        close_session(session);
+      })
+      .def_property_readonly("size", [](const CsgSession& session) {
+        auto size = camera_size(init_camera(), session.params.resolution);
+        return array<int, 2>{size.x, size.y};
+      });
+  py::class_<CsgGradient>(m, "CsgGradient")
+      .def_readonly("params", &CsgGradient::params)
+      .def_readonly("blend", &CsgGradient::blend)
+      .def_readonly("softness", &CsgGradient::softness);
 }
\ No newline at end of file
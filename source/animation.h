@@ -0,0 +1,255 @@
+#pragma once
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+#include "parser.h"
+#include "raymarch.h"
+
+// Parameters of a tree animated by keyframed tracks, rendered as a sequence
+// from a camera. The tape is compiled once for the whole animation, and
+// each frame only writes the parameters of the animated nodes into it, see
+// update_tape_params, so the native code of the tape and its guards are
+// kept too. Guards are made with the boxes that the animated nodes cover
+// over all their keys, and the softness the most of them; animated
+// operations are compiled as blends, which take any blend and softness of
+// their sign. Parameters move linearly between keys, so the boxes are the
+// largest at keys. Blends do not change between union and subtraction.
+//
+// Frames keep the tiles of the previous one where the tree does not change,
+// as the viewer does for edits, see dirty_pixels: rays that miss the boxes
+// of the animated nodes, see changed_regions, find the same hits. Rays are
+// clipped to the box of the root over the whole animation, so that the box
+// they march does not change either.
+//
+// Tracks are read from text files, one per line as the name of the node,
+// its parameter, that is x, y, z, radius, blend or soft, and pairs of time
+// and value, e.g. `nose radius 0 0.1 1 0.15`. Names are the variables of
+// the script, and the track animates the node that they name last. Lines
+// starting with `#` are skipped.
+
+struct CsgKey {
+  float time  = 0;
+  float value = 0;
+};
+
+struct CsgTrack {
+  int            node  = -1;
+  int            param = 0;  // see node_param
+  vector<CsgKey> keys  = {};  // by time
+};
+
+struct CsgAnimation {
+  Csg              csg          = {};  // at the time of the latest frame
+  CsgTape          tape         = {};  // of the tree at that time
+  bbox3f           bounds       = {};  // of the root over all the keys
+  vector<CsgTrack> tracks       = {};
+  vector<int>      instructions = {};  // of the node of each track
+};
+
+// Value of the track at the time, held before the first key and after the
+// last one.
+inline float eval_track(const CsgTrack& track, float time) {
+  auto& keys = track.keys;
+  if (time <= keys.front().time) return keys.front().value;
+  if (time >= keys.back().time) return keys.back().value;
+  auto next = std::upper_bound(keys.begin(), keys.end(), time,
+      [](float time, const CsgKey& key) { return time < key.time; });
+  auto& a = *(next - 1);
+  auto& b = *next;
+  return lerp(a.value, b.value, (time - a.time) / (b.time - a.time));
+}
+
+// First and last keys of the tracks.
+inline vec2f animation_range(const vector<CsgTrack>& tracks) {
+  auto range = vec2f{flt_max, -flt_max};
+  for (auto& track : tracks) {
+    range.x = yocto::min(range.x, track.keys.front().time);
+    range.y = yocto::max(range.y, track.keys.back().time);
+  }
+  return range;
+}
+
+// Tracks of a file for nodes of the tree. Throws on errors.
+inline vector<CsgTrack> load_tracks(const Csg& csg, const string& filename) {
+  auto fs = std::ifstream{filename};
+  if (!fs) throw std::runtime_error{filename + ": file not found"};
+  auto names  = vector<string>{"x", "y", "z", "radius", "blend", "soft"};
+  auto tracks = vector<CsgTrack>{};
+  auto line   = string{};
+  for (auto number = 1; std::getline(fs, line); number++) {
+    auto error = [&](const string& message) {
+      return std::runtime_error{filename + ": " + message + " at line " +
+                                std::to_string(number)};
+    };
+    auto str  = std::istringstream{line};
+    auto name = string{}, param = string{};
+    if (!(str >> name) || name[0] == '#') continue;
+    if (!(str >> param)) throw error("parameter expected");
+    auto index = csg.names ? find_name(*csg.names, name) : -1;
+    auto track = CsgTrack{};
+    for (auto n = (int)csg.nodes.size() - 1; n >= 0 && index >= 0; n--) {
+      if (csg.nodes[n].name != index) continue;
+      track.node = n;
+      break;
+    }
+    if (track.node < 0) throw error("unknown node " + name);
+    auto kind = std::find(names.begin(), names.end(), param) - names.begin();
+    auto leaf = csg.nodes[track.node].children == vec2i{-1, -1};
+    if (kind == names.size() || leaf != (kind < 4) ||
+        (leaf && get_opcode(csg.nodes[track.node]) != csg_opcode::sphere))
+      throw error("no parameter " + param + " for node " + name);
+    track.param = leaf ? (int)kind : (int)kind - 4;
+    auto key    = CsgKey{};
+    while (str >> key.time) {
+      if (!(str >> key.value)) throw error("value expected");
+      if (!track.keys.empty() && key.time <= track.keys.back().time)
+        throw error("keys out of order");
+      track.keys.push_back(key);
+    }
+    if (track.keys.empty()) throw error("keys expected");
+    tracks.push_back(track);
+  }
+  return tracks;
+}
+
+// Sets the parameters of the tree at the time.
+inline void apply_tracks(
+    Csg& csg, const vector<CsgTrack>& tracks, float time) {
+  for (auto& track : tracks) {
+    node_param(csg, track.node, track.param) = eval_track(track, time);
+    if (is_group(csg.nodes[track.node]))
+      refit_group(csg.groups[csg.nodes[track.node].group], {track.param / 4});
+  }
+}
+
+// Compiles the animation of the tree, see the notes above. Throws if a
+// blend changes sign.
+inline CsgAnimation make_animation(
+    const Csg& csg, const vector<CsgTrack>& tracks, float margin = 0.01f) {
+  auto animation   = CsgAnimation{};
+  animation.csg    = csg;
+  animation.tracks = tracks;
+  auto times       = vector<float>{};
+  for (auto& track : tracks)
+    for (auto& key : track.keys) times.push_back(key.time);
+  std::sort(times.begin(), times.end());
+
+  // boxes, softness and Lipschitz bound over all the keys, and whether the
+  // animated operations are unions or subtractions
+  auto envelope  = csg;
+  auto signs     = vector<int>(csg.nodes.size(), 0);
+  auto lipschitz = 0.0f;
+  envelope.bounds.assign(csg.nodes.size(), invalidb3f);
+  for (auto time : times) {
+    auto frame = csg;
+    apply_tracks(frame, tracks, time);
+    update_bounds(frame);
+    for (auto n = 0; n < csg.nodes.size(); n++)
+      envelope.bounds[n] = merge(envelope.bounds[n], frame.bounds[n]);
+    for (auto& track : tracks) {
+      auto& node = frame.nodes[track.node];
+      if (node.children == vec2i{-1, -1}) continue;
+      auto  sign = node.operation.blend >= 0 ? 1 : -1;
+      auto& kept = signs[track.node];
+      if (kept != 0 && kept != sign)
+        throw std::runtime_error{"blends cannot change sign"};
+      kept           = sign;
+      auto& softness = envelope.nodes[track.node].operation.softness;
+      softness       = yocto::max(softness, node.operation.softness);
+    }
+    lipschitz = yocto::max(lipschitz, eval_lipschitz(frame)[frame.root]);
+  }
+  for (auto n = 0; n < csg.nodes.size(); n++)
+    if (signs[n] != 0) envelope.nodes[n].operation.blend = signs[n] * 0.5f;
+
+  animation.tape           = compile_csg(envelope, margin);
+  animation.tape.lipschitz = yocto::max(lipschitz, 1.0f);
+  animation.bounds         = envelope.bounds[envelope.root];
+  update_bounds(animation.csg);
+  for (auto& track : tracks) {
+    auto& nodes       = animation.tape.nodes;
+    auto  instruction = -1;
+    for (auto i = 0; i < nodes.size(); i++) {
+      auto opcode = animation.tape.instructions[i].opcode;
+      if (nodes[i] == track.node && !is_guard(opcode))
+        instruction = i;
+    }
+    animation.instructions.push_back(instruction);
+  }
+  return animation;
+}
+
+// Moves the animation to the time, and returns the boxes where the tree
+// changed since its previous time, see changed_regions.
+inline vector<bbox3f> set_animation_time(
+    CsgAnimation& animation, float time) {
+  auto previous = animation.csg;
+  apply_tracks(animation.csg, animation.tracks, time);
+  update_bounds(animation.csg);
+  for (auto k = 0; k < animation.tracks.size(); k++)
+    if (animation.instructions[k] >= 0)
+      update_tape_params(
+          animation.tape, animation.csg, animation.instructions[k]);
+  return changed_regions(previous, animation.csg);
+}
+
+// Tiles whose pixels may see the boxes, which are moved as the points of
+// the tree, see raymarch. Returns all the tiles if a box is unbounded or
+// behind the camera.
+inline vector<bool> dirty_tiles(const vector<CsgTile>& tiles,
+    const vector<bbox3f>& regions, const trace_camera& camera,
+    const vec2i& size) {
+  auto dirty = vector<bool>(tiles.size(), false);
+  auto frame = inverse(camera.frame);
+  for (auto& region : regions) {
+    if (!is_bounded(region)) return vector<bool>(tiles.size(), true);
+    auto min = vec2f{flt_max, flt_max}, max = vec2f{-flt_max, -flt_max};
+    for (auto k = 0; k < 8; k++) {
+      auto corner = vec3f{k & 1 ? region.max.x : region.min.x,
+          k & 2 ? region.max.y : region.min.y,
+          k & 4 ? region.max.z : region.min.z};
+      auto uv     = project_camera(camera, frame, size, corner + 0.5f);
+      if (uv.x < 0 || uv.y < 0) return vector<bool>(tiles.size(), true);
+      min = yocto::min(min, uv);
+      max = yocto::max(max, uv);
+    }
+    for (auto t = 0; t < tiles.size(); t++) {
+      auto& tile = tiles[t];
+      if (tile.max.x + 1 >= min.x && tile.min.x - 1 <= max.x &&
+          tile.max.y + 1 >= min.y && tile.min.y - 1 <= max.y)
+        dirty[t] = true;
+    }
+  }
+  return dirty;
+}
+
+// Renders the animation at its time into `render`, which holds the frame
+// of the previous time from the same camera, tracing again only the tiles
+// that may see `regions`, or all of them if it is empty. Returns the tiles
+// traced. Paths and falsecolor trace all tiles, since they change with
+// what the rays see elsewhere.
+inline int raymarch_animation(const CsgAnimation& animation,
+    const CsgJit& jit, const march_params& march, const trace_camera& camera,
+    const trace_params& params, const vector<bbox3f>& regions,
+    image<vec4f>& render) {
+  auto state = march_buffer{};
+  init_state(state, camera, params);
+  auto tiles = make_tiles(state.size());
+  auto dirty = vector<bool>(tiles.size(), true);
+  if (render.size() == state.size() && !is_pathtraced(march) &&
+      march.falsecolor == march_falsecolor::none) {
+    dirty = dirty_tiles(tiles, regions, camera, state.size());
+  } else {
+    render = image{state.size(), zero4f};
+  }
+  auto traced = vector<CsgTile>{};
+  for (auto t = 0; t < tiles.size(); t++)
+    if (dirty[t]) traced.push_back(tiles[t]);
+  parallel_for_tiles(traced, [&](CsgTile& tile) {
+    for (; tile.samples < params.samples; tile.samples++)
+      raymarch_tile(animation.tape, jit, nullptr, march, state, camera, tile,
+          params, render);
+  });
+  return (int)traced.size();
+}
@@ -0,0 +1,113 @@
+#pragma once
+#include <algorithm>
+
+#include "ext/yocto-gl/yocto/ext/tinyexr.h"
+#include "ext/yocto-gl/yocto/yocto_commonio.h"
+#include "ext/yocto-gl/yocto/yocto_image.h"
+#include "raymarch.h"
+
+// Files of the passes of a render, see march_aovs, for compositing. Passes
+// are saved as float EXR images of their own next to the image, e.g.
+// out.depth.exr, or as layers of one EXR with the image, named as the
+// layers of OpenEXR: depth.Z, normal.X, normal.Y, normal.Z, id.V and
+// steps.V, with R, G, B and A for the image. Misses keep the values of
+// march_aov, with depths of flt_max.
+
+// Channels of the passes that are not empty, by their names in EXR.
+inline vector<pair<string, vector<float>>> aov_channels(
+    const march_aovs& aovs) {
+  auto channels = vector<pair<string, vector<float>>>{};
+  auto add      = [&](const string& name, const image<float>& pass) {
+    if (!pass.empty())
+      channels.push_back({name, vector<float>(pass.begin(), pass.end())});
+  };
+  add("depth.Z", aovs.depth);
+  if (!aovs.normal.empty()) {
+    auto& normal = aovs.normal;
+    for (auto c = 0; c < 3; c++) {
+      auto values = vector<float>(normal.count());
+      for (auto k = 0; k < values.size(); k++) values[k] = normal[k][c];
+      channels.push_back({string{"normal."} + "XYZ"[c], values});
+    }
+  }
+  add("id.V", aovs.node);
+  add("steps.V", aovs.steps);
+  return channels;
+}
+
+// Saves each pass to an EXR image named after `filename`, returns false on
+// errors.
+inline bool save_aov_images(
+    const string& filename, const march_aovs& aovs, string& error) {
+  auto save = [&](const string& name, const image<vec4f>& pass) {
+    auto path = get_noextension(filename) + "." + name + ".exr";
+    try {
+      save_image(path, pass);
+    } catch (const std::exception& exception) {
+      error = exception.what();
+      return false;
+    }
+    return true;
+  };
+  auto gray = [](const image<float>& pass) {
+    auto result = image<vec4f>{pass.size()};
+    for (auto k = 0; k < pass.count(); k++)
+      result[k] = {pass[k], pass[k], pass[k], 1};
+    return result;
+  };
+  if (!aovs.depth.empty() && !save("depth", gray(aovs.depth))) return false;
+  if (!aovs.normal.empty()) {
+    auto normal = image<vec4f>{aovs.normal.size()};
+    for (auto k = 0; k < normal.count(); k++)
+      normal[k] = {aovs.normal[k].x, aovs.normal[k].y, aovs.normal[k].z, 1};
+    if (!save("normal", normal)) return false;
+  }
+  if (!aovs.node.empty() && !save("id", gray(aovs.node))) return false;
+  if (!aovs.steps.empty() && !save("steps", gray(aovs.steps))) return false;
+  return true;
+}
+
+// Saves the image and its passes as the layers of one EXR, returns false
+// on errors.
+inline bool save_aov_layers(const string& filename,
+    const image<vec4f>& render, const march_aovs& aovs, string& error) {
+  auto channels = vector<pair<string, vector<float>>>{};
+  for (auto c = 0; c < 4; c++) {
+    auto values = vector<float>(render.count());
+    for (auto k = 0; k < values.size(); k++) values[k] = render[k][c];
+    channels.push_back({string(1, "RGBA"[c]), values});
+  }
+  for (auto& channel : aov_channels(aovs)) channels.push_back(channel);
+  // readers expect the channels sorted by name
+  std::sort(channels.begin(), channels.end(),
+      [](auto& a, auto& b) { return a.first < b.first; });
+
+  auto infos  = vector<EXRChannelInfo>(channels.size());
+  auto types  = vector<int>(channels.size(), TINYEXR_PIXELTYPE_FLOAT);
+  auto planes = vector<unsigned char*>(channels.size());
+  for (auto c = 0; c < channels.size(); c++) {
+    snprintf(infos[c].name, sizeof(infos[c].name), "%s",
+        channels[c].first.c_str());
+    planes[c] = (unsigned char*)channels[c].second.data();
+  }
+  auto header = EXRHeader{};
+  InitEXRHeader(&header);
+  header.num_channels          = (int)channels.size();
+  header.channels              = infos.data();
+  header.pixel_types           = types.data();
+  header.requested_pixel_types = types.data();
+  header.compression_type      = TINYEXR_COMPRESSIONTYPE_ZIP;
+  auto exr = EXRImage{};
+  InitEXRImage(&exr);
+  exr.images       = planes.data();
+  exr.num_channels = (int)channels.size();
+  exr.width        = render.size().x;
+  exr.height       = render.size().y;
+  auto message     = (const char*)nullptr;
+  if (SaveEXRImageToFile(&exr, &header, filename.c_str(), &message) !=
+      TINYEXR_SUCCESS) {
+    error = filename + ": " + (message ? message : "cannot write");
+    return false;
+  }
+  return true;
+}
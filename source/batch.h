@@ -0,0 +1,229 @@
+#pragma once
+#include "ext/yocto-gl/yocto/yocto_common.h"
+#include "pool.h"
+#include "tape.h"
+
+// Evaluation of many points in one call. Points are split in blocks that
+// are evaluated in parallel, and each block runs the tape over packets of
+// 8 points, so that the tape and the registers stay in cache while a block
+// is processed. Callers pass spans over their own storage, so no copies are
+// made at the boundary.
+
+// View of contiguous values, since std::span needs C++20.
+template <typename T>
+struct span {
+  span() {}
+  span(T* data, size_t size) : _data{data}, _size{size} {}
+  template <typename U>
+  span(vector<U>& values) : _data{values.data()}, _size{values.size()} {}
+  template <typename U>
+  span(const vector<U>& values) : _data{values.data()}, _size{values.size()} {}
+
+  T*     data() const { return _data; }
+  size_t size() const { return _size; }
+  T&     operator[](size_t i) const { return _data[i]; }
+
+ private:
+  T*     _data = nullptr;
+  size_t _size = 0;
+};
+
+// Points are processed in chunks, so that threads do not contend on every
+// point when the per-point work is small.
+template <typename Func>
+inline void parallel_for_chunks(int num, Func&& func, int chunk_size = 4096) {
+  auto num_chunks = (num + chunk_size - 1) / chunk_size;
+  parallel_for(
+      num_chunks,
+      [&](int chunk) {
+        auto begin = chunk * chunk_size;
+        auto end   = yocto::min(begin + chunk_size, num);
+        func(begin, end);
+      },
+      pool_priority());
+}
+
+struct CsgBatchOptions {
+  float margin     = flt_max;  // of the bound guards, exact values by default
+  int   block_size = 4096;     // points evaluated by each task
+  bool  parallel   = true;
+};
+
+// Values of the tape at `num` points with packets of type T. The last
+// packet is padded by load_points.
+template <typename T>
+inline void eval_csg_block(
+    const CsgTape& tape, const vec3f* points, float* out, int num) {
+  constexpr auto N         = packet_traits<T>::size;
+  auto           registers = tape_registers<T>(tape);
+  for (auto i = 0; i < num; i += N) {
+    auto count    = yocto::min(N, num - i);
+    auto position = load_points<T>(points + i, count);
+    auto values   = eval_tape(registers, tape, position);
+    if (count == N) {
+      store_packet(out + i, values);
+    } else {
+      float buffer[N];
+      store_packet(buffer, values);
+      for (auto k = 0; k < count; k++) out[i + k] = buffer[k];
+    }
+  }
+}
+
+// Widest packet of the instruction set this file is built for.
+#if defined(CSG_SIMD_AVX512)
+using csg_batch_packet = float16;
+#else
+using csg_batch_packet = float8;
+#endif
+
+// With CSG_DISPATCH, batch_kernel.cpp is also built with AVX2 and AVX-512
+// flags on x86, and the best kernel the running CPU supports is picked the
+// first time it is needed. Otherwise the kernel is the one of the build flags.
+using csg_batch_kernel = void (*)(
+    const CsgTape& tape, const vec3f* points, float* out, int num);
+
+struct CsgKernel {
+  const char*      name = nullptr;
+  csg_batch_kernel eval = nullptr;
+};
+
+#if defined(CSG_DISPATCH) && (defined(__x86_64__) || defined(__i386__)) && \
+    (defined(__GNUC__) || defined(__clang__))
+#define CSG_DISPATCH_X86
+extern "C" void eval_csg_batch_avx2(
+    const CsgTape& tape, const vec3f* points, float* out, int num);
+extern "C" void eval_csg_batch_avx512(
+    const CsgTape& tape, const vec3f* points, float* out, int num);
+#endif
+
+inline CsgKernel select_kernel() {
+#if defined(CSG_DISPATCH_X86)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f"))
+    return {"avx512", eval_csg_batch_avx512};
+  if (__builtin_cpu_supports("avx2")) return {"avx2", eval_csg_batch_avx2};
+#endif
+  return {"native", eval_csg_block<csg_batch_packet>};
+}
+
+inline const CsgKernel& get_kernel() {
+  static const auto kernel = select_kernel();
+  return kernel;
+}
+
+// Values of the tape at the points, written to `out`.
+inline void eval_csg_batch(const CsgTape& tape, span<const vec3f> points,
+    span<float> out, const CsgBatchOptions& options = {}) {
+  assert(points.size() == out.size());
+  auto kernel     = get_kernel().eval;
+  auto eval_block = [&](int begin, int end) {
+    kernel(tape, points.data() + begin, out.data() + begin, end - begin);
+  };
+  auto num = (int)points.size();
+  if (options.parallel) {
+    parallel_for_chunks(num, eval_block, options.block_size);
+  } else {
+    eval_block(0, num);
+  }
+}
+
+// Values of the tree at the points, written to `out`. The tree is compiled
+// once for the call, see compile_csg.
+inline void eval_csg_batch(const CsgTree& csg, span<const vec3f> points,
+    span<float> out, const CsgBatchOptions& options = {}) {
+  eval_csg_batch(compile_csg(csg, options.margin), points, out, options);
+}
+
+// Calls `func(tree, begin, end)` for each of `num_trees` trees and each
+// block of `num` points. Tasks take a block and a range of trees, which run
+// one after the other over it so that the block stays in cache, and ranges
+// are split so that there are enough tasks for the threads when there are
+// few blocks.
+template <typename Func>
+inline void parallel_for_trees(
+    int num_trees, int num, Func&& func, int block_size = 4096) {
+  auto num_blocks = (num + block_size - 1) / block_size;
+  auto ranges     = yocto::clamp(256 / yocto::max(num_blocks, 1), 1,
+      yocto::max(num_trees, 1));
+  auto range      = (num_trees + ranges - 1) / ranges;
+  parallel_for(
+      num_blocks * ranges,
+      [&](int task) {
+        auto begin = (task / ranges) * block_size;
+        auto end   = yocto::min(begin + block_size, num);
+        auto first = (task % ranges) * range;
+        auto last  = yocto::min(first + range, num_trees);
+        for (auto tree = first; tree < last; tree++) func(tree, begin, end);
+      },
+      pool_priority());
+}
+
+// Values of each tape at the same points, written to `out` by rows of
+// points.size() values, one row per tape.
+inline void eval_csg_batch(const vector<const CsgTape*>& tapes,
+    span<const vec3f> points, span<float> out,
+    const CsgBatchOptions& options = {}) {
+  assert(tapes.size() * points.size() == out.size());
+  auto kernel = get_kernel().eval;
+  auto num    = points.size();
+  parallel_for_trees(
+      (int)tapes.size(), (int)num,
+      [&](int tree, int begin, int end) {
+        kernel(*tapes[tree], points.data() + begin,
+            out.data() + tree * num + begin, end - begin);
+      },
+      options.block_size);
+}
+
+// Values and gradients of the tape at the points, written to `out` and
+// `grads`. Points are evaluated one at a time with dual numbers, see dual.h,
+// in parallel blocks as eval_csg_batch.
+inline void eval_csg_batch_grad(const CsgTape& tape, span<const vec3f> points,
+    span<float> out, span<vec3f> grads, const CsgBatchOptions& options = {}) {
+  assert(points.size() == out.size() && points.size() == grads.size());
+  auto eval_block = [&](int begin, int end) {
+    auto registers = tape_registers<dual>(tape);
+    for (auto i = begin; i < end; i++) {
+      auto result = eval_tape(registers, tape, make_dual(points[i]));
+      out[i]      = result.value;
+      grads[i]    = result.grad;
+    }
+  };
+  auto num = (int)points.size();
+  if (options.parallel) {
+    parallel_for_chunks(num, eval_block, options.block_size);
+  } else {
+    eval_block(0, num);
+  }
+}
+
+// Values of the tape at the points and nodes of the primitives that win at
+// them, see label.h, written to `out` and `nodes`. Points are evaluated in
+// packets of 8 as eval_csg_batch, at about twice the cost of the values.
+inline void eval_csg_batch_labels(const CsgTape& tape,
+    span<const vec3f> points, span<float> out, span<int> nodes,
+    const CsgBatchOptions& options = {}) {
+  assert(points.size() == out.size() && points.size() == nodes.size());
+  auto eval_block = [&](int begin, int end) {
+    auto registers = tape_registers<labeled<float8>>(tape);
+    for (auto i = begin; i < end; i += 8) {
+      auto count    = yocto::min(8, end - i);
+      auto position = load_points<float8>(points.data() + i, count);
+      auto result   = eval_tape(registers, tape, position);
+      float values[8], labels[8];
+      store_packet(values, result.value);
+      store_packet(labels, result.node);
+      for (auto k = 0; k < count; k++) {
+        out[i + k]   = values[k];
+        nodes[i + k] = (int)labels[k];
+      }
+    }
+  };
+  auto num = (int)points.size();
+  if (options.parallel) {
+    parallel_for_chunks(num, eval_block, options.block_size);
+  } else {
+    eval_block(0, num);
+  }
+}
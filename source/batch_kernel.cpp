@@ -0,0 +1,57 @@
+// Batch kernel built once per instruction set when CSG_DISPATCH is on, with
+// the function name in CSG_KERNEL (see batch_kernels.cmake). The inline
+// functions of the evaluators are compiled here with other flags than in
+// the rest of the program, so they are kept in an anonymous namespace and
+// never merged with the baseline ones by the linker. Headers that cannot be
+// wrapped, the ones of the system and of yocto, and the yocto parts of this
+// repo, are included first, so that their guards keep them out of it. The
+// kernel has a C name, since its tape type is the one of the namespace, of
+// the same definition as the tape of the caller.
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cassert>
+#include <cctype>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <future>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#include "ext/yocto-gl/yocto/yocto_bvh.h"
+#include "ext/yocto-gl/yocto/yocto_common.h"
+#include "ext/yocto-gl/yocto/yocto_math.h"
+#include "dual.h"
+#include "labeled.h"
+#include "simd.h"
+
+namespace {
+// overloads of the repo would otherwise hide the ones of yocto
+using yocto::lerp, yocto::max, yocto::min, yocto::parallel_for,
+    yocto::transform_point;
+#include "batch.h"
+}  // namespace
+
+extern "C" void CSG_KERNEL(
+    const CsgTape& tape, const vec3f* points, float* out, int num) {
+  eval_csg_block<csg_batch_packet>(tape, points, out, num);
+}
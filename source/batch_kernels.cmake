@@ -0,0 +1,24 @@
+# Builds batch_kernel.cpp for each instruction set that select_kernel in
+# batch.h can pick at runtime, and links the kernels into a target.
+set(CSG_SOURCE_DIR ${CMAKE_CURRENT_LIST_DIR})
+
+function(csg_add_batch_kernels target)
+  target_compile_definitions(${target} PRIVATE CSG_DISPATCH)
+  if(MSVC OR NOT CMAKE_SYSTEM_PROCESSOR MATCHES "x86_64|AMD64|i.86")
+    return()
+  endif()
+  foreach(isa avx2 avx512)
+    set(kernel ${target}_batch_${isa})
+    add_library(${kernel} OBJECT ${CSG_SOURCE_DIR}/batch_kernel.cpp)
+    set_target_properties(${kernel} PROPERTIES POSITION_INDEPENDENT_CODE ON)
+    target_include_directories(${kernel} PRIVATE ${CSG_SOURCE_DIR}/ext)
+    target_compile_definitions(${kernel} PRIVATE
+        CSG_KERNEL=eval_csg_batch_${isa})
+    if(isa STREQUAL avx2)
+      target_compile_options(${kernel} PRIVATE -mavx2 -ffp-contract=off)
+    else()
+      target_compile_options(${kernel} PRIVATE -mavx512f -ffp-contract=off)
+    endif()
+    target_sources(${target} PRIVATE $<TARGET_OBJECTS:${kernel}>)
+  endforeach()
+endfunction()
@@ -0,0 +1,93 @@
+#pragma once
+#include "batch.h"
+
+// Incremental evaluation over a fixed set of points while one node is being
+// edited. Only the nodes that depend on the subtree of the edited node can
+// change: the subtree itself and its ancestors. The other operands of those
+// nodes do not change, so their values are stored once per point and each
+// update only evaluates the dirty nodes. The cache stays valid while the
+// edits touch the subtree of the node or the operation parameters of its
+// ancestors, i.e. O(subtree + depth) work per point instead of O(nodes).
+// Shared nodes (see share_csg) are handled, since all their parents are
+// ancestors.
+
+struct CsgCache {
+  int           node   = -1;
+  vector<int>   dirty  = {};  // nodes evaluated by each update, in post order
+  vector<int>   inputs = {};  // clean operands of the dirty nodes
+  vector<vec3f> points = {};
+  vector<float> values = {};  // per point, one value per input
+};
+
+inline CsgCache make_cache(
+    const CsgTree& csg, int node, const vector<vec3f>& points) {
+  assert(csg.root == csg.nodes.size() - 1);
+  auto cache   = CsgCache{};
+  cache.node   = node;
+  cache.points = points;
+
+  // the subtree of the node, then every node that reads from it
+  auto below = vector<bool>(csg.nodes.size(), false);
+  auto dirty = vector<bool>(csg.nodes.size(), false);
+  below[node] = true;
+  for (auto i = node; i >= 0; i--) {
+    auto& children = csg.nodes[i].children;
+    if (!below[i] || children == vec2i{-1, -1}) continue;
+    below[children.x] = true;
+    below[children.y] = true;
+  }
+  for (auto i = 0; i < csg.nodes.size(); i++) {
+    auto& children = csg.nodes[i].children;
+    dirty[i]       = below[i] || (children != vec2i{-1, -1} &&
+                                   (dirty[children.x] || dirty[children.y]));
+    if (dirty[i]) cache.dirty.push_back(i);
+  }
+  auto input = vector<bool>(csg.nodes.size(), false);
+  for (auto i : cache.dirty) {
+    auto& children = csg.nodes[i].children;
+    if (children == vec2i{-1, -1}) continue;
+    for (auto c : {children.x, children.y}) {
+      if (dirty[c] || input[c]) continue;
+      input[c] = true;
+      cache.inputs.push_back(c);
+    }
+  }
+
+  auto num_inputs = (int)cache.inputs.size();
+  cache.values    = vector<float>(points.size() * num_inputs);
+  parallel_for_chunks((int)points.size(), [&](int begin, int end) {
+    auto values = vector<float>(csg.nodes.size());
+    for (auto i = begin; i < end; i++) {
+      eval_csg(values, csg, points[i]);
+      for (auto k = 0; k < num_inputs; k++)
+        cache.values[i * num_inputs + k] = values[cache.inputs[k]];
+    }
+  });
+  return cache;
+}
+
+// Values at the cached points for the current parameters of the tree.
+inline void eval_csg_cached(
+    vector<float>& result, const CsgCache& cache, const CsgTree& csg) {
+  auto num_inputs = (int)cache.inputs.size();
+  result.resize(cache.points.size());
+  parallel_for_chunks((int)cache.points.size(), [&](int begin, int end) {
+    auto values = vector<float>(csg.nodes.size());
+    for (auto i = begin; i < end; i++) {
+      auto& position = cache.points[i];
+      for (auto k = 0; k < num_inputs; k++)
+        values[cache.inputs[k]] = cache.values[i * num_inputs + k];
+      for (auto n : cache.dirty) {
+        auto& node = csg.nodes[n];
+        if (node.children == vec2i{-1, -1}) {
+          values[n] = eval_leaf(csg, node, position);
+        } else {
+          auto& f   = values[node.children.x];
+          auto& g   = values[node.children.y];
+          values[n] = eval_operation(f, g, node.operation);
+        }
+      }
+      result[i] = values[csg.root];
+    }
+  });
+}
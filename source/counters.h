@@ -0,0 +1,149 @@
+#pragma once
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <utility>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// Hardware counters of the calling thread, read around the code to measure
+// so that timings can be told apart as bound by compute, by the caches or by
+// branches that the predictor misses, e.g. in the dispatch of eval_csg.
+// Counters are the perf_event ones of Linux, opened each on its own and
+// scaled by the time they were scheduled, since the processor may have
+// fewer counters than events and then takes turns among them. Events that
+// the processor or the system does not count, e.g. in virtual machines or
+// with a perf_event_paranoid above 2, are NaN, and so are all of them on
+// other systems.
+
+enum struct csg_counter {
+  cycles,
+  instructions,
+  branches,
+  branch_misses,
+  l1d_misses,  // of reads
+  llc_misses,  // of reads
+};
+
+inline const int csg_counters = 6;
+
+struct CsgCounters {
+  int fds[csg_counters] = {-1, -1, -1, -1, -1, -1};
+};
+
+// Counts of each csg_counter over a run, NaN where it was not counted.
+struct CsgCounts {
+  double values[csg_counters] = {NAN, NAN, NAN, NAN, NAN, NAN};
+
+  double operator[](csg_counter counter) const {
+    return values[(int)counter];
+  }
+};
+
+// Counters of the calling thread, stopped, with the events that it may
+// count. Counters must be closed with close_counters.
+inline CsgCounters open_counters() {
+  auto counters = CsgCounters{};
+#ifdef __linux__
+  auto cache = [](uint64_t level) {
+    return level | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+           (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+  };
+  const std::pair<uint32_t, uint64_t> events[csg_counters] = {
+      {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+      {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+      {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_INSTRUCTIONS},
+      {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+      {PERF_TYPE_HW_CACHE, cache(PERF_COUNT_HW_CACHE_L1D)},
+      {PERF_TYPE_HW_CACHE, cache(PERF_COUNT_HW_CACHE_LL)},
+  };
+  for (auto k = 0; k < csg_counters; k++) {
+    auto attr           = perf_event_attr{};
+    attr.size           = sizeof(attr);
+    attr.type           = events[k].first;
+    attr.config         = events[k].second;
+    attr.disabled       = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv     = 1;
+    attr.read_format    = PERF_FORMAT_TOTAL_TIME_ENABLED |
+                       PERF_FORMAT_TOTAL_TIME_RUNNING;
+    counters.fds[k] = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+  }
+#endif
+  return counters;
+}
+
+inline void close_counters(CsgCounters& counters) {
+#ifdef __linux__
+  for (auto& fd : counters.fds) {
+    if (fd >= 0) close(fd);
+    fd = -1;
+  }
+#endif
+}
+
+// Whether any event is counted.
+inline bool is_counting(const CsgCounters& counters) {
+  for (auto fd : counters.fds)
+    if (fd >= 0) return true;
+  return false;
+}
+
+// Zeroes the counters and starts them.
+inline void start_counters(CsgCounters& counters) {
+#ifdef __linux__
+  for (auto fd : counters.fds) {
+    if (fd < 0) continue;
+    ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+    ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+  }
+#endif
+}
+
+// Stops the counters and reads their counts since start_counters.
+inline CsgCounts stop_counters(CsgCounters& counters) {
+  auto counts = CsgCounts{};
+#ifdef __linux__
+  for (auto fd : counters.fds)
+    if (fd >= 0) ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+  for (auto k = 0; k < csg_counters; k++) {
+    auto fd = counters.fds[k];
+    // value, time enabled and time running
+    uint64_t data[3] = {};
+    if (fd < 0 || read(fd, data, sizeof(data)) != sizeof(data)) continue;
+    if (data[2] == 0) continue;
+    counts.values[k] = (double)data[0] * data[1] / data[2];
+  }
+#endif
+  return counts;
+}
+
+// Counts of a run as a JSON object: instructions per cycle, misses per
+// thousand instructions of the caches and of the branches, and the share of
+// the branches that missed, with null for the ones that were not counted.
+inline std::string counts_json(const CsgCounts& counts) {
+  auto instructions = counts[csg_counter::instructions];
+  auto number       = [](double value) -> std::string {
+    if (!std::isfinite(value)) return "null";
+    char buffer[64];
+    snprintf(buffer, sizeof(buffer), "%.4g", value);
+    return buffer;
+  };
+  auto mpki = [&](csg_counter counter) {
+    return number(counts[counter] / instructions * 1000);
+  };
+  return "{\"ipc\": " +
+         number(instructions / counts[csg_counter::cycles]) +
+         ", \"l1d_mpki\": " + mpki(csg_counter::l1d_misses) +
+         ", \"llc_mpki\": " + mpki(csg_counter::llc_misses) +
+         ", \"branch_mpki\": " + mpki(csg_counter::branch_misses) +
+         ", \"branch_miss_rate\": " +
+         number(counts[csg_counter::branch_misses] /
+                counts[csg_counter::branches]) +
+         "}";
+}
@@ -1,9 +1,17 @@
 #pragma once
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <memory>
+#include <string_view>
+
+#include "ext/yocto-gl/yocto/yocto_bvh.h"
 #include "ext/yocto-gl/yocto/yocto_math.h"
+#include "dual.h"
+#include "primitives.h"
+#include "simd.h"
 using namespace yocto;
 
-enum struct primitive_type { sphere, box, none };
-
 struct CsgOperation {
   float blend;
   float softness;
@@ -13,21 +21,149 @@ struct CsgPrimitve {
   float          params[16];
   primitive_type type;
 };
+static_assert(csg_max_params <= 16, "primitives have too many parameters");
 
 struct CsgNode {
-  string name = "";
+  int   name     = -1;  // into CsgTree::names, see intern_name
   vec2i children = {-1, -1};
   union {
     CsgOperation operation;
     CsgPrimitve  primitive;
   };
+  int group = -1;  // into CsgTree::groups or instances, by type
+};
+
+// N-ary hard union of spheres, stored as a leaf with a BVH over the spheres
+// so that evaluation only visits the ones near the point. See group_csg.
+// Edits of the spheres refit the BVH, see refit_group, which keeps the
+// parents of its nodes and the leaf of each sphere, and the cost of the
+// BVH as built and as refit, see bvh_cost. None of these are stored.
+struct CsgGroup {
+  vector<vec3f> centers = {};
+  vector<float> radius  = {};
+  bvh_tree      bvh     = {};
+  vector<int>   parents = {};  // of the BVH nodes, -1 for the root
+  vector<int>   leaves  = {};  // BVH node of each sphere
+  float         built   = 0;   // cost when built, 0 if unknown
+  float         cost    = 0;   // cost after the refits
+};
+
+// Triangle mesh as a leaf, with a BVH over the triangles so that distances
+// only visit the ones near the point. Signs are the ones of the angle
+// weighted pseudo-normals of the nearest features [Baerentzen and Aanaes
+// 2005], exact for closed and consistently oriented meshes. See add_mesh.
+struct CsgTriangles {
+  vector<vec3f> positions = {};
+  vector<vec3i> triangles = {};
+  vector<vec3f> vertices  = {};  // pseudo-normals, per position
+  vector<vec3f> edges     = {};  // pseudo-normals, 3 per triangle
+  vector<vec3f> faces     = {};  // normals, per triangle
+  bvh_tree      bvh       = {};
+};
+
+// Names of the nodes, interned so that each is stored once and nodes keep
+// its index. Names are copied into blocks that never move, so that their
+// views stay valid, and found with an open addressing table of indices, so
+// that neither interning nor lookups allocate per name. Copies of a tree
+// share its names, which are only added while parsing.
+struct CsgNames {
+  vector<std::unique_ptr<char[]>> blocks = {};
+  size_t                          used   = 0;  // of the last block
+  vector<std::string_view>        names  = {};
+  vector<int>                     table  = {};  // into names, -1 if empty
+  std::shared_ptr<void>           file   = {};  // names may view, see load_csgb
+};
+
+struct CsgTree;
+
+// Folds of the points of an instance in the space of its tree, before they
+// enter it: mirrors take the coordinates of their axes to their absolute
+// values, and repetitions take them to the nearest of the 2 * copies + 1
+// cells of the period around the origin, so that one evaluation of the
+// tree stands for both halves or for all the copies. Distances are exact
+// for trees on the positive side of the mirrors and inside their cell, and
+// only approximate near the folds otherwise. See fold_point.
+struct CsgFold {
+  vec3i mirror = {0, 0, 0};  // 1 along the mirrored axes
+  vec3f period = {0, 0, 0};  // of the repetitions, 0 along the others
+  vec3i copies = {0, 0, 0};  // on each side of the tree
+};
+
+// Shared tree placed by a frame, stored as a leaf so that repeated
+// sub-assemblies are stored and compiled once. Points are taken into the
+// tree by the inverse frame, computed once, then folded. Frames are rigid
+// with a uniform scale, which scales the distances back exactly. See
+// make_instance.
+struct CsgInstance {
+  frame3f                        frame   = identity3x4f;
+  frame3f                        inverse = identity3x4f;
+  float                          scale   = 1;
+  CsgFold                        fold    = {};
+  std::shared_ptr<const CsgTree> tree    = {};
 };
 
 struct CsgTree {
-  vector<CsgNode> nodes = {};
-  int             root  = -1;
+  vector<CsgNode>           nodes     = {};
+  int                       root      = -1;
+  vector<bbox3f>            bounds    = {};  // per node, see update_bounds
+  vector<uint64_t>          hashes    = {};  // per node, see update_hashes
+  vector<CsgGroup>          groups    = {};
+  vector<CsgTriangles>      meshes    = {};
+  vector<CsgInstance>       instances = {};
+  std::shared_ptr<CsgNames> names     = {};
 };
 
+inline size_t hash_name(std::string_view name) {
+  return std::hash<std::string_view>{}(name);
+}
+
+// Index of the name, or -1 if it was never interned.
+inline int find_name(const CsgNames& names, std::string_view name) {
+  if (names.table.empty()) return -1;
+  auto mask = names.table.size() - 1;
+  for (auto slot = hash_name(name) & mask;; slot = (slot + 1) & mask) {
+    auto index = names.table[slot];
+    if (index < 0 || names.names[index] == name) return index;
+  }
+}
+
+// Index of the name, adding it if it is new. The table is kept at most half
+// full and grows by doubling.
+inline int intern_name(CsgNames& names, std::string_view name) {
+  if ((names.names.size() + 1) * 2 > names.table.size()) {
+    auto size = std::max(names.table.size() * 2, (size_t)1024);
+    names.table.assign(size, -1);
+    for (auto index = 0; index < names.names.size(); index++) {
+      auto slot = hash_name(names.names[index]) & (size - 1);
+      while (names.table[slot] >= 0) slot = (slot + 1) & (size - 1);
+      names.table[slot] = index;
+    }
+  }
+  auto mask = names.table.size() - 1;
+  auto slot = hash_name(name) & mask;
+  for (; names.table[slot] >= 0; slot = (slot + 1) & mask)
+    if (names.names[names.table[slot]] == name) return names.table[slot];
+
+  const auto block_size = (size_t)1 << 16;
+  if (names.blocks.empty() || names.used + name.size() > block_size) {
+    names.blocks.push_back(
+        std::make_unique<char[]>(std::max(block_size, name.size())));
+    names.used = 0;
+  }
+  auto data = names.blocks.back().get() + names.used;
+  std::copy(name.begin(), name.end(), data);
+  names.used += name.size();
+  names.names.push_back({data, name.size()});
+  names.table[slot] = (int)names.names.size() - 1;
+  return names.table[slot];
+}
+
+// Name of the node, empty if it has none.
+inline std::string_view node_name(const CsgTree& csg, int node) {
+  auto name = csg.nodes[node].name;
+  return name >= 0 && csg.names ? csg.names->names[name] : std::string_view{};
+}
+
 inline int add_primitive(CsgTree& csg, const CsgPrimitve& primitive) {
   auto node      = CsgNode();
   node.children  = {-1, -1};
@@ -45,6 +181,262 @@ inline int add_operation(
   return csg.nodes.size() - 1;
 }
 
+// Sum of the areas of the boxes of the BVH nodes, which is proportional to
+// the nodes that queries visit, as in the surface area heuristic.
+inline float bvh_cost(const bvh_tree& bvh) {
+  auto cost = 0.0f;
+  for (auto& node : bvh.nodes) {
+    auto extent = size(node.bbox);
+    cost += extent.x * extent.y + extent.y * extent.z + extent.z * extent.x;
+  }
+  return cost;
+}
+
+// Builds the BVH of the group over its spheres.
+inline void build_group(CsgGroup& group) {
+  auto points = vector<int>(group.centers.size());
+  for (auto k = 0; k < points.size(); k++) points[k] = k;
+  group.bvh = {};
+  if (!points.empty())
+    make_points_bvh(group.bvh, points, group.centers, group.radius);
+  group.parents.clear();
+  group.leaves.clear();
+  group.built = group.cost = bvh_cost(group.bvh);
+}
+
+// Refits the BVH of the group to the spheres of the indices, after edits
+// moved or resized them: the boxes of their leaves and of the ancestors of
+// those, up to the first that does not change, in place of a build. Returns
+// the quality of the BVH, its cost when built over its cost now, which
+// drops as refits loosen the boxes; build_group again when it is too low.
+inline float refit_group(CsgGroup& group, const vector<int>& spheres) {
+  auto& bvh = group.bvh;
+  if (bvh.nodes.empty()) return 1;
+  if (group.parents.size() != bvh.nodes.size() ||
+      group.leaves.size() != group.centers.size()) {
+    group.parents.assign(bvh.nodes.size(), -1);
+    group.leaves.assign(group.centers.size(), -1);
+    for (auto n = 0; n < bvh.nodes.size(); n++) {
+      auto& node = bvh.nodes[n];
+      for (auto k = 0; k < node.num; k++) {
+        if (node.internal) {
+          group.parents[node.start + k] = n;
+        } else {
+          group.leaves[bvh.primitives[node.start + k]] = n;
+        }
+      }
+    }
+    group.cost = bvh_cost(bvh);
+    if (group.built == 0) group.built = group.cost;
+  }
+  auto area = [](const bbox3f& bbox) {
+    auto extent = size(bbox);
+    return extent.x * extent.y + extent.y * extent.z + extent.z * extent.x;
+  };
+  for (auto sphere : spheres) {
+    for (auto n = group.leaves[sphere]; n >= 0; n = group.parents[n]) {
+      auto& node = bvh.nodes[n];
+      auto  bbox = invalidb3f;
+      for (auto k = 0; k < node.num; k++) {
+        if (node.internal) {
+          bbox = merge(bbox, bvh.nodes[node.start + k].bbox);
+        } else {
+          auto index = bvh.primitives[node.start + k];
+          bbox = merge(bbox, point_bounds(group.centers[index],
+                                 group.radius[index]));
+        }
+      }
+      if (bbox.min == node.bbox.min && bbox.max == node.bbox.max) break;
+      group.cost += area(bbox) - area(node.bbox);
+      node.bbox = bbox;
+    }
+  }
+  return group.cost > 0 ? yocto::min(group.built / group.cost, 1.0f) : 1;
+}
+
+// Adds a group of spheres as a leaf, building its BVH.
+inline int add_group(CsgTree& csg, CsgGroup group) {
+  build_group(group);
+  auto node           = CsgNode();
+  node.primitive.type = primitive_type::group;
+  node.group          = csg.groups.size();
+  csg.groups.push_back(std::move(group));
+  csg.nodes.push_back(node);
+  return csg.nodes.size() - 1;
+}
+
+// Builds the BVH and the pseudo-normals of a mesh from its positions and
+// triangles. Triangles of no area are dropped, since they have no normals.
+inline void update_mesh(CsgTriangles& mesh) {
+  auto& positions = mesh.positions;
+  mesh.faces.clear();
+  auto  kept      = vector<vec3i>{};
+  for (auto& t : mesh.triangles) {
+    auto normal = cross(positions[t.y] - positions[t.x],
+        positions[t.z] - positions[t.x]);
+    if (dot(normal, normal) <= 0) continue;
+    kept.push_back(t);
+    mesh.faces.push_back(normalize(normal));
+  }
+  mesh.triangles = std::move(kept);
+
+  // vertices weigh the faces by their angles, and edges add their two faces
+  auto& triangles = mesh.triangles;
+  auto  shared    = unordered_map<uint64_t, int>{};
+  auto  edge_key  = [](int a, int b) {
+    return (uint64_t)yocto::min(a, b) << 32 | (uint32_t)yocto::max(a, b);
+  };
+  mesh.vertices.assign(positions.size(), {0, 0, 0});
+  mesh.edges.assign(triangles.size() * 3, {0, 0, 0});
+  for (auto t = 0; t < triangles.size(); t++) {
+    auto& face = mesh.faces[t];
+    for (auto k = 0; k < 3; k++) {
+      auto a = triangles[t][k], b = triangles[t][(k + 1) % 3];
+      auto c = triangles[t][(k + 2) % 3];
+      mesh.vertices[a] += angle(positions[b] - positions[a],
+                              positions[c] - positions[a]) *
+                          face;
+      auto found = shared.emplace(edge_key(a, b), t * 3 + k);
+      mesh.edges[found.first->second] += face;
+    }
+  }
+  for (auto t = 0; t < triangles.size(); t++) {
+    for (auto k = 0; k < 3; k++) {
+      auto a = triangles[t][k], b = triangles[t][(k + 1) % 3];
+      mesh.edges[t * 3 + k] = mesh.edges[shared.at(edge_key(a, b))];
+    }
+  }
+
+  auto radius = vector<float>(positions.size(), 0);
+  mesh.bvh    = {};
+  if (!triangles.empty())
+    make_triangles_bvh(mesh.bvh, triangles, positions, radius);
+}
+
+// Adds a mesh as a leaf, see update_mesh.
+inline int add_mesh(CsgTree& csg, CsgTriangles mesh) {
+  update_mesh(mesh);
+  auto node           = CsgNode();
+  node.primitive.type = primitive_type::mesh;
+  node.group          = csg.meshes.size();
+  csg.meshes.push_back(std::move(mesh));
+  csg.nodes.push_back(node);
+  return csg.nodes.size() - 1;
+}
+
+// Instance of an optimized tree, which may be shared by many instances.
+inline CsgInstance make_instance(std::shared_ptr<const CsgTree> tree,
+    const frame3f& frame, const CsgFold& fold = {}) {
+  auto instance    = CsgInstance{};
+  instance.frame   = frame;
+  instance.inverse = inverse(frame, true);
+  instance.scale   = length(frame.x);
+  instance.fold    = fold;
+  instance.tree    = std::move(tree);
+  return instance;
+}
+
+inline bool operator==(const CsgFold& a, const CsgFold& b) {
+  return a.mirror == b.mirror && a.period == b.period && a.copies == b.copies;
+}
+inline bool operator!=(const CsgFold& a, const CsgFold& b) {
+  return !(a == b);
+}
+
+// Coordinate folded by the mirror and the repetition of its axis. Duals
+// keep the gradient, which the folds only flip or leave. Packets fold their
+// repetitions a lane at a time, since they do not round.
+inline float fold_coordinate(
+    float value, int mirror, float period, int copies) {
+  if (mirror) value = std::abs(value);
+  if (period <= 0) return value;
+  auto cell = clamp(std::round(value / period), (float)-copies, (float)copies);
+  return value - period * cell;
+}
+
+inline dual fold_coordinate(dual value, int mirror, float period, int copies) {
+  if (mirror) value = abs(value);
+  value.value = fold_coordinate(value.value, 0, period, copies);
+  return value;
+}
+
+template <typename T, typename = std::enable_if_t<is_packet_v<T>>>
+inline T fold_coordinate(T value, int mirror, float period, int copies) {
+  if (mirror) value = abs(value);
+  if (period <= 0) return value;
+  float lanes[packet_traits<T>::size];
+  store_packet(lanes, value);
+  for (auto& lane : lanes) lane = fold_coordinate(lane, 0, period, copies);
+  return load_packet(lanes, (T*)nullptr);
+}
+
+inline vec3f fold_point(const CsgFold& fold, const vec3f& position) {
+  auto result = position;
+  for (auto k = 0; k < 3; k++)
+    result[k] = fold_coordinate(
+        position[k], fold.mirror[k], fold.period[k], fold.copies[k]);
+  return result;
+}
+
+template <typename T>
+inline packet_vec3<T> fold_point(
+    const CsgFold& fold, const packet_vec3<T>& position) {
+  auto axis = [&](const T& value, int k) {
+    return fold_coordinate(
+        value, fold.mirror[k], fold.period[k], fold.copies[k]);
+  };
+  return {axis(position.x, 0), axis(position.y, 1), axis(position.z, 2)};
+}
+
+// Box of the folded points of a region.
+inline bbox3f fold_bbox(const CsgFold& fold, const bbox3f& region) {
+  auto result = region;
+  for (auto k = 0; k < 3; k++) {
+    auto &min = result.min[k], &max = result.max[k];
+    if (fold.mirror[k] && min < 0) {
+      auto extent = yocto::max(-min, max);
+      min         = max >= 0 ? 0 : -max;
+      max         = extent;
+    }
+    auto period = fold.period[k];
+    if (period <= 0) continue;
+    auto copies = (float)fold.copies[k];
+    auto first  = clamp(std::round(min / period), -copies, copies);
+    auto last   = clamp(std::round(max / period), -copies, copies);
+    auto lower  = min - period * first;
+    auto upper  = max - period * last;
+    // cells between the first and the last are covered whole
+    min = first == last ? lower : yocto::min(lower, -period / 2);
+    max = first == last ? upper : yocto::max(upper, period / 2);
+  }
+  return result;
+}
+
+// Box of the points whose folds are in the box of the tree.
+inline bbox3f unfold_bbox(const CsgFold& fold, const bbox3f& bounds) {
+  auto result = bounds;
+  for (auto k = 0; k < 3; k++) {
+    auto &min = result.min[k], &max = result.max[k];
+    auto  reach = fold.period[k] > 0 ? fold.period[k] * fold.copies[k] : 0;
+    min -= reach;
+    max += reach;
+    if (fold.mirror[k]) {
+      max = yocto::max(std::abs(min), std::abs(max));
+      min = -max;
+    }
+  }
+  return result;
+}
+
+inline int add_instance(CsgTree& csg, const CsgInstance& instance) {
+  auto node           = CsgNode();
+  node.primitive.type = primitive_type::instance;
+  node.group          = csg.instances.size();
+  csg.instances.push_back(instance);
+  csg.nodes.push_back(node);
+  return csg.nodes.size() - 1;
+}
+
 using Csg = CsgTree;
 
 inline float smin(float a, float b, float k) {
@@ -59,20 +451,16 @@ inline float smax(float a, float b, float k) {
   return max(a, b) + h * h * k * (1.0 / 4.0);
 };
 
+// Distance of a primitive of the registry, see primitives.h.
 inline float eval_primitive(
     const vec3f& position, const CsgPrimitve& primitive) {
-  // Sphere
-  if (primitive.type == primitive_type::sphere) {
-    auto center = (const vec3f*)primitive.params;
-    auto radius = primitive.params[3];
-    return length(position - *center) - radius;
-  }
-  // Box
-  if (primitive.type == primitive_type::box) {
-    return 1;
-  }
-  assert(0);
-  return 1;
+  auto result = 1.0f;
+  auto found  = visit_primitive(primitive.type, [&](auto kind) {
+    auto shape = decltype(kind)::load(primitive.params);
+    result     = shape.eval(position.x, position.y, position.z);
+  });
+  if (!found) assert(0);
+  return result;
 }
 
 inline float eval_operation(float f, float g, const CsgOperation& operation) {
@@ -85,54 +473,923 @@ inline float eval_operation(float f, float g, const CsgOperation& operation) {
   }
 }
 
+// Signed distance from a box, which is a lower bound of the distance of any
+// sphere inside it, also inside the box.
+inline float bounds_sdf(const vec3f& position, const bbox3f& bounds) {
+  auto q = max(bounds.min - position, position - bounds.max);
+  return length(max(q, vec3f{0, 0, 0})) + yocto::min(max(q), 0.0f);
+}
+
+// Nodes left to visit by a traversal of a BVH. The first ones are kept in
+// place, left uninitialized, and the ones beyond in a vector, so that trees
+// deeper than BVHs usually are do not overflow it.
+struct CsgBvhStack {
+  array<int, 128> local;
+  vector<int>     more = {};
+  int             size = 0;
+
+  bool empty() const { return size == 0; }
+  void push(int node) {
+    if (size < (int)local.size()) {
+      local[size] = node;
+    } else {
+      more.push_back(node);
+    }
+    size++;
+  }
+  int pop() {
+    if (--size < (int)local.size()) return local[size];
+    auto node = more.back();
+    more.pop_back();
+    return node;
+  }
+};
+
+// Nearest sphere of a group and its distance. BVH nodes are visited
+// nearest first and skipped when their box is not closer than the best
+// sphere so far.
+inline pair<int, float> nearest_sphere(
+    const CsgGroup& group, const vec3f& position) {
+  auto best  = pair<int, float>{-1, flt_max};
+  auto stack = CsgBvhStack{};
+  if (group.bvh.nodes.empty()) return best;
+  stack.push(0);
+  while (!stack.empty()) {
+    auto& node = group.bvh.nodes[stack.pop()];
+    if (bounds_sdf(position, node.bbox) >= best.second) continue;
+    if (node.internal) {
+      auto a = node.start, b = node.start + 1;
+      auto da = bounds_sdf(position, group.bvh.nodes[a].bbox);
+      auto db = bounds_sdf(position, group.bvh.nodes[b].bbox);
+      if (da < db) std::swap(a, b);
+      stack.push(a);
+      stack.push(b);
+    } else {
+      for (auto i = 0; i < node.num; i++) {
+        auto sphere   = group.bvh.primitives[node.start + i];
+        auto distance = length(position - group.centers[sphere]) -
+                        group.radius[sphere];
+        if (distance < best.second) best = {sphere, distance};
+      }
+    }
+  }
+  return best;
+}
+
+inline float eval_group(const CsgGroup& group, const vec3f& position) {
+  return nearest_sphere(group, position).second;
+}
+
+// Nearest point of a triangle to a position and its feature: 0 to 2 for
+// the vertices, 3 to 5 for the edges from them, 6 for the face [Ericson
+// 2004, 5.1.5].
+inline pair<vec3f, int> nearest_triangle_point(
+    const vec3f& p, const vec3f& a, const vec3f& b, const vec3f& c) {
+  auto ab = b - a, ac = c - a;
+  auto d1 = dot(ab, p - a), d2 = dot(ac, p - a);
+  if (d1 <= 0 && d2 <= 0) return {a, 0};
+  auto d3 = dot(ab, p - b), d4 = dot(ac, p - b);
+  if (d3 >= 0 && d4 <= d3) return {b, 1};
+  auto vc = d1 * d4 - d3 * d2;
+  if (vc <= 0 && d1 >= 0 && d3 <= 0) return {a + ab * (d1 / (d1 - d3)), 3};
+  auto d5 = dot(ab, p - c), d6 = dot(ac, p - c);
+  if (d6 >= 0 && d5 <= d6) return {c, 2};
+  auto vb = d5 * d2 - d1 * d6;
+  if (vb <= 0 && d2 >= 0 && d6 <= 0) return {a + ac * (d2 / (d2 - d6)), 5};
+  auto va = d3 * d6 - d5 * d4;
+  if (va <= 0 && d4 - d3 >= 0 && d5 - d6 >= 0)
+    return {b + (c - b) * ((d4 - d3) / ((d4 - d3) + (d5 - d6))), 4};
+  auto scale = 1 / (va + vb + vc);
+  return {a + ab * (vb * scale) + ac * (vc * scale), 6};
+}
+
+// Nearest point of a mesh, with the pseudo-normal of its feature.
+struct CsgMeshPoint {
+  vec3f point    = {0, 0, 0};
+  vec3f normal   = {0, 0, 1};
+  float distance = flt_max;
+};
+
+// Nearest point of a mesh, visiting the BVH as nearest_sphere does.
+inline CsgMeshPoint nearest_mesh_point(
+    const CsgTriangles& mesh, const vec3f& position) {
+  auto best    = CsgMeshPoint{};
+  auto nearest = pair<int, int>{-1, 6};  // triangle and feature
+  auto stack   = CsgBvhStack{};
+  if (mesh.bvh.nodes.empty()) return best;
+  stack.push(0);
+  while (!stack.empty()) {
+    auto& node = mesh.bvh.nodes[stack.pop()];
+    if (bounds_sdf(position, node.bbox) >= best.distance) continue;
+    if (node.internal) {
+      auto a = node.start, b = node.start + 1;
+      auto da = bounds_sdf(position, mesh.bvh.nodes[a].bbox);
+      auto db = bounds_sdf(position, mesh.bvh.nodes[b].bbox);
+      if (da < db) std::swap(a, b);
+      stack.push(a);
+      stack.push(b);
+    } else {
+      for (auto i = 0; i < node.num; i++) {
+        auto  triangle = mesh.bvh.primitives[node.start + i];
+        auto& t        = mesh.triangles[triangle];
+        auto [point, feature] = nearest_triangle_point(position,
+            mesh.positions[t.x], mesh.positions[t.y], mesh.positions[t.z]);
+        auto distance = length(position - point);
+        if (distance >= best.distance) continue;
+        best.point    = point;
+        best.distance = distance;
+        nearest       = {triangle, feature};
+      }
+    }
+  }
+  auto [triangle, feature] = nearest;
+  if (triangle < 0) return best;
+  best.normal = feature < 3 ? mesh.vertices[mesh.triangles[triangle][feature]]
+                : feature < 6 ? mesh.edges[triangle * 3 + feature - 3]
+                              : mesh.faces[triangle];
+  return best;
+}
+
+inline float eval_mesh(const CsgTriangles& mesh, const vec3f& position) {
+  auto nearest = nearest_mesh_point(mesh, position);
+  return dot(position - nearest.point, nearest.normal) < 0 ? -nearest.distance
+                                                           : nearest.distance;
+}
+
+inline bool is_group(const CsgNode& node) {
+  return node.children == vec2i{-1, -1} &&
+         node.primitive.type == primitive_type::group;
+}
+
+inline bool is_instance(const CsgNode& node) {
+  return node.children == vec2i{-1, -1} &&
+         node.primitive.type == primitive_type::instance;
+}
+
+inline bool is_mesh(const CsgNode& node) {
+  return node.children == vec2i{-1, -1} &&
+         node.primitive.type == primitive_type::mesh;
+}
+
+inline float eval_instance(const CsgInstance& instance, const vec3f& position);
+
+inline float eval_leaf(
+    const CsgTree& csg, const CsgNode& node, const vec3f& position) {
+  if (is_group(node)) return eval_group(csg.groups[node.group], position);
+  if (is_mesh(node)) return eval_mesh(csg.meshes[node.group], position);
+  if (is_instance(node))
+    return eval_instance(csg.instances[node.group], position);
+  return eval_primitive(position, node.primitive);
+}
+
+// Walks the tree from the node as the recursion would, children before
+// parents, but with explicit stacks since parsed chains of smooth unions
+// are as deep as the file is long. The stacks are kept per thread and
+// shared by the instances evaluated within, that use their tops.
 inline float eval_csg_recursive(
     const CsgTree& csg, const vec3f& position, const CsgNode& node) {
-  if (node.children == vec2i{-1, -1}) {
-    return eval_primitive(position, node.primitive);
-  } else {
-    auto f = eval_csg_recursive(csg, position, csg.nodes[node.children.x]);
-    auto g = eval_csg_recursive(csg, position, csg.nodes[node.children.y]);
-    return eval_operation(f, g, node.operation);
+  thread_local auto stack  = vector<pair<const CsgNode*, bool>>{};
+  thread_local auto values = vector<float>{};
+  auto              base   = stack.size();
+  stack.push_back({&node, false});
+  while (stack.size() > base) {
+    auto [current, expanded] = stack.back();
+    stack.pop_back();
+    if (current->children == vec2i{-1, -1}) {
+      values.push_back(eval_leaf(csg, *current, position));
+    } else if (!expanded) {
+      stack.push_back({current, true});
+      stack.push_back({&csg.nodes[current->children.y], false});
+      stack.push_back({&csg.nodes[current->children.x], false});
+    } else {
+      auto g = values.back();
+      values.pop_back();
+      values.back() = eval_operation(values.back(), g, current->operation);
+    }
   }
+  auto result = values.back();
+  values.pop_back();
+  return result;
 }
 
 inline float eval_csg_recursive(const CsgTree& csg, const vec3f& position) {
   return eval_csg_recursive(csg, position, csg.nodes[csg.root]);
 }
 
-inline void optimize_csg_internal(
-    const CsgTree& csg, int n, vector<CsgNode>& result, vector<int>& mapping) {
-  auto& node = csg.nodes[n];
-  auto  f    = CsgNode{};
+inline float eval_instance(const CsgInstance& instance, const vec3f& position) {
+  return instance.scale *
+         eval_csg_recursive(*instance.tree,
+             fold_point(instance.fold,
+                 transform_point(instance.inverse, position)));
+}
 
+inline bool is_bounded(const bbox3f& bounds) {
+  return bounds.min.x != -flt_max;
+}
+
+// Box outside which a node is at least as far as the box itself, so that the
+// distance to the box is a lower bound of its value. Nodes that cannot be
+// bounded, like blends beyond a full union, get an infinite box.
+inline bbox3f eval_bounds(const CsgTree& csg, const CsgNode& node) {
+  auto infinite = bbox3f{
+      {-flt_max, -flt_max, -flt_max}, {flt_max, flt_max, flt_max}};
+  if (is_group(node)) {
+    auto& bvh = csg.groups[node.group].bvh;
+    return bvh.nodes.empty() ? infinite : bvh.nodes[0].bbox;
+  }
+  if (is_mesh(node)) {
+    auto& bvh = csg.meshes[node.group].bvh;
+    return bvh.nodes.empty() ? infinite : bvh.nodes[0].bbox;
+  }
+  if (is_instance(node)) {
+    auto& instance = csg.instances[node.group];
+    auto& tree     = *instance.tree;
+    if (tree.bounds.size() != tree.nodes.size()) return infinite;
+    auto& bounds = tree.bounds[tree.root];
+    return is_bounded(bounds)
+               ? transform_bbox(
+                     instance.frame, unfold_bbox(instance.fold, bounds))
+               : infinite;
+  }
   if (node.children == vec2i{-1, -1}) {
-    f.children  = {-1, -1};
-    f.primitive = node.primitive;
-  } else {
-    optimize_csg_internal(csg, node.children.x, result, mapping);
-    optimize_csg_internal(csg, node.children.y, result, mapping);
-    f.children  = {mapping[node.children.x], mapping[node.children.y]};
-    f.operation = node.operation;
+    auto& primitive = node.primitive;
+    auto  bounds    = infinite;
+    visit_primitive(primitive.type, [&](auto kind) {
+      bounds = decltype(kind)::load(primitive.params).bounds();
+    });
+    return bounds;
   }
-  f.name = node.name;
-  mapping[n] = result.size();
-  result.push_back(f);
+  auto& operation = node.operation;
+  auto& f         = csg.bounds[node.children.x];
+  auto& g         = csg.bounds[node.children.y];
+  if (operation.blend <= 0) return f;
+  if (operation.blend > 1) return infinite;
+  if (!is_bounded(f) || !is_bounded(g)) return infinite;
+  auto bounds = merge(f, g);
+  return {bounds.min - operation.softness, bounds.max + operation.softness};
 }
 
-inline void optimize_csg(CsgTree& csg) {
-  auto result  = CsgTree{};
+// Recomputes the bounds of all nodes, needed after parameters are edited.
+inline void update_bounds(CsgTree& csg) {
+  csg.bounds.resize(csg.nodes.size());
+  for (auto i = 0; i < csg.nodes.size(); i++)
+    csg.bounds[i] = eval_bounds(csg, csg.nodes[i]);
+}
+
+// Hashes of the subtrees of the nodes, from their primitives, operations
+// and parameters and from the hashes of their children, so that equal
+// subtrees hash equal at any index and in any tree, e.g. to key caches of
+// compiled code or baked grids without walking the tree. Names are left
+// out. Groups hash their spheres, and instances their frames and the root
+// of their trees. Parameters hash by their bits, as in share_csg.
+inline uint64_t mix_hash(uint64_t hash, uint64_t value) {
+  hash = (hash ^ value) * 0xff51afd7ed558ccdull;
+  return hash ^ (hash >> 32);
+}
+
+inline uint64_t mix_hash(uint64_t hash, float value) {
+  auto bits = (uint32_t)0;
+  memcpy(&bits, &value, sizeof(bits));
+  return mix_hash(hash, (uint64_t)bits);
+}
+
+inline uint64_t root_hash(const CsgTree& csg);
+
+// Hash of the subtree of a node, with the hashes of its children updated.
+inline uint64_t node_hash(const CsgTree& csg, int n) {
+  auto& node = csg.nodes[n];
+  if (is_group(node)) {
+    auto& group = csg.groups[node.group];
+    auto  hash  = mix_hash(1, (uint64_t)group.centers.size());
+    for (auto i = 0; i < group.centers.size(); i++) {
+      for (auto k = 0; k < 3; k++) hash = mix_hash(hash, group.centers[i][k]);
+      hash = mix_hash(hash, group.radius[i]);
+    }
+    return hash;
+  }
+  if (is_mesh(node)) {
+    auto& mesh = csg.meshes[node.group];
+    auto  hash = mix_hash(5, (uint64_t)mesh.triangles.size());
+    for (auto& position : mesh.positions)
+      for (auto k = 0; k < 3; k++) hash = mix_hash(hash, position[k]);
+    for (auto& triangle : mesh.triangles)
+      for (auto k = 0; k < 3; k++)
+        hash = mix_hash(hash, (uint64_t)triangle[k]);
+    return hash;
+  }
+  if (is_instance(node)) {
+    auto& instance = csg.instances[node.group];
+    auto  hash     = mix_hash(2, root_hash(*instance.tree));
+    auto& fold     = instance.fold;
+    for (auto k = 0; k < 12; k++)
+      hash = mix_hash(hash, (&instance.frame.x.x)[k]);
+    for (auto k = 0; k < 3; k++) {
+      hash = mix_hash(hash, (float)fold.mirror[k]);
+      hash = mix_hash(hash, fold.period[k]);
+      hash = mix_hash(hash, (float)fold.copies[k]);
+    }
+    return hash;
+  }
+  if (node.children == vec2i{-1, -1}) {
+    auto hash = mix_hash(3, (uint64_t)node.primitive.type);
+    for (auto k = 0; k < primitive_params(node.primitive.type); k++)
+      hash = mix_hash(hash, node.primitive.params[k]);
+    return hash;
+  }
+  auto hash = mix_hash(4, csg.hashes[node.children.x]);
+  hash      = mix_hash(hash, csg.hashes[node.children.y]);
+  hash      = mix_hash(hash, node.operation.blend);
+  return mix_hash(hash, node.operation.softness);
+}
+
+// Recomputes the hashes of all nodes, children before parents.
+inline void update_hashes(CsgTree& csg) {
+  csg.hashes.resize(csg.nodes.size());
+  for (auto i = 0; i < csg.nodes.size(); i++) csg.hashes[i] = node_hash(csg, i);
+}
+
+// Updates the hashes after the parameters of a node are edited: only the
+// node and the nodes above it change, and they follow it.
+inline void update_hashes(CsgTree& csg, int node) {
+  if (csg.hashes.size() != csg.nodes.size()) return update_hashes(csg);
+  auto changed     = vector<bool>(csg.nodes.size(), false);
+  changed[node]    = true;
+  csg.hashes[node] = node_hash(csg, node);
+  for (auto i = node + 1; i < csg.nodes.size(); i++) {
+    auto& children = csg.nodes[i].children;
+    if (children == vec2i{-1, -1}) continue;
+    if (!changed[children.x] && !changed[children.y]) continue;
+    changed[i]    = true;
+    csg.hashes[i] = node_hash(csg, i);
+  }
+}
+
+// Hash of the whole tree, computed on a copy if its hashes are not updated.
+inline uint64_t root_hash(const CsgTree& csg) {
+  if (csg.root < 0) return 0;
+  if (csg.hashes.size() == csg.nodes.size()) return csg.hashes[csg.root];
+  auto copy = csg;
+  update_hashes(copy);
+  return copy.hashes[copy.root];
+}
+
+// Whether the trees differ only by the parameters of their nodes, e.g. when
+// a file is edited and loaded again, so that nodes match by index.
+inline bool same_structure(const CsgTree& a, const CsgTree& b) {
+  if (a.nodes.size() != b.nodes.size() || a.root != b.root ||
+      a.groups.size() != b.groups.size() ||
+      a.instances.size() != b.instances.size())
+    return false;
+  for (auto i = 0; i < a.nodes.size(); i++) {
+    auto &x = a.nodes[i], &y = b.nodes[i];
+    if (x.children != y.children || x.group != y.group) return false;
+    if (x.children == vec2i{-1, -1} && x.primitive.type != y.primitive.type)
+      return false;
+  }
+  return true;
+}
+
+inline bool node_changed(const CsgTree& a, const CsgTree& b, int node) {
+  auto &x = a.nodes[node], &y = b.nodes[node];
+  if (is_group(x)) {
+    auto &f = a.groups[x.group], &g = b.groups[y.group];
+    return f.centers != g.centers || f.radius != g.radius;
+  }
+  if (is_mesh(x)) {
+    auto &f = a.meshes[x.group], &g = b.meshes[y.group];
+    return f.positions != g.positions || f.triangles != g.triangles;
+  }
+  if (is_instance(x)) {
+    auto &f = a.instances[x.group], &g = b.instances[y.group];
+    return f.tree != g.tree || f.frame != g.frame || f.fold != g.fold;
+  }
+  if (x.children == vec2i{-1, -1})
+    return !std::equal(x.primitive.params,
+        x.primitive.params + primitive_params(x.primitive.type),
+        y.primitive.params);
+  return x.operation.blend != y.operation.blend ||
+         x.operation.softness != y.operation.softness;
+}
+
+// Boxes outside which the surfaces of two trees of the same structure
+// agree, with their bounds updated: the bounds of each changed node in both
+// trees, grown by the softness of the blends above it, so that edits far
+// apart do not cover the space between them. Empty if no node changed, and
+// a single unbounded box if a changed node is. More than `max_regions`
+// boxes are merged into one.
+inline vector<bbox3f> changed_regions(
+    const CsgTree& a, const CsgTree& b, int max_regions = 64) {
+  assert(same_structure(a, b));
+  // nodes follow their children, so the growth reaches them from the root
+  auto grow = vector<float>(a.nodes.size(), -1);
+  if (a.root >= 0) grow[a.root] = 0;
+  for (auto i = (int)a.nodes.size() - 1; i >= 0; i--) {
+    auto& node = a.nodes[i];
+    if (grow[i] < 0 || node.children == vec2i{-1, -1}) continue;
+    auto softness = yocto::max(
+        node.operation.softness, b.nodes[i].operation.softness);
+    for (auto child : {node.children.x, node.children.y})
+      grow[child] = yocto::max(grow[child], grow[i] + softness);
+  }
+  auto regions = vector<bbox3f>{};
+  for (auto i = 0; i < a.nodes.size(); i++) {
+    if (grow[i] < 0 || !node_changed(a, b, i)) continue;
+    auto bounds = merge(a.bounds[i], b.bounds[i]);
+    if (!is_bounded(bounds))
+      return {{{-flt_max, -flt_max, -flt_max}, {flt_max, flt_max, flt_max}}};
+    regions.push_back({bounds.min - grow[i], bounds.max + grow[i]});
+  }
+  if (regions.size() > max_regions) {
+    auto region = invalidb3f;
+    for (auto& box : regions) region = merge(region, box);
+    regions = {region};
+  }
+  return regions;
+}
+
+// Parameter `param` of the node: the position and the radius of spheres by
+// their index, the ones of the spheres of groups after 4 per sphere before
+// them, and the blend and the softness of operations. Edits of groups must
+// refit their BVH, see refit_group.
+inline float& node_param(Csg& csg, int node, int param) {
+  auto& selected = csg.nodes[node];
+  if (is_group(selected)) {
+    auto& group = csg.groups[selected.group];
+    if (param % 4 == 3) return group.radius[param / 4];
+    return group.centers[param / 4][param % 4];
+  }
+  if (selected.children == vec2i{-1, -1})
+    return selected.primitive.params[param];
+  return param == 0 ? selected.operation.blend : selected.operation.softness;
+}
+
+// Moves the shapes of the tree by the offset: primitives and the spheres of
+// groups by their centers, meshes by their positions, and instances by
+// their frames, while the trees of instances stay in their own space.
+inline void translate_csg(CsgTree& csg, const vec3f& offset) {
+  for (auto& node : csg.nodes) {
+    if (node.children != vec2i{-1, -1} || is_group(node) ||
+        is_mesh(node) || is_instance(node))
+      continue;
+    for (auto k = 0; k < 3; k++) node.primitive.params[k] += offset[k];
+  }
+  for (auto& group : csg.groups) {
+    for (auto& center : group.centers) center += offset;
+    for (auto& node : group.bvh.nodes)
+      node.bbox = {node.bbox.min + offset, node.bbox.max + offset};
+  }
+  for (auto& mesh : csg.meshes) {
+    for (auto& position : mesh.positions) position += offset;
+    for (auto& node : mesh.bvh.nodes)
+      node.bbox = {node.bbox.min + offset, node.bbox.max + offset};
+  }
+  for (auto& instance : csg.instances)
+    instance = make_instance(instance.tree,
+        translation_frame(offset) * instance.frame, instance.fold);
+  update_bounds(csg);
+  update_hashes(csg);
+}
+
+// Moves the tree so that its box is centered at the origin, and returns the
+// point of space that the origin stands for. Floats keep about 7 digits, so
+// trees placed kilometers from the origin are marched with steps and
+// normals that cannot resolve millimeters. Anchored trees are evaluated
+// close to the origin, and so are the rays of cameras moved by the anchor.
+// The offsets are exact for shapes close to the anchor. Unbounded trees are
+// not moved.
+inline vec3f anchor_csg(CsgTree& csg) {
+  if (csg.root < 0) return {0, 0, 0};
+  if (csg.bounds.size() != csg.nodes.size()) update_bounds(csg);
+  auto& bounds = csg.bounds[csg.root];
+  if (!is_bounded(bounds)) return {0, 0, 0};
+  auto anchor = (bounds.min + bounds.max) / 2;
+  translate_csg(csg, -anchor);
+  return anchor;
+}
+
+// Box of all the changed regions, see changed_regions.
+inline bbox3f changed_region(const CsgTree& a, const CsgTree& b) {
+  auto region = invalidb3f;
+  for (auto& box : changed_regions(a, b)) region = merge(region, box);
+  return region;
+}
+
+// Distance of a point from a box, zero inside it.
+inline float bounds_distance(const vec3f& position, const bbox3f& bounds) {
+  auto d = max(bounds.min - position, position - bounds.max);
+  return length(max(d, vec3f{0, 0, 0}));
+}
+
+// Copies the nodes reachable from the root in post order, replacing each
+// node n with forward[n]. Uses an explicit stack since chains can be deep.
+inline CsgTree copy_csg(const CsgTree& csg, const vector<int>& forward) {
+  auto result   = CsgTree{};
+  result.groups    = csg.groups;
+  result.meshes    = csg.meshes;
+  result.instances = csg.instances;
+  result.names     = csg.names;
+  auto mapping  = vector<int>(csg.nodes.size(), -1);
+  auto stack    = vector<int>{forward[csg.root]};
+  while (!stack.empty()) {
+    auto n    = stack.back();
+    auto node = csg.nodes[n];
+    if (node.children != vec2i{-1, -1}) {
+      auto a = forward[node.children.x], b = forward[node.children.y];
+      if (mapping[a] < 0 || mapping[b] < 0) {
+        if (mapping[b] < 0) stack.push_back(b);
+        if (mapping[a] < 0) stack.push_back(a);
+        continue;
+      }
+      node.children = {mapping[a], mapping[b]};
+    }
+    stack.pop_back();
+    if (mapping[n] >= 0) continue;
+    mapping[n] = result.nodes.size();
+    result.nodes.push_back(node);
+  }
+  result.root = result.nodes.size() - 1;
+  update_bounds(result);
+  update_hashes(result);
+  return result;
+}
+
+// Sorts the reachable nodes in post order in place, with the same order and
+// forwarding as copy_csg, so that large trees are not held twice. Children
+// are renumbered as nodes are reached, then nodes are moved along the cycles
+// of the permutation and the others are dropped.
+inline void compact_csg(CsgTree& csg, const vector<int>& forward) {
   auto mapping = vector<int>(csg.nodes.size(), -1);
-  optimize_csg_internal(csg, csg.root, result.nodes, mapping);
+  auto stack   = vector<int>{forward[csg.root]};
+  auto count   = 0;
+  while (!stack.empty()) {
+    auto  n    = stack.back();
+    auto& node = csg.nodes[n];
+    if (mapping[n] >= 0) {
+      stack.pop_back();
+      continue;
+    }
+    if (node.children != vec2i{-1, -1}) {
+      auto a = forward[node.children.x], b = forward[node.children.y];
+      if (mapping[a] < 0 || mapping[b] < 0) {
+        if (mapping[b] < 0) stack.push_back(b);
+        if (mapping[a] < 0) stack.push_back(a);
+        continue;
+      }
+      node.children = {mapping[a], mapping[b]};
+    }
+    stack.pop_back();
+    mapping[n] = count++;
+  }
+  for (auto i = 0; i < mapping.size(); i++) {
+    while (mapping[i] >= 0 && mapping[i] != i) {
+      auto target = mapping[i];
+      std::swap(csg.nodes[i], csg.nodes[target]);
+      std::swap(mapping[i], mapping[target]);
+    }
+  }
+  csg.nodes.resize(count);
+  csg.root = count - 1;
+  update_bounds(csg);
+  update_hashes(csg);
+}
+
+// Copies the subtree of a node as a tree of its own, with the groups,
+// meshes and instances that it uses, e.g. for the trees of instances.
+inline CsgTree subtree_csg(const CsgTree& csg, int root) {
+  auto result  = CsgTree{};
+  result.names = csg.names;
+  auto mapping = unordered_map<int, int>{};
+  auto stack   = vector<int>{root};
+  while (!stack.empty()) {
+    auto n = stack.back();
+    if (mapping.count(n)) {
+      stack.pop_back();
+      continue;
+    }
+    auto node = csg.nodes[n];
+    if (node.children != vec2i{-1, -1}) {
+      auto a = mapping.find(node.children.x);
+      auto b = mapping.find(node.children.y);
+      if (a == mapping.end() || b == mapping.end()) {
+        if (b == mapping.end()) stack.push_back(node.children.y);
+        if (a == mapping.end()) stack.push_back(node.children.x);
+        continue;
+      }
+      node.children = {a->second, b->second};
+    } else if (is_group(node)) {
+      result.groups.push_back(csg.groups[node.group]);
+      node.group = result.groups.size() - 1;
+    } else if (is_mesh(node)) {
+      result.meshes.push_back(csg.meshes[node.group]);
+      node.group = result.meshes.size() - 1;
+    } else if (is_instance(node)) {
+      result.instances.push_back(csg.instances[node.group]);
+      node.group = result.instances.size() - 1;
+    }
+    stack.pop_back();
+    mapping[n] = result.nodes.size();
+    result.nodes.push_back(node);
+  }
   result.root = result.nodes.size() - 1;
-  std::swap(csg, result);
+  update_bounds(result);
+  update_hashes(result);
+  return result;
+}
+
+inline bool is_hard_union(const CsgNode& node) {
+  return node.children != vec2i{-1, -1} && node.operation.blend == 1 &&
+         node.operation.softness == 0;
+}
+
+inline bool is_hard_subtraction(const CsgNode& node) {
+  return node.children != vec2i{-1, -1} && node.operation.blend == -1 &&
+         node.operation.softness == 0;
+}
+
+// Operands of the hard unions reachable from n through unnamed hard unions
+// only, so that named unions stay in the tree as operands. The stack is
+// kept per thread, since optimize_csg gathers once per chain.
+inline void gather_union(
+    const CsgTree& csg, int n, vector<int>& operands) {
+  thread_local auto stack = vector<int>{};
+  stack.assign(1, n);
+  while (!stack.empty()) {
+    auto k = stack.back();
+    stack.pop_back();
+    auto& node = csg.nodes[k];
+    if (is_hard_union(node) && (k == n || node.name < 0)) {
+      stack.push_back(node.children.y);
+      stack.push_back(node.children.x);
+    } else {
+      operands.push_back(k);
+    }
+  }
+}
+
+// Appends a balanced tree of hard unions over the operands, split at the
+// median of their box centers along the widest axis like a BVH, so that
+// nearby operands share subtrees with small bounds. Unbounded operands are
+// added at the top. Returns the root, which is named `name` since it is
+// the same union as the root of the chain.
+inline int build_union(CsgTree& csg, vector<int>& forward,
+    vector<int>& operands, int name) {
+  auto add = [&](int a, int b) {
+    auto node      = CsgNode();
+    node.children  = {a, b};
+    node.operation = {1, 0};
+    csg.nodes.push_back(node);
+    csg.bounds.push_back(eval_bounds(csg, node));
+    forward.push_back(csg.nodes.size() - 1);
+    return (int)csg.nodes.size() - 1;
+  };
+  auto centroid = [&](int n) { return center(csg.bounds[n]); };
+  auto build    = [&](auto& build, int begin, int end) -> int {
+    if (end - begin == 1) return operands[begin];
+    auto bounds = invalidb3f;
+    for (auto i = begin; i < end; i++)
+      bounds = merge(bounds, centroid(operands[i]));
+    auto size  = bounds.max - bounds.min;
+    auto axis  = (size.x >= size.y && size.x >= size.z) ? 0
+                 : (size.y >= size.z)                    ? 1
+                                                         : 2;
+    auto first = operands.begin();
+    auto mid   = (begin + end) / 2;
+    std::nth_element(first + begin, first + mid, first + end,
+        [&](int a, int b) { return centroid(a)[axis] < centroid(b)[axis]; });
+    return add(build(build, begin, mid), build(build, mid, end));
+  };
+
+  auto bounded = (int)(std::stable_partition(operands.begin(), operands.end(),
+                           [&](int n) { return is_bounded(csg.bounds[n]); }) -
+                       operands.begin());
+  auto root    = bounded ? build(build, 0, bounded) : operands[0];
+  for (auto i = bounded ? bounded : 1; i < operands.size(); i++)
+    root = add(root, operands[i]);
+  csg.nodes[root].name = name;
+  return root;
+}
+
+// Merges identical nodes, so that repeated primitives and sub-assemblies are
+// stored and evaluated once and the tree becomes a DAG. Nodes are identical
+// if they have the same name, parameters and children after merging, so
+// that named nodes are kept apart and keep their names. They are found with
+// an open addressing table of indices, comparing their keys bitwise, so that
+// no key is allocated per node.
+inline void share_csg(CsgTree& csg) {
+  assert(csg.root == csg.nodes.size() - 1);
+  auto forward = vector<int>(csg.nodes.size());
+  auto key     = [&](int i) {
+    auto& node  = csg.nodes[i];
+    auto  words = std::array<uint32_t, 3 + csg_max_params>{};
+    auto  add   = [&words](int k, const auto& value) {
+      memcpy(&words[k], &value, sizeof(value));
+    };
+    if (is_group(node) || is_mesh(node) || is_instance(node)) {
+      add(0, 0);
+      add(1, node.primitive.type);
+      add(2, node.group);
+    } else if (node.children == vec2i{-1, -1}) {
+      add(0, 1);
+      add(1, node.primitive.type);
+      for (auto k = 0; k < primitive_params(node.primitive.type); k++)
+        add(2 + k, node.primitive.params[k]);
+    } else {
+      add(0, 2);
+      add(1, forward[node.children.x]);
+      add(2, forward[node.children.y]);
+      add(3, node.operation);
+    }
+    add(words.size() - 1, node.name);
+    return words;
+  };
+  auto size = (size_t)1;
+  while (size < csg.nodes.size() * 2) size *= 2;
+  auto table = vector<int>(size, -1);
+  for (auto i = 0; i < csg.nodes.size(); i++) {
+    auto words = key(i);
+    auto hash  = (uint64_t)0;
+    for (auto word : words) hash = (hash ^ word) * 0x100000001b3ull;
+    auto slot = (size_t)(hash ^ (hash >> 29)) & (size - 1);
+    while (table[slot] >= 0 && key(table[slot]) != words)
+      slot = (slot + 1) & (size - 1);
+    if (table[slot] < 0) table[slot] = i;
+    forward[i] = table[slot];
+  }
+  table = {};
+  compact_csg(csg, forward);
+}
+
+// Folds the operations that do not need to be evaluated: those with zero
+// blend return their first operand, and so do hard unions of an operand with
+// itself. Negative softness gives min and max exactly, so it is cleared to
+// reach the hard forms. The subtrees that are no longer used are removed.
+// Works in place, like compact_csg.
+inline void simplify_csg(CsgTree& csg) {
+  auto forward = vector<int>(csg.nodes.size());
+  for (auto i = 0; i < forward.size(); i++) forward[i] = i;
+  compact_csg(csg, forward);
+  forward.resize(csg.nodes.size());
+  for (auto i = 0; i < csg.nodes.size(); i++) {
+    auto& node = csg.nodes[i];
+    forward[i] = i;
+    if (node.children == vec2i{-1, -1}) continue;
+    auto& operation = node.operation;
+    if (operation.softness < 0) operation.softness = 0;
+    auto [a, b] = node.children;
+    if (operation.blend == 0) forward[i] = forward[a];
+    if (is_hard_union(node) && forward[a] == forward[b])
+      forward[i] = forward[a];
+  }
+  compact_csg(csg, forward);
+}
+
+// Simplifies the tree with simplify_csg and sorts it in post order. Chains of
+// hard unions, and of hard subtractions from a common operand, are
+// reassociated into balanced trees over the operand bounds. Both are exact
+// since min and max are associative. Named operations end the chains, so
+// that their nodes are kept. Smooth unions are left as they are,
+// since smin is not associative and regrouping would change the shape.
+// Identical nodes are then merged by share_csg. Works in place, so that the
+// peak memory stays close to the size of the input tree.
+inline void optimize_csg(CsgTree& csg) {
+  simplify_csg(csg);
+
+  // reachable nodes in post order and their parents
+  auto order   = vector<int>{};
+  order.reserve(csg.nodes.size());
+  auto parents = vector<int>(csg.nodes.size(), -1);
+  auto visited = vector<bool>(csg.nodes.size(), false);
+  auto stack   = vector<pair<int, bool>>{{csg.root, false}};
+  while (!stack.empty()) {
+    auto [n, expanded] = stack.back();
+    stack.pop_back();
+    auto& children = csg.nodes[n].children;
+    if (children != vec2i{-1, -1} && !expanded) {
+      if (visited[n]) continue;
+      visited[n] = true;
+      stack.push_back({n, true});
+      stack.push_back({children.y, false});
+      stack.push_back({children.x, false});
+      parents[children.x] = n;
+      parents[children.y] = n;
+      continue;
+    }
+    if (children == vec2i{-1, -1}) {
+      if (visited[n]) continue;
+      visited[n] = true;
+    }
+    order.push_back(n);
+  }
+  // chains add as many nodes as they have hard operations, so that the nodes,
+  // their bounds and forwarding are reserved once and never copied as they
+  // grow
+  auto capacity = csg.nodes.size();
+  for (auto n : order)
+    capacity += is_hard_union(csg.nodes[n]) ||
+                is_hard_subtraction(csg.nodes[n]);
+  csg.nodes.reserve(capacity);
+  csg.bounds.reserve(capacity);
+  csg.bounds.assign(csg.nodes.size(), {});
+  for (auto n : order) csg.bounds[n] = eval_bounds(csg, csg.nodes[n]);
+
+  auto forward = vector<int>(csg.nodes.size());
+  forward.reserve(capacity);
+  for (auto i = 0; i < forward.size(); i++) forward[i] = i;
+  auto operands = vector<int>{};  // of a chain, reused across chains
+  for (auto n : order) {
+    auto node   = csg.nodes[n];
+    auto parent = parents[n] >= 0 ? csg.nodes[parents[n]] : CsgNode{};
+    if (is_hard_union(node) && (node.name >= 0 || !is_hard_union(parent))) {
+      operands.clear();
+      gather_union(csg, n, operands);
+      if (operands.size() > 2)
+        forward[n] = build_union(csg, forward, operands, node.name);
+    } else if (is_hard_subtraction(node) &&
+               (node.name >= 0 || !is_hard_subtraction(parent) ||
+                   csg.nodes[parents[n]].children.x != n)) {
+      auto& carvers = operands;
+      auto  base    = n;
+      carvers.clear();
+      while (is_hard_subtraction(csg.nodes[base]) &&
+             (base == n || csg.nodes[base].name < 0)) {
+        auto carver = csg.nodes[base].children.y;
+        if (csg.nodes[carver].name >= 0) {
+          carvers.push_back(carver);
+        } else {
+          gather_union(csg, carver, carvers);
+        }
+        base = csg.nodes[base].children.x;
+      }
+      if (carvers.size() < 2) continue;
+      auto carver = build_union(csg, forward, carvers, -1);
+      auto result = node;
+      result.children = {base, carver};
+      csg.nodes.push_back(result);
+      csg.bounds.push_back(eval_bounds(csg, result));
+      forward.push_back(csg.nodes.size() - 1);
+      forward[n] = csg.nodes.size() - 1;
+    }
+  }
+
+  compact_csg(csg, forward);
+  share_csg(csg);
 }
+
+// Optimizes the tree, then replaces the spheres of every hard union with at
+// least `min_size` of them by a single group with a BVH over the spheres.
+inline void group_csg(CsgTree& csg, int min_size = 64) {
+  optimize_csg(csg);
+  auto work    = csg;
+  auto forward = vector<int>(csg.nodes.size());
+  for (auto i = 0; i < forward.size(); i++) forward[i] = i;
+  auto parents = vector<int>(csg.nodes.size(), -1);
+  for (auto i = 0; i < csg.nodes.size(); i++) {
+    auto& children = csg.nodes[i].children;
+    if (children == vec2i{-1, -1}) continue;
+    parents[children.x] = i;
+    parents[children.y] = i;
+  }
+
+  for (auto n = 0; n < csg.nodes.size(); n++) {
+    auto& node = csg.nodes[n];
+    if (!is_hard_union(node)) continue;
+    if (parents[n] >= 0 && is_hard_union(csg.nodes[parents[n]])) continue;
+    auto operands = vector<int>{};
+    gather_union(csg, n, operands);
+    auto group = CsgGroup{};
+    auto rest  = vector<int>{};
+    for (auto k : operands) {
+      auto& primitive = csg.nodes[k].primitive;
+      if (csg.nodes[k].children != vec2i{-1, -1} ||
+          primitive.type != primitive_type::sphere) {
+        rest.push_back(k);
+        continue;
+      }
+      group.centers.push_back(
+          {primitive.params[0], primitive.params[1], primitive.params[2]});
+      group.radius.push_back(primitive.params[3]);
+    }
+    if (group.centers.size() < min_size) continue;
+
+    auto leaf             = add_group(work, std::move(group));
+    work.nodes[leaf].name = node.name;
+    work.bounds.push_back(eval_bounds(work, work.nodes[leaf]));
+    forward.push_back(work.nodes.size() - 1);
+    rest.push_back(work.nodes.size() - 1);
+    forward[n] = rest.size() == 1 ? rest[0]
+                                  : build_union(work, forward, rest, node.name);
+  }
+
+  csg = copy_csg(work, forward);
+}
+
 inline float eval_csg(vector<float>& values, const CsgTree& csg, const vec3f& position) {
   assert(csg.root == csg.nodes.size() - 1);
   assert(values.size() == csg.nodes.size());
   for (int i = 0; i < csg.nodes.size(); i++) {
     auto& inst = csg.nodes[i];
     if (inst.children == vec2i{-1, -1}) {
-      values[i] = eval_primitive(position, inst.primitive);
+      values[i] = eval_leaf(csg, inst, position);
     } else {
       auto f    = values[inst.children.x];
       auto g    = values[inst.children.y];
@@ -142,8 +1399,440 @@ inline float eval_csg(vector<float>& values, const CsgTree& csg, const vec3f& po
   return values.back();
 }
 
+// Uses per-thread scratch, so that repeated calls do not allocate.
 inline float eval_csg(const CsgTree& csg, const vec3f& position) {
-  auto values = vector<float>(csg.nodes.size());
+  thread_local auto values = vector<float>{};
+  values.resize(csg.nodes.size());
   return eval_csg(values, csg, position);
 }
 
+inline interval operator-(const interval& a) { return {-a.max, -a.min}; }
+inline interval operator+(const interval& a, const interval& b) {
+  return {a.min + b.min, a.max + b.max};
+}
+inline interval operator*(const interval& a, float b) {
+  if (b >= 0) return {a.min * b, a.max * b};
+  return {a.max * b, a.min * b};
+}
+inline interval min(const interval& a, const interval& b) {
+  return {yocto::min(a.min, b.min), yocto::min(a.max, b.max)};
+}
+inline interval max(const interval& a, const interval& b) {
+  return {yocto::max(a.min, b.min), yocto::max(a.max, b.max)};
+}
+inline bool contains(const interval& a, float b) {
+  return a.min <= b && b <= a.max;
+}
+
+// smin and smax are non-decreasing in both arguments, so their bounds are
+// the values at the bounds.
+inline interval smin(const interval& a, const interval& b, float k) {
+  return {smin(a.min, b.min, k), smin(a.max, b.max, k)};
+}
+inline interval smax(const interval& a, const interval& b, float k) {
+  return {smax(a.min, b.min, k), smax(a.max, b.max, k)};
+}
+inline interval lerp(const interval& a, const interval& b, float u) {
+  return a * (1 - u) + b * u;
+}
+
+inline interval eval_primitive(
+    const bbox3f& region, const CsgPrimitve& primitive) {
+  auto result = interval{1, 1};
+  auto found  = visit_primitive(primitive.type, [&](auto kind) {
+    result = decltype(kind)::load(primitive.params).eval(region);
+  });
+  if (!found) assert(0);
+  return result;
+}
+
+// Range of the nearest sphere distance over a region. A BVH node is skipped
+// when no sphere in it can lower the upper bound, which also bounds the
+// least lower bound from above.
+inline interval eval_group(const CsgGroup& group, const bbox3f& region) {
+  auto result = interval{flt_max, flt_max};
+  auto stack  = CsgBvhStack{};
+  if (group.bvh.nodes.empty()) return result;
+  stack.push(0);
+  while (!stack.empty()) {
+    auto& node = group.bvh.nodes[stack.pop()];
+    auto  gap  = max(node.bbox.min - region.max, region.min - node.bbox.max);
+    auto  lower = max(gap) > 0 ? length(max(gap, vec3f{0, 0, 0}))
+                               : -min(node.bbox.max - node.bbox.min) / 2;
+    if (lower >= result.max) continue;
+    if (node.internal) {
+      stack.push(node.start);
+      stack.push(node.start + 1);
+    } else {
+      for (auto i = 0; i < node.num; i++) {
+        auto sphere    = group.bvh.primitives[node.start + i];
+        auto primitive = CsgPrimitve{};
+        primitive.type = primitive_type::sphere;
+        for (auto k = 0; k < 3; k++)
+          primitive.params[k] = group.centers[sphere][k];
+        primitive.params[3] = group.radius[sphere];
+        result = min(result, eval_primitive(region, primitive));
+      }
+    }
+  }
+  return result;
+}
+
+// Range of the distance of a mesh over a region, from the one at its center
+// and the half diagonal, since distances change no faster than the points.
+inline interval eval_mesh(const CsgTriangles& mesh, const bbox3f& region) {
+  auto value = eval_mesh(mesh, center(region));
+  auto reach = length(region.max - region.min) / 2;
+  if (value == flt_max) return {flt_max, flt_max};
+  return {value - reach, value + reach};
+}
+
+inline interval eval_operation(
+    const interval& f, const interval& g, const CsgOperation& operation) {
+  if (operation.blend >= 0) {
+    // Union
+    return lerp(f, smin(f, g, operation.softness), operation.blend);
+  } else {
+    // Subtracion
+    return lerp(f, smax(f, -g, operation.softness), -operation.blend);
+  }
+}
+
+inline interval eval_csg_interval(const CsgTree& csg, const bbox3f& region);
+
+// Range over the box of the region in the tree, which contains it.
+inline interval eval_instance(
+    const CsgInstance& instance, const bbox3f& region) {
+  return eval_csg_interval(*instance.tree,
+             fold_bbox(instance.fold,
+                 transform_bbox(instance.inverse, region))) *
+         instance.scale;
+}
+
+// Bounds of the tree over an axis-aligned region.
+inline interval eval_csg_interval(
+    vector<interval>& values, const CsgTree& csg, const bbox3f& region) {
+  assert(csg.root == csg.nodes.size() - 1);
+  assert(values.size() == csg.nodes.size());
+  for (int i = 0; i < csg.nodes.size(); i++) {
+    auto& inst = csg.nodes[i];
+    if (is_group(inst)) {
+      values[i] = eval_group(csg.groups[inst.group], region);
+    } else if (is_mesh(inst)) {
+      values[i] = eval_mesh(csg.meshes[inst.group], region);
+    } else if (is_instance(inst)) {
+      values[i] = eval_instance(csg.instances[inst.group], region);
+    } else if (inst.children == vec2i{-1, -1}) {
+      values[i] = eval_primitive(region, inst.primitive);
+    } else {
+      auto f    = values[inst.children.x];
+      auto g    = values[inst.children.y];
+      values[i] = eval_operation(f, g, inst.operation);
+    }
+  }
+  return values.back();
+}
+
+inline interval eval_csg_interval(const CsgTree& csg, const bbox3f& region) {
+  auto values = vector<interval>(csg.nodes.size());
+  return eval_csg_interval(values, csg, region);
+}
+
+
+// Packet evaluation: every node is visited once for a whole packet of points,
+// so the node type and operation parameters are resolved once per packet.
+// The same templates run on duals to get the gradient along with the value.
+template <typename T>
+inline constexpr bool is_lifted_v = is_packet_v<T> || std::is_same_v<T, dual>;
+
+template <typename T, typename = std::enable_if_t<is_lifted_v<T>>>
+inline T smin(const T& a, const T& b, float k) {
+  if (k == 0) return min(a, b);
+  auto h = max(T{k} - abs(a - b), T{0}) / T{k};
+  return min(a, b) - h * h * T{k * (1.0f / 4.0f)};
+}
+
+template <typename T, typename = std::enable_if_t<is_lifted_v<T>>>
+inline T smax(const T& a, const T& b, float k) {
+  if (k == 0) return max(a, b);
+  auto h = max(T{k} - abs(a - b), T{0}) / T{k};
+  return max(a, b) + h * h * T{k * (1.0f / 4.0f)};
+}
+
+template <typename T, typename = std::enable_if_t<is_lifted_v<T>>>
+inline T lerp(const T& a, const T& b, float u) {
+  if (u == 1) return b;
+  return a * T{1 - u} + b * T{u};
+}
+
+template <typename T>
+inline T eval_primitive(
+    const packet_vec3<T>& position, const CsgPrimitve& primitive) {
+  auto result = T{1};
+  auto found  = visit_primitive(primitive.type, [&](auto kind) {
+    auto shape = decltype(kind)::load(primitive.params);
+    result     = shape.eval(position.x, position.y, position.z);
+  });
+  if (!found) assert(0);
+  return result;
+}
+
+template <typename T, typename = std::enable_if_t<is_lifted_v<T>>>
+inline T eval_operation(const T& f, const T& g, const CsgOperation& operation) {
+  if (operation.blend >= 0) {
+    // Union
+    return lerp(f, smin(f, g, operation.softness), operation.blend);
+  } else {
+    // Subtracion
+    return lerp(f, smax(f, -g, operation.softness), -operation.blend);
+  }
+}
+
+// Groups are searched one lane at a time, since lanes visit different
+// parts of the BVH.
+template <typename T, typename = std::enable_if_t<is_packet_v<T>>>
+inline T eval_group(const CsgGroup& group, const packet_vec3<T>& position) {
+  constexpr auto N = packet_traits<T>::size;
+  float          values[N];
+  for (auto i = 0; i < N; i++)
+    values[i] = eval_group(
+        group, vec3f{position.x[i], position.y[i], position.z[i]});
+  return load_packet(values, (T*)nullptr);
+}
+
+// The gradient is the one of the nearest sphere.
+inline dual eval_group(const CsgGroup& group, const vec3dual& position) {
+  auto [sphere, distance] = nearest_sphere(
+      group, {position.x.value, position.y.value, position.z.value});
+  if (sphere < 0) return {distance, {0, 0, 0}};
+  auto& center = group.centers[sphere];
+  auto  x      = position.x - dual{center.x};
+  auto  y      = position.y - dual{center.y};
+  auto  z      = position.z - dual{center.z};
+  return sqrt(x * x + y * y + z * z) - dual{group.radius[sphere]};
+}
+
+// Meshes are searched one lane at a time too.
+template <typename T, typename = std::enable_if_t<is_packet_v<T>>>
+inline T eval_mesh(const CsgTriangles& mesh, const packet_vec3<T>& position) {
+  constexpr auto N = packet_traits<T>::size;
+  float          values[N];
+  for (auto i = 0; i < N; i++)
+    values[i] = eval_mesh(
+        mesh, vec3f{position.x[i], position.y[i], position.z[i]});
+  return load_packet(values, (T*)nullptr);
+}
+
+// The gradient is the direction from the nearest point, or its normal on
+// the surface.
+inline dual eval_mesh(const CsgTriangles& mesh, const vec3dual& position) {
+  auto nearest = nearest_mesh_point(
+      mesh, {position.x.value, position.y.value, position.z.value});
+  if (nearest.distance == flt_max) return {flt_max, {0, 0, 0}};
+  auto x = position.x - dual{nearest.point.x};
+  auto y = position.y - dual{nearest.point.y};
+  auto z = position.z - dual{nearest.point.z};
+  auto& normal = nearest.normal;
+  auto  plane  = x * dual{normal.x} + y * dual{normal.y} + z * dual{normal.z};
+  if (nearest.distance < 1e-6f) return plane / dual{length(normal)};
+  auto distance = sqrt(x * x + y * y + z * z);
+  return plane.value < 0 ? -distance : distance;
+}
+
+template <typename T>
+inline T eval_csg_packet(
+    vector<T>& values, const CsgTree& csg, const packet_vec3<T>& position);
+
+// Points of a packet, or a dual point, taken by a frame.
+template <typename T>
+inline packet_vec3<T> transform_point(
+    const frame3f& frame, const packet_vec3<T>& position) {
+  auto& [x, y, z] = position;
+  auto  axis      = [&](int k) {
+    return x * T{frame.x[k]} + y * T{frame.y[k]} + z * T{frame.z[k]} +
+           T{frame.o[k]};
+  };
+  return {axis(0), axis(1), axis(2)};
+}
+
+template <typename T, typename = std::enable_if_t<is_lifted_v<T>>>
+inline T eval_instance(
+    const CsgInstance& instance, const packet_vec3<T>& position) {
+  auto values = vector<T>(instance.tree->nodes.size());
+  return eval_csg_packet(values, *instance.tree,
+             fold_point(instance.fold,
+                 transform_point(instance.inverse, position))) *
+         T{instance.scale};
+}
+
+template <typename T>
+inline T eval_csg_packet(
+    vector<T>& values, const CsgTree& csg, const packet_vec3<T>& position) {
+  assert(csg.root == csg.nodes.size() - 1);
+  assert(values.size() == csg.nodes.size());
+  for (int i = 0; i < csg.nodes.size(); i++) {
+    auto& inst = csg.nodes[i];
+    if (is_group(inst)) {
+      values[i] = eval_group(csg.groups[inst.group], position);
+    } else if (is_mesh(inst)) {
+      values[i] = eval_mesh(csg.meshes[inst.group], position);
+    } else if (is_instance(inst)) {
+      values[i] = eval_instance(csg.instances[inst.group], position);
+    } else if (inst.children == vec2i{-1, -1}) {
+      values[i] = eval_primitive(position, inst.primitive);
+    } else {
+      auto& f   = values[inst.children.x];
+      auto& g   = values[inst.children.y];
+      values[i] = eval_operation(f, g, inst.operation);
+    }
+  }
+  return values.back();
+}
+
+inline float8 eval_csg8(
+    vector<float8>& values, const CsgTree& csg, const vec3f8& position) {
+  return eval_csg_packet(values, csg, position);
+}
+
+inline float8 eval_csg8(const CsgTree& csg, const vec3f8& position) {
+  auto values = vector<float8>(csg.nodes.size());
+  return eval_csg_packet(values, csg, position);
+}
+
+inline float16 eval_csg16(
+    vector<float16>& values, const CsgTree& csg, const vec3f16& position) {
+  return eval_csg_packet(values, csg, position);
+}
+
+inline float16 eval_csg16(const CsgTree& csg, const vec3f16& position) {
+  auto values = vector<float16>(csg.nodes.size());
+  return eval_csg_packet(values, csg, position);
+}
+
+// Value and gradient with respect to the position, in a single pass.
+inline dual eval_csg_grad(
+    vector<dual>& values, const CsgTree& csg, const vec3f& position) {
+  return eval_csg_packet(values, csg, make_dual(position));
+}
+
+inline dual eval_csg_grad(const CsgTree& csg, const vec3f& position) {
+  auto values = vector<dual>(csg.nodes.size());
+  return eval_csg_packet(values, csg, make_dual(position));
+}
+
+// Gathers up to a packet of points into SoA form. Missing lanes repeat the
+// last point so that they produce valid, ignorable values.
+template <typename T>
+inline packet_vec3<T> load_points(const vec3f* points, int count) {
+  constexpr auto N = packet_traits<T>::size;
+  float          x[N], y[N], z[N];
+  for (int i = 0; i < N; i++) {
+    auto& p = points[yocto::min(i, count - 1)];
+    x[i]    = p.x;
+    y[i]    = p.y;
+    z[i]    = p.z;
+  }
+  return {load_packet(x, (T*)nullptr), load_packet(y, (T*)nullptr),
+      load_packet(z, (T*)nullptr)};
+}
+
+// Which operand of an operation decides its value everywhere in a region:
+// 0 for none, 1 for f and 2 for g. Operands are dropped only when the
+// operation returns the other one up to rounding, i.e. when they are farther
+// apart than the blend softness.
+inline int dominant_operand(
+    const interval& f, const interval& g, const CsgOperation& operation) {
+  auto k = operation.softness;
+  if (operation.blend == 0) return 1;
+  if (operation.blend > 0) {
+    if (f.max + k <= g.min) return 1;
+    if (g.max + k <= f.min && operation.blend == 1) return 2;
+  } else {
+    if (f.min >= -g.min + k) return 1;
+  }
+  return 0;
+}
+
+// Simplifies the tree for evaluation inside a region, removing the
+// subtrees that cannot affect the value there.
+inline CsgTree specialize_csg(const CsgTree& csg, const bbox3f& region) {
+  auto values = vector<interval>(csg.nodes.size());
+  eval_csg_interval(values, csg, region);
+
+  // node that each node reduces to, in post order
+  auto forward = vector<int>(csg.nodes.size());
+  for (auto i = 0; i < csg.nodes.size(); i++) {
+    auto& node = csg.nodes[i];
+    forward[i] = i;
+    if (node.children == vec2i{-1, -1}) continue;
+    auto [a, b]   = node.children;
+    auto operand = dominant_operand(values[a], values[b], node.operation);
+    if (operand == 1) forward[i] = forward[a];
+    if (operand == 2) forward[i] = forward[b];
+  }
+
+  return copy_csg(csg, forward);
+}
+
+// Simplifies the tree for points whose footprint is wider than `size`, for
+// levels of detail. Features narrower than it, i.e. subtrees whose box
+// grown by the softness of their parent is, are removed where they carve
+// the solid and replaced by the sphere around their box elsewhere, so that
+// the solid only grows, and only near the features. Spheres and shared
+// subtrees are kept.
+inline CsgTree simplify_csg(const CsgTree& csg, float size) {
+  assert(csg.bounds.size() == csg.nodes.size());
+  // paths from the root to each node, up to 2, and whether it is subtracted
+  // an odd number of times along its path
+  auto paths      = vector<int>(csg.nodes.size(), 0);
+  auto carved     = vector<bool>(csg.nodes.size(), false);
+  paths[csg.root] = 1;
+  for (auto i = (int)csg.nodes.size() - 1; i >= 0; i--) {
+    auto& node = csg.nodes[i];
+    if (node.children == vec2i{-1, -1}) continue;
+    auto [f, g] = node.children;
+    paths[f]    = yocto::min(paths[f] + paths[i], 2);
+    paths[g]    = yocto::min(paths[g] + paths[i], 2);
+    carved[f]   = carved[i];
+    carved[g]   = carved[i] != (node.operation.blend < 0);
+  }
+  auto small = [&](int n, float softness) {
+    auto& box = csg.bounds[n];
+    return paths[n] == 1 && is_bounded(box) &&
+           length(box.max - box.min) + 2 * softness < size;
+  };
+
+  // node that each node reduces to, in post order, with the spheres added
+  // after the nodes of the tree
+  auto work    = csg;
+  auto forward = vector<int>(csg.nodes.size());
+  for (auto i = 0; i < csg.nodes.size(); i++) {
+    auto& node = csg.nodes[i];
+    forward[i] = i;
+    if (node.children == vec2i{-1, -1} || small(i, 0)) continue;
+    auto softness = node.operation.softness;
+    for (auto c : {node.children.x, node.children.y}) {
+      auto& child = csg.nodes[c];
+      if (!small(c, softness) || carved[c]) continue;
+      if (child.children == vec2i{-1, -1} && !is_group(child) &&
+          !is_mesh(child) && !is_instance(child))
+        continue;
+      auto& box    = csg.bounds[c];
+      auto  sphere = CsgPrimitve{};
+      auto  center = (box.min + box.max) / 2;
+      sphere.type  = primitive_type::sphere;
+      for (auto k = 0; k < 3; k++) sphere.params[k] = center[k];
+      sphere.params[3] = length(box.max - box.min) / 2;
+      forward[c]       = add_primitive(work, sphere);
+    }
+    // carving features are dropped, but not both operands
+    auto [a, b] = node.children;
+    if (small(a, softness) && carved[a] && node.operation.blend > 0)
+      forward[i] = forward[b];
+    else if (small(b, softness) && carved[b])
+      forward[i] = forward[a];
+  }
+  for (auto n = (int)csg.nodes.size(); n < work.nodes.size(); n++)
+    forward.push_back(n);
+  return copy_csg(work, forward);
+}
@@ -0,0 +1,765 @@
+#include <cstdio>
+#include <filesystem>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#include "batch.h"
+#include "counters.h"
+#include "gpu.h"
+#include "memory.h"
+#include "mesh.h"
+#include "packed.h"
+#include "parser.h"
+#include "raymarch.h"
+#include "sparse.h"
+//
+#include "ext/yocto-gl/yocto/yocto_commonio.h"
+#include "ext/yocto-gl/yocto/yocto_image.h"
+using namespace yocto;
+
+// Times the evaluators, the optimizer, the parser and the raymarcher on
+// synthetic trees, so that changes to them can be compared on the same
+// shapes. Scenes are generated from a fixed seed in the order of the nodes
+// that the parser emits, children first and the root last, and written out
+// as .csg scripts for load_csg:
+//
+// - chain: a deep chain of hard unions, as from a script that adds spheres
+//   to one node line after line
+// - balanced: a balanced tree of hard unions, as from scripts that build
+//   parts and merge them pairwise
+// - clusters: a large sphere with clusters of small spheres carved out of
+//   it and added to it, so that rays pass close to many small features
+// - soft: a chain of soft unions along a random walk, which optimize_csg
+//   leaves as it is
+//
+// Evaluations are timed in ns per point on one thread over random points in
+// the unit box, and rays over a turntable of cameras in Mrays/s with the
+// distance evaluations per ray, then again as the previews of the viewer
+// march them, with approximate math and hits, see march_params, along with
+// the mean difference of their pixels. Results are written as JSON.
+//
+// The hardware counters of each evaluator over the same points, and of the
+// raymarchers over the first view on one thread, are reported side by side
+// as instructions per cycle and misses per thousand instructions, see
+// counters.h, so that changes can be told apart as saving work, misses or
+// mispredicted branches. They are null where the system does not count.
+//
+// With --scaling, the parallel paths are timed instead on more and more
+// threads, pinned to their cores, see bench_scaling. With --compare, every
+// evaluator that is built in is checked against eval_csg_recursive on the
+// trees as generated, see bench_compare, and the tool fails if any of them
+// differs by more than --tolerance.
+//
+// With --golden, the trees of --data and the generated ones are rendered
+// and checked against the images and the budgets of time, steps per ray
+// and peak memory stored in the folder, which --update writes, see
+// bench_golden.
+
+struct CsgBenchScene {
+  string  name = "";
+  CsgTree tree = {};  // in the order of the parser, not optimized
+};
+
+// Random sphere with its center in `center` +- `spread`.
+CsgPrimitve random_sphere(
+    rng_state& rng, const vec3f& center, float spread, vec2f radius) {
+  auto primitive      = CsgPrimitve{};
+  primitive.type      = primitive_type::sphere;
+  auto position       = center + (rand3f(rng) * 2 - 1) * spread;
+  primitive.params[0] = position.x;
+  primitive.params[1] = position.y;
+  primitive.params[2] = position.z;
+  primitive.params[3] = radius.x + rand1f(rng) * (radius.y - radius.x);
+  return primitive;
+}
+
+CsgBenchScene make_chain(int size, rng_state& rng) {
+  auto scene  = CsgBenchScene{"chain"};
+  auto& csg   = scene.tree;
+  auto radius = vec2f{0.02, 0.06};
+  csg.root = add_primitive(csg, random_sphere(rng, {0, 0, 0}, 0.35, radius));
+  for (auto k = 1; k < size; k++) {
+    auto leaf = add_primitive(
+        csg, random_sphere(rng, {0, 0, 0}, 0.35, radius));
+    csg.root  = add_operation(csg, {1, 0}, {csg.root, leaf});
+  }
+  return scene;
+}
+
+CsgBenchScene make_balanced(int size, rng_state& rng) {
+  auto scene  = CsgBenchScene{"balanced"};
+  auto& csg   = scene.tree;
+  auto level  = vector<int>{};
+  auto radius = vec2f{0.02, 0.06};
+  for (auto k = 0; k < size; k++)
+    level.push_back(
+        add_primitive(csg, random_sphere(rng, {0, 0, 0}, 0.35, radius)));
+  while (level.size() > 1) {
+    auto next = vector<int>{};
+    for (auto k = 0; k + 1 < level.size(); k += 2)
+      next.push_back(add_operation(csg, {1, 0}, {level[k], level[k + 1]}));
+    if (level.size() % 2) next.push_back(level.back());
+    level = next;
+  }
+  csg.root = level.front();
+  return scene;
+}
+
+CsgBenchScene make_clusters(int size, rng_state& rng) {
+  auto scene   = CsgBenchScene{"clusters"};
+  auto& csg    = scene.tree;
+  auto base    = CsgPrimitve{{0, 0, 0, 0.3f}, primitive_type::sphere};
+  auto cluster = 16;
+  csg.root     = add_primitive(csg, base);
+  for (auto first = 1; first < size; first += cluster) {
+    auto direction = rand3f(rng) * 2 - 1;
+    auto center    = normalize(direction + vec3f{0, 0, 1e-6f}) * 0.3f;
+    auto radius    = vec2f{0.004, 0.012};
+    auto features  = add_primitive(
+        csg, random_sphere(rng, center, 0.03, radius));
+    for (auto k = first + 1; k < yocto::min(first + cluster, size); k++) {
+      auto leaf = add_primitive(csg, random_sphere(rng, center, 0.03, radius));
+      features  = add_operation(csg, {1, 0}, {features, leaf});
+    }
+    auto blend = rand1f(rng) < 0.5f ? -1.0f : 1.0f;
+    csg.root   = add_operation(csg, {blend, 0.005f}, {csg.root, features});
+  }
+  return scene;
+}
+
+CsgBenchScene make_soft(int size, rng_state& rng) {
+  auto scene    = CsgBenchScene{"soft"};
+  auto& csg     = scene.tree;
+  auto position = vec3f{0, 0, 0};
+  auto radius   = vec2f{0.02, 0.04};
+  csg.root      = add_primitive(csg, random_sphere(rng, position, 0, radius));
+  for (auto k = 1; k < size; k++) {
+    position = clamp(position + (rand3f(rng) * 2 - 1) * 0.04f, -0.35f, 0.35f);
+    auto leaf = add_primitive(csg, random_sphere(rng, position, 0, radius));
+    csg.root  = add_operation(csg, {1, 0.03f}, {csg.root, leaf});
+  }
+  return scene;
+}
+
+// Writes the tree as a script that the parser reads back to the same nodes.
+// Nodes take the name of their leftmost leaf, and leaves that are the
+// second operand of their parent are written inline, e.g.
+// `n0 += 1 0.05 sphere 0 0 0 0.1`.
+void save_bench_csg(const string& filename, const CsgTree& csg) {
+  auto fs      = open_file(filename, "wb");
+  auto names   = vector<int>(csg.nodes.size());
+  auto operand = vector<bool>(csg.nodes.size(), false);
+  for (auto i = 0; i < csg.nodes.size(); i++) {
+    auto& node = csg.nodes[i];
+    names[i]   = node.children == vec2i{-1, -1} ? i : names[node.children.x];
+    if (node.children != vec2i{-1, -1}) {
+      auto child = node.children.y;
+      if (csg.nodes[child].children == vec2i{-1, -1}) operand[child] = true;
+    }
+  }
+  auto sphere = [](const CsgPrimitve& primitive) {
+    auto& p = primitive.params;
+    char  buffer[128];
+    snprintf(buffer, sizeof(buffer), "sphere %g %g %g %g", p[0], p[1], p[2],
+        p[3]);
+    return string{buffer};
+  };
+  for (auto i = 0; i < csg.nodes.size(); i++) {
+    auto& node = csg.nodes[i];
+    if (node.children == vec2i{-1, -1}) {
+      if (!operand[i])
+        fprintf(fs.fs, "n%d = %s\n", i, sphere(node.primitive).c_str());
+      continue;
+    }
+    auto [a, b]     = node.children;
+    auto& operation = node.operation;
+    auto  rhs = operand[b] ? sphere(csg.nodes[b].primitive)
+                           : "n" + std::to_string(names[b]);
+    fprintf(fs.fs, "n%d %s %g %g %s\n", names[a],
+        operation.blend < 0 ? "-=" : "+=", std::abs(operation.blend),
+        operation.softness, rhs.c_str());
+  }
+}
+
+// Random points in the unit box, in the space of the trees.
+vector<vec3f> bench_points(int num, uint64_t seed) {
+  auto rng    = make_rng(seed);
+  auto points = vector<vec3f>(num);
+  for (auto& point : points) point = rand3f(rng) - 0.5f;
+  return points;
+}
+
+// Nanoseconds per call of `eval` over the points, on one thread.
+template <typename Eval>
+double time_evals(const vector<vec3f>& points, Eval&& eval) {
+  auto sink  = 0.0f;
+  auto start = get_time();
+  for (auto& point : points) sink += eval(point);
+  auto elapsed = get_time() - start;
+  // keeps the calls from being dropped
+  if (sink == flt_max) printf("%g\n", sink);
+  return (double)elapsed / yocto::max((int)points.size(), 1);
+}
+
+// Times the evaluators, the optimizer and the parser on the scene, and the
+// raymarcher from each camera.
+string bench_scene(const CsgBenchScene& scene, const vector<vec3f>& points,
+    const vector<trace_camera>& cameras, const trace_params& params) {
+  auto folder   = std::filesystem::temp_directory_path();
+  auto filename = (folder / ("csg_bench_" + scene.name + ".csg")).string();
+  save_bench_csg(filename, scene.tree);
+  auto start  = get_time();
+  auto loaded = load_csg(filename);
+  auto load   = get_time() - start;
+  std::filesystem::remove(filename);
+
+  auto csg = scene.tree;
+  start    = get_time();
+  optimize_csg(csg);
+  auto optimize = get_time() - start;
+
+  // counts of each backend, in the order they run
+  auto counters = open_counters();
+  auto counts   = vector<pair<string, CsgCounts>>{};
+  auto counted  = [&](const string& name, auto&& run) {
+    start_counters(counters);
+    auto result = run();
+    counts.push_back({name, stop_counters(counters)});
+    return result;
+  };
+  auto timed = [&](const string& name, auto&& eval) {
+    return counted(name, [&] { return time_evals(points, eval); });
+  };
+
+  auto values    = vector<float>(csg.nodes.size());
+  auto tape      = compile_csg(csg);
+  auto jit       = compile_jit(tape);
+  auto flat      = timed("eval_csg", [&](const vec3f& point) {
+    return eval_csg(values, csg, point);
+  });
+  auto recursive = timed("eval_csg_recursive", [&](const vec3f& point) {
+    return eval_csg_recursive(csg, point);
+  });
+  auto taped     = timed("eval_tape", [&](const vec3f& point) {
+    return eval_tape(tape, point);
+  });
+  auto pruning   = compile_csg(csg, 0.01f, true);
+  auto pruned    = timed("eval_tape_prune", [&](const vec3f& point) {
+    return eval_tape(pruning, point);
+  });
+  if (is_valid(jit))
+    timed("eval_jit", [&](const vec3f& point) {
+      return eval_jit(jit, tape, point);
+    });
+  auto batch     = vector<float>(points.size());
+  auto serial    = CsgBatchOptions{};
+  serial.parallel = false;
+  counted("eval_csg_batch", [&] {
+    eval_csg_batch(tape, points, batch, serial);
+    return 0;
+  });
+
+  auto stats   = march_stats{};
+  auto elapsed = (int64_t)0;
+  auto renders = vector<image<vec4f>>{};
+  for (auto& camera : cameras) {
+    auto march = frame_march({}, csg, camera, params, false);
+    start      = get_time();
+    renders.push_back(
+        raymarch_image(camera, tape, jit, nullptr, march, params, &stats));
+    elapsed += get_time() - start;
+  }
+  auto rays  = (double)std::max(stats.rays.load(), (int64_t)1);
+  auto steps = (double)stats.steps.load();
+
+  // previews with approximate math and hits, and their mean difference
+  // from the exact renders over the pixels and channels
+  auto fast       = compile_jit(tape, true);
+  auto fast_stats = march_stats{};
+  auto fast_time  = (int64_t)0;
+  auto difference = 0.0;
+  auto pixels     = (size_t)0;
+  for (auto view = 0; view < cameras.size(); view++) {
+    auto march        = frame_march({}, csg, cameras[view], params, false);
+    march.approximate = true;
+    start             = get_time();
+    auto render       = raymarch_image(cameras[view], tape,
+        is_valid(fast) ? fast : jit, nullptr, march, params, &fast_stats);
+    fast_time += get_time() - start;
+    auto& exact = renders[view];
+    for (auto k = (size_t)0; k < render.count(); k++)
+      difference += sum(abs(render.data()[k] - exact.data()[k])) / 4;
+    pixels += render.count();
+  }
+  auto fast_rays = (double)std::max(fast_stats.rays.load(), (int64_t)1);
+
+  // counters are of the calling thread, so the marches run on it alone
+  set_pool_threads(get_pool(), 1);
+  for (auto approximate : {false, true}) {
+    auto march        = frame_march({}, csg, cameras.front(), params, false);
+    march.approximate = approximate;
+    auto& code        = approximate && is_valid(fast) ? fast : jit;
+    counted(approximate ? "raymarch_approximate" : "raymarch", [&] {
+      return raymarch_image(
+          cameras.front(), tape, code, nullptr, march, params);
+    });
+  }
+  set_pool_threads(get_pool(), 0);
+  auto counting = is_counting(counters);
+  close_counters(counters);
+  auto counted_json = string{"null"};
+  if (counting) {
+    counted_json = "{";
+    for (auto& [name, count] : counts)
+      counted_json += (counted_json.size() > 1 ? ", \"" : "\"") + name +
+                      "\": " + counts_json(count);
+    counted_json += "}";
+  }
+
+  char buffer[1024];
+  snprintf(buffer, sizeof(buffer),
+      "    {\"name\": \"%s\", \"nodes\": %d, \"optimized\": %d, "
+      "\"loaded\": %d, \"load_ms\": %.3f, \"optimize_ms\": %.3f, "
+      "\"eval_csg_ns\": %.2f, \"eval_csg_recursive_ns\": %.2f, "
+      "\"eval_tape_ns\": %.2f, \"eval_tape_prune_ns\": %.2f, "
+      "\"mrays_per_s\": %.3f, \"steps_per_ray\": %.2f, "
+      "\"approximate_mrays_per_s\": %.3f, "
+      "\"approximate_steps_per_ray\": %.2f, \"approximate_error\": %.5f, ",
+      scene.name.c_str(), (int)scene.tree.nodes.size(),
+      (int)csg.nodes.size(), (int)loaded.nodes.size(), load * 1e-6,
+      optimize * 1e-6, flat, recursive, taped, pruned,
+      rays / std::max(elapsed, (int64_t)1) * 1e3, steps / rays,
+      fast_rays / std::max(fast_time, (int64_t)1) * 1e3,
+      fast_stats.steps.load() / fast_rays,
+      difference / std::max(pixels, (size_t)1));
+  return buffer + ("\"counters\": "s + counted_json + "}");
+}
+
+// Pins the workers of the pool and the calling thread to a core each, in
+// the order of the cores the process may run on, so that runs with few
+// threads are not moved around by the scheduler. Only on Linux.
+void pin_pool_threads(CsgPool& pool) {
+#ifdef __linux__
+  auto allowed = cpu_set_t{};
+  CPU_ZERO(&allowed);
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) return;
+  auto cpus = vector<int>{};
+  for (auto cpu = 0; cpu < CPU_SETSIZE; cpu++)
+    if (CPU_ISSET(cpu, &allowed)) cpus.push_back(cpu);
+  if (cpus.empty()) return;
+  auto pin = [&](pthread_t thread, int index) {
+    auto set = cpu_set_t{};
+    CPU_ZERO(&set);
+    CPU_SET(cpus[index % cpus.size()], &set);
+    pthread_setaffinity_np(thread, sizeof(set), &set);
+  };
+  pin(pthread_self(), 0);
+  for (auto worker = 0; worker < pool.threads.size(); worker++)
+    pin(pool.threads[worker].native_handle(), worker + 1);
+#endif
+}
+
+// Times the parallel paths on 1, 2, 4... up to `threads` threads, see
+// set_pool_threads: the raymarcher, the dense and sparse bakers, meshing
+// and the batch evaluator. Each time is the best of three runs. Speedups
+// are over one thread, and efficiencies are speedups per thread, so that
+// contention shows up as efficiencies that drop with the threads.
+string bench_scaling(const CsgBenchScene& scene, const vector<vec3f>& points,
+    const vector<trace_camera>& cameras, const trace_params& params,
+    int threads) {
+  auto csg = scene.tree;
+  optimize_csg(csg);
+  auto tape   = compile_csg(csg);
+  auto jit    = compile_jit(tape);
+  auto bounds = bbox3f{{-0.5, -0.5, -0.5}, {0.5, 0.5, 0.5}};
+  auto values = vector<float>(points.size());
+  auto paths  = vector<pair<string, std::function<void()>>>{
+      {"raymarch",
+          [&] {
+            for (auto& camera : cameras) {
+              auto march = frame_march({}, csg, camera, params, false);
+              raymarch_image(camera, tape, jit, nullptr, march, params);
+            }
+          }},
+      {"bake_grid", [&] { bake_csg_grid(csg, bounds, 128); }},
+      {"bake_sparse", [&] { bake_csg_sparse(csg, bounds, 256); }},
+      {"mesh", [&] { mesh_csg(csg, bounds, 128); }},
+      {"eval_batch",
+          [&] {
+            eval_csg_batch(tape, {points.data(), points.size()}, values);
+          }},
+  };
+
+  auto counts = vector<int>{};
+  for (auto count = 1; count < threads; count *= 2) counts.push_back(count);
+  counts.push_back(threads);
+
+  auto json = string{};
+  for (auto& [name, run] : paths) {
+    auto times = vector<double>{};
+    for (auto count : counts) {
+      set_pool_threads(get_pool(), count);
+      auto best = std::numeric_limits<double>::max();
+      for (auto repeat = 0; repeat < 3; repeat++) {
+        auto start = get_time();
+        run();
+        best = std::min(best, (get_time() - start) * 1e-6);
+      }
+      times.push_back(best);
+    }
+    set_pool_threads(get_pool(), 0);
+
+    json += json.empty() ? "" : ",\n";
+    json += "    {\"scene\": \"" + scene.name + "\", \"path\": \"" + name +
+            "\", \"runs\": [";
+    for (auto k = 0; k < counts.size(); k++) {
+      auto speedup = times[0] / times[k];
+      char buffer[256];
+      snprintf(buffer, sizeof(buffer),
+          "%s\n      {\"threads\": %d, \"ms\": %.3f, \"speedup\": %.2f, "
+          "\"efficiency\": %.2f}",
+          k ? "," : "", counts[k], times[k], speedup, speedup / counts[k]);
+      json += buffer;
+    }
+    json += "]}";
+  }
+  return json;
+}
+
+// Errors of an evaluator against the reference values, and its speed.
+struct CsgBenchError {
+  string name      = "";
+  double max       = 0;
+  double rms       = 0;
+  double ns        = 0;  // per point
+  float  tolerance = 0;
+};
+
+CsgBenchError bench_error(const string& name, const vector<float>& values,
+    const vector<float>& reference, double ns, float tolerance) {
+  auto error = CsgBenchError{name, 0, 0, ns, tolerance};
+  for (auto k = 0; k < values.size(); k++) {
+    auto difference = std::abs((double)values[k] - reference[k]);
+    // a value that is not a number fails even the largest tolerance
+    if (!(difference <= flt_max)) difference = flt_max;
+    error.max = std::max(error.max, difference);
+    error.rms += difference * difference;
+  }
+  error.rms = std::sqrt(error.rms / yocto::max((int)values.size(), 1));
+  return error;
+}
+
+// Evaluates the points with each evaluator that is built in, i.e. the
+// linear and packed trees, the tape, the batch kernel, the JIT and the GPU,
+// and compares them to the recursive evaluation of the tree before
+// optimize_csg, so that the optimizer is checked too. Grids only match
+// within their cells, so they are checked against the size of a cell.
+// Evaluators run on one thread, but for the GPU. Sets `passed` to false if
+// any of them is off by more than its tolerance.
+string bench_compare(const CsgBenchScene& scene, const vector<vec3f>& points,
+    float tolerance, bool& passed) {
+  auto num       = (int)points.size();
+  auto reference = vector<float>(num);
+  for (auto k = 0; k < num; k++)
+    reference[k] = eval_csg_recursive(scene.tree, points[k]);
+
+  auto csg    = scene.tree;
+  optimize_csg(csg);
+  auto tape   = compile_csg(csg, flt_max);
+  auto values = vector<float>(num);
+  auto errors = vector<CsgBenchError>{};
+  auto check  = [&](const string& name, auto&& eval, float tolerance) {
+    auto start = get_time();
+    eval();
+    auto ns = (double)(get_time() - start) / yocto::max(num, 1);
+    errors.push_back(bench_error(name, values, reference, ns, tolerance));
+  };
+
+  check("eval_csg", [&] {
+    auto scratch = vector<float>(csg.nodes.size());
+    for (auto k = 0; k < num; k++)
+      values[k] = eval_csg(scratch, csg, points[k]);
+  }, tolerance);
+  auto packed = pack_csg(csg);
+  check("packed", [&] {
+    auto scratch = vector<float>(packed.types.size());
+    for (auto k = 0; k < num; k++)
+      values[k] = eval_csg(scratch, packed, points[k]);
+  }, tolerance);
+  check("tape", [&] {
+    for (auto k = 0; k < num; k++) values[k] = eval_tape(tape, points[k]);
+  }, tolerance);
+  auto& kernel = get_kernel();
+  check(string{"batch_"} + kernel.name, [&] {
+    kernel.eval(tape, points.data(), values.data(), num);
+  }, tolerance);
+  auto jit = compile_jit(tape);
+  if (is_valid(jit)) {
+    check("jit", [&] {
+      for (auto k = 0; k < num; k++)
+        values[k] = eval_jit(jit, tape, points[k]);
+    }, tolerance);
+  }
+  if (is_valid(get_gpu())) {
+    check("gpu", [&] {
+      eval_csg_batch_gpu(get_gpu(), tape, {points.data(), points.size()},
+          values);
+    }, tolerance);
+  }
+  auto bounds = bbox3f{{-0.5, -0.5, -0.5}, {0.5, 0.5, 0.5}};
+  auto grid   = bake_csg_grid(csg, bounds, 128);
+  check("grid", [&] {
+    for (auto k = 0; k < num; k++) values[k] = eval_grid(grid, points[k]);
+  }, yocto::max(grid_cell(grid)));
+
+  auto json = "    {\"name\": \"" + scene.name + "\", \"evaluators\": [";
+  for (auto& error : errors) {
+    auto pass = error.max <= error.tolerance;
+    passed    = passed && pass;
+    char buffer[256];
+    snprintf(buffer, sizeof(buffer),
+        "%s\n      {\"name\": \"%s\", \"max_error\": %g, "
+        "\"rms_error\": %g, \"tolerance\": %g, \"ns_per_eval\": %.2f, "
+        "\"pass\": %s}",
+        &error == &errors.front() ? "" : ",", error.name.c_str(), error.max,
+        error.rms, error.tolerance, error.ns, pass ? "true" : "false");
+    json += buffer;
+  }
+  return json + "]}";
+}
+
+// Time and steps per ray of a view, as recorded in the golden folder.
+struct CsgBenchBudget {
+  double ms    = 0;
+  double steps = 0;
+};
+
+// Budgets of golden.txt, one line per view as its name, its time in ms and
+// its steps per ray, and a line `peak_kb` with the memory of the run.
+unordered_map<string, CsgBenchBudget> load_budgets(
+    const string& filename, int64_t& peak) {
+  auto fs      = open_file(filename, "rb");
+  auto budgets = unordered_map<string, CsgBenchBudget>{};
+  char buffer[4096], name[1024];
+  while (read_line(fs, buffer, sizeof(buffer))) {
+    if (buffer[0] == '#') continue;
+    auto budget = CsgBenchBudget{};
+    auto kb     = (long long)0;
+    if (sscanf(buffer, "peak_kb %lld", &kb) == 1) {
+      peak = kb;
+    } else if (sscanf(buffer, "%1023s %lf %lf", name, &budget.ms,
+                   &budget.steps) == 3) {
+      budgets[name] = budget;
+    }
+  }
+  return budgets;
+}
+
+// Renders each tree from each camera with the seed of `params`, and checks
+// that the images match those of the folder, e.g. `test.0000.png`, within
+// `threshold` in every channel, and that the views take at most `slack`
+// more time than recorded, and no more steps per ray. The peak memory of
+// the run is checked with the same slack. With `update`, the images and
+// the budgets are written instead. Sets `passed` to false if any check
+// fails.
+string bench_golden(const vector<pair<string, CsgTree>>& trees,
+    const vector<trace_camera>& cameras, const trace_params& params,
+    const string& folder, bool update, float threshold, float slack,
+    bool& passed) {
+  auto path    = std::filesystem::path{folder};
+  auto record  = (path / "golden.txt").string();
+  auto peak    = (int64_t)0;
+  auto budgets = unordered_map<string, CsgBenchBudget>{};
+  if (update) {
+    std::filesystem::create_directories(path);
+  } else {
+    budgets = load_budgets(record, peak);
+  }
+
+  auto json  = string{};
+  auto lines = string{"# name ms steps_per_ray\n"};
+  for (auto& [tree_name, csg] : trees) {
+    auto tape = compile_csg(csg);
+    auto jit  = compile_jit(tape);
+    for (auto view = 0; view < cameras.size(); view++) {
+      auto& camera = cameras[view];
+      char  index[16];
+      snprintf(index, sizeof(index), ".%04d", view);
+      auto  name   = tree_name + index;
+      auto  march  = frame_march({}, csg, camera, params, false);
+      auto  stats  = march_stats{};
+      auto  start  = get_time();
+      auto  render = raymarch_image(
+          camera, tape, jit, nullptr, march, params, &stats);
+      auto ms    = (get_time() - start) * 1e-6;
+      auto steps = (double)stats.steps / std::max(stats.rays.load(),
+                                             (int64_t)1);
+      auto imagename = (path / (name + ".png")).string();
+      if (update) {
+        save_image(imagename, render);
+        char buffer[1024];
+        snprintf(buffer, sizeof(buffer), "%s %.3f %.3f\n", name.c_str(), ms,
+            steps);
+        lines += buffer;
+        continue;
+      }
+
+      auto budget     = budgets.count(name) ? budgets.at(name)
+                                            : CsgBenchBudget{};
+      auto golden     = image<vec4f>{};
+      auto difference = flt_max;
+      if (budgets.count(name) && std::filesystem::exists(imagename)) {
+        golden = load_image(imagename);
+        if (golden.size() == render.size()) {
+          difference = 0;
+          for (auto& pixel : image_difference(golden, render, false))
+            difference = yocto::max(difference, yocto::max(pixel));
+        }
+      }
+      auto pass = difference <= threshold &&
+                  ms <= budget.ms * (1 + slack) &&
+                  steps <= budget.steps * 1.001 + 0.001;
+      passed = passed && pass;
+      char buffer[512];
+      snprintf(buffer, sizeof(buffer),
+          "%s\n    {\"name\": \"%s\", \"ms\": %.3f, \"budget_ms\": %.3f, "
+          "\"steps_per_ray\": %.3f, \"budget_steps_per_ray\": %.3f, "
+          "\"difference\": %g, \"pass\": %s}",
+          json.empty() ? "" : ",", name.c_str(), ms, budget.ms, steps,
+          budget.steps, difference, pass ? "true" : "false");
+      json += buffer;
+    }
+  }
+
+  auto memory = peak_memory();
+  if (update) {
+    lines += "peak_kb " + std::to_string(memory) + "\n";
+    auto fs = open_file(record, "wb");
+    fwrite(lines.data(), 1, lines.size(), fs.fs);
+    return "\n    {\"updated\": \"" + record + "\", \"peak_kb\": " +
+           std::to_string(memory) + "}";
+  }
+  auto pass = memory <= peak * (1 + slack);
+  passed    = passed && pass;
+  return json + ",\n    {\"peak_kb\": " + std::to_string(memory) +
+         ", \"budget_peak_kb\": " + std::to_string(peak) +
+         ", \"pass\": " + (pass ? "true" : "false") + "}";
+}
+
+int main(int argc, const char* argv[]) {
+  auto size       = 1024;
+  auto num_points = 100000;
+  auto frames     = 4;
+  auto only       = ""s;
+  auto outname    = ""s;
+  auto scaling    = false;
+  auto threads    = 0;
+  auto compare    = false;
+  auto tolerance  = 1e-4f;
+  auto golden     = ""s;
+  auto data       = "data"s;
+  auto update     = false;
+  auto threshold  = 0.02f;
+  auto slack      = 0.5f;
+  auto params     = trace_params{};
+  params.resolution = 256;
+  params.samples    = 1;
+  auto cli = make_cli("csg_bench", "Time the evaluators on synthetic trees");
+  add_cli_option(cli, "--size,-n", size, "Primitives of each scene");
+  add_cli_option(cli, "--points,-p", num_points, "Points of the evaluations");
+  add_cli_option(cli, "--resolution,-r", params.resolution, "Image size");
+  add_cli_option(cli, "--samples,-s", params.samples, "Samples per pixel");
+  add_cli_option(cli, "--frames,-f", frames, "Views of the turntable");
+  add_cli_option(cli, "--scene", only, "Only run the scene of this name");
+  add_cli_option(cli, "--scaling", scaling, "Time the paths over threads");
+  add_cli_option(cli, "--threads,-t", threads, "Most threads of --scaling");
+  add_cli_option(cli, "--compare", compare, "Check the evaluators agree");
+  add_cli_option(cli, "--tolerance", tolerance, "Largest error of --compare");
+  add_cli_option(cli, "--golden", golden, "Check renders against this folder");
+  add_cli_option(cli, "--data", data, "Folder of the .csg files of --golden");
+  add_cli_option(cli, "--update", update, "Write the images of --golden");
+  add_cli_option(cli, "--threshold", threshold, "Largest pixel difference");
+  add_cli_option(cli, "--slack", slack, "Extra time and memory of --golden");
+  add_cli_option(cli, "--output,-o", outname, "JSON filename, or stdout");
+  parse_cli(cli, argc, argv);
+  if (size < 1) {
+    printf("--size must be positive\n");
+    return 1;
+  }
+  if ((int)scaling + (int)compare + (int)!golden.empty() > 1) {
+    printf("--scaling, --compare and --golden cannot be used together\n");
+    return 1;
+  }
+
+  auto rng    = make_rng(7);
+  auto scenes = vector<CsgBenchScene>{};
+  scenes.push_back(make_chain(size, rng));
+  scenes.push_back(make_balanced(size, rng));
+  scenes.push_back(make_clusters(size, rng));
+  scenes.push_back(make_soft(size, rng));
+  if (!only.empty()) {
+    auto match = [&](const CsgBenchScene& scene) { return scene.name != only; };
+    scenes.erase(std::remove_if(scenes.begin(), scenes.end(), match),
+        scenes.end());
+    if (scenes.empty()) {
+      printf("unknown scene %s\n", only.c_str());
+      return 1;
+    }
+  }
+
+  auto points  = bench_points(num_points, 13);
+  auto cameras = turntable_cameras(frames);
+  auto json    = string{"{\n  \"scenes\": ["};
+  if (scaling) {
+    pin_pool_threads(get_pool());
+    threads = threads > 0 ? threads : pool_threads(get_pool());
+    json    = "{\n  \"scaling\": [";
+  }
+  if (compare) json = "{\n  \"compare\": [";
+  auto passed = true;
+  if (!golden.empty()) {
+    auto trees = vector<pair<string, CsgTree>>{};
+    if (std::filesystem::is_directory(data)) {
+      auto filenames = vector<string>{};
+      for (auto& entry : std::filesystem::directory_iterator(data))
+        if (entry.path().extension() == ".csg")
+          filenames.push_back(entry.path().string());
+      std::sort(filenames.begin(), filenames.end());
+      for (auto& filename : filenames)
+        trees.push_back({std::filesystem::path{filename}.stem().string(),
+            load_csg(filename)});
+    }
+    for (auto& scene : scenes) {
+      trees.push_back({scene.name, scene.tree});
+      optimize_csg(trees.back().second);
+    }
+    json = "{\n  \"golden\": [" +
+           bench_golden(trees, cameras, params, golden, update, threshold,
+               slack, passed);
+    scenes.clear();
+  }
+  for (auto& scene : scenes) {
+    json += &scene == &scenes.front() ? "\n" : ",\n";
+    if (compare) {
+      json += bench_compare(scene, points, tolerance, passed);
+    } else if (scaling) {
+      json += bench_scaling(scene, points, cameras, params, threads);
+    } else {
+      json += bench_scene(scene, points, cameras, params);
+    }
+  }
+  json += "\n  ]";
+  if (compare || (!golden.empty() && !update))
+    json += passed ? ",\n  \"passed\": true" : ",\n  \"passed\": false";
+  json += "\n}\n";
+
+  if (outname.empty()) {
+    printf("%s", json.c_str());
+  } else {
+    auto fs = open_file(outname, "wb");
+    fwrite(json.data(), 1, json.size(), fs.fs);
+  }
+  return passed ? 0 : 1;
+}
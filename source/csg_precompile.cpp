@@ -0,0 +1,168 @@
+#include <filesystem>
+#include <fstream>
+#include <mutex>
+
+#include "grid_io.h"
+#include "jit.h"
+#include "parser.h"
+#include "tape_io.h"
+#include "tree_io.h"
+//
+#include "ext/yocto-gl/yocto/yocto_commonio.h"
+using namespace yocto;
+
+// Precompiles the .csg files of a folder and its subfolders, so that the
+// viewer, the server and Python start from warm caches. Each file is parsed,
+// optimized and bounded, and saved as a .csgb next to it, or at the same
+// path under --output. Its tapes are written to the tape cache, with guards
+// as renders compile them and exact as CsgCompiled does, see tape_io.h, their
+// code to the JIT cache with --jit, and the preview grid of --grid samples
+// to the grid cache, see grid_io.h. Files are processed in parallel, and
+// large ones also parse and bake in parallel. Timings of tuner.h are not
+// cached, since they depend on the machine that opens the scene.
+//
+// Files are skipped when their contents did not change since the last run,
+// as told by a hash of their bytes and of the options kept in a manifest in
+// the output folder, and their .csgb is there. Included files, meshes and
+// spheres are not hashed, so files that use them changed should be given
+// with --force. Trees with instances or meshes are cached but not saved as
+// .csgb, which does not store them.
+
+struct CsgPrecompiled {
+  string   path  = "";  // relative to the folder
+  uint64_t hash  = 0;   // of the contents and the options
+  bool     saved = false;
+  string   error = "";
+};
+
+// Hash of the bytes of the file mixed with `seed`.
+inline uint64_t file_hash(const string& filename, uint64_t seed) {
+  auto mapping = file_mapping{};
+  map_file(mapping, filename);
+  return hash_bytes(seed, mapping.data.data(), mapping.data.size());
+}
+
+inline std::unordered_map<string, uint64_t> load_manifest(
+    const string& filename) {
+  auto manifest = std::unordered_map<string, uint64_t>{};
+  auto fs       = std::ifstream{filename};
+  auto magic    = string{};
+  if (!std::getline(fs, magic) || magic != "csgprecompile1") return {};
+  for (auto line = string{}; std::getline(fs, line);) {
+    auto space = line.find(' ');
+    if (space == string::npos) continue;
+    manifest[line.substr(space + 1)] = std::stoull(line.substr(0, space));
+  }
+  return manifest;
+}
+
+// Writes the hashes of the files that were precompiled, by path, and
+// renames the file in place as save_grid_file.
+inline bool save_manifest(
+    const string& filename, const vector<CsgPrecompiled>& files) {
+  auto temporary = filename + ".tmp" + std::to_string(process_id());
+  auto fs        = fopen(temporary.c_str(), "w");
+  if (!fs) return false;
+  fprintf(fs, "csgprecompile1\n");
+  for (auto& file : files)
+    if (file.error.empty())
+      fprintf(fs, "%llu %s\n", (unsigned long long)file.hash,
+          file.path.c_str());
+  auto ok    = fclose(fs) == 0;
+  auto error = std::error_code{};
+  if (ok) std::filesystem::rename(temporary, filename, error);
+  if (!ok || error) std::filesystem::remove(temporary, error);
+  return ok && !error;
+}
+
+int main(int argc, const char* argv[]) {
+  auto folder     = ""s;
+  auto output     = ""s;
+  auto resolution = 128;
+  auto jit        = false;
+  auto force      = false;
+  auto cli        = make_cli("csg_precompile", "Precompile a folder of trees");
+  add_cli_option(cli, "--output,-o", output, "Folder of the .csgb files");
+  add_cli_option(cli, "--grid", resolution, "Samples of the grid, 0 for none");
+  add_cli_option(cli, "--jit", jit, "Build the native code of the tapes");
+  add_cli_option(cli, "--force", force, "Precompile unchanged files too");
+  add_cli_option(cli, "folder", folder, "Folder of .csg files");
+  parse_cli(cli, argc, argv);
+  if (resolution != 0 && resolution < 2) {
+    printf("--grid takes 0 or at least 2 samples\n");
+    return 1;
+  }
+  if (output.empty()) output = folder;
+
+  auto start = get_time();
+  auto root  = std::filesystem::path{folder};
+  auto files = vector<CsgPrecompiled>{};
+  auto error = std::error_code{};
+  using directory_iterator = std::filesystem::recursive_directory_iterator;
+  for (auto it = directory_iterator{root, error};
+       !error && it != directory_iterator{}; it.increment(error)) {
+    if (!it->is_regular_file() || it->path().extension() != ".csg") continue;
+    files.push_back({std::filesystem::relative(it->path(), root).string()});
+  }
+  if (error) {
+    printf("%s: %s\n", folder.c_str(), error.message().c_str());
+    return 1;
+  }
+  std::sort(files.begin(), files.end(),
+      [](auto& a, auto& b) { return a.path < b.path; });
+
+  // options that change the outputs, so that changing them redoes the files
+  auto options     = mix_hash((uint64_t)resolution, (uint64_t)jit);
+  auto manifest    = (std::filesystem::path{output} / "precompile.txt")
+                      .string();
+  auto hashes      = force ? std::unordered_map<string, uint64_t>{}
+                           : load_manifest(manifest);
+  auto skipped     = std::atomic<int>{0};
+  auto print_mutex = std::mutex{};
+  auto bounds      = bbox3f{{-0.5, -0.5, -0.5}, {0.5, 0.5, 0.5}};
+  parallel_for(
+      (int)files.size(),
+      [&](int index) {
+        auto& file   = files[index];
+        auto  source = (root / file.path).string();
+        auto  binary = (std::filesystem::path{output} / file.path)
+                          .replace_extension(".csgb");
+        try {
+          file.hash  = file_hash(source, options);
+          auto found = hashes.find(file.path);
+          if (found != hashes.end() && found->second == file.hash &&
+              std::filesystem::exists(binary)) {
+            skipped += 1;
+            return;
+          }
+          auto csg = load_csg(source);
+          if (csg.root < 0) throw std::runtime_error{"empty tree"};
+          update_bounds(csg);
+          auto tape = compile_csg_cached(csg);
+          compile_csg_cached(csg, flt_max);
+          if (jit) compile_jit(tape);
+          if (resolution) bake_csg_grid_cached(csg, bounds, resolution);
+          auto ignored = std::error_code{};
+          std::filesystem::create_directories(binary.parent_path(), ignored);
+          file.saved = save_csgb(binary.string(), csg);
+        } catch (std::exception& exception) {
+          file.error = exception.what();
+        }
+        auto lock = std::lock_guard{print_mutex};
+        if (!file.error.empty()) {
+          printf("%s: %s\n", file.path.c_str(), file.error.c_str());
+        } else if (!file.saved) {
+          printf("%s: cached, but not saved as .csgb\n", file.path.c_str());
+        }
+      },
+      csg_priority::background);
+
+  auto failed = 0;
+  for (auto& file : files) failed += !file.error.empty();
+  if (!save_manifest(manifest, files))
+    printf("cannot save %s\n", manifest.c_str());
+  printf("%d files, %d precompiled, %d unchanged, %d failed in %.2f s\n",
+      (int)files.size(), (int)files.size() - skipped - failed, (int)skipped,
+      failed, (get_time() - start) * 1e-9);
+  return failed ? 1 : 0;
+}
@@ -0,0 +1,57 @@
+#include <csignal>
+
+#include "parser.h"
+#include "query.h"
+//
+#include "ext/yocto-gl/yocto/yocto_commonio.h"
+using namespace yocto;
+
+// Serves the distances of a tree to the processes of the host through
+// shared memory, see query.h, until it is interrupted. The region is named
+// after --name, which defaults to the name of the file, and holds --slots
+// queries of up to --points points each. Trees are compiled with exact
+// values, as in eval_csg_batch. With --memo, points are memoized in cells
+// of that size, see memo.h, for clients that query the same points again,
+// and the hit rate is printed once the daemon stops.
+
+static auto stopped = std::atomic<bool>{false};
+
+int main(int argc, const char* argv[]) {
+  auto filename = ""s;
+  auto name     = ""s;
+  auto slots    = 64;
+  auto points   = 65536;
+  auto quantum  = -1.0f;  // of the memo, none if negative
+  auto cli      = make_cli("csg_query", "Serve the distances of a csg tree");
+  add_cli_option(cli, "--name", name, "Name of the shared memory");
+  add_cli_option(cli, "--slots", slots, "Queries at the same time");
+  add_cli_option(cli, "--points", points, "Points of a query at most");
+  add_cli_option(cli, "--memo", quantum, "Memoize points in cells this size");
+  add_cli_option(cli, "shape", filename, "Shape filename");
+  parse_cli(cli, argc, argv);
+  if (name.empty()) name = get_basename(filename);
+  if (slots < 1 || points < 1) {
+    printf("--slots and --points must be positive\n");
+    return 1;
+  }
+
+  auto csg    = load_csg(filename);
+  auto tape   = compile_csg(csg, flt_max);
+  auto region = CsgQueryRegion{};
+  auto error  = string{};
+  if (!create_query_region(region, name, slots, points, error)) {
+    printf("%s\n", error.c_str());
+    return 1;
+  }
+  std::signal(SIGINT, [](int) { stopped = true; });
+  std::signal(SIGTERM, [](int) { stopped = true; });
+  printf("serving %s as %s\n", filename.c_str(), name.c_str());
+  auto memo = quantum >= 0 ? make_memo(quantum) : nullptr;
+  serve_queries(region, tape, stopped, 4096, memo.get(), root_hash(csg));
+  close_query_region(region);
+  if (memo)
+    printf("memo: %.1f%% of %lld points hit, %lld bypassed\n",
+        memo_hit_rate(*memo) * 100,
+        (long long)(memo->hits + memo->misses), (long long)memo->bypassed);
+  return 0;
+}
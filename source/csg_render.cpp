@@ -0,0 +1,711 @@
+#include "animation.h"
+#include "aovs.h"
+#include "denoise.h"
+#include "embree.h"
+#include "gpu.h"
+#include "image_stream.h"
+#include "memory.h"
+#include "mesh_stream.h"
+#include "parser.h"
+#include "profile.h"
+#include "raymarch.h"
+#include "remote.h"
+#include "scene.h"
+#include "tape_io.h"
+#include "trace.h"
+#include "tuner.h"
+#include "zones.h"
+//
+#include "ext/yocto-gl/yocto/yocto_commonio.h"
+#include "ext/yocto-gl/yocto/yocto_image.h"
+#include "ext/yocto-gl/yocto/yocto_shape.h"
+using namespace yocto;
+
+// Renders trees to images without a window. The tree is parsed and compiled
+// once and rendered from each camera in turn, either from the turntable
+// around the initial camera of the viewer or from the cameras of a file.
+// With more than one camera, the index of the view is added to the names of
+// the images, e.g. out.0001.png. Shapes are .csg scripts or binary .csgb
+// trees, which are written with --binary, see tree_io.h. With --mesh, the
+// surface is also saved as a PLY or OBJ mesh, see mesh.h, which --stream
+// writes a slab of --band cells at a time, see mesh_stream.h. With --lods,
+// meshes of half the cells each are saved too, e.g. out.lod1.ply. With
+// --path, views are path traced with yocto_trace from a mesh of --cells,
+// see trace.h. With --profile, the costliest subtrees of the first view
+// are printed, and drawn hotter in --graph, see profile.h. With
+// --reorder, the operands of unions are swapped so that the one that wins
+// more often in the profile comes first, see reorder_csg, and the profile
+// is saved next to the shape, and next to --binary, for later renders. With
+// --prune, the tape skips the operands of hard unions and subtractions that
+// cannot win over the other operand, see compile_csg. With --tune, views
+// are rendered with the fastest of the tape, its native code and the GPU,
+// timed on points of the tree as it is loaded, or as cached for the tree on
+// this machine, see tune_csg. With
+// --falsecolor, pixels are colored by their march steps, their distance
+// evaluations or whether they ran out of steps, see march_falsecolor. With
+// --pyramid, rays skip empty space with a pyramid of that many levels, see
+// pyramid.h, and with --lod, features narrower than that many pixels are
+// simplified far from the camera, see lod_tape. With --trace, builds with
+// CSG_TRACE save the timing zones of the tree views as a Chrome trace, see
+// zones.h. With --memory, the memory of the tree, of its tape and of an
+// image is printed with the peak of the process, see memory.h. With
+// --sampler sobol, camera rays take scrambled Sobol points in their pixels,
+// see march_sampler. With --wavefront, tiles are marched, their normals
+// evaluated and shaded as separate kernels, see raymarch_wavefront. With
+// --anchor, trees far from the origin are moved to it, and the cameras of
+// the file with them, so that they are marched in full precision, see
+// anchor_csg. Meshes and binary trees are saved in the moved space. With
+// --compact, --gpu renders read the parameters in 16 bits each, see
+// quantize_params. With --bricks, --gpu renders march a sparse grid of that
+// resolution, whose bricks are streamed to the device as the views need
+// them, see stream_bricks.
+//
+// With --tracks, the parameters of the tree are animated by keyframed
+// tracks, see animation.h, and --frames images are rendered from the first
+// camera at times evenly spaced over the keys, tracing again only the
+// tiles that the animated nodes may change since the previous frame.
+//
+// With --aovs, a comma separated list of depth, normal, id and steps, those
+// passes of the first sample of each pixel are written in the same render,
+// see march_aovs, as layers of the image if it is an EXR and as EXR images
+// next to it otherwise, e.g. out.depth.exr, see aovs.h.
+//
+// With --stereo, each view is rendered for two eyes that far apart, saved
+// as e.g. out.left.png and out.right.png: the right eye reprojects the hits
+// of the left one and marches only the pixels it does not see, see
+// raymarch_stereo.
+//
+// With --radiance, paths of --bounces take the light past their second hit
+// from a cache shared by all the views and frames, see radiance.h, and
+// animations clear it near the nodes that move.
+//
+// With --denoise, images are denoised guided by the depth and normal passes,
+// with Open Image Denoise in builds with CSG_OIDN, see denoise.h, so that
+// far fewer samples are needed.
+//
+// With --batch, that many views are rendered together from the same tape,
+// their tiles running on the pool as one stream, see raymarch_images, or
+// with --gpu drawn back to back, each read back while the next one draws,
+// see render_csg_gpu_views.
+//
+// With --stream, images are rendered a band of rows at a time and written
+// as they are done, so that memory does not grow with their height, and
+// with --resume, renders that were stopped go on from their checkpoints.
+// PNGs are compressed in parts on the pool either way, see image_stream.h,
+// and other formats are saved by yocto_image. Images are saved in the
+// background while the next views render, up to --writes at a time, so the
+// times printed for the views leave out their saves.
+//
+// With --listen, images are rendered by the workers that connect to the
+// port, started elsewhere with --connect, a band of rows and --split samples
+// at a time, see remote.h. With --regions, the box of the tree is split in
+// that many regions along each axis, whose trees are specialized and sent
+// to --nodes workers, so that each holds only its regions, and rays through
+// the pixel centers are marched a region at a time by their owners, see
+// partition.h. Coordinators listen on the loopback address unless --bind
+// gives another, or "*" for all, which need a --token, and workers must
+// give the --token of the coordinator, which defaults to the
+// CSG_REMOTE_TOKEN variable so that it is not shown in the list of
+// processes.
+//
+// Shapes ending in .scene are scenes of many objects, see load_scene, which
+// are rendered on the CPU from each camera in turn, or traced with Embree
+// with --embree, see embree.h.
+
+// Cameras of a file, one per line as the position and the target, e.g.
+// `2 2 2 0.5 0.5 0.5`. Lines starting with `#` are skipped. Cameras are
+// moved by -`origin`, the anchor of the tree if it was anchored.
+vector<trace_camera> load_cameras(
+    const string& filename, const vec3f& origin = {0, 0, 0}) {
+  auto fs      = open_file(filename, "rb");
+  auto cameras = vector<trace_camera>{};
+  char buffer[4096];
+  while (read_line(fs, buffer, sizeof(buffer))) {
+    auto str = string_view{buffer};
+    skip_comment(str);
+    skip_whitespace(str);
+    if (str.empty()) continue;
+    auto from = vec3f{}, to = vec3f{};
+    parse_value(str, from);
+    parse_value(str, to);
+    auto camera  = init_camera();
+    camera.frame = lookat_frame(from - origin, to - origin, {0, 1, 0});
+    camera.focus = length(from - to);
+    cameras.push_back(camera);
+  }
+  return cameras;
+}
+
+string view_filename(const string& filename, int view, int views) {
+  if (views == 1) return filename;
+  char index[16];
+  snprintf(index, sizeof(index), ".%04d", view);
+  return get_noextension(filename) + index + get_extension(filename);
+}
+
+// Options and camera of a view, so that checkpoints of other renders are
+// not resumed.
+string render_key(const string& filename, const trace_camera& camera,
+    const trace_params& params, bool footprint) {
+  auto key = filename + " " + std::to_string(params.resolution) + " " +
+             std::to_string(params.samples) + " " +
+             std::to_string(params.seed) + " " + std::to_string(footprint);
+  for (auto k = 0; k < 12; k++)
+    key += " " + std::to_string(camera.frame[k / 3][k % 3]);
+  return key;
+}
+
+// Renders the view a band at a time to a PNG, see image_stream.h, saving a
+// checkpoint after each band.
+void render_bands(const string& name, const string& key,
+    const trace_camera& camera, const CsgTape& tape, const CsgJit& jit,
+    const march_params& march, const trace_params& params, int band,
+    bool resume) {
+  auto size       = camera_size(camera, params.resolution);
+  auto checkpoint = name + ".checkpoint";
+  auto stream     = CsgImageStream{};
+  if (!resume || !resume_image_stream(stream, name, size, checkpoint, key))
+    open_image_stream(stream, name, size);
+  else
+    printf("%s: resumed at row %d\n", name.c_str(), stream.rows);
+  auto state  = march_buffer{};
+  auto render = image<vec4f>{};
+  while (stream.rows < size.y) {
+    auto rows = yocto::min(band, size.y - stream.rows);
+    init_state_rows(state, camera, params, stream.rows, rows);
+    raymarch_rows(
+        camera, tape, jit, nullptr, march, params, state, stream.rows, render);
+    write_image_rows(stream, render);
+    save_image_checkpoint(stream, checkpoint, key);
+  }
+  close_image_stream(stream);
+  std::filesystem::remove(checkpoint);
+}
+
+int main(int argc, const char* argv[]) {
+  // parse command line
+  auto filename    = ""s;
+  auto imagename   = "out.png"s;
+  auto camerasname = ""s;
+  auto graphname   = ""s;
+  auto binaryname  = ""s;
+  auto meshname    = ""s;
+  auto tracename   = ""s;
+  auto tracksname  = ""s;
+  auto aovnames    = ""s;
+  auto cells       = 256;
+  auto lods        = 1;
+  auto params      = trace_params{};
+  auto frames      = 1;
+  auto batch       = 1;
+  auto footprint   = false;
+  auto bounces     = 0;
+  auto radiance    = false;
+  auto gpu         = false;
+  auto path        = false;
+  auto use_embree  = false;
+  auto stream      = false;
+  auto resume      = false;
+  auto band        = 64;
+  auto port        = 0;
+  auto coordinator = ""s;
+  auto host        = ""s;
+  auto token       = ""s;
+  auto split       = 0;
+  auto regions     = 0;
+  auto nodes       = 1;
+  auto profile     = 0;
+  auto reorder     = false;
+  auto prune       = false;
+  auto tune        = false;
+  auto falsecolor  = 0;  // see march_falsecolor
+  auto memory      = false;
+  auto denoise     = false;
+  auto pyramid     = 0;  // levels, see pyramid.h
+  auto lod         = 0.0f;  // pixels, see lod_tape
+  auto sampler     = 0;     // see march_sampler
+  auto wavefront   = false;
+  auto anchor      = false;
+  auto compact     = false;
+  auto bricks      = 0;  // resolution of the sparse grid of --gpu
+  auto stereo      = 0.0f;  // separation of the eyes
+  auto images      = CsgImageQueue{};
+  params.resolution = 720;
+  params.samples    = 64;
+  auto cli = make_cli("csg_render", "Render csg trees without a window");
+  add_cli_option(cli, "--output,-o", imagename, "Image filename");
+  add_cli_option(cli, "--resolution,-r", params.resolution, "Image size");
+  add_cli_option(cli, "--samples,-s", params.samples, "Samples per pixel");
+  add_cli_option(cli, "--frames,-f", frames, "Views of the turntable");
+  add_cli_option(cli, "--cameras,-c", camerasname, "Cameras filename");
+  add_cli_option(cli, "--batch", batch, "Views rendered together");
+  add_cli_option(cli, "--graph", graphname, "Draw the tree to this PNG");
+  add_cli_option(cli, "--binary", binaryname, "Save the tree to this .csgb");
+  add_cli_option(cli, "--mesh", meshname, "Save the surface to this mesh");
+  add_cli_option(cli, "--cells", cells, "Cells of --mesh along the bounds");
+  add_cli_option(cli, "--lods", lods, "Levels of detail of --mesh");
+  add_cli_option(cli, "--footprint", footprint, "Stop rays at the pixel size");
+  add_cli_option(cli, "--bounces", bounces, "Path trace with this many hits");
+  add_cli_option(cli, "--radiance", radiance, "Cache the light past the hits");
+  add_cli_option(cli, "--pyramid", pyramid, "Skip empty space, 1 to 8 levels");
+  add_cli_option(cli, "--lod", lod, "Simplify features below these pixels");
+  add_cli_option(cli, "--falsecolor", falsecolor, "Color the pixels by cost",
+      march_falsecolor_names);
+  add_cli_option(cli, "--sampler", sampler, "Sequence of the camera rays",
+      march_sampler_names);
+  add_cli_option(cli, "--wavefront", wavefront, "March tiles as kernels");
+  add_cli_option(cli, "--anchor", anchor, "Center the tree, with the cameras");
+  add_cli_option(cli, "--gpu", gpu, "Render on the GPU, see gpu.h");
+  add_cli_option(cli, "--compact", compact, "Parameters of --gpu in 16 bits");
+  add_cli_option(cli, "--bricks", bricks, "Stream a sparse grid to --gpu");
+  add_cli_option(cli, "--stereo", stereo, "Render two eyes this far apart");
+  add_cli_option(cli, "--path", path, "Path trace a mesh with yocto_trace");
+  add_cli_option(cli, "--embree", use_embree, "Trace scenes with Embree");
+  add_cli_option(cli, "--stream", stream, "Write PNGs a band at a time");
+  add_cli_option(cli, "--band", band, "Rows of the bands of --stream");
+  add_cli_option(cli, "--resume", resume, "Resume streams from checkpoints");
+  add_cli_option(cli, "--listen", port, "Render with workers on this port");
+  add_cli_option(cli, "--connect", coordinator, "Work for host:port");
+  add_cli_option(cli, "--bind", host, "Address of --listen, or * for all");
+  add_cli_option(cli, "--token", token, "Token of the workers of --listen");
+  add_cli_option(cli, "--split", split, "Samples of the units of --listen");
+  add_cli_option(cli, "--regions", regions, "Split --listen trees in space");
+  add_cli_option(cli, "--nodes", nodes, "Workers of the --regions");
+  add_cli_option(cli, "--profile", profile, "Print the costliest subtrees");
+  add_cli_option(cli, "--reorder", reorder, "Put the usual union winner first");
+  add_cli_option(cli, "--prune", prune, "Skip operands that cannot win");
+  add_cli_option(cli, "--tune", tune, "Pick the fastest backend, see tuner.h");
+  add_cli_option(cli, "--trace", tracename, "Save the zones to this trace");
+  add_cli_option(cli, "--memory", memory, "Print the memory of the render");
+  add_cli_option(cli, "--tracks", tracksname, "Animate with these tracks");
+  add_cli_option(cli, "--aovs", aovnames, "Passes, e.g. depth,normal,id");
+  add_cli_option(cli, "--denoise", denoise, "Denoise guided by the passes");
+  add_cli_option(cli, "--writes", images.depth, "Images saved at once");
+  add_cli_option(cli, "shape", filename, "Shape filename");
+  parse_cli(cli, argc, argv);
+  if (!tracename.empty() && !csg_tracing) {
+    printf("--trace needs a build with CSG_TRACE, see zones.h\n");
+    return 1;
+  }
+
+  if (token.empty())
+    if (auto env = getenv("CSG_REMOTE_TOKEN")) token = env;
+  if (!coordinator.empty()) {
+    auto error = string{};
+    if (!run_worker(coordinator, token, error)) {
+      printf("%s\n", error.c_str());
+      return 1;
+    }
+    return 0;
+  }
+  if (filename.empty()) {
+    printf("shape filename expected\n");
+    return 1;
+  }
+
+  if (get_extension(filename) == ".scene") {
+    auto scene   = load_scene(filename);
+    auto cameras = camerasname.empty() ? turntable_cameras(frames)
+                                       : load_cameras(camerasname);
+    auto embree  = CsgEmbree{};
+    if (use_embree && !init_embree(embree, {})) {
+      printf("embree disabled: %s\n", embree.error.c_str());
+    } else if (use_embree) {
+      add_embree_scene(embree, scene);
+    }
+    for (auto view = 0; view < cameras.size(); view++) {
+      auto start  = get_time();
+      auto name   = view_filename(imagename, view, (int)cameras.size());
+      auto march  = march_params{};
+      auto pixel  = yocto::max(cameras[view].film) / params.resolution /
+                   cameras[view].lens;
+      march.sampler   = (march_sampler)sampler;
+      march.footprint = footprint ? pixel : 0;
+      queue_image(images, name,
+          is_valid(embree) ? embree_image(cameras[view], embree, params)
+                           : raymarch_scene_image(
+                                 cameras[view], scene, march, params));
+      printf("%s: %.2f s\n", name.c_str(), (get_time() - start) * 1e-9);
+    }
+    finish_images(images);
+    release_embree(embree);
+    return 0;
+  }
+
+  auto csg     = load_csg(filename);
+  auto origin  = anchor ? anchor_csg(csg) : vec3f{0, 0, 0};
+  auto heat    = vector<float>{};
+  auto costs   = CsgProfile{};
+  auto stored  = filename + ".profile";
+  auto loaded  = reorder && load_profile(stored, csg, costs);
+  if ((profile > 0 || reorder) && !loaded) {
+    auto camera = camerasname.empty() ? turntable_cameras(1)[0]
+                                      : load_cameras(camerasname, origin)[0];
+    auto tape   = compile_csg(csg);
+    auto march  = frame_march({}, csg, camera, params, footprint);
+    costs = profile_csg(csg, tape, camera, march, params.resolution);
+    if (reorder && !save_profile(stored, csg, costs))
+      printf("%s: cannot write profile\n", stored.c_str());
+  }
+  if (reorder)
+    printf("%d unions reordered\n", reorder_csg(csg, costs));
+  if (profile > 0) {
+    heat = profile_heat(csg, costs);
+    printf("%8s %12s %10s %10s %6s  name\n", "node", "evals", "self ns",
+        "total ns", "share");
+    for (auto& cost : top_subtrees(csg, costs, profile)) {
+      auto name = node_name(csg, cost.node);
+      printf("%8d %12lld %10.2f %10.2f %5.1f%%  %.*s\n", cost.node,
+          (long long)cost.evals, cost.self, cost.total,
+          heat[cost.node] * 100, (int)name.size(), name.data());
+    }
+  }
+  if (!graphname.empty() && !save_tree_png(csg, graphname, heat))
+    printf("%s: dot failed, is graphviz installed?\n", graphname.c_str());
+  if (!binaryname.empty() && !save_csgb(binaryname, csg))
+    printf("%s: cannot write tree\n", binaryname.c_str());
+  else if (!binaryname.empty() && reorder)
+    save_profile(binaryname + ".profile", csg, costs);
+  if (!meshname.empty() && stream) {
+    auto triangles = stream_mesh_csg(
+        csg, mesh_bounds(csg), cells, meshname, band);
+    printf("%s: %llu triangles\n", meshname.c_str(),
+        (unsigned long long)triangles);
+  } else if (!meshname.empty()) {
+    auto meshes = mesh_csg_lods(csg, mesh_bounds(csg), cells, lods);
+    for (auto level = 0; level < meshes.size(); level++) {
+      auto& mesh = meshes[level];
+      auto  name = level == 0 ? meshname
+                              : get_noextension(meshname) + ".lod" +
+                                   std::to_string(level) +
+                                   get_extension(meshname);
+      save_shape(name, {}, {}, mesh.triangles, {}, mesh.positions, {}, {},
+          {}, {});
+      printf("%s: %d triangles\n", name.c_str(), (int)mesh.triangles.size());
+    }
+  }
+  if (pyramid < 0 || pyramid > 8) {
+    printf("--pyramid takes 1 to 8 levels\n");
+    return 1;
+  }
+  auto tape    = prune ? compile_csg(csg, 0.01f, true)
+                       : compile_csg_cached(csg);
+  auto jit     = compile_jit(tape);
+  if (tune) {
+    auto backends = cpu_backends(csg, tape, jit);
+    if (is_valid(get_gpu()))
+      backends.push_back({"gpu", [&tape](auto points, auto out) {
+        if (!eval_csg_batch_gpu(get_gpu(), tape, points, out))
+          for (auto i = (size_t)0; i < out.size(); i++) out[i] = flt_max;
+      }});
+    auto tuning  = tune_csg(csg, backends);
+    auto backend = choice(tuning, csg_consumer::render);
+    for (auto& timing : tuning.timings)
+      printf("%s: %.1f ns per point\n", timing.name.c_str(), timing.ns);
+    printf("render backend: %s%s\n", backend.empty() ? "none" : backend.c_str(),
+        tuning.cached ? ", cached" : "");
+    if (backend == "tape") jit = {};
+    if (!backend.empty()) gpu = backend == "gpu";
+  }
+  if (pyramid)
+    tape.pyramid = std::make_shared<CsgPyramid>(bake_csg_pyramid(
+        csg, {{-0.5, -0.5, -0.5}, {0.5, 0.5, 0.5}}, pyramid));
+  auto cameras = camerasname.empty() ? turntable_cameras(frames)
+                                     : load_cameras(camerasname, origin);
+  auto options      = march_params{};
+  options.lod       = lod;
+  options.sampler   = (march_sampler)sampler;
+  options.wavefront = wavefront;
+  if (lod > 0 && !cameras.empty())
+    tape.lods = std::make_shared<CsgLods>(compile_csg_lods(csg,
+        frame_march(options, csg, cameras.front(), params, false).lod));
+  if (stream && get_extension(imagename) != ".png") {
+    printf("--stream writes PNG images only\n");
+    return 1;
+  }
+  if (port && stream) {
+    printf("--listen and --stream cannot be used together\n");
+    return 1;
+  }
+  if (regions && (!port || regions < 1 || nodes < 1)) {
+    printf("--regions needs --listen, and positive regions and --nodes\n");
+    return 1;
+  }
+  if (path && (stream || port || gpu)) {
+    printf("--path cannot be used with --stream, --listen or --gpu\n");
+    return 1;
+  }
+  if (bricks && !gpu) {
+    printf("--bricks needs --gpu\n");
+    return 1;
+  }
+  if (bounces && (path || gpu)) {
+    printf("--bounces cannot be used with --path or --gpu\n");
+    return 1;
+  }
+  if (radiance && bounces < 2) {
+    printf("--radiance needs --bounces of at least 2\n");
+    return 1;
+  }
+  // shared by all the views and frames, see radiance.h
+  auto cache = radiance ? make_radiance_cache() : nullptr;
+  if (cache) match_radiance(*cache, bounces);
+  if (falsecolor && (path || gpu)) {
+    printf("--falsecolor cannot be used with --path or --gpu\n");
+    return 1;
+  }
+  auto traced = path ? make_trace_scene(csg, cells, params) : trace_scene{};
+  auto listener = -1;
+  auto workers  = vector<CsgRemoteWorker>{};
+  auto remote   = std::shared_ptr<const Csg>{};  // shared by the views
+  if (port) {
+    auto error = string{};
+    listener   = listen_workers(port, token, error, host);
+    if (listener < 0) {
+      printf("%s\n", error.c_str());
+      return 1;
+    }
+    remote = std::make_shared<const Csg>(csg);
+  }
+  auto partition = CsgPartition{};
+  if (regions) {
+    auto error = string{};
+    partition  = make_partition(csg, {regions, regions, regions}, nodes);
+    printf("waiting for %d workers\n", nodes);
+    if (!distribute_partition(
+            listener, token, workers, csg, partition, error)) {
+      printf("%s\n", error.c_str());
+      return 1;
+    }
+  }
+  auto passes = vector<string>{};
+  for (auto k = (size_t)0; k < aovnames.size();) {
+    auto comma = std::min(aovnames.find(',', k), aovnames.size());
+    passes.push_back(aovnames.substr(k, comma - k));
+    k = comma + 1;
+  }
+  if ((!passes.empty() || denoise) &&
+      (stream || port || path || gpu || batch > 1 || !tracksname.empty())) {
+    printf("--aovs and --denoise cannot be used with --stream, --listen, "
+           "--path, --gpu, --batch or --tracks\n");
+    return 1;
+  }
+  // the guides of the denoiser are rendered as passes
+  auto guides = passes;
+  for (auto name : {"depth", "normal"})
+    if (denoise && std::find(guides.begin(), guides.end(), name) ==
+                       guides.end())
+      guides.push_back(name);
+  if (batch > 1 && (stream || port || path || (gpu && bricks))) {
+    printf("--batch cannot be used with --stream, --listen, --path or "
+           "--bricks\n");
+    return 1;
+  }
+  if (stereo > 0 && (stream || port || path || gpu || batch > 1 ||
+                        !tracksname.empty() || !guides.empty())) {
+    printf("--stereo cannot be used with --stream, --listen, --path, --gpu, "
+           "--batch, --tracks, --aovs or --denoise\n");
+    return 1;
+  }
+  if (!tracksname.empty() && (stream || port || path || gpu)) {
+    printf("--tracks cannot be used with --stream, --listen, --path or "
+           "--gpu\n");
+    return 1;
+  }
+  if (!tracksname.empty()) {
+    auto animation = CsgAnimation{};
+    try {
+      animation = make_animation(csg, load_tracks(csg, tracksname));
+    } catch (const std::exception& error) {
+      printf("%s\n", error.what());
+      return 1;
+    }
+    auto jit    = compile_jit(animation.tape);
+    auto camera = camerasname.empty() ? turntable_cameras(1)[0]
+                                      : cameras.front();
+    auto range  = animation_range(animation.tracks);
+    auto render = image<vec4f>{};
+    for (auto frame = 0; frame < frames; frame++) {
+      auto start = get_time();
+      auto time  = frames == 1 ? range.x
+                               : lerp(range.x, range.y,
+                                    (float)frame / (frames - 1));
+      auto regions = set_animation_time(animation, time);
+      if (cache) clear_radiance(*cache, regions);
+      auto march = frame_march(
+          options, animation.bounds, camera, params, footprint);
+      march.bounces    = bounces;
+      march.radiance   = cache.get();
+      march.falsecolor = (march_falsecolor)falsecolor;
+      auto tiles       = raymarch_animation(
+          animation, jit, march, camera, params, regions, render);
+      // the next frame starts from this one, which is saved from a copy
+      auto name = view_filename(imagename, frame, frames);
+      queue_image(images, name, render);
+      printf("%s: time %.3f, %d tiles, %.2f s\n", name.c_str(), time, tiles,
+          (get_time() - start) * 1e-9);
+    }
+    finish_images(images);
+    return 0;
+  }
+  if (gpu && !is_valid(get_gpu())) {
+    printf("gpu backend disabled: %s\n", get_gpu().error.c_str());
+    gpu = false;
+  }
+  if (gpu && compact) {
+    get_gpu().compact = true;
+    printf("compact parameters: error %g\n", quantize_params(tape).error);
+  }
+  auto sparse = CsgSparseGrid{};
+  if (gpu && bricks)
+    sparse = bake_csg_sparse(csg, {{-0.5, -0.5, -0.5}, {0.5, 0.5, 0.5}},
+        yocto::max(bricks, 2));
+
+  for (auto first = 0; batch > 1 && first < cameras.size(); first += batch) {
+    CSG_ZONE("batch");
+    auto start   = get_time();
+    auto last    = yocto::min(first + batch, (int)cameras.size());
+    auto views   = vector<trace_camera>(
+        cameras.begin() + first, cameras.begin() + last);
+    auto marches = vector<march_params>{};
+    for (auto& camera : views) {
+      auto march = frame_march(options, csg, camera, params, footprint);
+      march.bounces    = bounces;
+      march.radiance   = cache.get();
+      march.falsecolor = (march_falsecolor)falsecolor;
+      marches.push_back(march);
+    }
+    // views are drawn on the GPU when they have the same size
+    auto renders  = vector<image<vec4f>>{};
+    auto size     = camera_size(views.front(), params.resolution);
+    auto gmarches = vector<CsgGpuMarch>{};
+    for (auto view = 0; gpu && view < views.size(); view++) {
+      if (camera_size(views[view], params.resolution) != size) break;
+      auto& march = marches[view];
+      gmarches.push_back(
+          {march.bounds, march.relaxation, march.footprint, params.clamp});
+    }
+    if (gpu && gmarches.size() == views.size() &&
+        !render_csg_gpu_views(get_gpu(), tape, views, size, params.samples,
+            gmarches, renders)) {
+      printf("gpu backend disabled: %s\n", get_gpu().error.c_str());
+      gpu = false;
+      renders.clear();
+    }
+    if (renders.empty())
+      renders = raymarch_images(views, tape, jit, nullptr, marches, params);
+    for (auto view = first; view < last; view++)
+      queue_image(images, view_filename(imagename, view, (int)cameras.size()),
+          std::move(renders[view - first]));
+    printf("%s to %s: %.2f s\n",
+        view_filename(imagename, first, (int)cameras.size()).c_str(),
+        view_filename(imagename, last - 1, (int)cameras.size()).c_str(),
+        (get_time() - start) * 1e-9);
+  }
+  for (auto view = 0; batch <= 1 && view < cameras.size(); view++) {
+    CSG_ZONE("view");
+    auto& camera = cameras[view];
+    auto  march  = frame_march(options, csg, camera, params, footprint);
+    march.bounces    = bounces;
+    march.radiance   = cache.get();
+    march.falsecolor = (march_falsecolor)falsecolor;
+    auto  start  = get_time();
+    auto  name   = view_filename(imagename, view, (int)cameras.size());
+    if (stream) {
+      render_bands(name, render_key(filename, camera, params, footprint),
+          camera, tape, jit, march, params, band, resume);
+      printf("%s: %.2f s\n", name.c_str(), (get_time() - start) * 1e-9);
+      continue;
+    }
+    if (stereo > 0) {
+      auto [left, right] = raymarch_stereo(
+          camera, stereo, tape, jit, nullptr, march, params);
+      for (auto& [eye, render] : {pair{".left", &left}, {".right", &right}})
+        queue_image(images, get_noextension(name) + eye + get_extension(name),
+            std::move(*render));
+      printf("%s: %.2f s\n", name.c_str(), (get_time() - start) * 1e-9);
+      continue;
+    }
+    auto render = image<vec4f>{};
+    if (path) {
+      queue_image(images, name, render_trace(traced, camera, params));
+      printf("%s: %.2f s\n", name.c_str(), (get_time() - start) * 1e-9);
+      continue;
+    }
+    if (regions) {
+      auto error = string{};
+      render     = render_partition(workers, partition, camera, params, error);
+      if (render.empty()) {
+        printf("%s\n", error.c_str());
+        return 1;
+      }
+      queue_image(images, name, std::move(render));
+      printf("%s: %.2f s\n", name.c_str(), (get_time() - start) * 1e-9);
+      continue;
+    }
+    if (listener >= 0) {
+      render = render_remote(listener, token, workers,
+          {view, remote, camera, march, params}, band, split);
+      queue_image(images, name, std::move(render));
+      printf("%s: %.2f s\n", name.c_str(), (get_time() - start) * 1e-9);
+      continue;
+    }
+    auto gmarch = CsgGpuMarch{
+        march.bounds, march.relaxation, march.footprint, params.clamp};
+    auto gsize  = camera_size(camera, params.resolution);
+    if (gpu && !(bricks ? render_sparse_gpu(get_gpu(), tape, sparse, camera,
+                              gsize, params.samples, gmarch, render)
+                        : render_csg_gpu(get_gpu(), tape, camera, gsize,
+                              params.samples, gmarch, render))) {
+      printf("gpu backend disabled: %s\n", get_gpu().error.c_str());
+      gpu = false;
+    }
+    auto aovs = march_aovs{};
+    if (!guides.empty()) {
+      auto error = string{};
+      if (!init_aovs(aovs, camera_size(camera, params.resolution), guides,
+              error)) {
+        printf("%s\n", error.c_str());
+        return 1;
+      }
+    }
+    if (!gpu)
+      render = raymarch_image(camera, tape, jit, nullptr, march, params,
+          nullptr, nullptr, is_valid(aovs) ? &aovs : nullptr);
+    if (denoise) {
+      auto error = string{};
+      if (!denoise_image(render, aovs, {}, error))
+        printf("oidn disabled: %s\n", error.c_str());
+    }
+    if (!passes.empty()) {
+      auto error = string{};
+      auto saved = get_extension(name) == ".exr"
+                       ? save_aov_layers(name, render, aovs, error)
+                       : save_aov_images(name, aovs, error);
+      if (!saved) {
+        printf("%s\n", error.c_str());
+        return 1;
+      }
+      if (get_extension(name) != ".exr")
+        queue_image(images, name, std::move(render));
+    } else {
+      queue_image(images, name, std::move(render));
+    }
+    printf("%s: %.2f s\n", name.c_str(), (get_time() - start) * 1e-9);
+  }
+  finish_workers(workers);
+  finish_images(images);
+  if (memory) {
+    auto size  = camera_size(cameras.front(), params.resolution);
+    auto rows  = stream ? std::min(band, size.y) : size.y;
+    auto usage = memory_usage(csg, tape);
+    usage.push_back({"image", (size_t)size.x * rows * sizeof(vec4f)});
+    for (auto& [name, bytes] : usage)
+      printf("%-12s %10.2f mb\n", name.c_str(), bytes / (1024.0 * 1024.0));
+    printf("%-12s %10.2f mb\n", "peak", peak_memory() / 1024.0);
+  }
+  if (!tracename.empty() && !save_trace(tracename)) {
+    printf("%s: cannot write trace\n", tracename.c_str());
+    return 1;
+  }
+}
@@ -0,0 +1,48 @@
+#include "server.h"
+//
+#include "ext/yocto-gl/yocto/yocto_commonio.h"
+using namespace yocto;
+
+// Serves renders of the trees of a folder over HTTP, for previews in other
+// tools, see server.h. Scenes stay compiled between requests, up to
+// --scenes of them, and with --error, tiles stop sampling once their noise
+// is below it. Servers listen on the loopback address unless --bind gives
+// another, or "*" for all of them. Interactive requests are refined first,
+// by the deadlines of --deadline seconds per round, and batch ones take the
+// threads they leave. On shared machines, --threads, --memory and --time
+// limit the threads of each round, the megabytes of the scenes and of the
+// buffers, and the seconds of each request.
+
+int main(int argc, const char* argv[]) {
+  auto server = CsgServer{};
+  auto folder = "."s;
+  auto port   = 8080;
+  auto cli    = make_cli("csg_server", "Serve renders of csg trees");
+  add_cli_option(cli, "--port,-p", port, "Port to listen on");
+  add_cli_option(cli, "--bind", server.host, "Address to listen on, * for all");
+  add_cli_option(cli, "--scenes", server.capacity, "Scenes kept compiled");
+  auto memory = 0;
+  auto time   = 0.0f;
+  add_cli_option(cli, "--error", server.error, "Noise of the done tiles");
+  add_cli_option(cli, "--deadline", server.deadline, "Seconds of each round");
+  add_cli_option(cli, "--threads", server.threads, "Threads of each round");
+  add_cli_option(cli, "--memory", memory, "Megabytes of scenes and buffers");
+  add_cli_option(cli, "--time", time, "Seconds of each request");
+  add_cli_option(cli, "folder", folder, "Folder of the scenes");
+  parse_cli(cli, argc, argv);
+  if (server.threads < 0 || memory < 0 || time < 0 || server.deadline < 0) {
+    printf("limits must not be negative\n");
+    return 1;
+  }
+  server.folder = folder;
+  server.memory = (size_t)memory << 20;
+  server.time   = time;
+
+  printf("serving %s on port %d\n", folder.c_str(), port);
+  auto error = string{};
+  if (!run_server(server, port, error)) {
+    printf("%s\n", error.c_str());
+    return 1;
+  }
+  return 0;
+}
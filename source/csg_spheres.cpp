@@ -0,0 +1,56 @@
+#include <chrono>
+#include <filesystem>
+
+#include "spheres.h"
+#include "tree_io.h"
+//
+#include "ext/yocto-gl/yocto/yocto_commonio.h"
+using namespace yocto;
+
+// Fits spheres to a mesh or a point cloud, as loaded by yocto_shape, see
+// spheres.h. Outputs ending in .csgb are trees, a group unless --unions is
+// given, loaded by load_csg; others are sphere files, placed by scripts
+// with `spheres`.
+
+int main(int argc, const char* argv[]) {
+  auto filename = ""s;
+  auto output   = "spheres.txt"s;
+  auto params   = CsgSphereFit{};
+  auto unions   = false;
+  auto cli      = make_cli("csg_spheres", "Fit spheres to a mesh");
+  add_cli_option(cli, "--output,-o", output, "Output filename");
+  add_cli_option(cli, "--error,-e", params.error, "Error of the surface");
+  add_cli_option(cli, "--resolution,-r", params.resolution,
+      "Samples along the longest side");
+  add_cli_option(cli, "--max-spheres,-n", params.max_spheres,
+      "Spheres at most, all that are needed if 0");
+  add_cli_option(cli, "--unions", unions, "Tree of unions rather than group");
+  add_cli_option(cli, "shape", filename, "Mesh or point cloud filename");
+  parse_cli(cli, argc, argv);
+  if (params.resolution < 2 || params.error < 0) {
+    printf("--resolution must be at least 2 and --error not negative\n");
+    return 1;
+  }
+  auto binary = std::filesystem::path{output}.extension() == ".csgb";
+  if (unions && !binary) {
+    printf("--unions needs a .csgb output\n");
+    return 1;
+  }
+
+  params.group = !unions;
+  auto start   = std::chrono::steady_clock::now();
+  auto csg     = fit_shape_spheres(filename, params);
+  auto elapsed = std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - start);
+  auto spheres = params.group ? csg.groups[0].centers.size()
+                              : (csg.nodes.size() + 1) / 2;
+  printf("%zu spheres in %.2f s\n", spheres, elapsed.count());
+
+  auto saved = binary ? save_csgb(output, csg)
+                      : save_spheres(output, csg.groups[0]);
+  if (!saved) {
+    printf("cannot save %s\n", output.c_str());
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,329 @@
+#include <cstdio>
+#include <map>
+
+#include "parser.h"
+#include "profile.h"
+//
+#include "ext/yocto-gl/yocto/yocto_commonio.h"
+using namespace yocto;
+
+// Reports the structure of a tree and what the passes of csg.h do to it, as
+// JSON, so that scripts can check models before they are accepted. The tree
+// is read as it is written, see load_csg, and described both as read and
+// once optimized:
+//
+// - nodes: counts of the leaves by primitive, and of the operations by kind
+// - depth: the longest path from the root, and the leaves at each depth
+// - chains: the longest runs of operations of the same kind, by their top
+// - fanout: operands of the n-ary hard unions that optimize_csg rebalances
+// - overlap: of the boxes of the operands of operations, over the smaller,
+//   since guards only skip operands whose boxes are away from the point
+// - softness: radii of the soft blends, which grow the boxes above them
+//
+// Passes are applied to copies of the tree as read, and the tape of each
+// result is evaluated at --points random points in the box of the tree,
+// counting the instructions that run, as eval_tape_profiled, and timing
+// them on one thread. Instructions of the trees of instances are not
+// counted. Limits on the optimized tree, if given, set "passed", and the
+// tool fails if they are exceeded.
+
+// Kind of a node, as reported in the counts.
+string node_kind(const CsgTree& csg, const CsgNode& node) {
+  if (node.children == vec2i{-1, -1}) {
+    if (is_group(node)) return "group";
+    if (is_mesh(node)) return "mesh";
+    if (is_instance(node)) return "instance";
+    auto name = string{"primitive"};
+    visit_primitive(node.primitive.type,
+        [&](auto primitive) { name = decltype(primitive)::name; });
+    return name;
+  }
+  auto& operation = node.operation;
+  auto  soft      = operation.softness > 0 ? "soft_" : "";
+  if (operation.blend == 1) return soft + string{"union"};
+  if (operation.blend == -1) return soft + string{"subtraction"};
+  if (operation.blend == 0) return "pass";
+  return soft + string{"blend"};
+}
+
+string json_string(string_view value) {
+  auto json = string{"\""};
+  for (auto c : value) {
+    if (c == '"' || c == '\\') json += '\\';
+    if ((unsigned char)c >= 0x20) json += c;
+  }
+  return json + "\"";
+}
+
+// Longest path from the root to each node, with nodes in post order.
+vector<int> node_depths(const CsgTree& csg) {
+  auto depths = vector<int>(csg.nodes.size(), 0);
+  for (auto i = (int)csg.nodes.size() - 1; i >= 0; i--) {
+    auto& children = csg.nodes[i].children;
+    if (children == vec2i{-1, -1}) continue;
+    for (auto c : {children.x, children.y})
+      depths[c] = yocto::max(depths[c], depths[i] + 1);
+  }
+  return depths;
+}
+
+inline float box_volume(const bbox3f& bounds) {
+  auto d = max(bounds.max - bounds.min, vec3f{0, 0, 0});
+  return d.x * d.y * d.z;
+}
+
+// Structure of the tree, see the top of the file.
+string tree_stats(const CsgTree& csg) {
+  char buffer[512];
+  auto json   = string{"{"};
+  auto counts = std::map<string, int>{};
+  for (auto& node : csg.nodes) counts[node_kind(csg, node)] += 1;
+  auto spheres = (size_t)0, triangles = (size_t)0;
+  for (auto& group : csg.groups) spheres += group.centers.size();
+  for (auto& mesh : csg.meshes) triangles += mesh.triangles.size();
+  snprintf(buffer, sizeof(buffer),
+      "\n    \"nodes\": %zu, \"spheres\": %zu, \"triangles\": %zu,"
+      "\n    \"counts\": {",
+      csg.nodes.size(), spheres, triangles);
+  json += buffer;
+  for (auto& [kind, count] : counts)
+    json += (kind == counts.begin()->first ? "" : ", ") + json_string(kind) +
+            ": " + std::to_string(count);
+  json += "},";
+
+  auto depths = node_depths(csg);
+  auto leaves = std::map<int, int>{};
+  auto total  = 0.0;
+  for (auto i = 0; i < csg.nodes.size(); i++) {
+    if (csg.nodes[i].children != vec2i{-1, -1}) continue;
+    leaves[depths[i]] += 1;
+    total += depths[i];
+  }
+  auto deepest = leaves.empty() ? 0 : leaves.rbegin()->first;
+  auto reached = 0;
+  for (auto& [depth, count] : leaves) reached += count;
+  snprintf(buffer, sizeof(buffer),
+      "\n    \"depth\": {\"max\": %d, \"mean\": %.2f, \"leaves\": {", deepest,
+      total / yocto::max(reached, 1));
+  json += buffer;
+  for (auto& [depth, count] : leaves)
+    json += (depth == leaves.begin()->first ? "\"" : ", \"") +
+            std::to_string(depth) + "\": " + std::to_string(count);
+  json += "}},";
+
+  // runs of operations of the same kind, reported from the top of each
+  auto kinds  = vector<string>(csg.nodes.size());
+  auto chains = vector<int>(csg.nodes.size(), 0);
+  auto inner  = vector<bool>(csg.nodes.size(), false);
+  for (auto i = 0; i < csg.nodes.size(); i++) {
+    auto& node = csg.nodes[i];
+    kinds[i]   = node_kind(csg, node);
+    if (node.children == vec2i{-1, -1}) continue;
+    chains[i] = 1;
+    for (auto c : {node.children.x, node.children.y}) {
+      if (kinds[c] != kinds[i]) continue;
+      chains[i] = yocto::max(chains[i], chains[c] + 1);
+      inner[c]  = true;
+    }
+  }
+  auto tops = vector<int>{};
+  for (auto i = 0; i < csg.nodes.size(); i++)
+    if (chains[i] > 0 && !inner[i]) tops.push_back(i);
+  std::sort(tops.begin(), tops.end(),
+      [&](int a, int b) { return chains[a] > chains[b]; });
+  if (tops.size() > 5) tops.resize(5);
+  json += "\n    \"chains\": [";
+  for (auto n : tops)
+    json += string{n == tops.front() ? "" : ", "} + "{\"node\": " +
+            json_string(node_name(csg, n)) + ", \"kind\": " +
+            json_string(kinds[n]) + ", \"length\": " +
+            std::to_string(chains[n]) + "}";
+  json += "],";
+
+  auto unions   = 0;
+  auto operands = vector<int>{};
+  auto fanout   = (size_t)0;
+  total         = 0;
+  for (auto i = 0; i < csg.nodes.size(); i++) {
+    if (kinds[i] != "union" || inner[i]) continue;
+    operands.clear();
+    gather_union(csg, i, operands);
+    unions += 1;
+    total += operands.size();
+    fanout = std::max(fanout, operands.size());
+  }
+  snprintf(buffer, sizeof(buffer),
+      "\n    \"fanout\": {\"unions\": %d, \"max\": %zu, \"mean\": %.2f},",
+      unions, fanout, unions ? total / unions : 0.0);
+  json += buffer;
+
+  // overlap of the operands, in quarters
+  auto quarters = vec4i{0, 0, 0, 0};
+  auto overlaps = 0;
+  total         = 0;
+  for (auto i = 0; i < csg.nodes.size(); i++) {
+    auto& children = csg.nodes[i].children;
+    if (children == vec2i{-1, -1}) continue;
+    auto a = csg.bounds[children.x], b = csg.bounds[children.y];
+    if (!is_bounded(a) || !is_bounded(b)) continue;
+    auto smaller = yocto::min(box_volume(a), box_volume(b));
+    auto shared  = box_volume({max(a.min, b.min), min(a.max, b.max)});
+    auto ratio   = smaller > 0 ? shared / smaller : 0.0f;
+    quarters[yocto::min((int)(ratio * 4), 3)] += 1;
+    overlaps += 1;
+    total += ratio;
+  }
+  snprintf(buffer, sizeof(buffer),
+      "\n    \"overlap\": {\"operations\": %d, \"mean\": %.3f, "
+      "\"quarters\": [%d, %d, %d, %d]},",
+      overlaps, overlaps ? total / overlaps : 0.0, quarters.x, quarters.y,
+      quarters.z, quarters.w);
+  json += buffer;
+
+  auto blends = 0;
+  auto least = flt_max, most = 0.0f;
+  total = 0;
+  for (auto& node : csg.nodes) {
+    if (node.children == vec2i{-1, -1} || node.operation.softness <= 0)
+      continue;
+    blends += 1;
+    least = yocto::min(least, node.operation.softness);
+    most  = yocto::max(most, node.operation.softness);
+    total += node.operation.softness;
+  }
+  snprintf(buffer, sizeof(buffer),
+      "\n    \"softness\": {\"blends\": %d, \"min\": %g, \"mean\": %g, "
+      "\"max\": %g}\n  }",
+      blends, blends ? least : 0.0f, blends ? total / blends : 0.0, most);
+  return json + buffer;
+}
+
+// Cost of evaluating the tape of a tree at the points, see the top of the
+// file.
+struct CsgStatsCost {
+  size_t nodes        = 0;
+  int    depth        = 0;
+  size_t instructions = 0;
+  double evals        = 0;  // instructions run per point
+  double ns           = 0;  // per point, on one thread
+};
+
+CsgStatsCost eval_cost(const CsgTree& csg, float margin,
+    const vector<vec3f>& points, bool prune = false) {
+  auto cost         = CsgStatsCost{};
+  auto depths       = node_depths(csg);
+  auto tape         = compile_csg(csg, margin, prune);
+  cost.nodes        = csg.nodes.size();
+  cost.depth        = *std::max_element(depths.begin(), depths.end());
+  cost.instructions = tape.instructions.size();
+  auto profile      = make_profile(csg);
+  auto registers    = tape_registers<float>(tape);
+  for (auto& point : points)
+    eval_tape_profiled(profile, registers, tape, point, false);
+  auto evals = (int64_t)0;
+  for (auto count : profile.evals) evals += count;
+  cost.evals = (double)evals / points.size();
+
+  auto sink = 0.0f;
+  cost.ns   = std::numeric_limits<double>::max();
+  for (auto repeat = 0; repeat < 3; repeat++) {
+    auto start = get_time();
+    for (auto& point : points) sink += eval_tape(registers, tape, point);
+    cost.ns = std::min(cost.ns, (double)(get_time() - start) / points.size());
+  }
+  // keeps the evaluations from being dropped
+  if (sink == flt_max) printf(" ");
+  return cost;
+}
+
+string cost_stats(const string& pass, const string& from,
+    const CsgStatsCost& cost, const CsgStatsCost& base) {
+  char buffer[512];
+  snprintf(buffer, sizeof(buffer),
+      "\n    {\"pass\": \"%s\", \"from\": \"%s\", \"nodes\": %zu, "
+      "\"depth\": %d, \"instructions\": %zu, \"evals\": %.2f, "
+      "\"ns\": %.1f, \"speedup\": %.2f}",
+      pass.c_str(), from.c_str(), cost.nodes, cost.depth, cost.instructions,
+      cost.evals, cost.ns, cost.ns > 0 ? base.ns / cost.ns : 0.0);
+  return buffer;
+}
+
+int main(int argc, const char* argv[]) {
+  auto filename   = ""s;
+  auto outname    = ""s;
+  auto num_points = 1024;
+  auto group_size = 64;
+  auto max_nodes  = 0;
+  auto max_depth  = 0;
+  auto max_evals  = 0.0f;
+  auto cli = make_cli("csg_stats", "Report the structure of a csg tree");
+  add_cli_option(cli, "--points,-p", num_points, "Points of the costs");
+  add_cli_option(cli, "--group-size", group_size, "Spheres of group_csg");
+  add_cli_option(cli, "--max-nodes", max_nodes, "Most nodes, or no limit");
+  add_cli_option(cli, "--max-depth", max_depth, "Most depth, or no limit");
+  add_cli_option(cli, "--max-evals", max_evals, "Most evals, or no limit");
+  add_cli_option(cli, "--output,-o", outname, "JSON filename, or stdout");
+  add_cli_option(cli, "shape", filename, "Shape filename");
+  parse_cli(cli, argc, argv);
+  if (num_points < 1 || group_size < 2) {
+    printf("--points must be positive and --group-size at least 2\n");
+    return 1;
+  }
+
+  // the tree as read, in post order and without the nodes it does not use
+  auto read    = load_csg(filename, nullptr, false);
+  auto forward = vector<int>(read.nodes.size());
+  for (auto i = 0; i < forward.size(); i++) forward[i] = i;
+  auto source = copy_csg(read, forward);
+  read        = {};
+  auto optimized = source;
+  optimize_csg(optimized);
+  auto simplified = source;
+  simplify_csg(simplified);
+  auto shared = source;
+  share_csg(shared);
+  auto grouped = optimized;
+  group_csg(grouped, group_size);
+
+  auto bounds = source.bounds[source.root];
+  if (!is_bounded(bounds)) bounds = {{-1, -1, -1}, {1, 1, 1}};
+  auto extent = bounds.max - bounds.min;
+  auto rng    = make_rng(13);
+  auto points = vector<vec3f>(num_points);
+  for (auto& point : points)
+    point = bounds.min - 0.1f * extent + 1.2f * extent * rand3f(rng);
+
+  auto base = eval_cost(source, 0.01f, points);
+  auto best = eval_cost(optimized, 0.01f, points);
+  auto json = "{\n  \"source\": " + tree_stats(source) +
+              ",\n  \"optimized\": " + tree_stats(optimized) +
+              ",\n  \"passes\": [";
+  json += cost_stats("none", "none", base, base) + ",";
+  json += cost_stats("simplify", "none",
+              eval_cost(simplified, 0.01f, points), base) + ",";
+  json += cost_stats("share", "none", eval_cost(shared, 0.01f, points),
+              base) + ",";
+  json += cost_stats("optimize", "none", best, base) + ",";
+  json += cost_stats("group", "optimize", eval_cost(grouped, 0.01f, points),
+              best) + ",";
+  json += cost_stats("prune", "optimize",
+              eval_cost(optimized, 0.01f, points, true), best) + ",";
+  json += cost_stats("no_guards", "optimize",
+      eval_cost(optimized, flt_max, points), best);
+  json += "\n  ]";
+
+  auto passed = (max_nodes <= 0 || best.nodes <= max_nodes) &&
+                (max_depth <= 0 || best.depth <= max_depth) &&
+                (max_evals <= 0 || best.evals <= max_evals);
+  if (max_nodes > 0 || max_depth > 0 || max_evals > 0)
+    json += passed ? ",\n  \"passed\": true" : ",\n  \"passed\": false";
+  json += "\n}\n";
+
+  if (outname.empty()) {
+    printf("%s", json.c_str());
+  } else {
+    auto fs = open_file(outname, "wb");
+    fwrite(json.data(), 1, json.size(), fs.fs);
+  }
+  return passed ? 0 : 1;
+}
@@ -0,0 +1,177 @@
+#pragma once
+#include <cmath>
+
+#include "raymarch.h"
+
+#ifdef CSG_OIDN
+#include <OpenImageDenoise/oidn.hpp>
+#endif
+
+// Denoising of renders with few samples, guided by the depths and the
+// normals of the first hits of their pixels, see march_aovs, so that edges
+// of the surface and of its normals stay sharp while the shading noise and
+// the jittered edges are smoothed.
+//
+// Builds with the CSG_OIDN option denoise with Intel Open Image Denoise,
+// whose albedo is the diffuse of eyelight on hits and the sky elsewhere.
+// Other builds, and the ones where the device fails, run an edge avoiding
+// à-trous filter [Dammertz et al. 2010]: passes of a 5x5 B-spline kernel
+// whose taps are twice as far apart each pass, weighted by how close the
+// colors, normals and depths of the taps are to the ones of the pixel. The
+// colors are trusted less in later passes, where the noise is lower.
+
+// Renders here are noisy mostly at edges and in the paths, so the filter
+// defaults to a single pass, which lowers the error of renders of a few
+// samples where wider passes start to blur the shading.
+struct CsgDenoiseOptions {
+  int   passes = 1;       // of the filter, each twice as wide
+  float color  = 1;       // deviation of the colors of a surface
+  float normal = 64;      // power of the cosine between normals
+  float depth  = 0.002f;  // relative difference of the depths of a surface
+};
+
+// Depths and normals of the centers of the pixels from their first hits,
+// see march_starts, for renders that do not keep passes.
+inline march_aovs denoise_guides(const CsgTape& tape, const CsgGrid* grid,
+    const trace_camera& camera, const march_starts& starts) {
+  auto guides = march_aovs{};
+  auto size   = starts.image;
+  guides.depth  = image{size, flt_max};
+  guides.normal = image{size, vec3f{0, 0, 0}};
+  if (starts.depth.size() != (size_t)size.x * size.y) return guides;
+  parallel_for(
+      size.y,
+      [&](int j) {
+        for (auto i = 0; i < size.x; i++) {
+          auto depth = starts.depth[j * size.x + i];
+          if (depth <= 0 || depth == flt_max) continue;
+          auto ray = sample_camera(camera, {i, j}, size, {0.5, 0.5}, {0, 0});
+          guides.depth[{i, j}]  = depth;
+          guides.normal[{i, j}] = hit_normal(tape, grid, ray.o + ray.d * depth);
+        }
+      },
+      csg_priority::background);
+  return guides;
+}
+
+// Weight of a tap of the filter for the pixel, by their guides. Depths are
+// flt_max where rays miss, and 0 if they are not known.
+inline float denoise_weight(const vec4f& color, const vec3f& normal,
+    float depth, const vec4f& tap_color, const vec3f& tap_normal,
+    float tap_depth, float color_sigma, const CsgDenoiseOptions& options) {
+  if ((depth == flt_max) != (tap_depth == flt_max)) return 0;
+  auto weight = 1.0f;
+  if (depth != flt_max) {
+    auto cosine = yocto::max(dot(normal, tap_normal), 0.0f);
+    weight *= std::pow(cosine, options.normal);
+    if (depth > 0)
+      weight *= std::exp(
+          -std::abs(depth - tap_depth) / (options.depth * depth));
+  }
+  auto difference = xyz(color) - xyz(tap_color);
+  weight *= std::exp(
+      -dot(difference, difference) / (color_sigma * color_sigma));
+  return weight;
+}
+
+// Denoises the render with the à-trous filter, see the notes above.
+inline void denoise_atrous(image<vec4f>& render, const march_aovs& guides,
+    const CsgDenoiseOptions& options = {}) {
+  static const float kernel[5] = {1 / 16.0f, 1 / 4.0f, 3 / 8.0f, 1 / 4.0f,
+      1 / 16.0f};
+  auto size   = render.size();
+  auto source = render;
+  auto depth  = [&](const vec2i& ij) {
+    return guides.depth.empty() ? 0.0f : guides.depth[ij];
+  };
+  auto normal = [&](const vec2i& ij) {
+    return guides.normal.empty() ? vec3f{0, 0, 1} : guides.normal[ij];
+  };
+  for (auto pass = 0; pass < options.passes; pass++) {
+    auto gap   = 1 << pass;
+    auto sigma = options.color / (float)gap;
+    parallel_for(
+        size.y,
+        [&](int j) {
+          for (auto i = 0; i < size.x; i++) {
+            auto center = source[{i, j}];
+            auto sum    = vec4f{0, 0, 0, 0};
+            auto total  = 0.0f;
+            for (auto y = -2; y <= 2; y++) {
+              for (auto x = -2; x <= 2; x++) {
+                auto tap = vec2i{i + x * gap, j + y * gap};
+                if (tap.x < 0 || tap.y < 0 || tap.x >= size.x ||
+                    tap.y >= size.y)
+                  continue;
+                auto weight = kernel[x + 2] * kernel[y + 2] *
+                              denoise_weight(center, normal({i, j}),
+                                  depth({i, j}), source[tap], normal(tap),
+                                  depth(tap), sigma, options);
+                sum += source[tap] * weight;
+                total += weight;
+              }
+            }
+            render[{i, j}] = total > 0 ? sum / total : center;
+          }
+        },
+        csg_priority::background);
+    std::swap(source, render);
+  }
+  std::swap(source, render);
+}
+
+#ifdef CSG_OIDN
+
+// Denoises the render with Open Image Denoise, returns false on errors.
+inline bool denoise_oidn(
+    image<vec4f>& render, const march_aovs& guides, string& error) {
+  static const auto diffuse = vec3f{0.9, 0.3, 0.2}, sky = vec3f(0.01);
+  auto size   = render.size();
+  auto color  = image<vec3f>{size};
+  auto albedo = image<vec3f>{size};
+  for (auto k = 0; k < render.count(); k++) {
+    color[k]  = xyz(render[k]);
+    auto missed = !guides.depth.empty() && guides.depth[k] == flt_max;
+    albedo[k]   = missed ? sky : diffuse;
+  }
+  auto output = image<vec3f>{size};
+  auto device = oidn::newDevice();
+  device.commit();
+  auto filter = device.newFilter("RT");
+  filter.setImage("color", color.data(), oidn::Format::Float3, size.x, size.y);
+  filter.setImage(
+      "albedo", albedo.data(), oidn::Format::Float3, size.x, size.y);
+  if (!guides.normal.empty())
+    filter.setImage("normal", (void*)guides.normal.data(),
+        oidn::Format::Float3, size.x, size.y);
+  filter.setImage(
+      "output", output.data(), oidn::Format::Float3, size.x, size.y);
+  filter.set("hdr", true);
+  filter.commit();
+  filter.execute();
+  auto message = (const char*)nullptr;
+  if (device.getError(message) != oidn::Error::None) {
+    error = message ? message : "unknown error";
+    return false;
+  }
+  for (auto k = 0; k < render.count(); k++)
+    render[k] = {output[k].x, output[k].y, output[k].z, render[k].w};
+  return true;
+}
+
+#endif
+
+// Denoises the render, with Open Image Denoise if the build has it, see the
+// notes above. Returns false, with the error of the device, if it failed
+// and the filter was run instead.
+inline bool denoise_image(image<vec4f>& render, const march_aovs& guides,
+    const CsgDenoiseOptions& options, string& error) {
+#ifdef CSG_OIDN
+  if (denoise_oidn(render, guides, error)) return true;
+  denoise_atrous(render, guides, options);
+  return false;
+#else
+  denoise_atrous(render, guides, options);
+  return true;
+#endif
+}
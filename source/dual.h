@@ -0,0 +1,56 @@
+#pragma once
+#include "ext/yocto-gl/yocto/yocto_math.h"
+#include "simd.h"
+
+// Dual numbers for forward-mode differentiation with respect to the
+// evaluation point: each value carries its gradient, and every operation
+// applies the chain rule. They live in the yocto namespace like packets, so
+// that the generic evaluators in csg.h and tape.h accept them unchanged.
+
+namespace yocto {
+
+struct dual {
+  float value = 0;
+  vec3f grad  = {0, 0, 0};
+};
+
+inline dual operator-(const dual& a) { return {-a.value, -a.grad}; }
+inline dual operator+(const dual& a, const dual& b) {
+  return {a.value + b.value, a.grad + b.grad};
+}
+inline dual operator-(const dual& a, const dual& b) {
+  return {a.value - b.value, a.grad - b.grad};
+}
+inline dual operator*(const dual& a, const dual& b) {
+  return {a.value * b.value, a.grad * b.value + b.grad * a.value};
+}
+inline dual operator/(const dual& a, const dual& b) {
+  return {a.value / b.value,
+      (a.grad * b.value - b.grad * a.value) / (b.value * b.value)};
+}
+
+// Piecewise functions take the gradient of the selected branch.
+inline dual min(const dual& a, const dual& b) {
+  return a.value < b.value ? a : b;
+}
+inline dual max(const dual& a, const dual& b) {
+  return a.value > b.value ? a : b;
+}
+inline dual abs(const dual& a) { return a.value < 0 ? -a : a; }
+
+// The gradient is zero where it is undefined, e.g. at a sphere center.
+inline dual sqrt(const dual& a) {
+  auto value = std::sqrt(a.value);
+  if (value == 0) return {0, {0, 0, 0}};
+  return {value, a.grad / (2 * value)};
+}
+
+using vec3dual = packet_vec3<dual>;
+
+// Seeds the gradient of each coordinate with its axis.
+inline vec3dual make_dual(const vec3f& position) {
+  return {{position.x, {1, 0, 0}}, {position.y, {0, 1, 0}},
+      {position.z, {0, 0, 1}}};
+}
+
+}  // namespace yocto
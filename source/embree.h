@@ -0,0 +1,318 @@
+#pragma once
+#include <deque>
+#include <limits>
+#include <string>
+
+#include "scene.h"
+
+#ifdef YOCTO_EMBREE
+#include <embree3/rtcore.h>
+#endif
+
+// Scenes of objects and meshes traced with Embree, so that mixed scenes get
+// its traversal for everything in them. Meshes are Embree triangles, and the
+// objects of scene.h are user geometry whose bounds are the boxes that they
+// are marched in, from the bounds of their nodes. Their intersect callbacks
+// march the rays that Embree hands them 8 at a time, as one packet of the
+// tape, with the same steps as raymarch_scene. Rays of an image are traced
+// as streams of a tile each, which Embree splits into packets.
+//
+// It is enabled by the YOCTO_EMBREE build option of yocto, linked with
+// embree3. Elsewhere the scene is always invalid and callers keep using
+// raymarch_scene.
+
+// User data of the geometry of an object.
+struct CsgEmbreeObject {
+  CsgObject    object = {};
+  march_params march  = {};
+};
+
+struct CsgEmbree {
+  void*                       device  = nullptr;  // RTCDevice
+  void*                       scene   = nullptr;  // RTCScene
+  string                      error   = {};
+  std::deque<CsgEmbreeObject> objects = {};
+  vector<vec3f>               diffuse = {};  // by geometry
+  march_params                march   = {};  // of the objects added next
+};
+
+inline bool is_valid(const CsgEmbree& embree) {
+  return embree.scene != nullptr;
+}
+
+#ifdef YOCTO_EMBREE
+
+// Distances of the hits of up to 8 rays with an object along the rays, or
+// flt_max where they miss it. Rays are marched as in raymarch_scene, from
+// their tmin in the box of the object to their tmax, and their directions
+// are normalized.
+inline void march_object_rays(const CsgObject& object,
+    const march_params& march, const ray3f* rays, int count, float* hits) {
+  constexpr auto N = 8;
+  auto& tape   = *object.tape;
+  auto  states = array<march_state, N>{};
+  auto  active = array<bool, N>{};
+  auto  params = march;
+  params.bounds = object.bounds;
+  for (auto lane = 0; lane < count; lane++) {
+    hits[lane] = flt_max;
+    active[lane] = init_march(
+        states[lane], rays[lane], params, rays[lane].tmin);
+  }
+  auto registers = tape_registers<float8>(tape);
+  while (true) {
+    auto live = -1;
+    for (auto lane = 0; lane < count; lane++)
+      if (active[lane]) live = lane;
+    if (live < 0) break;
+    float x[N], y[N], z[N], distances[N];
+    for (auto lane = 0; lane < N; lane++) {
+      auto& state = states[lane < count && active[lane] ? lane : live];
+      auto  p     = state.position - object.offset - vec3f(0.5);
+      x[lane] = p.x, y[lane] = p.y, z[lane] = p.z;
+    }
+    store8(distances,
+        eval_tape(registers, tape, vec3f8{load8(x), load8(y), load8(z)}));
+    for (auto lane = 0; lane < count; lane++) {
+      if (!active[lane]) continue;
+      auto& state = states[lane];
+      auto  event = march_step(state, distances[lane] / tape.lipschitz);
+      if (event == march_event::marching) continue;
+      active[lane] = false;
+      auto t       = state.offset + state.t;
+      if (event != march_event::escaped && t <= rays[lane].tmax)
+        hits[lane] = t;
+    }
+  }
+}
+
+// Rays of an Embree callback, gathered 8 valid ones at a time.
+template <typename Func>
+inline void for_embree_packets(
+    const int* valid, RTCRayN* rays, unsigned size, Func&& func) {
+  for (auto begin = 0u; begin < size; begin += 8) {
+    ray3f packet[8];
+    int   lanes[8];
+    auto  count = 0;
+    for (auto i = begin; i < std::min(begin + 8, size); i++) {
+      if (valid[i] != -1) continue;
+      auto& ray = packet[count];
+      ray.o     = {RTCRayN_org_x(rays, size, i), RTCRayN_org_y(rays, size, i),
+          RTCRayN_org_z(rays, size, i)};
+      ray.d     = {RTCRayN_dir_x(rays, size, i), RTCRayN_dir_y(rays, size, i),
+          RTCRayN_dir_z(rays, size, i)};
+      ray.tmin  = RTCRayN_tnear(rays, size, i);
+      ray.tmax  = RTCRayN_tfar(rays, size, i);
+      lanes[count++] = i;
+    }
+    if (count) func(packet, lanes, count);
+  }
+}
+
+inline void embree_object_bounds(const RTCBoundsFunctionArguments* args) {
+  auto& object = ((const CsgEmbreeObject*)args->geometryUserPtr)->object;
+  auto& bounds = *args->bounds_o;
+  bounds.lower_x = object.bounds.min.x;
+  bounds.lower_y = object.bounds.min.y;
+  bounds.lower_z = object.bounds.min.z;
+  bounds.upper_x = object.bounds.max.x;
+  bounds.upper_y = object.bounds.max.y;
+  bounds.upper_z = object.bounds.max.z;
+}
+
+// Hits are given the gradient of the tape as their normal.
+inline void embree_object_intersect(
+    const RTCIntersectFunctionNArguments* args) {
+  auto& data = *(const CsgEmbreeObject*)args->geometryUserPtr;
+  auto  size = args->N;
+  auto  rays   = RTCRayHitN_RayN(args->rayhit, args->N);
+  auto  hits   = RTCRayHitN_HitN(args->rayhit, args->N);
+  for_embree_packets(args->valid, rays, args->N,
+      [&](const ray3f* packet, const int* lanes, int count) {
+        float t[8];
+        march_object_rays(data.object, data.march, packet, count, t);
+        for (auto k = 0; k < count; k++) {
+          if (t[k] == flt_max) continue;
+          auto i      = lanes[k];
+          auto p      = packet[k].o + packet[k].d * t[k];
+          auto normal = eval_tape_grad(
+              *data.object.tape, p - data.object.offset - vec3f(0.5)).grad;
+          RTCRayN_tfar(rays, size, i)      = t[k];
+          RTCHitN_Ng_x(hits, size, i)      = normal.x;
+          RTCHitN_Ng_y(hits, size, i)      = normal.y;
+          RTCHitN_Ng_z(hits, size, i)      = normal.z;
+          RTCHitN_u(hits, size, i)         = 0;
+          RTCHitN_v(hits, size, i)         = 0;
+          RTCHitN_primID(hits, size, i)    = args->primID;
+          RTCHitN_geomID(hits, size, i)    = args->geomID;
+          RTCHitN_instID(hits, size, i, 0) = args->context->instID[0];
+        }
+      });
+}
+
+// Occluded rays get a tfar of -inf, as Embree expects.
+inline void embree_object_occluded(
+    const RTCOccludedFunctionNArguments* args) {
+  auto& data = *(const CsgEmbreeObject*)args->geometryUserPtr;
+  for_embree_packets(args->valid, args->ray, args->N,
+      [&](const ray3f* packet, const int* lanes, int count) {
+        float t[8];
+        march_object_rays(data.object, data.march, packet, count, t);
+        for (auto k = 0; k < count; k++)
+          if (t[k] != flt_max)
+            RTCRayN_tfar(args->ray, args->N, lanes[k]) =
+                -std::numeric_limits<float>::infinity();
+      });
+}
+
+inline bool init_embree(CsgEmbree& embree, const march_params& march) {
+  embree.device = rtcNewDevice(nullptr);
+  if (!embree.device) {
+    embree.error = "no Embree device";
+    return false;
+  }
+  embree.scene = rtcNewScene((RTCDevice)embree.device);
+  embree.march = march;
+  return true;
+}
+
+// Adds an object of a scene, which is copied, as user geometry marched with
+// the parameters of the scene. Returns its geometry, which hits report.
+inline int add_embree_object(CsgEmbree& embree, const CsgObject& object) {
+  auto& copy     = embree.objects.emplace_back(
+      CsgEmbreeObject{object, embree.march});
+  auto  geometry = rtcNewGeometry(
+      (RTCDevice)embree.device, RTC_GEOMETRY_TYPE_USER);
+  rtcSetGeometryUserPrimitiveCount(geometry, 1);
+  rtcSetGeometryUserData(geometry, &copy);
+  rtcSetGeometryBoundsFunction(geometry, embree_object_bounds, nullptr);
+  rtcSetGeometryIntersectFunction(geometry, embree_object_intersect);
+  rtcSetGeometryOccludedFunction(geometry, embree_object_occluded);
+  rtcCommitGeometry(geometry);
+  auto id = rtcAttachGeometry((RTCScene)embree.scene, geometry);
+  rtcReleaseGeometry(geometry);
+  embree.diffuse.resize(std::max((size_t)id + 1, embree.diffuse.size()));
+  embree.diffuse[id] = object.diffuse;
+  return (int)id;
+}
+
+// Adds a triangle mesh, which Embree copies. Returns its geometry.
+inline int add_embree_mesh(CsgEmbree& embree, const vector<vec3f>& positions,
+    const vector<vec3i>& triangles, const vec3f& diffuse) {
+  auto geometry = rtcNewGeometry(
+      (RTCDevice)embree.device, RTC_GEOMETRY_TYPE_TRIANGLE);
+  auto vertices = rtcSetNewGeometryBuffer(geometry, RTC_BUFFER_TYPE_VERTEX, 0,
+      RTC_FORMAT_FLOAT3, sizeof(vec3f), positions.size());
+  memcpy(vertices, positions.data(), positions.size() * sizeof(vec3f));
+  auto indices = rtcSetNewGeometryBuffer(geometry, RTC_BUFFER_TYPE_INDEX, 0,
+      RTC_FORMAT_UINT3, sizeof(vec3i), triangles.size());
+  memcpy(indices, triangles.data(), triangles.size() * sizeof(vec3i));
+  rtcCommitGeometry(geometry);
+  auto id = rtcAttachGeometry((RTCScene)embree.scene, geometry);
+  rtcReleaseGeometry(geometry);
+  embree.diffuse.resize(std::max((size_t)id + 1, embree.diffuse.size()));
+  embree.diffuse[id] = diffuse;
+  return (int)id;
+}
+
+// Builds the BVH of the scene after its geometries are added.
+inline void commit_embree(CsgEmbree& embree) {
+  rtcCommitScene((RTCScene)embree.scene);
+}
+
+inline void release_embree(CsgEmbree& embree) {
+  if (embree.scene) rtcReleaseScene((RTCScene)embree.scene);
+  if (embree.device) rtcReleaseDevice((RTCDevice)embree.device);
+  embree.scene  = nullptr;
+  embree.device = nullptr;
+  embree.objects.clear();
+  embree.diffuse.clear();
+}
+
+// Traces a stream of rays, coherent as the ones of a tile. Each hit has the
+// distance along its ray as its tfar, or its geometry is invalid.
+inline void intersect_embree(const CsgEmbree& embree, vector<RTCRayHit>& rays) {
+  auto context = RTCIntersectContext{};
+  rtcInitIntersectContext(&context);
+  context.flags = RTC_INTERSECT_CONTEXT_FLAG_COHERENT;
+  rtcIntersect1M((RTCScene)embree.scene, &context, rays.data(),
+      (unsigned)rays.size(), sizeof(RTCRayHit));
+}
+
+// Image of the scene with eyelight, a tile at a time as in
+// raymarch_scene_image, each sample of a tile as one stream of rays.
+inline image<vec4f> embree_image(const trace_camera& camera,
+    const CsgEmbree& embree, const trace_params& params) {
+  auto state = march_buffer{};
+  init_state(state, camera, params);
+  auto render = image{state.size(), zero4f};
+  auto tiles  = make_tiles(render.size());
+  parallel_for_tiles(tiles, [&](CsgTile& tile) {
+    auto pixels = vector<vec2i>{};
+    auto cast   = vector<ray3f>{};
+    auto rays   = vector<RTCRayHit>{};
+    for (; tile.samples < params.samples; tile.samples++) {
+      pixels.clear();
+      cast.clear();
+      rays.clear();
+      for (auto j = tile.min.y; j < tile.max.y; j++) {
+        for (auto i = tile.min.x; i < tile.max.x; i++) {
+          auto  ray = sample_ray(state, camera, {i, j});
+          auto& hit = rays.emplace_back();
+          hit.ray   = {ray.o.x, ray.o.y, ray.o.z, ray.tmin, ray.d.x, ray.d.y,
+              ray.d.z, 0, ray.tmax, (unsigned)-1, 0, 0};
+          hit.hit.geomID    = RTC_INVALID_GEOMETRY_ID;
+          hit.hit.instID[0] = RTC_INVALID_GEOMETRY_ID;
+          pixels.push_back({i, j});
+          cast.push_back(ray);
+        }
+      }
+      intersect_embree(embree, rays);
+      for (auto k = 0; k < rays.size(); k++) {
+        auto& hit      = rays[k].hit;
+        auto  radiance = vec3f(0.01);
+        if (hit.geomID != RTC_INVALID_GEOMETRY_ID) {
+          auto normal = normalize(vec3f{hit.Ng_x, hit.Ng_y, hit.Ng_z});
+          if (dot(normal, cast[k].d) > 0) normal = -normal;
+          radiance = eyelight(normal, cast[k], embree.diffuse[hit.geomID]);
+        }
+        render[pixels[k]] = accumulate_sample(
+            state, pixels[k], radiance, params);
+      }
+    }
+  });
+  return render;
+}
+
+#else
+
+inline bool init_embree(CsgEmbree& embree, const march_params& march) {
+  embree.error = "built without YOCTO_EMBREE";
+  return false;
+}
+
+inline int add_embree_object(CsgEmbree& embree, const CsgObject& object) {
+  return -1;
+}
+
+inline int add_embree_mesh(CsgEmbree& embree, const vector<vec3f>& positions,
+    const vector<vec3i>& triangles, const vec3f& diffuse) {
+  return -1;
+}
+
+inline void commit_embree(CsgEmbree& embree) {}
+
+inline void release_embree(CsgEmbree& embree) {}
+
+inline image<vec4f> embree_image(const trace_camera& camera,
+    const CsgEmbree& embree, const trace_params& params) {
+  return {};
+}
+
+#endif
+
+// Adds the objects of a scene and builds the BVH.
+inline void add_embree_scene(CsgEmbree& embree, const CsgScene& scene) {
+  for (auto& object : scene.objects) add_embree_object(embree, object);
+  commit_embree(embree);
+}
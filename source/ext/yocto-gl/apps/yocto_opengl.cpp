@@ -31,6 +31,7 @@
 
 #include <algorithm>
 #include <cstdarg>
+#include <cstring>
 #include <deque>
 #include <mutex>
 
@@ -271,8 +272,25 @@ void init_glimage(opengl_image& glimage) {
       in vec2 frag_texcoord;
       out vec4 frag_color;
       uniform sampler2D txt;
+      uniform float exposure;
+      uniform bool filmic, srgb;
+      vec3 tonemap_filmic(vec3 hdr) {
+          hdr *= 0.6;
+          vec3 ldr = (hdr * hdr * 2.51 + hdr * 0.03) /
+                     (hdr * hdr * 2.43 + hdr * 0.59 + 0.14);
+          return max(vec3(0), ldr);
+      }
+      vec3 rgb_to_srgb(vec3 rgb) {
+          vec3 low  = rgb * 12.92;
+          vec3 high = 1.055 * pow(max(rgb, vec3(0)), vec3(1 / 2.4)) - 0.055;
+          return mix(high, low, lessThanEqual(rgb, vec3(0.0031308)));
+      }
       void main() {
-          frag_color = texture(txt, frag_texcoord);
+          vec4 color = texture(txt, frag_texcoord);
+          vec3 rgb = color.rgb * exp2(exposure);
+          if (filmic) rgb = tonemap_filmic(rgb);
+          if (srgb) rgb = rgb_to_srgb(rgb);
+          frag_color = vec4(rgb, color.a);
       }
       )";
 #if 0
@@ -349,6 +367,111 @@ void set_glimage(
   glimage.texture_mipmap = mipmap;
 }
 
+// Converts to half floats, rounding to nearest and flushing values too small
+// for normal halves to zero.
+static uint16_t float_to_half(float value) {
+  auto bits = (uint32_t)0;
+  memcpy(&bits, &value, sizeof(bits));
+  auto sign     = (uint16_t)((bits >> 16) & 0x8000);
+  auto exponent = (int)((bits >> 23) & 0xff) - 127 + 15;
+  auto mantissa = bits & 0x7fffff;
+  if (((bits >> 23) & 0xff) == 0xff)
+    return sign | 0x7c00 | (mantissa ? 0x200 : 0);
+  if (exponent >= 31) return sign | 0x7c00;
+  if (exponent <= 0) return sign;
+  // a rounding that carries out of the mantissa moves to the next exponent
+  return sign + (uint16_t)((exponent << 10) + ((mantissa + 0x1000) >> 13));
+}
+
+// allocate image data, stored with the given format, if it changed
+void set_glimage(opengl_image& glimage, const vec2i& size,
+    opengl_image_format format, bool linear, bool mipmap) {
+  if (!glimage.texture_id || glimage.texture_size != size ||
+      glimage.texture_linear != linear || glimage.texture_mipmap != mipmap ||
+      glimage.texture_format != format) {
+    assert(glGetError() == GL_NO_ERROR);
+    if (glimage.texture_id) glDeleteTextures(1, &glimage.texture_id);
+    glGenTextures(1, &glimage.texture_id);
+    glBindTexture(GL_TEXTURE_2D, glimage.texture_id);
+    if (format == opengl_image_format::rgba16f) {
+      glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA16F, size.x, size.y, 0, GL_RGBA,
+          GL_HALF_FLOAT, nullptr);
+    } else {
+      glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, size.x, size.y, 0, GL_RGBA,
+          GL_UNSIGNED_BYTE, nullptr);
+    }
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER,
+        mipmap ? (linear ? GL_LINEAR_MIPMAP_LINEAR : GL_NEAREST_MIPMAP_NEAREST)
+               : (linear ? GL_LINEAR : GL_NEAREST));
+    glTexParameteri(
+        GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, linear ? GL_LINEAR : GL_NEAREST);
+    assert(glGetError() == GL_NO_ERROR);
+  }
+  glimage.texture_size   = size;
+  glimage.texture_linear = linear;
+  glimage.texture_mipmap = mipmap;
+  glimage.texture_format = format;
+}
+
+// update image data, stored with the given format
+void set_glimage(opengl_image& glimage, const image<vec4f>& img,
+    opengl_image_format format, bool linear, bool mipmap) {
+  set_glimage(glimage, img.size(), format, linear, mipmap);
+  set_glimage_regions(glimage, img, {{{0, 0}, img.size()}});
+}
+
+// update the regions of the image data through a pixel buffer object, which
+// is orphaned on every update so that the driver does not wait on the
+// previous upload
+void set_glimage_regions(opengl_image& glimage, const image<vec4f>& img,
+    const vector<pair<vec2i, vec2i>>& regions) {
+  if (!glimage.texture_id || glimage.texture_size != img.size()) return;
+  if (regions.empty()) return;
+  assert(glGetError() == GL_NO_ERROR);
+  auto half    = glimage.texture_format == opengl_image_format::rgba16f;
+  auto pixel   = half ? 4 * sizeof(uint16_t) : sizeof(vec4b);
+  auto offsets = vector<size_t>{};
+  auto total   = (size_t)0;
+  for (auto& [min, max] : regions) {
+    offsets.push_back(total);
+    total += (size_t)(max.x - min.x) * (max.y - min.y) * pixel;
+  }
+  if (!glimage.pbo_id) glGenBuffers(1, &glimage.pbo_id);
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, glimage.pbo_id);
+  glBufferData(GL_PIXEL_UNPACK_BUFFER, total, nullptr, GL_STREAM_DRAW);
+  auto data = (byte*)glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, total,
+      GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+  if (data) {
+    for (auto r = 0; r < regions.size(); r++) {
+      auto [min, max] = regions[r];
+      auto ptr        = data + offsets[r];
+      for (auto j = min.y; j < max.y; j++) {
+        for (auto i = min.x; i < max.x; i++) {
+          auto& color = img[{i, j}];
+          if (half) {
+            auto out = (uint16_t*)ptr;
+            for (auto c = 0; c < 4; c++) out[c] = float_to_half(color[c]);
+          } else {
+            *(vec4b*)ptr = float_to_byte(color);
+          }
+          ptr += pixel;
+        }
+      }
+    }
+    glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+    glBindTexture(GL_TEXTURE_2D, glimage.texture_id);
+    for (auto r = 0; r < regions.size(); r++) {
+      auto [min, max] = regions[r];
+      glTexSubImage2D(GL_TEXTURE_2D, 0, min.x, min.y, max.x - min.x,
+          max.y - min.y, GL_RGBA, half ? GL_HALF_FLOAT : GL_UNSIGNED_BYTE,
+          (const void*)offsets[r]);
+    }
+    if (glimage.texture_mipmap) glGenerateMipmap(GL_TEXTURE_2D);
+  }
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+  assert(glGetError() == GL_NO_ERROR);
+}
+
 // draw image
 void draw_glimage(opengl_image& glimage, const draw_glimage_params& params) {
   assert(glGetError() == GL_NO_ERROR);
@@ -370,6 +493,12 @@ void draw_glimage(opengl_image& glimage, const draw_glimage_params& params) {
       params.center.x, params.center.y);
   glUniform1f(
       glGetUniformLocation(glimage.program_id, "image_scale"), params.scale);
+  glUniform1f(
+      glGetUniformLocation(glimage.program_id, "exposure"), params.exposure);
+  glUniform1i(glGetUniformLocation(glimage.program_id, "filmic"),
+      (int)params.filmic);
+  glUniform1i(
+      glGetUniformLocation(glimage.program_id, "srgb"), (int)params.srgb);
   glBindBuffer(GL_ARRAY_BUFFER, glimage.texcoords_id);
   glEnableVertexAttribArray(
       glGetAttribLocation(glimage.program_id, "texcoord"));
@@ -393,6 +522,147 @@ opengl_image::~opengl_image() {
   if (texcoords_id) glDeleteBuffers(1, &texcoords_id);
   if (triangles_id) glDeleteBuffers(1, &triangles_id);
   if (texture_id) glDeleteTextures(1, &texture_id);
+  if (pbo_id) glDeleteBuffers(1, &pbo_id);
+}
+
+// init pass program, returns false with the log if it does not build
+bool init_glpass(opengl_pass& pass, const string& fragment, string& error) {
+  auto vert =
+      R"(
+      #version 330
+      in vec2 texcoord;
+      void main() {
+          gl_Position = vec4(texcoord * 2 - 1, 0, 1);
+      }
+      )";
+  if (pass.program_id) glDeleteProgram(pass.program_id);
+  if (pass.vertex_id) glDeleteShader(pass.vertex_id);
+  if (pass.fragment_id) glDeleteShader(pass.fragment_id);
+  if (pass.array_id) glDeleteVertexArrays(1, &pass.array_id);
+  pass.program_id = pass.vertex_id = pass.fragment_id = pass.array_id = 0;
+  try {
+    init_glprogram(pass.program_id, pass.vertex_id, pass.fragment_id,
+        pass.array_id, vert, fragment.c_str());
+  } catch (std::exception& e) {
+    error = e.what();
+    while (glGetError() != GL_NO_ERROR) continue;
+    if (pass.program_id) glDeleteProgram(pass.program_id);
+    pass.program_id = 0;
+    return false;
+  }
+
+  if (!pass.texcoords_id) {
+    auto texcoords = vector<vec2f>{{0, 0}, {0, 1}, {1, 1}, {1, 0}};
+    auto triangles = vector<vec3i>{{0, 1, 2}, {0, 2, 3}};
+    glGenBuffers(1, &pass.texcoords_id);
+    glBindBuffer(GL_ARRAY_BUFFER, pass.texcoords_id);
+    glBufferData(GL_ARRAY_BUFFER, texcoords.size() * 2 * sizeof(float),
+        texcoords.data(), GL_STATIC_DRAW);
+    glGenBuffers(1, &pass.triangles_id);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, pass.triangles_id);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, triangles.size() * 3 * sizeof(int),
+        triangles.data(), GL_STATIC_DRAW);
+  }
+  assert(glGetError() == GL_NO_ERROR);
+  return true;
+}
+
+bool is_initialized(const opengl_pass& pass) { return (bool)pass.program_id; }
+
+// update the values of the buffer, read as a samplerBuffer of floats
+void set_glpass_buffer(opengl_pass& pass, const vector<float>& data) {
+  assert(glGetError() == GL_NO_ERROR);
+  if (!pass.buffer_id) {
+    glGenBuffers(1, &pass.buffer_id);
+    glGenTextures(1, &pass.buffer_texture_id);
+  }
+  glBindBuffer(GL_TEXTURE_BUFFER, pass.buffer_id);
+  // an empty buffer cannot back a texture
+  glBufferData(GL_TEXTURE_BUFFER, std::max(data.size(), (size_t)1) * 4,
+      data.empty() ? nullptr : data.data(), GL_DYNAMIC_DRAW);
+  glBindTexture(GL_TEXTURE_BUFFER, pass.buffer_texture_id);
+  glTexBuffer(GL_TEXTURE_BUFFER, GL_R32F, pass.buffer_id);
+  glBindBuffer(GL_TEXTURE_BUFFER, 0);
+  glBindTexture(GL_TEXTURE_BUFFER, 0);
+  assert(glGetError() == GL_NO_ERROR);
+}
+
+// set uniforms of the pass program
+void set_glpass_uniform(opengl_pass& pass, const char* name, int value) {
+  glUseProgram(pass.program_id);
+  glUniform1i(glGetUniformLocation(pass.program_id, name), value);
+  glUseProgram(0);
+}
+void set_glpass_uniform(opengl_pass& pass, const char* name, float value) {
+  glUseProgram(pass.program_id);
+  glUniform1f(glGetUniformLocation(pass.program_id, name), value);
+  glUseProgram(0);
+}
+void set_glpass_uniform(
+    opengl_pass& pass, const char* name, const vec2f& value) {
+  glUseProgram(pass.program_id);
+  glUniform2f(glGetUniformLocation(pass.program_id, name), value.x, value.y);
+  glUseProgram(0);
+}
+void set_glpass_uniform(
+    opengl_pass& pass, const char* name, const vec3f& value) {
+  glUseProgram(pass.program_id);
+  glUniform3f(
+      glGetUniformLocation(pass.program_id, name), value.x, value.y, value.z);
+  glUseProgram(0);
+}
+
+// draw the pass into the texture of the image
+void draw_glpass(opengl_pass& pass, opengl_image& glimage, float weight) {
+  assert(glGetError() == GL_NO_ERROR);
+  if (!pass.framebuffer_id) glGenFramebuffers(1, &pass.framebuffer_id);
+  glBindFramebuffer(GL_FRAMEBUFFER, pass.framebuffer_id);
+  glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D,
+      glimage.texture_id, 0);
+  glViewport(0, 0, glimage.texture_size.x, glimage.texture_size.y);
+  glDisable(GL_DEPTH_TEST);
+  if (weight < 1) {
+    glEnable(GL_BLEND);
+    glBlendColor(0, 0, 0, weight);
+    glBlendFunc(GL_CONSTANT_ALPHA, GL_ONE_MINUS_CONSTANT_ALPHA);
+  }
+  auto last_array = 0;
+  glGetIntegerv(GL_VERTEX_ARRAY_BINDING, &last_array);
+  glUseProgram(pass.program_id);
+  glActiveTexture(GL_TEXTURE0 + 0);
+  glBindTexture(GL_TEXTURE_BUFFER, pass.buffer_texture_id);
+  glUniform1i(glGetUniformLocation(pass.program_id, "values"), 0);
+  glUniform2f(glGetUniformLocation(pass.program_id, "image_size"),
+      (float)glimage.texture_size.x, (float)glimage.texture_size.y);
+  glBindVertexArray(pass.array_id);
+  glBindBuffer(GL_ARRAY_BUFFER, pass.texcoords_id);
+  glEnableVertexAttribArray(glGetAttribLocation(pass.program_id, "texcoord"));
+  glVertexAttribPointer(glGetAttribLocation(pass.program_id, "texcoord"), 2,
+      GL_FLOAT, false, 0, nullptr);
+  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, pass.triangles_id);
+  glDrawElements(GL_TRIANGLES, 2 * 3, GL_UNSIGNED_INT, nullptr);
+  glUseProgram(0);
+  glBindVertexArray(last_array);
+  glBindTexture(GL_TEXTURE_BUFFER, 0);
+  glDisable(GL_BLEND);
+  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+  if (glimage.texture_mipmap) {
+    glBindTexture(GL_TEXTURE_2D, glimage.texture_id);
+    glGenerateMipmap(GL_TEXTURE_2D);
+  }
+  assert(glGetError() == GL_NO_ERROR);
+}
+
+opengl_pass::~opengl_pass() {
+  if (program_id) glDeleteProgram(program_id);
+  if (vertex_id) glDeleteShader(vertex_id);
+  if (fragment_id) glDeleteShader(fragment_id);
+  if (array_id) glDeleteVertexArrays(1, &array_id);
+  if (texcoords_id) glDeleteBuffers(1, &texcoords_id);
+  if (triangles_id) glDeleteBuffers(1, &triangles_id);
+  if (buffer_id) glDeleteBuffers(1, &buffer_id);
+  if (buffer_texture_id) glDeleteTextures(1, &buffer_texture_id);
+  if (framebuffer_id) glDeleteFramebuffers(1, &framebuffer_id);
 }
 
 }  // namespace yocto
@@ -1593,6 +1863,7 @@ void clear_glwindow(opengl_window& win) {
 
 // Run loop
 void run_ui(opengl_window& win) {
+  auto settle = 0;  // frames to draw after waking
   while (!glfwWindowShouldClose(win.win)) {
     // update input
     win.input.mouse_last = win.input.mouse_pos;
@@ -1652,11 +1923,25 @@ void run_ui(opengl_window& win) {
     // draw
     draw_glwindow(win);
 
-    // event hadling
-    glfwPollEvents();
+    // event hadling, idle windows wait for events and then draw a few
+    // frames, so that the widgets settle
+    auto wait = win.idle_cb ? win.idle_cb(win, win.input) : 0.0;
+    if (wait <= 0 || settle > 0) {
+      glfwPollEvents();
+      settle = std::max(settle - 1, 0);
+    } else {
+      if (std::isfinite(wait)) {
+        glfwWaitEventsTimeout(wait);
+      } else {
+        glfwWaitEvents();
+      }
+      settle = 2;
+    }
   }
 }
 
+void wake_glwindow() { glfwPostEmptyEvent(); }
+
 void set_draw_glcallback(opengl_window& win, draw_glcallback cb) {
   win.draw_cb = cb;
 }
@@ -1681,6 +1966,9 @@ void set_uiupdate_glcallback(opengl_window& win, uiupdate_glcallback cb) {
 void set_update_glcallback(opengl_window& win, update_glcallback cb) {
   win.update_cb = cb;
 }
+void set_idle_glcallback(opengl_window& win, idle_glcallback cb) {
+  win.idle_cb = cb;
+}
 
 void set_close(const opengl_window& win, bool close) {
   glfwSetWindowShouldClose(win.win, close ? GLFW_TRUE : GLFW_FALSE);
@@ -51,6 +51,10 @@ namespace yocto {
 // using directives
 using std::unique_ptr;
 
+// Texture formats of images. Float images are converted when uploaded, so
+// smaller formats also transfer less.
+enum struct opengl_image_format { rgba8, rgba16f };
+
 // OpenGL image data
 struct opengl_image {
   opengl_image() {}
@@ -67,6 +71,8 @@ struct opengl_image {
   vec2i texture_size   = {0, 0};
   bool  texture_linear = false;
   bool  texture_mipmap = false;
+  opengl_image_format texture_format = opengl_image_format::rgba8;
+  uint                pbo_id         = 0;  // streams the uploads
 
   ~opengl_image();
 };
@@ -81,6 +87,19 @@ void set_glimage(opengl_image& glimage, const image<vec4f>& img,
 void set_glimage(opengl_image& glimage, const image<vec4b>& img,
     bool linear = false, bool mipmap = false);
 
+// update image data, stored with the given format
+void set_glimage(opengl_image& glimage, const image<vec4f>& img,
+    opengl_image_format format, bool linear = false, bool mipmap = false);
+
+// allocate image data, with undefined values, e.g. for draw_glpass
+void set_glimage(opengl_image& glimage, const vec2i& size,
+    opengl_image_format format, bool linear = false, bool mipmap = false);
+
+// update the regions [min, max) of the image data, which must have the size
+// of the texture, streaming them through a pixel buffer object
+void set_glimage_regions(opengl_image& glimage, const image<vec4f>& img,
+    const vector<pair<vec2i, vec2i>>& regions);
+
 // OpenGL image drawing params
 struct draw_glimage_params {
   vec2i window      = {512, 512};
@@ -91,11 +110,51 @@ struct draw_glimage_params {
   bool  checker     = true;
   float border_size = 2;
   vec4f background  = {0.15f, 0.15f, 0.15f, 1.0f};
+  // tonemapping of linear images, applied when drawn
+  float exposure    = 0;
+  bool  filmic      = false;
+  bool  srgb        = false;
 };
 
 // draw image
 void draw_glimage(opengl_image& glimage, const draw_glimage_params& params);
 
+// Fragment shader run once per pixel of the texture of an image. Shaders
+// get the texture size in `image_size` and can read a float buffer from the
+// samplerBuffer `values`, for data too large for uniforms.
+struct opengl_pass {
+  uint program_id        = 0;
+  uint vertex_id         = 0;
+  uint fragment_id       = 0;
+  uint array_id          = 0;
+  uint texcoords_id      = 0;
+  uint triangles_id      = 0;
+  uint buffer_id         = 0;
+  uint buffer_texture_id = 0;
+  uint framebuffer_id    = 0;
+
+  ~opengl_pass();
+};
+
+// create pass program, returns false with the log if it does not build
+bool init_glpass(opengl_pass& pass, const string& fragment, string& error);
+bool is_initialized(const opengl_pass& pass);
+
+// update the values of the buffer
+void set_glpass_buffer(opengl_pass& pass, const vector<float>& data);
+
+// set uniforms of the pass program
+void set_glpass_uniform(opengl_pass& pass, const char* name, int value);
+void set_glpass_uniform(opengl_pass& pass, const char* name, float value);
+void set_glpass_uniform(
+    opengl_pass& pass, const char* name, const vec2f& value);
+void set_glpass_uniform(
+    opengl_pass& pass, const char* name, const vec3f& value);
+
+// draw the pass into the texture of the image, blended with its contents
+// by `weight`, 1 to replace them
+void draw_glpass(opengl_pass& pass, opengl_image& glimage, float weight = 1);
+
 }  // namespace yocto
 
 // -----------------------------------------------------------------------------
@@ -458,6 +517,11 @@ using uiupdate_glcallback =
 // Update functions called every frame
 using update_glcallback =
     std::function<void(const opengl_window&, const opengl_input& input)>;
+// Idle callback called after drawing, that returns how long the loop may
+// wait for events, in seconds, 0 to poll them and infinity to sleep until
+// one comes, see wake_glwindow
+using idle_glcallback =
+    std::function<double(const opengl_window&, const opengl_input& input)>;
 
 // OpenGL window wrapper
 struct opengl_window {
@@ -471,6 +535,7 @@ struct opengl_window {
   scroll_glcallback   scroll_cb     = {};
   update_glcallback   update_cb     = {};
   uiupdate_glcallback uiupdate_cb   = {};
+  idle_glcallback     idle_cb       = {};
   int                 widgets_width = 0;
   bool                widgets_left  = true;
   opengl_input        input         = {};
@@ -493,9 +558,12 @@ void set_click_glcallback(opengl_window& win, click_glcallback cb);
 void set_scroll_glcallback(opengl_window& win, scroll_glcallback cb);
 void set_uiupdate_glcallback(opengl_window& win, uiupdate_glcallback cb);
 void set_update_glcallback(opengl_window& win, update_glcallback cb);
+void set_idle_glcallback(opengl_window& win, idle_glcallback cb);
 
 // Run loop
 void run_ui(opengl_window& win);
+// Wakes the loop waiting for events, from any thread
+void wake_glwindow();
 void set_close(const opengl_window& win, bool close);
 
 }  // namespace yocto
@@ -63,7 +63,6 @@
 // INCLUDES
 // -----------------------------------------------------------------------------
 
-#include "../../../csg.h"
 #include "yocto_image.h"
 #include "yocto_math.h"
 
@@ -0,0 +1,141 @@
+#pragma once
+#include "batch.h"
+#include "gradient.h"
+
+// Fitting of the parameters of a tree to target distances at points, e.g.
+// zero at the points of a scanned cloud, by minimizing the mean squared
+// error with Adam [Kingma and Ba 2015]. Each step takes a minibatch of the
+// targets, whose parameter derivatives are summed in parallel chunks as in
+// eval_csg_params_grad, so that steps do not depend on scheduling. Sphere
+// parameters are fitted, and the blend and softness of operations if asked,
+// see CsgGradient. Radii and softness are kept from going negative, and
+// blends keep their sign, which tells unions from subtractions.
+
+struct CsgFitParams {
+  int      batch      = 4096;  // targets per step, all of them if 0
+  float    rate       = 1e-3f;
+  float    beta1      = 0.9f;
+  float    beta2      = 0.999f;
+  float    epsilon    = 1e-8f;
+  bool     operations = false;  // also fit blend and softness
+  uint64_t seed       = 7;
+};
+
+// Moments of the optimizer, which persist across steps, so that minibatches
+// can be given one at a time.
+struct CsgFit {
+  CsgFitParams params = {};
+  CsgGradient  mean   = {};
+  CsgGradient  second = {};
+  int          steps  = 0;
+  rng_state    rng    = {};
+};
+
+inline CsgFit make_fit(const CsgTree& csg, const CsgFitParams& params = {}) {
+  auto fit   = CsgFit{};
+  fit.params = params;
+  fit.mean   = make_gradient(csg);
+  fit.second = make_gradient(csg);
+  fit.rng    = make_rng(params.seed);
+  return fit;
+}
+
+// Mean squared error of the values at the points, and its derivatives with
+// respect to the parameters, over the targets of `batch`.
+inline float fit_loss(CsgGradient& gradient, const CsgTree& csg,
+    span<const vec3f> points, span<const float> targets,
+    const vector<int>& batch) {
+  const auto chunk_size = 1024;
+  auto       num_chunks = ((int)batch.size() + chunk_size - 1) / chunk_size;
+  auto       chunks     = vector<CsgGradient>(num_chunks);
+  auto       losses     = vector<double>(num_chunks, 0);
+  auto       scale      = 1.0f / yocto::max((int)batch.size(), 1);
+  parallel_for(num_chunks, [&](int chunk) {
+    auto gradient = make_gradient(csg);
+    auto values   = vector<float>(csg.nodes.size());
+    auto adjoints = vector<float>(csg.nodes.size());
+    auto begin    = chunk * chunk_size;
+    auto end      = yocto::min(begin + chunk_size, (int)batch.size());
+    for (auto k = begin; k < end; k++) {
+      auto  item  = batch[k];
+      auto& point = points[item];
+      auto  error = eval_csg(values, csg, point) - targets[item];
+      losses[chunk] += error * error * scale;
+      backpropagate(gradient, values, adjoints, csg, point, 2 * error * scale);
+    }
+    chunks[chunk] = std::move(gradient);
+  }, pool_priority());
+
+  gradient  = make_gradient(csg);
+  auto loss = 0.0;
+  for (auto chunk = 0; chunk < num_chunks; chunk++) {
+    accumulate(gradient, chunks[chunk]);
+    loss += losses[chunk];
+  }
+  return (float)loss;
+}
+
+// Moves a parameter by its derivative, updating its moments.
+inline void adam_update(CsgFit& fit, float& param, float& mean,
+    float& second, float derivative) {
+  auto& params = fit.params;
+  mean         = params.beta1 * mean + (1 - params.beta1) * derivative;
+  second = params.beta2 * second + (1 - params.beta2) * derivative * derivative;
+  auto corrected_mean   = mean / (1 - std::pow(params.beta1, fit.steps));
+  auto corrected_second = second / (1 - std::pow(params.beta2, fit.steps));
+  param -= params.rate * corrected_mean /
+           (std::sqrt(corrected_second) + params.epsilon);
+}
+
+// Takes a step over a minibatch of the targets, drawn at random, or over
+// all of them. Returns the loss of the minibatch before the step. Bounds
+// are updated after the step.
+inline float fit_step(CsgFit& fit, CsgTree& csg, span<const vec3f> points,
+    span<const float> targets) {
+  assert(points.size() == targets.size());
+  assert(fit.mean.params.size() == csg.nodes.size());
+  auto num   = (int)points.size();
+  auto size  = fit.params.batch > 0 ? yocto::min(fit.params.batch, num) : num;
+  auto batch = vector<int>(size);
+  for (auto k = 0; k < size; k++)
+    batch[k] = size == num ? k : rand1i(fit.rng, num);
+  auto gradient = CsgGradient{};
+  auto loss     = fit_loss(gradient, csg, points, targets, batch);
+
+  fit.steps += 1;
+  for (auto i = 0; i < csg.nodes.size(); i++) {
+    auto& node = csg.nodes[i];
+    if (node.children == vec2i{-1, -1}) {
+      if (node.primitive.type != primitive_type::sphere) continue;
+      auto& params = node.primitive.params;
+      for (auto k = 0; k < 4; k++)
+        adam_update(fit, params[k], fit.mean.params[i][k],
+            fit.second.params[i][k], gradient.params[i][k]);
+      params[3] = yocto::max(params[3], 0.0f);
+    } else if (fit.params.operations) {
+      auto& operation = node.operation;
+      auto  sign      = operation.blend < 0 ? -1.0f : 1.0f;
+      adam_update(fit, operation.blend, fit.mean.blend[i], fit.second.blend[i],
+          gradient.blend[i]);
+      adam_update(fit, operation.softness, fit.mean.softness[i],
+          fit.second.softness[i], gradient.softness[i]);
+      operation.blend    = sign < 0 ? yocto::min(operation.blend, 0.0f)
+                                    : yocto::max(operation.blend, 0.0f);
+      operation.softness = yocto::max(operation.softness, 0.0f);
+    }
+  }
+  update_bounds(csg);
+  update_hashes(csg);
+  return loss;
+}
+
+// Fits the tree with `iterations` steps. Returns the loss of the last one.
+inline float fit_csg(CsgTree& csg, span<const vec3f> points,
+    span<const float> targets, int iterations,
+    const CsgFitParams& params = {}) {
+  auto fit  = make_fit(csg, params);
+  auto loss = 0.0f;
+  for (auto iteration = 0; iteration < iterations; iteration++)
+    loss = fit_step(fit, csg, points, targets);
+  return loss;
+}
@@ -0,0 +1,539 @@
+#pragma once
+#include <cmath>
+#include <cstdint>
+#include <string>
+
+#include "tape.h"
+
+// GPU backend: the tape is translated to a GLSL fragment shader that
+// marches a ray per pixel with the same steps as march_step in the viewer
+// and shades hits like eyelight. Parameters are read at runtime from a
+// float buffer holding CsgTape::params, or from its compact encoding in 16
+// bits per parameter, see quantize_params, so, like the native backend (see
+// jit.h), only structural edits need a new shader. Tapes with groups are
+// not supported, since their spheres are searched at runtime, and neither
+// are tapes with instances.
+//
+// The shader is a pass of yocto_opengl (see opengl_pass), blended into the
+// image a sample at a time. Its uniforms are the pinhole camera, as the
+// axes and origin of its frame, the film and the distance of the film from
+// the lens, the march options, the Lipschitz bound of the tape and the index
+// of the sample, which seeds the jitter of the rays.
+
+// Uniforms of the shader, then its helpers and its march, before and after
+// the distance function. Smooth operations reproduce smin and smax from
+// csg.h.
+inline const char* glsl_header =
+    R"(#version 330
+uniform vec2  image_size;
+uniform vec3  camera_x, camera_y, camera_z, camera_o;
+uniform vec2  camera_film;
+uniform float camera_distance;
+uniform vec3  bounds_min, bounds_max;
+uniform float relaxation, footprint, max_radiance, lipschitz;
+uniform int   sample_index;
+out vec4 frag_color;
+)";
+
+// Reads of the parameters by the shaders: param for any parameter and
+// point for the three coordinates of a position at the offset. Compact
+// parameters are read through two views of the same buffer, of halves and
+// of fractions of the box of the positions.
+inline const char* glsl_params =
+    R"(
+uniform samplerBuffer values;
+float param(int i) { return texelFetch(values, i).r; }
+vec3 point(int o) { return vec3(param(o), param(o + 1), param(o + 2)); }
+)";
+
+inline const char* glsl_compact_params =
+    R"(
+uniform samplerBuffer values, units;
+uniform vec3 units_min, units_size;
+float param(int i) { return texelFetch(values, i).r; }
+vec3 point(int o) {
+  vec3 u = vec3(texelFetch(units, o).r, texelFetch(units, o + 1).r,
+      texelFetch(units, o + 2).r);
+  return units_min + units_size * u;
+}
+)";
+
+// Operations, shared by the shaders, which take the primitives from
+// glsl_primitives_source.
+inline const char* glsl_helpers =
+    R"(
+float sn(float a, float b, float k) {
+  if (k == 0) return min(a, b);
+  float h = max(k - abs(a - b), 0.0) / k;
+  return min(a, b) - h * h * k * (1.0 / 4.0);
+}
+float sx(float a, float b, float k) {
+  if (k == 0) return max(a, b);
+  float h = max(k - abs(a - b), 0.0) / k;
+  return max(a, b) + h * h * k * (1.0 / 4.0);
+}
+float gd(vec3 q, int o) {
+  return length(max(max(point(o) - q, q - point(o + 3)), 0.0));
+}
+float pb(vec3 q, int o) {
+  vec3 d = max(point(o) - q, q - point(o + 3));
+  return length(max(d, 0.0)) + min(max(max(d.x, d.y), d.z), 0.0) *
+                                   param(o + 6);
+}
+)";
+
+inline const char* glsl_march =
+    R"(
+// normals by central differences on a tetrahedron, in a loop that is not
+// unrolled so that the distance function is inlined once
+vec3 csg_normal(vec3 q) {
+  vec3 normal = vec3(0);
+  for (int i = min(sample_index, 0); i < 4; i++) {
+    vec3 e = 0.5773 * (2.0 * vec3((((i + 3) >> 1) & 1), ((i >> 1) & 1),
+                                  (i & 1)) - 1.0);
+    normal += e * csg_eval(q + e * 0.0005);
+  }
+  return normalize(normal);
+}
+
+vec3 fresnel_schlick(vec3 specular, float cosine) {
+  return specular + (1 - specular) * pow(clamp(1 - abs(cosine), 0, 1), 5);
+}
+float microfacet_d(float roughness, vec3 normal, vec3 halfway) {
+  float cosine = dot(normal, halfway);
+  if (cosine <= 0) return 0.0;
+  float r2 = roughness * roughness, c2 = cosine * cosine;
+  float t2 = clamp(1 - c2, 0, 1) / c2;
+  return r2 / (3.14159265 * c2 * c2 * (r2 + t2) * (r2 + t2));
+}
+float microfacet_g1(float roughness, vec3 normal, vec3 halfway, vec3 w) {
+  float cosine = dot(normal, w);
+  if (dot(halfway, w) * cosine <= 0) return 0.0;
+  float r2 = roughness * roughness, c2 = cosine * cosine;
+  float t2 = clamp(1 - c2, 0, 1) / c2;
+  return 2 / (1 + sqrt(1.0 + r2 * t2));
+}
+
+// as eyelight, for its material and light
+vec3 eyelight(vec3 direction, vec3 position) {
+  vec3  diffuse   = vec3(0.9, 0.3, 0.2);
+  vec3  specular  = vec3(0.04);
+  float roughness = 0.2;
+  vec3  normal    = csg_normal(position - 0.5);
+  vec3  light     = normalize(vec3(0.2, 1, 0));
+  vec3  outgoing  = -direction;
+  vec3  radiance  = vec3(0);
+  if (dot(normal, outgoing) * dot(normal, light) > 0) {
+    vec3 up      = dot(normal, outgoing) > 0 ? normal : -normal;
+    vec3 halfway = normalize(light + outgoing);
+    vec3 spec    = fresnel_schlick(specular, dot(normal, outgoing));
+    radiance += (1 - spec) * diffuse / 3.14159265 * abs(dot(normal, light));
+    vec3  f = fresnel_schlick(specular, dot(halfway, outgoing));
+    float d = microfacet_d(roughness, up, halfway);
+    float g = microfacet_g1(roughness, up, halfway, outgoing) *
+              microfacet_g1(roughness, up, halfway, light);
+    radiance += f * d * g /
+                abs(4 * dot(normal, outgoing) * dot(normal, light)) *
+                abs(dot(normal, light));
+  }
+  return radiance + min((normal.y + 1) * 0.1, 0.1) * diffuse;
+}
+
+// as march_state and march_step
+const int marching = 0, hit = 1, escaped = 2, exhausted = 3;
+struct march_state {
+  vec3  origin, direction, position;
+  float t, tmin, tmax, step, radius, omega, offset;
+  int   steps, phase, iterations;
+  bool  relaxed;
+  vec2  previous, lo, hi;
+};
+
+int march_move(inout march_state s, float t) {
+  s.t        = t;
+  s.position = s.origin + s.direction * t;
+  return s.steps == 1000 ? exhausted : marching;
+}
+
+float secant(vec2 lo, vec2 hi) {
+  return lo.x - lo.y * (hi.x - lo.x) / (hi.y - lo.y);
+}
+
+int march_step(inout march_state s, float value) {
+  s.steps += 1;
+  if (s.phase == 1) {
+    s.phase = 0;
+    if (value < 0) {
+      s.hi    = vec2(s.t, value);
+      s.phase = 2;
+      return march_move(s, secant(s.lo, s.hi));
+    }
+  }
+  if (s.phase == 2) {
+    if (abs(value) <= 0.001 || ++s.iterations == 4) return hit;
+    if (value > 0) s.lo = vec2(s.t, value);
+    if (value < 0) s.hi = vec2(s.t, value);
+    return march_move(s, secant(s.lo, s.hi));
+  }
+  if (s.omega > 1 && abs(value) + s.radius < s.step) {
+    float t = s.t - (s.step - s.radius);
+    s.step  = s.radius;
+    s.omega = 1;
+    return march_move(s, t);
+  }
+  float epsilon = max(0.001, footprint * (s.offset + s.t));
+  if (abs(value) <= 0.001) return hit;
+  if (s.t < s.tmin || s.t > s.tmax) return escaped;
+  if (abs(value) <= epsilon) {
+    if (value < 0 && s.previous.y <= 0) return hit;
+    if (value < 0) {
+      s.lo    = s.previous;
+      s.hi    = vec2(s.t, value);
+      s.phase = 2;
+      return march_move(s, secant(s.lo, s.hi));
+    }
+    if (s.t + 2 * epsilon <= s.tmax) {
+      s.lo    = vec2(s.t, value);
+      s.phase = 1;
+      return march_move(s, s.t + 2 * epsilon);
+    }
+  }
+  s.previous = vec2(s.t, value);
+  if (s.relaxed) {
+    s.step   = value > 0 ? value * s.omega : value;
+    s.radius = abs(value);
+    s.t += s.step;
+    s.position = s.origin + s.direction * s.t;
+  } else {
+    s.t += value;
+    s.position += s.direction * value;
+  }
+  return s.steps == 1000 ? exhausted : marching;
+}
+
+vec3 raymarch(vec3 origin, vec3 direction) {
+  vec3  t0    = (bounds_min - origin) / direction;
+  vec3  t1    = (bounds_max - origin) / direction;
+  vec3  tnear = min(t0, t1), tfar = max(t0, t1);
+  float tmin  = max(max(tnear.x, tnear.y), max(tnear.z, 1e-4));
+  float tmax  = min(min(tfar.x, tfar.y), tfar.z);
+  if (tmin > tmax) return vec3(0);
+  float start = tmin + 0.01;
+  march_state s;
+  s.origin     = origin + direction * start;
+  s.direction  = direction;
+  s.position   = s.origin;
+  s.t          = 0;
+  s.tmin       = tmin - start;
+  s.tmax       = tmax - start;
+  s.step       = 0;
+  s.radius     = 0;
+  s.omega      = relaxation;
+  s.relaxed    = relaxation > 1;
+  s.offset     = start;
+  s.steps      = 0;
+  s.phase      = 0;
+  s.iterations = 0;
+  s.previous   = vec2(0);
+  s.lo         = vec2(0);
+  s.hi         = vec2(0);
+  int event    = marching;
+  while (event == marching)
+    event = march_step(s, csg_eval(s.position - 0.5) / lipschitz);
+  if (event == hit) return eyelight(direction, s.position);
+  if (event == escaped) return vec3(0.01);
+  return vec3(1, 0, 0);
+}
+
+uvec3 pcg3d(uvec3 v) {
+  v = v * 1664525u + 1013904223u;
+  v.x += v.y * v.z; v.y += v.z * v.x; v.z += v.x * v.y;
+  v ^= v >> 16u;
+  v.x += v.y * v.z; v.y += v.z * v.x; v.z += v.x * v.y;
+  return v;
+}
+
+void main() {
+  uvec3 seed      = pcg3d(uvec3(ivec2(gl_FragCoord.xy), sample_index));
+  vec2  jitter    = vec2(seed.xy) / 4294967296.0;
+  vec2  uv        = (floor(gl_FragCoord.xy) + jitter) / image_size;
+  vec3  q         = vec3(camera_film.x * (0.5 - uv.x),
+               camera_film.y * (uv.y - 0.5), camera_distance);
+  vec3  d         = normalize(-q);
+  vec3  direction = camera_x * d.x + camera_y * d.y + camera_z * d.z;
+  vec3  radiance  = raymarch(camera_o, direction);
+  if (any(isnan(radiance)) || any(isinf(radiance))) radiance = vec3(0);
+  float largest = max(radiance.x, max(radiance.y, radiance.z));
+  if (largest > max_radiance) radiance *= max_radiance / largest;
+  frag_color = vec4(radiance, 1);
+}
+)";
+
+// GLSL source of the distance function of the tape, as in jit_source.
+inline string glsl_eval_source(
+    const CsgTape& tape, const string& name = "csg_eval") {
+  auto source = "float " + name + "(vec3 q) {\n  float d;\n";
+  for (auto i = 0; i < tape.num_registers; i++)
+    source += "  float r" + std::to_string(i) + ";\n";
+  // bound instructions open a block that ends with their subtree
+  auto ends = vector<int>{};
+  for (auto i = 0; i < tape.instructions.size(); i++) {
+    auto& inst = tape.instructions[i];
+    auto  r    = "r" + std::to_string(inst.r);
+    auto  a    = "r" + std::to_string(inst.a);
+    auto  b    = "r" + std::to_string(inst.b);
+    auto  p    = [&inst](int k) {
+      return "param(" + std::to_string(inst.params + k) + ")";
+    };
+    auto kernel = [&inst](const char* name) {
+      return string{name} + "(q, " + std::to_string(inst.params) + ")";
+    };
+    auto line = string{};
+    switch (inst.opcode) {
+      case csg_opcode::sphere: line = kernel(csg_sphere::name); break;
+      case csg_opcode::box: line = kernel(csg_box::name); break;
+      case csg_opcode::union_hard: line = "min(" + a + ", " + b + ")"; break;
+      case csg_opcode::union_smooth:
+        line = "sn(" + a + ", " + b + ", " + p(0) + ")";
+        break;
+      case csg_opcode::union_blend:
+        line = "mix(" + a + ", sn(" + a + ", " + b + ", " + p(1) + "), " +
+               p(0) + ")";
+        break;
+      case csg_opcode::subtract_hard:
+        line = "max(" + a + ", -" + b + ")";
+        break;
+      case csg_opcode::subtract_smooth:
+        line = "sx(" + a + ", -" + b + ", " + p(0) + ")";
+        break;
+      case csg_opcode::subtract_blend:
+        line = "mix(" + a + ", sx(" + a + ", -" + b + ", " + p(1) + "), " +
+               p(0) + ")";
+        break;
+      case csg_opcode::group:
+      case csg_opcode::instance:
+      case csg_opcode::mesh: assert(0); break;
+      case csg_opcode::bound:
+      case csg_opcode::cull:
+      case csg_opcode::prune_min:
+      case csg_opcode::prune_max: break;
+    }
+    if (inst.opcode == csg_opcode::prune_min ||
+        inst.opcode == csg_opcode::prune_max) {
+      auto other = inst.opcode == csg_opcode::prune_min ? a : "-" + a;
+      source += "  d = pb(q, " + std::to_string(inst.params) + ");\n";
+      source += "  if (d > " + other + ") " + r + " = d; else {\n";
+      ends.push_back(i + inst.skip);
+      continue;
+    }
+    if (inst.opcode == csg_opcode::bound || inst.opcode == csg_opcode::cull) {
+      auto value = inst.opcode == csg_opcode::bound ? "d + " + p(6)
+                                                    : string{"3.4e38"};
+      source += "  d = gd(q, " + std::to_string(inst.params) + ");\n";
+      source += "  if (d > 0) " + r + " = " + value + "; else {\n";
+      ends.push_back(i + inst.skip);
+      continue;
+    }
+    source += "  " + r + " = " + line + ";\n";
+    while (!ends.empty() && ends.back() == i) {
+      source += "  }\n";
+      ends.pop_back();
+    }
+  }
+  source += "  return r" + std::to_string(tape.instructions.back().r) + ";\n";
+  source += "}\n";
+  return source;
+}
+
+// Fragment shader of the tape, empty if the tape is not supported. Compact
+// shaders read the parameters of quantize_params.
+inline string glsl_source(const CsgTape& tape, bool compact = false) {
+  if (tape.instructions.empty() || !tape.groups.empty() ||
+      !tape.instances.empty() || !tape.meshes.empty())
+    return {};
+  return glsl_header + string{compact ? glsl_compact_params : glsl_params} +
+         glsl_helpers + glsl_primitives_source() + glsl_eval_source(tape) +
+         glsl_march;
+}
+
+// Distance of a sparse grid whose bricks are streamed to the device, see
+// stream_bricks in gpu.h, interpolated as in eval_sparse. The table holds,
+// per brick, its slot in the atlas, or -1 and the bound of far bricks, or
+// -1 and 0 for the bricks that are not resident yet, which are evaluated by
+// the tape. Slots are blocks of (brick_size + 1)^3 samples of the atlas,
+// read with linear filtering at the centers of the samples.
+inline const char* glsl_bricks =
+    R"(
+uniform sampler3D brick_atlas, brick_table;
+uniform vec3  grid_min, grid_max;
+uniform float grid_cell;
+uniform int   brick_size;
+uniform ivec3 grid_bricks, atlas_bricks;
+float csg_eval(vec3 q) {
+  vec3  nearest = clamp(q, grid_min, grid_max);
+  float outside = length(q - nearest);
+  vec3  uvw     = (nearest - grid_min) / grid_cell;
+  ivec3 brick   = clamp(ivec3(uvw / brick_size), ivec3(0), grid_bricks - 1);
+  vec2  entry   = texelFetch(brick_table, brick, 0).rg;
+  if (entry.x < 0 && entry.y != 0) return entry.y + outside;
+  if (entry.x < 0) return csg_tape(q);
+  int   slot   = int(entry.x);
+  ivec3 corner = ivec3(slot % atlas_bricks.x,
+                     (slot / atlas_bricks.x) % atlas_bricks.y,
+                     slot / (atlas_bricks.x * atlas_bricks.y)) *
+                 (brick_size + 1);
+  vec3 local = clamp(uvw - vec3(brick * brick_size), 0.0, float(brick_size));
+  vec3 size  = vec3(textureSize(brick_atlas, 0));
+  return texture(brick_atlas, (vec3(corner) + local + 0.5) / size).r +
+         outside;
+}
+)";
+
+// Fragment shader of the tape over the bricks of a sparse grid, empty if
+// the tape is not supported.
+inline string glsl_bricks_source(const CsgTape& tape, bool compact = false) {
+  if (tape.instructions.empty() || !tape.groups.empty() ||
+      !tape.instances.empty() || !tape.meshes.empty())
+    return {};
+  return glsl_header + string{compact ? glsl_compact_params : glsl_params} +
+         glsl_helpers + glsl_primitives_source() +
+         glsl_eval_source(tape, "csg_tape") + glsl_bricks + glsl_march;
+}
+
+// Shader that writes the values of the tape at a point per fragment, in rows
+// of `width`. Points are read from a float buffer, three values each, or,
+// with a grid size, are the samples of a grid starting from index `first`,
+// x fastest, as in bake_csg_grid.
+inline const char* glsl_points_header =
+    R"(#version 330
+uniform samplerBuffer points;
+uniform int   width, first;
+uniform ivec3 grid_size;  // 0 for points from the buffer
+uniform vec3  grid_min, grid_cell;
+out float frag_value;
+)";
+
+inline const char* glsl_points_main =
+    R"(
+void main() {
+  int  i = int(gl_FragCoord.y) * width + int(gl_FragCoord.x);
+  vec3 q;
+  if (grid_size.x == 0) {
+    q = vec3(texelFetch(points, 3 * i).r, texelFetch(points, 3 * i + 1).r,
+        texelFetch(points, 3 * i + 2).r);
+  } else {
+    int k = first + i;
+    q     = grid_min + grid_cell * vec3(k % grid_size.x,
+                                   (k / grid_size.x) % grid_size.y,
+                                   k / (grid_size.x * grid_size.y));
+  }
+  frag_value = csg_eval(q);
+}
+)";
+
+// Point shader of the tape, empty if the tape is not supported.
+inline string glsl_points_source(const CsgTape& tape, bool compact = false) {
+  if (tape.instructions.empty() || !tape.groups.empty() ||
+      !tape.instances.empty() || !tape.meshes.empty())
+    return {};
+  return glsl_points_header +
+         string{compact ? glsl_compact_params : glsl_params} + glsl_helpers +
+         glsl_primitives_source() + glsl_eval_source(tape) +
+         glsl_points_main;
+}
+
+// Compact parameters of a tape for the GPU, in 16 bits each, that halve the
+// memory and the bandwidth of the parameters of tapes of many primitives.
+// Positions, i.e. the centers of primitives and the corners of the boxes of
+// guards, are fractions of the box of all of them, read as normalized
+// integers, with the boxes of guards rounded outwards so that they still
+// contain their subtrees. The other parameters are halves, read as such:
+// sizes, blends and softness to the nearest, and the growth of guards down,
+// so that their bounds stay below the distances. `error` bounds how far the
+// distance of any primitive moves, as the distance its center moves plus
+// its size change, times √3 for boxes, whose corners move the most.
+struct CsgCompactParams {
+  vector<uint16_t> values = {};
+  bbox3f           box    = {};  // of the positions
+  float            error  = 0;
+};
+
+// Bits of the half nearest to the value, or of the nearest one toward zero,
+// clamped to the largest finite half.
+inline uint16_t half_bits(float value, bool truncate = false) {
+  auto round = [truncate](float x) {
+    return (uint32_t)(truncate ? std::floor(x) : std::nearbyint(x));
+  };
+  auto sign      = (uint32_t)(std::signbit(value) ? 0x8000 : 0);
+  auto magnitude = yocto::min(std::abs(value), 65504.0f);
+  if (magnitude < 0x1p-14f)
+    return (uint16_t)(sign | round(magnitude * 0x1p24f));
+  auto exponent = 0;
+  auto mantissa = std::frexp(magnitude, &exponent) * 2 - 1;
+  // mantissas that round up to 1 carry into the exponent
+  auto bits = ((uint32_t)(exponent + 14) << 10) + round(mantissa * 1024);
+  return (uint16_t)(sign | bits);
+}
+
+inline float half_value(uint16_t bits) {
+  auto exponent = (bits >> 10) & 31, mantissa = bits & 1023;
+  auto value    = exponent == 0
+                      ? std::ldexp((float)mantissa, -24)
+                      : std::ldexp(1 + mantissa / 1024.0f, exponent - 15);
+  return (bits & 0x8000) ? -value : value;
+}
+
+// Coordinates of positions that lead the parameters of the opcode: the
+// center of primitives and the corners of the box of guards.
+inline int num_positions(csg_opcode opcode) {
+  if (opcode == csg_opcode::sphere || opcode == csg_opcode::box) return 3;
+  if (is_guard(opcode)) return 6;
+  return 0;
+}
+
+inline CsgCompactParams quantize_params(const CsgTape& tape) {
+  auto compact = CsgCompactParams{};
+  auto box     = invalidb3f;
+  for (auto& inst : tape.instructions) {
+    for (auto k = 0; k < num_positions(inst.opcode); k++) {
+      auto value      = tape.params[inst.params + k];
+      box.min[k % 3] = yocto::min(box.min[k % 3], value);
+      box.max[k % 3] = yocto::max(box.max[k % 3], value);
+    }
+  }
+  if (box.min.x <= box.max.x) compact.box = box;
+
+  // parameters that are not positions stay halves to the nearest
+  auto& values = compact.values;
+  values.resize(tape.params.size());
+  for (auto k = 0; k < values.size(); k++)
+    values[k] = half_bits(tape.params[k]);
+  auto size = compact.box.max - compact.box.min;
+  auto unit = [&](float value, int axis) {
+    if (size[axis] <= 0) return 0.0f;
+    return (value - compact.box.min[axis]) / size[axis] * 65535;
+  };
+  auto point = [&](int k, int axis) {
+    return compact.box.min[axis] + size[axis] * (values[k] / 65535.0f);
+  };
+  for (auto& inst : tape.instructions) {
+    auto p     = inst.params;
+    auto guard = num_positions(inst.opcode) == 6;
+    for (auto k = 0; k < num_positions(inst.opcode); k++) {
+      auto u = unit(tape.params[p + k], k % 3);
+      u      = !guard ? std::nearbyint(u)
+               : k < 3 ? std::floor(u)
+                       : std::ceil(u);
+      values[p + k] = (uint16_t)yocto::clamp(u, 0.0f, 65535.0f);
+    }
+    if (guard) values[p + 6] = half_bits(tape.params[p + 6], true);
+    if (guard || num_positions(inst.opcode) == 0) continue;
+    auto moved = vec3f{};
+    for (auto k = 0; k < 3; k++)
+      moved[k] = point(p + k, k) - tape.params[p + k];
+    auto grown = std::abs(half_value(values[p + 3]) - tape.params[p + 3]);
+    if (inst.opcode == csg_opcode::box) grown *= std::sqrt(3.0f);
+    compact.error = yocto::max(compact.error, length(moved) + grown);
+  }
+  return compact;
+}
@@ -0,0 +1,766 @@
+#pragma once
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "ext/yocto-gl/yocto/yocto_image.h"
+#include "ext/yocto-gl/yocto/yocto_trace.h"
+#include "glsl.h"
+#include "grid.h"
+#include "jit.h"
+#include "sparse.h"
+
+#if defined(CSG_GPU) && defined(__linux__)
+#define CSG_GPU_EGL
+#define EGL_NO_X11
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+
+#include "ext/yocto-gl/apps/ext/glad/glad.h"
+#endif
+
+// Headless GPU backend: the shaders of glsl.h run in an OpenGL context made
+// through EGL, with no window or display server, for batch evaluation, grid
+// baking and rendering on machines that have a GPU but no screen. The
+// parameters of the latest tape stay in device memory and its shaders are
+// kept by structure, so repeated calls on a tree, e.g. the views of a camera
+// path, upload nothing but what changed. Points and values are streamed in
+// chunks, and the values of a chunk are read back while the next one runs,
+// so device memory stays bounded for any number of points. Devices set to
+// `compact` keep the parameters in 16 bits each, see quantize_params.
+//
+// It is enabled by the CSG_GPU build option on Linux, linked with libEGL and
+// glad. Elsewhere the device is always invalid and callers keep using the
+// CPU. Calls are serialized and can be made from any thread, since the
+// context is made current for each of them. The device is the first one
+// listed by EGL, or the one at the index in the CSG_GPU_DEVICE environment
+// variable.
+//
+// Trees too large to evaluate per fragment are rendered over the bricks of
+// a sparse grid, see sparse.h, which are streamed to an atlas of bounded
+// size, nearest to the camera first, a few thousand per view, see
+// stream_bricks. The tape is evaluated only where the brick is not
+// resident yet, so a camera path shows the full tree from its first view
+// and reads the atlas more as it fills.
+
+// Programs of a tape structure, built the first time they are needed.
+struct CsgGpuProgram {
+  uint32_t points = 0;  // values at points or at the samples of a grid
+  uint32_t render = 0;  // eyelight of an image, see glsl_source
+  uint32_t bricks = 0;  // as render, over bricks, see glsl_bricks_source
+};
+
+// Bricks of a sparse grid resident on the device, in the slots of a 3D
+// atlas, and the table of glsl_bricks that finds them. Slots are taken
+// over from the bricks that were wanted least recently, so the atlas never
+// grows beyond `memory`.
+struct CsgGpuBricks {
+  size_t memory  = (size_t)256 << 20;  // bytes of the atlas
+  int    uploads = 4096;               // bricks streamed per view
+
+  const void*      source   = nullptr;    // samples of the resident grid
+  int              capacity = 0;          // slots of the atlas
+  vec3i            atlas    = {0, 0, 0};  // slots along each axis
+  vector<int>      slots    = {};  // per brick of the grid, or -1
+  vector<int>      owners   = {};  // per slot, its brick or -1
+  vector<uint32_t> wanted   = {};  // per slot, the latest view that wanted it
+  vector<vec2f>    table    = {};  // per brick, see glsl_bricks
+  uint32_t         view     = 0;
+
+  uint32_t atlas_texture = 0;
+  uint32_t table_texture = 0;
+};
+
+struct CsgGpu {
+  void*      display = nullptr;  // EGLDisplay
+  void*      context = nullptr;  // EGLContext
+  string     error   = {};       // of the latest call that failed
+  std::mutex mutex   = {};
+
+  // resident tape, and the programs of the structures seen so far, which
+  // read compact parameters if `compact` is set, see quantize_params
+  bool                                        compact  = false;
+  uint64_t                                    hash     = 0;
+  vector<float>                               params   = {};
+  CsgCompactParams                            resident = {};  // if compact
+  std::unordered_map<uint64_t, CsgGpuProgram> programs = {};
+  CsgGpuBricks                                bricks   = {};
+
+  uint32_t vertex_shader  = 0;
+  uint32_t vertex_array   = 0;
+  uint32_t framebuffer    = 0;
+  uint32_t target         = 0;  // color attachment, resized by each call
+  uint32_t params_buffer  = 0;
+  uint32_t params_texture = 0;
+  uint32_t halves_texture = 0;  // views of compact parameters
+  uint32_t units_texture  = 0;
+  uint32_t points_buffer  = 0;
+  uint32_t points_texture = 0;
+  uint32_t readback[2]    = {0, 0};  // pixel buffers of consecutive chunks
+  int      chunk_size     = 0;       // points per draw
+};
+
+// Options of the march of the render, as march_params in the viewer.
+struct CsgGpuMarch {
+  bbox3f bounds     = {{0, 0, 0}, {1, 1, 1}};
+  float  relaxation = 1;
+  float  footprint  = 0;
+  float  clamp      = 10;  // of the radiance of each sample
+};
+
+inline bool is_valid(const CsgGpu& gpu) { return gpu.context != nullptr; }
+
+inline bool init_gpu(CsgGpu& gpu);
+
+// Device shared by the process, made the first time it is needed. It is
+// invalid if no context could be made, and its error says why.
+inline CsgGpu& get_gpu() {
+  static auto gpu = [] {
+    auto gpu = std::make_unique<CsgGpu>();
+    init_gpu(*gpu);
+    return gpu;
+  }();
+  return *gpu;
+}
+
+// Distance of the film from the lens of a pinhole camera.
+inline float film_distance(const trace_camera& camera) {
+  return camera.focus < flt_max
+             ? camera.lens * camera.focus / (camera.focus - camera.lens)
+             : camera.lens;
+}
+
+// Sampled bricks that the camera may see, nearest first. Bricks are seen if
+// their bounding spheres cross the frustum of the film. Dirty bricks are
+// left to the tape.
+inline vector<int> brick_priorities(
+    const CsgSparseGrid& grid, const trace_camera& camera) {
+  auto distance = film_distance(camera);
+  auto tangent  = vec2f{camera.film.x, camera.film.y} / (2 * distance);
+  auto slope    = vec2f{std::sqrt(1 + tangent.x * tangent.x),
+      std::sqrt(1 + tangent.y * tangent.y)};
+  auto radius   = 0.5f * std::sqrt(3.0f) * grid.cell * grid.brick_size;
+  auto order    = vector<pair<float, int>>{};
+  for (auto brick = 0; brick < grid.index.size(); brick++) {
+    if (grid.index[brick] < 0 || grid.dirty[brick]) continue;
+    auto box = brick_bounds(grid, brick_coords(grid, brick));
+    auto p   = (box.min + box.max) / 2 + 0.5f - camera.frame.o;  // render
+    auto x = dot(p, camera.frame.x), y = dot(p, camera.frame.y),
+         z = -dot(p, camera.frame.z);
+    if (z < -radius || std::abs(x) > tangent.x * z + radius * slope.x ||
+        std::abs(y) > tangent.y * z + radius * slope.y)
+      continue;
+    order.push_back({length(p), brick});
+  }
+  std::sort(order.begin(), order.end());
+  auto bricks = vector<int>(order.size());
+  for (auto i = 0; i < order.size(); i++) bricks[i] = order[i].second;
+  return bricks;
+}
+
+// Makes the grid the resident one, with no brick in the atlas yet. The
+// atlas holds at most `max_slots` along each axis.
+inline void reset_bricks(
+    CsgGpuBricks& bricks, const CsgSparseGrid& grid, int max_slots) {
+  auto sampled  = 0;
+  for (auto index : grid.index) sampled += index >= 0;
+  auto limit    = (size_t)max_slots * max_slots * max_slots;
+  auto per      = (size_t)num_samples(grid) * sizeof(float);
+  auto capacity = std::min({bricks.memory / per, limit, (size_t)sampled});
+  bricks.capacity = yocto::max((int)capacity, 1);
+  bricks.atlas.x  = yocto::min(max_slots, bricks.capacity);
+  bricks.atlas.y  = yocto::min(max_slots,
+      (bricks.capacity + bricks.atlas.x - 1) / bricks.atlas.x);
+  bricks.atlas.z  = (bricks.capacity + bricks.atlas.x * bricks.atlas.y - 1) /
+                   (bricks.atlas.x * bricks.atlas.y);
+  bricks.source = grid.storage.get();
+  bricks.slots  = vector<int>(grid.index.size(), -1);
+  bricks.owners = vector<int>(bricks.capacity, -1);
+  bricks.wanted = vector<uint32_t>(bricks.capacity, 0);
+  bricks.table  = vector<vec2f>(grid.index.size(), {-1, 0});
+  bricks.view   = 0;
+  for (auto brick = 0; brick < grid.index.size(); brick++)
+    if (grid.index[brick] < 0 && !grid.dirty[brick])
+      bricks.table[brick].y = grid.far[brick];
+}
+
+// Picks the bricks to upload for the view, as pairs of brick and slot, and
+// updates the table as if they were uploaded. The nearest bricks that fit
+// the atlas are wanted, and those that are not resident take the slots of
+// the bricks that are not wanted, the ones wanted longest ago first.
+inline vector<pair<int, int>> pick_bricks(CsgGpuBricks& bricks,
+    const CsgSparseGrid& grid, const trace_camera& camera) {
+  auto order = brick_priorities(grid, camera);
+  if (order.size() > bricks.capacity) order.resize(bricks.capacity);
+  bricks.view += 1;
+  auto missing = vector<int>{};
+  for (auto brick : order) {
+    auto slot = bricks.slots[brick];
+    if (slot >= 0) {
+      bricks.wanted[slot] = bricks.view;
+    } else if (missing.size() < bricks.uploads) {
+      missing.push_back(brick);
+    }
+  }
+  auto spare = vector<int>{};
+  for (auto slot = 0; slot < bricks.capacity; slot++)
+    if (bricks.wanted[slot] != bricks.view) spare.push_back(slot);
+  auto count = (int)std::min(missing.size(), spare.size());
+  std::partial_sort(spare.begin(), spare.begin() + count, spare.end(),
+      [&bricks](int a, int b) { return bricks.wanted[a] < bricks.wanted[b]; });
+  auto picked = vector<pair<int, int>>(count);
+  for (auto i = 0; i < count; i++) {
+    auto brick = missing[i], slot = spare[i];
+    if (auto owner = bricks.owners[slot]; owner >= 0) {
+      bricks.slots[owner] = -1;
+      bricks.table[owner] = {-1, 0};
+    }
+    bricks.owners[slot] = brick;
+    bricks.slots[brick] = slot;
+    bricks.wanted[slot] = bricks.view;
+    bricks.table[brick] = {(float)slot, 0};
+    picked[i]           = {brick, slot};
+  }
+  return picked;
+}
+
+#if defined(CSG_GPU_EGL)
+
+// Fragments are drawn by a triangle that covers the viewport.
+inline const char* gpu_vertex_source =
+    R"(#version 330
+void main() {
+  vec2 p      = vec2((gl_VertexID << 1) & 2, gl_VertexID & 2);
+  gl_Position = vec4(p * 2.0 - 1.0, 0, 1);
+}
+)";
+
+// Points of a chunk are drawn in rows of this many fragments.
+inline const int gpu_width = 1024;
+
+inline bool gpu_check(CsgGpu& gpu, const char* what) {
+  auto code = glGetError();
+  if (code == GL_NO_ERROR) return true;
+  char buffer[64];
+  snprintf(buffer, sizeof(buffer), "%s: GL error 0x%x", what, code);
+  gpu.error = buffer;
+  return false;
+}
+
+inline bool init_gpu(CsgGpu& gpu) {
+  auto display = EGL_NO_DISPLAY;
+  auto query   = (PFNEGLQUERYDEVICESEXTPROC)eglGetProcAddress(
+      "eglQueryDevicesEXT");
+  auto platform = (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress(
+      "eglGetPlatformDisplayEXT");
+  if (query && platform) {
+    EGLDeviceEXT devices[16];
+    auto         num   = EGLint{0};
+    auto         index = 0;
+    if (auto device = getenv("CSG_GPU_DEVICE")) index = atoi(device);
+    if (query(16, devices, &num) && num > 0) {
+      if (index < 0 || index >= num) {
+        gpu.error = "no EGL device " + std::to_string(index);
+        return false;
+      }
+      display = platform(EGL_PLATFORM_DEVICE_EXT, devices[index], nullptr);
+      if (!eglInitialize(display, nullptr, nullptr)) display = EGL_NO_DISPLAY;
+    }
+  }
+  if (display == EGL_NO_DISPLAY) {
+    display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+    if (!eglInitialize(display, nullptr, nullptr)) {
+      gpu.error = "no EGL display";
+      return false;
+    }
+  }
+
+  // the context draws to framebuffer objects only, so any configuration works
+  EGLint attributes[] = {EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT, EGL_NONE};
+  auto   config       = EGLConfig{};
+  auto   num_configs  = EGLint{0};
+  eglChooseConfig(display, attributes, &config, 1, &num_configs);
+  EGLint version[] = {EGL_CONTEXT_MAJOR_VERSION, 3, EGL_CONTEXT_MINOR_VERSION,
+      3, EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+      EGL_NONE};
+  auto context = EGL_NO_CONTEXT;
+  if (eglBindAPI(EGL_OPENGL_API))
+    context = eglCreateContext(display, num_configs ? config : nullptr,
+        EGL_NO_CONTEXT, version);
+  if (context == EGL_NO_CONTEXT ||
+      !eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context)) {
+    gpu.error = "no OpenGL 3.3 context without a surface";
+    eglTerminate(display);
+    return false;
+  }
+  if (!gladLoadGLLoader((GLADloadproc)eglGetProcAddress)) {
+    gpu.error = "no OpenGL functions";
+    eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+    eglDestroyContext(display, context);
+    eglTerminate(display);
+    return false;
+  }
+
+  gpu.vertex_shader = glCreateShader(GL_VERTEX_SHADER);
+  glShaderSource(gpu.vertex_shader, 1, &gpu_vertex_source, nullptr);
+  glCompileShader(gpu.vertex_shader);
+  glGenVertexArrays(1, &gpu.vertex_array);
+  glGenFramebuffers(1, &gpu.framebuffer);
+  glGenTextures(1, &gpu.target);
+  glGenBuffers(1, &gpu.params_buffer);
+  glGenBuffers(1, &gpu.points_buffer);
+  glGenBuffers(2, gpu.readback);
+  glGenTextures(1, &gpu.params_texture);
+  glGenTextures(1, &gpu.halves_texture);
+  glGenTextures(1, &gpu.units_texture);
+  glGenTextures(1, &gpu.points_texture);
+  glGenTextures(1, &gpu.bricks.atlas_texture);
+  glGenTextures(1, &gpu.bricks.table_texture);
+  glBindBuffer(GL_TEXTURE_BUFFER, gpu.params_buffer);
+  glBindTexture(GL_TEXTURE_BUFFER, gpu.params_texture);
+  glTexBuffer(GL_TEXTURE_BUFFER, GL_R32F, gpu.params_buffer);
+  glBindTexture(GL_TEXTURE_BUFFER, gpu.halves_texture);
+  glTexBuffer(GL_TEXTURE_BUFFER, GL_R16F, gpu.params_buffer);
+  glBindTexture(GL_TEXTURE_BUFFER, gpu.units_texture);
+  glTexBuffer(GL_TEXTURE_BUFFER, GL_R16, gpu.params_buffer);
+  glBindBuffer(GL_TEXTURE_BUFFER, gpu.points_buffer);
+  glBindTexture(GL_TEXTURE_BUFFER, gpu.points_texture);
+  glTexBuffer(GL_TEXTURE_BUFFER, GL_R32F, gpu.points_buffer);
+
+  // chunks are bounded by the size of buffer textures and of the target
+  auto max_buffer = GLint{0}, max_texture = GLint{0};
+  glGetIntegerv(GL_MAX_TEXTURE_BUFFER_SIZE, &max_buffer);
+  glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max_texture);
+  auto rows      = yocto::min(max_buffer / 3 / gpu_width, max_texture);
+  gpu.chunk_size = yocto::clamp(rows, 1, 1024) * gpu_width;
+
+  auto ok = gpu_check(gpu, "init");
+  eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+  if (!ok) {
+    eglDestroyContext(display, context);
+    eglTerminate(display);
+    return false;
+  }
+  gpu.display = display;
+  gpu.context = context;
+  return true;
+}
+
+// Runs `func` with the context current on this thread, and returns whether
+// it succeeded without GL errors.
+template <typename Func>
+inline bool with_gpu(CsgGpu& gpu, Func&& func) {
+  if (!is_valid(gpu)) return false;
+  auto lock = std::lock_guard{gpu.mutex};
+  if (!eglMakeCurrent(
+          gpu.display, EGL_NO_SURFACE, EGL_NO_SURFACE, gpu.context)) {
+    gpu.error = "context not current";
+    return false;
+  }
+  auto ok = func() && gpu_check(gpu, "draw");
+  eglMakeCurrent(gpu.display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+  return ok;
+}
+
+inline uint32_t gpu_program(CsgGpu& gpu, const string& fragment) {
+  if (fragment.empty()) {
+    gpu.error = "tapes with groups, meshes or instances are not supported";
+    return 0;
+  }
+  auto shader = glCreateShader(GL_FRAGMENT_SHADER);
+  auto source = fragment.c_str();
+  glShaderSource(shader, 1, &source, nullptr);
+  glCompileShader(shader);
+  auto program = glCreateProgram();
+  glAttachShader(program, gpu.vertex_shader);
+  glAttachShader(program, shader);
+  glLinkProgram(program);
+  glDeleteShader(shader);
+  auto linked = GLint{0};
+  glGetProgramiv(program, GL_LINK_STATUS, &linked);
+  if (!linked) {
+    char log[1024];
+    glGetProgramInfoLog(program, sizeof(log), nullptr, log);
+    gpu.error = string{"shader not built: "} + log;
+    glDeleteProgram(program);
+    return 0;
+  }
+  return program;
+}
+
+// Makes the tape resident and returns its program, building it if needed.
+// Parameters are uploaded only if they differ from the resident ones.
+// Compact parameters are read through the views of halves and of units of
+// the same buffer, see glsl_compact_params. Render programs read the
+// resident bricks if `bricks` is set.
+inline uint32_t use_tape(
+    CsgGpu& gpu, const CsgTape& tape, bool render, bool bricks = false) {
+  auto  hash     = structure_hash(tape);
+  auto  compact  = gpu.compact;
+  auto& programs = gpu.programs[compact ? mix_hash(hash, (uint64_t)1) : hash];
+  auto& program  = bricks ? programs.bricks
+                          : (render ? programs.render : programs.points);
+  if (!program) {
+    program = bricks   ? gpu_program(gpu, glsl_bricks_source(tape, compact))
+              : render ? gpu_program(gpu, glsl_source(tape, compact))
+                       : gpu_program(gpu, glsl_points_source(tape, compact));
+    if (!program) return 0;
+  }
+  auto resident_compact = !gpu.resident.values.empty();
+  if (hash != gpu.hash || tape.params != gpu.params ||
+      compact != resident_compact) {
+    glBindBuffer(GL_TEXTURE_BUFFER, gpu.params_buffer);
+    gpu.resident = compact ? quantize_params(tape) : CsgCompactParams{};
+    if (compact) {
+      glBufferData(GL_TEXTURE_BUFFER,
+          gpu.resident.values.size() * sizeof(uint16_t),
+          gpu.resident.values.data(), GL_STATIC_DRAW);
+    } else {
+      glBufferData(GL_TEXTURE_BUFFER, tape.params.size() * sizeof(float),
+          tape.params.data(), GL_STATIC_DRAW);
+    }
+    gpu.hash   = hash;
+    gpu.params = tape.params;
+  }
+  glUseProgram(program);
+  glActiveTexture(GL_TEXTURE0);
+  glBindTexture(GL_TEXTURE_BUFFER,
+      compact ? gpu.halves_texture : gpu.params_texture);
+  glUniform1i(glGetUniformLocation(program, "values"), 0);
+  if (compact) {
+    auto& box  = gpu.resident.box;
+    auto  size = box.max - box.min;
+    glActiveTexture(GL_TEXTURE2);
+    glBindTexture(GL_TEXTURE_BUFFER, gpu.units_texture);
+    glUniform1i(glGetUniformLocation(program, "units"), 2);
+    glUniform3f(glGetUniformLocation(program, "units_min"), box.min.x,
+        box.min.y, box.min.z);
+    glUniform3f(
+        glGetUniformLocation(program, "units_size"), size.x, size.y, size.z);
+  }
+  return program;
+}
+
+// Sets the target to a texture of `size`, drawn over all of it.
+inline void use_target(CsgGpu& gpu, const vec2i& size, bool color) {
+  glBindTexture(GL_TEXTURE_2D, gpu.target);
+  glTexImage2D(GL_TEXTURE_2D, 0, color ? GL_RGBA32F : GL_R32F, size.x, size.y,
+      0, color ? GL_RGBA : GL_RED, GL_FLOAT, nullptr);
+  glBindFramebuffer(GL_FRAMEBUFFER, gpu.framebuffer);
+  glFramebufferTexture2D(
+      GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, gpu.target, 0);
+  glViewport(0, 0, size.x, size.y);
+  glBindVertexArray(gpu.vertex_array);
+}
+
+// Draws the values of `num` points, from the points or, without them, from
+// the samples of the grid, and writes them to `out`. The values of a chunk
+// are read into a pixel buffer, and copied once the next chunk is drawn.
+inline bool eval_gpu_points(CsgGpu& gpu, const CsgTape& tape,
+    const vec3f* points, const CsgGrid* grid, float* out, int num) {
+  return with_gpu(gpu, [&]() {
+    auto program = use_tape(gpu, tape, false);
+    if (!program) return false;
+    auto uniform = [program](const char* name) {
+      return glGetUniformLocation(program, name);
+    };
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_BUFFER, gpu.points_texture);
+    glUniform1i(uniform("points"), 1);
+    glUniform1i(uniform("width"), gpu_width);
+    auto size = grid ? grid->size : vec3i{0, 0, 0};
+    glUniform3i(uniform("grid_size"), size.x, size.y, size.z);
+    if (grid) {
+      auto cell = grid_cell(*grid);
+      glUniform3f(uniform("grid_min"), grid->bounds.min.x, grid->bounds.min.y,
+          grid->bounds.min.z);
+      glUniform3f(uniform("grid_cell"), cell.x, cell.y, cell.z);
+    }
+    use_target(gpu, {gpu_width, gpu.chunk_size / gpu_width}, false);
+
+    // chunk drawn before the current one, whose values are still to copy
+    auto previous = vec3i{0, 0, -1};  // first point, count, pixel buffer
+    auto copy     = [&]() {
+      if (previous.z < 0) return;
+      glBindBuffer(GL_PIXEL_PACK_BUFFER, gpu.readback[previous.z]);
+      auto data = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0,
+          previous.y * sizeof(float), GL_MAP_READ_BIT);
+      if (data) memcpy(out + previous.x, data, previous.y * sizeof(float));
+      glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+    };
+    for (auto begin = 0, k = 0; begin < num; begin += gpu.chunk_size, k++) {
+      auto count = yocto::min(gpu.chunk_size, num - begin);
+      auto rows  = (count + gpu_width - 1) / gpu_width;
+      if (points) {
+        glBindBuffer(GL_TEXTURE_BUFFER, gpu.points_buffer);
+        glBufferData(GL_TEXTURE_BUFFER, count * sizeof(vec3f), points + begin,
+            GL_STREAM_DRAW);
+      } else {
+        glUniform1i(uniform("first"), begin);
+      }
+      glViewport(0, 0, gpu_width, rows);
+      glDrawArrays(GL_TRIANGLES, 0, 3);
+      glBindBuffer(GL_PIXEL_PACK_BUFFER, gpu.readback[k % 2]);
+      glBufferData(GL_PIXEL_PACK_BUFFER, rows * gpu_width * sizeof(float),
+          nullptr, GL_STREAM_READ);
+      glReadPixels(0, 0, gpu_width, rows, GL_RED, GL_FLOAT, nullptr);
+      copy();
+      previous = {begin, count, k % 2};
+    }
+    copy();
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    return true;
+  });
+}
+
+// Draws `samples` jittered samples per pixel of the program, blended into
+// the target as they are drawn.
+inline void draw_samples(CsgGpu& gpu, uint32_t program, const CsgTape& tape,
+    const trace_camera& camera, const vec2i& size, int samples,
+    const CsgGpuMarch& march) {
+  auto uniform = [program](const char* name, const vec3f& value) {
+    glUniform3f(
+        glGetUniformLocation(program, name), value.x, value.y, value.z);
+  };
+  auto location = [program](const char* name) {
+    return glGetUniformLocation(program, name);
+  };
+  uniform("camera_x", camera.frame.x);
+  uniform("camera_y", camera.frame.y);
+  uniform("camera_z", camera.frame.z);
+  uniform("camera_o", camera.frame.o);
+  uniform("bounds_min", march.bounds.min);
+  uniform("bounds_max", march.bounds.max);
+  glUniform2f(location("image_size"), (float)size.x, (float)size.y);
+  glUniform2f(location("camera_film"), camera.film.x, camera.film.y);
+  glUniform1f(location("camera_distance"), film_distance(camera));
+  glUniform1f(location("relaxation"), march.relaxation);
+  glUniform1f(location("footprint"), march.footprint);
+  glUniform1f(location("lipschitz"), tape.lipschitz);
+  glUniform1f(location("max_radiance"), march.clamp);
+  use_target(gpu, size, true);
+  glEnable(GL_BLEND);
+  glBlendFunc(GL_CONSTANT_ALPHA, GL_ONE_MINUS_CONSTANT_ALPHA);
+  for (auto sample = 0; sample < samples; sample++) {
+    glUniform1i(location("sample_index"), sample);
+    glBlendColor(0, 0, 0, 1.0f / (sample + 1));
+    glDrawArrays(GL_TRIANGLES, 0, 3);
+    glFlush();
+  }
+  glDisable(GL_BLEND);
+}
+
+// Draws the samples as draw_samples and reads them to `render`.
+inline void draw_render(CsgGpu& gpu, uint32_t program, const CsgTape& tape,
+    const trace_camera& camera, const vec2i& size, int samples,
+    const CsgGpuMarch& march, image<vec4f>& render) {
+  draw_samples(gpu, program, tape, camera, size, samples, march);
+  render = image{size, zero4f};
+  glReadPixels(0, 0, size.x, size.y, GL_RGBA, GL_FLOAT, render.data());
+}
+
+// Image of the tape seen by a pinhole camera, as in the viewer, with
+// `samples` jittered samples per pixel blended into the target as they are
+// drawn. Returns false, with the error in the device, if it was not made.
+inline bool render_csg_gpu(CsgGpu& gpu, const CsgTape& tape,
+    const trace_camera& camera, const vec2i& size, int samples,
+    const CsgGpuMarch& march, image<vec4f>& render) {
+  if (camera.orthographic || camera.aperture) {
+    gpu.error = "only pinhole cameras are supported";
+    return false;
+  }
+  return with_gpu(gpu, [&]() {
+    auto program = use_tape(gpu, tape, true);
+    if (!program) return false;
+    draw_render(gpu, program, tape, camera, size, samples, march, render);
+    return true;
+  });
+}
+
+// Images of `size` of the tape seen by the cameras, as render_csg_gpu, for
+// camera paths rendered without a display. Each view is read into a pixel
+// buffer while the next one is drawn, as the chunks of eval_gpu_points, so
+// the device does not wait for the copies. Returns false, with the error in
+// the device, if they were not made.
+inline bool render_csg_gpu_views(CsgGpu& gpu, const CsgTape& tape,
+    const vector<trace_camera>& cameras, const vec2i& size, int samples,
+    const vector<CsgGpuMarch>& marches, vector<image<vec4f>>& renders) {
+  assert(cameras.size() == marches.size());
+  for (auto& camera : cameras) {
+    if (camera.orthographic || camera.aperture) {
+      gpu.error = "only pinhole cameras are supported";
+      return false;
+    }
+  }
+  renders.assign(cameras.size(), image{size, zero4f});
+  return with_gpu(gpu, [&]() {
+    auto program = use_tape(gpu, tape, true);
+    if (!program) return false;
+    auto bytes = (size_t)size.x * size.y * sizeof(vec4f);
+    auto copy  = [&](int view) {
+      glBindBuffer(GL_PIXEL_PACK_BUFFER, gpu.readback[view % 2]);
+      auto data = glMapBufferRange(
+          GL_PIXEL_PACK_BUFFER, 0, bytes, GL_MAP_READ_BIT);
+      if (data) memcpy(renders[view].data(), data, bytes);
+      glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+    };
+    for (auto view = 0; view < cameras.size(); view++) {
+      draw_samples(
+          gpu, program, tape, cameras[view], size, samples, marches[view]);
+      glBindBuffer(GL_PIXEL_PACK_BUFFER, gpu.readback[view % 2]);
+      glBufferData(GL_PIXEL_PACK_BUFFER, bytes, nullptr, GL_STREAM_READ);
+      glReadPixels(0, 0, size.x, size.y, GL_RGBA, GL_FLOAT, nullptr);
+      if (view > 0) copy(view - 1);
+    }
+    if (!cameras.empty()) copy((int)cameras.size() - 1);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    return true;
+  });
+}
+
+// Streams the bricks of the grid that the camera sees to the atlas, see
+// pick_bricks, and uploads the table if any of them moved. The atlas is
+// made again when the grid has new samples, and grids sampled again in
+// place, e.g. by refill_sparse, are made resident with reset_bricks.
+inline void stream_bricks(
+    CsgGpu& gpu, const CsgSparseGrid& grid, const trace_camera& camera) {
+  auto& bricks = gpu.bricks;
+  auto  n      = grid.brick_size + 1;
+  if (bricks.source != grid.storage.get() ||
+      bricks.slots.size() != grid.index.size() || bricks.capacity == 0) {
+    auto max_size = GLint{0};
+    glGetIntegerv(GL_MAX_3D_TEXTURE_SIZE, &max_size);
+    reset_bricks(bricks, grid, yocto::max(max_size / n, 1));
+    auto texels = bricks.atlas * n;
+    glBindTexture(GL_TEXTURE_3D, bricks.atlas_texture);
+    glTexImage3D(GL_TEXTURE_3D, 0, GL_R32F, texels.x, texels.y, texels.z, 0,
+        GL_RED, GL_FLOAT, nullptr);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    for (auto wrap : {GL_TEXTURE_WRAP_S, GL_TEXTURE_WRAP_T, GL_TEXTURE_WRAP_R})
+      glTexParameteri(GL_TEXTURE_3D, wrap, GL_CLAMP_TO_EDGE);
+    glBindTexture(GL_TEXTURE_3D, bricks.table_texture);
+    glTexImage3D(GL_TEXTURE_3D, 0, GL_RG32F, grid.bricks.x, grid.bricks.y,
+        grid.bricks.z, 0, GL_RG, GL_FLOAT, bricks.table.data());
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+  }
+  auto picked = pick_bricks(bricks, grid, camera);
+  if (picked.empty()) return;
+  glBindTexture(GL_TEXTURE_3D, bricks.atlas_texture);
+  for (auto [brick, slot] : picked) {
+    auto corner = vec3i{slot % bricks.atlas.x,
+                      (slot / bricks.atlas.x) % bricks.atlas.y,
+                      slot / (bricks.atlas.x * bricks.atlas.y)} *
+                  n;
+    glTexSubImage3D(GL_TEXTURE_3D, 0, corner.x, corner.y, corner.z, n, n, n,
+        GL_RED, GL_FLOAT,
+        grid.values.data() + (size_t)grid.index[brick] * num_samples(grid));
+  }
+  glBindTexture(GL_TEXTURE_3D, bricks.table_texture);
+  glTexSubImage3D(GL_TEXTURE_3D, 0, 0, 0, 0, grid.bricks.x, grid.bricks.y,
+      grid.bricks.z, GL_RG, GL_FLOAT, bricks.table.data());
+}
+
+// Image of the tape as render_csg_gpu, over the bricks of the grid, which
+// are streamed for the camera first, so that the following views of a path
+// find more of them resident.
+inline bool render_sparse_gpu(CsgGpu& gpu, const CsgTape& tape,
+    const CsgSparseGrid& grid, const trace_camera& camera, const vec2i& size,
+    int samples, const CsgGpuMarch& march, image<vec4f>& render) {
+  if (camera.orthographic || camera.aperture) {
+    gpu.error = "only pinhole cameras are supported";
+    return false;
+  }
+  return with_gpu(gpu, [&]() {
+    auto program = use_tape(gpu, tape, true, true);
+    if (!program) return false;
+    stream_bricks(gpu, grid, camera);
+    auto location = [program](const char* name) {
+      return glGetUniformLocation(program, name);
+    };
+    auto& bricks = gpu.bricks;
+    glActiveTexture(GL_TEXTURE3);
+    glBindTexture(GL_TEXTURE_3D, bricks.atlas_texture);
+    glUniform1i(location("brick_atlas"), 3);
+    glActiveTexture(GL_TEXTURE4);
+    glBindTexture(GL_TEXTURE_3D, bricks.table_texture);
+    glUniform1i(location("brick_table"), 4);
+    glUniform3f(location("grid_min"), grid.bounds.min.x, grid.bounds.min.y,
+        grid.bounds.min.z);
+    glUniform3f(location("grid_max"), grid.bounds.max.x, grid.bounds.max.y,
+        grid.bounds.max.z);
+    glUniform1f(location("grid_cell"), grid.cell);
+    glUniform1i(location("brick_size"), grid.brick_size);
+    glUniform3i(location("grid_bricks"), grid.bricks.x, grid.bricks.y,
+        grid.bricks.z);
+    glUniform3i(location("atlas_bricks"), bricks.atlas.x, bricks.atlas.y,
+        bricks.atlas.z);
+    glActiveTexture(GL_TEXTURE0);
+    draw_render(gpu, program, tape, camera, size, samples, march, render);
+    return true;
+  });
+}
+
+#else
+
+inline bool init_gpu(CsgGpu& gpu) {
+  gpu.error = "built without CSG_GPU";
+  return false;
+}
+
+inline bool eval_gpu_points(CsgGpu& gpu, const CsgTape& tape,
+    const vec3f* points, const CsgGrid* grid, float* out, int num) {
+  return false;
+}
+
+inline bool render_csg_gpu(CsgGpu& gpu, const CsgTape& tape,
+    const trace_camera& camera, const vec2i& size, int samples,
+    const CsgGpuMarch& march, image<vec4f>& render) {
+  return false;
+}
+
+inline bool render_csg_gpu_views(CsgGpu& gpu, const CsgTape& tape,
+    const vector<trace_camera>& cameras, const vec2i& size, int samples,
+    const vector<CsgGpuMarch>& marches, vector<image<vec4f>>& renders) {
+  return false;
+}
+
+inline bool render_sparse_gpu(CsgGpu& gpu, const CsgTape& tape,
+    const CsgSparseGrid& grid, const trace_camera& camera, const vec2i& size,
+    int samples, const CsgGpuMarch& march, image<vec4f>& render) {
+  return false;
+}
+
+#endif
+
+// Values of the tape at the points, written to `out`, as eval_csg_batch.
+// Returns false, with the error in the device, if they were not evaluated.
+inline bool eval_csg_batch_gpu(CsgGpu& gpu, const CsgTape& tape,
+    span<const vec3f> points, span<float> out) {
+  assert(points.size() == out.size());
+  return eval_gpu_points(
+      gpu, tape, points.data(), nullptr, out.data(), (int)points.size());
+}
+
+inline bool eval_csg_batch_gpu(CsgGpu& gpu, const CsgTree& csg,
+    span<const vec3f> points, span<float> out) {
+  return eval_csg_batch_gpu(gpu, compile_csg(csg, flt_max), points, out);
+}
+
+// Samples the tree as bake_csg_grid, with the points made on the device.
+inline bool bake_csg_grid_gpu(CsgGpu& gpu, const CsgTree& csg,
+    const bbox3f& bounds, int resolution, CsgGrid& grid) {
+  grid        = init_grid(bounds, resolution);
+  auto values = std::make_shared<vector<float>>(
+      grid.size.x * grid.size.y * grid.size.z);
+  if (!eval_gpu_points(gpu, compile_csg(csg, flt_max), nullptr, &grid,
+          values->data(), (int)values->size()))
+    return false;
+  grid.values  = {values->data(), values->size()};
+  grid.storage = values;
+  return true;
+}
@@ -0,0 +1,164 @@
+#pragma once
+#include "csg.h"
+#include "ext/yocto-gl/yocto/yocto_common.h"
+#include "pool.h"
+
+// Reverse-mode differentiation with respect to the tree parameters. The
+// forward pass stores the value of every node in post order, then adjoints
+// are propagated from the root back to the leaves, so that one backward
+// pass gives the derivatives for all the parameters at once.
+
+// Derivatives with respect to the parameters of each node, indexed like
+// CsgTree::nodes. Primitives use the first four parameters. The spheres of
+// groups, meshes and the trees of instances are not differentiated.
+struct CsgGradient {
+  vector<array<float, 4>> params   = {};
+  vector<float>           blend    = {};
+  vector<float>           softness = {};
+};
+
+inline CsgGradient make_gradient(const CsgTree& csg) {
+  auto gradient     = CsgGradient{};
+  gradient.params   = vector<array<float, 4>>(csg.nodes.size(), {0, 0, 0, 0});
+  gradient.blend    = vector<float>(csg.nodes.size(), 0);
+  gradient.softness = vector<float>(csg.nodes.size(), 0);
+  return gradient;
+}
+
+inline void accumulate(CsgGradient& gradient, const CsgGradient& other) {
+  for (auto i = 0; i < gradient.params.size(); i++) {
+    for (auto k = 0; k < 4; k++) gradient.params[i][k] += other.params[i][k];
+    gradient.blend[i] += other.blend[i];
+    gradient.softness[i] += other.softness[i];
+  }
+}
+
+// Partial derivatives of smin(a, b, k) and smax(a, b, k) with respect to
+// a, b and k. Ties pick the same operand as min and max.
+inline vec3f smin_partials(float a, float b, float k) {
+  auto da = a < b ? 1.0f : 0.0f;
+  if (k == 0) return {da, 1 - da, 0};
+  auto d = a - b;
+  auto h = max(k - yocto::abs(d), 0.0f) / k;
+  auto s = d < 0 ? -1.0f : 1.0f;
+  return {da + h * s / 2, 1 - da - h * s / 2,
+      -(h * h / 4 + h * yocto::abs(d) / (2 * k))};
+}
+
+inline vec3f smax_partials(float a, float b, float k) {
+  auto da = a > b ? 1.0f : 0.0f;
+  if (k == 0) return {da, 1 - da, 0};
+  auto d = a - b;
+  auto h = max(k - yocto::abs(d), 0.0f) / k;
+  auto s = d > 0 ? 1.0f : -1.0f;
+  return {da - h * s / 2, 1 - da + h * s / 2,
+      h * h / 4 + h * yocto::abs(d) / (2 * k)};
+}
+
+// Adds to `gradient` the derivatives of weight * eval_csg(csg, position),
+// given the `values` of the nodes that eval_csg left at the point, e.g. when
+// the weight depends on the value. `adjoints` is scratch of one float per
+// node.
+inline void backpropagate(CsgGradient& gradient, const vector<float>& values,
+    vector<float>& adjoints, const CsgTree& csg, const vec3f& position,
+    float weight) {
+  assert(values.size() == csg.nodes.size());
+  assert(adjoints.size() == csg.nodes.size());
+  std::fill(adjoints.begin(), adjoints.end(), 0.0f);
+  adjoints[csg.root] = weight;
+
+  for (auto i = csg.root; i >= 0; i--) {
+    auto& node = csg.nodes[i];
+    auto  w    = adjoints[i];
+    if (w == 0) continue;
+    if (node.children == vec2i{-1, -1}) {
+      auto& primitive = node.primitive;
+      if (primitive.type != primitive_type::sphere) continue;
+      auto center    = vec3f{
+          primitive.params[0], primitive.params[1], primitive.params[2]};
+      auto distance  = length(position - center);
+      auto direction = distance > 0 ? (position - center) / distance
+                                    : vec3f{0, 0, 0};
+      auto& params   = gradient.params[i];
+      params[0] -= w * direction.x;
+      params[1] -= w * direction.y;
+      params[2] -= w * direction.z;
+      params[3] -= w;
+      continue;
+    }
+
+    auto& operation = node.operation;
+    auto [a, b]     = node.children;
+    auto f          = values[a];
+    auto g          = values[b];
+    auto k          = operation.softness;
+    if (operation.blend >= 0) {
+      // Union: lerp(f, smin(f, g, k), blend)
+      auto u = operation.blend;
+      auto s = smin(f, g, k);
+      auto d = smin_partials(f, g, k);
+      adjoints[a] += w * ((1 - u) + u * d.x);
+      adjoints[b] += w * u * d.y;
+      gradient.softness[i] += w * u * d.z;
+      gradient.blend[i] += w * (s - f);
+    } else {
+      // Subtraction: lerp(f, smax(f, -g, k), -blend)
+      auto u = -operation.blend;
+      auto s = smax(f, -g, k);
+      auto d = smax_partials(f, -g, k);
+      adjoints[a] += w * ((1 - u) + u * d.x);
+      adjoints[b] -= w * u * d.y;
+      gradient.softness[i] += w * u * d.z;
+      gradient.blend[i] -= w * (s - f);
+    }
+  }
+}
+
+// Adds to `gradient` the derivatives of weight * eval_csg(csg, position).
+// `values` and `adjoints` are scratch of one float per node. Returns the
+// value at the point.
+inline float accumulate_gradient(CsgGradient& gradient, vector<float>& values,
+    vector<float>& adjoints, const CsgTree& csg, const vec3f& position,
+    float weight) {
+  assert(values.size() == csg.nodes.size());
+  auto value = eval_csg(values, csg, position);
+  backpropagate(gradient, values, adjoints, csg, position, weight);
+  return value;
+}
+
+// Derivatives of eval_csg(csg, position) with respect to all the parameters.
+inline CsgGradient eval_csg_params_grad(
+    const CsgTree& csg, const vec3f& position) {
+  auto gradient = make_gradient(csg);
+  auto values   = vector<float>(csg.nodes.size());
+  auto adjoints = vector<float>(csg.nodes.size());
+  accumulate_gradient(gradient, values, adjoints, csg, position, 1);
+  return gradient;
+}
+
+// Sum over the points of the parameter derivatives, each scaled by its
+// weight, e.g. the derivative of a loss with respect to the point value.
+// Points are split in fixed chunks evaluated in parallel, and chunks are
+// summed in order so that the result does not depend on scheduling.
+inline CsgGradient eval_csg_params_grad(const CsgTree& csg,
+    const vector<vec3f>& points, const vector<float>& weights) {
+  assert(points.size() == weights.size());
+  const auto chunk_size = 1024;
+  auto       num_chunks = ((int)points.size() + chunk_size - 1) / chunk_size;
+  auto       chunks     = vector<CsgGradient>(num_chunks);
+  parallel_for(num_chunks, [&](int chunk) {
+    auto gradient = make_gradient(csg);
+    auto values   = vector<float>(csg.nodes.size());
+    auto adjoints = vector<float>(csg.nodes.size());
+    auto begin    = chunk * chunk_size;
+    auto end      = yocto::min(begin + chunk_size, (int)points.size());
+    for (auto i = begin; i < end; i++)
+      accumulate_gradient(
+          gradient, values, adjoints, csg, points[i], weights[i]);
+    chunks[chunk] = std::move(gradient);
+  }, pool_priority());
+
+  auto gradient = make_gradient(csg);
+  for (auto& chunk : chunks) accumulate(gradient, chunk);
+  return gradient;
+}
@@ -0,0 +1,103 @@
+#pragma once
+#include <memory>
+
+#include "batch.h"
+
+// Distances sampled at the corners of a regular grid, for previews and for
+// trees large enough that trilinear interpolation is much cheaper than
+// evaluating them. Values are exact at the samples, so the surface is
+// reproduced within about a cell.
+
+// The samples are owned by `storage`, either in memory or mapped from a
+// file (see grid_io.h), and copies of a grid share them.
+struct CsgGrid {
+  bbox3f                      bounds  = {};
+  vec3i                       size    = {0, 0, 0};  // samples along each axis
+  span<const float>           values  = {};  // x fastest, then y and z
+  std::shared_ptr<const void> storage = {};
+};
+
+inline vec3f grid_cell(const CsgGrid& grid) {
+  auto size = grid.size - vec3i{1, 1, 1};
+  return (grid.bounds.max - grid.bounds.min) /
+         vec3f{(float)size.x, (float)size.y, (float)size.z};
+}
+
+// Grid over `bounds` with cubic cells and `resolution` samples along the
+// longest side, without values. Its bounds grow to a whole number of cells.
+inline CsgGrid init_grid(const bbox3f& bounds, int resolution) {
+  assert(resolution >= 2);
+  auto grid   = CsgGrid{};
+  auto extent = bounds.max - bounds.min;
+  auto cell   = yocto::max(extent) / (resolution - 1);
+  for (auto k = 0; k < 3; k++)
+    grid.size[k] = yocto::max((int)std::ceil(extent[k] / cell - 1e-3f), 1) + 1;
+  grid.bounds.min = bounds.min;
+  grid.bounds.max = bounds.min + cell * vec3f{(float)grid.size.x - 1,
+                                            (float)grid.size.y - 1,
+                                            (float)grid.size.z - 1};
+  return grid;
+}
+
+// Samples the tree over `bounds`, see init_grid. Points are generated block
+// by block and evaluated in parallel by the batch kernel.
+inline CsgGrid bake_csg_grid(
+    const CsgTree& csg, const bbox3f& bounds, int resolution) {
+  auto grid   = init_grid(bounds, resolution);
+  auto cell   = grid_cell(grid).x;
+  auto num    = grid.size.x * grid.size.y * grid.size.z;
+  auto values = std::make_shared<vector<float>>(num);
+
+  auto tape   = compile_csg(csg, flt_max);
+  auto kernel = get_kernel().eval;
+  parallel_for_chunks(num, [&](int begin, int end) {
+    auto points = vector<vec3f>(end - begin);
+    for (auto i = begin; i < end; i++) {
+      auto x = i % grid.size.x, y = (i / grid.size.x) % grid.size.y,
+           z = i / (grid.size.x * grid.size.y);
+      points[i - begin] = grid.bounds.min +
+                          cell * vec3f{(float)x, (float)y, (float)z};
+    }
+    kernel(tape, points.data(), values->data() + begin, end - begin);
+  });
+  grid.values  = {values->data(), values->size()};
+  grid.storage = values;
+  return grid;
+}
+
+// Trilinear interpolation of the samples. Outside the grid, the distance
+// from the grid is added to the value at the nearest point on its boundary.
+inline float eval_grid(const CsgGrid& grid, const vec3f& position) {
+  auto nearest = min(max(position, grid.bounds.min), grid.bounds.max);
+  auto uvw     = (nearest - grid.bounds.min) / grid_cell(grid);
+  auto ijk     = vec3i{};
+  auto t       = vec3f{};
+  for (auto k = 0; k < 3; k++) {
+    ijk[k] = yocto::clamp((int)uvw[k], 0, grid.size[k] - 2);
+    t[k]   = uvw[k] - ijk[k];
+  }
+  auto at = [&grid](int i, int j, int k) {
+    return grid.values[(k * grid.size.y + j) * grid.size.x + i];
+  };
+  auto [i, j, k] = ijk;
+  auto x00 = lerp(at(i, j, k), at(i + 1, j, k), t.x);
+  auto x10 = lerp(at(i, j + 1, k), at(i + 1, j + 1, k), t.x);
+  auto x01 = lerp(at(i, j, k + 1), at(i + 1, j, k + 1), t.x);
+  auto x11 = lerp(at(i, j + 1, k + 1), at(i + 1, j + 1, k + 1), t.x);
+  auto value = lerp(lerp(x00, x10, t.y), lerp(x01, x11, t.y), t.z);
+  return value + length(position - nearest);
+}
+
+// Gradient of the interpolated distance by central differences over a cell.
+inline vec3f eval_grid_grad(const CsgGrid& grid, const vec3f& position) {
+  auto cell = grid_cell(grid);
+  auto grad = vec3f{};
+  for (auto k = 0; k < 3; k++) {
+    auto offset = vec3f{0, 0, 0};
+    offset[k]   = cell[k] / 2;
+    grad[k]     = (eval_grid(grid, position + offset) -
+                  eval_grid(grid, position - offset)) /
+              cell[k];
+  }
+  return grad;
+}
@@ -0,0 +1,336 @@
+#pragma once
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+
+#include "memory.h"
+#include "sparse.h"
+#include "user_cache.h"
+
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#else
+#include <process.h>
+#endif
+
+// Binary files of baked grids, so that a scene baked once starts from the
+// file afterwards. Files start with a fixed header that holds a hash of the
+// tree and of the bake parameters, followed by the brick tables of sparse
+// grids and by the samples, aligned to 64 bytes. Samples are mapped in
+// place on POSIX systems, so loading copies nothing and processes that map
+// the same file share its pages. Sparse samples are mapped copy-on-write,
+// so that refills only copy the pages they touch. Elsewhere files are read
+// in memory.
+//
+// Files are written next to their final name and renamed when complete, so
+// that concurrent readers never see a partial file. Loads check the sizes
+// of the grids and the brick tables against the samples in the file, so
+// that damaged files are baked again rather than read past their end. The
+// cache folder is the grid folder of the user, see user_cache_directory,
+// and can be changed with the CSG_GRID_CACHE environment variable.
+
+// Hash of everything that changes the values of the tree, i.e. all but the
+// node names.
+inline uint64_t hash_csg(const CsgTree& csg) {
+  auto hash = (uint64_t)14695981039346656037ull;
+  auto mix  = [&hash](const void* data, size_t size) {
+    for (auto i = 0; i < size; i++) {
+      hash ^= ((const uint8_t*)data)[i];
+      hash *= 1099511628211ull;
+    }
+  };
+  for (auto& node : csg.nodes) {
+    mix(&node.children, sizeof(node.children));
+    if (node.children == vec2i{-1, -1}) {
+      mix(&node.primitive.type, sizeof(node.primitive.type));
+      mix(node.primitive.params, sizeof(float) * 4);
+      mix(&node.group, sizeof(node.group));
+    } else {
+      mix(&node.operation, sizeof(node.operation));
+    }
+  }
+  for (auto& group : csg.groups) {
+    mix(group.centers.data(), group.centers.size() * sizeof(vec3f));
+    mix(group.radius.data(), group.radius.size() * sizeof(float));
+  }
+  for (auto& mesh : csg.meshes) {
+    mix(mesh.positions.data(), mesh.positions.size() * sizeof(vec3f));
+    mix(mesh.triangles.data(), mesh.triangles.size() * sizeof(vec3i));
+  }
+  for (auto& instance : csg.instances) {
+    auto tree = hash_csg(*instance.tree);
+    mix(&instance.frame, sizeof(instance.frame));
+    mix(&instance.fold, sizeof(instance.fold));
+    mix(&tree, sizeof(tree));
+  }
+  mix(&csg.root, sizeof(csg.root));
+  return hash;
+}
+
+struct CsgGridHeader {
+  char     magic[8]   = {'c', 's', 'g', 'g', 'r', 'i', 'd', 0};
+  uint32_t version    = 1;
+  uint32_t sparse     = 0;
+  uint64_t hash       = 0;
+  float    bounds[6]  = {};
+  int32_t  size[3]    = {};  // samples for dense grids, bricks for sparse
+  float    cell       = 0;
+  float    band       = 0;
+  int32_t  brick_size = 0;
+  uint64_t num_free   = 0;
+  uint64_t num_values = 0;
+  uint64_t offset     = 0;  // of the samples
+};
+
+inline uint64_t align_offset(uint64_t offset) {
+  return (offset + 63) / 64 * 64;
+}
+
+// Key of a bake: the hash of the root, see update_hashes, mixed with the
+// parameters, so that equal trees share bakes whatever their names.
+inline uint64_t grid_key(const CsgTree& csg, const bbox3f& bounds,
+    int resolution, float band, bool sparse) {
+  auto hash = root_hash(csg);
+  auto mix  = [&hash](const void* data, size_t size) {
+    for (auto i = 0; i < size; i++) {
+      hash ^= ((const uint8_t*)data)[i];
+      hash *= 1099511628211ull;
+    }
+  };
+  mix(&bounds, sizeof(bounds));
+  mix(&resolution, sizeof(resolution));
+  mix(&band, sizeof(band));
+  mix(&sparse, sizeof(sparse));
+  return hash;
+}
+
+// Cache folder of the grids, or an empty path if there is none.
+inline std::filesystem::path grid_cache_directory() {
+  return user_cache_directory("grid", "CSG_GRID_CACHE");
+}
+
+inline int process_id() {
+#if !defined(_WIN32)
+  return getpid();
+#else
+  return _getpid();
+#endif
+}
+
+// Writes the header, the sections and the samples, then renames the file in
+// place. Returns false on errors.
+inline bool save_grid_file(const string& filename, const CsgGridHeader& header,
+    const vector<pair<const void*, size_t>>& sections, const float* values) {
+  auto temporary = filename + ".tmp" + std::to_string(process_id());
+  auto fs        = fopen(temporary.c_str(), "wb");
+  if (!fs) return false;
+  auto ok      = fwrite(&header, sizeof(header), 1, fs) == 1;
+  auto written = (uint64_t)sizeof(header);
+  for (auto [data, size] : sections) {
+    if (size) ok = ok && fwrite(data, size, 1, fs) == 1;
+    written += size;
+  }
+  auto padding = vector<char>(header.offset - written, 0);
+  if (!padding.empty())
+    ok = ok && fwrite(padding.data(), padding.size(), 1, fs) == 1;
+  if (header.num_values)
+    ok = ok && fwrite(values, sizeof(float), header.num_values, fs) ==
+                   header.num_values;
+  ok = fclose(fs) == 0 && ok;
+  auto error = std::error_code{};
+  if (ok) std::filesystem::rename(temporary, filename, error);
+  if (!ok || error) std::filesystem::remove(temporary, error);
+  return ok && !error;
+}
+
+// Contents of a file, mapped when possible. Returns null on errors.
+inline std::shared_ptr<void> map_grid_file(
+    const string& filename, size_t& size, bool writable) {
+#if !defined(_WIN32)
+  auto fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0) return {};
+  struct stat info;
+  if (fstat(fd, &info) != 0 || info.st_size == 0) {
+    close(fd);
+    return {};
+  }
+  size         = info.st_size;
+  auto protect = writable ? PROT_READ | PROT_WRITE : PROT_READ;
+  auto data    = mmap(nullptr, size, protect,
+      writable ? MAP_PRIVATE : MAP_SHARED, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) return {};
+  return std::shared_ptr<void>(
+      data, [size](void* data) { munmap(data, size); });
+#else
+  auto fs = fopen(filename.c_str(), "rb");
+  if (!fs) return {};
+  auto buffer = std::make_shared<vector<char>>();
+  fseek(fs, 0, SEEK_END);
+  buffer->resize(ftell(fs));
+  fseek(fs, 0, SEEK_SET);
+  auto ok = fread(buffer->data(), buffer->size(), 1, fs) == 1;
+  fclose(fs);
+  if (!ok) return {};
+  size = buffer->size();
+  return std::shared_ptr<void>(buffer, buffer->data());
+#endif
+}
+
+// Header of a mapped file, or null if it does not match.
+inline const CsgGridHeader* read_grid_header(
+    const std::shared_ptr<void>& data, size_t size, uint64_t hash,
+    bool sparse) {
+  if (!data || size < sizeof(CsgGridHeader)) return nullptr;
+  auto header = (const CsgGridHeader*)data.get();
+  auto check  = CsgGridHeader{};
+  if (memcmp(header->magic, check.magic, sizeof(check.magic)) != 0 ||
+      header->version != check.version || header->hash != hash ||
+      header->sparse != (sparse ? 1 : 0))
+    return nullptr;
+  if (header->offset < sizeof(CsgGridHeader) || header->offset % 64 ||
+      header->offset > size ||
+      header->num_values > (size - header->offset) / sizeof(float))
+    return nullptr;
+  return header;
+}
+
+inline bool save_grid(
+    const string& filename, const CsgGrid& grid, uint64_t hash) {
+  auto header   = CsgGridHeader{};
+  header.hash   = hash;
+  header.sparse = 0;
+  for (auto k = 0; k < 3; k++) {
+    header.bounds[k]     = grid.bounds.min[k];
+    header.bounds[k + 3] = grid.bounds.max[k];
+    header.size[k]       = grid.size[k];
+  }
+  header.num_values = grid.values.size();
+  header.offset     = align_offset(sizeof(header));
+  return save_grid_file(filename, header, {}, grid.values.data());
+}
+
+inline bool load_grid(const string& filename, uint64_t hash, CsgGrid& grid) {
+  auto size   = (size_t)0;
+  auto data   = map_grid_file(filename, size, false);
+  auto header = read_grid_header(data, size, hash, false);
+  if (!header) return false;
+  for (auto k = 0; k < 3; k++) {
+    grid.bounds.min[k] = header->bounds[k];
+    grid.bounds.max[k] = header->bounds[k + 3];
+    grid.size[k]       = header->size[k];
+  }
+  if (min(grid.size) < 1 ||
+      (uint64_t)grid.size.x * grid.size.y * grid.size.z != header->num_values)
+    return false;
+  auto values  = (const float*)((const char*)data.get() + header->offset);
+  grid.values  = {values, header->num_values};
+  grid.storage = data;
+  return true;
+}
+
+// Sparse grids are saved after refill_sparse, so that no brick is dirty.
+inline bool save_sparse(
+    const string& filename, const CsgSparseGrid& grid, uint64_t hash) {
+  auto header   = CsgGridHeader{};
+  header.hash   = hash;
+  header.sparse = 1;
+  for (auto k = 0; k < 3; k++) {
+    header.bounds[k]     = grid.bounds.min[k];
+    header.bounds[k + 3] = grid.bounds.max[k];
+    header.size[k]       = grid.bricks[k];
+  }
+  header.cell       = grid.cell;
+  header.band       = grid.band;
+  header.brick_size = grid.brick_size;
+  header.num_free   = grid.free.size();
+  header.num_values = grid.values.size();
+  auto sections     = vector<pair<const void*, size_t>>{
+      {grid.index.data(), grid.index.size() * sizeof(int)},
+      {grid.far.data(), grid.far.size() * sizeof(float)},
+      {grid.free.data(), grid.free.size() * sizeof(int)}};
+  auto offset = (uint64_t)sizeof(header);
+  for (auto& section : sections) offset += section.second;
+  header.offset = align_offset(offset);
+  return save_grid_file(filename, header, sections, grid.values.data());
+}
+
+// The brick tables are copied, since they are small, and the samples are
+// mapped.
+inline bool load_sparse(
+    const string& filename, uint64_t hash, CsgSparseGrid& grid) {
+  auto size   = (size_t)0;
+  auto data   = map_grid_file(filename, size, true);
+  auto header = read_grid_header(data, size, hash, true);
+  if (!header) return false;
+  for (auto k = 0; k < 3; k++) {
+    grid.bounds.min[k] = header->bounds[k];
+    grid.bounds.max[k] = header->bounds[k + 3];
+    grid.bricks[k]     = header->size[k];
+  }
+  grid.cell       = header->cell;
+  grid.band       = header->band;
+  grid.brick_size = header->brick_size;
+  if (!(grid.cell > 0) || grid.brick_size < 1 || grid.brick_size > 64 ||
+      min(grid.bricks) < 1 || max(grid.bricks) > 65536 ||
+      header->num_free > size / sizeof(int))
+    return false;
+  auto num    = (size_t)grid.bricks.x * grid.bricks.y * grid.bricks.z;
+  auto tables = sizeof(CsgGridHeader) + num * (sizeof(int) + sizeof(float)) +
+                header->num_free * sizeof(int);
+  if (tables > header->offset) return false;
+  auto index = (const int*)((const char*)data.get() + sizeof(CsgGridHeader));
+  auto far   = (const float*)(index + num);
+  auto free  = (const int*)(far + num);
+  grid.index.assign(index, index + num);
+  grid.far.assign(far, far + num);
+  grid.free.assign(free, free + header->num_free);
+  // bricks and free slots must name whole bricks of the samples
+  auto samples = (uint64_t)num_samples(grid);
+  if (header->num_values % samples) return false;
+  auto count = (int64_t)(header->num_values / samples);
+  for (auto brick : grid.index)
+    if (brick < -1 || brick >= count) return false;
+  for (auto brick : grid.free)
+    if (brick < 0 || brick >= count) return false;
+  grid.dirty.assign(num, 0);
+  grid.values  = {(float*)((char*)data.get() + header->offset),
+      header->num_values};
+  grid.storage = data;
+  return true;
+}
+
+// Takes the grid of the tree from the grid cache in memory, or loads it from
+// the cache folder, baking and saving it if it is missing, see memory.h.
+inline CsgGrid bake_csg_grid_cached(
+    const CsgTree& csg, const bbox3f& bounds, int resolution) {
+  auto key  = grid_key(csg, bounds, resolution, 0, false);
+  auto grid = CsgGrid{};
+  if (find_cached_grid(get_grid_cache(), key, grid)) return grid;
+  auto directory = grid_cache_directory();
+  auto filename  = directory.empty()
+                       ? string{}
+                       : (directory / (std::to_string(key) + ".grid")).string();
+  if (filename.empty() || !load_grid(filename, key, grid)) {
+    grid = bake_csg_grid(csg, bounds, resolution);
+    if (!filename.empty()) save_grid(filename, grid, key);
+  }
+  insert_cached_grid(get_grid_cache(), key, grid);
+  return grid;
+}
+
+inline CsgSparseGrid bake_csg_sparse_cached(const CsgTree& csg,
+    const bbox3f& bounds, int resolution, float band = 0) {
+  auto key       = grid_key(csg, bounds, resolution, band, true);
+  auto directory = grid_cache_directory();
+  if (directory.empty()) return bake_csg_sparse(csg, bounds, resolution, band);
+  auto filename = (directory / (std::to_string(key) + ".sparse")).string();
+  auto grid     = CsgSparseGrid{};
+  if (load_sparse(filename, key, grid)) return grid;
+  grid = bake_csg_sparse(csg, bounds, resolution, band);
+  save_sparse(filename, grid, key);
+  return grid;
+}
@@ -0,0 +1,409 @@
+#pragma once
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <filesystem>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "pool.h"
+//
+#include "ext/yocto-gl/yocto/yocto_image.h"
+using namespace yocto;
+
+// Images written a band of rows at a time, for renders too large to be kept
+// in memory. Images are 8-bit RGBA PNGs in sRGB, as the ones of save_image.
+// Bands are cut in parts of rows that are filtered and compressed on the
+// pool, each as an IDAT chunk of deflate blocks that ends on a byte with an
+// empty stored block, as the flushes of zlib, so that parts are written
+// without the rows before them. The first row of a band is filtered
+// without the row above it. The state of the stream after a band is a few
+// numbers, and once saved as a checkpoint a stopped render goes on from the
+// last band written, see resume_image_stream. Whole images are saved the
+// same way by save_image_parallel.
+
+struct CsgImageStream {
+  FILE*    file   = nullptr;
+  vec2i    size   = {0, 0};
+  int      rows   = 0;  // written so far
+  uint32_t adler  = 1;  // of the rows, for the end of the zlib stream
+  long     offset = 0;  // of the end of the last band
+};
+
+inline uint32_t png_crc(const uint8_t* data, size_t size, uint32_t crc = 0) {
+  static const auto table = [] {
+    auto table = std::vector<uint32_t>(256);
+    for (auto n = 0u; n < 256; n++) {
+      auto c = n;
+      for (auto k = 0; k < 8; k++) c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+      table[n] = c;
+    }
+    return table;
+  }();
+  crc = ~crc;
+  for (auto i = (size_t)0; i < size; i++)
+    crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+  return ~crc;
+}
+
+// Sums are reduced every 5552 bytes, the most that cannot overflow them.
+inline uint32_t png_adler(const uint8_t* data, size_t size, uint32_t adler) {
+  auto a = adler & 0xffff, b = adler >> 16;
+  while (size > 0) {
+    auto block = std::min(size, (size_t)5552);
+    for (auto i = (size_t)0; i < block; i++) {
+      a += data[i];
+      b += a;
+    }
+    a %= 65521;
+    b %= 65521;
+    data += block;
+    size -= block;
+  }
+  return (b << 16) | a;
+}
+
+// Checksum of two buffers from the ones of each, the second of `size`
+// bytes, as adler32_combine in zlib.
+inline uint32_t png_adler_combine(
+    uint32_t first, uint32_t second, size_t size) {
+  const auto base = 65521u;
+  auto       rem  = (uint32_t)(size % base);
+  auto       a    = first & 0xffff;
+  auto       b    = (uint32_t)(((uint64_t)rem * a) % base);
+  a += (second & 0xffff) + base - 1;
+  b += (first >> 16) + (second >> 16) + base - rem;
+  if (a >= base) a -= base;
+  if (a >= base) a -= base;
+  if (b >= 2 * base) b -= 2 * base;
+  if (b >= base) b -= base;
+  return (b << 16) | a;
+}
+
+inline void push_uint32(std::vector<uint8_t>& data, uint32_t value) {
+  for (auto k = 3; k >= 0; k--) data.push_back((value >> (k * 8)) & 0xff);
+}
+
+// Appends the chunk, with its size and checksum, to `chunk`.
+inline void push_png_chunk(std::vector<uint8_t>& chunk, const char* type,
+    const std::vector<uint8_t>& data) {
+  auto start = chunk.size();
+  push_uint32(chunk, (uint32_t)data.size());
+  chunk.insert(chunk.end(), type, type + 4);
+  chunk.insert(chunk.end(), data.begin(), data.end());
+  push_uint32(
+      chunk, png_crc(chunk.data() + start + 4, chunk.size() - start - 4));
+}
+
+inline void write_png_bytes(
+    CsgImageStream& stream, const std::vector<uint8_t>& bytes) {
+  if (fwrite(bytes.data(), 1, bytes.size(), stream.file) != bytes.size())
+    throw std::runtime_error{"cannot write image"};
+}
+
+inline void write_png_chunk(CsgImageStream& stream, const char* type,
+    const std::vector<uint8_t>& data) {
+  auto chunk = std::vector<uint8_t>{};
+  chunk.reserve(data.size() + 12);
+  push_png_chunk(chunk, type, data);
+  write_png_bytes(stream, chunk);
+}
+
+// Appends the data as a deflate block with the fixed Huffman codes, which
+// is not final, and an empty stored block that ends it on a byte, so that
+// the blocks of consecutive parts make a single stream. Matches are found
+// in chains of the positions of 3-byte hashes, up to 32 KB back in the
+// part.
+inline void deflate_part(
+    const uint8_t* data, size_t size, std::vector<uint8_t>& out) {
+  static const int lengths[]       = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15,
+      17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227,
+      258};
+  static const int length_bits[]   = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2,
+      2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+  static const int distances[]     = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49,
+      65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+      8193, 12289, 16385, 24577};
+  static const int distance_bits[] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5,
+      5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+  const auto window = 32768, depth = 8;
+
+  // bits are written from the lowest, and Huffman codes from their highest
+  auto bits  = (uint64_t)0;
+  auto count = 0;
+  auto put   = [&](uint32_t value, int length) {
+    bits |= (uint64_t)value << count;
+    count += length;
+    while (count >= 8) {
+      out.push_back((uint8_t)bits);
+      bits >>= 8;
+      count -= 8;
+    }
+  };
+  auto code = [&](uint32_t value, int length) {
+    auto reversed = 0u;
+    for (auto k = 0; k < length; k++)
+      reversed |= ((value >> k) & 1) << (length - 1 - k);
+    put(reversed, length);
+  };
+  auto symbol = [&](int value) {
+    if (value < 144) code(0x30 + value, 8);
+    else if (value < 256) code(0x190 + value - 144, 9);
+    else if (value < 280) code(value - 256, 7);
+    else code(0xc0 + value - 280, 8);
+  };
+
+  auto head   = std::vector<int>(1 << 15, -1);
+  auto chain  = std::vector<int>(window, -1);
+  auto hash   = [&](size_t i) {
+    return ((data[i] << 10) ^ (data[i + 1] << 5) ^ data[i + 2]) & 0x7fff;
+  };
+  auto insert = [&](size_t i) {
+    auto& first       = head[hash(i)];
+    chain[i % window] = first;
+    first             = (int)i;
+  };
+  put(0, 1);  // not final
+  put(1, 2);  // fixed codes
+  for (auto i = (size_t)0; i < size;) {
+    auto best = 0, distance = 0;
+    if (i + 2 < size) {
+      auto limit     = (int)std::min(size - i, (size_t)258);
+      auto candidate = head[hash(i)];
+      for (auto step = 0;
+           candidate >= 0 && i - candidate <= window && step < depth; step++) {
+        auto length = 0;
+        while (length < limit && data[candidate + length] == data[i + length])
+          length++;
+        if (length > best) {
+          best     = length;
+          distance = (int)(i - candidate);
+          if (length == limit) break;
+        }
+        candidate = chain[candidate % window];
+      }
+      insert(i);
+    }
+    if (best < 3) {
+      symbol(data[i++]);
+      continue;
+    }
+    auto l = std::upper_bound(lengths, lengths + 29, best) - lengths - 1;
+    symbol(257 + (int)l);
+    put(best - lengths[l], length_bits[l]);
+    auto d = std::upper_bound(distances, distances + 30, distance) -
+             distances - 1;
+    code((uint32_t)d, 5);
+    put(distance - distances[d], distance_bits[d]);
+    for (auto k = (size_t)1; k < best; k++)
+      if (i + k + 2 < size) insert(i + k);
+    i += best;
+  }
+  symbol(256);
+  put(0, 3);  // stored, not final
+  if (count) put(0, 8 - count);
+  out.insert(out.end(), {0, 0, 0xff, 0xff});
+}
+
+// Filters a row of RGBA pixels with the filter of PNG that gives the least
+// sum of the magnitudes of its bytes, a common heuristic. Rows without
+// `above` use the ones that do not need it.
+inline void filter_png_row(const uint8_t* row, const uint8_t* above,
+    size_t size, std::vector<uint8_t>& out) {
+  auto best = std::vector<uint8_t>{}, filtered = std::vector<uint8_t>{};
+  auto cost = std::numeric_limits<size_t>::max();
+  for (auto filter = 0; filter < (above ? 5 : 2); filter++) {
+    filtered.assign(1, (uint8_t)filter);
+    auto sum = (size_t)0;
+    for (auto i = (size_t)0; i < size; i++) {
+      auto a = i >= 4 ? (int)row[i - 4] : 0;
+      auto b = above ? (int)above[i] : 0;
+      auto c = above && i >= 4 ? (int)above[i - 4] : 0;
+      auto predicted = 0;
+      if (filter == 1) predicted = a;
+      if (filter == 2) predicted = b;
+      if (filter == 3) predicted = (a + b) / 2;
+      if (filter == 4) {
+        auto p  = a + b - c;
+        auto pa = std::abs(p - a), pb = std::abs(p - b), pc = std::abs(p - c);
+        predicted = pa <= pb && pa <= pc ? a : pb <= pc ? b : c;
+      }
+      auto value = (uint8_t)(row[i] - predicted);
+      filtered.push_back(value);
+      sum += std::abs((int8_t)value);
+    }
+    if (sum < cost) {
+      cost = sum;
+      std::swap(best, filtered);
+    }
+  }
+  out.insert(out.end(), best.begin(), best.end());
+}
+
+// Starts the image with its header and the header of its zlib stream.
+inline void open_image_stream(
+    CsgImageStream& stream, const string& filename, const vec2i& size) {
+  stream      = CsgImageStream{};
+  stream.file = fopen(filename.c_str(), "wb");
+  if (!stream.file) throw std::runtime_error{filename + ": cannot open"};
+  stream.size = size;
+  const uint8_t signature[] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+  fwrite(signature, 1, sizeof(signature), stream.file);
+  auto header = std::vector<uint8_t>{};
+  push_uint32(header, size.x);
+  push_uint32(header, size.y);
+  header.insert(header.end(), {8, 6, 0, 0, 0});  // 8-bit RGBA, no interlace
+  write_png_chunk(stream, "IHDR", header);
+  write_png_chunk(stream, "IDAT", {0x78, 0x01});
+  fflush(stream.file);
+  stream.offset = ftell(stream.file);
+}
+
+// Appends the rows of `band`, whose width is the one of the image.
+inline void write_image_rows(
+    CsgImageStream& stream, const image<vec4f>& band) {
+  assert(band.size().x == stream.size.x);
+  assert(stream.rows + band.size().y <= stream.size.y);
+  // parts of about 256 KB, whose rows are converted before any is filtered
+  auto width  = (size_t)band.size().x * 4;
+  auto rows   = band.size().y;
+  auto step   = std::max(1, (int)(262144 / (width + 1)));
+  auto parts  = (rows + step - 1) / step;
+  auto colors = std::vector<uint8_t>(width * rows);
+  parallel_for(parts, [&](int part) {
+    for (auto j = part * step; j < std::min((part + 1) * step, rows); j++) {
+      for (auto i = 0; i < band.size().x; i++) {
+        auto color = float_to_byte(rgb_to_srgb(band[{i, j}]));
+        memcpy(&colors[j * width + i * 4], &color, 4);
+      }
+    }
+  }, pool_priority());
+  auto chunks = std::vector<std::vector<uint8_t>>(parts);
+  auto adlers = std::vector<uint32_t>(parts);
+  auto sizes  = std::vector<size_t>(parts);
+  parallel_for(parts, [&](int part) {
+    auto pixels = std::vector<uint8_t>{};
+    for (auto j = part * step; j < std::min((part + 1) * step, rows); j++) {
+      auto above = j > 0 ? &colors[(j - 1) * width] : nullptr;
+      filter_png_row(&colors[j * width], above, width, pixels);
+    }
+    adlers[part] = png_adler(pixels.data(), pixels.size(), 1);
+    sizes[part]  = pixels.size();
+    auto data    = std::vector<uint8_t>{};
+    deflate_part(pixels.data(), pixels.size(), data);
+    push_png_chunk(chunks[part], "IDAT", data);
+  }, pool_priority());
+  for (auto part = 0; part < parts; part++) {
+    stream.adler = png_adler_combine(stream.adler, adlers[part], sizes[part]);
+    write_png_bytes(stream, chunks[part]);
+  }
+  fflush(stream.file);
+  stream.rows += band.size().y;
+  stream.offset = ftell(stream.file);
+}
+
+// Ends the zlib stream with a final stored block, and the image.
+inline void close_image_stream(CsgImageStream& stream) {
+  assert(stream.rows == stream.size.y);
+  auto end = std::vector<uint8_t>{1, 0, 0, 0xff, 0xff};
+  push_uint32(end, stream.adler);
+  write_png_chunk(stream, "IDAT", end);
+  write_png_chunk(stream, "IEND", {});
+  fclose(stream.file);
+  stream.file = nullptr;
+}
+
+// Saves the state of the stream with `key`, which describes the render so
+// that checkpoints of other renders are not resumed. The output is flushed
+// before, so the checkpoint never runs ahead of it.
+inline void save_image_checkpoint(const CsgImageStream& stream,
+    const string& filename, const string& key) {
+  auto temporary = filename + ".tmp";
+  auto file      = fopen(temporary.c_str(), "w");
+  if (!file) throw std::runtime_error{temporary + ": cannot open"};
+  fprintf(file, "%s\n%d %d %d %ld %u\n", key.c_str(), stream.size.x,
+      stream.size.y, stream.rows, stream.offset, stream.adler);
+  fclose(file);
+  std::filesystem::rename(temporary, filename);
+}
+
+// Reopens the image at the last band of the checkpoint, dropping what was
+// written after it. Returns false if there is no checkpoint for `key` and
+// `size`, and the image should be started again.
+inline bool resume_image_stream(CsgImageStream& stream,
+    const string& filename, const vec2i& size, const string& checkpoint,
+    const string& key) {
+  auto file = fopen(checkpoint.c_str(), "r");
+  if (!file) return false;
+  auto saved = string{}, line = string{};
+  auto state = CsgImageStream{};
+  char buffer[4096];
+  if (fgets(buffer, sizeof(buffer), file)) saved = buffer;
+  if (fgets(buffer, sizeof(buffer), file)) line = buffer;
+  fclose(file);
+  if (saved != key + "\n") return false;
+  if (sscanf(line.c_str(), "%d %d %d %ld %u", &state.size.x, &state.size.y,
+          &state.rows, &state.offset, &state.adler) != 5)
+    return false;
+  auto error  = std::error_code{};
+  auto length = std::filesystem::file_size(filename, error);
+  if (error || state.size != size || length < (uintmax_t)state.offset)
+    return false;
+  std::filesystem::resize_file(filename, state.offset, error);
+  if (error) return false;
+  state.file = fopen(filename.c_str(), "r+b");
+  if (!state.file) return false;
+  fseek(state.file, state.offset, SEEK_SET);
+  stream = state;
+  return true;
+}
+
+// Saves the image as save_image, PNGs as the streams above so that they are
+// encoded on the pool.
+inline void save_image_parallel(
+    const string& filename, const image<vec4f>& img) {
+  auto extension = std::filesystem::path{filename}.extension();
+  if (extension != ".png" && extension != ".PNG") {
+    save_image(filename, img);
+    return;
+  }
+  auto stream = CsgImageStream{};
+  open_image_stream(stream, filename, img.size());
+  write_image_rows(stream, img);
+  close_image_stream(stream);
+}
+
+// Images saved in the background by save_image_parallel, so that the next
+// frames of sequences render meanwhile. At most `depth` are in flight, and
+// queueing another waits for the oldest. Errors of the saves are thrown
+// when they are waited for.
+struct CsgImageQueue {
+  int                           depth   = 2;
+  std::deque<std::future<void>> pending = {};
+};
+
+inline void queue_image(
+    CsgImageQueue& queue, const string& filename, image<vec4f> img) {
+  while (!queue.pending.empty() &&
+         queue.pending.size() >= std::max(queue.depth, 1)) {
+    queue.pending.front().get();
+    queue.pending.pop_front();
+  }
+  queue.pending.push_back(async_task(
+      [filename, img = std::move(img)]() {
+        save_image_parallel(filename, img);
+      },
+      csg_priority::background));
+}
+
+// Waits for the images of the queue to be saved.
+inline void finish_images(CsgImageQueue& queue) {
+  while (!queue.pending.empty()) {
+    queue.pending.front().get();
+    queue.pending.pop_front();
+  }
+}
@@ -0,0 +1,509 @@
+#pragma once
+#include <condition_variable>
+#include <cstdlib>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "tape.h"
+#include "user_cache.h"
+
+#if defined(CSG_JIT) && !defined(_WIN32)
+#include <dlfcn.h>
+#include <spawn.h>
+#include <sys/wait.h>
+
+#include <cerrno>
+#include <cstring>
+
+extern char** environ;
+#endif
+
+// Native backend: the tape is translated to C, built into a
+// shared library by the host compiler and loaded with dlopen. Parameters
+// are read at runtime from CsgTape::params, so only structural edits need
+// new code. Libraries are cached on disk by a hash of the tape structure
+// and the instruction set they are built for, and in memory for the
+// lifetime of the process. Libraries export the hash and their source,
+// which are checked against the ones of the tape when they are loaded, so
+// that stale files, or files of tapes with the same hash, are built again.
+// It is
+// enabled by the CSG_JIT build option on POSIX systems; elsewhere
+// compile_jit always returns an invalid CsgJit and callers keep using
+// eval_tape.
+//
+// The compiler defaults to `cc`, run without a shell, and the cache to the
+// jit folder of the user, see user_cache_directory, since loaded libraries
+// run as the user. They can be changed with the CSG_JIT_CC and
+// CSG_JIT_CACHE environment variables. Without a cache folder, no code is
+// built.
+//
+// Approximate libraries, for previews, are built with fast math, so that
+// lengths take the reciprocal square root and smin and smax multiply by the
+// reciprocal of the softness, each refined by a Newton step on x86. Their
+// values differ from the exact ones by a few 1e-7 in the unit box, far less
+// than the hit distance of the previews, and they are cached apart.
+//
+// Builds take seconds for large tapes, so renders do not wait for them:
+// start_jit builds the code on the pool while callers run the tape, and
+// they take the latest code with current_jit where they can switch, e.g. at
+// each tile. The code can be built again with hints of the branches that
+// a profile of the guards took, see guard_hints, which replaces the first.
+// All codes of a tape give its values, so switching does not change renders.
+
+using csg_jit_function = float (*)(const float* position, const float* params);
+using csg_jit_function8 = void (*)(const float* x, const float* y,
+    const float* z, const float* params, float* result);
+
+struct CsgJit {
+  uint64_t              hash    = 0;
+  csg_jit_function      eval    = nullptr;
+  csg_jit_function8     eval8   = nullptr;
+  std::shared_ptr<void> library = {};
+};
+
+inline bool is_valid(const CsgJit& jit) { return jit.eval != nullptr; }
+
+// Hash of everything but the parameter values, and of the kernels of the
+// primitives, so that libraries built with other kernels are not loaded.
+inline uint64_t structure_hash(const CsgTape& tape) {
+  auto hash  = (uint64_t)14695981039346656037ull;
+  auto mix   = [&hash](uint64_t value) {
+    for (auto i = 0; i < 8; i++) {
+      hash ^= (value >> (i * 8)) & 0xff;
+      hash *= 1099511628211ull;
+    }
+  };
+  static const auto kernels = jit_primitives_source();
+  for (auto c : kernels) mix((uint64_t)c);
+  for (auto& inst : tape.instructions) {
+    mix((uint64_t)inst.opcode | ((uint64_t)inst.r << 8) |
+        ((uint64_t)inst.a << 24) | ((uint64_t)inst.b << 40));
+    mix((uint64_t)inst.params | ((uint64_t)inst.skip << 32));
+  }
+  return hash;
+}
+
+// C source of the tape. The helpers reproduce smin, smax and lerp from
+// csg.h operation by operation, so results match eval_tape. Tapes with
+// groups or instances are not supported. Guards with a hint, 1 if they
+// usually skip their subtree and -1 if they usually run it, tell the
+// compiler which branch to lay out first.
+inline string jit_source(
+    const CsgTape& tape, const vector<int8_t>& hints = {}) {
+  auto source = string{};
+  source +=
+      "#include <float.h>\n"
+      "#include <math.h>\n"
+      "static inline float mn(float a, float b) { return a < b ? a : b; }\n"
+      "static inline float mx(float a, float b) { return a > b ? a : b; }\n"
+      "static inline float ab(float a) { return a < 0 ? -a : a; }\n"
+      "static inline float lp(float a, float b, float u) {\n"
+      "  return a * (1 - u) + b * u;\n"
+      "}\n"
+      "static inline float sn(float a, float b, float k) {\n"
+      "  float h = mx(k - ab(a - b), 0) / k;\n"
+      "  return mn(a, b) - h * h * k * (1.0 / 4.0);\n"
+      "}\n"
+      "static inline float sx(float a, float b, float k) {\n"
+      "  float h = mx(k - ab(a - b), 0) / k;\n"
+      "  return mx(a, b) + h * h * k * (1.0 / 4.0);\n"
+      "}\n"
+      "static inline float gd(float x, float y, float z, const float* p) {\n"
+      "  float dx = mx(mx(p[0] - x, x - p[3]), 0);\n"
+      "  float dy = mx(mx(p[1] - y, y - p[4]), 0);\n"
+      "  float dz = mx(mx(p[2] - z, z - p[5]), 0);\n"
+      "  return sqrtf(dx * dx + dy * dy + dz * dz);\n"
+      "}\n"
+      "static inline float pb(float x, float y, float z, const float* p) {\n"
+      "  float dx = mx(p[0] - x, x - p[3]);\n"
+      "  float dy = mx(p[1] - y, y - p[4]);\n"
+      "  float dz = mx(p[2] - z, z - p[5]);\n"
+      "  float in = mn(mx(mx(dx, dy), dz), 0);\n"
+      "  dx = mx(dx, 0), dy = mx(dy, 0), dz = mx(dz, 0);\n"
+      "  return sqrtf(dx * dx + dy * dy + dz * dz) + in * p[6];\n"
+      "}\n";
+  source += jit_primitives_source();
+  source +=
+      "static inline float eval(float x, float y, float z, const float* p) {\n"
+      "  float d;\n";
+  for (auto i = 0; i < tape.num_registers; i++)
+    source += "  float r" + std::to_string(i) + ";\n";
+  // bound instructions open a block that ends with their subtree
+  auto ends   = vector<int>{};
+  auto branch = [&hints](int i, const string& condition) {
+    auto hint = i < hints.size() ? hints[i] : 0;
+    if (hint == 0) return "if (" + condition + ")";
+    return "if (__builtin_expect(" + condition + ", " +
+           (hint > 0 ? "1" : "0") + "))";
+  };
+  for (auto i = 0; i < tape.instructions.size(); i++) {
+    auto& inst = tape.instructions[i];
+    auto r = "r" + std::to_string(inst.r);
+    auto a = "r" + std::to_string(inst.a);
+    auto b = "r" + std::to_string(inst.b);
+    auto p = [&inst](int k) {
+      return "p[" + std::to_string(inst.params + k) + "]";
+    };
+    auto kernel = [&inst](const char* name) {
+      return string{name} + "(x, y, z, p + " + std::to_string(inst.params) +
+             ")";
+    };
+    auto line = string{};
+    switch (inst.opcode) {
+      case csg_opcode::sphere: line = kernel(csg_sphere::name); break;
+      case csg_opcode::box: line = kernel(csg_box::name); break;
+      case csg_opcode::union_hard: line = "mn(" + a + ", " + b + ")"; break;
+      case csg_opcode::union_smooth:
+        line = "sn(" + a + ", " + b + ", " + p(0) + ")";
+        break;
+      case csg_opcode::union_blend:
+        line = "lp(" + a + ", sn(" + a + ", " + b + ", " + p(1) + "), " +
+               p(0) + ")";
+        break;
+      case csg_opcode::subtract_hard:
+        line = "mx(" + a + ", -" + b + ")";
+        break;
+      case csg_opcode::subtract_smooth:
+        line = "sx(" + a + ", -" + b + ", " + p(0) + ")";
+        break;
+      case csg_opcode::subtract_blend:
+        line = "lp(" + a + ", sx(" + a + ", -" + b + ", " + p(1) + "), " +
+               p(0) + ")";
+        break;
+      case csg_opcode::group:
+      case csg_opcode::instance:
+      case csg_opcode::mesh: assert(0); break;
+      case csg_opcode::bound:
+      case csg_opcode::cull:
+      case csg_opcode::prune_min:
+      case csg_opcode::prune_max: break;
+    }
+    if (inst.opcode == csg_opcode::prune_min ||
+        inst.opcode == csg_opcode::prune_max) {
+      auto other = inst.opcode == csg_opcode::prune_min ? a : "-" + a;
+      source += "  d = pb(x, y, z, p + " + std::to_string(inst.params) +
+                ");\n";
+      source += "  " + branch(i, "d > " + other) + " " + r + " = d; else {\n";
+      ends.push_back(i + inst.skip);
+      continue;
+    }
+    if (inst.opcode == csg_opcode::bound || inst.opcode == csg_opcode::cull) {
+      auto value = inst.opcode == csg_opcode::bound ? "d + " + p(6)
+                                                    : string{"FLT_MAX"};
+      source += "  d = gd(x, y, z, p + " + std::to_string(inst.params) +
+                ");\n";
+      source += "  " + branch(i, "d > 0") + " " + r + " = " + value +
+                "; else {\n";
+      ends.push_back(i + inst.skip);
+      continue;
+    }
+    source += "  " + r + " = " + line + ";\n";
+    while (!ends.empty() && ends.back() == i) {
+      source += "  }\n";
+      ends.pop_back();
+    }
+  }
+  source += "  return r" + std::to_string(tape.instructions.back().r) + ";\n";
+  source +=
+      "}\n"
+      "float csg_eval(const float* position, const float* p) {\n"
+      "  return eval(position[0], position[1], position[2], p);\n"
+      "}\n"
+      "void csg_eval8(const float* x, const float* y, const float* z,\n"
+      "    const float* p, float* result) {\n"
+      "  for (int i = 0; i < 8; i++) result[i] = eval(x[i], y[i], z[i], p);\n"
+      "}\n";
+  return source;
+}
+
+// Whether the tape can be built, see jit_source.
+inline bool jit_supported(const CsgTape& tape) {
+  return !tape.instructions.empty() && tape.groups.empty() &&
+         tape.instances.empty() && tape.meshes.empty();
+}
+
+#if defined(CSG_JIT) && !defined(_WIN32)
+
+// Instruction set that -march=native builds for on this machine, so that a
+// cache folder shared by machines keeps a library for each.
+inline string jit_isa() {
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+  if (__builtin_cpu_supports("avx512f")) return "avx512";
+  if (__builtin_cpu_supports("avx2")) return "avx2";
+  return "x86-64";
+#elif defined(__aarch64__)
+  return "arm64";
+#else
+  return "native";
+#endif
+}
+
+// C string literal of the text, a line at a time.
+inline string c_literal(const string& text) {
+  auto literal = string{"\""};
+  for (auto c : text) {
+    if (c == '\\' || c == '"') {
+      literal += '\\';
+      literal += c;
+    } else if (c == '\n') {
+      literal += "\\n\"\n\"";
+    } else if ((unsigned char)c < 32 || (unsigned char)c >= 127) {
+      char escape[8];
+      snprintf(escape, sizeof(escape), "\\%03o", (unsigned char)c);
+      literal += escape;
+    } else {
+      literal += c;
+    }
+  }
+  return literal + "\"";
+}
+
+// Library of the hash built from the source, or an invalid CsgJit if it
+// was built from another.
+inline CsgJit load_jit(
+    const string& filename, uint64_t hash, const string& source) {
+  auto handle = dlopen(filename.c_str(), RTLD_NOW | RTLD_LOCAL);
+  if (!handle) return {};
+  auto jit    = CsgJit{};
+  jit.hash    = hash;
+  jit.library = std::shared_ptr<void>(handle, [](void* h) { dlclose(h); });
+  jit.eval    = (csg_jit_function)dlsym(handle, "csg_eval");
+  jit.eval8   = (csg_jit_function8)dlsym(handle, "csg_eval8");
+  auto built  = (const unsigned long long*)dlsym(handle, "csg_hash");
+  auto text   = (const char*)dlsym(handle, "csg_source");
+  if (!jit.eval || !jit.eval8 || !built || *built != hash || !text ||
+      strcmp(text, source.c_str()) != 0)
+    return {};
+  return jit;
+}
+
+// Runs the program of the first argument, found on the path, with the
+// others, without a shell, and waits for it. Returns whether it succeeded.
+inline bool run_program(const vector<string>& arguments) {
+  auto argv = vector<char*>{};
+  for (auto& argument : arguments) argv.push_back((char*)argument.c_str());
+  argv.push_back(nullptr);
+  auto pid = pid_t{};
+  if (posix_spawnp(&pid, argv[0], nullptr, nullptr, argv.data(), environ))
+    return false;
+  auto status = 0;
+  while (waitpid(pid, &status, 0) < 0)
+    if (errno != EINTR) return false;
+  return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+// Hash of the code of the tape, with the math and the hints it is built
+// with, which names its library.
+inline uint64_t jit_hash(
+    const CsgTape& tape, bool approximate, const vector<int8_t>& hints) {
+  auto hash = structure_hash(tape);
+  if (approximate) hash = mix_hash(hash, (uint64_t)1);
+  auto hinted = std::any_of(
+      hints.begin(), hints.end(), [](int8_t hint) { return hint != 0; });
+  if (hinted)
+    for (auto hint : hints) hash = mix_hash(hash, (uint64_t)(hint + 2));
+  return hash;
+}
+
+// Library of the hash in the cache folder, or an empty string without one.
+inline string jit_library(uint64_t hash) {
+  auto directory = user_cache_directory("jit", "CSG_JIT_CACHE");
+  if (directory.empty()) return "";
+  auto name = std::to_string(hash) + "-" + jit_isa();
+  return (directory / (name + ".so")).string();
+}
+
+// Libraries loaded by this process by their hash, and the ones being built.
+// Builds run outside the lock, so that they do not hold up lookups, and
+// callers of a library that is being built wait for it.
+struct CsgJitCache {
+  std::mutex                      mutex    = {};
+  std::condition_variable         built    = {};
+  unordered_map<uint64_t, CsgJit> loaded   = {};
+  std::unordered_set<uint64_t>    building = {};
+};
+
+inline CsgJitCache& jit_cache() {
+  static auto cache = CsgJitCache{};
+  return cache;
+}
+
+// Native code of the tape if it is built already, in memory or in the cache
+// folder, without building it. Returns an invalid CsgJit otherwise.
+inline CsgJit find_jit(const CsgTape& tape, bool approximate = false,
+    const vector<int8_t>& hints = {}) {
+  if (!jit_supported(tape)) return {};
+  auto  hash  = jit_hash(tape, approximate, hints);
+  auto& cache = jit_cache();
+  {
+    auto lock = std::lock_guard{cache.mutex};
+    if (auto it = cache.loaded.find(hash); it != cache.loaded.end())
+      return it->second;
+    if (cache.building.count(hash)) return {};
+  }
+  auto library = jit_library(hash);
+  if (library.empty() || !std::filesystem::exists(library)) return {};
+  auto jit = load_jit(library, hash, jit_source(tape, hints));
+  if (!is_valid(jit)) return {};
+  auto lock = std::lock_guard{cache.mutex};
+  return cache.loaded.emplace(hash, jit).first->second;
+}
+
+// Returns native code for the tape, building it if it is not cached yet,
+// with approximate math if `approximate` is set and the branch hints of
+// jit_source. Returns an invalid CsgJit if the compiler is not available.
+inline CsgJit compile_jit(const CsgTape& tape, bool approximate = false,
+    const vector<int8_t>& hints = {}) {
+  if (!jit_supported(tape)) return {};  // groups are searched at runtime
+  auto  hash  = jit_hash(tape, approximate, hints);
+  auto& cache = jit_cache();
+  {
+    auto lock = std::unique_lock{cache.mutex};
+    cache.built.wait(lock, [&] { return !cache.building.count(hash); });
+    if (auto it = cache.loaded.find(hash); it != cache.loaded.end())
+      return it->second;
+    cache.building.insert(hash);
+  }
+
+  auto library = jit_library(hash);
+  auto code    = jit_source(tape, hints);
+  auto jit     = !library.empty() && std::filesystem::exists(library)
+                     ? load_jit(library, hash, code)
+                     : CsgJit{};
+  if (!library.empty() && !is_valid(jit)) {
+    // files of this process, renamed in place once built so that other
+    // processes never load them half written
+    auto stem   = library.substr(0, library.size() - 3);
+    auto temp   = stem + "." + std::to_string(getpid()) + ".tmp";
+    auto source = temp + ".c";
+    auto fs     = fopen(source.c_str(), "w");
+    if (fs) {
+      fputs(code.c_str(), fs);
+      fprintf(fs, "const unsigned long long csg_hash = %lluull;\n",
+          (unsigned long long)hash);
+      fprintf(fs, "const char csg_source[] =\n%s;\n", c_literal(code).c_str());
+      fclose(fs);
+      auto compiler  = getenv("CSG_JIT_CC") ? getenv("CSG_JIT_CC") : "cc";
+      auto arguments = vector<string>{compiler, "-O3", "-march=native"};
+      if (approximate) {
+        arguments.push_back("-ffast-math");
+#if defined(__x86_64__)
+        arguments.push_back("-mrecip=all");
+#endif
+      } else {
+        arguments.push_back("-ffp-contract=off");
+      }
+      for (auto argument : {"-fPIC", "-shared", "-o"})
+        arguments.push_back(argument);
+      arguments.push_back(temp);
+      arguments.push_back(source);
+      arguments.push_back("-lm");
+      auto error = std::error_code{};
+      if (run_program(arguments)) {
+        std::filesystem::rename(temp, library, error);
+        if (!error) jit = load_jit(library, hash, code);
+      }
+      std::filesystem::remove(temp, error);
+      std::filesystem::rename(source, stem + ".c", error);
+    }
+  }
+  auto lock = std::lock_guard{cache.mutex};
+  cache.building.erase(hash);
+  if (is_valid(jit)) cache.loaded[hash] = jit;
+  cache.built.notify_all();
+  return jit;
+}
+
+#else
+
+inline CsgJit find_jit(const CsgTape& tape, bool approximate = false,
+    const vector<int8_t>& hints = {}) {
+  return {};
+}
+
+inline CsgJit compile_jit(const CsgTape& tape, bool approximate = false,
+    const vector<int8_t>& hints = {}) {
+  return {};
+}
+
+#endif
+
+// Native code of a tape for tiered execution, see start_jit: none until
+// the first build is done, then the code of the latest tier.
+struct CsgJitTiers {
+  CsgTape                       tape        = {};  // the code is built for
+  bool                          approximate = false;
+  std::shared_ptr<const CsgJit> code        = {};  // swapped atomically
+  std::atomic<int>              tier        = 0;   // 0 for the tape
+  std::atomic<bool>             profiled    = false;  // see respecialize_jit
+};
+
+// Latest code of the tiers, invalid while the tape runs.
+inline CsgJit current_jit(const std::shared_ptr<CsgJitTiers>& tiers) {
+  if (!tiers) return {};
+  auto code = std::atomic_load(&tiers->code);
+  return code ? *code : CsgJit{};
+}
+
+// Takes the code as the tier, unless a later tier is in already.
+inline void update_jit(CsgJitTiers& tiers, const CsgJit& jit, int tier) {
+  if (!is_valid(jit) || tiers.tier >= tier) return;
+  std::atomic_store(&tiers.code, std::make_shared<const CsgJit>(jit));
+  tiers.tier = tier;
+}
+
+// Starts tiered execution of the tape: its code is taken right away if it
+// is cached, and built in the background otherwise.
+inline std::shared_ptr<CsgJitTiers> start_jit(
+    const CsgTape& tape, bool approximate = false) {
+  auto tiers         = std::make_shared<CsgJitTiers>();
+  tiers->approximate = approximate;
+  if (!jit_supported(tape)) return tiers;
+  tiers->tape = tape;
+  update_jit(*tiers, find_jit(tape, approximate), 1);
+  if (tiers->tier > 0) return tiers;
+  async_task(
+      [tiers]() {
+        update_jit(*tiers, compile_jit(tiers->tape, tiers->approximate), 1);
+      },
+      csg_priority::background);
+  return tiers;
+}
+
+// Builds the code of the tiers again with the branch hints that `profile`
+// returns for their tape, once the first build is in, and replaces it when
+// it is done. Both run in the background, and only once for the tiers.
+// Returns whether they were started.
+template <typename Profile>
+inline bool respecialize_jit(
+    const std::shared_ptr<CsgJitTiers>& tiers, Profile&& profile) {
+  if (!tiers || tiers->tier != 1 || tiers->profiled.exchange(true))
+    return false;
+  async_task(
+      [tiers, profile = std::forward<Profile>(profile)]() {
+        auto hints = profile(tiers->tape);
+        update_jit(*tiers,
+            compile_jit(tiers->tape, tiers->approximate, hints), 2);
+      },
+      csg_priority::background);
+  return true;
+}
+
+inline float eval_jit(
+    const CsgJit& jit, const CsgTape& tape, const vec3f& position) {
+  return jit.eval(&position.x, tape.params.data());
+}
+
+inline float8 eval_jit(
+    const CsgJit& jit, const CsgTape& tape, const vec3f8& position) {
+  float x[8], y[8], z[8], result[8];
+  store8(x, position.x);
+  store8(y, position.y);
+  store8(z, position.z);
+  jit.eval8(x, y, z, tape.params.data(), result);
+  return load8(result);
+}
@@ -0,0 +1,40 @@
+#pragma once
+#include "csg.h"
+#include "labeled.h"
+
+// Distances labeled with the node of the primitive that wins at each point,
+// so that shading and picking need no second evaluation. The label is kept
+// in a value of the same type as the distance, so that packets pick labels
+// with the masks of their distances, and nodes are exact as floats below
+// 2^24. Unions take the label of the nearer operand and subtractions the
+// one of the subtracted operand where it carves the surface, ties going to
+// the same operand as min and max. Smooth operations take the label of the
+// operand that weighs more, the nearer one, and blends the one of the side
+// they are closer to. Values that no primitive gives, as the ones of
+// guards, are labeled -1.
+
+template <typename T>
+inline labeled<T> smin(const labeled<T>& a, const labeled<T>& b, float k) {
+  return {smin(a.value, b.value, k),
+      select_label(a.value < b.value, a.node, b.node)};
+}
+
+template <typename T>
+inline labeled<T> smax(const labeled<T>& a, const labeled<T>& b, float k) {
+  return {smax(a.value, b.value, k),
+      select_label(a.value > b.value, a.node, b.node)};
+}
+
+template <typename T>
+inline labeled<T> lerp(const labeled<T>& a, const labeled<T>& b, float u) {
+  return {lerp(a.value, b.value, u), u >= 0.5f ? b.node : a.node};
+}
+
+// Labels the value of a leaf with its node. Unlabeled values are unchanged.
+template <typename T>
+inline void label_leaf(T& value, int node) {}
+
+template <typename T>
+inline void label_leaf(labeled<T>& value, int node) {
+  value.node = T{(float)node};
+}
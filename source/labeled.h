@@ -0,0 +1,69 @@
+#pragma once
+#include <type_traits>
+
+#include "ext/yocto-gl/yocto/yocto_math.h"
+#include "simd.h"
+
+// Values labeled with a node, see label.h. They live in the yocto namespace
+// like packets, and need nothing of csg.h, so that batch_kernel.cpp can
+// include them before its own namespace.
+
+namespace yocto {
+
+template <typename T>
+struct labeled {
+  T value = T{0};
+  T node  = T{-1};
+
+  labeled() = default;
+  labeled(float value_) : value{T{value_}} {}
+  template <typename U = T,
+      typename = std::enable_if_t<!std::is_same_v<U, float>>>
+  labeled(const T& value_) : value{value_} {}
+  labeled(const T& value_, const T& node_) : value{value_}, node{node_} {}
+
+  // Arithmetic keeps the label of the left operand, as do the box distances
+  // of guards and the scaled values of instances.
+  friend labeled operator-(const labeled& a) { return {-a.value, a.node}; }
+  friend labeled operator+(const labeled& a, const labeled& b) {
+    return {a.value + b.value, a.node};
+  }
+  friend labeled operator*(const labeled& a, const labeled& b) {
+    return {a.value * b.value, a.node};
+  }
+  friend auto operator>(const labeled& a, const labeled& b) {
+    return a.value > b.value;
+  }
+};
+
+// Labeled packets run the packet paths of the evaluators.
+template <typename T>
+struct packet_traits<labeled<T>> : packet_traits<T> {};
+
+template <typename M, typename T>
+inline T select_label(const M& mask, const T& a, const T& b) {
+  if constexpr (is_packet_v<T>) {
+    return select(mask, a, b);
+  } else {
+    return mask ? a : b;
+  }
+}
+
+template <typename M, typename T>
+inline labeled<T> select(
+    const M& mask, const labeled<T>& a, const labeled<T>& b) {
+  return {select(mask, a.value, b.value), select(mask, a.node, b.node)};
+}
+
+template <typename T>
+inline labeled<T> min(const labeled<T>& a, const labeled<T>& b) {
+  return {min(a.value, b.value),
+      select_label(a.value < b.value, a.node, b.node)};
+}
+template <typename T>
+inline labeled<T> max(const labeled<T>& a, const labeled<T>& b) {
+  return {max(a.value, b.value),
+      select_label(a.value > b.value, a.node, b.node)};
+}
+
+}  // namespace yocto
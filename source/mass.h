@@ -0,0 +1,195 @@
+#pragma once
+#include <stdexcept>
+
+#include "batch.h"
+
+// Mass properties of a tree of unit density: volume, surface area,
+// centroid and inertia tensor. Cells of an octree over the bounds are
+// classified top down by interval arithmetic, as in pyramid.h, so that
+// whole cells inside count as boxes and cells outside are skipped, and only
+// the cells of the finest level that the surface may cross are sampled.
+// Samples are cubes, filled by the fraction of them under the tangent plane
+// at their centers, and the area sums a hat of the distance to that plane
+// over them, which counts each column of cubes once for flat surfaces.
+//
+// Cells are bounded a sample away from the surface, so that the samples
+// near it are all in sampled cells. Distances are related to the surface
+// by the Lipschitz bound of the tape, see eval_lipschitz: only the samples
+// whose cube the surface may cross can be wrong, and the volume error is
+// their volume. Sums are kept in double precision.
+
+struct CsgMass {
+  float volume         = 0;
+  float area           = 0;  // an estimate, with no bound
+  vec3f centroid       = {0, 0, 0};
+  mat3f inertia        = {};  // about the centroid
+  float volume_error   = 0;   // bound of the error of the volume
+  float centroid_error = 0;   // bound of the distance to the true centroid
+};
+
+struct CsgMassOptions {
+  int  levels   = 7;  // of the octree, 2^levels cells per side
+  int  samples  = 2;  // per side of the cells of the finest level
+  bool parallel = true;
+};
+
+// Sums of the integrals over the volume: first moments in x, y, z and
+// second ones in xx, yy, zz, xy, yz, zx.
+struct CsgMoments {
+  double volume    = 0;
+  double area      = 0;
+  double ambiguous = 0;  // volume of the samples the surface may cross
+  double first[3]  = {0, 0, 0};
+  double second[6] = {0, 0, 0, 0, 0, 0};
+};
+
+inline void add_moments(CsgMoments& moments, const CsgMoments& other) {
+  moments.volume += other.volume;
+  moments.area += other.area;
+  moments.ambiguous += other.ambiguous;
+  for (auto k = 0; k < 3; k++) moments.first[k] += other.first[k];
+  for (auto k = 0; k < 6; k++) moments.second[k] += other.second[k];
+}
+
+// Adds `fraction` of the box, as if it was spread over the whole box.
+inline void add_box_moments(
+    CsgMoments& moments, const bbox3f& box, double fraction = 1) {
+  auto size   = box.max - box.min;
+  auto c      = (box.min + box.max) / 2;
+  auto volume = (double)size.x * size.y * size.z * fraction;
+  auto cx = (double)c.x, cy = (double)c.y, cz = (double)c.z;
+  moments.volume += volume;
+  moments.first[0] += volume * cx;
+  moments.first[1] += volume * cy;
+  moments.first[2] += volume * cz;
+  moments.second[0] += volume * (cx * cx + size.x * size.x / 12.0);
+  moments.second[1] += volume * (cy * cy + size.y * size.y / 12.0);
+  moments.second[2] += volume * (cz * cz + size.z * size.z / 12.0);
+  moments.second[3] += volume * cx * cy;
+  moments.second[4] += volume * cy * cz;
+  moments.second[5] += volume * cz * cx;
+}
+
+// Moments of the samples of a cell, `samples` per side, whose distances
+// are evaluated together with the batch kernel.
+inline CsgMoments sample_cell_moments(
+    const CsgTape& tape, const bbox3f& cell, int samples) {
+  thread_local auto points = vector<vec3f>{};
+  thread_local auto values = vector<float>{};
+  auto size = (cell.max.x - cell.min.x) / samples;
+  auto num  = samples * samples * samples;
+  points.resize(num);
+  values.resize(num);
+  for (auto k = 0; k < num; k++) {
+    auto ijk  = vec3f{(float)(k % samples), (float)((k / samples) % samples),
+        (float)(k / (samples * samples))};
+    points[k] = cell.min + (ijk + 0.5f) * size;
+  }
+  get_kernel().eval(tape, points.data(), values.data(), num);
+  auto moments = CsgMoments{};
+  auto corner  = size * std::sqrt(3.0f) / 2;
+  for (auto k = 0; k < num; k++) {
+    auto value    = values[k];
+    auto fraction = value < 0 ? 1.0f : 0.0f;
+    if (std::abs(value) / tape.lipschitz < size) {
+      // distance to the tangent plane
+      auto grad  = length(eval_tape_grad(tape, points[k]).grad);
+      auto plane = value / (grad > 0 ? grad : tape.lipschitz);
+      fraction   = clamp(0.5f - plane / size, 0.0f, 1.0f);
+      moments.area += (double)size * size *
+                      yocto::max(1 - std::abs(plane) / size, 0.0f);
+    }
+    if (std::abs(value) / tape.lipschitz < corner)
+      moments.ambiguous += (double)size * size * size;
+    if (fraction > 0)
+      add_box_moments(
+          moments, {points[k] - size / 2, points[k] + size / 2}, fraction);
+  }
+  return moments;
+}
+
+// Mass properties of the tree in the cube around its bounds. Throws if the
+// tree is unbounded.
+inline CsgMass integrate_csg(
+    const CsgTree& csg, const CsgMassOptions& options = {}) {
+  assert(options.levels >= 0 && options.samples >= 1);
+  if (csg.bounds.size() != csg.nodes.size() ||
+      !is_bounded(csg.bounds[csg.root]))
+    throw std::runtime_error{"the tree is unbounded"};
+  auto& root   = csg.bounds[csg.root];
+  auto  tape   = compile_csg(csg);
+  auto  center = (root.min + root.max) / 2;
+  auto  half   = yocto::max(root.max - root.min) / 2 * 1.01f;
+  auto  bounds = bbox3f{center - half, center + half};
+  auto  sample = 2 * half / (1 << options.levels) / options.samples;
+  auto  margin = sample * tape.lipschitz;
+
+  auto total = CsgMoments{};
+  auto cells = vector<vec3i>{{0, 0, 0}};
+  for (auto level = 0; level <= options.levels && !cells.empty(); level++) {
+    auto size     = 2 * half / (1 << level);
+    auto finest   = level == options.levels;
+    auto inside   = vector<CsgMoments>(cells.size());
+    auto refined  = vector<char>(cells.size(), 0);
+    auto classify = [&](int item) {
+      thread_local auto intervals = vector<interval>{};
+      intervals.resize(csg.nodes.size());
+      auto& cell  = cells[item];
+      auto  min   = bounds.min + size * vec3f{(float)cell.x, (float)cell.y,
+                                                (float)cell.z};
+      auto  box   = bbox3f{min, min + size};
+      auto  range = eval_csg_interval(intervals, csg, box);
+      if (range.min > margin) return;
+      if (range.max < -margin) {
+        add_box_moments(inside[item], box);
+      } else if (finest) {
+        inside[item] = sample_cell_moments(tape, box, options.samples);
+      } else {
+        refined[item] = 1;
+      }
+    };
+    if (options.parallel) {
+      parallel_for((int)cells.size(), classify, pool_priority());
+    } else {
+      for (auto item = 0; item < cells.size(); item++) classify(item);
+    }
+    auto next = vector<vec3i>{};
+    for (auto item = 0; item < cells.size(); item++) {
+      add_moments(total, inside[item]);
+      if (!refined[item]) continue;
+      for (auto k = 0; k < 8; k++)
+        next.push_back(cells[item] * 2 + vec3i{k & 1, (k >> 1) & 1, k >> 2});
+    }
+    cells = std::move(next);
+  }
+
+  auto mass         = CsgMass{};
+  mass.volume       = (float)total.volume;
+  mass.area         = (float)total.area;
+  mass.volume_error = (float)total.ambiguous;
+  if (total.volume <= 0) return mass;
+  auto c = vec3f{(float)(total.first[0] / total.volume),
+      (float)(total.first[1] / total.volume),
+      (float)(total.first[2] / total.volume)};
+  mass.centroid = c;
+  // second moments about the centroid, then the inertia tensor
+  auto& s  = total.second;
+  auto  v  = total.volume;
+  auto  xx = s[0] - v * c.x * c.x;
+  auto  yy = s[1] - v * c.y * c.y;
+  auto  zz = s[2] - v * c.z * c.z;
+  auto  xy = s[3] - v * c.x * c.y;
+  auto  yz = s[4] - v * c.y * c.z;
+  auto  zx = s[5] - v * c.z * c.x;
+  mass.inertia = {{(float)(yy + zz), (float)-xy, (float)-zx},
+      {(float)-xy, (float)(xx + zz), (float)-yz},
+      {(float)-zx, (float)-yz, (float)(xx + yy)}};
+  // each ambiguous sample moves the first moments by at most its volume
+  // times the diagonal of the bounds
+  if (total.volume > total.ambiguous)
+    mass.centroid_error = (float)(total.ambiguous * 2 * half * std::sqrt(3.0) /
+                                  (total.volume - total.ambiguous));
+  else
+    mass.centroid_error = flt_max;
+  return mass;
+}
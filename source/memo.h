@@ -0,0 +1,290 @@
+#pragma once
+#include <atomic>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "batch.h"
+
+// Memo of point queries in front of eval_csg_batch, for workloads that
+// query the same points again and again, as optimizers over fixed samples
+// or simulations whose particles barely move. Points are quantized to a
+// grid of side `quantum` and keyed by their cell and the version of the
+// tree, e.g. its root_hash, so that the values of several trees, or of the
+// edits of one, are kept apart. Cells keep the value of the first of their
+// points that was evaluated, which differs from the ones of the others by
+// up to the Lipschitz bound of the tree times the diagonal of a cell, see
+// eval_lipschitz. With a quantum of 0, points are keyed by their bits, and
+// only the same points are memoized. Points whose cells do not fit in the
+// keys, as the ones that are not finite, are evaluated without the memo.
+//
+// Entries are spread over stripes, each an open addressing table behind its
+// own mutex, so that the blocks of a batch rarely wait for each other. The
+// points of a block are sorted by stripe, so that each stripe is locked once
+// to look them up and once to add the ones it missed, and a stripe is
+// emptied once it holds its share of `capacity`. Memos that miss most of
+// their queries only add to their cost, as do the ones of trees that cost
+// less to evaluate than to look up: calls that hit less than `min_rate` of
+// their points, or less than the share that pays for the lookups, by the
+// times of the calls, bypass the memo for the next `bypass` calls, which go
+// to the batch evaluator, then try it again. Calls that fill the memo, the
+// first one and the first after bypassing it, are not judged.
+
+struct CsgMemoKey {
+  int64_t  cell[3] = {0, 0, 0};
+  uint64_t version = 0;
+
+  bool operator==(const CsgMemoKey& other) const {
+    return cell[0] == other.cell[0] && cell[1] == other.cell[1] &&
+           cell[2] == other.cell[2] && version == other.version;
+  }
+};
+
+// Hash of the key, never 0, which marks free slots.
+inline uint64_t memo_hash(const CsgMemoKey& key) {
+  auto hash = mix_hash(key.version, (uint64_t)key.cell[0]);
+  hash      = mix_hash(hash, (uint64_t)key.cell[1]);
+  return mix_hash(hash, (uint64_t)key.cell[2]) | 1;
+}
+
+struct CsgMemoStripe {
+  std::mutex         mutex  = {};
+  vector<uint64_t>   hashes = {};  // of the slots, 0 if free
+  vector<CsgMemoKey> keys   = {};
+  vector<float>      values = {};
+  size_t             count  = 0;  // of taken slots
+};
+
+struct CsgMemo {
+  float  quantum  = 1e-6f;
+  size_t capacity = (size_t)1 << 22;  // of values
+  float  min_rate = 0.25f;  // of hits, below which calls bypass the memo
+  int    bypass   = 16;     // calls
+
+  std::unique_ptr<CsgMemoStripe[]> stripes     = {};
+  int                              num_stripes = 0;
+
+  // points of the calls, and calls left to bypass
+  std::atomic<int64_t> hits     = 0;
+  std::atomic<int64_t> misses   = 0;
+  std::atomic<int64_t> bypassed = 0;
+  std::atomic<int>     skipping = 0;
+  std::atomic<bool>    filling  = true;  // the next call is not judged
+
+  // nanoseconds per point of evaluating it, by the last call that did
+  std::atomic<double> eval_cost = 0;
+};
+
+// Memo of `capacity` values in `stripes` stripes, with cells of `quantum`.
+inline std::shared_ptr<CsgMemo> make_memo(float quantum = 1e-6f,
+    size_t capacity = (size_t)1 << 22, int stripes = 64) {
+  if (!(quantum >= 0) || capacity < 1 || stripes < 1)
+    throw std::invalid_argument{"invalid memo"};
+  auto memo         = std::make_shared<CsgMemo>();
+  memo->quantum     = quantum;
+  memo->capacity    = capacity;
+  memo->stripes     = std::make_unique<CsgMemoStripe[]>(stripes);
+  memo->num_stripes = stripes;
+  return memo;
+}
+
+// Whether the cells of the point fit in the keys, with room for their
+// hashes to mix, which also rejects points that are not finite.
+inline bool memo_keyable(const CsgMemo& memo, const vec3f& point) {
+  if (memo.quantum == 0) return true;
+  for (auto k = 0; k < 3; k++)
+    if (!(std::abs((double)point[k] / memo.quantum) < 0x1p62)) return false;
+  return true;
+}
+
+// Key of the point, which should be keyable, see memo_keyable.
+inline CsgMemoKey memo_key(
+    const CsgMemo& memo, const vec3f& point, uint64_t version) {
+  auto key    = CsgMemoKey{};
+  key.version = version;
+  for (auto k = 0; k < 3; k++) {
+    if (memo.quantum > 0) {
+      key.cell[k] = (int64_t)std::floor((double)point[k] / memo.quantum);
+    } else {
+      auto bits = (uint32_t)0;
+      memcpy(&bits, &point[k], sizeof(bits));
+      key.cell[k] = bits;
+    }
+  }
+  return key;
+}
+
+// Stripe of the hash, by its high bits, since its low ones pick the slot.
+inline int memo_stripe(const CsgMemo& memo, uint64_t hash) {
+  return (int)((hash >> 40) % (uint64_t)memo.num_stripes);
+}
+
+// Slot of the key in the stripe, either holding it or free. Stripes are
+// never more than half full, so probes end.
+inline size_t memo_slot(
+    const CsgMemoStripe& stripe, const CsgMemoKey& key, uint64_t hash) {
+  auto mask = stripe.hashes.size() - 1;
+  for (auto slot = hash & mask;; slot = (slot + 1) & mask) {
+    if (stripe.hashes[slot] == 0) return slot;
+    if (stripe.hashes[slot] == hash && stripe.keys[slot] == key) return slot;
+  }
+}
+
+// Share of the points of the calls through the memo that it held.
+inline float memo_hit_rate(const CsgMemo& memo) {
+  auto hits = memo.hits.load(), misses = memo.misses.load();
+  return hits + misses ? (float)hits / (hits + misses) : 0;
+}
+
+// Empties the memo and its statistics, e.g. after the tree changed in ways
+// that its versions do not tell.
+inline void clear_memo(CsgMemo& memo) {
+  for (auto stripe = 0; stripe < memo.num_stripes; stripe++) {
+    auto& entries = memo.stripes[stripe];
+    auto  lock    = std::lock_guard{entries.mutex};
+    std::fill(entries.hashes.begin(), entries.hashes.end(), 0);
+    entries.count = 0;
+  }
+  memo.hits     = 0;
+  memo.misses   = 0;
+  memo.bypassed = 0;
+  memo.skipping = 0;
+  memo.filling  = true;
+}
+
+// Values of the tape of the tree of `version` at the points, written to
+// `out` as eval_csg_batch, taken from the memo where it holds their cells.
+// The points it misses are evaluated together in each block and added.
+inline void eval_csg_memo(CsgMemo& memo, const CsgTape& tape,
+    uint64_t version, span<const vec3f> points, span<float> out,
+    const CsgBatchOptions& options = {}) {
+  assert(points.size() == out.size());
+  auto num = (int)points.size();
+  if (num == 0) return;
+  auto skipping = memo.skipping.load();
+  while (skipping > 0 &&
+         !memo.skipping.compare_exchange_weak(skipping, skipping - 1)) {
+  }
+  if (skipping > 0) {
+    auto start = get_time();
+    eval_csg_batch(tape, points, out, options);
+    memo.eval_cost = (double)(get_time() - start) / num;
+    memo.bypassed += num;
+    return;
+  }
+  auto kernel = get_kernel().eval;
+  auto share  = std::max(memo.capacity / memo.num_stripes, (size_t)1);
+  auto slots  = (size_t)2;
+  while (slots < share * 2) slots *= 2;
+  // points that hit, and nanoseconds of the blocks and of their kernels
+  auto hits       = std::atomic<int64_t>{0};
+  auto total_time = std::atomic<int64_t>{0};
+  auto eval_time  = std::atomic<int64_t>{0};
+  auto eval_block = [&](int begin, int end) {
+    auto start = get_time();
+    thread_local auto keys   = vector<CsgMemoKey>{};
+    thread_local auto hashes = vector<uint64_t>{};
+    thread_local auto starts = vector<int>{};
+    thread_local auto order  = vector<int>{};
+    thread_local auto missed = vector<int>{};
+    thread_local auto inputs = vector<vec3f>{};
+    thread_local auto values = vector<float>{};
+    auto count = end - begin;
+    keys.resize(count);
+    hashes.resize(count);
+    order.resize(count);
+    missed.clear();
+    inputs.clear();
+    // points by stripe, by counting sort, with the ones without a key, of
+    // hash 0, after the last stripe
+    auto stripe_of = [&](int k) {
+      return hashes[k] ? memo_stripe(memo, hashes[k]) : memo.num_stripes;
+    };
+    starts.assign(memo.num_stripes + 2, 0);
+    for (auto k = 0; k < count; k++) {
+      auto keyable = memo_keyable(memo, points[begin + k]);
+      if (keyable) keys[k] = memo_key(memo, points[begin + k], version);
+      hashes[k] = keyable ? memo_hash(keys[k]) : 0;
+      starts[stripe_of(k) + 1]++;
+    }
+    for (auto s = 0; s <= memo.num_stripes; s++) starts[s + 1] += starts[s];
+    for (auto k = 0; k < count; k++) order[starts[stripe_of(k)]++] = k;
+    auto first = 0;
+    for (auto s = 0; s < memo.num_stripes; s++) {
+      auto last = starts[s];
+      if (first == last) continue;
+      auto& stripe = memo.stripes[s];
+      auto  lock   = std::lock_guard{stripe.mutex};
+      for (; first < last; first++) {
+        auto k = order[first];
+        if (!stripe.hashes.empty()) {
+          auto slot = memo_slot(stripe, keys[k], hashes[k]);
+          if (stripe.hashes[slot] != 0) {
+            out[begin + k] = stripe.values[slot];
+            continue;
+          }
+        }
+        missed.push_back(k);
+        inputs.push_back(points[begin + k]);
+      }
+    }
+    for (; first < count; first++) {
+      missed.push_back(order[first]);
+      inputs.push_back(points[begin + order[first]]);
+    }
+    values.resize(inputs.size());
+    auto evaluated = get_time();
+    kernel(tape, inputs.data(), values.data(), (int)inputs.size());
+    eval_time += get_time() - evaluated;
+    // misses are in the order of their stripes
+    for (auto m = 0; m < (int)missed.size();) {
+      if (hashes[missed[m]] == 0) {
+        out[begin + missed[m]] = values[m];
+        m++;
+        continue;
+      }
+      auto  s      = memo_stripe(memo, hashes[missed[m]]);
+      auto& stripe = memo.stripes[s];
+      auto  lock   = std::lock_guard{stripe.mutex};
+      if (stripe.hashes.empty()) {
+        stripe.hashes.assign(slots, 0);
+        stripe.keys.resize(slots);
+        stripe.values.resize(slots);
+      }
+      for (; m < (int)missed.size(); m++) {
+        auto k = missed[m];
+        if (stripe_of(k) != s) break;
+        out[begin + k] = values[m];
+        if (stripe.count >= share) {
+          std::fill(stripe.hashes.begin(), stripe.hashes.end(), 0);
+          stripe.count = 0;
+        }
+        auto slot = memo_slot(stripe, keys[k], hashes[k]);
+        if (stripe.hashes[slot] != 0) continue;
+        stripe.hashes[slot] = hashes[k];
+        stripe.keys[slot]   = keys[k];
+        stripe.values[slot] = values[m];
+        stripe.count++;
+      }
+    }
+    hits += count - (int64_t)missed.size();
+    total_time += get_time() - start;
+  };
+  if (options.parallel) {
+    parallel_for_chunks(num, eval_block, options.block_size);
+  } else {
+    eval_block(0, num);
+  }
+  memo.hits += hits;
+  memo.misses += num - hits;
+  if (num > hits) memo.eval_cost = (double)eval_time / (num - hits);
+  if (memo.filling.exchange(false)) return;
+  // hits pay for the lookups of all points if they save more time
+  auto lookup_cost = (double)(total_time - eval_time) / num;
+  auto break_even  = memo.eval_cost > 0 ? lookup_cost / memo.eval_cost : 0;
+  if (hits < std::max((double)memo.min_rate, break_even) * num) {
+    memo.filling  = true;
+    memo.skipping = memo.bypass;
+  }
+}
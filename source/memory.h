@@ -0,0 +1,218 @@
+#pragma once
+#include <cstdlib>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
+
+#ifdef __linux__
+#include <sys/resource.h>
+#endif
+
+#include "ext/yocto-gl/yocto/yocto_image.h"
+#include "pyramid.h"
+#include "sparse.h"
+
+// Bytes held by trees, tapes, grids and images, so that the apps can tell
+// where their memory goes, and a cache of baked grids in memory, bounded by
+// a global budget, that evicts the grids used least recently once full.
+// Bytes are those of the capacity of the buffers. Buffers shared by copies,
+// e.g. names, are counted by each holder, but the trees of instances once
+// per tree. Mapped grids count their samples, which the system may page out.
+//
+// The budget of the cache defaults to 1 GB and can be changed with the
+// CSG_CACHE_BUDGET environment variable, in MB, or with set_cache_budget.
+// Grids larger than the budget are not cached, and evicted grids stay alive
+// as long as someone holds them. Grids cached by jobs with a memory budget,
+// see CsgJob, are also bounded by it, evicting the grids of the job used
+// least recently, so that a job cannot fill the cache of the others.
+
+template <typename T>
+inline size_t vector_bytes(const vector<T>& values) {
+  return values.capacity() * sizeof(T);
+}
+
+inline size_t memory_bytes(const CsgGroup& group) {
+  return vector_bytes(group.centers) + vector_bytes(group.radius) +
+         vector_bytes(group.bvh.nodes) + vector_bytes(group.bvh.primitives) +
+         vector_bytes(group.parents) + vector_bytes(group.leaves);
+}
+
+inline size_t memory_bytes(const CsgTriangles& mesh) {
+  return vector_bytes(mesh.positions) + vector_bytes(mesh.triangles) +
+         vector_bytes(mesh.vertices) + vector_bytes(mesh.edges) +
+         vector_bytes(mesh.faces) + vector_bytes(mesh.bvh.nodes) +
+         vector_bytes(mesh.bvh.primitives);
+}
+
+inline size_t memory_bytes(const CsgNames& names) {
+  const auto block_size = (size_t)1 << 16;  // as in intern_name
+  return names.blocks.size() * block_size + vector_bytes(names.names) +
+         vector_bytes(names.table);
+}
+
+inline size_t memory_bytes(const CsgTree& csg) {
+  auto bytes = vector_bytes(csg.nodes) + vector_bytes(csg.bounds) +
+               vector_bytes(csg.hashes) + vector_bytes(csg.groups) +
+               vector_bytes(csg.meshes) + vector_bytes(csg.instances);
+  if (csg.names) bytes += memory_bytes(*csg.names);
+  for (auto& group : csg.groups) bytes += memory_bytes(group);
+  for (auto& mesh : csg.meshes) bytes += memory_bytes(mesh);
+  auto trees = std::unordered_set<const CsgTree*>{};
+  for (auto& instance : csg.instances)
+    if (trees.insert(instance.tree.get()).second)
+      bytes += memory_bytes(*instance.tree);
+  return bytes;
+}
+
+inline size_t memory_bytes(const CsgTape& tape) {
+  auto bytes = vector_bytes(tape.instructions) + vector_bytes(tape.params) +
+               vector_bytes(tape.groups) + vector_bytes(tape.instances) +
+               vector_bytes(tape.meshes) + vector_bytes(tape.nodes);
+  for (auto& group : tape.groups) bytes += memory_bytes(group);
+  for (auto& mesh : tape.meshes) bytes += memory_bytes(mesh);
+  if (tape.pyramid)
+    for (auto& level : tape.pyramid->levels) bytes += vector_bytes(level);
+  if (tape.lods)
+    for (auto& level : tape.lods->tapes) bytes += memory_bytes(level);
+  auto tapes = std::unordered_set<const CsgTape*>{};
+  for (auto& instance : tape.instances)
+    if (tapes.insert(instance.tape.get()).second)
+      bytes += memory_bytes(*instance.tape);
+  return bytes;
+}
+
+inline size_t memory_bytes(const CsgGrid& grid) {
+  return grid.values.size() * sizeof(float);
+}
+
+inline size_t memory_bytes(const CsgSparseGrid& grid) {
+  return grid.values.size() * sizeof(float) + vector_bytes(grid.index) +
+         vector_bytes(grid.far) + vector_bytes(grid.dirty) +
+         vector_bytes(grid.free);
+}
+
+template <typename T>
+inline size_t memory_bytes(const image<T>& img) {
+  return (size_t)img.size().x * img.size().y * sizeof(T);
+}
+
+// Peak resident memory of the process in KB, 0 where it is not known.
+inline int64_t peak_memory() {
+#ifdef __linux__
+  auto usage = rusage{};
+  if (getrusage(RUSAGE_SELF, &usage) == 0) return usage.ru_maxrss;
+#endif
+  return 0;
+}
+
+// Bytes held by a part of an app, for reports.
+struct CsgMemoryUsage {
+  string name  = "";
+  size_t bytes = 0;
+};
+
+// Grids by their key, see grid_key, most recently used first.
+struct CsgGridCache {
+  struct entry {
+    uint64_t key   = 0;
+    CsgGrid  grid  = {};
+    size_t   bytes = 0;
+    uint64_t job   = 0;  // that cached it, 0 for none
+  };
+  using iterator = std::list<entry>::iterator;
+
+  std::mutex                             mutex   = {};
+  std::list<entry>                       entries = {};
+  std::unordered_map<uint64_t, iterator> index   = {};
+  std::unordered_map<uint64_t, size_t>   jobs    = {};  // bytes by job
+  size_t                                 bytes   = 0;
+  size_t                                 budget  = 0;
+};
+
+inline CsgGridCache& get_grid_cache() {
+  static auto cache = [] {
+    auto cache    = std::make_unique<CsgGridCache>();
+    auto env      = getenv("CSG_CACHE_BUDGET");
+    auto megabyte = (size_t)1 << 20;
+    cache->budget = env ? (size_t)atoll(env) * megabyte : 1024 * megabyte;
+    return cache;
+  }();
+  return *cache;
+}
+
+// Drops the least recently used grids until the cache fits its budget.
+// Called with the cache locked.
+inline void evict_grid(CsgGridCache& cache, CsgGridCache::iterator it) {
+  cache.bytes -= it->bytes;
+  if (it->job && (cache.jobs[it->job] -= it->bytes) == 0)
+    cache.jobs.erase(it->job);
+  cache.index.erase(it->key);
+  cache.entries.erase(it);
+}
+
+inline void evict_grids(CsgGridCache& cache) {
+  while (cache.bytes > cache.budget && !cache.entries.empty())
+    evict_grid(cache, std::prev(cache.entries.end()));
+}
+
+// Drops the least recently used grids of the job until they fit `budget`.
+inline void evict_job_grids(CsgGridCache& cache, uint64_t job, size_t budget) {
+  for (auto it = cache.entries.end(); it != cache.entries.begin();) {
+    auto found = cache.jobs.find(job);
+    if (found == cache.jobs.end() || found->second <= budget) return;
+    auto entry = std::prev(it);
+    if (entry->job == job) {
+      evict_grid(cache, entry);
+    } else {
+      it = entry;
+    }
+  }
+}
+
+inline bool find_cached_grid(
+    CsgGridCache& cache, uint64_t key, CsgGrid& grid) {
+  auto lock = std::lock_guard{cache.mutex};
+  auto it   = cache.index.find(key);
+  if (it == cache.index.end()) return false;
+  cache.entries.splice(cache.entries.begin(), cache.entries, it->second);
+  grid = it->second->grid;
+  return true;
+}
+
+inline void insert_cached_grid(
+    CsgGridCache& cache, uint64_t key, const CsgGrid& grid) {
+  auto  lock  = std::lock_guard{cache.mutex};
+  auto  bytes = memory_bytes(grid);
+  auto& job   = pool_job();
+  auto  owner = job && job->memory ? job->id : 0;
+  if (cache.index.count(key) || bytes > cache.budget) return;
+  if (owner && bytes > job->memory) return;
+  cache.entries.push_front({key, grid, bytes, owner});
+  cache.index[key] = cache.entries.begin();
+  cache.bytes += bytes;
+  if (owner) {
+    cache.jobs[owner] += bytes;
+    evict_job_grids(cache, owner, job->memory);
+  }
+  evict_grids(cache);
+}
+
+inline void set_cache_budget(CsgGridCache& cache, size_t budget) {
+  auto lock    = std::lock_guard{cache.mutex};
+  cache.budget = budget;
+  evict_grids(cache);
+}
+
+inline size_t cache_bytes(CsgGridCache& cache) {
+  auto lock = std::lock_guard{cache.mutex};
+  return cache.bytes;
+}
+
+// Memory of a tree and of its tape, which every app holds, and of the grid
+// cache.
+inline vector<CsgMemoryUsage> memory_usage(
+    const CsgTree& csg, const CsgTape& tape) {
+  return {{"tree", memory_bytes(csg)}, {"tape", memory_bytes(tape)},
+      {"grid cache", cache_bytes(get_grid_cache())}};
+}
@@ -0,0 +1,298 @@
+#pragma once
+#include <unordered_map>
+#include <unordered_set>
+
+#include "batch.h"
+#include "dual.h"
+
+// Triangle meshes of the surface, by dual contouring, for tools that take
+// meshes rather than trees. Positions and triangles are laid out as in
+// yocto_shape, so they can be saved with save_shape.
+//
+// Cells are found top down over an octree, as the bricks of sparse.h, and
+// regions that interval evaluation proves not to hold the surface are not
+// split, so that the work and the memory grow with the surface area rather
+// than the volume. Each cell crossed by the surface gets a vertex that
+// minimizes the distance from the tangent planes at its crossings, which
+// are found with the gradients of the tape, so that edges and corners of
+// the shapes stay sharp. Each crossed edge joins the vertices of its four
+// cells with a quad, split in two triangles.
+
+struct CsgMesh {
+  vector<vec3f> positions = {};
+  vector<vec3i> triangles = {};
+};
+
+// Cells of the octree as keys of the maps of meshers, 21 bits per axis.
+inline uint64_t cell_key(const vec3i& cell) {
+  return (uint64_t)cell.x | (uint64_t)cell.y << 21 | (uint64_t)cell.z << 42;
+}
+
+// Corners of a cell, in the order of the bits of their index.
+inline vec3i cell_corner(int k) { return {k & 1, (k >> 1) & 1, k >> 2}; }
+
+// Cells that the surface may cross in the cubic regions of `level`, given
+// as their first cell and their size, a power of two, in cells from
+// `origin`. The octree is split a level at a time, in parallel over its
+// regions.
+inline vector<vec3i> surface_cells(const CsgTree& csg, const vec3f& origin,
+    float cell, vector<pair<vec3i, int>> level) {
+  auto cells = vector<vec3i>{};
+  while (!level.empty()) {
+    auto split = vector<uint8_t>(level.size(), 0);
+    parallel_for((int)level.size(), [&](int item) {
+      thread_local auto values = vector<interval>{};
+      values.resize(csg.nodes.size());
+      auto [corner, size] = level[item];
+      auto min    = origin + cell * vec3f{(float)corner.x, (float)corner.y,
+                                           (float)corner.z};
+      auto range  = eval_csg_interval(values, csg, {min, min + cell * size});
+      split[item] = range.min <= 0 && range.max >= 0;
+    }, pool_priority());
+    auto next = vector<pair<vec3i, int>>{};
+    for (auto item = 0; item < level.size(); item++) {
+      if (!split[item]) continue;
+      auto [corner, size] = level[item];
+      if (size == 1) {
+        cells.push_back(corner);
+        continue;
+      }
+      auto half = size / 2;
+      for (auto k = 0; k < 8; k++)
+        next.push_back({corner + half * cell_corner(k), half});
+    }
+    level = std::move(next);
+  }
+  return cells;
+}
+
+// Point that minimizes the squared distances from the planes through
+// `points` with `normals`. Directions where the planes do not constrain
+// it, e.g. along an edge, are pulled toward the mass point of the points,
+// and the point is clamped to `bounds`.
+inline vec3f solve_qef(const vector<vec3f>& points,
+    const vector<vec3f>& normals, const bbox3f& bounds) {
+  auto mass = vec3f{0, 0, 0};
+  for (auto& point : points) mass += point;
+  mass /= (float)points.size();
+  auto regularization = 0.05f;
+  auto a = mat3f{{regularization, 0, 0}, {0, regularization, 0},
+      {0, 0, regularization}};
+  auto b = vec3f{0, 0, 0};
+  for (auto k = 0; k < points.size(); k++) {
+    auto& n = normals[k];
+    a += mat3f{n * n.x, n * n.y, n * n.z};
+    b += n * dot(n, points[k] - mass);
+  }
+  auto position = mass + inverse(a) * b;
+  return min(max(position, bounds.min), bounds.max);
+}
+
+// Values at the corners of cells from surface_cells and the vertices of
+// the cells whose edges the surface crosses.
+struct CsgContour {
+  vector<vec3i>                 cells   = {};
+  vector<std::array<float, 8>> corners = {};
+  vector<vec3f>                 vertex  = {};
+  vector<uint8_t>               crossed = {};
+};
+
+// Evaluates the corners of the cells and places their vertices, in parallel
+// over chunks of cells. Corners that are already there, as the samples of
+// mesh_csg_lods, are kept.
+inline void contour_cells(CsgContour& contour, const CsgTape& tape,
+    const vec3f& origin, float cell) {
+  auto& cells = contour.cells;
+  auto  at    = [&](const vec3i& c) {
+    return origin + cell * vec3f{(float)c.x, (float)c.y, (float)c.z};
+  };
+  auto sampled = contour.corners.size() == cells.size();
+  if (!sampled) contour.corners.assign(cells.size(), {});
+  contour.vertex.assign(cells.size(), {0, 0, 0});
+  contour.crossed.assign(cells.size(), 0);
+  parallel_for_chunks((int)cells.size(), [&](int begin, int end) {
+    auto points  = vector<vec3f>{};
+    auto normals = vector<vec3f>{};
+    for (auto item = begin; item < end; item++) {
+      auto& values = contour.corners[item];
+      for (auto k = 0; k < 8 && !sampled; k++)
+        values[k] = eval_tape(tape, at(cells[item] + cell_corner(k)));
+      points.clear();
+      normals.clear();
+      for (auto k = 0; k < 8; k++) {
+        for (auto axis = 0; axis < 3; axis++) {
+          auto other = k | (1 << axis);
+          if (other == k || (values[k] > 0) == (values[other] > 0)) continue;
+          auto t     = values[k] / (values[k] - values[other]);
+          auto point = lerp(at(cells[item] + cell_corner(k)),
+              at(cells[item] + cell_corner(other)), t);
+          auto grad  = eval_tape_grad(tape, point).grad;
+          points.push_back(point);
+          normals.push_back(
+              grad == vec3f{0, 0, 0} ? grad : normalize(grad));
+        }
+      }
+      if (points.empty()) continue;
+      contour.crossed[item] = 1;
+      contour.vertex[item]  = solve_qef(points, normals,
+          {at(cells[item]), at(cells[item] + vec3i{1, 1, 1})});
+    }
+  }, 256);
+}
+
+// Triangles of the quads of the edges from the first corner of each cell,
+// whose four cells are the cell and its neighbors below along the other two
+// axes, in the order that faces the edge axis. Vertices are found in
+// `indices` by cell_key, and edges whose cells are not all there are
+// skipped.
+inline vector<vec3i> contour_triangles(const CsgContour& contour,
+    const std::unordered_map<uint64_t, int>& indices) {
+  auto& cells  = contour.cells;
+  auto  chunks = (int)(cells.size() + 4095) / 4096;
+  auto  quads  = vector<vector<vec3i>>(chunks);
+  parallel_for(chunks, [&](int chunk) {
+    auto end = yocto::min((chunk + 1) * 4096, (int)cells.size());
+    for (auto item = chunk * 4096; item < end; item++) {
+      if (!contour.crossed[item]) continue;
+      auto& values = contour.corners[item];
+      for (auto axis = 0; axis < 3; axis++) {
+        auto inside = values[0] <= 0;
+        if (inside == (values[1 << axis] <= 0)) continue;
+        auto u = vec3i{0, 0, 0}, v = vec3i{0, 0, 0};
+        u[(axis + 1) % 3] = 1;
+        v[(axis + 2) % 3] = 1;
+        auto& c    = cells[item];
+        auto  quad = vec4i{-1, -1, -1, -1};
+        auto  ring = std::array<vec3i, 4>{c, c - u, c - u - v, c - v};
+        for (auto k = 0; k < 4; k++) {
+          if (min(ring[k]) < 0) break;
+          auto found = indices.find(cell_key(ring[k]));
+          if (found == indices.end()) break;
+          quad[k] = found->second;
+        }
+        if (quad.w < 0) continue;
+        if (!inside) quad = {quad.w, quad.z, quad.y, quad.x};
+        quads[chunk].push_back({quad.x, quad.y, quad.z});
+        quads[chunk].push_back({quad.x, quad.z, quad.w});
+      }
+    }
+  }, pool_priority());
+  auto triangles = vector<vec3i>{};
+  for (auto& chunk : quads)
+    triangles.insert(triangles.end(), chunk.begin(), chunk.end());
+  return triangles;
+}
+
+// Bounds of the tree grown by a margin, so that cells close the surface, or
+// the unit box around the origin when it is unbounded.
+inline bbox3f mesh_bounds(const CsgTree& csg) {
+  auto& root = csg.bounds[csg.root];
+  if (!is_bounded(root)) return {{-0.5, -0.5, -0.5}, {0.5, 0.5, 0.5}};
+  auto margin = 0.02f * yocto::max(root.max - root.min) + 1e-3f;
+  return {root.min - margin, root.max + margin};
+}
+
+// Meshes the surface in `bounds`, with `resolution` cells along the longest
+// side, which is rounded up to a power of two. Cells are cubes, so the grid
+// may extend past the bounds on the shorter sides.
+inline CsgMesh mesh_csg(
+    const CsgTree& csg, const bbox3f& bounds, int resolution) {
+  assert(resolution >= 1 && resolution <= (1 << 20));
+  auto size = 1;
+  while (size < resolution) size *= 2;
+  auto cell    = yocto::max(bounds.max - bounds.min) / size;
+  auto contour = CsgContour{};
+  contour.cells = surface_cells(csg, bounds.min, cell, {{{0, 0, 0}, size}});
+  contour_cells(contour, compile_csg(csg, flt_max), bounds.min, cell);
+
+  auto mesh    = CsgMesh{};
+  auto indices = std::unordered_map<uint64_t, int>{};
+  for (auto item = 0; item < contour.cells.size(); item++) {
+    if (!contour.crossed[item]) continue;
+    indices[cell_key(contour.cells[item])] = (int)mesh.positions.size();
+    mesh.positions.push_back(contour.vertex[item]);
+  }
+  mesh.triangles = contour_triangles(contour, indices);
+  return mesh;
+}
+
+// Meshes of the surface as mesh_csg, with `resolution` cells and then half
+// as many along each side at each of the `levels` after it, from one pass
+// over the octree. The cells of each level are the parents of the cells of
+// the level before, and their corners are corners of the finest grid at
+// even coordinates, whose samples are cached and evaluated once for all the
+// levels.
+inline vector<CsgMesh> mesh_csg_lods(const CsgTree& csg, const bbox3f& bounds,
+    int resolution, int levels) {
+  assert(resolution >= 1 && resolution <= (1 << 20));
+  auto size = 1;
+  while (size < resolution) size *= 2;
+  auto cell = yocto::max(bounds.max - bounds.min) / size;
+  auto tape = compile_csg(csg, flt_max);
+  auto at   = [&](const vec3i& c) {
+    return bounds.min + cell * vec3f{(float)c.x, (float)c.y, (float)c.z};
+  };
+
+  auto samples = std::unordered_map<uint64_t, float>{};
+  auto meshes  = vector<CsgMesh>{};
+  auto contour = CsgContour{};
+  for (auto level = 0; level < levels && (size >> level) > 0; level++) {
+    auto scale = 1 << level;
+    if (level == 0) {
+      contour.cells = surface_cells(csg, bounds.min, cell, {{{0, 0, 0}, size}});
+      contour.corners.clear();
+    } else {
+      // parents of the cells of the level before, and their corners, with
+      // the ones that are not cached yet evaluated in parallel
+      auto cells   = vector<vec3i>{};
+      auto parents = std::unordered_set<uint64_t>{};
+      for (auto& c : contour.cells) {
+        auto parent = vec3i{c.x >> 1, c.y >> 1, c.z >> 1};
+        if (parents.insert(cell_key(parent)).second) cells.push_back(parent);
+      }
+      contour.cells = std::move(cells);
+      auto missing  = vector<vec3i>{};
+      for (auto& c : contour.cells) {
+        for (auto k = 0; k < 8; k++) {
+          auto corner = (c + cell_corner(k)) * scale;
+          if (samples.insert({cell_key(corner), 0}).second)
+            missing.push_back(corner);
+        }
+      }
+      auto values = vector<float>(missing.size());
+      parallel_for_chunks((int)missing.size(), [&](int begin, int end) {
+        for (auto k = begin; k < end; k++)
+          values[k] = eval_tape(tape, at(missing[k]));
+      });
+      for (auto k = 0; k < missing.size(); k++)
+        samples[cell_key(missing[k])] = values[k];
+      contour.corners.resize(contour.cells.size());
+      for (auto item = 0; item < contour.cells.size(); item++)
+        for (auto k = 0; k < 8; k++)
+          contour.corners[item][k] = samples.at(
+              cell_key((contour.cells[item] + cell_corner(k)) * scale));
+    }
+    contour_cells(contour, tape, bounds.min, cell * scale);
+
+    // the finest samples that the coarser levels can use
+    if (level == 0 && levels > 1) {
+      for (auto item = 0; item < contour.cells.size(); item++) {
+        for (auto k = 0; k < 8; k++) {
+          auto corner = contour.cells[item] + cell_corner(k);
+          if (corner.x % 2 || corner.y % 2 || corner.z % 2) continue;
+          samples[cell_key(corner)] = contour.corners[item][k];
+        }
+      }
+    }
+
+    auto& mesh    = meshes.emplace_back();
+    auto  indices = std::unordered_map<uint64_t, int>{};
+    for (auto item = 0; item < contour.cells.size(); item++) {
+      if (!contour.crossed[item]) continue;
+      indices[cell_key(contour.cells[item])] = (int)mesh.positions.size();
+      mesh.positions.push_back(contour.vertex[item]);
+    }
+    mesh.triangles = contour_triangles(contour, indices);
+  }
+  return meshes;
+}
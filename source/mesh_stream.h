@@ -0,0 +1,148 @@
+#pragma once
+#include <climits>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <stdexcept>
+
+#include "mesh.h"
+
+// Meshes written a slab of cells at a time, for meshes too large to be kept
+// in memory. The grid of mesh_csg is split in slabs along z, and each slab
+// is contoured and written before the next one, keeping only the cells of
+// its top layer, whose vertices the quads of the next slab weld to by the
+// keys of their cells. Memory is then bounded by the cells of a slab.
+//
+// OBJ files are written as they go. PLY files are binary, in the byte order
+// of the machine as .csgb files. Their faces are kept in a temporary file
+// next to them until the vertices are done, and their counts are padded so
+// that the header is written again at the end with the same size.
+
+struct CsgMeshStream {
+  FILE*    file      = nullptr;
+  FILE*    faces     = nullptr;  // of PLY files
+  string   filename  = {};
+  bool     ply       = false;
+  uint64_t vertices  = 0;
+  uint64_t triangles = 0;
+};
+
+inline bool write_ply_header(const CsgMeshStream& stream) {
+  return fprintf(stream.file,
+             "ply\nformat binary_little_endian 1.0\n"
+             "element vertex %20llu\n"
+             "property float x\nproperty float y\nproperty float z\n"
+             "element face %20llu\n"
+             "property list uchar uint vertex_indices\nend_header\n",
+             (unsigned long long)stream.vertices,
+             (unsigned long long)stream.triangles) > 0;
+}
+
+// Opens the mesh, a PLY or an OBJ file by its extension.
+inline void open_mesh_stream(CsgMeshStream& stream, const string& filename) {
+  auto extension  = std::filesystem::path{filename}.extension().string();
+  stream          = CsgMeshStream{};
+  stream.filename = filename;
+  stream.ply      = extension == ".ply" || extension == ".PLY";
+  if (!stream.ply && extension != ".obj" && extension != ".OBJ")
+    throw std::runtime_error{filename + ": unknown mesh format"};
+  stream.file = fopen(filename.c_str(), "wb");
+  if (!stream.file) throw std::runtime_error{filename + ": cannot open"};
+  if (!stream.ply) return;
+  stream.faces = fopen((filename + ".faces").c_str(), "w+b");
+  if (!stream.faces) throw std::runtime_error{filename + ": cannot open"};
+  write_ply_header(stream);
+}
+
+// Appends vertices and the triangles of a slab, whose indices count all the
+// vertices written so far.
+inline void write_mesh_slab(CsgMeshStream& stream,
+    const vector<vec3f>& positions, const vector<vec3i>& triangles) {
+  auto ok = true;
+  if (stream.ply) {
+    ok = positions.empty() || fwrite(positions.data(), sizeof(vec3f),
+                                  positions.size(), stream.file) ==
+                                  positions.size();
+    auto faces = vector<uint8_t>(triangles.size() * 13);
+    for (auto k = 0; k < triangles.size(); k++) {
+      faces[k * 13] = 3;
+      memcpy(faces.data() + k * 13 + 1, &triangles[k], sizeof(vec3i));
+    }
+    ok = ok && (faces.empty() || fwrite(faces.data(), 1, faces.size(),
+                                     stream.faces) == faces.size());
+  } else {
+    for (auto& p : positions)
+      ok = ok &&
+           fprintf(stream.file, "v %.9g %.9g %.9g\n", p.x, p.y, p.z) > 0;
+    for (auto& t : triangles)
+      ok = ok && fprintf(stream.file, "f %d %d %d\n", t.x + 1, t.y + 1,
+                     t.z + 1) > 0;
+  }
+  if (!ok) throw std::runtime_error{stream.filename + ": cannot write mesh"};
+  stream.vertices += positions.size();
+  stream.triangles += triangles.size();
+}
+
+// Ends the mesh. PLY files get their faces and their counts.
+inline void close_mesh_stream(CsgMeshStream& stream) {
+  auto ok = true;
+  if (stream.ply) {
+    auto buffer = vector<char>(1 << 20);
+    rewind(stream.faces);
+    while (auto size = fread(buffer.data(), 1, buffer.size(), stream.faces))
+      ok = ok && fwrite(buffer.data(), 1, size, stream.file) == size;
+    fclose(stream.faces);
+    std::filesystem::remove(stream.filename + ".faces");
+    ok = ok && fseek(stream.file, 0, SEEK_SET) == 0 &&
+         write_ply_header(stream);
+  }
+  ok = fclose(stream.file) == 0 && ok;
+  stream.file  = nullptr;
+  stream.faces = nullptr;
+  if (!ok) throw std::runtime_error{stream.filename + ": cannot write mesh"};
+}
+
+// Meshes the surface as mesh_csg, a slab of `slab` cells at a time, into
+// `filename`. The slab is rounded up to a power of two. Returns the number
+// of triangles.
+inline uint64_t stream_mesh_csg(const CsgTree& csg, const bbox3f& bounds,
+    int resolution, const string& filename, int slab = 32) {
+  assert(resolution >= 1 && resolution <= (1 << 20));
+  auto size = 1;
+  while (size < resolution) size *= 2;
+  auto thickness = 1;
+  while (thickness < slab && thickness < size) thickness *= 2;
+  auto cell   = yocto::max(bounds.max - bounds.min) / size;
+  auto tape   = compile_csg(csg, flt_max);
+  auto stream = CsgMeshStream{};
+  open_mesh_stream(stream, filename);
+
+  auto indices   = std::unordered_map<uint64_t, int>{};
+  auto contour   = CsgContour{};
+  auto positions = vector<vec3f>{};
+  for (auto z = 0; z < size; z += thickness) {
+    auto level = vector<pair<vec3i, int>>{};
+    for (auto y = 0; y < size; y += thickness)
+      for (auto x = 0; x < size; x += thickness)
+        level.push_back({{x, y, z}, thickness});
+    contour.cells = surface_cells(csg, bounds.min, cell, std::move(level));
+    contour_cells(contour, tape, bounds.min, cell);
+    positions.clear();
+    for (auto item = 0; item < contour.cells.size(); item++) {
+      if (!contour.crossed[item]) continue;
+      auto index = stream.vertices + positions.size();
+      if (index > INT_MAX)
+        throw std::runtime_error{filename + ": too many vertices"};
+      indices[cell_key(contour.cells[item])] = (int)index;
+      positions.push_back(contour.vertex[item]);
+    }
+    write_mesh_slab(stream, positions, contour_triangles(contour, indices));
+
+    // the top layer is kept for the quads of the next slab
+    auto top = (uint64_t)(z + thickness - 1);
+    for (auto it = indices.begin(); it != indices.end();)
+      it = (it->first >> 42) == top ? std::next(it) : indices.erase(it);
+  }
+  close_mesh_stream(stream);
+  return stream.triangles;
+}
@@ -0,0 +1,125 @@
+#pragma once
+#include <atomic>
+#include <memory>
+
+#include "pool.h"
+
+// Counters of long running processes, e.g. the render server, for metrics
+// scraped by monitoring, see write_metrics in server.h. Counters are kept
+// per thread, so that the loops that count them share no cache lines: each
+// worker of the pool adds to its own slot with relaxed atomics, and other
+// threads to the first slot. Slots are summed only when they are read.
+// Durations are counted in buckets a factor of two apart from a
+// millisecond, from which quantiles are estimated as in Prometheus.
+
+enum struct csg_counter {
+  requests,
+  failures,  // requests answered with errors
+  tiles,     // passes over tiles, see render_batch
+  rays,
+  steps,
+  scene_hits,  // scenes found resident, with their tapes
+  scene_misses,
+  count
+};
+
+constexpr auto csg_duration_buckets = 20;  // up to 2^19 ms, then infinite
+
+struct alignas(64) CsgCounterSlot {
+  std::atomic<uint64_t> counters[(int)csg_counter::count]    = {};
+  std::atomic<uint64_t> durations[csg_duration_buckets + 1] = {};
+  std::atomic<uint64_t> duration_sum                        = {0};  // ns
+};
+
+struct CsgMetrics {
+  std::unique_ptr<CsgCounterSlot[]> slots = {};
+  int                               size  = 0;
+};
+
+// Metrics of the process, with a slot per worker of the pool and one for
+// the other threads.
+inline CsgMetrics& get_metrics() {
+  static auto metrics = [] {
+    auto metrics   = std::make_unique<CsgMetrics>();
+    metrics->size  = get_pool().size + 1;
+    metrics->slots = std::make_unique<CsgCounterSlot[]>(metrics->size);
+    return metrics;
+  }();
+  return *metrics;
+}
+
+inline CsgCounterSlot& metrics_slot() {
+  auto& metrics = get_metrics();
+  auto  worker  = pool_worker();
+  return metrics.slots[worker >= 0 && worker + 1 < metrics.size ? worker + 1
+                                                                : 0];
+}
+
+inline void count_metric(csg_counter counter, uint64_t value = 1) {
+  metrics_slot().counters[(int)counter].fetch_add(
+      value, std::memory_order_relaxed);
+}
+
+// Upper bound of the bucket, in seconds.
+inline double duration_bound(int bucket) {
+  return (double)((uint64_t)1 << bucket) * 1e-3;
+}
+
+inline void count_duration(int64_t nanoseconds) {
+  auto bucket = 0;
+  while (bucket < csg_duration_buckets &&
+         nanoseconds * 1e-9 > duration_bound(bucket))
+    bucket++;
+  auto& slot = metrics_slot();
+  slot.durations[bucket].fetch_add(1, std::memory_order_relaxed);
+  slot.duration_sum.fetch_add(nanoseconds, std::memory_order_relaxed);
+}
+
+inline uint64_t read_metric(csg_counter counter) {
+  auto& metrics = get_metrics();
+  auto  value   = (uint64_t)0;
+  for (auto k = 0; k < metrics.size; k++)
+    value += metrics.slots[k].counters[(int)counter].load(
+        std::memory_order_relaxed);
+  return value;
+}
+
+// Counts of the durations in each bucket, and their sum in seconds.
+struct CsgDurations {
+  uint64_t buckets[csg_duration_buckets + 1] = {};
+  uint64_t count                             = 0;
+  double   sum                               = 0;
+};
+
+inline CsgDurations read_durations() {
+  auto& metrics   = get_metrics();
+  auto  durations = CsgDurations{};
+  auto  sum       = (uint64_t)0;
+  for (auto k = 0; k < metrics.size; k++) {
+    auto& slot = metrics.slots[k];
+    for (auto bucket = 0; bucket <= csg_duration_buckets; bucket++)
+      durations.buckets[bucket] += slot.durations[bucket].load(
+          std::memory_order_relaxed);
+    sum += slot.duration_sum.load(std::memory_order_relaxed);
+  }
+  for (auto count : durations.buckets) durations.count += count;
+  durations.sum = sum * 1e-9;
+  return durations;
+}
+
+// Quantile of the durations, interpolated linearly in its bucket. Durations
+// beyond the last bound are given it.
+inline double duration_quantile(const CsgDurations& durations, double q) {
+  if (durations.count == 0) return 0;
+  auto rank = q * durations.count, seen = 0.0;
+  for (auto bucket = 0; bucket < csg_duration_buckets; bucket++) {
+    auto count = (double)durations.buckets[bucket];
+    if (seen + count >= rank && count > 0) {
+      auto lower = bucket ? duration_bound(bucket - 1) : 0.0;
+      auto upper = duration_bound(bucket);
+      return lower + (upper - lower) * (rank - seen) / count;
+    }
+    seen += count;
+  }
+  return duration_bound(csg_duration_buckets - 1);
+}
@@ -0,0 +1,117 @@
+#pragma once
+#include <queue>
+#include <stdexcept>
+
+#include "tape.h"
+
+// Overlap of two trees, as the parts of an assembly. The intersection of
+// the trees is max(f, g), and the search looks for its lowest value over
+// an octree of the space where their boxes meet: cells are taken best
+// first by a lower bound of max(f, g) found by interval arithmetic on both
+// trees, their centers are evaluated with the tapes, and cells whose bound
+// is not below the best value are never split. The trees overlap as soon
+// as a center is inside both, and are separated once no cell can go below
+// zero. The lowest value, divided by the Lipschitz bounds, estimates the
+// penetration depth: the distance that the deepest point of the overlap is
+// from the nearer of the two surfaces.
+
+struct CsgOverlap {
+  bool  overlap   = false;      // a point inside both trees was found
+  bool  separated = false;      // no point is inside both
+  float depth     = 0;          // of the penetration, if it was asked for
+  vec3f point     = {0, 0, 0};  // deepest point found
+};
+
+struct CsgOverlapOptions {
+  int  levels = 8;      // of the octree, 2^levels cells per side
+  bool depth  = false;  // keeps searching past the first overlap
+};
+
+// Overlap of the trees and their compiled tapes. Throws if both trees are
+// unbounded.
+inline CsgOverlap overlap_csg(const CsgTree& a, const CsgTape& tape_a,
+    const CsgTree& b, const CsgTape& tape_b,
+    const CsgOverlapOptions& options = {}) {
+  auto infinite  = bbox3f{
+      {-flt_max, -flt_max, -flt_max}, {flt_max, flt_max, flt_max}};
+  auto bounds_of = [&](const CsgTree& csg) {
+    return csg.bounds.size() == csg.nodes.size() ? csg.bounds[csg.root]
+                                                 : infinite;
+  };
+  auto box_a = bounds_of(a), box_b = bounds_of(b);
+  if (!is_bounded(box_a) && !is_bounded(box_b))
+    throw std::runtime_error{"both trees are unbounded"};
+  auto box    = bbox3f{max(box_a.min, box_b.min), min(box_a.max, box_b.max)};
+  auto result = CsgOverlap{};
+  if (box.min.x > box.max.x || box.min.y > box.max.y ||
+      box.min.z > box.max.z) {
+    result.separated = true;
+    return result;
+  }
+  auto center    = (box.min + box.max) / 2;
+  auto half      = yocto::max(box.max - box.min) / 2;
+  auto lipschitz = yocto::max(tape_a.lipschitz, tape_b.lipschitz);
+
+  struct cell_bound {
+    float bound = 0;  // of max(f, g) in the cell
+    int   level = 0;
+    vec3i cell  = {0, 0, 0};
+    bool  operator<(const cell_bound& other) const {
+      return bound > other.bound;
+    }
+  };
+  auto intervals_a = vector<interval>(a.nodes.size());
+  auto intervals_b = vector<interval>(b.nodes.size());
+  auto cell_box    = [&](int level, const vec3i& cell) {
+    auto size = 2 * half / (1 << level);
+    auto min  = center - half +
+               size * vec3f{(float)cell.x, (float)cell.y, (float)cell.z};
+    return bbox3f{min, min + size};
+  };
+  auto bound_cell = [&](int level, const vec3i& cell) {
+    auto region = cell_box(level, cell);
+    auto f      = eval_csg_interval(intervals_a, a, region);
+    auto g      = eval_csg_interval(intervals_b, b, region);
+    return cell_bound{yocto::max(f.min, g.min), level, cell};
+  };
+
+  auto best       = flt_max;
+  auto unresolved = flt_max;  // lowest bound of the cells of the finest level
+  auto queue      = std::priority_queue<cell_bound>{};
+  queue.push(bound_cell(0, {0, 0, 0}));
+  while (!queue.empty()) {
+    auto top = queue.top();
+    queue.pop();
+    if (top.bound >= best) break;
+    auto region = cell_box(top.level, top.cell);
+    auto point  = (region.min + region.max) / 2;
+    auto value  = yocto::max(
+        eval_tape(tape_a, point), eval_tape(tape_b, point));
+    if (value < best) {
+      best         = value;
+      result.point = point;
+    }
+    if (best < 0 && !options.depth) break;
+    if (top.level == options.levels) {
+      unresolved = yocto::min(unresolved, top.bound);
+      continue;
+    }
+    for (auto k = 0; k < 8; k++) {
+      auto child = bound_cell(top.level + 1,
+          top.cell * 2 + vec3i{k & 1, (k >> 1) & 1, k >> 2});
+      if (child.bound < best) queue.push(child);
+    }
+  }
+
+  // the cells left are not below the best value, but the ones of the finest
+  // level may go below zero between their centers
+  result.overlap   = best < 0;
+  result.separated = !result.overlap && unresolved >= 0;
+  if (result.overlap && options.depth) result.depth = -best / lipschitz;
+  return result;
+}
+
+inline CsgOverlap overlap_csg(const CsgTree& a, const CsgTree& b,
+    const CsgOverlapOptions& options = {}) {
+  return overlap_csg(a, compile_csg(a), b, compile_csg(b), options);
+}
@@ -0,0 +1,100 @@
+#pragma once
+#include "csg.h"
+
+// Evaluation layout of a tree. CsgNode keeps a name and a 64-byte union next
+// to the children, so most of every node is cold during evaluation. Here the
+// node tags and children are parallel arrays and the parameters of all the
+// nodes are packed in post order: 4 floats for primitives and 2 (blend,
+// softness) for operations. Evaluation walks the parameters sequentially,
+// so the offsets and the names are kept apart for editing only. Groups are
+// not supported.
+
+enum struct csg_node_type : uint8_t { sphere, box, operation };
+
+struct CsgPacked {
+  vector<csg_node_type> types    = {};
+  vector<vec2i>         children = {};
+  vector<float>         params   = {};
+  int                   root     = -1;
+
+  // cold data, used by editing
+  vector<int>               offsets = {};  // of each node into params
+  vector<int>               names   = {};  // see CsgTree::names
+  std::shared_ptr<CsgNames> symbols = {};
+};
+
+inline int num_params(csg_node_type type) {
+  return type == csg_node_type::operation ? 2 : 4;
+}
+
+inline CsgPacked pack_csg(const CsgTree& csg) {
+  assert(csg.root == csg.nodes.size() - 1);
+  assert(csg.groups.empty() && csg.meshes.empty() && csg.instances.empty());
+  auto packed = CsgPacked{};
+  packed.root    = csg.root;
+  packed.symbols = csg.names;
+  packed.types.reserve(csg.nodes.size());
+  packed.children.reserve(csg.nodes.size());
+  packed.offsets.reserve(csg.nodes.size());
+  packed.names.reserve(csg.nodes.size());
+  for (auto& node : csg.nodes) {
+    packed.offsets.push_back(packed.params.size());
+    packed.names.push_back(node.name);
+    packed.children.push_back(node.children);
+    if (node.children != vec2i{-1, -1}) {
+      packed.types.push_back(csg_node_type::operation);
+      packed.params.push_back(node.operation.blend);
+      packed.params.push_back(node.operation.softness);
+    } else {
+      auto type = node.primitive.type;
+      assert(type == primitive_type::sphere || type == primitive_type::box);
+      packed.types.push_back(type == primitive_type::sphere
+                                 ? csg_node_type::sphere
+                                 : csg_node_type::box);
+      for (auto k = 0; k < 4; k++)
+        packed.params.push_back(node.primitive.params[k]);
+    }
+  }
+  return packed;
+}
+
+// Parameters of a node, for editing in place.
+inline float* get_params(CsgPacked& csg, int node) {
+  return csg.params.data() + csg.offsets[node];
+}
+
+// Index of the last node with the given name, or -1.
+inline int find_node(const CsgPacked& csg, const string& name) {
+  auto symbol = csg.symbols ? find_name(*csg.symbols, name) : -1;
+  if (symbol < 0) return -1;
+  for (auto i = (int)csg.names.size() - 1; i >= 0; i--)
+    if (csg.names[i] == symbol) return i;
+  return -1;
+}
+
+inline float eval_csg(
+    vector<float>& values, const CsgPacked& csg, const vec3f& position) {
+  assert(values.size() == csg.types.size());
+  auto params = csg.params.data();
+  for (auto i = 0; i < csg.types.size(); i++) {
+    switch (csg.types[i]) {
+      case csg_node_type::sphere: {
+        auto center = vec3f{params[0], params[1], params[2]};
+        values[i]   = length(position - center) - params[3];
+      } break;
+      case csg_node_type::box: values[i] = 1; break;
+      case csg_node_type::operation: {
+        auto [a, b] = csg.children[i];
+        values[i]   = eval_operation(
+            values[a], values[b], CsgOperation{params[0], params[1]});
+      } break;
+    }
+    params += num_params(csg.types[i]);
+  }
+  return values[csg.root];
+}
+
+inline float eval_csg(const CsgPacked& csg, const vec3f& position) {
+  auto values = vector<float>(csg.types.size());
+  return eval_csg(values, csg, position);
+}
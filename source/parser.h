@@ -1,9 +1,27 @@
 #pragma once
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <cstring>
+#include <filesystem>
+#include <mutex>
 #include <string_view>
 #include <unordered_set>
 using namespace std;
 
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 #include "csg.h"
+#include "pool.h"
+#include "tree_io.h"
+#include "zones.h"
+//
+#include "ext/yocto-gl/yocto/yocto_shape.h"
 using namespace yocto;
 
 // file wrapper with RIIA
@@ -30,7 +48,7 @@ struct file_wrapper {
   FILE*  fs       = nullptr;
 };
 
-file_wrapper open_file(const string& filename, const string& mode) {
+inline file_wrapper open_file(const string& filename, const string& mode) {
   auto fs = file_wrapper{};
   fs.fs   = fopen(filename.c_str(), mode.c_str());
   if (!fs.fs) throw std::runtime_error{filename + ": file not found"};
@@ -38,10 +56,54 @@ file_wrapper open_file(const string& filename, const string& mode) {
   return fs;
 }
 
-bool read_line(file_wrapper& fs, char* buffer, int size) {
+inline bool read_line(file_wrapper& fs, char* buffer, int size) {
   return (bool)fgets(buffer, size, fs.fs);
 }
 
+// Contents of a file, mapped in memory where possible and read otherwise,
+// so that large files are parsed in place without copies.
+struct file_mapping {
+  file_mapping() {}
+  ~file_mapping() {
+#if !defined(_WIN32)
+    if (mapped) munmap(mapped, data.size());
+#endif
+  }
+  file_mapping(const file_mapping&) = delete;
+  file_mapping& operator=(const file_mapping&) = delete;
+
+  string_view data    = {};
+  void*       mapped  = nullptr;
+  string      storage = {};  // where files cannot be mapped
+};
+
+// Maps the file, whose contents stay valid as long as `mapping` lives.
+inline void map_file(file_mapping& mapping, const string& filename) {
+#if !defined(_WIN32)
+  auto file = open(filename.c_str(), O_RDONLY);
+  if (file < 0) throw std::runtime_error{filename + ": file not found"};
+  struct stat info = {};
+  if (fstat(file, &info) == 0 && info.st_size > 0) {
+    auto mapped = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+    if (mapped != MAP_FAILED) {
+      madvise(mapped, info.st_size, MADV_SEQUENTIAL);
+      mapping.mapped = mapped;
+      mapping.data   = {(const char*)mapped, (size_t)info.st_size};
+    }
+  }
+  close(file);
+  if (mapping.mapped || info.st_size == 0) return;
+#endif
+  auto fs = open_file(filename, "rb");
+  fseek(fs.fs, 0, SEEK_END);
+  mapping.storage.resize(ftell(fs.fs));
+  fseek(fs.fs, 0, SEEK_SET);
+  if (fread(mapping.storage.data(), 1, mapping.storage.size(), fs.fs) !=
+      mapping.storage.size())
+    throw std::runtime_error{filename + ": cannot read"};
+  mapping.data = mapping.storage;
+}
+
 // utilities
 static bool is_newline(char c) { return c == '\r' || c == '\n'; }
 static bool is_space(char c) {
@@ -151,17 +213,34 @@ inline void parse_value(string_view& str, bool& value) {
   parse_value(str, valuei);
   value = (bool)valuei;
 }
+// Numbers are read with from_chars, which stops at the end of the string,
+// so that strings need not be terminated, e.g. when files are mapped. Its
+// grammar lacks the leading plus of strtod, which is skipped.
+template <typename T>
+inline void parse_number(string_view& str, T& value) {
+  skip_whitespace(str);
+  auto begin = str.data(), end = str.data() + str.size();
+  if (begin != end && *begin == '+') begin++;
+#if defined(__cpp_lib_to_chars)
+  auto result = std::from_chars(begin, end, value);
+  if (result.ec != std::errc{}) assert(0 && "number expected");
+  str.remove_prefix(result.ptr - str.data());
+#else
+  char buffer[64];
+  auto size = yocto::min((size_t)(end - begin), sizeof(buffer) - 1);
+  memcpy(buffer, begin, size);
+  buffer[size]  = 0;
+  auto* stopped = (char*)nullptr;
+  value         = (T)strtod(buffer, &stopped);
+  if (stopped == buffer) assert(0 && "number expected");
+  str.remove_prefix((begin - str.data()) + (stopped - buffer));
+#endif
+}
 inline void parse_value(string_view& str, float& value) {
-  char* end = nullptr;
-  value     = strtof(str.data(), &end);
-  if (str.data() == end) assert(0 && "float expected");
-  str.remove_prefix(end - str.data());
+  parse_number(str, value);
 }
 inline void parse_value(string_view& str, double& value) {
-  char* end = nullptr;
-  value     = strtod(str.data(), &end);
-  if (str.data() == end) assert(0 && "double expected");
-  str.remove_prefix(end - str.data());
+  parse_number(str, value);
 }
 #ifdef __APPLE__
 inline void parse_value(string_view& str, size_t& value) {
@@ -204,30 +283,121 @@ void parse_value(file_wrapper& fs, string_view& str, T& value) {
   }
 }
 
-int parse_primitive(
-    string_view& str, CsgPrimitve& primitive, const string& name) {
-  if (name == "sphere") {
-    primitive.type = primitive_type::sphere;
-  } else if (name == "cube") {
-    primitive.type = primitive_type::box;
-  } else {
+// Spheres of a group, one per line of the file as its center and radius,
+// e.g. for particles or point clouds, evaluated through the BVH of the
+// group rather than as a node each. Lines starting with `#` are skipped.
+inline CsgGroup load_spheres(const string& filename) {
+  auto mapping = file_mapping{};
+  map_file(mapping, filename);
+  auto group = CsgGroup{};
+  for (auto data = mapping.data; !data.empty();) {
+    auto end = data.find('\n');
+    auto str = data.substr(0, end);
+    data.remove_prefix(end == string_view::npos ? data.size() : end + 1);
+    skip_comment(str);
+    skip_whitespace(str);
+    if (str.empty()) continue;
+    auto sphere = vec4f{};
+    parse_value(str, sphere);
+    group.centers.push_back(xyz(sphere));
+    group.radius.push_back(sphere.w);
+  }
+  return group;
+}
+
+// Triangles of a mesh, as loaded by yocto_shape, with quads split in two,
+// e.g. for scans to be carved or blended with other shapes.
+inline CsgTriangles load_mesh(const string& filename) {
+  auto points    = vector<int>{};
+  auto lines     = vector<vec2i>{};
+  auto quads     = vector<vec4i>{};
+  auto normals   = vector<vec3f>{};
+  auto texcoords = vector<vec2f>{};
+  auto colors    = vector<vec4f>{};
+  auto radius    = vector<float>{};
+  auto mesh      = CsgTriangles{};
+  load_shape(filename, points, lines, mesh.triangles, quads, mesh.positions,
+      normals, texcoords, colors, radius);
+  for (auto& triangle : quads_to_triangles(quads))
+    mesh.triangles.push_back(triangle);
+  if (mesh.triangles.empty())
+    throw std::runtime_error{filename + ": no triangles"};
+  return mesh;
+}
+
+// Instances are placed by a translation, then optionally by rotations in
+// degrees around x, y and z, and a uniform scale, e.g.
+// `bolt1 = instance bolt 0.5 0 0 0 90 0 2`. Mirrors and repetitions are
+// instances that fold the points, see CsgFold: mirrors take the axes, e.g.
+// `face = mirror half x`, and repetitions the period and the copies on each
+// side along each axis, e.g. `grille = repeat bar 0.1 0 0 4 0 0`. Their
+// parameters follow the 7 of the frame: the mirrored axes, the period and
+// the copies.
+inline int parse_primitive(
+    string_view& str, CsgPrimitve& primitive, string_view name) {
+  auto found = false;
+  for_each_primitive([&](auto kind) {
+    if (name != decltype(kind)::name) return;
+    primitive.type = decltype(kind)::type;
+    found          = true;
+  });
+  if (name == "spheres") {
+    primitive.type = primitive_type::group;  // see load_spheres
+    return true;
+  } else if (name == "mesh") {
+    primitive.type = primitive_type::mesh;  // see load_mesh
+    return true;
+  } else if (name == "instance" || name == "mirror" || name == "repeat") {
+    primitive.type = primitive_type::instance;
+    for (int i = 0; i < 16; i++) primitive.params[i] = i == 6 ? 1 : 0;
+    if (name == "mirror") {
+      // axes other than x, y and z are marked for load_csg to reject
+      auto axes = string_view{};
+      skip_whitespace(str);
+      if (!str.empty()) parse_value(str, axes);
+      auto valid = !axes.empty();
+      for (auto axis : axes) {
+        if (axis < 'x' || axis > 'z') valid = false;
+        if (valid) primitive.params[7 + axis - 'x'] = 1;
+      }
+      if (!valid) primitive.params[7] = -1;
+      return true;
+    }
+    if (name == "repeat") {
+      for (int i = 10; i < 16; i++) parse_value(str, primitive.params[i]);
+      return true;
+    }
+    for (int i = 0; i < 7; i++) {
+      skip_whitespace(str);
+      if (i >= 3 && str.empty()) break;
+      parse_value(str, primitive.params[i]);
+    }
+    return true;
+  } else if (!found) {
     return false;
   }
-  int num_params;
-  if (primitive.type == primitive_type::sphere) num_params = 4;
-  if (primitive.type == primitive_type::box) num_params = 4;
+  auto num_params = primitive_params(primitive.type);
   for (int i = 0; i < num_params; i++) {
     parse_value(str, primitive.params[i]);
   }
   return true;
 }
 
-inline string tree_to_string(const CsgTree& tree) {
+// Graphviz graph of the tree. With `heat`, e.g. from profile_heat, nodes
+// are filled from white to red by their fraction of the cost, which is
+// added to their labels.
+inline string tree_to_string(
+    const CsgTree& tree, const vector<float>& heat = {}) {
   string result = "graph {\n";
   result += "forcelabels=true\n";
 
   for (int i = 0; i < tree.nodes.size(); i++) {
     auto color = vec3f(0.0, 0.0, 0.8);
+    auto cost  = string{};
+    if (!heat.empty()) {
+      color = vec3f(0.0, clamp(heat[i], 0.0f, 1.0f), 1.0);
+      cost  = "\n" + std::to_string((int)round(heat[i] * 100)) + "%";
+    }
     char str[256];
     sprintf(str, "%d [label=\"%d\" style=filled fillcolor=\" %f %f %f\"]", i, i,
         color.x, color.y, color.z);
@@ -236,9 +406,13 @@ inline string tree_to_string(const CsgTree& tree) {
     if (tree.nodes[i].children == vec2i{-1, -1}) {
       result += std::to_string(i) + "\n";
 
-      sprintf(str, "%d [label=\"sphere\n%.1f %.1f %.1f %.1f\"]\n", i,
+      auto name = "leaf";
+      visit_primitive(tree.nodes[i].primitive.type,
+          [&](auto kind) { name = decltype(kind)::name; });
+      sprintf(str, "%d [label=\"%s\n%.1f %.1f %.1f %.1f%s\"]\n", i, name,
           tree.nodes[i].primitive.params[0], tree.nodes[i].primitive.params[1],
-          tree.nodes[i].primitive.params[2], tree.nodes[i].primitive.params[3]);
+          tree.nodes[i].primitive.params[2], tree.nodes[i].primitive.params[3],
+          cost.c_str());
       result += std::string(str);
     } else {
       int c = tree.nodes[i].children.x;
@@ -246,8 +420,10 @@ inline string tree_to_string(const CsgTree& tree) {
       c = tree.nodes[i].children.y;
       result += std::to_string(i) + " -- " + std::to_string(c) + "\n";
 
-      sprintf(str, "%d [label=\"%s\n%.1f %.1f\"]\n", i, tree.nodes[i].name.c_str(),
-          tree.nodes[i].operation.blend, tree.nodes[i].operation.softness);
+      auto name = node_name(tree, i);
+      snprintf(str, sizeof(str), "%d [label=\"%.*s\n%.1f %.1f%s\"]\n", i,
+          (int)name.size(), name.data(), tree.nodes[i].operation.blend,
+          tree.nodes[i].operation.softness, cost.c_str());
       result += std::string(str);
     }
   }
@@ -255,22 +431,35 @@ inline string tree_to_string(const CsgTree& tree) {
   return result;
 }
 
-void save_tree_png(const CsgTree& tree, const string& filename) {
-  FILE* file = fopen((filename + ".txt").c_str(), "w");
-  fprintf(file, "%s", tree_to_string(tree).c_str());
-  fclose(file);
-  system(
-      ("dot -Tpng " + filename + ".txt" + " > " + filename + ".png").c_str());
+// Saves the tree as a graphviz graph, see tree_to_string.
+inline void save_tree_dot(const CsgTree& tree, const string& filename,
+    const vector<float>& heat = {}) {
+  auto fs = open_file(filename, "w");
+  fprintf(fs.fs, "%s", tree_to_string(tree, heat).c_str());
+}
+
+// Draws the tree to a PNG with graphviz, whose dot must be on the path,
+// through a graph written next to the image. Returns false if dot failed.
+// Large trees take long to lay out, so the viewer draws them in the
+// background.
+inline bool save_tree_png(const CsgTree& tree, const string& filename,
+    const vector<float>& heat = {}) {
+  auto graph = filename + ".dot";
+  save_tree_dot(tree, graph, heat);
+  auto status = system(
+      ("dot -Tpng \"" + graph + "\" -o \"" + filename + "\"").c_str());
+  std::filesystem::remove(graph);
+  return status == 0;
 }
 
 struct CsgParser {
-  char buffer[4096];
-  int  line         = 0;
-  int  instructions = 0;
+  string_view text         = {};  // of the current line
+  int         line         = 0;
+  int         instructions = 0;
 };
 
 // https://stackoverflow.com/questions/5878775/how-to-find-and-replace-string/5878802
-void replace(std::string& subject, const std::string& search,
+inline void replace(std::string& subject, const std::string& search,
     const std::string& replace) {
   size_t pos = 0;
   while ((pos = subject.find(search, pos)) != std::string::npos) {
@@ -279,134 +468,392 @@ void replace(std::string& subject, const std::string& search,
   }
 }
 
-void parser_error(const CsgParser& parser, string message) {
-  printf("\n\tParse error at line %d: \n\t %s\n\twhy?:\n\t %s\n\t", parser.line,
-      parser.buffer, message.c_str());
-  exit(1);
-}
-
-Csg load_csg(const string& filename, bool debug_draw = false) {
-  auto csg = CsgTree{};
+// Errors are thrown rather than exiting, so that files reloaded by a viewer
+// can be fixed and saved again while the previous tree is shown.
+[[noreturn]] inline void parser_error(const CsgParser& parser, string message) {
+  throw std::runtime_error{"parse error at line " +
+                           std::to_string(parser.line) + ": " + message +
+                           "\n\t" + string{parser.text}};
+}
+
+// A line of a file, lexed without the nodes that it names, which depend on
+// the lines before it and are looked up by load_csg.
+struct CsgLine {
+  string_view  text       = {};  // for errors
+  int          line       = 0;   // in its chunk
+  bool         assignment = false;
+  bool         primitive  = false;  // if rhs is not a node
+  string_view  lhs        = {};
+  string_view  rhs        = {};
+  CsgOperation operation  = {};
+  CsgPrimitve  shape      = {};
+  string_view  source     = {};  // tree of instances, file of spheres, mesh
+  bool         include    = false;  // of the file of source as lhs
+};
 
-  auto                       fs = open_file(filename, "rb");
-  unordered_map<string, int> names;
-  std::unordered_set<string> names_used;
-  CsgParser                  parser;
-  parser.line = 1;
-  for (;; parser.line += 1) {
-    if (!read_line(fs, parser.buffer, sizeof(parser.buffer))) {
-      break;
-    }
-    auto str = string_view{parser.buffer};
+// Lexes the lines of `data` that are not blank or comments, and returns the
+// number of lines of `data`. Nothing here depends on other lines, so chunks
+// of a file are lexed in parallel.
+inline int lex_csg_lines(string_view data, vector<CsgLine>& lines) {
+  auto line = 0;
+  for (; !data.empty(); line += 1) {
+    auto end = data.find('\n');
+    auto str = data.substr(0, end);
+    data.remove_prefix(end == string_view::npos ? data.size() : end + 1);
+    auto text = str;
     skip_comment(str);
     skip_whitespace(str);
     if (str.empty()) continue;
 
-    auto   primitive = CsgPrimitve{};
-    auto   operation = CsgOperation{};
-    string lhs;
-    parse_value(str, lhs);
-    assert(lhs != "sphere");
-    assert(lhs != "cube");
+    auto& record = lines.emplace_back();
+    record.text  = text;
+    record.line  = line;
+    parse_value(str, record.lhs);
+
+    // include "part.csg" as part, checked by load_csg
+    if (record.lhs == "include") {
+      record.include = true;
+      record.lhs     = {};
+      auto as        = string_view{};
+      skip_whitespace(str);
+      if (!str.empty()) parse_value(str, record.source);
+      skip_whitespace(str);
+      if (!str.empty()) parse_value(str, as);
+      skip_whitespace(str);
+      if (as == "as" && !str.empty()) parse_value(str, record.lhs);
+      continue;
+    }
+    assert(record.lhs != "sphere");
+    assert(record.lhs != "cube");
 
     // operation
     skip_whitespace(str);
-    operation.blend = +1;
-    bool assignment = (str[0] == '=');
-    bool add        = (str[0] == '+' && str[1] == '=');
-    bool sub        = (str[0] == '-' && str[1] == '=');
-    if (!assignment && !add && !sub) {
+    record.operation.blend = +1;
+    record.assignment      = !str.empty() && str[0] == '=';
+    bool add               = str.substr(0, 2) == "+=";
+    bool sub               = str.substr(0, 2) == "-=";
+    if (!record.assignment && !add && !sub) {
       assert(0 && "Not a valid operator.");
       // @Check =, += or -=
     }
-    int parent = -1;
-
-    if (assignment) {
+    if (record.assignment) {
       str.remove_prefix(1);
       skip_whitespace(str);
-      names[lhs] = csg.nodes.size();
     } else {
-      if (parser.instructions == 0) {
-        parser_error(parser, "First edit must be an assignment.");
-      }
-
       str.remove_prefix(2);
       skip_whitespace(str);
 
-      if (names.find(lhs) == names.end()) {
-        if (names_used.count(lhs)) {
-          parser_error(parser, "Cannot modify node \"" + lhs +
-                                   "\" because it was already consumed.");
-        } else {
-          parser_error(parser, "Cannot find node named \"" + lhs + "\".");
-        }
-      } else {
-        parent = names.at(lhs);
-      }
-
       // Apply operators modifiers only on += and -=.
-      if (is_number(str[0])) {
+      auto& operation = record.operation;
+      if (!str.empty() && is_number(str[0])) {
         parse_value(str, operation.blend);
         skip_whitespace(str);
 
         operation.softness = 0;
-        if (is_number(str[0])) {
+        if (!str.empty() && is_number(str[0])) {
           parse_value(str, operation.softness);
         }
       }
       if (sub) operation.blend = -operation.blend;
     }
 
-    string rhs;
-    parse_value(str, rhs);
-    int  child = -1;
-    auto it    = names.find(rhs);
-
-    // rhs is a name or primitve
-    if (it != names.end()) {
-      // ex: lhs = rhs
-      // ex: lhs += rhs
-      child = it->second;
-      names_used.insert(rhs);
-      names.erase(it);
-    } else {
-      // ex: lhs = sphere
-      // ex: lhs += sphere
-      auto success = parse_primitive(str, primitive, rhs);
-      if (!success) {
-        parser_error(
-            parser, "Expected primitive or node name. Found: \"" + rhs + "\".");
-      }
-      if (!assignment) {
-        // ex: lhs += sphere
-        child = add_primitive(csg, primitive);
-      }
-    }
+    // rhs is a name or primitive, which is known only once lines are in order
+    parse_value(str, record.rhs);
+    if (record.rhs == "instance" || record.rhs == "mirror" ||
+        record.rhs == "repeat" || record.rhs == "spheres" ||
+        record.rhs == "mesh")
+      parse_value(str, record.source);
+    record.primitive = parse_primitive(str, record.shape, record.rhs);
+  }
+  return line;
+}
+
+inline Csg load_csg(const string& filename,
+    std::atomic<float>* progress = nullptr, bool optimize = true);
+
+// Trees of the files included by scripts, loaded once per process and kept
+// by path, so that scripts that include libraries of parts reparse only the
+// files that changed since, as told by their time and size. Files included
+// while they are loaded are cycles, found per thread.
+struct CsgIncludeCache {
+  struct entry {
+    std::filesystem::file_time_type time = {};
+    uintmax_t                       size = 0;
+    shared_ptr<const CsgTree>       tree = {};
+  };
+  std::mutex                   mutex   = {};
+  unordered_map<string, entry> entries = {};
+};
 
-    if (assignment) {
-      if (csg.nodes.empty()) csg.root = 0;
-      names[lhs] = add_primitive(csg, primitive);
-      csg.nodes.back().name = lhs;
-    } else {
-      assert(parent != -1);
-      auto backup                  = csg.nodes[parent];
-      csg.nodes[parent].operation  = operation;
-      csg.nodes[parent].children.x = csg.nodes.size();
-      csg.nodes[parent].children.y = child;
-      csg.nodes[parent].name = backup.name;
-      csg.nodes.push_back(backup);
-    }
+inline CsgIncludeCache& get_include_cache() {
+  static auto cache = CsgIncludeCache{};
+  return cache;
+}
+
+// Optimized tree of the file, from the cache if it did not change.
+inline shared_ptr<const CsgTree> include_csg(const string& filename) {
+  thread_local auto loading = vector<string>{};
+  auto path = std::filesystem::weakly_canonical(filename).string();
+  if (std::find(loading.begin(), loading.end(), path) != loading.end())
+    throw std::runtime_error{filename + ": included by itself"};
+  auto  time  = std::filesystem::last_write_time(path);
+  auto  size  = std::filesystem::file_size(path);
+  auto& cache = get_include_cache();
+  {
+    auto lock  = std::lock_guard{cache.mutex};
+    auto found = cache.entries.find(path);
+    if (found != cache.entries.end() && found->second.time == time &&
+        found->second.size == size)
+      return found->second.tree;
+  }
+  loading.push_back(path);
+  auto tree = shared_ptr<const CsgTree>{};
+  try {
+    auto csg = load_csg(path);
+    if (csg.root < 0) throw std::runtime_error{filename + ": empty tree"};
+    tree = make_shared<const CsgTree>(std::move(csg));
+  } catch (...) {
+    loading.pop_back();
+    throw;
+  }
+  loading.pop_back();
+  auto lock           = std::lock_guard{cache.mutex};
+  cache.entries[path] = {time, size, tree};
+  return tree;
+}
+
+// Loads the tree of the file, reading nothing else and writing nothing, see
+// save_tree_png for drawing it. If `progress` is given, it is set to the
+// fraction of the file lexed so far, and to 1 once the tree is optimized,
+// for loads running in the background. Trees are returned as they are read
+// if not `optimize`, with the nodes in the order of the lines, e.g. to tell
+// what optimize_csg does to them.
+//
+// The file is mapped and parsed in place, numbers are read with from_chars
+// and names are interned, see CsgNames. Chunks of the file split after
+// newlines are lexed in parallel, see lex_csg_lines, a batch at a time, then
+// the lines are read in order to look up the nodes they name and build the
+// tree, which is optimized in place.
+//
+// Lines `include "part.csg" as part` name an instance of the tree of the
+// file, relative to this one, which is shared by the instances of it, see
+// include_csg. Includes do not become the root, unless there is nothing
+// else.
+//
+// Files ending in .csgb are binary trees written by save_csgb, which are
+// loaded as they are, already optimized.
+inline Csg load_csg(
+    const string& filename, std::atomic<float>* progress, bool optimize) {
+  CSG_ZONE("load_csg");
+  auto csg = CsgTree{};
+  if (std::filesystem::path{filename}.extension() == ".csgb") {
+    if (!load_csgb(filename, csg))
+      throw std::runtime_error{filename + ": cannot read tree"};
+    if (progress) *progress = 1;
+    return csg;
+  }
 
-    if (debug_draw) {
-      save_tree_png(csg, "tree" + std::to_string(parser.instructions));
-    }
-    parser.instructions += 1;
+  auto mapping = file_mapping{};
+  map_file(mapping, filename);
+  auto chunks = vector<string_view>{};
+  for (auto data = mapping.data; !data.empty();) {
+    const auto chunk_size = (size_t)1 << 20;
+    auto       end  = data.find('\n', std::min(chunk_size, data.size()));
+    auto       size = end == string_view::npos ? data.size() : end + 1;
+    chunks.push_back(data.substr(0, size));
+    data.remove_prefix(size);
   }
+  csg.names   = make_shared<CsgNames>();
+  auto& names = *csg.names;
+  auto  nodes = vector<int>{};   // of each symbol, -1 if none
+  auto  used  = vector<bool>{};  // symbols consumed by other nodes
+  auto  named = [&](string_view name) {
+    auto symbol = find_name(names, name);
+    return symbol >= 0 ? nodes[symbol] : -1;
+  };
+  // lines add at most two nodes and optimize_csg about one more per edit,
+  // so that the nodes are not copied as they grow; pages that are not used
+  // are never touched
+  auto lines = (size_t)std::count(
+      mapping.data.begin(), mapping.data.end(), '\n');
+  csg.nodes.reserve(lines * 3 + 3);
+
+  // trees of instances, copied and optimized once per node, see subtree_csg
+  CsgParser parser;
+  auto trees     = unordered_map<int, std::shared_ptr<const CsgTree>>{};
+  auto folder    = std::filesystem::path{filename}.parent_path();
+  auto add_shape = [&](const CsgLine& record) {
+    if (record.shape.type == primitive_type::group) {
+      auto path = (folder / string{record.source}).string();
+      return add_group(csg, load_spheres(path));
+    }
+    if (record.shape.type == primitive_type::mesh) {
+      auto path = (folder / string{record.source}).string();
+      return add_mesh(csg, load_mesh(path));
+    }
+    if (record.shape.type != primitive_type::instance)
+      return add_primitive(csg, record.shape);
+    auto source = named(record.source);
+    if (source < 0) {
+      parser_error(parser,
+          "Cannot find node named \"" + string{record.source} + "\".");
+    }
+    auto& params = record.shape.params;
+    if (params[6] <= 0) parser_error(parser, "Scales must be positive.");
+    auto fold = CsgFold{};
+    for (auto k = 0; k < 3; k++) {
+      fold.mirror[k] = (int)params[7 + k];
+      fold.period[k] = params[10 + k];
+      fold.copies[k] = (int)params[13 + k];
+      if (fold.mirror[k] < 0)
+        parser_error(parser, "Mirrors take the axes x, y or z.");
+      if (fold.period[k] < 0 || fold.copies[k] < 0 ||
+          fold.copies[k] != params[13 + k] ||
+          (fold.copies[k] > 0) != (fold.period[k] > 0))
+        parser_error(parser,
+            "Repetitions take positive periods and whole copies.");
+    }
+    auto& tree = trees[source];
+    if (!tree) {
+      auto subtree = subtree_csg(csg, source);
+      optimize_csg(subtree);
+      tree = make_shared<const CsgTree>(std::move(subtree));
+    }
+    auto frame = translation_frame({params[0], params[1], params[2]}) *
+                 rotation_frame({0, 0, 1}, radians(params[5])) *
+                 rotation_frame({0, 1, 0}, radians(params[4])) *
+                 rotation_frame({1, 0, 0}, radians(params[3])) *
+                 scaling_frame({params[6], params[6], params[6]});
+    return add_instance(csg, make_instance(tree, frame, fold));
+  };
+
+  // chunks are lexed a batch at a time, so that only the lines of a batch
+  // are held next to the tree
+  auto included = false;  // the root is an include, until an assignment
+  auto batch    = 4 * pool_threads(get_pool());
+  auto records  = vector<vector<CsgLine>>(batch);
+  auto counts   = vector<int>(batch);
+  auto lexed    = std::atomic<int>{0};
+  auto first = 1;  // line of the chunk
+  for (auto start = 0; start < chunks.size(); start += batch) {
+    auto size = std::min(batch, (int)chunks.size() - start);
+    parallel_for(
+        size,
+        [&](int chunk) {
+          CSG_ZONE("lex");
+          records[chunk].clear();
+          counts[chunk] = lex_csg_lines(chunks[start + chunk], records[chunk]);
+          if (progress) *progress = (float)++lexed / chunks.size();
+        },
+        pool_priority());
+
+    CSG_ZONE("build");
+    for (auto chunk = 0; chunk < size; chunk++) {
+      for (auto& record : records[chunk]) {
+        parser.text = record.text;
+        parser.line = first + record.line;
+        auto lhs = record.lhs, rhs = record.rhs;
+
+        if (record.include) {
+          if (lhs.empty() || record.source.empty())
+            parser_error(parser,
+                "Includes take a file and a name, as in "
+                "include \"part.csg\" as part.");
+          auto symbol = intern_name(names, lhs);
+          if (symbol >= nodes.size()) {
+            nodes.resize(symbol + 1, -1);
+            used.resize(symbol + 1, false);
+          }
+          auto tree = shared_ptr<const CsgTree>{};
+          try {
+            tree = include_csg((folder / string{record.source}).string());
+          } catch (std::exception& error) {
+            parser_error(parser, error.what());
+          }
+          auto node = add_instance(
+              csg, make_instance(tree, identity3x4f, CsgFold{}));
+          csg.nodes[node].name = symbol;
+          nodes[symbol]        = node;
+          used[symbol]         = false;
+          trees[node]          = tree;  // for instances of it
+          if (csg.root < 0) {
+            csg.root = node;
+            included = true;
+          }
+          parser.instructions += 1;
+          continue;
+        }
 
-  optimize_csg(csg);
+        auto symbol = -1;
+        if (record.assignment) {
+          symbol = intern_name(names, lhs);
+          if (symbol >= nodes.size()) {
+            nodes.resize(symbol + 1, -1);
+            used.resize(symbol + 1, false);
+          }
+        } else {
+          if (parser.instructions == 0) {
+            parser_error(parser, "First edit must be an assignment.");
+          }
+
+          symbol = find_name(names, lhs);
+          if (symbol < 0 || nodes[symbol] < 0) {
+            if (symbol >= 0 && used[symbol]) {
+              parser_error(parser, "Cannot modify node \"" + string{lhs} +
+                                       "\" because it was already consumed.");
+            } else {
+              parser_error(
+                  parser, "Cannot find node named \"" + string{lhs} + "\".");
+            }
+          }
+        }
 
-  save_tree_png(csg, "tree");
-  system(("rm tree*.txt"s).c_str());
+        int child = named(rhs);
+        if (child >= 0) {
+          // ex: lhs = rhs
+          // ex: lhs += rhs
+          auto consumed   = find_name(names, rhs);
+          nodes[consumed] = -1;
+          used[consumed]  = true;
+        } else {
+          // ex: lhs = sphere
+          // ex: lhs += sphere
+          if (!record.primitive) {
+            parser_error(parser, "Expected primitive or node name. Found: \"" +
+                                     string{rhs} + "\".");
+          }
+          if (!record.assignment) {
+            // ex: lhs += sphere
+            child = add_shape(record);
+          }
+        }
+
+        // edits append an operation over the node and the child, which
+        // takes the name of the node, so that children come before parents
+        if (record.assignment) {
+          if (csg.root < 0 || included) csg.root = csg.nodes.size();
+          included              = false;
+          nodes[symbol]         = add_shape(record);
+          csg.nodes.back().name = symbol;
+        } else {
+          auto parent = nodes[symbol];
+          auto node   = add_operation(csg, record.operation, {parent, child});
+          csg.nodes[node].name = csg.nodes[parent].name;
+          if (csg.root == parent) csg.root = node;
+          nodes[symbol] = node;
+        }
 
+        parser.instructions += 1;
+      }
+      first += counts[chunk];
+    }
+  }
+  records = {};
+
+  if (optimize) {
+    CSG_ZONE("optimize");
+    optimize_csg(csg);
+  }
+  if (progress) *progress = 1;
   return csg;
 }
@@ -0,0 +1,182 @@
+#pragma once
+#include <algorithm>
+#include <vector>
+
+#include "pool.h"
+#include "raymarch.h"
+
+// Trees too large for one machine, split in space across the workers of a
+// cluster, see distribute_partition. The box of the tree is cut into a grid
+// of regions, and each region keeps the tree specialized to it, without the
+// subtrees that cannot change its values there, see specialize_csg. Regions
+// are assigned to the workers in Morton order, in runs of about the same
+// number of nodes, so that the regions of a worker are close together and
+// rays cross few workers. Each worker then compiles only the trees of its
+// regions, while the coordinator keeps the grid. Groups, meshes and
+// instances are kept whole in the regions that use them.
+//
+// Point queries are routed to the workers of the regions that hold them,
+// and points outside the box get the distance to it, which bounds the one
+// to the tree. Rays are cut into the segments they march in each region,
+// see split_ray, which the owner of the region marches with its tree, so
+// a ray goes on to the next region only once it missed in the previous one.
+// Values of the specialized trees match the tree inside their region up to
+// rounding, so they are only evaluated there.
+
+struct CsgPartition {
+  bbox3f         bounds = invalidb3f;
+  vec3i          cells  = {1, 1, 1};
+  vector<int>    owners = {};  // worker of each region
+  vector<size_t> nodes  = {};  // of the tree of each region
+  int            count  = 1;   // of workers
+};
+
+// Segment of a ray inside a region, from tmin to tmax along it.
+struct CsgSegment {
+  int   region = -1;
+  float tmin   = 0;
+  float tmax   = 0;
+};
+
+inline int region_index(const CsgPartition& partition, const vec3i& cell) {
+  auto& cells = partition.cells;
+  return (cell.z * cells.y + cell.y) * cells.x + cell.x;
+}
+
+inline bbox3f region_bounds(const CsgPartition& partition, int region) {
+  auto& cells  = partition.cells;
+  auto  cell   = vec3i{region % cells.x, region / cells.x % cells.y,
+      region / (cells.x * cells.y)};
+  auto& bounds = partition.bounds;
+  auto  size   = (bounds.max - bounds.min) /
+               vec3f{(float)cells.x, (float)cells.y, (float)cells.z};
+  auto  corner = vec3f{(float)cell.x, (float)cell.y, (float)cell.z};
+  return {bounds.min + size * corner, bounds.min + size * (corner + 1)};
+}
+
+// Region of the cell holding the point, or -1 outside the box.
+inline int region_at(const CsgPartition& partition, const vec3f& position) {
+  auto& bounds = partition.bounds;
+  auto& cells  = partition.cells;
+  auto  uvw    = (position - bounds.min) / (bounds.max - bounds.min);
+  if (min(uvw) < 0 || max(uvw) > 1) return -1;
+  auto cell = vec3i{(int)(uvw.x * cells.x), (int)(uvw.y * cells.y),
+      (int)(uvw.z * cells.z)};
+  return region_index(partition, {yocto::min(cell.x, cells.x - 1),
+                                     yocto::min(cell.y, cells.y - 1),
+                                     yocto::min(cell.z, cells.z - 1)});
+}
+
+// Bits of the coordinate, below 1024, spread to every third bit.
+inline uint32_t spread_bits(uint32_t x) {
+  x = (x | (x << 16)) & 0x030000ffu;
+  x = (x | (x << 8)) & 0x0300f00fu;
+  x = (x | (x << 4)) & 0x030c30c3u;
+  x = (x | (x << 2)) & 0x09249249u;
+  return x;
+}
+
+// Splits the box of the tree in `cells` regions for `count` workers. Trees
+// are specialized to each region, on the pool, to weigh the regions by
+// their nodes, then dropped: distribute_partition makes them again as it
+// sends them, so that they are never all held at once.
+inline CsgPartition make_partition(
+    const CsgTree& csg, const vec3i& cells, int count) {
+  if (csg.root < 0) throw std::invalid_argument{"empty tree"};
+  if (min(cells) < 1 || max(cells) > 1024 || count < 1)
+    throw std::invalid_argument{"regions and workers must be positive"};
+  auto partition   = CsgPartition{};
+  partition.bounds = csg.bounds[csg.root];
+  if (!is_bounded(partition.bounds))
+    throw std::invalid_argument{"unbounded trees cannot be partitioned"};
+  partition.cells = cells;
+  partition.count = count;
+  auto regions    = cells.x * cells.y * cells.z;
+  partition.nodes.resize(regions);
+  parallel_for(regions, [&](int region) {
+    partition.nodes[region] =
+        specialize_csg(csg, region_bounds(partition, region)).nodes.size();
+  });
+
+  // runs of regions in Morton order, cut where the nodes before them reach
+  // a multiple of the share of each worker
+  auto order = vector<pair<uint32_t, int>>(regions);
+  for (auto region = 0; region < regions; region++) {
+    auto cell     = vec3i{region % cells.x, region / cells.x % cells.y,
+        region / (cells.x * cells.y)};
+    order[region] = {spread_bits(cell.x) | (spread_bits(cell.y) << 1) |
+                         (spread_bits(cell.z) << 2),
+        region};
+  }
+  std::sort(order.begin(), order.end());
+  auto total = (size_t)0;
+  for (auto nodes : partition.nodes) total += nodes;
+  partition.owners.resize(regions);
+  auto before = (size_t)0;
+  for (auto [code, region] : order) {
+    auto share = (double)before * count / total;
+    partition.owners[region] = yocto::min((int)share, count - 1);
+    before += partition.nodes[region];
+  }
+  return partition;
+}
+
+// Indices of the points in each worker, and the ones outside the box.
+inline vector<vector<int>> route_points(const CsgPartition& partition,
+    const vector<vec3f>& points, vector<int>& outside) {
+  auto routes = vector<vector<int>>(partition.count);
+  outside.clear();
+  for (auto k = 0; k < points.size(); k++) {
+    auto region = region_at(partition, points[k]);
+    if (region < 0) {
+      outside.push_back(k);
+    } else {
+      routes[partition.owners[region]].push_back(k);
+    }
+  }
+  return routes;
+}
+
+// Segments of the ray in the regions it crosses, in order along it.
+inline vector<CsgSegment> split_ray(
+    const CsgPartition& partition, const ray3f& ray) {
+  auto segments = vector<CsgSegment>{};
+  auto tmin = 0.0f, tmax = 0.0f;
+  if (!intersect_bbox(ray, partition.bounds, tmin, tmax)) return segments;
+  // cells are found a little past the start of each segment, so past the
+  // face that the previous one ended on
+  auto& cells = partition.cells;
+  auto  size  = (partition.bounds.max - partition.bounds.min) /
+               vec3f{(float)cells.x, (float)cells.y, (float)cells.z};
+  auto  nudge = min(size) * 1e-4f;
+  for (auto t = tmin; t < tmax;) {
+    auto region = region_at(partition, ray.o + ray.d * (t + nudge));
+    if (region < 0) break;
+    auto enter = 0.0f, exit = 0.0f;
+    auto piece = ray3f{ray.o, ray.d, t, tmax};
+    if (!intersect_bbox(piece, region_bounds(partition, region), enter, exit))
+      exit = t + nudge;
+    exit = yocto::max(exit, t + nudge);
+    if (!segments.empty() && segments.back().region == region) {
+      segments.back().tmax = yocto::min(exit, tmax);
+    } else {
+      segments.push_back({region, t, yocto::min(exit, tmax)});
+    }
+    t = exit;
+  }
+  return segments;
+}
+
+// Distance along the ray of its first hit with the tape in the segment, or
+// -1 if it leaves it before, marching with the distance of the tape. Rays
+// starting inside the solid hit at the start of the segment.
+inline float march_segment(const CsgTape& tape, const ray3f& ray,
+    const CsgSegment& segment) {
+  auto t = segment.tmin;
+  for (auto step = 0; step < max_march_steps && t <= segment.tmax; step++) {
+    auto distance = eval_tape(tape, ray.o + ray.d * t) / tape.lipschitz;
+    if (distance <= 0.001f) return t;
+    t += distance;
+  }
+  return -1;
+}
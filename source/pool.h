@@ -0,0 +1,425 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+
+#include <fstream>
+#include <string>
+#endif
+
+// Worker threads started once and shared by all the parallel loops, i.e.
+// previews, progressive renders, bakes and batch evaluation, so that loops
+// do not pay for starting threads on every call. Each worker has a deque of
+// tasks per priority: workers run their newest tasks first and steal the
+// oldest tasks of the other workers when they run out, and interactive tasks
+// always run before background ones.
+//
+// The thread that starts a loop works on it too, so loops started from
+// inside tasks do not wait on busy workers. Loops are cancelled
+// cooperatively: once their flag is set they stop taking new items.
+//
+// Jobs sharing the machine, e.g. the renders of the server or the calls of
+// a Python thread, can be limited to a number of threads, see CsgJob.
+//
+// On machines with more than one NUMA node, workers are pinned to the CPUs
+// of a node each, spread like the CPUs, so that the memory they first touch
+// stays on their node, see CsgUninitialized, and read-only data can be
+// copied per node, see CsgReplicas. Nodes are read from sysfs on Linux, and
+// other systems are taken as a single node.
+
+enum struct csg_priority { interactive, background };
+
+struct CsgPool {
+  struct queue {
+    std::mutex                        mutex = {};
+    std::deque<std::function<void()>> tasks[2];
+  };
+
+  std::vector<std::thread> threads = {};
+  std::vector<int>         nodes   = {};  // of the workers
+  std::unique_ptr<queue[]> queues  = {};
+  int                      size    = 0;
+  std::mutex               mutex   = {};
+  std::condition_variable  wake    = {};
+  std::atomic<int>         pending = {0};
+  std::atomic<unsigned>    next    = {0};
+  std::atomic<int>         limit   = {0};  // threads of each loop, 0 for all
+  bool                     stop    = false;
+
+  ~CsgPool() {
+    {
+      auto lock = std::lock_guard{mutex};
+      stop      = true;
+    }
+    wake.notify_all();
+    for (auto& thread : threads) thread.join();
+  }
+};
+
+// Index of the worker running on this thread, -1 outside the pool.
+inline int& pool_worker() {
+  static thread_local auto worker = -1;
+  return worker;
+}
+
+// Priority of the loops started on this thread. Workers take the priority
+// of the task they run, so that loops nested in background work stay in the
+// background.
+inline csg_priority& pool_priority() {
+  static thread_local auto priority = csg_priority::interactive;
+  return priority;
+}
+
+// Limits of a job that shares the machine with others. The loops of the
+// job, and of the tasks it starts, ask for helpers up to `threads` threads
+// at once over all of them, counting the thread that runs the job, so that
+// nested loops share the limit. Tasks started by the job run in it but are
+// not counted, since they cannot wait for a thread. The budgets of memory
+// and time are read by the subsystems that allocate buffers and that refine
+// renders, see fits_job_memory and job_expired: renders and caches refuse
+// buffers over the memory budget, and renders stop refining once the time
+// budget is spent, keeping the samples they have.
+struct CsgJob {
+  int                                   threads = 0;  // 0 for all
+  size_t                                memory  = 0;  // bytes, 0 for any
+  double                                time    = 0;  // seconds, 0 for any
+  std::chrono::steady_clock::time_point start   = {};
+  uint64_t                              id      = 0;  // of its caches
+  std::atomic<int>                      helpers = {0};  // working on loops
+};
+
+inline std::shared_ptr<CsgJob> make_job(
+    int threads, size_t memory = 0, double time = 0) {
+  static auto next = std::atomic<uint64_t>{1};
+  auto        job  = std::make_shared<CsgJob>();
+  job->id      = next++;
+  job->threads = std::max(threads, 0);
+  job->memory  = memory;
+  job->time    = std::max(time, 0.0);
+  job->start   = std::chrono::steady_clock::now();
+  return job;
+}
+
+// Job of the calling thread, null outside jobs. Workers take the job of the
+// task they run, as they take its priority.
+inline std::shared_ptr<CsgJob>& pool_job() {
+  static thread_local auto job = std::shared_ptr<CsgJob>{};
+  return job;
+}
+
+// Runs the calling thread in the job until the scope ends.
+struct CsgJobScope {
+  explicit CsgJobScope(std::shared_ptr<CsgJob> job)
+      : previous{std::move(pool_job())} {
+    pool_job() = std::move(job);
+  }
+  ~CsgJobScope() { pool_job() = std::move(previous); }
+  CsgJobScope(const CsgJobScope&) = delete;
+  CsgJobScope& operator=(const CsgJobScope&) = delete;
+
+  std::shared_ptr<CsgJob> previous = {};
+};
+
+// Whether the time budget of the job of the calling thread is spent.
+inline bool job_expired() {
+  auto& job = pool_job();
+  if (!job || job->time <= 0) return false;
+  auto elapsed = std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - job->start);
+  return elapsed.count() > job->time;
+}
+
+// Whether buffers of `bytes` fit the memory budget of the job of the
+// calling thread.
+inline bool fits_job_memory(size_t bytes) {
+  auto& job = pool_job();
+  return !job || job->memory == 0 || bytes <= job->memory;
+}
+
+// Own tasks are taken from the back, stolen ones from the front.
+inline bool pop_task(CsgPool& pool, int worker, std::function<void()>& task,
+    csg_priority& priority) {
+  for (auto level = 0; level < 2; level++) {
+    for (auto k = 0; k < pool.size; k++) {
+      auto  index = (worker + k) % pool.size;
+      auto& queue = pool.queues[index];
+      auto  lock  = std::lock_guard{queue.mutex};
+      auto& tasks = queue.tasks[level];
+      if (tasks.empty()) continue;
+      if (index == worker) {
+        task = std::move(tasks.back());
+        tasks.pop_back();
+      } else {
+        task = std::move(tasks.front());
+        tasks.pop_front();
+      }
+      pool.pending--;
+      priority = (csg_priority)level;
+      return true;
+    }
+  }
+  return false;
+}
+
+// CPUs of each NUMA node, a single node without CPUs if unknown.
+inline const std::vector<std::vector<int>>& pool_topology() {
+  static const auto topology = [] {
+    auto nodes = std::vector<std::vector<int>>{};
+#ifdef __linux__
+    for (auto node = 0;; node++) {
+      auto file = std::ifstream{"/sys/devices/system/node/node" +
+                                std::to_string(node) + "/cpulist"};
+      if (!file) break;
+      // lists of ranges, as 0-7,16-23
+      auto cpus = std::vector<int>{};
+      auto list = std::string{};
+      std::getline(file, list);
+      for (auto pos = (size_t)0; pos < list.size();) {
+        auto end   = std::min(list.find(',', pos), list.size());
+        auto range = list.substr(pos, end - pos);
+        auto dash  = range.find('-');
+        auto first = std::stoi(range);
+        auto last  = first;
+        if (dash != std::string::npos) last = std::stoi(range.substr(dash + 1));
+        for (auto cpu = first; cpu <= last; cpu++) cpus.push_back(cpu);
+        pos = end + 1;
+      }
+      if (!cpus.empty()) nodes.push_back(std::move(cpus));
+    }
+#endif
+    if (nodes.empty()) nodes.push_back({});
+    return nodes;
+  }();
+  return topology;
+}
+
+// Pins the calling thread to the CPUs of the node, if they are known.
+inline void pin_thread(int node) {
+#ifdef __linux__
+  auto& cpus = pool_topology()[node];
+  if (cpus.empty()) return;
+  auto set = cpu_set_t{};
+  CPU_ZERO(&set);
+  for (auto cpu : cpus)
+    if (cpu < CPU_SETSIZE) CPU_SET(cpu, &set);
+  pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#endif
+}
+
+inline void run_worker(CsgPool& pool, int worker) {
+  pool_worker() = worker;
+  if (pool_topology().size() > 1) pin_thread(pool.nodes[worker]);
+  auto task     = std::function<void()>{};
+  while (true) {
+    if (pop_task(pool, worker, task, pool_priority())) {
+      task();
+      task = nullptr;
+      continue;
+    }
+    auto lock = std::unique_lock{pool.mutex};
+    pool.wake.wait(lock, [&pool] { return pool.stop || pool.pending > 0; });
+    if (pool.stop && pool.pending == 0) return;
+  }
+}
+
+inline void init_pool(CsgPool& pool, int num_threads) {
+  pool.size   = std::max(num_threads, 1);
+  pool.queues = std::make_unique<CsgPool::queue[]>(pool.size);
+  // workers take the nodes of the CPUs in order, wrapping around
+  auto& topology = pool_topology();
+  auto  cpus     = std::vector<int>{};  // nodes of the CPUs
+  for (auto node = 0; node < topology.size(); node++)
+    cpus.insert(cpus.end(), std::max(topology[node].size(), (size_t)1), node);
+  for (auto worker = 0; worker < pool.size; worker++)
+    pool.nodes.push_back(cpus[worker % cpus.size()]);
+  for (auto worker = 0; worker < pool.size; worker++)
+    pool.threads.emplace_back(run_worker, std::ref(pool), worker);
+}
+
+// Pool shared by the whole process, with a worker per hardware thread.
+inline CsgPool& get_pool() {
+  static auto pool = [] {
+    auto pool = std::make_unique<CsgPool>();
+    init_pool(*pool, (int)std::thread::hardware_concurrency());
+    return pool;
+  }();
+  return *pool;
+}
+
+// Threads that work on each loop, counting the one that starts it. Limits
+// are meant for measuring how loops scale, e.g. in csg_bench, and only
+// change how many helpers loops ask for, so workers are not stopped.
+inline int pool_threads(const CsgPool& pool) {
+  auto limit   = pool.limit.load();
+  auto threads = limit > 0 ? std::min(limit, pool.size + 1) : pool.size + 1;
+  auto& job    = pool_job();
+  return job && job->threads > 0 ? std::min(threads, job->threads) : threads;
+}
+
+inline void set_pool_threads(CsgPool& pool, int threads) {
+  pool.limit = std::max(threads, 0);
+}
+
+// Tasks started from a worker go to its own deque, the others are spread
+// over all the deques. Tasks run in the job of the thread that starts them.
+inline void submit_task(CsgPool& pool, std::function<void()> task,
+    csg_priority priority = csg_priority::interactive) {
+  if (auto& job = pool_job()) {
+    task = [job, task = std::move(task)]() {
+      auto scope = CsgJobScope{job};
+      task();
+    };
+  }
+  auto worker = pool_worker();
+  auto index  = worker >= 0 ? worker : (int)(pool.next++ % pool.size);
+  {
+    auto& queue = pool.queues[index];
+    auto  lock  = std::lock_guard{queue.mutex};
+    queue.tasks[(int)priority].push_back(std::move(task));
+  }
+  {
+    auto lock = std::lock_guard{pool.mutex};
+    pool.pending++;
+  }
+  pool.wake.notify_one();
+}
+
+// Runs `func` on the pool, like std::async without starting a thread.
+template <typename Func>
+inline std::future<void> async_task(
+    Func&& func, csg_priority priority = csg_priority::interactive) {
+  auto task   = std::make_shared<std::packaged_task<void()>>(
+      std::forward<Func>(func));
+  auto result = task->get_future();
+  submit_task(get_pool(), [task]() { (*task)(); }, priority);
+  return result;
+}
+
+// Calls `func` for each index in [0, num) on the pool and returns when all
+// the calls are done. Items are handed out one at a time from a counter, so
+// they should be large enough to amortize it. If `cancel` is set while the
+// loop runs, items that have not started are skipped.
+template <typename Func>
+inline void parallel_for(int num, Func&& func, csg_priority priority,
+    const std::atomic<bool>* cancel = nullptr) {
+  if (num <= 0) return;
+  auto& pool = get_pool();
+  if (num == 1 && !cancel) {
+    func(0);
+    return;
+  }
+
+  // helpers that start after the loop is done only read the counter, which
+  // they share, and leave
+  struct job {
+    std::atomic<int> next   = {0};
+    std::atomic<int> active = {0};
+  };
+  auto state = std::make_shared<job>();
+  auto work  = [state, num, &func, cancel]() {
+    state->active++;
+    while (true) {
+      auto i = state->next++;
+      if (i >= num) break;
+      if (cancel && *cancel) {
+        state->next = num;
+        break;
+      }
+      func(i);
+    }
+    state->active--;
+  };
+  // helpers of jobs leave if the job already has its threads, and the
+  // thread that starts the loop works on it either way
+  auto help = [work, job = pool_job()]() {
+    if (job && job->threads > 0 && job->helpers++ >= job->threads - 1) {
+      job->helpers--;
+      return;
+    }
+    work();
+    if (job && job->threads > 0) job->helpers--;
+  };
+  auto helpers = std::min(num, pool_threads(pool)) - 1;
+  for (auto helper = 0; helper < helpers; helper++)
+    submit_task(pool, help, priority);
+  work();
+  while (state->active > 0) std::this_thread::yield();
+}
+
+// Node of the worker running on this thread, 0 outside the pool.
+inline int pool_node() {
+  auto worker = pool_worker();
+  return worker >= 0 ? get_pool().nodes[worker] : 0;
+}
+
+// Allocator that leaves the values of resized vectors uninitialized, so
+// that their pages are first touched by the loops that fill them and land
+// on the nodes of their workers, rather than all on the node of the thread
+// that allocates them.
+template <typename T>
+struct CsgUninitialized : std::allocator<T> {
+  template <typename U>
+  struct rebind {
+    using other = CsgUninitialized<U>;
+  };
+  CsgUninitialized() = default;
+  template <typename U>
+  CsgUninitialized(const CsgUninitialized<U>&) {}
+
+  template <typename U>
+  void construct(U* pointer) noexcept {
+    ::new ((void*)pointer) U;
+  }
+  template <typename U, typename... Args>
+  void construct(U* pointer, Args&&... args) {
+    ::new ((void*)pointer) U(std::forward<Args>(args)...);
+  }
+};
+
+template <typename T>
+using uninitialized_vector = std::vector<T, CsgUninitialized<T>>;
+
+// Copies of read-only data per node, each first touched by a thread pinned
+// to its node, so that workers read the copy of their node. Nothing is
+// copied for a single node, and the original is used.
+template <typename T>
+struct CsgReplicas {
+  const T*                              value  = nullptr;
+  std::vector<std::unique_ptr<const T>> copies = {};  // per node
+};
+
+template <typename T>
+inline CsgReplicas<T> make_replicas(const T& value) {
+  auto replicas  = CsgReplicas<T>{};
+  replicas.value = &value;
+  auto nodes     = (int)pool_topology().size();
+  if (nodes == 1) return replicas;
+  replicas.copies.resize(nodes);
+  auto threads = std::vector<std::thread>{};
+  for (auto node = 0; node < nodes; node++) {
+    threads.emplace_back([&replicas, &value, node]() {
+      pin_thread(node);
+      replicas.copies[node] = std::make_unique<const T>(value);
+    });
+  }
+  for (auto& thread : threads) thread.join();
+  return replicas;
+}
+
+// Copy of the node of the calling thread.
+template <typename T>
+inline const T& local_replica(const CsgReplicas<T>& replicas) {
+  if (replicas.copies.empty()) return *replicas.value;
+  return *replicas.copies[pool_node()];
+}
@@ -0,0 +1,196 @@
+#pragma once
+#include <string>
+
+#include "ext/yocto-gl/yocto/yocto_math.h"
+#include "dual.h"
+#include "simd.h"
+using namespace yocto;
+
+// Registry of the primitives of the leaves. Each primitive is a struct with
+// its parameters as typed fields, read from the floats of a node or of a
+// tape with `load`, and with its distance for points, packets and duals,
+// its range over a region, its box and the kernels of the native and GPU
+// backends. The primitives are listed once in `csg_primitives`, in the
+// order of primitive_type, which is also the order of their opcodes, see
+// csg_opcode, and each backend is generated from the list: the evaluators
+// of csg.h and the tape interpreter call the distance of the struct, whose
+// parameters are known at compile time, and jit.h and glsl.h emit each
+// kernel once as a function that instructions call. A new primitive is a
+// struct, its entries in primitive_type and csg_opcode, a case of the tape
+// interpreter and its place in the list.
+//
+// Distances are written once for any value type T, on the coordinates of
+// the point, so that floats, packets and duals share them. Shapes are
+// centered at their first three parameters, so that node_param moves them
+// alike.
+
+enum struct primitive_type { sphere, box, group, instance, mesh, none };
+
+// Conservative range of values of a function over a region of space.
+struct interval {
+  float min = 0;
+  float max = 0;
+};
+
+// Sphere of a center and a radius.
+struct csg_sphere {
+  static constexpr auto type       = primitive_type::sphere;
+  static constexpr auto name       = "sphere";  // in scripts and kernels
+  static constexpr auto num_params = 4;
+
+  vec3f center = {0, 0, 0};
+  float radius = 0;
+
+  static csg_sphere load(const float* params) {
+    return {{params[0], params[1], params[2]}, params[3]};
+  }
+
+  template <typename T>
+  T eval(const T& x, const T& y, const T& z) const {
+    auto dx = x - T{center.x}, dy = y - T{center.y}, dz = z - T{center.z};
+    return yocto::sqrt(dx * dx + dy * dy + dz * dz) - T{radius};
+  }
+
+  // The nearest and the farthest points of the region bound the distance.
+  interval eval(const bbox3f& region) const {
+    auto nearest  = yocto::min(yocto::max(center, region.min), region.max);
+    auto farthest = vec3f{};
+    for (auto k = 0; k < 3; k++) {
+      auto middle = (region.min[k] + region.max[k]) / 2;
+      farthest[k] = center[k] < middle ? region.max[k] : region.min[k];
+    }
+    return {length(nearest - center) - radius,
+        length(farthest - center) - radius};
+  }
+
+  bbox3f bounds() const { return {center - radius, center + radius}; }
+
+  static constexpr auto c_kernel =
+      "  float dx = x - p[0], dy = y - p[1], dz = z - p[2];\n"
+      "  return sqrtf(dx * dx + dy * dy + dz * dz) - p[3];\n";
+  static constexpr auto glsl_kernel =
+      "  return length(q - point(o)) - param(o + 3);\n";
+};
+
+// Cube of a center and half its side, that is named cube in scripts.
+struct csg_box {
+  static constexpr auto type       = primitive_type::box;
+  static constexpr auto name       = "cube";
+  static constexpr auto num_params = 4;
+
+  vec3f center = {0, 0, 0};
+  float half   = 0;
+
+  static csg_box load(const float* params) {
+    return {{params[0], params[1], params[2]}, params[3]};
+  }
+
+  template <typename T>
+  T eval(const T& x, const T& y, const T& z) const {
+    auto qx = yocto::abs(x - T{center.x}) - T{half};
+    auto qy = yocto::abs(y - T{center.y}) - T{half};
+    auto qz = yocto::abs(z - T{center.z}) - T{half};
+    auto ox = yocto::max(qx, T{0}), oy = yocto::max(qy, T{0});
+    auto oz = yocto::max(qz, T{0});
+    return yocto::sqrt(ox * ox + oy * oy + oz * oz) +
+           yocto::min(yocto::max(qx, yocto::max(qy, qz)), T{0});
+  }
+
+  // The distance changes at most by the distance from the center of the
+  // region, since it is 1-Lipschitz.
+  interval eval(const bbox3f& region) const {
+    auto middle = (region.min + region.max) / 2;
+    auto value  = eval(middle.x, middle.y, middle.z);
+    auto radius = length(region.max - region.min) / 2;
+    return {value - radius, value + radius};
+  }
+
+  bbox3f bounds() const { return {center - half, center + half}; }
+
+  static constexpr auto c_kernel =
+      "  float qx = ab(x - p[0]) - p[3], qy = ab(y - p[1]) - p[3];\n"
+      "  float qz = ab(z - p[2]) - p[3];\n"
+      "  float ox = mx(qx, 0), oy = mx(qy, 0), oz = mx(qz, 0);\n"
+      "  return sqrtf(ox * ox + oy * oy + oz * oz) + "
+      "mn(mx(qx, mx(qy, qz)), 0);\n";
+  static constexpr auto glsl_kernel =
+      "  vec3 d = abs(q - point(o)) - param(o + 3);\n"
+      "  return length(max(d, 0.0)) + min(max(d.x, max(d.y, d.z)), 0.0);\n";
+};
+
+template <typename... Primitives>
+struct primitive_list {};
+
+using csg_primitives = primitive_list<csg_sphere, csg_box>;
+
+// Parameters of the primitive of the list with the most of them, which
+// bound the ones that nodes store and that their keys hold, see share_csg.
+template <typename... Primitives>
+constexpr int max_primitive_params(primitive_list<Primitives...>) {
+  auto count = 0;
+  ((count = Primitives::num_params > count ? Primitives::num_params : count),
+      ...);
+  return count;
+}
+
+inline constexpr auto csg_max_params = max_primitive_params(csg_primitives{});
+
+// Calls `func` with a value of each primitive of the list, in order.
+template <typename Func, typename... Primitives>
+inline void for_each_primitive(primitive_list<Primitives...>, Func&& func) {
+  (func(Primitives{}), ...);
+}
+
+template <typename Func>
+inline void for_each_primitive(Func&& func) {
+  for_each_primitive(csg_primitives{}, func);
+}
+
+// Calls `func` with a value of the primitive of the type, and returns
+// false if the type is not a primitive of the list, as groups and
+// instances. The tests fold into one comparison per primitive.
+template <typename Func, typename... Primitives>
+inline bool visit_primitive(
+    primitive_list<Primitives...>, primitive_type type, Func&& func) {
+  return ((type == Primitives::type ? (func(Primitives{}), true) : false) ||
+          ...);
+}
+
+template <typename Func>
+inline bool visit_primitive(primitive_type type, Func&& func) {
+  return visit_primitive(csg_primitives{}, type, func);
+}
+
+// Parameters of the primitive of the type, 0 for the other leaves.
+inline int primitive_params(primitive_type type) {
+  auto count = 0;
+  visit_primitive(type, [&](auto primitive) {
+    count = decltype(primitive)::num_params;
+  });
+  return count;
+}
+
+// Kernels of all the primitives, as C functions of the point and of the
+// parameters, see jit.h, that use the helpers of its source, and as GLSL
+// functions of the point and of the offset of the parameters, see glsl.h,
+// that read positions with point and other parameters with param.
+inline std::string jit_primitives_source() {
+  auto source = std::string{};
+  for_each_primitive([&](auto primitive) {
+    using P = decltype(primitive);
+    source += std::string{"static inline float "} + P::name +
+              "(float x, float y, float z, const float* p) {\n" +
+              P::c_kernel + "}\n";
+  });
+  return source;
+}
+
+inline std::string glsl_primitives_source() {
+  auto source = std::string{};
+  for_each_primitive([&](auto primitive) {
+    using P = decltype(primitive);
+    source += std::string{"float "} + P::name + "(vec3 q, int o) {\n" +
+              P::glsl_kernel + "}\n";
+  });
+  return source;
+}
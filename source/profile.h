@@ -0,0 +1,310 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <mutex>
+
+#include "grid_io.h"
+#include "raymarch.h"
+
+// Costs of the nodes of a tree during a render, to find the subtrees that
+// make it slow. The view is marched with eyelight as in raymarch, a ray per
+// pixel on the tape, counting for each node the evaluations that its bound
+// guard does not skip, and timing its instructions on one distance in
+// `period`. Times are in ns with the cost of reading the clock taken out, so
+// they are meant to compare nodes rather than as absolute costs, and the
+// gradients of the shading are left out. Nodes are those of the tree the
+// tape was compiled from, see CsgTape::nodes.
+//
+// The profile also counts, for each operation, the evaluations that its
+// second operand decided, i.e. won the min of a union or the max of a
+// subtraction, so that reorder_csg can put the operand that usually wins
+// of commutative unions first. Profiles are saved with the hash of their
+// tree, e.g. next to its .csgb, so that later sessions reorder it the same
+// way without profiling it again.
+//
+// Guards of the tape count the evaluations that reach them and the ones
+// they skip, so that its native code can be built to expect the usual
+// branch, see guard_hints. These are not saved, since they are of a tape.
+
+struct CsgProfile {
+  vector<int64_t> evals  = {};  // of each node
+  vector<double>  time    = {};  // of each node over the timed distances, ns
+  vector<int64_t> seconds = {};  // of each operation, decided by operand y
+  int64_t         points  = 0;   // distances evaluated
+  int64_t         timed   = 0;   // distances timed
+  vector<int64_t> reached = {};  // of each instruction of the tape
+  vector<int64_t> skipped = {};  // of each guard of the tape
+};
+
+// Cost of a subtree, see top_subtrees.
+struct CsgNodeCost {
+  int     node  = -1;
+  int64_t evals = 0;
+  double  self  = 0;  // ns per distance, of the node alone
+  double  total = 0;  // ns per distance, of its subtree
+};
+
+inline CsgProfile make_profile(const CsgTree& csg) {
+  auto profile  = CsgProfile{};
+  profile.evals = vector<int64_t>(csg.nodes.size(), 0);
+  profile.time    = vector<double>(csg.nodes.size(), 0);
+  profile.seconds = vector<int64_t>(csg.nodes.size(), 0);
+  return profile;
+}
+
+inline void merge_profile(CsgProfile& profile, const CsgProfile& other) {
+  for (auto i = 0; i < profile.evals.size(); i++) {
+    profile.evals[i] += other.evals[i];
+    profile.time[i] += other.time[i];
+    profile.seconds[i] += other.seconds[i];
+  }
+  profile.reached.resize(other.reached.size());
+  profile.skipped.resize(other.skipped.size());
+  for (auto i = 0; i < other.reached.size(); i++) {
+    profile.reached[i] += other.reached[i];
+    profile.skipped[i] += other.skipped[i];
+  }
+  profile.points += other.points;
+  profile.timed += other.timed;
+}
+
+// Time of reading the clock twice, the least of a few tries.
+inline double clock_overhead() {
+  using clock          = std::chrono::steady_clock;
+  static auto overhead = [] {
+    auto least = std::numeric_limits<double>::max();
+    for (auto k = 0; k < 1000; k++) {
+      auto start = clock::now();
+      auto end   = clock::now();
+      least      = std::min(least,
+          std::chrono::duration<double, std::nano>(end - start).count());
+    }
+    return least;
+  }();
+  return overhead;
+}
+
+// Whether the second operand of an operation decided its value, from the
+// values of its operands. Exact ties are left to the first one.
+inline bool second_decides(csg_opcode opcode, float f, float g) {
+  switch (opcode) {
+    case csg_opcode::union_hard:
+    case csg_opcode::union_smooth:
+    case csg_opcode::union_blend: return g < f;
+    case csg_opcode::subtract_hard:
+    case csg_opcode::subtract_smooth:
+    case csg_opcode::subtract_blend: return -g > f;
+    default: return false;
+  }
+}
+
+// Value of the tape at the point as eval_tape, adding the instructions that
+// run to the profile, and their times if `timed`. Guards add their time to
+// the node they guard, but not an evaluation, and count their skips if the
+// profile counts the instructions of the tape.
+inline float eval_tape_profiled(CsgProfile& profile, float* registers,
+    const CsgTape& tape, const vec3f& position, bool timed) {
+  using clock   = std::chrono::steady_clock;
+  auto overhead = timed ? clock_overhead() : 0.0;
+  profile.points += 1;
+  profile.timed += timed ? 1 : 0;
+  auto counted = profile.reached.size() == tape.instructions.size();
+  for (auto i = 0; i < (int)tape.instructions.size(); i++) {
+    auto& inst  = tape.instructions[i];
+    auto  node  = tape.nodes[i];
+    auto  guard = is_guard(inst.opcode);
+    if (counted) profile.reached[i] += 1;
+    // operands are read first, since the result may reuse their registers
+    auto f = registers[inst.a], g = registers[inst.b];
+    auto start = timed ? clock::now() : clock::time_point{};
+    eval_tape_range(registers, tape, position, i, i + 1);
+    if (timed) {
+      auto elapsed = std::chrono::duration<double, std::nano>(
+          clock::now() - start);
+      profile.time[node] += std::max(elapsed.count() - overhead, 0.0);
+    }
+    if (!guard) {
+      profile.evals[node] += 1;
+      profile.seconds[node] += second_decides(inst.opcode, f, g) ? 1 : 0;
+    } else if (guard_skips(registers, inst, tape.params.data(), position)) {
+      if (counted) profile.skipped[i] += 1;
+      i += inst.skip;
+    }
+  }
+  return registers[tape.instructions.back().r];
+}
+
+// Marches a ray per pixel of the view with `resolution` pixels along its
+// longest side, with the tape of the tree, timing one distance in `period`.
+inline CsgProfile profile_csg(const CsgTree& csg, const CsgTape& tape,
+    const trace_camera& camera, const march_params& march, int resolution,
+    int period = 16, uint64_t seed = 7) {
+  assert(tape.nodes.size() == tape.instructions.size());
+  auto size    = camera_size(camera, resolution);
+  auto profile = make_profile(csg);
+  auto mutex   = std::mutex{};
+  parallel_for(size.y, [&](int j) {
+    auto row       = make_profile(csg);
+    row.reached.assign(tape.instructions.size(), 0);
+    row.skipped.assign(tape.instructions.size(), 0);
+    auto rng       = make_rng(seed, j + 1);
+    auto registers = tape_registers<float>(tape);
+    auto count     = 0;
+    auto sdf       = [&](vec3f p) -> float {
+      auto timed = count++ % period == 0;
+      return eval_tape_profiled(row, registers, tape, p - vec3f(0.5), timed) /
+             tape.lipschitz;
+    };
+    for (auto i = 0; i < size.x; i++) {
+      auto ray   = sample_camera(
+          camera, {i, j}, size, rand2f(rng), rand2f(rng));
+      auto steps = 0;
+      march_eyelight(sdf, tape, nullptr, march, ray, steps);
+    }
+    auto lock = std::lock_guard{mutex};
+    merge_profile(profile, row);
+  }, pool_priority());
+  return profile;
+}
+
+// Branch hints of the guards of the tape for jit_source, from a profile of
+// it: 1 for the guards that skipped at least `bias` of the evaluations that
+// reached them, -1 for the ones that ran their subtree as often, and 0 for
+// the others and the ones reached fewer than `least` times.
+inline vector<int8_t> guard_hints(const CsgTape& tape,
+    const CsgProfile& profile, float bias = 0.9f, int64_t least = 256) {
+  auto hints = vector<int8_t>(tape.instructions.size(), 0);
+  if (profile.reached.size() != hints.size()) return hints;
+  for (auto i = 0; i < hints.size(); i++) {
+    auto reached = profile.reached[i];
+    if (!is_guard(tape.instructions[i].opcode) || reached < least) continue;
+    auto skipped = (double)profile.skipped[i] / reached;
+    if (skipped >= bias) hints[i] = 1;
+    if (skipped <= 1 - bias) hints[i] = -1;
+  }
+  return hints;
+}
+
+// Costs of the nodes and of their subtrees per distance, estimated from the
+// timed distances. Subtrees that are shared count once for each use.
+inline vector<CsgNodeCost> node_costs(
+    const CsgTree& csg, const CsgProfile& profile) {
+  auto costs = vector<CsgNodeCost>(csg.nodes.size());
+  auto scale = profile.timed ? 1.0 / profile.timed : 0.0;
+  for (auto i = 0; i < csg.nodes.size(); i++) {
+    auto& cost = costs[i];
+    cost.node  = i;
+    cost.evals = profile.evals[i];
+    cost.self  = profile.time[i] * scale;
+    cost.total = cost.self;
+    auto& children = csg.nodes[i].children;
+    if (children == vec2i{-1, -1}) continue;
+    cost.total += costs[children.x].total + costs[children.y].total;
+  }
+  return costs;
+}
+
+// The `num` costliest subtrees, without the root, costliest first.
+inline vector<CsgNodeCost> top_subtrees(
+    const CsgTree& csg, const CsgProfile& profile, int num) {
+  auto costs = node_costs(csg, profile);
+  costs.erase(costs.begin() + csg.root);
+  num = std::min(num, (int)costs.size());
+  std::partial_sort(costs.begin(), costs.begin() + num, costs.end(),
+      [](const CsgNodeCost& a, const CsgNodeCost& b) {
+        return a.total > b.total;
+      });
+  costs.resize(num);
+  return costs;
+}
+
+// Fraction of the cost of the root spent in the subtree of each node, for
+// the heat of tree_to_string.
+inline vector<float> profile_heat(
+    const CsgTree& csg, const CsgProfile& profile) {
+  auto costs = node_costs(csg, profile);
+  auto root  = costs[csg.root].total;
+  auto heat  = vector<float>(costs.size(), 0);
+  for (auto i = 0; i < costs.size(); i++)
+    heat[i] = root > 0 ? (float)(costs[i].total / root) : 0;
+  return heat;
+}
+
+// Swaps the operands of the unions whose second operand decided most of
+// their evaluations, so that the usual winner comes first, and the counts
+// of the profile with them, so that it stays the profile of the tree. Only
+// unions are swapped, hard and smooth ones, since smin is symmetric; in
+// the balanced trees of optimize_csg, this moves the usual winner of an
+// n-ary union to the front along its path. Returns the unions swapped.
+inline int reorder_csg(CsgTree& csg, CsgProfile& profile) {
+  assert(profile.seconds.size() == csg.nodes.size());
+  auto swapped = 0;
+  for (auto i = 0; i < csg.nodes.size(); i++) {
+    auto& node = csg.nodes[i];
+    if (node.children == vec2i{-1, -1} || node.operation.blend != 1) continue;
+    if (profile.seconds[i] * 2 <= profile.evals[i]) continue;
+    std::swap(node.children.x, node.children.y);
+    profile.seconds[i] = profile.evals[i] - profile.seconds[i];
+    swapped += 1;
+  }
+  if (swapped) update_hashes(csg);
+  return swapped;
+}
+
+// Header of the files of profiles, followed by the evaluations, the times
+// and the decisions of the second operands of each node.
+struct CsgProfileHeader {
+  char     magic[8] = {'c', 's', 'g', 'p', 'r', 'o', 'f', '1'};
+  uint64_t hash     = 0;  // of the tree, see hash_csg
+  uint64_t nodes    = 0;
+  int64_t  points   = 0;
+  int64_t  timed    = 0;
+};
+
+// Writes the profile of the tree and renames the file in place, as
+// save_grid_file. Returns false on errors.
+inline bool save_profile(
+    const string& filename, const CsgTree& csg, const CsgProfile& profile) {
+  auto header   = CsgProfileHeader{};
+  header.hash   = hash_csg(csg);
+  header.nodes  = csg.nodes.size();
+  header.points = profile.points;
+  header.timed  = profile.timed;
+  auto temporary = filename + ".tmp" + std::to_string(process_id());
+  auto fs        = fopen(temporary.c_str(), "wb");
+  if (!fs) return false;
+  auto n  = header.nodes;
+  auto ok = fwrite(&header, sizeof(header), 1, fs) == 1 &&
+            fwrite(profile.evals.data(), sizeof(int64_t), n, fs) == n &&
+            fwrite(profile.time.data(), sizeof(double), n, fs) == n &&
+            fwrite(profile.seconds.data(), sizeof(int64_t), n, fs) == n;
+  ok         = fclose(fs) == 0 && ok;
+  auto error = std::error_code{};
+  if (ok) std::filesystem::rename(temporary, filename, error);
+  if (!ok || error) std::filesystem::remove(temporary, error);
+  return ok && !error;
+}
+
+// Reads a profile written by save_profile. Returns false if the file cannot
+// be read or is of another tree.
+inline bool load_profile(
+    const string& filename, const CsgTree& csg, CsgProfile& profile) {
+  auto fs = fopen(filename.c_str(), "rb");
+  if (!fs) return false;
+  auto header = CsgProfileHeader{};
+  auto magic  = header;
+  auto result = make_profile(csg);
+  auto n      = (size_t)csg.nodes.size();
+  auto ok     = fread(&header, sizeof(header), 1, fs) == 1 &&
+            memcmp(header.magic, magic.magic, sizeof(magic.magic)) == 0 &&
+            header.nodes == n && header.hash == hash_csg(csg) &&
+            fread(result.evals.data(), sizeof(int64_t), n, fs) == n &&
+            fread(result.time.data(), sizeof(double), n, fs) == n &&
+            fread(result.seconds.data(), sizeof(int64_t), n, fs) == n;
+  fclose(fs);
+  if (!ok) return false;
+  result.points = header.points;
+  result.timed  = header.timed;
+  profile       = std::move(result);
+  return true;
+}
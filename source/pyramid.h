@@ -0,0 +1,116 @@
+#pragma once
+#include "pool.h"
+#include "tape.h"
+
+// Pyramid of lower bounds of the distance, for skipping empty space. Level
+// k splits the cube of the pyramid in 2^k cells per side, and each cell
+// keeps a value that the tree does not go below anywhere in it, found by
+// interval arithmetic as in sparse.h, or 0 if it may hold the surface. The
+// surface is out of the cell, and a distance changes at most as fast as the
+// points move, so a ray through the cell is farther from the surface than
+// the bound where it leaves the cell. Rays far from the surface step over
+// whole cells of the coarser levels, and evaluate the tree only near it.
+// Values of trees that change faster than the points are divided by their
+// Lipschitz bound, see eval_lipschitz.
+//
+// Cells are bounded top down. Cells whose bound is larger than their size
+// pass it to their children without bounding them, since rays already
+// cross the children in the steps of the parent.
+
+struct CsgPyramid {
+  bbox3f                bounds = {};  // a cube
+  vector<vector<float>> levels = {};  // per level, x fastest, then y and z
+};
+
+inline bbox3f pyramid_cell(
+    const CsgPyramid& pyramid, int level, const vec3i& cell) {
+  auto size = (pyramid.bounds.max.x - pyramid.bounds.min.x) / (1 << level);
+  auto min  = pyramid.bounds.min +
+             size * vec3f{(float)cell.x, (float)cell.y, (float)cell.z};
+  return {min, min + size};
+}
+
+// Bakes the pyramid over the cube around `bounds`, with `levels` levels.
+inline CsgPyramid bake_csg_pyramid(
+    const CsgTree& csg, const bbox3f& bounds, int levels = 6) {
+  assert(levels >= 1 && levels <= 8);
+  auto pyramid   = CsgPyramid{};
+  auto center    = (bounds.min + bounds.max) / 2;
+  auto half      = yocto::max(bounds.max - bounds.min) / 2;
+  pyramid.bounds = {center - half, center + half};
+  pyramid.levels.resize(levels);
+  auto lipschitz = eval_lipschitz(csg)[csg.root];
+
+  // cells of the current level to bound, the others keep their parent's
+  auto cells = vector<vec3i>{{0, 0, 0}};
+  for (auto level = 0; level < levels; level++) {
+    auto  side   = 1 << level;
+    auto  size   = 2 * half / side;
+    auto& values = pyramid.levels[level];
+    values.assign(side * side * side, 0);
+    if (level > 0) {
+      auto& parents = pyramid.levels[level - 1];
+      for (auto i = 0; i < values.size(); i++) {
+        auto x = i % side, y = (i / side) % side, z = i / (side * side);
+        auto parent = ((z / 2) * (side / 2) + y / 2) * (side / 2) + x / 2;
+        values[i]   = parents[parent];
+      }
+    }
+    parallel_for((int)cells.size(), [&](int item) {
+      thread_local auto intervals = vector<interval>{};
+      intervals.resize(csg.nodes.size());
+      auto& cell   = cells[item];
+      auto  range  = eval_csg_interval(
+          intervals, csg, pyramid_cell(pyramid, level, cell));
+      auto& value = values[(cell.z * side + cell.y) * side + cell.x];
+      value       = yocto::max(value, range.min / lipschitz);
+    }, pool_priority());
+    auto next = vector<vec3i>{};
+    for (auto& cell : cells) {
+      if (values[(cell.z * side + cell.y) * side + cell.x] >= size) continue;
+      for (auto k = 0; k < 8; k++)
+        next.push_back(cell * 2 + vec3i{k & 1, (k >> 1) & 1, k >> 2});
+    }
+    cells = std::move(next);
+  }
+  return pyramid;
+}
+
+// Distance that a ray from the point along `direction` travels before it
+// may reach the surface: to where it leaves the coarsest cell with a bound,
+// plus the bound. Returns 0 if that is less than a cell of the finest level
+// or the point is out of the pyramid. Rays that step by this do not cross
+// the surface, and neither do over-relaxed steps that it covers, see
+// march_step, since the ray is free up to it.
+inline float eval_pyramid(const CsgPyramid& pyramid, const vec3f& position,
+    const vec3f& direction) {
+  auto& bounds = pyramid.bounds;
+  if (pyramid.levels.empty() || position.x < bounds.min.x ||
+      position.y < bounds.min.y || position.z < bounds.min.z ||
+      position.x > bounds.max.x || position.y > bounds.max.y ||
+      position.z > bounds.max.z)
+    return 0;
+  auto extent = bounds.max.x - bounds.min.x;
+  auto uvw    = (position - bounds.min) / extent;
+  for (auto level = 0; level < pyramid.levels.size(); level++) {
+    auto side = 1 << level;
+    auto cell = vec3i{};
+    for (auto k = 0; k < 3; k++)
+      cell[k] = yocto::clamp((int)(uvw[k] * side), 0, side - 1);
+    auto value = pyramid.levels[level][(cell.z * side + cell.y) * side +
+                                       cell.x];
+    if (value <= 0) continue;
+    auto box  = pyramid_cell(pyramid, level, cell);
+    auto exit = flt_max;
+    for (auto k = 0; k < 3; k++) {
+      if (direction[k] > 0)
+        exit = yocto::min(exit, (box.max[k] - position[k]) / direction[k]);
+      if (direction[k] < 0)
+        exit = yocto::min(exit, (box.min[k] - position[k]) / direction[k]);
+    }
+    auto free   = yocto::max(exit, 0.0f) + value;
+    auto finest = extent / (1 << (pyramid.levels.size() - 1));
+    return free >= finest ? free : 0;
+  }
+  return 0;
+}
@@ -0,0 +1,384 @@
+#pragma once
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <thread>
+
+#include "batch.h"
+#include "grid_io.h"
+#include "memo.h"
+
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define CSG_QUERY
+#endif
+
+// Distances served to the processes of a host through shared memory, so
+// that a tree is loaded and compiled once for all the processes that query
+// it. The daemon maps a region named after the tree with a ring of slots,
+// each holding the points of a query and their distances. Clients claim a
+// free slot with a compare-and-swap, write their points in place, publish
+// the slot and wait for its state to change, so queries copy no data
+// through the kernel and make no system calls. The daemon takes the slots
+// published since its last pass and evaluates them together in parallel,
+// see eval_csg_batch, a chunk of points per task, through a memo of the
+// points queried before if it is given, see memo.h.
+//
+// Waits spin for a while, then yield, and check now and then that the
+// daemon is still running. The daemon spins on the ring and sleeps a little
+// once it has been idle for some time. Clients write their process id in
+// the slots they claim, and every second the daemon frees the ones of
+// processes that are gone, so that clients that crash do not keep them.
+//
+// Any process of the user can write the region, so the daemon keeps its
+// own copy of the layout of the ring and clamps the points of each query
+// to the ones a slot holds. Names are taken by one daemon at a time: the
+// regions of daemons that crashed must be removed, see shm_unlink, before
+// the name is served again. Only POSIX shared memory is supported.
+
+enum struct query_state : uint32_t { free, claimed, submitted, done };
+
+struct CsgQueryHeader {
+  char                  magic[8]    = {'c', 's', 'g', 'q', 'u', 'e', 'r', 'y'};
+  uint32_t              version     = 2;
+  uint32_t              num_slots   = 0;
+  uint64_t              slot_points = 0;  // largest points of a query
+  uint64_t              slot_bytes  = 0;
+  int32_t               pid         = 0;    // of the daemon
+  std::atomic<uint32_t> serving     = {0};  // cleared when the daemon stops
+  std::atomic<uint32_t> next        = {0};  // slot that clients try first
+};
+
+// Slot of the ring, followed by its points and their distances.
+struct alignas(64) CsgQuerySlot {
+  std::atomic<query_state> state = {query_state::free};
+  uint32_t                 count = 0;
+  std::atomic<int32_t>     owner = {0};  // client that claimed it, if known
+};
+
+static_assert(std::atomic<uint32_t>::is_always_lock_free &&
+                  std::atomic<int32_t>::is_always_lock_free &&
+                  std::atomic<query_state>::is_always_lock_free,
+    "shared atomics are lock free");
+
+// Region of the ring, as mapped by the daemon or a client, with the layout
+// of the header as it was when the region was made or opened.
+struct CsgQueryRegion {
+  string          name        = "";
+  void*           data        = nullptr;
+  size_t          size        = 0;
+  CsgQueryHeader* header      = nullptr;
+  bool            owner       = false;  // unlinks the region when closed
+  uint32_t        num_slots   = 0;
+  uint64_t        slot_points = 0;
+  uint64_t        slot_bytes  = 0;
+};
+
+inline string query_region_name(const string& name) {
+  return "/csg-query-" + name;
+}
+
+inline size_t query_header_bytes() {
+  return (size_t)align_offset(sizeof(CsgQueryHeader));
+}
+
+inline CsgQuerySlot& query_slot(const CsgQueryRegion& region, int slot) {
+  return *(CsgQuerySlot*)((uint8_t*)region.data + query_header_bytes() +
+                          slot * region.slot_bytes);
+}
+
+// Points of the slot, three floats each, where clients write their query.
+inline float* query_points(const CsgQueryRegion& region, int slot) {
+  return (float*)((uint8_t*)&query_slot(region, slot) + sizeof(CsgQuerySlot));
+}
+
+// Distances of the points of the slot, once it is done.
+inline float* query_distances(const CsgQueryRegion& region, int slot) {
+  return query_points(region, slot) + 3 * region.slot_points;
+}
+
+// Waits a little longer after each failed try: spinning, then yielding.
+inline void query_backoff(int& tries) {
+  if (tries++ < 1024) return;
+  std::this_thread::yield();
+}
+
+#ifdef CSG_QUERY
+
+// Whether the daemon still serves, checking that its process is there once
+// in a while, since one that crashed leaves its region as it was.
+inline bool is_serving(const CsgQueryHeader& header, int tries) {
+  if (!header.serving) return false;
+  if (tries % 65536 != 65535) return true;
+  return kill(header.pid, 0) == 0 || errno == EPERM;
+}
+
+// Closes the mapping, and removes the region if the daemon made it.
+inline void close_query_region(CsgQueryRegion& region) {
+  if (region.owner && region.header) region.header->serving = 0;
+  if (region.data) munmap(region.data, region.size);
+  if (region.owner) shm_unlink(query_region_name(region.name).c_str());
+  region = {};
+}
+
+// Whether the process is gone, so that the slots it claimed can be freed.
+inline bool is_process_gone(int32_t pid) {
+  return pid > 0 && kill(pid, 0) != 0 && errno == ESRCH;
+}
+
+// Makes the region of the daemon. Returns false with `error` set if it
+// cannot be made, or if the name is taken, by another daemon or by one that
+// crashed.
+inline bool create_query_region(CsgQueryRegion& region, const string& name,
+    int num_slots, int slot_points, string& error) {
+  auto path = query_region_name(name);
+  if (num_slots < 1 || slot_points < 1) {
+    error = path + ": slots and points must be positive";
+    return false;
+  }
+  auto fd = shm_open(path.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+  if (fd < 0 && errno == EEXIST) {
+    error = path + ": already served, or left by a daemon that crashed";
+    return false;
+  }
+  if (fd < 0) {
+    error = path + ": cannot create shared memory";
+    return false;
+  }
+  auto slot_bytes = align_offset(
+      sizeof(CsgQuerySlot) + (uint64_t)slot_points * 4 * sizeof(float));
+  auto size = query_header_bytes() + num_slots * slot_bytes;
+  auto data = ftruncate(fd, size) == 0 ? mmap(nullptr, size,
+                                             PROT_READ | PROT_WRITE,
+                                             MAP_SHARED, fd, 0)
+                                       : MAP_FAILED;
+  close(fd);
+  if (data == MAP_FAILED) {
+    shm_unlink(path.c_str());
+    error = path + ": cannot map shared memory";
+    return false;
+  }
+  region = {name, data, size, new (data) CsgQueryHeader{}, true,
+      (uint32_t)num_slots, (uint64_t)slot_points, slot_bytes};
+  auto& header = *region.header;
+  header.num_slots   = num_slots;
+  header.slot_points = slot_points;
+  header.slot_bytes  = slot_bytes;
+  header.pid         = process_id();
+  for (auto slot = 0; slot < num_slots; slot++)
+    new (&query_slot(region, slot)) CsgQuerySlot{};
+  header.serving = 1;
+  return true;
+}
+
+// Maps the region of the daemon serving `name`. Returns false with `error`
+// set if there is none or it does not match.
+inline bool open_query_region(
+    CsgQueryRegion& region, const string& name, string& error) {
+  auto path = query_region_name(name);
+  auto fd   = shm_open(path.c_str(), O_RDWR, 0);
+  if (fd < 0) {
+    error = path + ": no daemon serves it";
+    return false;
+  }
+  struct stat info;
+  auto        data = fstat(fd, &info) == 0 &&
+                     info.st_size >= (off_t)query_header_bytes()
+                         ? mmap(nullptr, info.st_size, PROT_READ | PROT_WRITE,
+                               MAP_SHARED, fd, 0)
+                         : MAP_FAILED;
+  close(fd);
+  if (data == MAP_FAILED) {
+    error = path + ": cannot map shared memory";
+    return false;
+  }
+  region       = {name, data, (size_t)info.st_size, (CsgQueryHeader*)data};
+  auto& header       = *region.header;
+  auto  check        = CsgQueryHeader{};
+  auto  slots_size   = region.size - query_header_bytes();
+  region.num_slots   = header.num_slots;
+  region.slot_points = header.slot_points;
+  region.slot_bytes  = header.slot_bytes;
+  if (memcmp(header.magic, check.magic, sizeof(check.magic)) != 0 ||
+      header.version != check.version || region.num_slots < 1 ||
+      region.slot_points > slots_size / (4 * sizeof(float)) ||
+      region.slot_bytes <
+          sizeof(CsgQuerySlot) + region.slot_points * 4 * sizeof(float) ||
+      region.slot_bytes % 64 ||
+      region.num_slots > slots_size / region.slot_bytes) {
+    close_query_region(region);
+    error = path + ": not a query region";
+    return false;
+  }
+  return true;
+}
+
+#else
+
+inline bool is_serving(const CsgQueryHeader& header, int tries) {
+  return header.serving;
+}
+
+inline bool is_process_gone(int32_t pid) { return false; }
+
+inline void close_query_region(CsgQueryRegion& region) { region = {}; }
+
+inline bool create_query_region(CsgQueryRegion& region, const string& name,
+    int num_slots, int slot_points, string& error) {
+  error = "queries need POSIX shared memory";
+  return false;
+}
+
+inline bool open_query_region(
+    CsgQueryRegion& region, const string& name, string& error) {
+  error = "queries need POSIX shared memory";
+  return false;
+}
+
+#endif
+
+// Claims a free slot for a query, waiting for one if they are all taken.
+// Returns -1 if the daemon stopped.
+inline int claim_query_slot(const CsgQueryRegion& region) {
+  auto& header = *region.header;
+  auto  tries  = 0;
+  while (is_serving(header, tries)) {
+    auto first = header.next.fetch_add(1, std::memory_order_relaxed);
+    for (auto k = 0u; k < region.num_slots; k++) {
+      auto  slot     = (int)((first + k) % region.num_slots);
+      auto  expected = query_state::free;
+      auto& entry    = query_slot(region, slot);
+      if (entry.state.load(std::memory_order_relaxed) == expected &&
+          entry.state.compare_exchange_strong(expected, query_state::claimed,
+              std::memory_order_acquire)) {
+        entry.owner.store(process_id(), std::memory_order_relaxed);
+        return slot;
+      }
+    }
+    query_backoff(tries);
+  }
+  return -1;
+}
+
+// Publishes the `count` points written to the slot and waits for their
+// distances, which stay in the slot until it is released. Returns false if
+// the daemon stopped first.
+inline bool run_query_slot(
+    const CsgQueryRegion& region, int slot, int count) {
+  auto& header = *region.header;
+  auto& entry  = query_slot(region, slot);
+  assert(count >= 0 && count <= region.slot_points);
+  entry.count = count;
+  entry.state.store(query_state::submitted, std::memory_order_release);
+  auto tries = 0;
+  while (entry.state.load(std::memory_order_acquire) != query_state::done) {
+    if (!is_serving(header, tries)) return false;
+    query_backoff(tries);
+  }
+  return true;
+}
+
+inline void release_query_slot(const CsgQueryRegion& region, int slot) {
+  auto& entry = query_slot(region, slot);
+  entry.owner.store(0, std::memory_order_relaxed);
+  entry.state.store(query_state::free, std::memory_order_release);
+}
+
+// Frees the slots that clients claimed and did not release before they
+// were gone. Slots are only written by their owner until it frees them, so
+// the ones of gone owners are only freed here.
+inline void reclaim_query_slots(const CsgQueryRegion& region) {
+  for (auto slot = 0; slot < (int)region.num_slots; slot++) {
+    auto& entry = query_slot(region, slot);
+    auto  state = entry.state.load(std::memory_order_acquire);
+    if (state != query_state::claimed && state != query_state::done)
+      continue;
+    if (!is_process_gone(entry.owner.load(std::memory_order_relaxed)))
+      continue;
+    entry.owner.store(0, std::memory_order_relaxed);
+    entry.state.compare_exchange_strong(
+        state, query_state::free, std::memory_order_release);
+  }
+}
+
+// Distances at the points, copied through as many slots as needed. Returns
+// false if the daemon stopped first.
+inline bool query_csg(const CsgQueryRegion& region, span<const vec3f> points,
+    span<float> out) {
+  assert(points.size() == out.size());
+  auto chunk = (size_t)region.slot_points;
+  for (auto begin = (size_t)0; begin < points.size(); begin += chunk) {
+    auto count = std::min(chunk, points.size() - begin);
+    auto slot  = claim_query_slot(region);
+    if (slot < 0) return false;
+    memcpy(query_points(region, slot), points.data() + begin,
+        count * sizeof(vec3f));
+    auto ok = run_query_slot(region, slot, (int)count);
+    if (ok)
+      memcpy(out.data() + begin, query_distances(region, slot),
+          count * sizeof(float));
+    release_query_slot(region, slot);
+    if (!ok) return false;
+  }
+  return true;
+}
+
+// Serves the queries of the clients with the tape until `stop` is set,
+// through the memo if given, with the version of the tree of the tape.
+inline void serve_queries(const CsgQueryRegion& region, const CsgTape& tape,
+    const std::atomic<bool>& stop, int chunk_size = 4096,
+    CsgMemo* memo = nullptr, uint64_t version = 0) {
+  auto kernel    = get_kernel().eval;
+  auto items     = vector<pair<int, int>>{};  // slot and first point
+  auto slots     = vector<int>{};
+  auto counts    = vector<int>(region.num_slots, 0);  // read once per query
+  auto idle      = 0;
+  auto reclaimed = get_time();
+  while (!stop) {
+    if (get_time() - reclaimed > 1000000000) {
+      reclaim_query_slots(region);
+      reclaimed = get_time();
+    }
+    slots.clear();
+    items.clear();
+    for (auto slot = 0; slot < (int)region.num_slots; slot++) {
+      auto& entry = query_slot(region, slot);
+      if (entry.state.load(std::memory_order_acquire) !=
+          query_state::submitted)
+        continue;
+      slots.push_back(slot);
+      counts[slot] = (int)std::min((uint64_t)entry.count, region.slot_points);
+      for (auto begin = 0; begin < counts[slot]; begin += chunk_size)
+        items.push_back({slot, begin});
+    }
+    if (slots.empty()) {
+      if (++idle > 65536)
+        std::this_thread::sleep_for(std::chrono::microseconds(50));
+      else if (idle > 1024)
+        std::this_thread::yield();
+      continue;
+    }
+    idle = 0;
+    parallel_for((int)items.size(), [&](int item) {
+      auto [slot, begin] = items[item];
+      auto count = yocto::min(counts[slot] - begin, chunk_size);
+      auto points    = (const vec3f*)query_points(region, slot) + begin;
+      auto distances = query_distances(region, slot) + begin;
+      if (memo) {
+        auto options     = CsgBatchOptions{};
+        options.parallel = false;
+        eval_csg_memo(*memo, tape, version, {points, (size_t)count},
+            {distances, (size_t)count}, options);
+      } else {
+        kernel(tape, points, distances, count);
+      }
+    }, pool_priority());
+    for (auto slot : slots)
+      query_slot(region, slot).state.store(
+          query_state::done, std::memory_order_release);
+  }
+}
@@ -0,0 +1,74 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <thread>
+
+// Bounded queue of values pushed by any thread and popped by a single one,
+// without locks [Vyukov 2010]. Each slot has a sequence number telling
+// whose turn it is: producers claim the slot at the tail with a
+// compare-and-swap, write it and publish it by bumping its sequence, and the
+// consumer reads the slot at the head once it is published and hands it
+// back to the producers of the next round. Values are copied in place, so
+// pushes do not allocate.
+
+template <typename T, size_t N>
+struct CsgQueue {
+  static_assert(N && (N & (N - 1)) == 0, "the capacity is a power of two");
+
+  struct slot {
+    std::atomic<size_t> sequence = {0};
+    T                   value    = {};
+  };
+
+  std::array<slot, N> slots = {};
+  alignas(64) std::atomic<size_t> tail = {0};  // of the producers
+  alignas(64) size_t head = 0;                 // of the consumer
+
+  CsgQueue() {
+    for (auto k = (size_t)0; k < N; k++) slots[k].sequence = k;
+  }
+};
+
+// Pushes a copy of `value`, or returns false if the queue is full.
+template <typename T, size_t N>
+inline bool try_push(CsgQueue<T, N>& queue, const T& value) {
+  auto position = queue.tail.load(std::memory_order_relaxed);
+  while (true) {
+    auto& slot     = queue.slots[position & (N - 1)];
+    auto  sequence = slot.sequence.load(std::memory_order_acquire);
+    auto  turn     = (ptrdiff_t)sequence - (ptrdiff_t)position;
+    if (turn == 0) {
+      if (queue.tail.compare_exchange_weak(
+              position, position + 1, std::memory_order_relaxed)) {
+        slot.value = value;
+        slot.sequence.store(position + 1, std::memory_order_release);
+        return true;
+      }
+    } else if (turn < 0) {
+      return false;  // the consumer has not popped the slot yet
+    } else {
+      position = queue.tail.load(std::memory_order_relaxed);
+    }
+  }
+}
+
+// Pushes a copy of `value`, waiting for the consumer if the queue is full.
+// The consumer must not push to a full queue, since it would wait on itself.
+template <typename T, size_t N>
+inline void push(CsgQueue<T, N>& queue, const T& value) {
+  while (!try_push(queue, value)) std::this_thread::yield();
+}
+
+// Pops the oldest value into `value`, or returns false if there is none.
+// Only one thread may pop.
+template <typename T, size_t N>
+inline bool try_pop(CsgQueue<T, N>& queue, T& value) {
+  auto& slot     = queue.slots[queue.head & (N - 1)];
+  auto  sequence = slot.sequence.load(std::memory_order_acquire);
+  if (sequence != queue.head + 1) return false;
+  value = slot.value;
+  slot.sequence.store(queue.head + N, std::memory_order_release);
+  queue.head += 1;
+  return true;
+}
@@ -0,0 +1,172 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <memory>
+
+#include "csg.h"
+
+// Cache of the light that paths gather past their first bounce, kept in the
+// space of the tree so that the paths of nearby pixels, of later samples
+// and of other views take it instead of tracing it again [Binder et al.
+// 2019]. Points of the surface are hashed to cells of side `cell`, with one
+// cell for each direction of the normal along the axes, so that the two
+// sides of thin walls are kept apart. Each cell sums the light leaving its
+// points toward the paths, the direct light and the rest of their bounces;
+// the material is mostly diffuse, so this is taken as the same in all
+// directions. Points are jittered by up to half a cell before hashing, so
+// that the cells average into each other rather than showing as blocks.
+//
+// Paths read a cell once it has `min_samples` samples, and trace on with
+// probability `refresh`, adding to it, so that cells keep converging. The
+// light of a cell is from paths of `bounces` hits, and caches are cleared
+// when the hits of the paths change. Cells are slots of an open addressing
+// table of fixed size, with atomic keys and sums, so that tiles fill it in
+// parallel without locks; points that find no free slot are traced.
+//
+// Edits of the tree clear the cells near the regions they changed, up to
+// `reach`, see clear_radiance: light bounced at farther points changes too,
+// but less. Caches must not be cleared while paths read them.
+
+struct CsgRadianceCell {
+  std::atomic<uint64_t> key    = 0;  // 0 for free slots, see radiance_key
+  std::atomic<uint32_t> count  = 0;
+  std::atomic<float>    sum[3] = {};
+};
+
+struct CsgRadianceCache {
+  float cell        = 1.0f / 128;
+  int   min_samples = 8;
+  float refresh     = 0.125f;
+  float reach       = 0.1f;  // of the edits, see clear_radiance
+  int   bounces     = 0;     // of the paths of the light
+
+  std::unique_ptr<CsgRadianceCell[]> cells = {};
+  size_t                             mask  = 0;  // of the slot indices
+};
+
+// Cache with 2^`bits` slots and cells of side `cell`.
+inline std::shared_ptr<CsgRadianceCache> make_radiance_cache(
+    float cell = 1.0f / 128, int bits = 20) {
+  if (cell <= 0 || bits < 4 || bits > 30)
+    throw std::invalid_argument{"invalid radiance cache"};
+  auto cache   = std::make_shared<CsgRadianceCache>();
+  cache->cell  = cell;
+  cache->cells = std::make_unique<CsgRadianceCell[]>((size_t)1 << bits);
+  cache->mask  = ((size_t)1 << bits) - 1;
+  return cache;
+}
+
+// Key of the cell of the point and of the direction of the normal: 20 bits
+// for each coordinate of the cell, counted from -8 on each axis, and 3 for
+// the direction, below a bit that keeps keys of points from 0.
+inline uint64_t radiance_key(
+    const CsgRadianceCache& cache, const vec3f& position, const vec3f& normal) {
+  auto axis = 0;
+  for (auto k = 1; k < 3; k++)
+    if (std::abs(normal[k]) > std::abs(normal[axis])) axis = k;
+  auto key = (uint64_t)1;
+  for (auto k = 0; k < 3; k++) {
+    auto index = (int64_t)std::floor((position[k] + 8) / cache.cell);
+    key = (key << 20) | (uint64_t)std::clamp(index, (int64_t)0,
+                                     (int64_t)(1 << 20) - 1);
+  }
+  return (key << 3) | (uint64_t)(axis * 2 + (normal[axis] < 0 ? 1 : 0));
+}
+
+// Box of the cell of the key, in the space of the tree.
+inline bbox3f radiance_bounds(const CsgRadianceCache& cache, uint64_t key) {
+  auto min = vec3f{};
+  for (auto k = 0; k < 3; k++)
+    min[k] = ((key >> (3 + 20 * (2 - k))) & ((1 << 20) - 1)) * cache.cell - 8;
+  return {min, min + cache.cell};
+}
+
+// Slot of the cell of the key, taken if it is not in the table yet and
+// `insert` is set. Returns nullptr if the cell is missing, or if the slots
+// it may take are all taken by others.
+inline CsgRadianceCell* radiance_cell(
+    CsgRadianceCache& cache, uint64_t key, bool insert) {
+  auto index = mix_hash((uint64_t)0, key);
+  for (auto probe = 0; probe < 16; probe++) {
+    auto& slot  = cache.cells[(index + probe) & cache.mask];
+    auto  found = slot.key.load(std::memory_order_acquire);
+    if (found == key) return &slot;
+    if (found != 0) continue;
+    if (!insert) return nullptr;
+    if (slot.key.compare_exchange_strong(found, key)) return &slot;
+    if (found == key) return &slot;
+  }
+  return nullptr;
+}
+
+// Slot of the point of the surface, jittered with the generator of its path.
+inline CsgRadianceCell* radiance_cell(CsgRadianceCache& cache,
+    const vec3f& position, const vec3f& normal, rng_state& rng) {
+  auto jittered = position + (rand3f(rng) - 0.5f) * cache.cell;
+  return radiance_cell(cache, radiance_key(cache, jittered, normal), true);
+}
+
+// Light of the cell, if it has enough samples and the path does not trace
+// on to refresh it.
+inline bool read_radiance(const CsgRadianceCache& cache,
+    const CsgRadianceCell& cell, rng_state& rng, vec3f& radiance) {
+  auto count = cell.count.load(std::memory_order_relaxed);
+  if (count < cache.min_samples || rand1f(rng) < cache.refresh) return false;
+  for (auto k = 0; k < 3; k++)
+    radiance[k] = cell.sum[k].load(std::memory_order_relaxed) / count;
+  return true;
+}
+
+inline void add_radiance(CsgRadianceCell& cell, const vec3f& radiance) {
+  for (auto k = 0; k < 3; k++) {
+    auto& sum = cell.sum[k];
+    auto  old = sum.load(std::memory_order_relaxed);
+    while (!sum.compare_exchange_weak(
+        old, old + radiance[k], std::memory_order_relaxed)) {
+    }
+  }
+  cell.count.fetch_add(1, std::memory_order_relaxed);
+}
+
+// Empties all the cells.
+inline void clear_radiance(CsgRadianceCache& cache) {
+  for (auto slot = (size_t)0; slot <= cache.mask; slot++) {
+    auto& cell = cache.cells[slot];
+    cell.key.store(0, std::memory_order_relaxed);
+    cell.count.store(0, std::memory_order_relaxed);
+    for (auto& sum : cell.sum) sum.store(0, std::memory_order_relaxed);
+  }
+}
+
+// Empties the cache if its light is from paths of other hits.
+inline void match_radiance(CsgRadianceCache& cache, int bounces) {
+  if (cache.bounces == bounces) return;
+  clear_radiance(cache);
+  cache.bounces = bounces;
+}
+
+// Empties the cells within `reach` of the regions, in the space of the
+// tree, e.g. the ones of changed_regions, or all of them if a region is
+// unbounded. Cells keep their slots, so that their points fill them again.
+inline void clear_radiance(
+    CsgRadianceCache& cache, const vector<bbox3f>& regions) {
+  for (auto& region : regions)
+    if (!is_bounded(region)) return clear_radiance(cache);
+  if (regions.empty()) return;
+  for (auto slot = (size_t)0; slot <= cache.mask; slot++) {
+    auto& cell = cache.cells[slot];
+    auto  key  = cell.key.load(std::memory_order_relaxed);
+    if (key == 0) continue;
+    auto bounds = radiance_bounds(cache, key);
+    for (auto& region : regions) {
+      auto near = bbox3f{region.min - cache.reach, region.max + cache.reach};
+      if (near.min.x > bounds.max.x || near.min.y > bounds.max.y ||
+          near.min.z > bounds.max.z || bounds.min.x > near.max.x ||
+          bounds.min.y > near.max.y || bounds.min.z > near.max.z)
+        continue;
+      cell.count.store(0, std::memory_order_relaxed);
+      for (auto& sum : cell.sum) sum.store(0, std::memory_order_relaxed);
+      break;
+    }
+  }
+}
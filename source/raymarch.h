@@ -0,0 +1,2237 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+
+#include "ext/yocto-gl/yocto/yocto_trace.h"
+#include "grid.h"
+#include "jit.h"
+#include "pyramid.h"
+#include "radiance.h"
+#include "tape.h"
+#include "tiles.h"
+
+// Sphere tracing of the tape and progressive rendering of images with
+// eyelight, shared by the viewer and by csg_render, which renders without a
+// window.
+
+// Sphere tracing options. With a relaxation above 1, steps are scaled by it
+// and a step is taken back when the spheres of two consecutive points do
+// not overlap, since the surface may lie between them. Marching goes on
+// with plain steps from there [Keinert et al. 2014].
+//
+// With a footprint, rays stop when the distance is below the size of a pixel
+// at the point, and the hit is refined by secant steps once a sign change
+// brackets the surface, so rays do not take many small steps near it.
+//
+// Distances are divided by the Lipschitz bound of the tape that gives them,
+// see eval_lipschitz, which is 1 unless blends go beyond a full operation.
+//
+// With bounces, hits are path traced instead of shaded by eyelight, see
+// pathtrace. False colors replace the shading by the cost of the pixels,
+// see march_falsecolor.
+enum struct march_falsecolor {
+  none,
+  steps,      // march steps of the camera ray
+  evals,      // distances evaluated for the pixel, with its shading
+  exhausted,  // gray eyelight, red where rays run out of steps
+};
+
+inline const auto march_falsecolor_names = vector<string>{
+    "none", "steps", "evals", "exhausted"};
+
+// Sequences of the positions of the camera rays in their pixels and on the
+// lens: independent random numbers from the generator of each pixel, or
+// Owen scrambled Sobol points indexed by the sample, see sobol_sample, whose
+// strata cover the pixel evenly at every count, so edges converge faster.
+// Sobol points take no state, so split and distributed samples are the
+// same as in one render.
+enum struct march_sampler { random, sobol };
+
+inline const auto march_sampler_names = vector<string>{"random", "sobol"};
+
+// Material of the hits and direction toward the light, of eyelight and of
+// the paths. The viewer edits them, and relights its frames without
+// marching them again, see relight_samples.
+struct CsgShading {
+  vec3f light     = {0.2, 1, 0};  // normalized when shading
+  vec3f diffuse   = {0.9, 0.3, 0.2};
+  vec3f specular  = {0.04, 0.04, 0.04};
+  float roughness = 0.2;
+};
+
+inline bool operator==(const CsgShading& a, const CsgShading& b) {
+  return a.light == b.light && a.diffuse == b.diffuse &&
+         a.specular == b.specular && a.roughness == b.roughness;
+}
+inline bool operator!=(const CsgShading& a, const CsgShading& b) {
+  return !(a == b);
+}
+
+// Steps after which rays give up, see march_event::exhausted.
+inline const auto max_march_steps = 1000;
+
+// Hit distance and steps of approximate marches, see march_params.
+inline const auto approximate_epsilon = 0.004;
+inline const auto approximate_steps   = 128;
+
+struct march_params {
+  float            relaxation  = 1;  // 1 for plain sphere tracing
+  float            footprint   = 0;  // pixel size per unit of distance, 0 for
+                                     // a fixed epsilon
+  bbox3f           bounds      = {{0, 0, 0}, {1, 1, 1}};  // clipped to scene
+  int              bounces     = 0;  // hits of the paths, 0 for eyelight
+  march_falsecolor falsecolor  = march_falsecolor::none;
+  float            lod         = 0;  // width of the simplified features per
+                                     // unit of distance, see lod_tape
+  march_sampler    sampler     = march_sampler::random;  // of camera rays
+  bool             wavefront   = false;  // see raymarch_wavefront
+  bool             approximate = false;  // hits within approximate_epsilon,
+                                         // in approximate_steps
+  CsgShading       shading     = {};
+  const std::atomic<bool>* cancel   = nullptr;  // see is_cancelled
+  CsgRadianceCache*        radiance = nullptr;  // of the paths, see radiance.h
+};
+
+// Whether the marches were cancelled. Packets check it at each step, and
+// paths at each step of their rays, so that a render stops within a step
+// of its rays instead of at the end of its tiles, however costly they are.
+inline bool is_cancelled(const march_params& march) {
+  return march.cancel && march.cancel->load(std::memory_order_relaxed);
+}
+
+// Tape of the level of detail of points at `distance` from the camera: the
+// coarsest whose features are narrower than the width of the rays there, or
+// the tape itself without levels. Only the rays of eyelight are simplified,
+// and hits are shaded with the tape.
+inline const CsgTape& lod_tape(
+    const CsgTape& tape, const march_params& march, float distance) {
+  if (!tape.lods || march.lod <= 0) return tape;
+  auto  width  = march.lod * distance;
+  auto& lods   = *tape.lods;
+  auto  result = &tape;
+  for (auto level = 0; level < lods.sizes.size(); level++)
+    if (lods.sizes[level] <= width) result = &lods.tapes[level];
+  return *result;
+}
+
+// Whether the pixels are path traced, which false colors of the camera rays
+// skip.
+inline bool is_pathtraced(const march_params& march) {
+  return march.bounces > 0 && (march.falsecolor == march_falsecolor::none ||
+                                  march.falsecolor == march_falsecolor::evals);
+}
+
+// Rays and distance evaluations, to compare marching modes.
+struct march_stats {
+  std::atomic<int64_t> rays  = {0};
+  std::atomic<int64_t> steps = {0};
+};
+
+// Distances that the rays of each block of pixels can skip, see cone_march,
+// and the distances of the first hits of each pixel, that later samples
+// start from, see march_start. Rays that escaped the box keep the distance
+// where they left it, negated, rays that missed it keep 0 and pixels not
+// traced yet keep flt_max. Rays also skip the distance to the boxes of the
+// tree that their pixel covers, see proxy_march.
+struct march_starts {
+  int           block    = 4;
+  vec2i         size     = {0, 0};  // in blocks
+  vector<float> distance = {};
+  vec2i         image    = {0, 0};  // in pixels
+  vector<float> depth    = {};
+  vector<float> proxy    = {};  // per pixel, of size * block
+};
+
+// Passes of a camera ray, for compositing: the distance of its hit from the
+// camera, the normal there, the node of its primitive, see label.h, and the
+// steps it marched. Rays that miss keep flt_max, a zero normal and -1.
+struct march_aov {
+  float depth  = flt_max;
+  vec3f normal = {0, 0, 0};
+  float node   = -1;
+  float steps  = 0;
+};
+
+// Images of the passes of the first sample of each pixel. Only the ones
+// that are not empty are written, see init_aovs.
+struct march_aovs {
+  image<float> depth  = {};
+  image<vec3f> normal = {};
+  image<float> node   = {};
+  image<float> steps  = {};
+};
+
+inline const auto march_aov_names = vector<string>{
+    "depth", "normal", "id", "steps"};
+
+// Allocates the images of the passes named in `names`, see march_aov_names,
+// returns false on unknown names.
+inline bool init_aovs(march_aovs& aovs, const vec2i& size,
+    const vector<string>& names, string& error) {
+  aovs = {};
+  for (auto& name : names) {
+    if (name == "depth") {
+      aovs.depth = image{size, flt_max};
+    } else if (name == "normal") {
+      aovs.normal = image{size, vec3f{0, 0, 0}};
+    } else if (name == "id") {
+      aovs.node = image{size, -1.0f};
+    } else if (name == "steps") {
+      aovs.steps = image{size, 0.0f};
+    } else {
+      error = "unknown pass " + name;
+      return false;
+    }
+  }
+  return true;
+}
+
+inline bool is_valid(const march_aovs& aovs) {
+  return !aovs.depth.empty() || !aovs.normal.empty() || !aovs.node.empty() ||
+         !aovs.steps.empty();
+}
+
+// Range of the ray inside the box, returns false if it misses it.
+inline bool intersect_bbox(
+    const ray3f& ray, const bbox3f& bbox, float& tmin, float& tmax) {
+  auto invd = 1.0f / ray.d;
+  auto t0   = (bbox.min - ray.o) * invd;
+  auto t1   = (bbox.max - ray.o) * invd;
+  if (invd.x < 0.0f) swap(t0.x, t1.x);
+  if (invd.y < 0.0f) swap(t0.y, t1.y);
+  if (invd.z < 0.0f) swap(t0.z, t1.z);
+  tmin = max(t0.z, max(t0.y, max(t0.x, ray.tmin)));
+  tmax = min(t1.z, min(t1.y, min(t1.x, ray.tmax)));
+  return tmin <= tmax;
+}
+
+// Shadows of the light of eyelight and ambient occlusion, baked at the
+// corners of a grid a cell off the surface, where hits read them, see
+// bake_lighting. Volumes are low resolution, since both vary slowly, and
+// shading a hit reads them instead of marching more rays.
+struct CsgLighting {
+  CsgGrid shadow    = {};  // light reaching the point, from 0 to 1
+  CsgGrid occlusion = {};  // sky seen from the point, from 0 to 1
+  vec3f   light     = {0.2, 1, 0};  // of the shadows, see CsgShading
+};
+
+// Shadow and occlusion of a hit point with its normal, from the volume of
+// the tape, or 1 without one.
+inline vec2f eval_lighting(
+    const CsgTape& tape, const vec3f& position, const vec3f& normal) {
+  if (!tape.lighting) return {1, 1};
+  auto& lighting = *tape.lighting;
+  auto& bounds   = lighting.shadow.bounds;
+  auto  p        = position - vec3f(0.5) +
+           normal * grid_cell(lighting.shadow).x;
+  p = min(max(p, bounds.min), bounds.max);
+  return {eval_grid(lighting.shadow, p), eval_grid(lighting.occlusion, p)};
+}
+
+// Shading of a hit point with its normal, seen along `direction`, with the
+// shadow of the light and the occlusion of the ambient term given by `lit`,
+// see eval_lighting.
+inline vec3f shade_hit(const CsgShading& shading, const vec3f& normal,
+    const vec3f& direction, const vec2f& lit = {1, 1}) {
+  auto material      = material_point{};
+  material.diffuse   = shading.diffuse;
+  material.specular  = shading.specular;
+  material.roughness = shading.roughness;
+
+  auto light    = normalize(shading.light);
+  auto clr      = vec3f{1, 1, 1};
+  auto ambient  = min((normal.y + 1) * 0.1f, 0.1f);
+  auto radiance = vec3f(0);
+  radiance += clr * eval_brdfcos(material, normal, -direction, light) * lit.x;
+  radiance += ambient * material.diffuse * lit.y;
+  return radiance;
+}
+
+// As shade_hit, with the default shading but for the diffuse color.
+inline vec3f eyelight(const vec3f& normal, const ray3f& ray,
+    const vec3f& diffuse = {0.9, 0.3, 0.2}, const vec2f& lit = {1, 1}) {
+  auto shading    = CsgShading{};
+  shading.diffuse = diffuse;
+  return shade_hit(shading, normal, ray.d, lit);
+}
+
+// Normal at a hit point of the tape, or of the grid if there is one.
+inline vec3f hit_normal(
+    const CsgTape& tape, const CsgGrid* grid, const vec3f& position) {
+  auto p    = position - vec3f(0.5);
+  auto grad = grid ? eval_grid_grad(*grid, p) : eval_tape_grad(tape, p).grad;
+  return normalize(grad);
+}
+
+// Shading of a hit point of the tape, or of the grid if there is one.
+inline vec3f eyelight(const CsgTape& tape, const CsgGrid* grid,
+    const ray3f& ray, const vec3f& position,
+    const vec3f& diffuse = {0.9, 0.3, 0.2}) {
+  auto normal = hit_normal(tape, grid, position);
+  return eyelight(
+      normal, ray, diffuse, eval_lighting(tape, position, normal));
+}
+
+enum struct march_event { marching, hit, escaped, exhausted };
+
+// Hits found by a footprint are refined: `probe` tests a point just past
+// the hit for a sign change, and `refine` runs secant steps in the bracket.
+enum struct march_phase { march, probe, refine };
+
+// Ray being marched. Plain steps add the distance to the position, relaxed
+// steps move along the ray so that they can be taken back. Both keep the
+// distance along the ray, and the ray escapes when it leaves the box.
+struct march_state {
+  ray3f       ray        = {};  // starting at the box
+  vec3f       position   = {};
+  float       t          = 0;
+  float       tmin       = 0;  // of the box, inside steps can go back
+  float       tmax       = 0;
+  float       step       = 0;
+  float       radius     = 0;  // of the previous point
+  float       omega      = 1;
+  int         steps      = 0;
+  bool        relaxed    = false;
+  float       offset     = 0;  // from the camera to the start
+  float       footprint  = 0;
+  march_phase phase      = march_phase::march;
+  vec2f       previous   = {0, 0};  // distance along the ray and value
+  vec2f       lo         = {0, 0};  // bracket of the surface
+  vec2f       hi         = {0, 0};
+  int         iterations = 0;
+  double      epsilon    = 0.001;  // of hits
+  int         max_steps  = max_march_steps;
+};
+
+// Starts the ray at the scene box, or at `start` if it is farther, returns
+// false if the ray misses the box.
+inline bool init_march(march_state& state, ray3f ray,
+    const march_params& params, float start = 0) {
+  auto tmin = 0.0f, tmax = 0.0f;
+  if (!intersect_bbox(ray, params.bounds, tmin, tmax)) return false;
+  auto t = yocto::max(tmin + 0.01f, start);
+  ray.o += ray.d * t;
+  state           = {};
+  state.ray       = ray;
+  state.position  = ray.o;
+  state.tmin      = tmin - t;
+  state.tmax      = tmax - t;
+  state.omega     = params.relaxation;
+  state.relaxed   = params.relaxation > 1;
+  state.offset    = t;
+  state.footprint = params.footprint;
+  if (params.approximate) {
+    state.epsilon   = approximate_epsilon;
+    state.max_steps = approximate_steps;
+  }
+  return true;
+}
+
+// Root of the line through the bracket, which is inside it since the values
+// at its ends have opposite signs.
+inline float secant(const vec2f& lo, const vec2f& hi) {
+  return lo.x - lo.y * (hi.x - lo.x) / (hi.y - lo.y);
+}
+
+// Advances the ray given the distance at its position.
+inline march_event march_step(march_state& state, float distance) {
+  auto& ray  = state.ray;
+  auto& o    = state.position;
+  auto  move = [&state](float t) {
+    state.t        = t;
+    state.position = state.ray.o + state.ray.d * t;
+    return state.steps >= state.max_steps ? march_event::exhausted
+                                          : march_event::marching;
+  };
+  state.steps += 1;
+  if (state.phase == march_phase::probe) {
+    // without a sign change the ray only grazes the surface, and marching
+    // goes on from the probe
+    state.phase = march_phase::march;
+    if (distance < 0) {
+      state.hi    = {state.t, distance};
+      state.phase = march_phase::refine;
+      return move(secant(state.lo, state.hi));
+    }
+  }
+  if (state.phase == march_phase::refine) {
+    if (fabs(distance) <= state.epsilon || ++state.iterations == 4)
+      return march_event::hit;
+    if (distance > 0) state.lo = {state.t, distance};
+    if (distance < 0) state.hi = {state.t, distance};
+    return move(secant(state.lo, state.hi));
+  }
+  if (state.omega > 1 && fabs(distance) + state.radius < state.step) {
+    auto t      = state.t - (state.step - state.radius);
+    state.step  = state.radius;
+    state.omega = 1;
+    return move(t);
+  }
+  auto epsilon = yocto::max(
+      (float)state.epsilon, state.footprint * (state.offset + state.t));
+  if (fabs(distance) <= state.epsilon) return march_event::hit;
+  if (state.t < state.tmin || state.t > state.tmax)
+    return march_event::escaped;
+  if (fabs(distance) <= epsilon) {
+    if (distance < 0 && state.previous.y <= 0) return march_event::hit;
+    if (distance < 0) {
+      state.lo    = state.previous;
+      state.hi    = {state.t, distance};
+      state.phase = march_phase::refine;
+      return move(secant(state.lo, state.hi));
+    }
+    // probes past the box would find the solids it cuts
+    if (state.t + 2 * epsilon <= state.tmax) {
+      state.lo    = {state.t, distance};
+      state.phase = march_phase::probe;
+      return move(state.t + 2 * epsilon);
+    }
+  }
+  state.previous = {state.t, distance};
+  if (state.relaxed) {
+    state.step   = distance > 0 ? distance * state.omega : distance;
+    state.radius = fabs(distance);
+    state.t += state.step;
+    o = ray.o + ray.d * state.t;
+  } else {
+    state.t += distance;
+    o += ray.d * distance;
+  }
+  return state.steps >= state.max_steps ? march_event::exhausted
+                                        : march_event::marching;
+}
+
+// Radiance of a ray that stopped with `event`. Hits are shaded with the
+// normal, if given, see hit_normal.
+inline vec3f march_radiance(const CsgTape& tape, const CsgGrid* grid,
+    const march_state& state, march_event event,
+    const vec3f* normal = nullptr, const CsgShading& shading = {}) {
+  switch (event) {
+    case march_event::hit: {
+      auto hit = normal ? *normal : hit_normal(tape, grid, state.position);
+      return shade_hit(shading, hit, state.ray.d,
+          eval_lighting(tape, state.position, hit));
+    }
+    case march_event::escaped: return vec3f(0.01);
+    case march_event::exhausted: return {1, 0, 0};
+    default: return vec3f(0.0);
+  }
+}
+
+// Colors from blue to red along a log scale of `count` over `range`.
+inline vec3f falsecolor_ramp(float count, float range = max_march_steps) {
+  const vec3f stops[] = {{0.0, 0.0, 0.5}, {0.0, 0.4, 1.0}, {0.0, 0.9, 0.3},
+      {1.0, 0.9, 0.0}, {1.0, 0.0, 0.0}};
+  auto t = clamp(std::log2(1 + count) / std::log2(1 + range), 0.0f, 1.0f) * 4;
+  auto k = yocto::min((int)t, 3);
+  return lerp(stops[k], stops[k + 1], t - k);
+}
+
+// Radiance of a camera ray that stopped with `event`, or its false color.
+// Distances are evaluated once per step, and once more for the normal of
+// hits.
+inline vec3f march_color(const CsgTape& tape, const CsgGrid* grid,
+    const march_params& march, const march_state& state, march_event event,
+    const vec3f* normal = nullptr) {
+  auto steps = (float)state.steps;
+  switch (march.falsecolor) {
+    case march_falsecolor::none: break;
+    case march_falsecolor::steps: return falsecolor_ramp(steps);
+    case march_falsecolor::evals:
+      return falsecolor_ramp(steps + (event == march_event::hit));
+    case march_falsecolor::exhausted:
+      if (event == march_event::exhausted) return {1, 0, 0};
+      return vec3f(mean(march_radiance(
+                       tape, grid, state, event, normal, march.shading)) *
+                   0.5f);
+  }
+  return march_radiance(tape, grid, state, event, normal, march.shading);
+}
+
+// Path tracing with the material and the lights of eyelight, for renders
+// with soft shadows and diffuse interreflections. At each hit the light of
+// march.shading is sampled with a soft shadow, and the path bounces along a
+// cosine distributed direction, taking the sky when it escapes. The last hit
+// takes the sky weighted by its ambient occlusion instead of bouncing. Both
+// are estimated from the distances around the point [Quilez 2010; Evans
+// 2006], which costs a few evaluations rather than a ray.
+
+// Light reaching a point from the direction of `light`, from 0 in the
+// shadow to 1. Steps toward the light keep the narrowest opening of the
+// spheres seen from the point, so penumbras widen with `k` lower.
+template <typename Sdf>
+inline float soft_shadow(Sdf&& sdf, const march_params& march,
+    const vec3f& position, const vec3f& light, float k = 16) {
+  auto tmin = 0.0f, tmax = 0.0f;
+  if (!intersect_bbox({position, light}, march.bounds, tmin, tmax)) return 1;
+  auto shadow = 1.0f, t = 0.01f;
+  for (auto step = 0; step < 128 && t < tmax; step++) {
+    auto distance = sdf(position + light * t);
+    if (distance < 0.0005f) return 0;
+    shadow = yocto::min(shadow, k * distance / t);
+    t += clamp(distance, 0.002f, 0.1f);
+  }
+  return shadow;
+}
+
+// Fraction of the sky seen from a point, from 0 to 1, by how much the
+// distances along the normal fall short of the distances to the point,
+// weighting the nearest samples more.
+template <typename Sdf>
+inline float ambient_occlusion(Sdf&& sdf, const vec3f& position,
+    const vec3f& normal, float radius = 0.05f) {
+  auto occlusion = 0.0f, total = 0.0f, weight = 1.0f;
+  for (auto k = 1; k <= 5; k++) {
+    auto h = radius * k / 5;
+    occlusion += weight * yocto::max(h - sdf(position + normal * h), 0.0f);
+    total += weight * h;
+    weight *= 0.5f;
+  }
+  return clamp(1 - occlusion / total, 0.0f, 1.0f);
+}
+
+// Lighting volume of the tree over `bounds`, with `resolution` samples
+// along the longest side, see CsgLighting. Samples are moved along the
+// normal to a cell off the surface, by up to two cells, since those inside
+// are read only by hits that blend them with the ones outside. Shadows of
+// `light`, see CsgShading, and occlusion are estimated there as in
+// pathtrace.
+inline CsgLighting bake_lighting(const CsgTree& csg, const bbox3f& bounds,
+    int resolution, const vec3f& light = {0.2, 1, 0});
+
+// Lighting volume after an edit of the tree it was baked from, which
+// changed the surface only in `regions`, see changed_regions. Only the
+// samples near the regions, or whose path to the light crosses them, are
+// estimated again, and the volume shares nothing with the old one, which
+// may still be rendered.
+inline CsgLighting relight_lighting(const CsgLighting& lighting,
+    const CsgTree& csg, const vector<bbox3f>& regions);
+
+// Position of a sample of the volume, x fastest.
+inline vec3f lighting_point(const CsgGrid& grid, int i) {
+  auto x = i % grid.size.x, y = (i / grid.size.x) % grid.size.y,
+       z = i / (grid.size.x * grid.size.y);
+  return grid.bounds.min + grid_cell(grid).x * vec3f{(float)x, (float)y,
+                                                   (float)z};
+}
+
+// Estimates the samples of the volume whose index `update` accepts.
+template <typename Update>
+inline void light_samples(
+    CsgLighting& lighting, const CsgTree& csg, Update&& update) {
+  auto& grid = lighting.shadow;
+  auto  cell = grid_cell(grid).x;
+  auto  num  = grid.size.x * grid.size.y * grid.size.z;
+  auto  copy = [num](const CsgGrid& grid) {
+    auto values = std::make_shared<vector<float>>(num, 1.0f);
+    std::copy(grid.values.data(), grid.values.data() + grid.values.size(),
+        values->data());
+    return values;
+  };
+  auto shadow    = copy(grid);
+  auto occlusion = copy(lighting.occlusion);
+  auto tape  = compile_csg(csg, flt_max);
+  auto light = normalize(lighting.light);
+  auto march = march_params{};
+  march.bounds = {grid.bounds.min + vec3f(0.5), grid.bounds.max + vec3f(0.5)};
+  parallel_for_chunks(num, [&](int begin, int end) {
+    auto registers = tape_registers<float>(tape);
+    auto sdf       = [&](vec3f p) -> float {
+      return eval_tape(registers, tape, p - vec3f(0.5)) / tape.lipschitz;
+    };
+    for (auto i = begin; i < end; i++) {
+      if (!update(i)) continue;
+      auto p      = lighting_point(grid, i);
+      auto grad   = eval_tape_grad(tape, p).grad;
+      auto normal = length(grad) > 0 ? normalize(grad) : vec3f{0, 1, 0};
+      auto q      = p + vec3f(0.5);
+      q += normal * clamp(cell - sdf(q), 0.0f, 2 * cell);
+      (*shadow)[i]    = soft_shadow(sdf, march, q + normal * 0.002f, light);
+      (*occlusion)[i] = ambient_occlusion(sdf, q, normal);
+    }
+  });
+  grid.values                = {shadow->data(), shadow->size()};
+  grid.storage               = shadow;
+  lighting.occlusion.bounds  = grid.bounds;
+  lighting.occlusion.size    = grid.size;
+  lighting.occlusion.values  = {occlusion->data(), occlusion->size()};
+  lighting.occlusion.storage = occlusion;
+}
+
+inline CsgLighting bake_lighting(const CsgTree& csg, const bbox3f& bounds,
+    int resolution, const vec3f& light) {
+  auto lighting   = CsgLighting{};
+  lighting.shadow = init_grid(bounds, resolution);
+  lighting.light  = light;
+  light_samples(lighting, csg, [](int) { return true; });
+  return lighting;
+}
+
+inline CsgLighting relight_lighting(const CsgLighting& lighting,
+    const CsgTree& csg, const vector<bbox3f>& regions) {
+  auto& grid = lighting.shadow;
+  auto  cell = grid_cell(grid).x;
+  // samples move up to two cells, plus one for their normals, and occlusion
+  // reaches its radius past them, while penumbras widen by a sixteenth of
+  // the distance to the occluder, see soft_shadow
+  auto near  = 3 * cell + 0.05f;
+  auto wide  = near + length(grid.bounds.max - grid.bounds.min) / 16;
+  auto light = normalize(lighting.light);
+  for (auto& region : regions)
+    if (!is_bounded(region))
+      return bake_lighting(
+          csg, grid.bounds, yocto::max(grid.size), lighting.light);
+  auto relit = lighting;
+  light_samples(relit, csg, [&](int i) {
+    auto p = lighting_point(grid, i);
+    for (auto& region : regions) {
+      auto shade = bbox3f{region.min - wide, region.max + wide};
+      auto tmin = 0.0f, tmax = 0.0f;
+      if (bounds_distance(p, region) <= near ||
+          intersect_bbox({p, light}, shade, tmin, tmax))
+        return true;
+    }
+    return false;
+  });
+  return relit;
+}
+
+// Direction around the normal with a cosine distribution.
+inline vec3f sample_cosine(const vec3f& normal, const vec2f& ruv) {
+  auto z   = std::sqrt(ruv.y);
+  auto r   = std::sqrt(1 - z * z);
+  auto phi = 2 * pif * ruv.x;
+  return transform_direction(
+      basis_fromz(normal), {r * std::cos(phi), r * std::sin(phi), z});
+}
+
+// Radiance of a path of up to `march.bounces` hits. Rays start as in
+// init_march and `steps` counts all the distances evaluated. Bounces march
+// with a fixed epsilon, since the footprint is the one of the camera. With
+// a radiance cache, the second hit takes the light past it from its cell,
+// or traces it and adds it there, see radiance.h.
+inline vec3f pathtrace(const CsgTape& tape, const CsgJit& jit,
+    const CsgGrid* grid, const march_params& march, ray3f ray, float start,
+    rng_state& rng, int& steps) {
+  auto registers = tape_registers<float>(tape);
+  auto sdf       = [&](vec3f p) -> float {
+    steps += 1;
+    p -= vec3f(0.5);
+    if (grid) return eval_grid(*grid, p) / tape.lipschitz;
+    if (is_valid(jit)) return eval_jit(jit, tape, p) / tape.lipschitz;
+    return eval_tape(registers, tape, p) / tape.lipschitz;
+  };
+  // rays skip empty space, while shadows and occlusion need the distances
+  auto skip = [&](const march_state& state) -> float {
+    auto free = tape.pyramid && !grid
+                    ? eval_pyramid(*tape.pyramid,
+                          state.position - vec3f(0.5), state.ray.d)
+                    : 0.0f;
+    if (free <= 0) return sdf(state.position);
+    steps += 1;
+    return free;
+  };
+  auto material      = material_point{};
+  material.diffuse   = march.shading.diffuse;
+  material.specular  = march.shading.specular;
+  material.roughness = march.shading.roughness;
+  auto light         = normalize(march.shading.light);
+  auto sky           = vec3f(0.1);
+  auto bounce_march  = march;
+  bounce_march.footprint = 0;
+
+  steps         = 0;
+  auto radiance = vec3f(0.0), weight = vec3f(1.0);
+  // light past the cell of the second hit, out of its weight
+  auto cell   = (CsgRadianceCell*)nullptr;
+  auto before = vec3f(0.0), through = vec3f(1.0);
+  auto gather = [&](const vec3f& result) {
+    if (cell) add_radiance(*cell, (result - before) / through);
+    return result;
+  };
+  for (auto bounce = 0; bounce < march.bounces; bounce++) {
+    auto state = march_state{};
+    if (!init_march(state, ray, bounce ? bounce_march : march, start))
+      return bounce ? gather(radiance + weight * sky) : vec3f(0.0);
+    auto event = march_event::marching;
+    while (event == march_event::marching) {
+      if (is_cancelled(march)) return vec3f(0.0);
+      event = march_step(state, skip(state));
+    }
+    if (event == march_event::escaped)
+      return gather(radiance + weight * (bounce ? sky : vec3f(0.01)));
+    if (event == march_event::exhausted)
+      return bounce ? gather(radiance) : vec3f{1, 0, 0};
+
+    auto position = state.position;
+    auto p        = position - vec3f(0.5);
+    auto normal = normalize(
+        grid ? eval_grid_grad(*grid, p) : eval_tape_grad(tape, p).grad);
+    auto origin = position + normal * 0.002f;
+    if (bounce == 1 && march.radiance) {
+      auto cached = vec3f(0.0);
+      cell        = radiance_cell(*march.radiance, p, normal, rng);
+      if (cell && read_radiance(*march.radiance, *cell, rng, cached))
+        return radiance + weight * cached;
+      before  = radiance;
+      through = weight;
+    }
+    radiance += weight * eval_brdfcos(material, normal, -state.ray.d, light) *
+                soft_shadow(sdf, march, origin, light);
+    if (bounce == march.bounces - 1) {
+      radiance += weight * material.diffuse * sky *
+                  ambient_occlusion(sdf, position, normal);
+      break;
+    }
+    weight *= material.diffuse;
+    ray   = {origin, sample_cosine(normal, rand2f(rng))};
+    start = 0;
+  }
+  return gather(radiance);
+}
+
+// Eyelight of the ray, marched with the distances of `sdf` at points of the
+// unit box, e.g. instrumented ones as in profile.h.
+template <typename Sdf>
+inline vec3f march_eyelight(Sdf&& sdf, const CsgTape& tape,
+    const CsgGrid* grid, const march_params& march, ray3f ray, int& steps) {
+  auto state = march_state{};
+  steps      = 0;
+  if (!init_march(state, ray, march)) return vec3f(0.0);
+  while (true) {
+    auto event = march_step(state, sdf(state.position));
+    if (event == march_event::marching) continue;
+    steps = state.steps;
+    return march_color(tape, grid, march, state, event);
+  }
+}
+
+// Eyelight for quick previewing, or paths with bounces.
+inline vec3f raymarch(const trace_camera& camera, const CsgTape& tape,
+    const CsgJit& jit, const CsgGrid* grid, const march_params& march,
+    ray3f ray, rng_state& rng, int& steps) {
+  if (is_pathtraced(march)) {
+    auto radiance = pathtrace(tape, jit, grid, march, ray, 0, rng, steps);
+    if (march.falsecolor == march_falsecolor::none) return radiance;
+    return falsecolor_ramp(steps);
+  }
+  auto sdf = [&](vec3f p) -> float {
+    auto& level = lod_tape(tape, march, distance(ray.o, p));
+    p -= vec3f(0.5);
+    if (grid) return eval_grid(*grid, p) / tape.lipschitz;
+    auto free = tape.pyramid ? eval_pyramid(*tape.pyramid, p, ray.d) : 0.0f;
+    if (free > 0) return free;
+    if (is_valid(jit) && &level == &tape)
+      return eval_jit(jit, tape, p) / tape.lipschitz;
+    return eval_tape(tape_registers<float>(level), level, p) /
+           level.lipschitz;
+  };
+  return march_eyelight(sdf, tape, grid, march, ray, steps);
+}
+
+// Distance that the ray of the pixel can skip. With `hits`, rays also start
+// a little before the nearest first hit of the pixel and of its neighbours,
+// since jittered rays may find a closer surface at silhouettes, unless one
+// of them missed.
+inline float march_start(
+    const march_starts& starts, const vec2i& ij, bool hits = false) {
+  auto start = 0.0f;
+  if (!starts.distance.empty()) {
+    auto block = ij / starts.block;
+    start      = starts.distance[block.y * starts.size.x + block.x];
+  }
+  if (!starts.proxy.empty())
+    start = yocto::max(
+        start, starts.proxy[ij.y * starts.size.x * starts.block + ij.x]);
+  if (!hits || starts.depth.empty()) return start;
+  auto nearest = flt_max;
+  for (auto j = ij.y - 1; j <= ij.y + 1; j++) {
+    for (auto i = ij.x - 1; i <= ij.x + 1; i++) {
+      auto x  = clamp(i, 0, starts.image.x - 1);
+      auto y  = clamp(j, 0, starts.image.y - 1);
+      nearest = yocto::min(nearest, starts.depth[y * starts.image.x + x]);
+    }
+  }
+  if (nearest <= 0 || nearest == flt_max) return start;
+  return yocto::max(start, nearest * 0.98f - 0.01f);
+}
+
+inline void init_depths(march_starts& starts, const vec2i& image_size) {
+  starts.image = image_size;
+  starts.depth.assign(image_size.x * image_size.y, flt_max);
+}
+
+// Distances that the rays of each block of pixels can skip, found by
+// marching a cone around the block from the camera. While the distance at
+// the axis is larger than the radius of the cone, the ball around the axis
+// point holds the section of the cone, so no ray of the block hits anything
+// before it. Blocks of 16 pixels are marched first, then blocks of 4 go on
+// from their parent. Only pinhole cameras and the tape are supported, and
+// the distances are empty otherwise. The first hits are left as they are.
+inline void cone_march(march_starts& starts, const CsgTape& tape,
+    const CsgJit& jit, const CsgGrid* grid, const trace_camera& camera,
+    const vec2i& image_size, march_stats* stats = nullptr) {
+  starts.distance.clear();
+  if (grid || camera.orthographic || camera.aperture) return;
+  starts.size = (image_size + starts.block - 1) / starts.block;
+  starts.distance.assign(starts.size.x * starts.size.y, 0);
+
+  auto sdf = [&tape, &jit](const vec3f& p) {
+    if (is_valid(jit))
+      return eval_jit(jit, tape, p - vec3f(0.5)) / tape.lipschitz;
+    return eval_tape(tape_registers<float>(tape), tape, p - vec3f(0.5)) /
+           tape.lipschitz;
+  };
+  // marches the cone of the pixels in [min, max) from t, returns the
+  // distance reached and adds the steps taken
+  auto march_cone = [&](const vec2i& min, const vec2i& max, float t,
+                        int64_t& steps) {
+    auto corners = array<vec3f, 4>{};
+    auto axis    = vec3f{0, 0, 0};
+    for (auto k = 0; k < 4; k++) {
+      auto ij = vec2i{k & 1 ? max.x : min.x, k & 2 ? max.y : min.y};
+      corners[k] = sample_camera(camera, ij, image_size, {0, 0}, {0, 0}).d;
+      axis += corners[k];
+    }
+    axis          = normalize(axis);
+    auto cosangle = 1.0f;
+    for (auto& corner : corners)
+      cosangle = yocto::min(cosangle, dot(axis, corner));
+    auto slope  = std::sqrt(1 - cosangle * cosangle) / cosangle;
+    auto origin = camera.frame.o;
+    for (auto i = 0; i < 64 && t < 100; i++) {
+      auto gap = sdf(origin + axis * t) - t * slope;
+      steps += 1;
+      if (gap < 0.001f) break;
+      t += gap / (1 + slope);
+    }
+    return t;
+  };
+
+  const auto ratio = 4;
+  auto       coarse = (starts.size + ratio - 1) / ratio;
+  auto       steps  = std::atomic<int64_t>{0};
+  parallel_for(
+      coarse.x * coarse.y,
+      [&](int index) {
+        auto count = (int64_t)0;
+        auto outer = vec2i{index % coarse.x, index / coarse.x} * ratio;
+        auto last  = yocto::min(outer + ratio, starts.size);
+        auto t     = march_cone(outer * starts.block,
+            yocto::min(last * starts.block, image_size), 0, count);
+        for (auto y = outer.y; y < last.y; y++) {
+          for (auto x = outer.x; x < last.x; x++) {
+            auto min = vec2i{x, y} * starts.block;
+            auto max = yocto::min(min + starts.block, image_size);
+            starts.distance[y * starts.size.x + x] = march_cone(
+                min, max, t, count);
+          }
+        }
+        steps += count;
+      },
+      pool_priority());
+  if (stats) stats->steps += steps;
+}
+
+// Largest number of boxes drawn by proxy_march.
+inline const auto max_proxy_boxes = 64;
+
+// Distances that the ray of each pixel can skip, found by drawing the boxes
+// of the tree as proxies of its surface, as a depth prepass on the CPU. The
+// tree is cut in up to max_proxy_boxes subtrees from the root, splitting
+// unions in their operands, grown by their softness, and subtractions and
+// intersections in their first operand. Each box is drawn over the pixels
+// of its projection, where the ray of the center enters it grown by the
+// footprint of the pixel and twice the epsilon of the hits at its far side,
+// so that no ray of the pixel hits the tree before. Pixels that cover no
+// box start past the box of the rays, so that they leave it at their first
+// step. Only pinhole cameras and bounded trees are supported, and the
+// distances are empty otherwise.
+inline void proxy_march(march_starts& starts, const CsgTree& csg,
+    const trace_camera& camera, const vec2i& image_size,
+    const march_params& march) {
+  starts.proxy.clear();
+  if (camera.orthographic || camera.aperture || csg.root < 0 ||
+      csg.bounds.size() != csg.nodes.size())
+    return;
+
+  // subtrees with the softness of their ancestors, split breadth first
+  auto subtrees = vector<pair<int, float>>{{csg.root, 0.0f}};
+  for (auto k = 0; k < subtrees.size(); k++) {
+    auto [index, softness] = subtrees[k];
+    auto& node             = csg.nodes[index];
+    if (is_group(node) || is_instance(node) ||
+        node.children == vec2i{-1, -1} || node.operation.blend > 1)
+      continue;
+    auto blend = node.operation.blend > 0;
+    if (blend && subtrees.size() >= max_proxy_boxes) continue;
+    if (blend) softness += node.operation.softness;
+    subtrees[k] = {node.children.x, softness};
+    if (blend) subtrees.push_back({node.children.y, softness});
+    k--;
+  }
+  auto boxes = vector<bbox3f>{};
+  for (auto [index, softness] : subtrees) {
+    auto& bounds = csg.bounds[index];
+    if (!is_bounded(bounds)) return;
+    boxes.push_back({bounds.min + 0.5f - softness,
+        bounds.max + 0.5f + softness});  // in render space
+  }
+
+  // angle of the rays of a pixel from its center, and the pixels of the
+  // projection of each grown box, or all if it is behind the camera
+  auto distance = camera.focus < flt_max ? camera.lens * camera.focus /
+                                             (camera.focus - camera.lens)
+                                       : camera.lens;  // of the film
+  auto angle    = length(vec2f{camera.film.x / image_size.x,
+                      camera.film.y / image_size.y}) /
+               (2 * distance);
+  auto origin   = camera.frame.o;
+  auto rects    = vector<pair<vec2i, vec2i>>{};
+  for (auto& box : boxes) {
+    auto far = 0.0f;
+    for (auto k = 0; k < 8; k++) {
+      auto corner = vec3f{k & 1 ? box.max.x : box.min.x,
+          k & 2 ? box.max.y : box.min.y, k & 4 ? box.max.z : box.min.z};
+      far         = yocto::max(far, length(corner - origin));
+    }
+    auto grow = far * angle + 2 * yocto::max(0.001f, march.footprint * far);
+    box       = {box.min - grow, box.max + grow};
+    auto rect = pair{image_size, vec2i{0, 0}};
+    for (auto k = 0; k < 8; k++) {
+      auto p = vec3f{k & 1 ? box.max.x : box.min.x,
+                   k & 2 ? box.max.y : box.min.y,
+                   k & 4 ? box.max.z : box.min.z} -
+               origin;
+      auto z = -dot(p, camera.frame.z);
+      if (z <= 0) {
+        rect = {{0, 0}, image_size};
+        break;
+      }
+      auto uv = vec2f{0.5f + dot(p, camera.frame.x) * distance /
+                                 (z * camera.film.x),
+          0.5f - dot(p, camera.frame.y) * distance / (z * camera.film.y)};
+      auto ij = vec2f{uv.x * image_size.x, uv.y * image_size.y};
+      rect.first  = yocto::min(rect.first, vec2i{(int)std::floor(ij.x) - 1,
+                                              (int)std::floor(ij.y) - 1});
+      rect.second = yocto::max(rect.second, vec2i{(int)std::ceil(ij.x) + 1,
+                                                (int)std::ceil(ij.y) + 1});
+    }
+    rect.first  = yocto::max(rect.first, vec2i{0, 0});
+    rect.second = yocto::min(rect.second, image_size);
+    rects.push_back(rect);
+  }
+
+  auto past = 0.0f;
+  for (auto k = 0; k < 8; k++) {
+    auto& bounds = march.bounds;
+    auto  corner = vec3f{k & 1 ? bounds.max.x : bounds.min.x,
+        k & 2 ? bounds.max.y : bounds.min.y,
+        k & 4 ? bounds.max.z : bounds.min.z};
+    past         = yocto::max(past, length(corner - origin));
+  }
+  starts.size  = (image_size + starts.block - 1) / starts.block;
+  auto width   = starts.size.x * starts.block;
+  starts.proxy.assign(width * starts.size.y * starts.block, past);
+  parallel_for(
+      image_size.y,
+      [&](int j) {
+        thread_local auto rays = vector<ray3f>{};
+        rays.clear();
+        for (auto i = 0; i < image_size.x; i++)
+          rays.push_back(sample_camera(
+              camera, {i, j}, image_size, {0.5f, 0.5f}, {0, 0}));
+        for (auto b = 0; b < boxes.size(); b++) {
+          auto [min, max] = rects[b];
+          if (j < min.y || j >= max.y) continue;
+          for (auto i = min.x; i < max.x; i++) {
+            auto& proxy = starts.proxy[j * width + i];
+            auto  tmin = 0.0f, tmax = 0.0f;
+            if (intersect_bbox(rays[i], boxes[b], tmin, tmax))
+              proxy = yocto::min(proxy, tmin);
+          }
+        }
+      },
+      pool_priority());
+}
+
+// Interval bounds of the tree over the frustum of a tile, see
+// classify_tile.
+struct march_frustum {
+  bool    classified = false;
+  bool    empty      = false;  // no ray of the tile hits the tree
+  float   start      = 0;      // distance that the rays of the tile can skip
+  CsgTape tape       = {};     // tree pruned to the frustum, if much smaller
+};
+
+// Segments of the frustums, and the largest trees that are classified,
+// since each segment bounds the whole tree.
+inline const auto frustum_segments  = 16;
+inline const auto max_frustum_nodes = 4096;
+
+// Classifies a tile by bounding the tree over its frustum, from the camera
+// to the far side of the box of the rays, with interval arithmetic. The
+// frustum is cut in segments along the rays, which skip the leading ones
+// where the tree stays farther than twice the epsilon of the hits. If all
+// segments are empty, the rays miss the tree and start past the box, so
+// that they leave it at their first step. Otherwise, the tree is pruned to
+// the rest of the frustum, see specialize_csg, and its tape is kept if it
+// has at most a quarter of the instructions of `tape`. Only pinhole cameras
+// are supported, and the frustum skips nothing otherwise.
+inline void classify_tile(march_frustum& frustum, const CsgTree& csg,
+    const CsgTape& tape, const trace_camera& camera, const vec2i& image_size,
+    const CsgTile& tile, const march_params& march) {
+  frustum            = {};
+  frustum.classified = true;
+  if (camera.orthographic || camera.aperture || csg.nodes.empty() ||
+      csg.nodes.size() > max_frustum_nodes)
+    return;
+  auto corners = array<vec3f, 4>{};
+  auto axis    = vec3f{0, 0, 0};
+  for (auto k = 0; k < 4; k++) {
+    auto ij = vec2i{k & 1 ? tile.max.x : tile.min.x,
+        k & 2 ? tile.max.y : tile.min.y};
+    corners[k] = sample_camera(camera, ij, image_size, {0, 0}, {0, 0}).d;
+    axis += corners[k];
+  }
+  axis          = normalize(axis);
+  auto cosangle = 1.0f;
+  for (auto& corner : corners)
+    cosangle = yocto::min(cosangle, dot(axis, corner));
+  auto& bounds = march.bounds;
+  auto  origin = camera.frame.o;
+  auto  near   = distance(origin, max(bounds.min, min(bounds.max, origin)));
+  auto  far    = 0.0f;
+  for (auto k = 0; k < 8; k++) {
+    auto corner = vec3f{k & 1 ? bounds.max.x : bounds.min.x,
+        k & 2 ? bounds.max.y : bounds.min.y,
+        k & 4 ? bounds.max.z : bounds.min.z};
+    far         = yocto::max(far, distance(origin, corner));
+  }
+
+  // box of the points of the frustum between the distances t0 and t1 along
+  // the rays, which lie between the sections of the pyramid of the corners
+  // at t0 * cosangle and t1 along the axis, in the space of the tree
+  auto section = [&](float t0, float t1) {
+    auto box = invalidb3f;
+    for (auto& corner : corners) {
+      auto scale = 1 / dot(axis, corner);
+      box        = merge(box, origin + corner * (t0 * cosangle * scale));
+      box        = merge(box, origin + corner * (t1 * scale));
+    }
+    box.min = max(box.min, bounds.min) - vec3f(0.5);
+    box.max = min(box.max, bounds.max) - vec3f(0.5);
+    return box;
+  };
+  auto values = vector<interval>(csg.nodes.size());
+  auto empty  = [&](float t0, float t1) {
+    auto region = section(t0, t1);
+    if (region.min.x > region.max.x || region.min.y > region.max.y ||
+        region.min.z > region.max.z)
+      return true;
+    auto epsilon = yocto::max(0.001f, march.footprint * t1);
+    return eval_csg_interval(values, csg, region).min > 2 * epsilon;
+  };
+  auto step = (far - near) / frustum_segments;
+  auto t    = near;
+  while (t < far && empty(t, yocto::min(t + step, far))) t += step;
+  frustum.start = yocto::min(t, far);
+  if (t >= far) {
+    frustum.empty = true;
+    return;
+  }
+
+  auto pruned = compile_csg(specialize_csg(csg, section(t, far)));
+  if (pruned.instructions.size() * 4 <= tape.instructions.size())
+    frustum.tape = std::move(pruned);
+}
+
+// Distances of a packet of 8 rays at their positions, divided by the
+// Lipschitz bound, as one evaluation of the tape. Lanes far from the
+// surface step by the pyramid, see eval_pyramid, and the others evaluate
+// the level of detail of the nearest lane.
+inline void march_distances(const CsgTape& tape, const CsgJit& jit,
+    const CsgGrid* grid, const march_params& march,
+    const march_state* const* states, float* distances) {
+  constexpr auto N = 8;
+  float x[N], y[N], z[N], free[N];
+  auto  skipped = 0;
+  auto  nearest = flt_max;
+  for (auto lane = 0; lane < N; lane++) {
+    auto& state = *states[lane];
+    auto  p     = state.position - vec3f(0.5);
+    x[lane] = p.x, y[lane] = p.y, z[lane] = p.z;
+    free[lane] = tape.pyramid && !grid
+                     ? eval_pyramid(*tape.pyramid, p, state.ray.d)
+                     : 0.0f;
+    skipped += free[lane] > 0;
+    nearest = yocto::min(nearest, state.offset + state.t);
+  }
+  auto& level    = lod_tape(tape, march, nearest);
+  auto  position = vec3f8{load8(x), load8(y), load8(z)};
+  if (skipped == N) {
+    std::copy(free, free + N, distances);
+  } else if (grid) {
+    for (auto lane = 0; lane < N; lane++)
+      distances[lane] = eval_grid(*grid, {x[lane], y[lane], z[lane]});
+  } else if (is_valid(jit) && &level == &tape) {
+    store8(distances, eval_jit(jit, tape, position));
+  } else {
+    store8(distances,
+        eval_tape(tape_registers<float8>(level), level, position));
+  }
+  auto lipschitz = grid ? tape.lipschitz : level.lipschitz;
+  for (auto lane = 0; lane < N && skipped != N; lane++)
+    distances[lane] /= lipschitz;
+  for (auto lane = 0; lane < N && skipped; lane++)
+    if (free[lane] > 0) distances[lane] = free[lane];
+}
+
+// Eyelight of many rays, marching 8 rays at a time so that their distances
+// are evaluated as one packet. Rays that hit or leave the box are replaced
+// by the next ones, so that packets stay full. Each ray takes the same steps
+// as in raymarch, so the radiance is the same, except with levels of detail,
+// which packets take from their nearest ray. Returns the number of steps.
+// Rays start at `starts`, if not empty, and the distances where they stop
+// are written to `depths` as in march_starts. With `aovs`, the passes of
+// the rays are written to them, and hits are shaded with their normal.
+inline int64_t raymarch_packets(const CsgTape& tape, const CsgJit& jit,
+    const CsgGrid* grid, const march_params& march, const vector<ray3f>& rays,
+    const vector<float>& starts, vector<vec3f>& radiance,
+    vector<float>* depths = nullptr, vector<march_aov>* aovs = nullptr) {
+  constexpr auto N = 8;
+  radiance.assign(rays.size(), vec3f(0.0));
+  if (depths) depths->assign(rays.size(), 0);
+  if (aovs) aovs->assign(rays.size(), {});
+
+  // ray and state of each lane, rays that miss the box are black
+  auto lanes  = array<int, N>{};
+  auto states = array<march_state, N>{};
+  auto next   = 0;
+  auto steps  = (int64_t)0;
+  auto start  = [&](int lane) {
+    lanes[lane] = -1;
+    for (; next < rays.size(); next++) {
+      auto start = starts.empty() ? 0 : starts[next];
+      if (!init_march(states[lane], rays[next], march, start)) continue;
+      lanes[lane] = next++;
+      return;
+    }
+  };
+  for (auto lane = 0; lane < N; lane++) start(lane);
+
+  while (!is_cancelled(march)) {
+    // idle lanes repeat a live one, so that they do not widen the packet
+    auto live = -1;
+    for (auto lane = 0; lane < N; lane++)
+      if (lanes[lane] >= 0) live = lane;
+    if (live < 0) break;
+    const march_state* packet[N];
+    for (auto lane = 0; lane < N; lane++)
+      packet[lane] = &states[lanes[lane] >= 0 ? lane : live];
+    float distances[N];
+    march_distances(tape, jit, grid, march, packet, distances);
+
+    for (auto lane = 0; lane < N; lane++) {
+      if (lanes[lane] < 0) continue;
+      auto& state = states[lane];
+      auto  event = march_step(state, distances[lane]);
+      if (event == march_event::marching) continue;
+      if (aovs) {
+        auto& aov = (*aovs)[lanes[lane]];
+        aov.steps = (float)state.steps;
+        if (event == march_event::hit) {
+          aov.depth  = state.offset + state.t;
+          aov.normal = hit_normal(tape, grid, state.position);
+          aov.node   = eval_tape_label(tape, state.position - 0.5f).node;
+        }
+        radiance[lanes[lane]] = march_color(tape, grid, march, state, event,
+            event == march_event::hit ? &aov.normal : nullptr);
+      } else {
+        radiance[lanes[lane]] = march_color(tape, grid, march, state, event);
+      }
+      if (depths && event == march_event::escaped) {
+        auto t                 = clamp(state.t, state.tmin, state.tmax);
+        (*depths)[lanes[lane]] = -(state.offset + t);
+      } else if (depths) {
+        (*depths)[lanes[lane]] = state.offset + state.t;
+      }
+      steps += state.steps;
+      start(lane);
+    }
+  }
+  return steps;
+}
+
+// Eyelight of many rays as separate kernels over queues of rays, as in
+// wavefront path tracers [Laine et al. 2013]: the march kernel steps the
+// rays of the queue 8 at a time, see march_distances, and compacts the ones
+// still marching in place, so that packets stay full until the queue runs
+// out; the normal kernel evaluates the normals of the hits two at a time,
+// see eval_tape_normals, and the shade kernel colors all the rays. Each
+// kernel runs one loop over the rays that need it, instead of switching
+// between them for each lane. Takes and returns the same as
+// raymarch_packets, whose radiance it matches up to the normals, which are
+// differences rather than gradients, and the levels of detail, since
+// packets are made of other rays.
+inline int64_t raymarch_wavefront(const CsgTape& tape, const CsgJit& jit,
+    const CsgGrid* grid, const march_params& march, const vector<ray3f>& rays,
+    const vector<float>& starts, vector<vec3f>& radiance,
+    vector<float>* depths = nullptr, vector<march_aov>* aovs = nullptr) {
+  constexpr auto N = 8;
+  radiance.assign(rays.size(), vec3f(0.0));
+  if (depths) depths->assign(rays.size(), 0);
+  if (aovs) aovs->assign(rays.size(), {});
+  thread_local auto states  = vector<march_state>{};
+  thread_local auto events  = vector<march_event>{};
+  thread_local auto queue   = vector<int>{};
+  thread_local auto hits    = vector<int>{};
+  thread_local auto normals = vector<vec3f>{};
+  states.resize(rays.size());
+  events.assign(rays.size(), march_event::marching);
+  queue.clear();
+  hits.clear();
+
+  // rays that miss the box are black
+  for (auto k = 0; k < (int)rays.size(); k++) {
+    auto start = starts.empty() ? 0 : starts[k];
+    if (init_march(states[k], rays[k], march, start)) queue.push_back(k);
+  }
+
+  // march kernel, short packets repeat their last ray
+  auto steps = (int64_t)0;
+  while (!queue.empty()) {
+    auto kept = 0;
+    for (auto first = 0; first < (int)queue.size(); first += N) {
+      if (is_cancelled(march)) return steps;
+      auto count = yocto::min(N, (int)queue.size() - first);
+      const march_state* packet[N];
+      for (auto lane = 0; lane < N; lane++)
+        packet[lane] = &states[queue[first + yocto::min(lane, count - 1)]];
+      float distances[N];
+      march_distances(tape, jit, grid, march, packet, distances);
+      for (auto lane = 0; lane < count; lane++) {
+        auto ray   = queue[first + lane];
+        auto event = march_step(states[ray], distances[lane]);
+        if (event == march_event::marching) {
+          queue[kept++] = ray;
+          continue;
+        }
+        events[ray] = event;
+        steps += states[ray].steps;
+        if (event == march_event::hit) hits.push_back(ray);
+      }
+    }
+    queue.resize(kept);
+  }
+
+  // normal kernel, over the hits in the order of their rays, two at a time
+  std::sort(hits.begin(), hits.end());
+  normals.resize(hits.size());
+  for (auto h = 0; h < (int)hits.size(); h += 2) {
+    auto count = yocto::min(2, (int)hits.size() - h);
+    if (grid) {
+      for (auto k = h; k < h + count; k++)
+        normals[k] = hit_normal(tape, grid, states[hits[k]].position);
+      continue;
+    }
+    vec3f points[2];
+    for (auto k = 0; k < count; k++)
+      points[k] = states[hits[h + k]].position - vec3f(0.5);
+    eval_tape_normals(tape, points, count, &normals[h]);
+  }
+
+  // shade kernel, rays that missed the box stay marching and black
+  auto hit = 0;
+  for (auto k = 0; k < (int)rays.size(); k++) {
+    auto  event  = events[k];
+    auto& state  = states[k];
+    auto  normal = (const vec3f*)nullptr;
+    if (event == march_event::marching) continue;
+    if (event == march_event::hit) normal = &normals[hit++];
+    radiance[k] = march_color(tape, grid, march, state, event, normal);
+    if (aovs) {
+      auto& aov = (*aovs)[k];
+      aov.steps = (float)state.steps;
+      if (normal) {
+        aov.depth  = state.offset + state.t;
+        aov.normal = *normal;
+        aov.node   = eval_tape_label(tape, state.position - 0.5f).node;
+      }
+    }
+    if (depths && event == march_event::escaped) {
+      auto t       = clamp(state.t, state.tmin, state.tmax);
+      (*depths)[k] = -(state.offset + t);
+    } else if (depths) {
+      (*depths)[k] = state.offset + state.t;
+    }
+  }
+  return steps;
+}
+
+// Sums of the samples of the pixels of an image, as in yocto's trace_state,
+// with each field of the pixels in an array of its own, so that tiles read
+// and write contiguous runs of each. Generators keep their increments in 32
+// bits, which hold the sequences that init_state gives them. Pixels take 28
+// bytes against the 40 of trace_pixel, which also counts hits, always as
+// many as the samples here. Fields are filled in bands of rows on the pool,
+// so that their pages are spread over the nodes of the workers.
+struct march_buffer {
+  vec2i                          extent   = {0, 0};
+  uninitialized_vector<vec3f>    radiance = {};  // sums of the samples
+  uninitialized_vector<int>      samples  = {};
+  uninitialized_vector<uint64_t> rng      = {};  // states of the generators
+  uninitialized_vector<uint32_t> inc      = {};  // increments of generators
+  int sample = 0;  // of the first samples, see init_state_rows
+
+  vec2i size() const { return extent; }
+  int   index(const vec2i& ij) const { return ij.y * extent.x + ij.x; }
+};
+
+inline rng_state pixel_rng(const march_buffer& state, int k) {
+  return {state.rng[k], state.inc[k]};
+}
+
+// State of an image of `size` pixels, without samples nor generators.
+inline void init_state(march_buffer& state, const vec2i& size) {
+  auto pixels    = (size_t)size.x * size.y;
+  state.extent   = size;
+  state.radiance = uninitialized_vector<vec3f>(pixels);
+  state.samples  = uninitialized_vector<int>(pixels);
+  state.rng      = uninitialized_vector<uint64_t>(pixels);
+  state.inc      = uninitialized_vector<uint32_t>(pixels);
+  const auto band = 16;  // rows, as the tiles
+  parallel_for(
+      (size.y + band - 1) / band,
+      [&](int index) {
+        auto begin = (size_t)index * band * size.x;
+        auto end   = std::min(begin + (size_t)band * size.x, pixels);
+        std::fill(state.radiance.begin() + begin,
+            state.radiance.begin() + end, zero3f);
+        std::fill(
+            state.samples.begin() + begin, state.samples.begin() + end, 0);
+        std::fill(state.rng.begin() + begin, state.rng.begin() + end, 0);
+        std::fill(state.inc.begin() + begin, state.inc.begin() + end, 0);
+      },
+      pool_priority());
+}
+
+inline void set_pixel_rng(march_buffer& state, int k, const rng_state& rng) {
+  state.rng[k] = rng.state;
+  state.inc[k] = (uint32_t)rng.inc;
+}
+
+// Drops the samples of the pixel, keeping its generator.
+inline void reset_pixel(march_buffer& state, const vec2i& ij) {
+  auto k            = state.index(ij);
+  state.radiance[k] = zero3f;
+  state.samples[k]  = 0;
+}
+
+inline size_t state_bytes(const march_buffer& state) {
+  return state.radiance.capacity() * sizeof(vec3f) +
+         state.samples.capacity() * sizeof(int) +
+         state.rng.capacity() * sizeof(uint64_t) +
+         state.inc.capacity() * sizeof(uint32_t);
+}
+
+// Bytes of the state and of the render of an image of `size`, as
+// raymarch_image allocates them, to check them against budgets before.
+inline size_t render_buffer_bytes(const vec2i& size) {
+  auto pixel = sizeof(vec3f) + sizeof(int) + sizeof(uint64_t) +
+               sizeof(uint32_t) + sizeof(vec4f);
+  return (size_t)size.x * size.y * pixel;
+}
+
+// Size of the images of the camera, as in yocto's camera_resolution.
+inline vec2i camera_size(const trace_camera& camera, int resolution) {
+  if (camera.film.x > camera.film.y)
+    return {resolution, (int)round(resolution * camera.film.y / camera.film.x)};
+  return {(int)round(resolution * camera.film.x / camera.film.y), resolution};
+}
+
+// Advances the generator by `delta` numbers in O(log delta) steps, by
+// composing the steps of its congruential state [Brown 1994].
+inline void skip_rng(rng_state& rng, uint64_t delta) {
+  auto mult = (uint64_t)6364136223846793005ull, plus = rng.inc;
+  auto acc_mult = (uint64_t)1, acc_plus = (uint64_t)0;
+  for (; delta > 0; delta /= 2) {
+    if (delta & 1) {
+      acc_mult *= mult;
+      acc_plus = acc_plus * mult + plus;
+    }
+    plus *= mult + 1;
+    mult *= mult;
+  }
+  rng.state = acc_mult * rng.state + acc_plus;
+}
+
+// State of `rows` rows of the image of the camera from row `first`, with the
+// generators that init_state gives to them, so that images rendered a band
+// at a time match raymarch_image. Generators are advanced past `sample`
+// samples, which take 4 numbers each for the position of the ray in the
+// pixel and on the lens, so that the samples of a pixel can be split too.
+// Paths take a varying count of numbers, so their split samples differ.
+inline void init_state_rows(march_buffer& state, const trace_camera& camera,
+    const trace_params& params, int first, int rows, int sample = 0) {
+  auto size = camera_size(camera, params.resolution);
+  init_state(state, {size.x, rows});
+  state.sample    = sample;
+  const auto band = 16;
+  parallel_for(
+      (rows + band - 1) / band,
+      [&](int index) {
+        auto begin = index * band * size.x;
+        auto end   = std::min(begin + band * size.x, size.x * rows);
+        auto rng   = make_rng(1301081);
+        skip_rng(rng, (uint64_t)first * size.x + begin);
+        for (auto k = begin; k < end; k++) {
+          auto pixel = make_rng(params.seed, rand1i(rng, 1 << 31) / 2 + 1);
+          if (sample) skip_rng(pixel, (uint64_t)sample * 4);
+          set_pixel_rng(state, k, pixel);
+        }
+      },
+      pool_priority());
+}
+
+// State of the image of the camera, with the generators of yocto's
+// init_state, so that renders match those of trace_state.
+inline void init_state(march_buffer& state, const trace_camera& camera,
+    const trace_params& params) {
+  init_state_rows(state, camera, params, 0,
+      camera_size(camera, params.resolution).y);
+}
+
+// Paths of the rays of the pixels of the tile, in order, with the
+// generators of the pixels. Returns the number of steps.
+inline int64_t pathtrace_tile(const CsgTape& tape, const CsgJit& jit,
+    const CsgGrid* grid, const march_params& march, march_buffer& state,
+    const CsgTile& tile, const vector<ray3f>& rays,
+    const vector<float>& starts, vector<vec3f>& radiance) {
+  radiance.assign(rays.size(), vec3f(0.0));
+  auto steps = (int64_t)0;
+  auto k     = 0;
+  for (auto j = tile.min.y; j < tile.max.y && !is_cancelled(march); j++) {
+    for (auto i = tile.min.x; i < tile.max.x; i++, k++) {
+      auto ray_steps = 0;
+      auto pixel     = state.index({i, j});
+      auto rng       = pixel_rng(state, pixel);
+      radiance[k]    = pathtrace(tape, jit, grid, march, rays[k],
+          starts.empty() ? 0 : starts[k], rng, ray_steps);
+      state.rng[pixel] = rng.state;
+      if (march.falsecolor != march_falsecolor::none)
+        radiance[k] = falsecolor_ramp(ray_steps);
+      steps += ray_steps;
+    }
+  }
+  return steps;
+}
+
+// Point of a 2D Sobol sequence with nested uniform scrambling, which shuffles
+// the index and scrambles the bits of each coordinate with a hash of the
+// seed and of the bits above them [Burley 2020].
+inline uint32_t reverse_bits(uint32_t x) {
+  x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+  x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+  x = ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+  x = ((x >> 8) & 0x00ff00ffu) | ((x & 0x00ff00ffu) << 8);
+  return (x >> 16) | (x << 16);
+}
+
+inline uint32_t owen_scramble(uint32_t x, uint32_t seed) {
+  x = reverse_bits(x);
+  x += seed;
+  x ^= x * 0x6c50b47cu;
+  x ^= x * 0xb82f1e52u;
+  x ^= x * 0xc7afe638u;
+  x ^= x * 0x8d22f6e6u;
+  return reverse_bits(x);
+}
+
+inline uint32_t hash_seed(uint32_t x) {
+  x ^= x >> 16;
+  x *= 0x7feb352du;
+  x ^= x >> 15;
+  x *= 0x846ca68bu;
+  return x ^ (x >> 16);
+}
+
+inline vec2f sobol_sample(uint32_t index, uint32_t seed) {
+  index  = owen_scramble(index, hash_seed(seed));
+  auto x = reverse_bits(index), y = 0u;
+  for (auto v = 1u << 31; index; index >>= 1, v ^= v >> 1)
+    if (index & 1) y ^= v;
+  x = owen_scramble(x, hash_seed(seed ^ 0x9e3779b9u));
+  y = owen_scramble(y, hash_seed(seed ^ 0x85ebca6bu));
+  return {yocto::min(x * 0x1p-32f, 1 - flt_eps),
+      yocto::min(y * 0x1p-32f, 1 - flt_eps)};
+}
+
+// Ray of the next sample of the pixel `k` of the state, which is `ij` of an
+// image of `size`. Sobol points are seeded by the increment of the generator
+// of the pixel, which is the same in bands and splits, see init_state_rows.
+inline ray3f sample_pixel_ray(march_buffer& state, const trace_camera& camera,
+    int k, const vec2i& ij, const vec2i& size, march_sampler sampler) {
+  if (sampler == march_sampler::sobol) {
+    auto index = (uint32_t)(state.sample + state.samples[k]);
+    auto seed  = state.inc[k];
+    return sample_camera(camera, ij, size, sobol_sample(index, seed),
+        sobol_sample(index, hash_seed(seed)));
+  }
+  auto rng     = pixel_rng(state, k);
+  auto ray     = sample_camera(camera, ij, size, rand2f(rng), rand2f(rng));
+  state.rng[k] = rng.state;
+  return ray;
+}
+
+inline ray3f sample_ray(march_buffer& state, const trace_camera& camera,
+    const vec2i& ij, march_sampler sampler = march_sampler::random) {
+  return sample_pixel_ray(
+      state, camera, state.index(ij), ij, state.size(), sampler);
+}
+
+// Adds a sample to the pixel and returns its average.
+inline vec4f accumulate_sample(march_buffer& state, const vec2i& ij,
+    vec3f radiance, const trace_params& params) {
+  if (!isfinite(radiance)) radiance = zero3f;
+  if (max(radiance) > params.clamp) {
+    radiance = radiance * (params.clamp / max(radiance));
+  }
+  auto k = state.index(ij);
+  state.radiance[k] += radiance;
+  state.samples[k] += 1;
+  return {state.radiance[k] / (float)state.samples[k], 1};
+}
+
+// Trace a block of samples
+inline vec4f raymarch_sample(const CsgTape& tape, const CsgJit& jit,
+    const CsgGrid* grid, const march_params& march, march_buffer& state,
+    const trace_camera& camera, const vec2i& ij, const trace_params& params,
+    march_stats* stats = nullptr) {
+  auto ray      = sample_ray(state, camera, ij, march.sampler);
+  auto rng      = pixel_rng(state, state.index(ij));
+  auto steps    = 0;
+  auto radiance = raymarch(camera, tape, jit, grid, march, ray, rng, steps);
+  state.rng[state.index(ij)] = rng.state;
+  if (stats) {
+    stats->rays += 1;
+    stats->steps += steps;
+  }
+  return accumulate_sample(state, ij, radiance, params);
+}
+
+// Gray level of a sample, as used for the noise of the pixels.
+inline float sample_value(const vec3f& radiance, const trace_params& params) {
+  if (!isfinite(radiance)) return 0;
+  return yocto::min(mean(radiance), params.clamp);
+}
+
+// Largest standard error of the mean of the pixels of the tile, from the
+// sums of their samples and of the squared samples. Tiles are only trusted
+// after a few samples, since fewer often agree by chance.
+inline float tile_error(const CsgTile& tile, const march_buffer& state,
+    const image<float>& moments) {
+  if (tile.samples < 4) return flt_max;
+  auto error = 0.0f;
+  for (auto j = tile.min.y; j < tile.max.y; j++) {
+    for (auto i = tile.min.x; i < tile.max.x; i++) {
+      auto  k        = state.index({i, j});
+      auto  n        = (float)state.samples[k];
+      auto  average  = mean(state.radiance[k]) / n;
+      auto  variance = yocto::max(
+          moments[{i, j}] / n - average * average, 0.0f);
+      error = yocto::max(error, std::sqrt(variance / (n - 1)));
+    }
+  }
+  return error;
+}
+
+// Trace a sample for each pixel of the tile with packets of rays. With
+// starts, the first sample of the tile records its hits in them and later
+// samples start from the hits. Since the neighbours of a pixel are read, all
+// tiles should take their first sample before any takes the second. With
+// moments, the squared samples are added to them. With bounces, pixels are
+// path traced one at a time, and hits are not recorded. With a frustum, see
+// classify_tile, rays skip its start and camera rays march its pruned tape.
+// With aovs, the first sample of the tile writes their passes, which paths
+// take from camera rays marched once more. Returns false if the marches
+// were cancelled, see is_cancelled, and the pixels are left as they were.
+inline bool raymarch_tile(const CsgTape& tape, const CsgJit& jit,
+    const CsgGrid* grid, const march_params& march, march_buffer& state,
+    const trace_camera& camera, const CsgTile& tile,
+    const trace_params& params, image<vec4f>& render,
+    march_starts* starts = nullptr, march_stats* stats = nullptr,
+    image<float>* moments = nullptr, const march_frustum* frustum = nullptr,
+    march_aovs* aovs = nullptr) {
+  static const auto no_jit    = CsgJit{};
+  thread_local auto rays      = vector<ray3f>{};
+  thread_local auto distances = vector<float>{};
+  thread_local auto radiance  = vector<vec3f>{};
+  thread_local auto depths    = vector<float>{};
+  thread_local auto passes    = vector<march_aov>{};
+  thread_local auto shaded    = vector<vec3f>{};  // of the camera rays
+  auto record = starts && tile.samples == 0 && !starts->depth.empty() &&
+                !is_pathtraced(march);
+  auto passed = aovs && tile.samples == 0;
+  rays.clear();
+  distances.clear();
+  for (auto j = tile.min.y; j < tile.max.y; j++) {
+    for (auto i = tile.min.x; i < tile.max.x; i++) {
+      rays.push_back(sample_ray(state, camera, {i, j}, march.sampler));
+      if (!starts && !frustum) continue;
+      // pixels sampled by a preview start from their hits from the first
+      // sample of the tile, see raymarch_preview
+      auto start = 0.0f;
+      if (starts) {
+        auto hits = tile.samples > 0 ||
+                    (!starts->depth.empty() &&
+                        starts->depth[j * starts->image.x + i] != flt_max);
+        start     = march_start(*starts, {i, j}, hits);
+      }
+      distances.push_back(frustum ? yocto::max(start, frustum->start) : start);
+    }
+  }
+  auto pruned = frustum && !frustum->tape.instructions.empty();
+  auto steps  = is_pathtraced(march)
+                    ? pathtrace_tile(tape, jit, grid, march, state, tile,
+                          rays, distances, radiance)
+                    : (march.wavefront ? raymarch_wavefront
+                                       : raymarch_packets)(
+                          pruned ? frustum->tape : tape, pruned ? no_jit : jit,
+                          grid, march, rays, distances, radiance,
+                          record ? &depths : nullptr,
+                          passed ? &passes : nullptr);
+  if (passed && is_pathtraced(march)) {
+    auto camera_march    = march;
+    camera_march.bounces = 0;
+    raymarch_packets(tape, jit, grid, camera_march, rays, distances, shaded,
+        nullptr, &passes);
+  }
+  if (is_cancelled(march)) return false;
+  if (passed) {
+    auto k = 0;
+    for (auto j = tile.min.y; j < tile.max.y; j++) {
+      for (auto i = tile.min.x; i < tile.max.x; i++, k++) {
+        auto& pass = passes[k];
+        if (!aovs->depth.empty()) aovs->depth[{i, j}] = pass.depth;
+        if (!aovs->normal.empty()) aovs->normal[{i, j}] = pass.normal;
+        if (!aovs->node.empty()) aovs->node[{i, j}] = pass.node;
+        if (!aovs->steps.empty()) aovs->steps[{i, j}] = pass.steps;
+      }
+    }
+  }
+  if (record) {
+    auto k = 0;
+    for (auto j = tile.min.y; j < tile.max.y; j++)
+      for (auto i = tile.min.x; i < tile.max.x; i++)
+        starts->depth[j * starts->image.x + i] = depths[k++];
+  }
+  if (stats) {
+    stats->rays += rays.size();
+    stats->steps += steps;
+  }
+  auto k = 0;
+  for (auto j = tile.min.y; j < tile.max.y; j++) {
+    for (auto i = tile.min.x; i < tile.max.x; i++, k++) {
+      if (moments) {
+        auto value = sample_value(radiance[k], params);
+        (*moments)[{i, j}] += value * value;
+      }
+      render[{i, j}] = accumulate_sample(state, {i, j}, radiance[k], params);
+    }
+  }
+  return true;
+}
+
+// Progressively compute an image by calling trace_samples multiple times.
+// With starts, the first hits of the first samples are recorded in them.
+// With aovs, their passes are written in the same pass, see raymarch_tile,
+// which runs the tiles one at a time without parallelism too.
+// In jobs, renders over the memory budget throw, and renders with a time
+// budget refine all the tiles a doubling of samples at a time, stopping with
+// the samples they have once it is spent, see CsgJob.
+inline image<vec4f> raymarch_image(const trace_camera& camera,
+    const CsgTape& tape, const CsgJit& jit, const CsgGrid* grid,
+    const march_params& march, const trace_params& params,
+    march_stats* stats = nullptr, march_starts* starts = nullptr,
+    march_aovs* aovs = nullptr) {
+  if (!fits_job_memory(
+          render_buffer_bytes(camera_size(camera, params.resolution))))
+    throw std::runtime_error{"render exceeds the memory budget of the job"};
+  auto state = march_buffer{};
+  init_state(state, camera, params);
+  auto render = image{state.size(), zero4f};
+  if (starts) init_depths(*starts, render.size());
+
+  if (params.noparallel && aovs) {
+    for (auto tile : make_tiles(render.size()))
+      for (; tile.samples < params.samples; tile.samples++)
+        raymarch_tile(tape, jit, grid, march, state, camera, tile, params,
+            render, tile.samples == 0 ? starts : nullptr, stats, nullptr,
+            nullptr, aovs);
+  } else if (params.noparallel) {
+    for (auto j = 0; j < render.size().y; j++) {
+      for (auto i = 0; i < render.size().x; i++) {
+        for (auto s = 0; s < params.samples; s++) {
+          render[{i, j}] = raymarch_sample(tape, jit, grid, march, state,
+              camera, {i, j}, params, stats);
+        }
+      }
+    }
+  } else {
+    auto  tiles  = make_tiles(render.size());
+    auto& job    = pool_job();
+    auto  timed  = job && job->time > 0;
+    auto  target = timed ? 1 : params.samples;
+    while (true) {
+      auto samples = yocto::min(target, params.samples);
+      parallel_for_tiles(tiles, [&](CsgTile& tile) {
+        for (; tile.samples < samples; tile.samples++)
+          raymarch_tile(tape, jit, grid, march, state, camera, tile, params,
+              render, tile.samples == 0 ? starts : nullptr, stats, nullptr,
+              nullptr, aovs);
+      });
+      if (samples >= params.samples || job_expired()) break;
+      target *= 2;
+    }
+  }
+
+  return render;
+}
+
+// Adds the first samples of the pixels of the state again from their
+// passes, see march_aovs, shaded with `march.shading` instead of marched, so
+// that edits of the shading show at once at full resolution. The state
+// must be reset as for the samples that wrote the passes, so that their
+// rays are taken again, and the passes need depth, normal and steps. Hits
+// read the lighting of the tape, and misses take the color of their event,
+// told by their steps: none if the ray missed the box, and exhausted once
+// they reached the most steps of the march. The samples are added to the
+// moments as raymarch_tile adds them, and later samples go on from them.
+inline void relight_samples(const march_aovs& aovs, const CsgTape& tape,
+    const march_params& march, march_buffer& state,
+    const trace_camera& camera, const trace_params& params,
+    image<vec4f>& render, image<float>* moments = nullptr) {
+  auto size = state.size();
+  if (aovs.depth.size() != size || aovs.normal.size() != size ||
+      aovs.steps.size() != size)
+    throw std::invalid_argument{"passes do not match the state"};
+  auto most = march.approximate ? approximate_steps : max_march_steps;
+  parallel_for(size.y, [&](int j) {
+    for (auto i = 0; i < size.x; i++) {
+      auto ray      = sample_ray(state, camera, {i, j}, march.sampler);
+      auto depth    = aovs.depth[{i, j}];
+      auto steps    = aovs.steps[{i, j}];
+      auto radiance = vec3f(0.01);
+      if (depth != flt_max) {
+        auto& normal = aovs.normal[{i, j}];
+        auto  hit    = ray.o + ray.d * depth;
+        radiance     = shade_hit(march.shading, normal, ray.d,
+                eval_lighting(tape, hit, normal));
+      } else if (steps == 0) {
+        radiance = vec3f(0.0);
+      } else if (steps >= most) {
+        radiance = {1, 0, 0};
+      }
+      if (moments) {
+        auto value = sample_value(radiance, params);
+        (*moments)[{i, j}] += value * value;
+      }
+      render[{i, j}] = accumulate_sample(state, {i, j}, radiance, params);
+    }
+  });
+}
+
+// Preview with `downscale` times fewer pixels on each side, as raymarch_image
+// renders it with a sample per pixel, whose rays are the first samples of the
+// pixels of `state` at the centers of its pixels. The samples are added to
+// the state and to the moments, so that the progressive render of the state
+// goes on from them, and their hits are written to `hits`, of the preview,
+// and to the depths of `starts`, of the state, from which raymarch_tile
+// starts the next samples of those pixels. Path traced marches are rendered
+// by raymarch_image, without samples for the state.
+inline image<vec4f> raymarch_preview(const trace_camera& camera,
+    const CsgTape& tape, const CsgJit& jit, const CsgGrid* grid,
+    const march_params& march, const trace_params& params, int downscale,
+    march_buffer& state, march_starts& hits, march_starts& starts,
+    image<float>* moments = nullptr, march_stats* stats = nullptr) {
+  auto preview_params = params;
+  preview_params.resolution /= downscale;
+  preview_params.samples = 1;
+  if (is_pathtraced(march))
+    return raymarch_image(
+        camera, tape, jit, grid, march, preview_params, stats, &hits);
+
+  auto psize   = camera_size(camera, preview_params.resolution);
+  auto size    = state.size();
+  auto preview = image{psize, zero4f};
+  init_depths(hits, psize);
+  auto pixel = [&](int i, int j) {
+    return vec2i{yocto::min((int)((i + 0.5f) * size.x / psize.x), size.x - 1),
+        yocto::min((int)((j + 0.5f) * size.y / psize.y), size.y - 1)};
+  };
+  parallel_for(
+      psize.y,
+      [&](int j) {
+        static const auto no_starts = vector<float>{};
+        thread_local auto rays      = vector<ray3f>{};
+        thread_local auto radiance  = vector<vec3f>{};
+        thread_local auto depths    = vector<float>{};
+        rays.clear();
+        for (auto i = 0; i < psize.x; i++)
+          rays.push_back(sample_ray(state, camera, pixel(i, j), march.sampler));
+        auto steps = (march.wavefront ? raymarch_wavefront : raymarch_packets)(
+            tape, jit, grid, march, rays, no_starts, radiance, &depths,
+            nullptr);
+        for (auto i = 0; i < psize.x; i++) {
+          auto ij = pixel(i, j);
+          if (moments) {
+            auto value = sample_value(radiance[i], params);
+            (*moments)[ij] += value * value;
+          }
+          preview[{i, j}] = accumulate_sample(state, ij, radiance[i], params);
+          hits.depth[j * psize.x + i] = depths[i];
+          starts.depth[ij.y * starts.image.x + ij.x] = depths[i];
+        }
+        if (stats) {
+          stats->rays += rays.size();
+          stats->steps += steps;
+        }
+      },
+      pool_priority());
+  return preview;
+}
+
+// Renders the views of the same tape, as raymarch_image does each one, with
+// the options of each view. The tiles of all the views run on the pool as
+// one stream, so threads do not wait for the last tiles of a view before
+// starting the next one, and all the images are kept until the end.
+inline vector<image<vec4f>> raymarch_images(
+    const vector<trace_camera>& cameras, const CsgTape& tape,
+    const CsgJit& jit, const CsgGrid* grid,
+    const vector<march_params>& marches, const trace_params& params,
+    march_stats* stats = nullptr) {
+  assert(cameras.size() == marches.size());
+  auto renders = vector<image<vec4f>>(cameras.size());
+  if (params.noparallel) {
+    for (auto view = 0; view < cameras.size(); view++)
+      renders[view] = raymarch_image(
+          cameras[view], tape, jit, grid, marches[view], params, stats);
+    return renders;
+  }
+  auto states = vector<march_buffer>(cameras.size());
+  auto tiles  = vector<CsgTile>{};
+  auto views  = vector<int>{};  // of each tile
+  for (auto view = 0; view < cameras.size(); view++) {
+    init_state(states[view], cameras[view], params);
+    renders[view] = image{states[view].size(), zero4f};
+    for (auto& tile : make_tiles(renders[view].size())) {
+      tiles.push_back(tile);
+      views.push_back(view);
+    }
+  }
+  parallel_for(
+      (int)tiles.size(),
+      [&](int i) {
+        auto& tile = tiles[i];
+        auto  view = views[i];
+        for (; tile.samples < params.samples; tile.samples++)
+          raymarch_tile(tape, jit, grid, marches[view], states[view],
+              cameras[view], tile, params, renders[view], nullptr, stats);
+      },
+      csg_priority::interactive);
+  return renders;
+}
+
+// Image position, in pixels, where a pinhole camera sees the point, or the
+// direction if `direction`, {-1, -1} if it is behind the camera. `frame` is
+// the inverse of the camera frame.
+inline vec2f project_camera(const trace_camera& camera, const frame3f& frame,
+    const vec2i& image_size, const vec3f& point, bool direction = false) {
+  auto local = direction ? transform_direction(frame, point)
+                         : transform_point(frame, point);
+  if (local.z >= 0) return {-1, -1};
+  // as in yocto's eval_perspective_camera
+  auto distance = camera.focus < flt_max ? camera.lens * camera.focus /
+                                               (camera.focus - camera.lens)
+                                         : camera.lens;
+  auto scale = distance / -local.z;
+  auto uv    = vec2f{0.5f + local.x * scale / camera.film.x,
+      0.5f - local.y * scale / camera.film.y};
+  return {uv.x * image_size.x, uv.y * image_size.y};
+}
+
+// Options of the rays of a frame. The footprint is the pixel size at unit
+// distance from a pinhole camera, whose resolution is the one of the
+// longest side of the film. The level of detail is given in pixels and
+// scaled by it too. Rays are clipped to the box of the root, moved like
+// the points (see raymarch) and grown so that the first step does not skip
+// the surface.
+inline march_params frame_march(march_params march, const bbox3f& root,
+    const trace_camera& camera, const trace_params& params, bool footprint) {
+  auto pixel = yocto::max(camera.film) / params.resolution / camera.lens;
+  march.footprint = footprint ? pixel : 0;
+  march.lod *= pixel;
+  march.bounds    = bbox3f{{0, 0, 0}, {1, 1, 1}};
+  if (is_bounded(root)) {
+    march.bounds.min = max(march.bounds.min, root.min + 0.48f);
+    march.bounds.max = min(march.bounds.max, root.max + 0.52f);
+  }
+  return march;
+}
+
+inline march_params frame_march(const march_params& march, const Csg& csg,
+    const trace_camera& camera, const trace_params& params, bool footprint) {
+  return frame_march(march, csg.bounds[csg.root], camera, params, footprint);
+}
+
+// Camera the viewer starts from, looking at the center of the unit box.
+inline trace_camera init_camera() {
+  auto camera  = trace_camera{};
+  auto from    = vec3f{2, 2, 2};
+  auto to      = vec3f{0.5, 0.5, 0.5};
+  camera.film  = {0.024, 0.024};
+  camera.frame = lookat_frame(from, to, {0, 1, 0});
+  camera.focus = length(from - to);
+  return camera;
+}
+
+// Views of the initial camera turned around the vertical axis through the
+// center of the unit box.
+inline vector<trace_camera> turntable_cameras(int frames) {
+  auto cameras = vector<trace_camera>{};
+  for (auto frame = 0; frame < frames; frame++) {
+    auto camera = init_camera();
+    auto angle  = 2 * pif * frame / frames;
+    auto center = vec3f{0.5, 0.5, 0.5};
+    camera.frame = translation_frame(center) *
+                   rotation_frame(vec3f{0, 1, 0}, angle) *
+                   translation_frame(-center) * camera.frame;
+    cameras.push_back(camera);
+  }
+  return cameras;
+}
+
+// Renders all the samples of the rows of the state, see init_state_rows,
+// into `render`, with the rays that raymarch_image traces for them. Only
+// the band is kept in memory, so images of any height can be rendered.
+inline void raymarch_rows(const trace_camera& camera, const CsgTape& tape,
+    const CsgJit& jit, const CsgGrid* grid, const march_params& march,
+    const trace_params& params, march_buffer& state, int first,
+    image<vec4f>& render, march_stats* stats = nullptr) {
+  auto size = camera_size(camera, params.resolution);
+  if (render.size() != state.size()) render = image{state.size(), zero4f};
+  auto tiles = make_tiles(state.size());
+  parallel_for_tiles(tiles, [&](CsgTile& tile) {
+    thread_local auto rays     = vector<ray3f>{};
+    thread_local auto radiance = vector<vec3f>{};
+    for (; tile.samples < params.samples; tile.samples++) {
+      rays.clear();
+      for (auto j = tile.min.y; j < tile.max.y; j++) {
+        for (auto i = tile.min.x; i < tile.max.x; i++) {
+          rays.push_back(sample_pixel_ray(state, camera, state.index({i, j}),
+              {i, first + j}, size, march.sampler));
+        }
+      }
+      auto steps = is_pathtraced(march)
+                       ? pathtrace_tile(tape, jit, grid, march, state, tile,
+                             rays, {}, radiance)
+                       : raymarch_packets(
+                             tape, jit, grid, march, rays, {}, radiance);
+      if (stats) {
+        stats->rays += rays.size();
+        stats->steps += steps;
+      }
+      auto k = 0;
+      for (auto j = tile.min.y; j < tile.max.y; j++)
+        for (auto i = tile.min.x; i < tile.max.x; i++, k++)
+          render[{i, j}] = accumulate_sample(
+              state, {i, j}, radiance[k], params);
+    }
+  });
+}
+
+// Pixels of a render of `previous` moved to the view of `camera`, as in
+// reproject_render, with the distances of the nearest pixels landing on
+// them, flt_max where none does. Returns false if the cameras or the first
+// hits do not allow it.
+inline bool reproject_pixels(const image<vec4f>& display,
+    const march_starts& starts, const trace_camera& previous,
+    const trace_camera& camera, image<vec4f>& colors, vector<float>& depths,
+    image<float>& nearest) {
+  auto size = display.size();
+  if (starts.image != size || starts.depth.empty()) return false;
+  if (previous.orthographic || previous.aperture || camera.orthographic ||
+      camera.aperture)
+    return false;
+  // rows land in parallel, keeping for each pixel the bits of the nearest
+  // distance and the index of its pixel, so that ties go to the first pixel
+  // as in order; positive floats compare as their bits
+  auto pixels  = size.x * size.y;
+  auto winners = vector<std::atomic<uint64_t>>(pixels);
+  for (auto& winner : winners) winner.store(~(uint64_t)0);
+  auto frame = inverse(camera.frame);
+  parallel_for(
+      size.y,
+      [&](int j) {
+        for (auto i = 0; i < size.x; i++) {
+          auto index = j * size.x + i;
+          auto depth = starts.depth[index];
+          if (depth == flt_max) continue;
+          auto ray   = sample_camera(previous, {i, j}, size, {0.5, 0.5}, {});
+          auto point = ray.o + ray.d * fabs(depth);
+          auto uv = depth ? project_camera(camera, frame, size, point)
+                          : project_camera(camera, frame, size, ray.d, true);
+          auto distance = depth ? length(point - camera.frame.o) : flt_max / 2;
+          if (uv.x < 0 || uv.y < 0) continue;
+          auto bits = (uint32_t)0;
+          memcpy(&bits, &distance, sizeof(bits));
+          auto packed = ((uint64_t)bits << 32) | (uint32_t)index;
+          auto corner = vec2i{
+              (int)floor(uv.x - 0.5f), (int)floor(uv.y - 0.5f)};
+          for (auto k = 0; k < 4; k++) {
+            auto ij = corner + vec2i{k & 1, k >> 1};
+            if (ij.x < 0 || ij.y < 0 || ij.x >= size.x || ij.y >= size.y)
+              continue;
+            auto& winner  = winners[ij.y * size.x + ij.x];
+            auto  current = winner.load(std::memory_order_relaxed);
+            while (packed < current &&
+                   !winner.compare_exchange_weak(
+                       current, packed, std::memory_order_relaxed)) {
+            }
+          }
+        }
+      },
+      pool_priority());
+
+  colors  = image{size, zero4f};
+  depths  = vector<float>(pixels, flt_max);
+  nearest = image{size, flt_max};
+  for (auto k = 0; k < pixels; k++) {
+    auto packed = winners[k].load(std::memory_order_relaxed);
+    if (packed == ~(uint64_t)0) continue;
+    auto bits     = (uint32_t)(packed >> 32);
+    auto distance = 0.0f;
+    memcpy(&distance, &bits, sizeof(distance));
+    auto source = (int)(uint32_t)packed;
+    auto depth  = starts.depth[source];
+    nearest[k]  = distance;
+    colors[k]   = display[source];
+    depths[k]   = depth ? copysign(distance, depth) : 0;
+  }
+  return true;
+}
+
+// Moves the pixels of a render of `previous` to the view of `camera` by the
+// first hits of their centers, nearest first. Each pixel covers the 4
+// pixels around where it lands, so that stretched surfaces have no cracks.
+// Rays that escaped the box move with the point where they left it and rays
+// that missed it move by their direction. Pixels that nothing lands on, such
+// as surfaces hidden before and pixels not traced yet, are marched again
+// with a ray per block of `block` pixels, through its center, or with
+// `samples` jittered rays averaged. The first hits are moved too, so that
+// views can be reprojected again before they are rendered. Returns false,
+// and changes nothing, if more than `max_holes` of the pixels are holes.
+inline bool reproject_render(image<vec4f>& display, march_starts& starts,
+    const trace_camera& previous, const trace_camera& camera,
+    const CsgTape& tape, const CsgJit& jit, const CsgGrid* grid,
+    const march_params& march, int block = 3, float max_holes = 0.25f,
+    int samples = 1) {
+  auto size    = display.size();
+  auto colors  = image<vec4f>{};
+  auto depths  = vector<float>{};
+  auto nearest = image<float>{};
+  if (!reproject_pixels(
+          display, starts, previous, camera, colors, depths, nearest))
+    return false;
+  // holes are marched a ray per block, and are traced again by the render
+  auto num_holes = 0;
+  auto blocks    = vector<vec2i>{};
+  for (auto y = 0; y < size.y; y += block) {
+    for (auto x = 0; x < size.x; x += block) {
+      auto count = 0;
+      for (auto j = y; j < yocto::min(y + block, size.y); j++)
+        for (auto i = x; i < yocto::min(x + block, size.x); i++)
+          count += nearest[{i, j}] == flt_max;
+      if (count) blocks.push_back({x, y});
+      num_holes += count;
+    }
+  }
+  if (num_holes > max_holes * size.x * size.y) return false;
+  const auto chunk = 64;
+  parallel_for(
+      ((int)blocks.size() + chunk - 1) / chunk,
+      [&](int index) {
+        auto begin  = index * chunk;
+        auto end    = yocto::min(begin + chunk, (int)blocks.size());
+        auto center = vec2f{block / 2.0f, block / 2.0f};
+        auto rng    = make_rng(961748941, index);
+        auto rays   = vector<ray3f>{};
+        for (auto k = begin; k < end; k++) {
+          for (auto s = 0; s < samples; s++) {
+            if (samples == 1) {
+              rays.push_back(
+                  sample_camera(camera, blocks[k], size, center, {}));
+              continue;
+            }
+            auto uv = rand2f(rng) * (float)block;
+            auto ij = yocto::min(
+                blocks[k] + vec2i{(int)uv.x, (int)uv.y}, size - 1);
+            rays.push_back(sample_camera(camera, ij, size,
+                uv - vec2f{(float)(int)uv.x, (float)(int)uv.y}, {}));
+          }
+        }
+        auto radiance = vector<vec3f>{};
+        raymarch_packets(tape, jit, grid, march, rays, {}, radiance);
+        for (auto k = begin; k < end; k++) {
+          auto c = vec3f{0, 0, 0};
+          for (auto s = 0; s < samples; s++)
+            c += radiance[(k - begin) * samples + s];
+          c /= (float)samples;
+          auto color = vec4f{c.x, c.y, c.z, 1};
+          auto min   = blocks[k];
+          auto max   = yocto::min(min + block, size);
+          for (auto j = min.y; j < max.y; j++)
+            for (auto i = min.x; i < max.x; i++)
+              if (nearest[{i, j}] == flt_max) colors[{i, j}] = color;
+        }
+      },
+      pool_priority());
+  display      = std::move(colors);
+  starts.depth = std::move(depths);
+  return true;
+}
+
+// Renders one of `subsets` interleaved sets of the pixels of the view of
+// `camera`, picked by `phase`: a checkerboard for 2, a pixel of each 2 by
+// 2 block for 4. Their centers are marched and their first hits recorded.
+// The other pixels take the render of `previous` moved to the view, see
+// reproject_pixels, where it lands on the surface of a marched neighbour,
+// or else the average of the marched pixels around them, and are traced
+// again by the render. Successive phases march the other sets, so that
+// views that keep moving refresh all the pixels at a fraction of the cost.
+// Nothing is reprojected if `reproject` is false or `display` does not
+// have `size` pixels.
+inline void interleave_render(image<vec4f>& display, march_starts& starts,
+    const trace_camera& previous, const trace_camera& camera,
+    const CsgTape& tape, const CsgJit& jit, const CsgGrid* grid,
+    const march_params& march, const vec2i& size, int phase, int subsets = 2,
+    bool reproject = true) {
+  auto colors  = image<vec4f>{};
+  auto depths  = vector<float>{};
+  auto nearest = image<float>{};
+  if (!reproject || display.size() != size ||
+      !reproject_pixels(
+          display, starts, previous, camera, colors, depths, nearest)) {
+    colors  = image{size, zero4f};
+    depths  = vector<float>(size.x * size.y, flt_max);
+    nearest = image{size, flt_max};
+  }
+  auto marched = [subsets, phase](int i, int j) {
+    if (subsets == 4) return (i & 1) + 2 * (j & 1) == phase % 4;
+    return ((i + j + phase) & 1) == 0;
+  };
+
+  // bands of rows are marched on the pool, then the other pixels are filled
+  // from the marched ones around them
+  auto       traced = image{size, zero4f};
+  auto       hits   = vector<float>(size.x * size.y, flt_max);
+  const auto band   = 4;
+  parallel_for(
+      (size.y + band - 1) / band,
+      [&](int index) {
+        auto rays   = vector<ray3f>{};
+        auto pixels = vector<vec2i>{};
+        for (auto j = index * band; j < yocto::min((index + 1) * band, size.y);
+             j++) {
+          for (auto i = 0; i < size.x; i++) {
+            if (!marched(i, j)) continue;
+            rays.push_back(
+                sample_camera(camera, {i, j}, size, {0.5, 0.5}, {0, 0}));
+            pixels.push_back({i, j});
+          }
+        }
+        auto radiance = vector<vec3f>{};
+        auto first    = vector<float>{};
+        raymarch_packets(tape, jit, grid, march, rays, {}, radiance, &first);
+        for (auto k = 0; k < pixels.size(); k++) {
+          auto [i, j]           = pixels[k];
+          auto c               = radiance[k];
+          traced[{i, j}]       = {c.x, c.y, c.z, 1};
+          hits[j * size.x + i] = first[k];
+        }
+      },
+      pool_priority());
+
+  parallel_for(
+      size.y,
+      [&](int j) {
+        for (auto i = 0; i < size.x; i++) {
+          auto k = j * size.x + i;
+          if (marched(i, j)) {
+            colors[{i, j}] = traced[{i, j}];
+            depths[k]      = hits[k];
+            continue;
+          }
+          // the moved pixel is kept if a marched neighbour sees the same
+          // surface, or misses as it does
+          auto average = zero4f;
+          auto count   = 0;
+          auto agrees  = false;
+          auto moved   = nearest[{i, j}] != flt_max ? depths[k] : flt_max;
+          for (auto y = yocto::max(j - 1, 0);
+               y <= yocto::min(j + 1, size.y - 1); y++) {
+            for (auto x = yocto::max(i - 1, 0);
+                 x <= yocto::min(i + 1, size.x - 1); x++) {
+              if (!marched(x, y)) continue;
+              auto hit = hits[y * size.x + x];
+              average += traced[{x, y}];
+              count += 1;
+              if (moved == flt_max) continue;
+              if (moved > 0 && hit > 0)
+                agrees |= fabs(moved - hit) < 0.05f * hit;
+              else
+                agrees |= (moved > 0) == (hit > 0);
+            }
+          }
+          if (!agrees) colors[{i, j}] = count ? average / (float)count : zero4f;
+          depths[k] = flt_max;
+        }
+      },
+      pool_priority());
+  display      = std::move(colors);
+  starts.image = size;
+  starts.depth = std::move(depths);
+}
+
+// Views of the two eyes of the camera, `separation` apart along its x axis,
+// with parallel axes.
+inline pair<trace_camera, trace_camera> stereo_cameras(
+    const trace_camera& camera, float separation) {
+  auto left = camera, right = camera;
+  left.frame.o -= camera.frame.x * (separation / 2);
+  right.frame.o += camera.frame.x * (separation / 2);
+  return {left, right};
+}
+
+// Renders the views of the two eyes, see stereo_cameras. The left eye is
+// rendered as raymarch_image, recording the first hits of its pixels, and
+// they are moved to the right eye, see reproject_render, so that only the
+// pixels that the left eye does not see are marched again, with the samples
+// of the render each. Shading that depends on the view is kept from the
+// left eye. The right eye is rendered in full if it cannot be reprojected.
+inline pair<image<vec4f>, image<vec4f>> raymarch_stereo(
+    const trace_camera& camera, float separation, const CsgTape& tape,
+    const CsgJit& jit, const CsgGrid* grid, const march_params& march,
+    const trace_params& params, march_stats* stats = nullptr) {
+  auto [left, right] = stereo_cameras(camera, separation);
+  auto starts = march_starts{};
+  auto images = pair<image<vec4f>, image<vec4f>>{};
+  images.first  = raymarch_image(
+      left, tape, jit, grid, march, params, stats, &starts);
+  images.second = images.first;
+  if (!reproject_render(images.second, starts, left, right, tape, jit, grid,
+          march, 1, 1, params.samples))
+    images.second = raymarch_image(right, tape, jit, grid, march, params);
+  return images;
+}
@@ -0,0 +1,1310 @@
+#pragma once
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "grid_io.h"
+#include "partition.h"
+#include "raymarch.h"
+
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+#define CSG_REMOTE
+#endif
+
+#ifdef CSG_ZSTD
+#include <zstd.h>
+#endif
+
+// Renders split across machines. A coordinator cuts the images into units
+// of rows and samples and hands them to the workers that connect to it,
+// which render them and send back the sums of the samples of their pixels.
+// Pixels take the generators of raymarch_image, advanced past the samples
+// before the unit, see init_state_rows, so what a unit renders does not
+// depend on the worker rendering it. The sums of a band are added in the
+// order of their samples once they are all back, so the image depends on
+// the size of the units only, not on the workers or the order in which they
+// finish, and units with all the samples give the image of raymarch_image.
+//
+// Workers get the tree, the camera and the options of a view before its
+// units, and the units of workers that disconnect are handed out again.
+// Messages are a type and a size followed by the payload, in the byte order
+// of the machines, which are assumed to agree. Only POSIX sockets are
+// supported. Listeners bind the loopback address unless given another,
+// which needs a token, and workers open with a hello holding the token
+// shared with the coordinator, which reads the hellos without blocking and
+// drops the workers whose token differs or that are late. Messages, and the
+// payloads they decompress to, are at most max_message_size bytes, and
+// trees read from them are checked, see read_csg, so that a peer cannot
+// make the other side allocate or read beyond them.
+//
+// Trees are sent by their content hash, see hash_csg, and the ones that a
+// worker holds, i.e. those of the latest view sent to it and the trees of
+// their instances, are sent as the hash only, so views of the same tree
+// send it once per worker and edits keep the instanced trees they did not
+// change. Others are sent as columns, whose 32-bit words are written as the
+// differences with the words of the previous element, in planes of their
+// bytes, so that the indices and parameters of nodes in post-order, which
+// vary slowly, give long runs of zeros. Builds with CSG_ZSTD compress the
+// views with zstd, and read views compressed or not.
+//
+// Trees split in space, see partition.h, are sent to the workers a region
+// at a time, each to its owner only, which compiles the trees of its
+// regions and answers the points and the ray segments in them, see
+// query_partition and trace_partition, instead of units.
+
+enum struct remote_message : uint32_t {
+  view,
+  unit,
+  result,
+  done,
+  regions,
+  points,
+  segments,
+  hello
+};
+enum struct remote_encoding : uint8_t { raw, zstd };
+
+// Bytes of the messages and of the payloads they decompress to, at most.
+inline const uint64_t max_message_size = (uint64_t)1 << 30;
+
+// Trees within instances of a tree read from a message, at most.
+inline const int max_remote_depth = 64;
+
+// What the workers need to render a view, of the params only the
+// resolution, the samples, the seed and the clamp.
+struct CsgRemoteView {
+  int                            index  = 0;
+  std::shared_ptr<const CsgTree> csg    = {};
+  trace_camera                   camera = {};
+  march_params                   march  = {};
+  trace_params                   params = {};
+};
+
+// Trees held by a worker, by their hash.
+using CsgRemoteTrees =
+    std::unordered_map<uint64_t, std::shared_ptr<const CsgTree>>;
+
+// Rows `first` to `first + rows` of a view, from `sample` for `samples`.
+struct CsgRemoteUnit {
+  int view    = 0;
+  int first   = 0;
+  int rows    = 0;
+  int sample  = 0;
+  int samples = 0;
+};
+
+// Sums of the samples of a pixel, as in trace_pixel, whose hits are the
+// samples, see march_buffer.
+// Segment of a ray for the owner of its region, see trace_partition.
+struct CsgRemoteSegment {
+  ray3f      ray     = {};
+  CsgSegment segment = {};
+};
+
+// Tapes of the regions of a worker, by region.
+using CsgRemoteRegions = std::unordered_map<int, CsgTape>;
+
+struct CsgRemotePixel {
+  vec3f radiance = zero3f;
+  int   hits     = 0;
+  int   samples  = 0;
+};
+
+template <typename T>
+inline void write_value(vector<uint8_t>& data, const T& value) {
+  static_assert(std::is_trivially_copyable_v<T>);
+  auto bytes = (const uint8_t*)&value;
+  data.insert(data.end(), bytes, bytes + sizeof(T));
+}
+
+template <typename T>
+inline void write_values(vector<uint8_t>& data, const vector<T>& values) {
+  static_assert(std::is_trivially_copyable_v<T>);
+  write_value(data, (uint64_t)values.size());
+  auto bytes = (const uint8_t*)values.data();
+  data.insert(data.end(), bytes, bytes + values.size() * sizeof(T));
+}
+
+// Reads from `offset`, which is moved past the value. Returns false if the
+// data is too short.
+template <typename T>
+inline bool read_value(const vector<uint8_t>& data, size_t& offset, T& value) {
+  static_assert(std::is_trivially_copyable_v<T>);
+  if (data.size() - offset < sizeof(T)) return false;
+  memcpy(&value, data.data() + offset, sizeof(T));
+  offset += sizeof(T);
+  return true;
+}
+
+template <typename T>
+inline bool read_values(
+    const vector<uint8_t>& data, size_t& offset, vector<T>& values) {
+  static_assert(std::is_trivially_copyable_v<T>);
+  auto size = (uint64_t)0;
+  if (!read_value(data, offset, size)) return false;
+  if ((data.size() - offset) / sizeof(T) < size) return false;
+  values.resize(size);
+  memcpy(values.data(), data.data() + offset, size * sizeof(T));
+  offset += size * sizeof(T);
+  return true;
+}
+
+// Values as columns of their 32-bit words, each written as its difference
+// with the word of the previous value, in planes of bytes.
+template <typename T>
+inline void write_deltas(vector<uint8_t>& data, const vector<T>& values) {
+  static_assert(std::is_trivially_copyable_v<T> && sizeof(T) % 4 == 0);
+  auto stride = sizeof(T) / 4;
+  auto words  = values.size() * stride;
+  auto source = (const uint8_t*)values.data();
+  write_value(data, (uint64_t)values.size());
+  auto start = data.size();
+  data.resize(start + words * 4);
+  for (auto k = (size_t)0; k < words; k++) {
+    auto word = (uint32_t)0, last = (uint32_t)0;
+    memcpy(&word, source + k * 4, 4);
+    if (k >= stride) memcpy(&last, source + (k - stride) * 4, 4);
+    auto delta = word - last;
+    for (auto b = 0; b < 4; b++)
+      data[start + b * words + k] = (uint8_t)(delta >> (8 * b));
+  }
+}
+
+template <typename T>
+inline bool read_deltas(
+    const vector<uint8_t>& data, size_t& offset, vector<T>& values) {
+  static_assert(std::is_trivially_copyable_v<T> && sizeof(T) % 4 == 0);
+  auto size = (uint64_t)0;
+  if (!read_value(data, offset, size)) return false;
+  if ((data.size() - offset) / sizeof(T) < size) return false;
+  auto stride = sizeof(T) / 4;
+  auto words  = size * stride;
+  auto planes = data.data() + offset;
+  values.resize(size);
+  auto target = (uint8_t*)values.data();
+  for (auto k = (size_t)0; k < words; k++) {
+    auto delta = (uint32_t)0, last = (uint32_t)0;
+    for (auto b = 0; b < 4; b++)
+      delta |= (uint32_t)planes[b * words + k] << (8 * b);
+    if (k >= stride) memcpy(&last, target + (k - stride) * 4, 4);
+    auto word = last + delta;
+    memcpy(target + k * 4, &word, 4);
+  }
+  offset += words * 4;
+  return true;
+}
+
+// Hashes of the tree and of the trees of its instances, recursively.
+inline void collect_hashes(
+    const CsgTree& csg, std::unordered_set<uint64_t>& hashes) {
+  hashes.insert(hash_csg(csg));
+  for (auto& instance : csg.instances) collect_hashes(*instance.tree, hashes);
+}
+
+// Trees without the names of their nodes, as their hash and whether they
+// follow, which they do unless their hash is `held`. Written trees are
+// added to `held`, so the trees of instances are sent once each, before the
+// frames of the instances that place them.
+inline void write_csg(vector<uint8_t>& data, const CsgTree& csg,
+    std::unordered_set<uint64_t>& held) {
+  auto hash = hash_csg(csg);
+  auto sent = held.insert(hash).second;
+  write_value(data, hash);
+  write_value(data, (uint8_t)sent);
+  if (!sent) return;
+  auto children   = vector<vec2i>{};
+  auto primitives = vector<CsgPrimitve>{};  // the largest of the union
+  auto groups     = vector<int>{};
+  for (auto& node : csg.nodes) {
+    children.push_back(node.children);
+    primitives.push_back(node.primitive);
+    groups.push_back(node.group);
+  }
+  write_value(data, csg.root);
+  write_deltas(data, children);
+  write_deltas(data, primitives);
+  write_deltas(data, groups);
+  write_deltas(data, csg.bounds);
+  write_value(data, (uint64_t)csg.groups.size());
+  for (auto& group : csg.groups) {
+    write_deltas(data, group.centers);
+    write_deltas(data, group.radius);
+  }
+  write_value(data, (uint64_t)csg.meshes.size());
+  for (auto& mesh : csg.meshes) {
+    write_deltas(data, mesh.positions);
+    write_deltas(data, mesh.triangles);
+  }
+  auto trees = vector<const CsgTree*>{};
+  for (auto& instance : csg.instances)
+    if (std::find(trees.begin(), trees.end(), instance.tree.get()) ==
+        trees.end())
+      trees.push_back(instance.tree.get());
+  write_value(data, (uint64_t)trees.size());
+  for (auto tree : trees) write_csg(data, *tree, held);
+  write_value(data, (uint64_t)csg.instances.size());
+  for (auto& instance : csg.instances) {
+    auto tree = (uint64_t)(std::find(trees.begin(), trees.end(),
+                               instance.tree.get()) -
+                           trees.begin());
+    write_value(data, tree);
+    write_value(data, instance.frame);
+    write_value(data, instance.fold);
+  }
+}
+
+// Depth of the trees within the instances of the tree, 1 for trees without
+// instances, with the ones of trees already seen in `depths`.
+inline int instance_depth(
+    const CsgTree& csg, std::unordered_map<const CsgTree*, int>& depths) {
+  auto found = depths.find(&csg);
+  if (found != depths.end()) return found->second;
+  auto depth = 1;
+  for (auto& instance : csg.instances)
+    depth = yocto::max(depth, 1 + instance_depth(*instance.tree, depths));
+  depths[&csg] = depth;
+  return depth;
+}
+
+// Whether the nodes of the tree are in post-order, with children before
+// their parents, and whether its root, its leaves and the groups, meshes
+// and instances of its leaves are valid, so that evaluation stays within
+// the tree.
+inline bool check_csg(const CsgTree& csg) {
+  auto size = (int)csg.nodes.size();
+  if (csg.root < -1 || csg.root >= size) return false;
+  if (csg.bounds.size() != csg.nodes.size()) return false;
+  for (auto index = 0; index < size; index++) {
+    auto& node = csg.nodes[index];
+    if (node.children != vec2i{-1, -1}) {
+      if (min(node.children) < 0 || max(node.children) >= index)
+        return false;
+      continue;
+    }
+    auto type  = node.primitive.type;
+    auto count = type == primitive_type::group      ? csg.groups.size()
+                 : type == primitive_type::mesh     ? csg.meshes.size()
+                 : type == primitive_type::instance ? csg.instances.size()
+                                                    : (size_t)0;
+    if ((int)type < 0 || type >= primitive_type::none) return false;
+    if (type != primitive_type::group && type != primitive_type::mesh &&
+        type != primitive_type::instance)
+      continue;
+    if (node.group < 0 || (size_t)node.group >= count) return false;
+  }
+  return true;
+}
+
+// Reads a tree, which is taken from `trees` if it was not sent, and added
+// to them otherwise, once it is checked, see check_csg, and its hash too.
+// Group and mesh BVHs are built again. Returns null if the tree is unknown,
+// if the data is invalid or if instances nest deeper than max_remote_depth.
+inline std::shared_ptr<const CsgTree> read_csg(const vector<uint8_t>& data,
+    size_t& offset, CsgRemoteTrees& trees, int depth = 1) {
+  if (depth > max_remote_depth) return nullptr;
+  auto hash = (uint64_t)0;
+  auto sent = (uint8_t)0;
+  if (!read_value(data, offset, hash)) return nullptr;
+  if (!read_value(data, offset, sent)) return nullptr;
+  if (!sent) {
+    auto found = trees.find(hash);
+    return found != trees.end() ? found->second : nullptr;
+  }
+  auto csg        = std::make_shared<CsgTree>();
+  auto children   = vector<vec2i>{};
+  auto primitives = vector<CsgPrimitve>{};
+  auto groups     = vector<int>{};
+  if (!read_value(data, offset, csg->root)) return nullptr;
+  if (!read_deltas(data, offset, children)) return nullptr;
+  if (!read_deltas(data, offset, primitives)) return nullptr;
+  if (!read_deltas(data, offset, groups)) return nullptr;
+  if (primitives.size() != children.size() ||
+      groups.size() != children.size())
+    return nullptr;
+  csg->nodes.resize(children.size());
+  for (auto k = 0; k < csg->nodes.size(); k++) {
+    csg->nodes[k].children  = children[k];
+    csg->nodes[k].primitive = primitives[k];
+    csg->nodes[k].group     = groups[k];
+  }
+  if (!read_deltas(data, offset, csg->bounds)) return nullptr;
+  auto count = (uint64_t)0;
+  if (!read_value(data, offset, count)) return nullptr;
+  if ((data.size() - offset) / (2 * sizeof(uint64_t)) < count) return nullptr;
+  csg->groups.resize(count);
+  for (auto& group : csg->groups) {
+    if (!read_deltas(data, offset, group.centers)) return nullptr;
+    if (!read_deltas(data, offset, group.radius)) return nullptr;
+    if (group.centers.size() != group.radius.size()) return nullptr;
+    auto points = vector<int>(group.centers.size());
+    for (auto k = 0; k < points.size(); k++) points[k] = k;
+    make_points_bvh(group.bvh, points, group.centers, group.radius);
+  }
+  if (!read_value(data, offset, count)) return nullptr;
+  if ((data.size() - offset) / (2 * sizeof(uint64_t)) < count) return nullptr;
+  for (auto k = (uint64_t)0; k < count; k++) {
+    auto mesh = CsgTriangles{};
+    if (!read_deltas(data, offset, mesh.positions)) return nullptr;
+    if (!read_deltas(data, offset, mesh.triangles)) return nullptr;
+    for (auto& triangle : mesh.triangles)
+      if (min(triangle) < 0 || max(triangle) >= mesh.positions.size())
+        return nullptr;
+    update_mesh(mesh);
+    csg->meshes.push_back(std::move(mesh));
+  }
+  if (!read_value(data, offset, count)) return nullptr;
+  if ((data.size() - offset) / (sizeof(uint64_t) + 1) < count) return nullptr;
+  auto shared = vector<std::shared_ptr<const CsgTree>>{};
+  for (auto k = (uint64_t)0; k < count; k++) {
+    auto tree = read_csg(data, offset, trees, depth + 1);
+    if (!tree) return nullptr;
+    shared.push_back(tree);
+  }
+  if (!read_value(data, offset, count)) return nullptr;
+  if ((data.size() - offset) / sizeof(uint64_t) < count) return nullptr;
+  for (auto k = (uint64_t)0; k < count; k++) {
+    auto tree  = (uint64_t)0;
+    auto frame = frame3f{};
+    auto fold  = CsgFold{};
+    if (!read_value(data, offset, tree) || tree >= shared.size())
+      return nullptr;
+    if (!read_value(data, offset, frame)) return nullptr;
+    if (!read_value(data, offset, fold)) return nullptr;
+    csg->instances.push_back(make_instance(shared[tree], frame, fold));
+  }
+  if (!check_csg(*csg)) return nullptr;
+  // trees held from other messages may nest deeper than the ones read here
+  auto depths = std::unordered_map<const CsgTree*, int>{};
+  if (instance_depth(*csg, depths) > max_remote_depth) return nullptr;
+  if (hash_csg(*csg) != hash) return nullptr;
+  trees[hash] = csg;
+  return csg;
+}
+
+// Payload after its encoding and its size, compressed with zstd in builds
+// with CSG_ZSTD.
+inline void compress_payload(
+    const vector<uint8_t>& data, vector<uint8_t>& payload) {
+  payload.clear();
+#ifdef CSG_ZSTD
+  write_value(payload, remote_encoding::zstd);
+  write_value(payload, (uint64_t)data.size());
+  auto start = payload.size();
+  payload.resize(start + ZSTD_compressBound(data.size()));
+  // checksummed, and on threads in builds of zstd that have them
+  auto context = ZSTD_createCCtx();
+  ZSTD_CCtx_setParameter(context, ZSTD_c_checksumFlag, 1);
+  ZSTD_CCtx_setParameter(context, ZSTD_c_nbWorkers,
+      (int)std::thread::hardware_concurrency());
+  auto size = ZSTD_compress2(context, payload.data() + start,
+      payload.size() - start, data.data(), data.size());
+  ZSTD_freeCCtx(context);
+  if (!ZSTD_isError(size)) {
+    payload.resize(start + size);
+    return;
+  }
+  payload.clear();
+#endif
+  write_value(payload, remote_encoding::raw);
+  write_value(payload, (uint64_t)data.size());
+  payload.insert(payload.end(), data.begin(), data.end());
+}
+
+// Returns false if the payload is invalid, if it decompresses to more than
+// max_message_size bytes, or if it is compressed with zstd in a build
+// without CSG_ZSTD.
+inline bool decompress_payload(
+    const vector<uint8_t>& payload, vector<uint8_t>& data) {
+  auto offset   = (size_t)0;
+  auto encoding = remote_encoding{};
+  auto size     = (uint64_t)0;
+  if (!read_value(payload, offset, encoding)) return false;
+  if (!read_value(payload, offset, size)) return false;
+  if (encoding == remote_encoding::raw) {
+    if (payload.size() - offset != size) return false;
+    data.assign(payload.begin() + offset, payload.end());
+    return true;
+  }
+#ifdef CSG_ZSTD
+  if (encoding == remote_encoding::zstd) {
+    // frames that do not say their size, or claim more than a message
+    // holds, are not decompressed
+    auto frame   = payload.data() + offset;
+    auto content = ZSTD_getFrameContentSize(frame, payload.size() - offset);
+    if (content == ZSTD_CONTENTSIZE_UNKNOWN ||
+        content == ZSTD_CONTENTSIZE_ERROR || content != size ||
+        size > max_message_size)
+      return false;
+    data.resize(size);
+    auto read = ZSTD_decompress(
+        data.data(), size, frame, payload.size() - offset);
+    return !ZSTD_isError(read) && read == size;
+  }
+#endif
+  return false;
+}
+
+// Writes the view for a worker that holds the trees of `held`.
+inline void write_view(vector<uint8_t>& payload, const CsgRemoteView& view,
+    std::unordered_set<uint64_t> held = {}) {
+  auto data = vector<uint8_t>{};
+  write_value(data, view.index);
+  write_csg(data, *view.csg, held);
+  write_value(data, view.camera);
+  write_value(data, view.march);
+  write_value(data, view.params.resolution);
+  write_value(data, view.params.samples);
+  write_value(data, view.params.seed);
+  write_value(data, view.params.clamp);
+  compress_payload(data, payload);
+}
+
+// Reads a view, whose trees are then the ones held, see write_view.
+inline bool read_view(const vector<uint8_t>& payload, CsgRemoteView& view,
+    CsgRemoteTrees& trees) {
+  auto data   = vector<uint8_t>{};
+  auto offset = (size_t)0;
+  if (!decompress_payload(payload, data)) return false;
+  if (!read_value(data, offset, view.index)) return false;
+  view.csg = read_csg(data, offset, trees);
+  if (!view.csg) return false;
+  auto hashes = std::unordered_set<uint64_t>{};
+  collect_hashes(*view.csg, hashes);
+  for (auto tree = trees.begin(); tree != trees.end();)
+    tree = hashes.count(tree->first) ? std::next(tree) : trees.erase(tree);
+  if (!read_value(data, offset, view.camera) ||
+      !read_value(data, offset, view.march) ||
+      !read_value(data, offset, view.params.resolution) ||
+      !read_value(data, offset, view.params.samples) ||
+      !read_value(data, offset, view.params.seed) ||
+      !read_value(data, offset, view.params.clamp))
+    return false;
+  // pointers of the coordinator, which the worker does not share
+  view.march.cancel   = nullptr;
+  view.march.radiance = nullptr;
+  return true;
+}
+
+// Writes the trees of the regions of the worker, specialized one at a time
+// so that only the written ones are held.
+inline void write_regions(vector<uint8_t>& payload, const CsgTree& csg,
+    const CsgPartition& partition, int worker) {
+  auto data    = vector<uint8_t>{};
+  auto regions = vector<int>{};
+  for (auto region = 0; region < partition.owners.size(); region++)
+    if (partition.owners[region] == worker) regions.push_back(region);
+  write_value(data, (uint64_t)regions.size());
+  auto held = std::unordered_set<uint64_t>{};
+  for (auto region : regions) {
+    write_value(data, region);
+    write_csg(
+        data, specialize_csg(csg, region_bounds(partition, region)), held);
+  }
+  compress_payload(data, payload);
+}
+
+// Reads the trees of the regions and compiles them with exact values, as
+// eval_csg_batch does, then drops them.
+inline bool read_regions(
+    const vector<uint8_t>& payload, CsgRemoteRegions& regions) {
+  auto data   = vector<uint8_t>{};
+  auto offset = (size_t)0;
+  auto count  = (uint64_t)0;
+  auto trees  = CsgRemoteTrees{};
+  regions.clear();
+  if (!decompress_payload(payload, data)) return false;
+  if (!read_value(data, offset, count)) return false;
+  for (auto k = (uint64_t)0; k < count; k++) {
+    auto region = 0;
+    if (!read_value(data, offset, region)) return false;
+    auto tree = read_csg(data, offset, trees);
+    if (!tree || tree->root < 0) return false;
+    regions[region] = compile_csg(*tree, flt_max);
+  }
+  return true;
+}
+
+// Answers the points or the segments of a message for the regions of the
+// worker, as distances, or as the distance along the ray of each hit and
+// its normal, with -1 for misses. Returns false if a region is not held.
+inline bool answer_partition(remote_message type,
+    const vector<uint8_t>& data, const CsgRemoteRegions& regions,
+    vector<uint8_t>& answer) {
+  auto offset  = (size_t)0;
+  auto indices = vector<int>{};
+  if (!read_values(data, offset, indices)) return false;
+  auto tapes = vector<const CsgTape*>(indices.size());
+  for (auto k = 0; k < indices.size(); k++) {
+    auto found = regions.find(indices[k]);
+    if (found == regions.end()) return false;
+    tapes[k] = &found->second;
+  }
+  answer.clear();
+  if (type == remote_message::points) {
+    auto points = vector<vec3f>{};
+    if (!read_values(data, offset, points) || points.size() != tapes.size())
+      return false;
+    auto distances = vector<float>(points.size());
+    parallel_for_chunks((int)points.size(), [&](int begin, int end) {
+      for (auto k = begin; k < end; k++)
+        distances[k] = eval_tape(*tapes[k], points[k]);
+    });
+    write_values(answer, distances);
+    return true;
+  }
+  auto segments = vector<CsgRemoteSegment>{};
+  if (!read_values(data, offset, segments) || segments.size() != tapes.size())
+    return false;
+  auto hits = vector<vec4f>(segments.size());
+  parallel_for_chunks((int)segments.size(), [&](int begin, int end) {
+    for (auto k = begin; k < end; k++) {
+      auto& [ray, segment] = segments[k];
+      auto  t              = march_segment(*tapes[k], ray, segment);
+      auto  normal         = zero3f;
+      if (t >= 0)
+        normal = normalize(eval_tape_grad(*tapes[k], ray.o + ray.d * t).grad);
+      hits[k] = {t, normal.x, normal.y, normal.z};
+    }
+  }, 256);
+  write_values(answer, hits);
+  return true;
+}
+
+#ifdef CSG_REMOTE
+
+inline bool send_bytes(int socket, const void* data, size_t size) {
+  auto bytes = (const uint8_t*)data;
+  while (size > 0) {
+    auto sent = send(socket, bytes, size, MSG_NOSIGNAL);
+    if (sent <= 0) return false;
+    bytes += sent;
+    size -= sent;
+  }
+  return true;
+}
+
+inline bool recv_bytes(int socket, void* data, size_t size) {
+  auto bytes = (uint8_t*)data;
+  while (size > 0) {
+    auto received = recv(socket, bytes, size, 0);
+    if (received <= 0) return false;
+    bytes += received;
+    size -= received;
+  }
+  return true;
+}
+
+inline bool send_message(
+    int socket, remote_message type, const vector<uint8_t>& data = {}) {
+  auto header = vector<uint8_t>{};
+  write_value(header, type);
+  write_value(header, (uint64_t)data.size());
+  return send_bytes(socket, header.data(), header.size()) &&
+         send_bytes(socket, data.data(), data.size());
+}
+
+// Returns false if the message is longer than `max_size`, before reading
+// its payload.
+inline bool recv_message(int socket, remote_message& type,
+    vector<uint8_t>& data, uint64_t max_size = max_message_size) {
+  auto size = (uint64_t)0;
+  if (!recv_bytes(socket, &type, sizeof(type))) return false;
+  if (!recv_bytes(socket, &size, sizeof(size))) return false;
+  if (size > max_size) return false;
+  data.resize(size);
+  return recv_bytes(socket, data.data(), size);
+}
+
+// Whether the address is a loopback one, which other machines cannot reach.
+inline bool is_loopback(const sockaddr* address) {
+  if (address->sa_family == AF_INET) {
+    auto ip = ntohl(((const sockaddr_in*)address)->sin_addr.s_addr);
+    return (ip >> 24) == 127;
+  }
+  if (address->sa_family == AF_INET6) {
+    auto& ip = ((const sockaddr_in6*)address)->sin6_addr;
+    return IN6_IS_ADDR_LOOPBACK(&ip) ||
+           (IN6_IS_ADDR_V4MAPPED(&ip) && ip.s6_addr[12] == 127);
+  }
+  return false;
+}
+
+// Socket accepting workers on `port` of the address `host`, the loopback
+// one if empty and all of them if "*", or -1 with `error` set. Addresses
+// that other machines can reach need a token, since any peer would
+// otherwise say the empty hello.
+inline int listen_workers(int port, const string& token, string& error,
+    const string& host = "") {
+  auto hints        = addrinfo{};
+  hints.ai_family   = host == "*" ? AF_INET6 : AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags    = AI_PASSIVE;
+  auto node      = host == "*"    ? nullptr
+                   : host.empty() ? "127.0.0.1"
+                                  : host.c_str();
+  auto service   = std::to_string(port);
+  auto addresses = (addrinfo*)nullptr;
+  if (getaddrinfo(node, service.c_str(), &hints, &addresses) != 0) {
+    error = host + ": unknown host";
+    return -1;
+  }
+  auto listener = -1;
+  for (auto info = addresses; info && listener < 0; info = info->ai_next) {
+    if (token.empty() && (host == "*" || !is_loopback(info->ai_addr))) {
+      error = "listening on " + host + " needs a token";
+      continue;
+    }
+    listener = socket(info->ai_family, info->ai_socktype, info->ai_protocol);
+    if (listener < 0) continue;
+    // the address of all IPv6 interfaces takes the IPv4 ones too
+    auto yes = 1, no = 0;
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+    if (info->ai_family == AF_INET6)
+      setsockopt(listener, IPPROTO_IPV6, IPV6_V6ONLY, &no, sizeof(no));
+    if (bind(listener, info->ai_addr, info->ai_addrlen) < 0 ||
+        listen(listener, 64) < 0) {
+      close(listener);
+      listener = -1;
+    }
+  }
+  freeaddrinfo(addresses);
+  if (listener < 0 && error.empty())
+    error = "cannot listen on port " + std::to_string(port);
+  return listener;
+}
+
+// Socket connected to `address`, as host:port, or -1 with `error` set.
+inline int connect_coordinator(const string& address, string& error) {
+  auto colon = address.rfind(':');
+  if (colon == string::npos) {
+    error = address + ": expected host:port";
+    return -1;
+  }
+  auto host  = address.substr(0, colon), port = address.substr(colon + 1);
+  auto hints = addrinfo{};
+  hints.ai_family   = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  auto addresses    = (addrinfo*)nullptr;
+  if (getaddrinfo(host.c_str(), port.c_str(), &hints, &addresses) != 0) {
+    error = address + ": unknown host";
+    return -1;
+  }
+  auto connected = -1;
+  for (auto info = addresses; info && connected < 0; info = info->ai_next) {
+    connected = socket(info->ai_family, info->ai_socktype, info->ai_protocol);
+    if (connected < 0) continue;
+    if (connect(connected, info->ai_addr, info->ai_addrlen) < 0) {
+      close(connected);
+      connected = -1;
+    }
+  }
+  freeaddrinfo(addresses);
+  if (connected < 0) error = address + ": cannot connect";
+  return connected;
+}
+
+inline bool send_hello(int socket, const string& token) {
+  return send_message(
+      socket, remote_message::hello, {token.begin(), token.end()});
+}
+
+// Bytes of the hellos, and seconds that connections have to send them.
+inline const uint64_t max_hello_size = 4096;
+inline const int64_t  hello_timeout  = 5;
+
+// Connections that have not said hello yet, at most.
+inline const int max_pending_workers = 64;
+
+// Worker of the coordinator, see render_remote. Connections are workers
+// once they said hello with the token, and until then are read without
+// blocking, so that peers that send nothing, or send it slowly, do not stall
+// the coordinator.
+struct CsgRemoteWorker {
+  int                          socket   = -1;
+  bool                         joined   = false;  // said hello
+  int64_t                      deadline = 0;      // of the hello, see get_time
+  vector<uint8_t>              hello    = {};     // read so far
+  int                          view     = -1;     // last sent to it
+  bool                         busy     = false;
+  CsgRemoteUnit                unit     = {};
+  std::unordered_set<uint64_t> trees    = {};  // held, see read_view
+};
+
+// Accepts a connection of the listener as a worker that has yet to say
+// hello, see greet_worker, or closes it if too many are waiting to.
+inline void accept_worker(int listener, vector<CsgRemoteWorker>& workers) {
+  auto connected = accept(listener, nullptr, nullptr);
+  if (connected < 0) return;
+  auto pending = std::count_if(workers.begin(), workers.end(),
+      [](auto& worker) { return !worker.joined; });
+  if (pending >= max_pending_workers) {
+    close(connected);
+    return;
+  }
+  fcntl(connected, F_SETFL, fcntl(connected, F_GETFL) | O_NONBLOCK);
+  auto worker     = CsgRemoteWorker{connected};
+  worker.deadline = get_time() + hello_timeout * 1000000000;
+  workers.push_back(std::move(worker));
+}
+
+// Reads what arrived of the hello of a worker that has not said it,
+// without blocking. Once it is all there, the worker joins if it holds the
+// token, compared in full so that the time taken does not tell how much of
+// it matched, and is closed otherwise, as it is if the peer leaves.
+inline void greet_worker(CsgRemoteWorker& worker, const string& token) {
+  auto& hello  = worker.hello;
+  auto  header = sizeof(remote_message) + sizeof(uint64_t);
+  while (true) {
+    auto need = header;
+    if (hello.size() >= header) {
+      auto size = (uint64_t)0;
+      memcpy(&size, hello.data() + sizeof(remote_message), sizeof(size));
+      if (size > max_hello_size) break;
+      need += size;
+    }
+    if (hello.size() >= need) break;
+    auto offset = hello.size();
+    hello.resize(need);
+    auto received = recv(worker.socket, hello.data() + offset,
+        need - offset, 0);
+    hello.resize(offset + std::max(received, (ssize_t)0));
+    if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK ||
+                            errno == EINTR))
+      return;
+    if (received <= 0) break;
+  }
+  auto type = remote_message{};
+  auto size = (uint64_t)0;
+  if (hello.size() >= header) {
+    memcpy(&type, hello.data(), sizeof(type));
+    memcpy(&size, hello.data() + sizeof(type), sizeof(size));
+  }
+  auto valid = type == remote_message::hello && size == token.size() &&
+               hello.size() == header + size;
+  auto differ = (uint8_t)0;
+  for (auto k = (size_t)0; valid && k < token.size(); k++)
+    differ |= hello[header + k] ^ (uint8_t)token[k];
+  if (!valid || differ != 0) {
+    close(worker.socket);
+    worker.socket = -1;
+    return;
+  }
+  fcntl(worker.socket, F_SETFL, fcntl(worker.socket, F_GETFL) & ~O_NONBLOCK);
+  auto yes = 1;
+  setsockopt(worker.socket, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+  worker.joined = true;
+  worker.hello  = {};
+}
+
+// Closes the workers that did not say hello in time, and returns the
+// milliseconds until the next deadline, -1 if none, to poll for.
+inline int close_late_workers(vector<CsgRemoteWorker>& workers) {
+  auto now     = get_time();
+  auto timeout = -1;
+  for (auto& worker : workers) {
+    if (worker.socket < 0 || worker.joined) continue;
+    if (worker.deadline <= now) {
+      close(worker.socket);
+      worker.socket = -1;
+      continue;
+    }
+    auto left = (int)((worker.deadline - now) / 1000000 + 1);
+    timeout   = timeout < 0 ? left : yocto::min(timeout, left);
+  }
+  return timeout;
+}
+
+// Renders the view with the workers, including the ones connecting to
+// `listener` meanwhile with the token, which are added to `workers`. Units
+// are `band` rows with `split` samples, or all of them if 0. Workers that
+// fail are dropped.
+inline image<vec4f> render_remote(int listener, const string& token,
+    vector<CsgRemoteWorker>& workers, const CsgRemoteView& view, int band,
+    int split) {
+  auto size    = camera_size(view.camera, view.params.resolution);
+  auto samples = view.params.samples;
+  if (split <= 0 || split > samples) split = samples;
+  auto ranges = (samples + split - 1) / split;
+  auto bands  = (size.y + band - 1) / band;
+
+  auto queue = std::deque<CsgRemoteUnit>{};
+  for (auto b = 0; b < bands; b++) {
+    for (auto r = 0; r < ranges; r++) {
+      auto first = b * band, sample = r * split;
+      queue.push_back({view.index, first, yocto::min(band, size.y - first),
+          sample, yocto::min(split, samples - sample)});
+    }
+  }
+  // results are kept until all the ranges of their band are back
+  auto results = vector<vector<vector<CsgRemotePixel>>>(
+      bands, vector<vector<CsgRemotePixel>>(ranges));
+  auto missing    = vector<int>(bands, ranges);
+  auto render     = image<vec4f>{size, zero4f};
+  auto done       = 0;
+
+  // views are written once for each subset of their trees that workers hold
+  auto hashes = std::unordered_set<uint64_t>{};
+  collect_hashes(*view.csg, hashes);
+  auto serialized = std::map<vector<uint64_t>, vector<uint8_t>>{};
+  auto serialize  = [&](const CsgRemoteWorker& worker) -> auto& {
+    auto held = vector<uint64_t>{};
+    for (auto hash : hashes)
+      if (worker.trees.count(hash)) held.push_back(hash);
+    std::sort(held.begin(), held.end());
+    auto& payload = serialized[held];
+    if (payload.empty())
+      write_view(payload, view, {held.begin(), held.end()});
+    return payload;
+  };
+
+  auto drop = [&](CsgRemoteWorker& worker) {
+    if (worker.busy) queue.push_front(worker.unit);
+    close(worker.socket);
+    worker.socket = -1;
+  };
+  auto merge = [&](int b) {
+    auto& band_results = results[b];
+    auto  first        = b * band;
+    for (auto k = 0; k < band_results[0].size(); k++) {
+      auto sum = CsgRemotePixel{};
+      for (auto& result : band_results) {
+        sum.radiance += result[k].radiance;
+        sum.hits += result[k].hits;
+        sum.samples += result[k].samples;
+      }
+      auto radiance = sum.hits ? sum.radiance / sum.hits : zero3f;
+      auto coverage = (float)sum.hits / sum.samples;
+      render[{k % size.x, first + k / size.x}] = {
+          radiance.x, radiance.y, radiance.z, coverage};
+    }
+    band_results = {};
+  };
+
+  auto data = vector<uint8_t>{};
+  auto fds  = vector<pollfd>{};
+  while (done < bands) {
+    for (auto& worker : workers) {
+      if (worker.socket < 0 || !worker.joined || worker.busy || queue.empty())
+        continue;
+      if (worker.view != view.index) {
+        if (!send_message(
+                worker.socket, remote_message::view, serialize(worker))) {
+          drop(worker);
+          continue;
+        }
+        worker.view  = view.index;
+        worker.trees = hashes;
+      }
+      data.clear();
+      write_value(data, queue.front());
+      if (!send_message(worker.socket, remote_message::unit, data)) {
+        drop(worker);
+        continue;
+      }
+      worker.unit = queue.front();
+      worker.busy = true;
+      queue.pop_front();
+    }
+    workers.erase(std::remove_if(workers.begin(), workers.end(),
+                      [](auto& worker) { return worker.socket < 0; }),
+        workers.end());
+
+    fds.assign(1, {listener, POLLIN, 0});
+    for (auto& worker : workers) fds.push_back({worker.socket, POLLIN, 0});
+    auto timeout = close_late_workers(workers);
+    if (poll(fds.data(), fds.size(), timeout) < 0) continue;
+    if (fds[0].revents & POLLIN) accept_worker(listener, workers);
+    for (auto k = 1; k < fds.size(); k++) {
+      if (!fds[k].revents || workers[k - 1].socket < 0) continue;
+      auto& worker = workers[k - 1];
+      if (!worker.joined) {
+        greet_worker(worker, token);
+        continue;
+      }
+      auto  type   = remote_message{};
+      auto  unit   = CsgRemoteUnit{};
+      auto  offset = (size_t)0;
+      auto  pixels = vector<CsgRemotePixel>{};
+      if (!recv_message(worker.socket, type, data) ||
+          type != remote_message::result ||
+          !read_value(data, offset, unit) ||
+          !read_values(data, offset, pixels) ||
+          memcmp(&unit, &worker.unit, sizeof(unit)) != 0 ||
+          pixels.size() != (size_t)unit.rows * size.x) {
+        drop(worker);
+        continue;
+      }
+      worker.busy = false;
+      auto b      = unit.first / band;
+      results[b][unit.sample / split] = std::move(pixels);
+      if (--missing[b] == 0) {
+        merge(b);
+        done++;
+      }
+    }
+  }
+  return render;
+}
+
+// Tells the workers that there is nothing left, and disconnects them.
+inline void finish_workers(vector<CsgRemoteWorker>& workers) {
+  for (auto& worker : workers) {
+    if (worker.socket < 0) continue;
+    if (worker.joined) send_message(worker.socket, remote_message::done);
+    close(worker.socket);
+  }
+  workers.clear();
+}
+
+// Waits for the workers of the partition to connect to `listener` with the
+// token, then sends each the trees of its regions, see write_regions. Their
+// index in `workers` is the one of the partition, in the order in which
+// they said hello, and the connections beyond them are closed. Returns false
+// with `error` set if a worker cannot be reached.
+inline bool distribute_partition(int listener, const string& token,
+    vector<CsgRemoteWorker>& workers, const CsgTree& csg,
+    const CsgPartition& partition, string& error) {
+  auto order  = vector<CsgRemoteWorker>{};
+  auto fds    = vector<pollfd>{};
+  auto joined = [&](auto& worker) { return worker.joined; };
+  for (auto& worker : workers)
+    if (worker.joined) order.push_back(std::move(worker));
+  workers.erase(
+      std::remove_if(workers.begin(), workers.end(), joined), workers.end());
+  while (order.size() < partition.count) {
+    fds.assign(1, {listener, POLLIN, 0});
+    for (auto& worker : workers) fds.push_back({worker.socket, POLLIN, 0});
+    auto timeout = close_late_workers(workers);
+    if (poll(fds.data(), fds.size(), timeout) < 0) continue;
+    if (fds[0].revents & POLLIN) accept_worker(listener, workers);
+    for (auto k = 1; k < fds.size(); k++) {
+      auto& worker = workers[k - 1];
+      if (fds[k].revents && worker.socket >= 0) greet_worker(worker, token);
+      if (worker.joined) order.push_back(std::move(worker));
+    }
+    workers.erase(std::remove_if(workers.begin(), workers.end(),
+                      [&](auto& worker) {
+                        return worker.socket < 0 || joined(worker);
+                      }),
+        workers.end());
+  }
+  for (auto k = (size_t)partition.count; k < order.size(); k++)
+    workers.push_back(std::move(order[k]));
+  finish_workers(workers);
+  order.resize(partition.count);
+  workers = std::move(order);
+  auto payload = vector<uint8_t>{};
+  for (auto worker = 0; worker < partition.count; worker++) {
+    write_regions(payload, csg, partition, worker);
+    if (!send_message(
+            workers[worker].socket, remote_message::regions, payload)) {
+      error = "worker " + std::to_string(worker) + " disconnected";
+      return false;
+    }
+  }
+  return true;
+}
+
+// Sends the messages of each worker that has one, then reads their answers.
+// Regions are not held elsewhere, so a worker that fails fails the query.
+inline bool exchange_partition(vector<CsgRemoteWorker>& workers,
+    remote_message type, const vector<vector<uint8_t>>& messages,
+    vector<vector<uint8_t>>& answers, string& error) {
+  answers.resize(messages.size());
+  for (auto worker = 0; worker < messages.size(); worker++) {
+    if (messages[worker].empty()) continue;
+    if (!send_message(workers[worker].socket, type, messages[worker])) {
+      error = "worker " + std::to_string(worker) + " disconnected";
+      return false;
+    }
+  }
+  for (auto worker = 0; worker < messages.size(); worker++) {
+    if (messages[worker].empty()) continue;
+    auto answer = remote_message{};
+    if (!recv_message(workers[worker].socket, answer, answers[worker]) ||
+        answer != remote_message::result) {
+      error = "worker " + std::to_string(worker) + " failed";
+      return false;
+    }
+  }
+  return true;
+}
+
+// Distances of the tree at the points, each evaluated by the owner of its
+// region, see distribute_partition. Returns false with `error` set if a
+// worker fails.
+inline bool query_partition(vector<CsgRemoteWorker>& workers,
+    const CsgPartition& partition, const vector<vec3f>& points,
+    vector<float>& distances, string& error) {
+  auto outside  = vector<int>{};
+  auto routes   = route_points(partition, points, outside);
+  auto messages = vector<vector<uint8_t>>(partition.count);
+  for (auto worker = 0; worker < partition.count; worker++) {
+    auto& route = routes[worker];
+    if (route.empty()) continue;
+    auto regions   = vector<int>{};
+    auto positions = vector<vec3f>{};
+    for (auto k : route) {
+      regions.push_back(region_at(partition, points[k]));
+      positions.push_back(points[k]);
+    }
+    write_values(messages[worker], regions);
+    write_values(messages[worker], positions);
+  }
+  auto answers = vector<vector<uint8_t>>{};
+  if (!exchange_partition(
+          workers, remote_message::points, messages, answers, error))
+    return false;
+  distances.assign(points.size(), 0);
+  for (auto k : outside)
+    distances[k] = bounds_distance(points[k], partition.bounds);
+  for (auto worker = 0; worker < partition.count; worker++) {
+    auto& route  = routes[worker];
+    auto  values = vector<float>{};
+    auto  offset = (size_t)0;
+    if (route.empty()) continue;
+    if (!read_values(answers[worker], offset, values) ||
+        values.size() != route.size()) {
+      error = "worker " + std::to_string(worker) + " failed";
+      return false;
+    }
+    for (auto k = 0; k < route.size(); k++) distances[route[k]] = values[k];
+  }
+  return true;
+}
+
+// First hits of the rays with the tree, as their distance along the ray and
+// their normal, with -1 for misses. Rays are marched a segment at a time,
+// see split_ray, in rounds that send each worker the segments of its
+// regions, and go on to their next segment while they miss. Returns false
+// with `error` set if a worker fails.
+inline bool trace_partition(vector<CsgRemoteWorker>& workers,
+    const CsgPartition& partition, const vector<ray3f>& rays,
+    vector<vec4f>& hits, string& error) {
+  auto segments = vector<vector<CsgSegment>>(rays.size());
+  auto next     = vector<int>(rays.size(), 0);
+  parallel_for_chunks((int)rays.size(), [&](int begin, int end) {
+    for (auto k = begin; k < end; k++)
+      segments[k] = split_ray(partition, rays[k]);
+  });
+  hits.assign(rays.size(), {-1, 0, 0, 0});
+  auto routes   = vector<vector<int>>(partition.count);
+  auto messages = vector<vector<uint8_t>>(partition.count);
+  auto answers  = vector<vector<uint8_t>>{};
+  while (true) {
+    for (auto& route : routes) route.clear();
+    for (auto k = 0; k < rays.size(); k++) {
+      if (next[k] >= segments[k].size()) continue;
+      auto region = segments[k][next[k]].region;
+      routes[partition.owners[region]].push_back(k);
+    }
+    auto pending = false;
+    for (auto worker = 0; worker < partition.count; worker++) {
+      messages[worker].clear();
+      auto& route = routes[worker];
+      if (route.empty()) continue;
+      auto regions = vector<int>{};
+      auto pieces  = vector<CsgRemoteSegment>{};
+      for (auto k : route) {
+        regions.push_back(segments[k][next[k]].region);
+        pieces.push_back({rays[k], segments[k][next[k]]});
+      }
+      write_values(messages[worker], regions);
+      write_values(messages[worker], pieces);
+      pending = true;
+    }
+    if (!pending) return true;
+    if (!exchange_partition(
+            workers, remote_message::segments, messages, answers, error))
+      return false;
+    for (auto worker = 0; worker < partition.count; worker++) {
+      auto& route  = routes[worker];
+      auto  values = vector<vec4f>{};
+      auto  offset = (size_t)0;
+      if (route.empty()) continue;
+      if (!read_values(answers[worker], offset, values) ||
+          values.size() != route.size()) {
+        error = "worker " + std::to_string(worker) + " failed";
+        return false;
+      }
+      for (auto k = 0; k < route.size(); k++) {
+        auto ray = route[k];
+        if (values[k].x >= 0) {
+          hits[ray] = values[k];
+          next[ray] = (int)segments[ray].size();
+        } else {
+          next[ray] += 1;
+        }
+      }
+    }
+  }
+}
+
+// Renders the units of the coordinator at `address`, as host:port, after
+// saying hello with the token, and answers the queries of the regions it
+// sends, see distribute_partition, until it is done. Returns false with
+// `error` set if it cannot be reached or sends something unexpected.
+inline bool run_worker(
+    const string& address, const string& token, string& error) {
+  auto connected = connect_coordinator(address, error);
+  if (connected < 0) return false;
+  auto yes = 1;
+  setsockopt(connected, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+  auto view     = CsgRemoteView{};
+  auto trees    = CsgRemoteTrees{};
+  auto compiled = std::shared_ptr<const CsgTree>{};
+  auto tape     = CsgTape{};
+  auto jit      = CsgJit{};
+  auto state    = march_buffer{};
+  auto render   = image<vec4f>{};
+  auto data     = vector<uint8_t>{};
+  auto regions  = CsgRemoteRegions{};
+  auto answer   = vector<uint8_t>{};
+  auto fail     = [&](const string& message) {
+    error = address + ": " + message;
+    close(connected);
+    return false;
+  };
+  if (!send_hello(connected, token)) return fail("disconnected");
+  while (true) {
+    auto type = remote_message{};
+    if (!recv_message(connected, type, data)) return fail("disconnected");
+    if (type == remote_message::done) break;
+    if (type == remote_message::view) {
+      if (!read_view(data, view, trees)) return fail("bad view");
+      if (view.csg->root < 0) return fail("empty tree");
+      // views of the same tree keep its tape
+      if (view.csg != compiled) {
+        tape     = compile_csg(*view.csg);
+        jit      = compile_jit(tape);
+        compiled = view.csg;
+      }
+      continue;
+    }
+    if (type == remote_message::regions) {
+      if (!read_regions(data, regions)) return fail("bad regions");
+      continue;
+    }
+    if (type == remote_message::points || type == remote_message::segments) {
+      if (!answer_partition(type, data, regions, answer))
+        return fail("bad query");
+      if (!send_message(connected, remote_message::result, answer))
+        return fail("disconnected");
+      continue;
+    }
+    auto unit   = CsgRemoteUnit{};
+    auto offset = (size_t)0;
+    if (type != remote_message::unit || !read_value(data, offset, unit) ||
+        unit.view != view.index)
+      return fail("bad unit");
+    auto params    = view.params;
+    params.samples = unit.samples;
+    init_state_rows(
+        state, view.camera, params, unit.first, unit.rows, unit.sample);
+    raymarch_rows(view.camera, tape, jit, nullptr, view.march, params, state,
+        unit.first, render);
+    auto pixels = vector<CsgRemotePixel>{};
+    pixels.reserve(state.samples.size());
+    for (auto k = 0; k < state.samples.size(); k++)
+      pixels.push_back(
+          {state.radiance[k], state.samples[k], state.samples[k]});
+    data.clear();
+    write_value(data, unit);
+    write_values(data, pixels);
+    if (!send_message(connected, remote_message::result, data))
+      return fail("disconnected");
+  }
+  close(connected);
+  return true;
+}
+
+#else
+
+struct CsgRemoteWorker {};
+
+inline int listen_workers(int port, const string& token, string& error,
+    const string& host = "") {
+  error = "remote renders need POSIX sockets";
+  return -1;
+}
+
+inline image<vec4f> render_remote(int listener, const string& token,
+    vector<CsgRemoteWorker>& workers, const CsgRemoteView& view, int band,
+    int split) {
+  return {};
+}
+
+inline void finish_workers(vector<CsgRemoteWorker>& workers) {}
+
+inline bool distribute_partition(int listener, const string& token,
+    vector<CsgRemoteWorker>& workers, const CsgTree& csg,
+    const CsgPartition& partition, string& error) {
+  error = "remote renders need POSIX sockets";
+  return false;
+}
+
+inline bool query_partition(vector<CsgRemoteWorker>& workers,
+    const CsgPartition& partition, const vector<vec3f>& points,
+    vector<float>& distances, string& error) {
+  error = "remote renders need POSIX sockets";
+  return false;
+}
+
+inline bool trace_partition(vector<CsgRemoteWorker>& workers,
+    const CsgPartition& partition, const vector<ray3f>& rays,
+    vector<vec4f>& hits, string& error) {
+  error = "remote renders need POSIX sockets";
+  return false;
+}
+
+inline bool run_worker(
+    const string& address, const string& token, string& error) {
+  error = "remote renders need POSIX sockets";
+  return false;
+}
+
+#endif
+
+// Renders the view with the workers of the partition, a ray through the
+// center of each pixel shaded as eyelight, see trace_partition, with the
+// camera moved to the space of the tree as raymarch does. Returns an empty
+// image with `error` set if a worker fails.
+inline image<vec4f> render_partition(vector<CsgRemoteWorker>& workers,
+    const CsgPartition& partition, const trace_camera& camera,
+    const trace_params& params, string& error) {
+  auto size = camera_size(camera, params.resolution);
+  auto rays = vector<ray3f>((size_t)size.x * size.y);
+  for (auto j = 0; j < size.y; j++) {
+    for (auto i = 0; i < size.x; i++) {
+      auto ray = sample_camera(camera, {i, j}, size, {0.5, 0.5}, {0.5, 0.5});
+      ray.o -= vec3f(0.5);
+      rays[(size_t)j * size.x + i] = ray;
+    }
+  }
+  auto hits = vector<vec4f>{};
+  if (!trace_partition(workers, partition, rays, hits, error)) return {};
+  auto render = image<vec4f>{size, zero4f};
+  for (auto k = (size_t)0; k < rays.size(); k++) {
+    if (hits[k].x < 0) continue;
+    auto color = eyelight({hits[k].y, hits[k].z, hits[k].w}, rays[k]);
+    render[{(int)(k % size.x), (int)(k / size.x)}] = {
+        color.x, color.y, color.z, 1};
+  }
+  return render;
+}
@@ -0,0 +1,53 @@
+#pragma once
+#include <stdexcept>
+
+#include "batch.h"
+#include "mesh.h"
+#include "surface.h"
+
+// Points around a tree with their distances, as training data for models of
+// the distance field. Points are drawn uniformly in a box, near the surface,
+// uniformly in the cells of the octree of mesh.h that the surface may cross,
+// or on the surface, by projecting points near it along the gradient. Points
+// are drawn in parallel chunks, each with a generator seeded by the chunk,
+// so that the samples only depend on the seed and not on the threads.
+
+enum struct csg_sampling { uniform, near, surface };
+
+// Draws a point for each of `points`, of the kind of `sampling`, in
+// `bounds`, and writes their values to `values`. Near the surface, cells
+// have the size of `resolution` cells along the longest side of the bounds,
+// as in mesh_csg. Throws if the surface does not cross the bounds.
+inline void sample_csg(const CsgTree& csg, const bbox3f& bounds,
+    csg_sampling sampling, span<vec3f> points, span<float> values,
+    int resolution = 128, uint64_t seed = 7) {
+  assert(points.size() == values.size());
+  auto tape  = compile_csg(csg, flt_max);
+  auto size  = 1;
+  auto cells = vector<vec3i>{};
+  while (size < resolution) size *= 2;
+  auto cell = yocto::max(bounds.max - bounds.min) / size;
+  if (sampling != csg_sampling::uniform) {
+    cells = surface_cells(csg, bounds.min, cell, {{{0, 0, 0}, size}});
+    if (cells.empty())
+      throw std::runtime_error{"the surface does not cross the bounds"};
+  }
+
+  auto chunk = 4096;
+  auto draw  = [&](int begin, int end) {
+    auto rng = make_rng(seed, begin / chunk + 1);
+    for (auto k = begin; k < end; k++) {
+      if (sampling == csg_sampling::uniform) {
+        points[k] = bounds.min + rand3f(rng) * (bounds.max - bounds.min);
+        continue;
+      }
+      auto& corner = cells[rand1i(rng, (int)cells.size())];
+      auto  offset = vec3f{(float)corner.x, (float)corner.y, (float)corner.z};
+      points[k]    = bounds.min + (offset + rand3f(rng)) * cell;
+      if (sampling == csg_sampling::surface)
+        points[k] = project_surface(tape, points[k], cell * 1e-4f);
+    }
+  };
+  parallel_for_chunks((int)points.size(), draw, chunk);
+  eval_csg_batch(tape, {points.data(), points.size()}, values);
+}
@@ -0,0 +1,209 @@
+#pragma once
+#include <algorithm>
+#include <memory>
+#include <tuple>
+
+#include "parser.h"
+#include "raymarch.h"
+
+// Scenes of many separate objects, each a tree compiled on its own with its
+// material, so that rays march only the objects whose boxes they cross
+// rather than one union evaluated everywhere. A BVH over the boxes of the
+// objects, built with yocto_bvh, finds them for each ray, which marches them
+// nearest first and stops at the first one whose box starts past its hit.
+// Objects placed at different offsets share their tape.
+
+struct CsgObject {
+  std::shared_ptr<const CsgTape> tape    = {};
+  vec3f                          offset  = {0, 0, 0};  // of the tree
+  vec3f                          diffuse = {0.9, 0.3, 0.2};
+  bbox3f                         bounds  = invalidb3f;  // marched, as rays
+};
+
+struct CsgScene {
+  vector<CsgObject> objects = {};
+  bvh_tree          bvh     = {};  // over the bounds, see build_scene_bvh
+};
+
+// Adds an object from a tree, which should be optimized, and its compiled
+// tape. Rays move like the points of the tree (see raymarch) and march it
+// in its box grown as in frame_march, or in the unit box if it is unbounded.
+inline int add_object(CsgScene& scene, const CsgTree& csg,
+    std::shared_ptr<const CsgTape> tape, const vec3f& offset,
+    const vec3f& diffuse) {
+  auto& object   = scene.objects.emplace_back();
+  object.tape    = std::move(tape);
+  object.offset  = offset;
+  object.diffuse = diffuse;
+  auto& root     = csg.bounds[csg.root];
+  object.bounds  = is_bounded(root)
+                       ? bbox3f{root.min + 0.48f, root.max + 0.52f}
+                       : bbox3f{{0, 0, 0}, {1, 1, 1}};
+  object.bounds  = {object.bounds.min + offset, object.bounds.max + offset};
+  return (int)scene.objects.size() - 1;
+}
+
+// Builds the BVH over the boxes of the objects. yocto_bvh builds it over
+// the spheres around the boxes, then its nodes are fitted to the boxes.
+inline void build_scene_bvh(CsgScene& scene) {
+  auto points  = vector<int>(scene.objects.size());
+  auto centers = vector<vec3f>(scene.objects.size());
+  auto radius  = vector<float>(scene.objects.size());
+  for (auto k = 0; k < scene.objects.size(); k++) {
+    auto& bounds = scene.objects[k].bounds;
+    points[k]    = k;
+    centers[k]   = center(bounds);
+    radius[k]    = length(bounds.max - bounds.min) / 2;
+  }
+  scene.bvh = {};
+  if (points.empty()) return;
+  make_points_bvh(scene.bvh, points, centers, radius);
+  // children follow their parents
+  for (auto n = (int)scene.bvh.nodes.size() - 1; n >= 0; n--) {
+    auto& node = scene.bvh.nodes[n];
+    auto& bvh  = scene.bvh;
+    if (node.internal) {
+      node.bbox = merge(bvh.nodes[node.start].bbox,
+          bvh.nodes[node.start + 1].bbox);
+      continue;
+    }
+    node.bbox = invalidb3f;
+    for (auto k = 0; k < node.num; k++)
+      node.bbox = merge(node.bbox,
+          scene.objects[bvh.primitives[node.start + k]].bounds);
+  }
+}
+
+// Objects whose boxes the ray crosses, as the range of the ray in the box
+// and the object, nearest first.
+inline void scene_candidates(const CsgScene& scene, const ray3f& ray,
+    vector<std::tuple<float, float, int>>& candidates) {
+  candidates.clear();
+  if (scene.bvh.nodes.empty()) return;
+  auto stack = CsgBvhStack{};
+  stack.push(0);
+  while (!stack.empty()) {
+    auto& node = scene.bvh.nodes[stack.pop()];
+    auto  tmin = 0.0f, tmax = 0.0f;
+    if (!intersect_bbox(ray, node.bbox, tmin, tmax)) continue;
+    if (node.internal) {
+      stack.push(node.start);
+      stack.push(node.start + 1);
+      continue;
+    }
+    for (auto k = 0; k < node.num; k++) {
+      auto index = scene.bvh.primitives[node.start + k];
+      if (intersect_bbox(ray, scene.objects[index].bounds, tmin, tmax))
+        candidates.push_back({tmin, tmax, index});
+    }
+  }
+  std::sort(candidates.begin(), candidates.end());
+}
+
+// Eyelight of the nearest hit among the objects that the ray crosses. Each
+// object is marched in its box as in raymarch, and rays that enter a box
+// and hit nothing are escaped.
+inline vec3f raymarch_scene(const CsgScene& scene, const march_params& march,
+    const ray3f& ray, int& steps) {
+  thread_local auto candidates = vector<std::tuple<float, float, int>>{};
+  scene_candidates(scene, ray, candidates);
+  steps         = 0;
+  auto nearest  = flt_max;
+  auto radiance = vec3f{0, 0, 0};
+  for (auto [tmin, tmax, index] : candidates) {
+    if (tmin >= nearest) break;
+    auto& object    = scene.objects[index];
+    auto& tape      = *object.tape;
+    auto  registers = tape_registers<float>(tape);
+    auto  params    = march;
+    params.bounds   = object.bounds;
+    auto  state     = march_state{};
+    if (!init_march(state, ray, params)) continue;
+    auto event = march_event::marching;
+    while (event == march_event::marching) {
+      auto p = state.position - object.offset - vec3f(0.5);
+      event  = march_step(
+          state, eval_tape(registers, tape, p) / tape.lipschitz);
+    }
+    steps += state.steps;
+    if (event == march_event::escaped) {
+      if (nearest == flt_max)
+        radiance = march_radiance(tape, nullptr, state, event);
+      continue;
+    }
+    auto t = state.offset + state.t;
+    if (t >= nearest) continue;
+    nearest = t;
+    if (event == march_event::exhausted) {
+      radiance = march_radiance(tape, nullptr, state, event);
+      continue;
+    }
+    auto moved = state;
+    moved.position -= object.offset;
+    moved.ray.o -= object.offset;
+    radiance = eyelight(tape, nullptr, moved.ray, moved.position,
+        object.diffuse);
+  }
+  return radiance;
+}
+
+// Image of the scene, a tile at a time as in raymarch_image.
+inline image<vec4f> raymarch_scene_image(const trace_camera& camera,
+    const CsgScene& scene, const march_params& march,
+    const trace_params& params, march_stats* stats = nullptr) {
+  auto state = march_buffer{};
+  init_state(state, camera, params);
+  auto render = image{state.size(), zero4f};
+  auto tiles  = make_tiles(render.size());
+  parallel_for_tiles(tiles, [&](CsgTile& tile) {
+    for (; tile.samples < params.samples; tile.samples++) {
+      for (auto j = tile.min.y; j < tile.max.y; j++) {
+        for (auto i = tile.min.x; i < tile.max.x; i++) {
+          auto ray      = sample_ray(state, camera, {i, j}, march.sampler);
+          auto steps    = 0;
+          auto radiance = raymarch_scene(scene, march, ray, steps);
+          if (stats) {
+            stats->rays += 1;
+            stats->steps += steps;
+          }
+          render[{i, j}] = accumulate_sample(
+              state, {i, j}, radiance, params);
+        }
+      }
+    }
+  });
+  return render;
+}
+
+// Loads a scene, one object per line as the filename of its tree, relative
+// to the scene, its color and optionally its offset, e.g.
+// `bolt.csg 0.8 0.8 0.9 0.1 0 0`. Lines starting with `#` are skipped. Each
+// file is loaded and compiled once, whatever the objects it places.
+inline CsgScene load_scene(const string& filename) {
+  auto fs     = open_file(filename, "rb");
+  auto folder = std::filesystem::path{filename}.parent_path();
+  auto scene  = CsgScene{};
+  auto trees  = unordered_map<string,
+      pair<CsgTree, std::shared_ptr<const CsgTape>>>{};
+  char buffer[4096];
+  while (read_line(fs, buffer, sizeof(buffer))) {
+    auto str = string_view{buffer};
+    skip_comment(str);
+    skip_whitespace(str);
+    if (str.empty()) continue;
+    auto name    = string{};
+    auto diffuse = vec3f{}, offset = vec3f{0, 0, 0};
+    parse_value(str, name);
+    parse_value(str, diffuse);
+    skip_whitespace(str);
+    if (!str.empty()) parse_value(str, offset);
+    auto& [csg, tape] = trees[name];
+    if (!tape) {
+      csg  = load_csg((folder / name).string());
+      tape = std::make_shared<const CsgTape>(compile_csg(csg));
+    }
+    add_object(scene, csg, tape, offset, diffuse);
+  }
+  build_scene_bvh(scene);
+  return scene;
+}
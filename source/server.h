@@ -0,0 +1,758 @@
+#pragma once
+#include <cctype>
+#include <cerrno>
+#include <filesystem>
+#include <future>
+#include <list>
+#include <unordered_map>
+
+#include "memory.h"
+#include "metrics.h"
+#include "parser.h"
+#include "remote.h"
+#include "tape_io.h"
+
+#ifdef CSG_REMOTE
+#include <fcntl.h>
+#endif
+
+// Render server, for previews of trees in tools that do not ship the app.
+// Scenes are the trees of the files in a folder, named by their path in
+// it, loaded and compiled on their first request and kept resident, up to
+// a count of scenes, evicting the one used least recently. Renders are
+// asked for with HTTP, e.g.
+//
+//   GET /render/shapes/head.csg?from=2,2,2&to=0.5,0.5,0.5&samples=16
+//
+// where the camera looks at `to` from `from` as in the cameras files of
+// csg_render, and the options default to those of init_camera, 256 pixels
+// and 16 samples. Answers stream the tiles of the image in a chunked
+// response after each doubling of their samples, so that clients show the
+// image as it converges. A tile is 6 32-bit integers, its first pixel, its
+// size, its samples and whether it is done, followed by its pixels as 8-bit
+// sRGB and alpha, by rows. Tiles are done once they have all the samples,
+// or once the noise of their pixels is below `error`, see tile_error.
+//
+// Requests are rendered together, whatever their scenes, in rounds that
+// refine their tiles on the pool by up to 8 samples, and that stream the
+// tiles after each round, taking new requests in between, see
+// schedule_tiles. Requests are interactive, the default, or batch, as
+// asked for with `priority=batch`: interactive requests refine all their
+// tiles in every round, the ones closest to their deadline first, while
+// batch requests share a budget of tiles per round by their `weight`, the
+// whole pool when no interactive request waits, so that long renders fill
+// the idle threads without delaying previews. A request is read per
+// connection, which is closed after the answer. Scenes load on the pool,
+// and answers are queued and written as clients read them, so that neither
+// new scenes nor slow clients hold up the other requests. Servers listen on
+// the loopback address unless `host` is set. Only POSIX sockets are
+// supported.
+//
+// Servers sharing a machine can be limited, see CsgJob: rounds run as jobs
+// of `threads` threads, resident scenes and the buffers of the requests
+// share a budget of `memory` bytes, evicting scenes and leaving requests
+// waiting beyond it, and requests older than `time` seconds end with the
+// samples they have, their tiles sent as done.
+//
+// GET /metrics answers the counters of the server in the Prometheus text
+// format, see write_metrics: the requests waiting, the tiles, rays and
+// steps rendered, the hits of the resident scenes, the bytes of their trees
+// and tapes, and the quantiles of the durations of the requests. Counters
+// are kept per thread, see metrics.h. Scrapes are answered between batches,
+// like renders.
+
+// Tree of a file of the folder, compiled once.
+struct CsgServerScene {
+  string  id   = "";  // path in the folder
+  Csg     csg  = {};
+  CsgTape tape = {};
+  CsgJit  jit  = {};
+  CsgReplicas<CsgTape> tapes = {};  // of tape per node, see make_replicas
+};
+
+struct CsgServerRequest {
+  int          socket   = -1;
+  int64_t      start    = 0;  // ns, when it was read
+  string       scene    = "";
+  trace_camera camera   = {};
+  trace_params params   = {};
+  csg_priority priority = csg_priority::interactive;  // background for batch
+  float        weight   = 1;  // share of the tiles of batch requests
+  float        deadline = 0;  // seconds of each round, 0 for the server's
+};
+
+struct CsgServer {
+  std::filesystem::path     folder   = ".";
+  int                       capacity = 8;  // resident scenes
+  float                     error    = 0;  // noise of done tiles, 0 for none
+  int                       threads  = 0;  // of each round, 0 for all
+  size_t                    memory   = 0;  // bytes, 0 for no limit
+  double                    time     = 0;  // seconds per request, 0 for any
+  float                     deadline = 0.1f;  // of interactive rounds
+  string                    host     = "";  // see listen_workers
+  std::list<std::shared_ptr<CsgServerScene>> scenes = {};  // most recent first
+};
+
+// Bytes of a resident scene, with the copies of its tape per node.
+inline size_t scene_bytes(const CsgServerScene& scene) {
+  return memory_bytes(scene.csg) +
+         memory_bytes(scene.tape) * (1 + scene.tapes.copies.size());
+}
+
+// Bytes of the buffers of the render of a request, see start_job.
+inline size_t request_bytes(const CsgServerRequest& request) {
+  auto size = camera_size(request.camera, request.params.resolution);
+  return render_buffer_bytes(size) + (size_t)size.x * size.y * sizeof(float);
+}
+
+// Bytes of a percent-encoded string, or false if an escape is cut short.
+inline bool decode_url(string_view str, string& decoded) {
+  decoded.clear();
+  for (auto i = 0; i < str.size(); i++) {
+    if (str[i] == '+') {
+      decoded += ' ';
+    } else if (str[i] != '%') {
+      decoded += str[i];
+    } else {
+      if (i + 2 >= str.size() || !isxdigit(str[i + 1]) ||
+          !isxdigit(str[i + 2]))
+        return false;
+      decoded += (char)std::stoi(string{str.substr(i + 1, 2)}, nullptr, 16);
+      i += 2;
+    }
+  }
+  return true;
+}
+
+// Request of the header of an HTTP GET. Returns false with `error` set to
+// the status of the answer if it is not a render of a scene of the folder.
+inline bool parse_render_request(
+    string_view header, CsgServerRequest& request, string& error) {
+  error    = "400 Bad Request";
+  auto end = header.find("\r\n");
+  auto line = header.substr(0, end);
+  if (line.substr(0, 4) != "GET ") {
+    error = "405 Method Not Allowed";
+    return false;
+  }
+  line.remove_prefix(4);
+  auto target = line.substr(0, line.find(' '));
+  auto prefix = string_view{"/render/"};
+  if (target.substr(0, prefix.size()) != prefix) {
+    error = "404 Not Found";
+    return false;
+  }
+  target.remove_prefix(prefix.size());
+  auto question = target.find('?');
+  auto query    = question == string_view::npos ? string_view{}
+                                                : target.substr(question + 1);
+  if (!decode_url(target.substr(0, question), request.scene)) return false;
+  // scenes stay in the folder
+  auto path = std::filesystem::path{request.scene}.lexically_normal();
+  if (request.scene.empty() || path.is_absolute() ||
+      path.begin()->string() == "..")
+    return false;
+
+  auto from = vec3f{2, 2, 2}, to = vec3f{0.5, 0.5, 0.5};
+  request.params            = {};
+  request.params.resolution = 256;
+  request.params.samples    = 16;
+  while (!query.empty()) {
+    auto amp   = query.find('&');
+    auto pair  = query.substr(0, amp);
+    auto equal = pair.find('=');
+    auto key   = pair.substr(0, equal);
+    auto value = string{};
+    query      = amp == string_view::npos ? string_view{}
+                                          : query.substr(amp + 1);
+    if (equal == string_view::npos ||
+        !decode_url(pair.substr(equal + 1), value))
+      return false;
+    std::replace(value.begin(), value.end(), ',', ' ');
+    auto str = string_view{value};
+    try {
+      if (key == "from") parse_value(str, from);
+      if (key == "to") parse_value(str, to);
+      if (key == "resolution") parse_value(str, request.params.resolution);
+      if (key == "samples") parse_value(str, request.params.samples);
+      if (key == "weight") parse_value(str, request.weight);
+      if (key == "deadline") parse_value(str, request.deadline);
+    } catch (std::exception&) {
+      return false;
+    }
+    if (key == "priority" && value != "interactive" && value != "batch")
+      return false;
+    if (key == "priority")
+      request.priority = value == "batch" ? csg_priority::background
+                                          : csg_priority::interactive;
+  }
+  if (from == to || request.params.resolution < 1 ||
+      request.params.resolution > 4096 || request.params.samples < 1 ||
+      request.params.samples > 4096 || !(request.weight > 0) ||
+      request.weight > 1000 || !(request.deadline >= 0))
+    return false;
+  request.camera       = init_camera();
+  request.camera.frame = lookat_frame(from, to, {0, 1, 0});
+  request.camera.focus = length(from - to);
+  return true;
+}
+
+// Scene of the id if it is resident, moved first.
+inline std::shared_ptr<CsgServerScene> find_scene(
+    CsgServer& server, const string& id) {
+  auto& scenes = server.scenes;
+  for (auto it = scenes.begin(); it != scenes.end(); it++) {
+    if ((*it)->id != id) continue;
+    scenes.splice(scenes.begin(), scenes, it);
+    return scenes.front();
+  }
+  return nullptr;
+}
+
+// Scene of a file of the folder, loaded and compiled. It runs on the pool,
+// so it reads nothing of the server. Returns null with `error` set if the
+// file cannot be loaded.
+inline std::shared_ptr<CsgServerScene> load_scene(
+    const std::filesystem::path& folder, const string& id, string& error) {
+  auto scene = std::make_shared<CsgServerScene>();
+  scene->id  = id;
+  try {
+    scene->csg = load_csg((folder / id).string());
+  } catch (std::exception& exception) {
+    error = exception.what();
+    return nullptr;
+  }
+  if (scene->csg.root < 0) {
+    error = id + ": empty tree";
+    return nullptr;
+  }
+  scene->tape  = compile_csg_cached(scene->csg);
+  scene->jit   = compile_jit(scene->tape);
+  scene->tapes = make_replicas(scene->tape);
+  return scene;
+}
+
+// Makes the scene resident, first, evicting the ones used least recently
+// beyond the capacity. Requests that render evicted scenes keep them until
+// they are done.
+inline void add_scene(
+    CsgServer& server, std::shared_ptr<CsgServerScene> scene) {
+  auto& scenes = server.scenes;
+  scenes.push_front(std::move(scene));
+  auto bytes = (size_t)0;
+  for (auto& scene : scenes) bytes += scene_bytes(*scene);
+  while (scenes.size() > 1 &&
+         (scenes.size() > (size_t)yocto::max(server.capacity, 1) ||
+             (server.memory && bytes > server.memory))) {
+    bytes -= scene_bytes(*scenes.back());
+    scenes.pop_back();
+  }
+}
+
+// Counters of the server in the Prometheus text format, with the gauges of
+// the requests waiting and of the resident scenes.
+inline string write_metrics(const CsgServer& server, int waiting) {
+  auto text   = string{};
+  auto metric = [&text](const char* name, const char* type,
+                    const char* help, const string& value,
+                    const char* labels = "") {
+    text += string{"# HELP "} + name + " " + help + "\n# TYPE " + name + " " +
+            type + "\n" + name + labels + " " + value + "\n";
+  };
+  auto counter = [&](const char* name, const char* help, csg_counter which) {
+    metric(name, "counter", help, std::to_string(read_metric(which)));
+  };
+  counter("csg_requests_total", "Render requests read.",
+      csg_counter::requests);
+  counter("csg_request_failures_total", "Requests answered with errors.",
+      csg_counter::failures);
+  counter("csg_tiles_total", "Passes over tiles rendered.",
+      csg_counter::tiles);
+  counter("csg_rays_total", "Rays marched.", csg_counter::rays);
+  counter("csg_march_steps_total", "Steps of the marched rays.",
+      csg_counter::steps);
+  counter("csg_scene_hits_total", "Requests for resident scenes.",
+      csg_counter::scene_hits);
+  counter("csg_scene_misses_total", "Scenes loaded and compiled.",
+      csg_counter::scene_misses);
+  metric("csg_queue_requests", "gauge", "Requests waiting for a render.",
+      std::to_string(waiting));
+  metric("csg_scenes_resident", "gauge", "Scenes kept compiled.",
+      std::to_string(server.scenes.size()));
+
+  // trees and tapes, with the copies of the tapes per node
+  auto trees = (size_t)0, tapes = (size_t)0;
+  for (auto& scene : server.scenes) {
+    trees += memory_bytes(scene->csg);
+    tapes += scene_bytes(*scene) - memory_bytes(scene->csg);
+  }
+  text += "# HELP csg_memory_bytes Bytes held by each subsystem.\n"
+          "# TYPE csg_memory_bytes gauge\n";
+  text += "csg_memory_bytes{subsystem=\"trees\"} " + std::to_string(trees) +
+          "\n";
+  text += "csg_memory_bytes{subsystem=\"tapes\"} " + std::to_string(tapes) +
+          "\n";
+  metric("csg_peak_resident_bytes", "gauge", "Peak resident memory.",
+      std::to_string(peak_memory() * 1024));
+
+  auto durations = read_durations();
+  text += "# HELP csg_request_duration_seconds Durations of the requests.\n"
+          "# TYPE csg_request_duration_seconds summary\n";
+  for (auto q : {0.5, 0.9, 0.99}) {
+    char line[128];
+    snprintf(line, sizeof(line),
+        "csg_request_duration_seconds{quantile=\"%g\"} %g\n", q,
+        duration_quantile(durations, q));
+    text += line;
+  }
+  char line[128];
+  snprintf(line, sizeof(line),
+      "csg_request_duration_seconds_sum %g\n"
+      "csg_request_duration_seconds_count %llu\n",
+      durations.sum, (unsigned long long)durations.count);
+  text += line;
+  return text;
+}
+
+// Whether the header asks for the metrics, see write_metrics.
+inline bool is_metrics_request(string_view header) {
+  auto line = header.substr(0, header.find("\r\n"));
+  return line.substr(0, 13) == "GET /metrics " || line == "GET /metrics";
+}
+
+#ifdef CSG_REMOTE
+
+// Connection of a client. Sockets do not block: answers are queued and
+// written as the client reads them, so that slow clients do not hold up the
+// others. A request is read per connection, and the connection is closed
+// once its answer is written, or once writing fails.
+struct CsgServerClient {
+  string header  = "";     // read so far
+  string output  = "";     // queued, written up to `written`
+  size_t written = 0;
+  bool   busy    = false;  // while its request waits or renders
+  bool   done    = false;  // nothing to add to `output`
+  bool   failed  = false;  // the client left
+};
+
+inline size_t queued_bytes(const CsgServerClient& client) {
+  return client.output.size() - client.written;
+}
+
+// Writes what the socket takes of the queue. Returns false if it failed.
+inline bool flush_client(int socket, CsgServerClient& client) {
+  while (queued_bytes(client) > 0) {
+    auto sent = send(socket, client.output.data() + client.written,
+        queued_bytes(client), MSG_NOSIGNAL);
+    if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+    if (sent < 0 && errno == EINTR) continue;
+    if (sent <= 0) return false;
+    client.written += sent;
+  }
+  if (client.written == client.output.size()) {
+    client.output.clear();
+    client.written = 0;
+  }
+  return true;
+}
+
+inline void send_status(
+    CsgServerClient& client, const string& status, const string& body = "") {
+  auto text = body.empty() ? status + "\n" : body + "\n";
+  client.output += "HTTP/1.1 " + status +
+                   "\r\nContent-Type: text/plain\r\nContent-Length: " +
+                   std::to_string(text.size()) +
+                   "\r\nAccess-Control-Allow-Origin: *\r\n"
+                   "Connection: close\r\n\r\n" +
+                   text;
+  client.done = true;
+}
+
+inline void send_chunk(CsgServerClient& client, const vector<uint8_t>& data) {
+  char size[32];
+  snprintf(size, sizeof(size), "%zx\r\n", data.size());
+  client.output += size;
+  client.output.append((const char*)data.data(), data.size());
+  client.output += "\r\n";
+}
+
+// Render of a request, refined by the rounds of run_server.
+struct CsgServerJob {
+  CsgServerRequest                      request  = {};
+  std::shared_ptr<const CsgServerScene> scene    = {};
+  march_params                          march    = {};
+  march_buffer                          state    = {};
+  image<vec4f>                          render   = {};
+  image<float>                          moments  = {};
+  vector<CsgTile>                       tiles    = {};
+  vector<bool>                          done     = {};  // per tile
+  int                                   left     = 0;   // tiles not done
+  int                                   target   = 1;   // samples of the pass
+  int                                   next     = 0;   // tile of the pass
+  double                                credit   = 0;   // of batch requests
+  int64_t                               deadline = 0;   // ns, of the round
+  CsgServerClient*                      client   = nullptr;
+  bool                                  blocked  = false;  // see run_server
+};
+
+// Seconds of the rounds of the request.
+inline float round_deadline(
+    const CsgServer& server, const CsgServerRequest& request) {
+  return request.deadline > 0 ? request.deadline : server.deadline;
+}
+
+// Starts the render of the request, queueing the header of its stream to
+// the client.
+inline void start_job(const CsgServer& server, CsgServerJob& job,
+    std::shared_ptr<const CsgServerScene> scene,
+    const CsgServerRequest& request, CsgServerClient& client) {
+  job.request = request;
+  job.scene   = std::move(scene);
+  job.client  = &client;
+  init_state(job.state, request.camera, request.params);
+  job.march    = frame_march(
+      {}, job.scene->csg, request.camera, request.params, true);
+  job.render   = image{job.state.size(), zero4f};
+  job.moments  = image{job.state.size(), 0.0f};
+  job.tiles    = make_tiles(job.state.size(), 16, tile_order::center);
+  job.done.assign(job.tiles.size(), false);
+  job.left     = (int)job.tiles.size();
+  job.deadline = request.start +
+                 (int64_t)(round_deadline(server, request) * 1e9);
+  client.output +=
+      "HTTP/1.1 200 OK\r\nContent-Type: application/octet-stream\r\n"
+      "Transfer-Encoding: chunked\r\nAccess-Control-Allow-Origin: *\r\n"
+      "Connection: close\r\n\r\n";
+}
+
+// Tiles of the next round, as job and tile, in the order the pool takes
+// them. Interactive requests refine all the tiles of their pass, those
+// whose deadline comes first before the others. Batch requests follow by
+// deficit round robin: each adds its share of the budget of the round to
+// its credit, by weight, and refines a tile of its pass per unit of credit.
+// The budget is of 2 tiles per thread while interactive requests wait, so
+// that their rounds stay short, and of 8 otherwise.
+inline vector<pair<int, int>> schedule_tiles(
+    const CsgServer& server, vector<CsgServerJob>& jobs) {
+  auto interactive = vector<int>{}, batch = vector<int>{};
+  auto weights     = 0.0;
+  for (auto k = 0; k < jobs.size(); k++) {
+    if (!jobs[k].left || jobs[k].blocked) continue;
+    if (jobs[k].request.priority == csg_priority::interactive) {
+      interactive.push_back(k);
+    } else {
+      batch.push_back(k);
+      weights += jobs[k].request.weight;
+    }
+  }
+  std::sort(interactive.begin(), interactive.end(),
+      [&jobs](int a, int b) { return jobs[a].deadline < jobs[b].deadline; });
+  auto items   = vector<pair<int, int>>{};
+  auto pending = [](const CsgServerJob& job, int t) {
+    return !job.done[t] && job.tiles[t].samples < job.target;
+  };
+  for (auto k : interactive)
+    for (auto t = 0; t < jobs[k].tiles.size(); t++)
+      if (pending(jobs[k], t)) items.push_back({k, t});
+  auto budget = (interactive.empty() ? 8 : 2) * pool_threads(get_pool());
+  for (auto k : batch) {
+    auto& job  = jobs[k];
+    job.credit = std::min(
+        job.credit + budget * job.request.weight / weights, (double)budget);
+    while (job.credit >= 1) {
+      while (job.next < job.tiles.size() && !pending(job, job.next))
+        job.next++;
+      if (job.next == job.tiles.size()) break;
+      items.push_back({k, job.next++});
+      job.credit -= 1;
+    }
+  }
+  return items;
+}
+
+// Renders a round of the jobs, see schedule_tiles, and queues the tiles it
+// refined to their clients. Jobs whose tiles are all done are left with
+// none. Jobs that are blocked are skipped.
+inline void render_round(CsgServer& server, vector<CsgServerJob>& jobs) {
+  auto items = schedule_tiles(server, jobs);
+  parallel_for((int)items.size(), [&](int item) {
+    auto [k, t]   = items[item];
+    auto& job     = jobs[k];
+    auto& request = job.request;
+    auto& tile    = job.tiles[t];
+    auto  samples = yocto::min(job.target, request.params.samples);
+    auto& tape    = local_replica(job.scene->tapes);
+    auto  stats   = march_stats{};  // of the item, so threads share none
+    for (; tile.samples < samples; tile.samples++)
+      raymarch_tile(tape, job.scene->jit, nullptr, job.march, job.state,
+          request.camera, tile, request.params, job.render, nullptr, &stats,
+          &job.moments);
+    tile.error = tile_error(tile, job.state, job.moments);
+    count_metric(csg_counter::tiles);
+    count_metric(csg_counter::rays, stats.rays);
+    count_metric(csg_counter::steps, stats.steps);
+  }, csg_priority::interactive);
+
+  // requests over their time end with the samples they have
+  const auto max_batch = 8;
+  auto       now       = get_time();
+  auto       data      = vector<uint8_t>{};
+  auto       sent      = vector<int>{};
+  for (auto k = 0; k < jobs.size(); k++) {
+    auto& job = jobs[k];
+    if (!job.left) continue;
+    auto& request = job.request;
+    auto  expired = server.time > 0 &&
+                   (now - request.start) * 1e-9 > server.time;
+    sent.clear();
+    if (expired) {
+      for (auto t = 0; t < job.tiles.size(); t++)
+        if (!job.done[t]) sent.push_back(t);
+    } else {
+      for (auto [owner, t] : items)
+        if (owner == k) sent.push_back(t);
+    }
+    data.clear();
+    for (auto t : sent) {
+      auto& tile = job.tiles[t];
+      auto  done = tile.samples >= request.params.samples ||
+                  (server.error > 0 && tile.error < server.error) || expired;
+      auto  size = tile.max - tile.min;
+      for (auto value : {tile.min.x, tile.min.y, size.x, size.y,
+               tile.samples, (int)done})
+        write_value(data, (int32_t)value);
+      for (auto j = tile.min.y; j < tile.max.y; j++) {
+        for (auto i = tile.min.x; i < tile.max.x; i++) {
+          auto color = float_to_byte(rgb_to_srgb(job.render[{i, j}]));
+          data.insert(data.end(), {color.x, color.y, color.z, color.w});
+        }
+      }
+      job.done[t] = done;
+      job.left -= done;
+    }
+    if (!sent.empty()) send_chunk(*job.client, data);
+    if (!sent.empty() && job.left == 0) send_chunk(*job.client, {});
+
+    // passes end once all their tiles are refined, and add samples to the
+    // tiles up to a batch of max_batch
+    auto finished = true;
+    for (auto t = 0; t < job.tiles.size() && finished; t++)
+      finished = job.done[t] || job.tiles[t].samples >= job.target;
+    if (finished) {
+      job.target = yocto::min(job.target + yocto::min(job.target, max_batch),
+          request.params.samples);
+      job.next   = 0;
+    }
+    job.deadline = now + (int64_t)(round_deadline(server, request) * 1e9);
+  }
+}
+
+// Serves the scenes of the folder on `port` until it fails, which returns
+// false with `error` set. Requests wait until their scene is loaded, on the
+// pool while the other requests go on, and until the memory left by the
+// resident scenes and the requests being rendered fits their buffers. Jobs
+// are not refined while their clients have more than `max_queued` bytes to
+// read.
+inline bool run_server(CsgServer& server, int port, string& error) {
+  auto listener = listen_workers(port, error, server.host);
+  if (listener < 0) return false;
+  struct scene_load {
+    string                          id     = "";
+    std::shared_ptr<CsgServerScene> scene  = {};
+    string                          error  = "";
+    std::future<void>               future = {};  // invalid once done
+  };
+  struct waiting {
+    CsgServerRequest                      request = {};
+    std::shared_ptr<const CsgServerScene> scene   = {};  // found once
+    std::shared_ptr<scene_load>           load    = {};
+  };
+  const auto max_queued = (size_t)1 << 23;
+  auto       clients    = std::unordered_map<int, CsgServerClient>{};
+  auto       loads      = vector<std::shared_ptr<scene_load>>{};
+  auto       pending    = vector<waiting>{};
+  auto       jobs       = vector<CsgServerJob>{};
+  auto       fds        = vector<pollfd>{};
+  auto       ended      = false;  // jobs, so that requests may start
+  char       buffer[4096];
+  while (true) {
+    auto ready = false;
+    for (auto& job : jobs) {
+      job.blocked = queued_bytes(*job.client) > max_queued;
+      ready       = ready || !job.blocked;
+    }
+    fds.assign(1, {listener, POLLIN, 0});
+    for (auto& [socket, client] : clients) {
+      auto events = (short)0;
+      if (!client.busy && !client.done) events |= POLLIN;
+      if (queued_bytes(client)) events |= POLLOUT;
+      fds.push_back({socket, events, 0});
+    }
+    auto timeout = ready || (ended && !pending.empty()) ? 0
+                   : !loads.empty()                     ? 10
+                                                        : -1;
+    if (poll(fds.data(), fds.size(), timeout) < 0) continue;
+    if (fds[0].revents & POLLIN) {
+      auto connected = accept(listener, nullptr, nullptr);
+      if (connected >= 0) {
+        auto yes = 1;
+        setsockopt(connected, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+        fcntl(connected, F_SETFL, fcntl(connected, F_GETFL) | O_NONBLOCK);
+        clients[connected] = {};
+      }
+    }
+    for (auto k = 1; k < fds.size(); k++) {
+      auto& client = clients.at(fds[k].fd);
+      if (fds[k].revents & (POLLERR | POLLHUP | POLLNVAL) &&
+          !(fds[k].revents & POLLIN))
+        client.failed = true;
+      if (!(fds[k].revents & POLLIN) || client.busy || client.done) continue;
+      auto received = recv(fds[k].fd, buffer, sizeof(buffer), 0);
+      if (received < 0 && (errno == EAGAIN || errno == EINTR)) continue;
+      if (received <= 0) {
+        client.failed = true;
+        continue;
+      }
+      client.header.append(buffer, received);
+      auto end = client.header.find("\r\n\r\n");
+      if (end == string::npos && client.header.size() > 16384)
+        send_status(client, "431 Request Header Fields Too Large");
+      if (end == string::npos) continue;
+      auto request = CsgServerRequest{};
+      auto status  = string{};
+      if (is_metrics_request(client.header)) {
+        send_status(
+            client, "200 OK", write_metrics(server, (int)pending.size()));
+      } else if (parse_render_request(client.header, request, status)) {
+        request.socket = fds[k].fd;
+        request.start  = get_time();
+        client.busy    = true;
+        pending.push_back({request});
+        count_metric(csg_counter::requests);
+      } else {
+        send_status(client, status);
+        count_metric(csg_counter::requests);
+        count_metric(csg_counter::failures);
+      }
+    }
+
+    // loaded scenes become resident, and failed loads keep their error
+    for (auto& load : loads) {
+      if (load->future.wait_for(std::chrono::seconds{0}) !=
+          std::future_status::ready)
+        continue;
+      try {
+        load->future.get();
+      } catch (std::exception& exception) {
+        load->scene = nullptr;
+        load->error = exception.what();
+      }
+      if (load->scene) add_scene(server, load->scene);
+    }
+    loads.erase(std::remove_if(loads.begin(), loads.end(),
+                    [](auto& load) { return !load->future.valid(); }),
+        loads.end());
+
+    // requests start in order, as long as their buffers fit
+    auto fail = [](CsgServerClient& client, const CsgServerRequest& request,
+                    const string& status, const string& message) {
+      send_status(client, status, message);
+      count_metric(csg_counter::failures);
+      count_duration(get_time() - request.start);
+    };
+    for (auto& wait : pending) {
+      auto& request = wait.request;
+      auto& client  = clients.at(request.socket);
+      if (!wait.scene && !wait.load && !client.failed) {
+        wait.scene = find_scene(server, request.scene);
+        if (wait.scene) count_metric(csg_counter::scene_hits);
+      }
+      if (!wait.scene && !wait.load && !client.failed) {
+        for (auto& load : loads)
+          if (load->id == request.scene) wait.load = load;
+      }
+      if (!wait.scene && !wait.load && !client.failed) {
+        count_metric(csg_counter::scene_misses);
+        auto load    = std::make_shared<scene_load>();
+        load->id     = request.scene;
+        load->future = async_task(
+            [load, folder = server.folder]() {
+              load->scene = load_scene(folder, load->id, load->error);
+            },
+            csg_priority::background);
+        loads.push_back(load);
+        wait.load = load;
+      }
+      if (!client.failed && wait.load && wait.load->future.valid()) continue;
+      if (wait.load) wait.scene = wait.load->scene;
+      auto left = server.memory;
+      for (auto& resident : server.scenes)
+        left -= std::min(left, scene_bytes(*resident));
+      auto room = left;  // without the requests being rendered
+      for (auto& job : jobs)
+        left -= std::min(left, request_bytes(job.request));
+      auto bytes = request_bytes(request);
+      if (client.failed) {
+        count_duration(get_time() - request.start);
+      } else if (!wait.scene) {
+        fail(client, request, "404 Not Found", wait.load->error);
+      } else if (server.memory && bytes > room) {
+        fail(client, request, "503 Service Unavailable",
+            "render exceeds the memory budget");
+      } else if (server.memory && bytes > left) {
+        continue;  // waits for renders to end
+      } else {
+        jobs.emplace_back();
+        start_job(server, jobs.back(), wait.scene, request, client);
+      }
+      client.busy    = !client.done && !client.failed;
+      request.socket = -1;
+    }
+    pending.erase(std::remove_if(pending.begin(), pending.end(),
+                      [](auto& wait) { return wait.request.socket < 0; }),
+        pending.end());
+
+    for (auto& job : jobs)
+      if (job.client->failed) job.left = 0;
+    if (!jobs.empty()) {
+      auto job   = make_job(server.threads, server.memory, 0);
+      auto scope = CsgJobScope{job};
+      render_round(server, jobs);
+    }
+    ended = false;
+    for (auto& job : jobs) {
+      if (job.left) continue;
+      job.client->busy = false;
+      job.client->done = true;
+      ended            = true;
+      count_duration(get_time() - job.request.start);
+    }
+    jobs.erase(std::remove_if(jobs.begin(), jobs.end(),
+                   [](auto& job) { return job.left == 0; }),
+        jobs.end());
+
+    // answers are written as far as the sockets take them, and connections
+    // close once theirs are written
+    for (auto it = clients.begin(); it != clients.end();) {
+      auto& [socket, client] = *it;
+      if (!client.failed && !flush_client(socket, client))
+        client.failed = true;
+      if (client.busy ||
+          (!client.failed && (!client.done || queued_bytes(client)))) {
+        it++;
+        continue;
+      }
+      close(socket);
+      it = clients.erase(it);
+    }
+  }
+}
+
+#else
+
+inline bool run_server(CsgServer& server, int port, string& error) {
+  error = "the server needs POSIX sockets";
+  return false;
+}
+
+#endif
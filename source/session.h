@@ -0,0 +1,204 @@
+#pragma once
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include "jit.h"
+#include "raymarch.h"
+#include "tiles.h"
+//
+#include "ext/yocto-gl/yocto/ext/stb_image_write.h"
+
+// Progressive renders of a tree for a client that moves the camera, e.g.
+// the notebook widget of pycsg_widget.py, without a window. Views are asked
+// for with view_session from any thread and rendered by the thread of the
+// session: a new view stops the one being refined at its next tiles, and
+// the thread then takes the latest view, so views asked for meanwhile
+// merge, as in the viewer. Each view starts with a preview of fewer pixels,
+// whose samples the render keeps, see raymarch_preview, then refines its
+// tiles from the center out, doubling their samples up to a batch of 8 as
+// the viewer does. Tiles are encoded as JPEG after each batch and wait in
+// the session until poll_session takes them, so clients draw the image as
+// it converges. The preview is sent as a tile of the whole image.
+
+// Pixels of the view since the last poll, as JPEG in sRGB. The preview
+// covers the whole image with fewer pixels, and clients scale it.
+struct CsgSessionTile {
+  int             view    = 0;  // of the session, see view_session
+  vec2i           min     = {0, 0};
+  vec2i           size    = {0, 0};  // in pixels of the image
+  int             samples = 0;       // 0 for the preview
+  bool            done    = false;
+  vector<uint8_t> jpeg    = {};
+};
+
+struct CsgSession {
+  Csg                  csg       = {};
+  CsgTape              tape      = {};
+  CsgJit               jit       = {};
+  CsgReplicas<CsgTape> tapes     = {};  // of tape per node
+  trace_params         params    = {};
+  int                  downscale = 4;   // of the preview
+  int                  quality   = 80;  // of the JPEG tiles
+  float                error     = 0;   // noise of done tiles, 0 for none
+
+  // views asked for, and tiles to send, guarded by the mutex
+  std::mutex              mutex    = {};
+  std::condition_variable changed  = {};
+  trace_camera            camera   = {};
+  int                     view     = 0;  // latest asked for
+  int                     rendered = 0;  // latest taken by the thread
+  bool                    closed   = false;
+  vector<CsgSessionTile>  tiles    = {};
+  std::atomic<bool>       stop     = {};  // of the view being refined
+  std::thread             thread   = {};
+};
+
+// Pixels in [min, min + size) of the render as JPEG, in sRGB.
+inline vector<uint8_t> encode_jpeg(const image<vec4f>& render,
+    const vec2i& min, const vec2i& size, int quality) {
+  auto pixels = vector<uint8_t>{};
+  pixels.reserve((size_t)size.x * size.y * 3);
+  for (auto j = 0; j < size.y; j++) {
+    for (auto i = 0; i < size.x; i++) {
+      auto color = float_to_byte(rgb_to_srgb(render[min + vec2i{i, j}]));
+      pixels.insert(pixels.end(), {color.x, color.y, color.z});
+    }
+  }
+  auto jpeg  = vector<uint8_t>{};
+  auto write = [](void* context, void* data, int size) {
+    auto bytes = (vector<uint8_t>*)context;
+    bytes->insert(bytes->end(), (uint8_t*)data, (uint8_t*)data + size);
+  };
+  if (!stbi_write_jpg_to_func(
+          write, &jpeg, size.x, size.y, 3, pixels.data(), quality))
+    throw std::runtime_error{"cannot encode jpeg"};
+  return jpeg;
+}
+
+inline void send_tile(CsgSession& session, CsgSessionTile&& tile) {
+  auto lock = std::lock_guard{session.mutex};
+  session.tiles.push_back(std::move(tile));
+  session.changed.notify_all();
+}
+
+// Renders a view until it is done or a later one is asked for.
+inline void render_session_view(
+    CsgSession& session, const trace_camera& camera, int view) {
+  auto& params = session.params;
+  auto  march  = frame_march({}, session.csg, camera, params, true);
+  auto  state  = march_buffer{};
+  auto  starts = march_starts{};
+  auto  hits   = march_starts{};  // of the preview
+  march.cancel = &session.stop;
+  init_state(state, camera, params);
+  init_depths(starts, state.size());
+  auto size    = state.size();
+  auto moments = image{size, 0.0f};
+  auto preview = raymarch_preview(camera, session.tape, session.jit, nullptr,
+      march, params, session.downscale, state, hits, starts, &moments);
+  if (session.stop) return;
+  send_tile(session,
+      {view, {0, 0}, size, 0, false,
+          encode_jpeg(preview, {0, 0}, preview.size(), session.quality)});
+
+  auto render = image{size, zero4f};
+  auto tiles  = make_tiles(size, 32, tile_order::center);
+  auto done   = [&](const CsgTile& tile) {
+    return tile.samples >= params.samples ||
+           (session.error > 0 && tile.error <= session.error);
+  };
+  cone_march(starts, session.tape, session.jit, nullptr, camera, size);
+  const auto max_batch = 8;
+  for (auto target = 1, last = 0; last < params.samples;
+       last = target, target += yocto::min(target, max_batch)) {
+    if (all_of(tiles.begin(), tiles.end(), done)) break;
+    auto samples = yocto::min(target, params.samples);
+    parallel_for_tiles(
+        tiles,
+        [&](CsgTile& tile) {
+          if (done(tile)) return;
+          auto& tape = local_replica(session.tapes);
+          while (tile.samples < samples && !done(tile)) {
+            if (!raymarch_tile(tape, session.jit, nullptr, march, state,
+                    camera, tile, params, render, &starts, nullptr,
+                    &moments))
+              return;
+            tile.samples += 1;
+            tile.error = tile_error(tile, state, moments);
+          }
+          auto extent = tile.max - tile.min;
+          send_tile(session,
+              {view, tile.min, extent, tile.samples, done(tile),
+                  encode_jpeg(render, tile.min, extent, session.quality)});
+        },
+        csg_priority::interactive, &session.stop);
+    if (session.stop) return;
+  }
+}
+
+// Starts the thread of the session, which renders the views it is asked for
+// until close_session. The tree is compiled once.
+inline void start_session(CsgSession& session, const Csg& csg,
+    const trace_params& params) {
+  if (params.resolution < 1 || params.samples < 1)
+    throw std::invalid_argument{"resolution and samples must be positive"};
+  session.csg = csg;
+  update_bounds(session.csg);
+  session.params = params;
+  session.tape   = compile_csg(session.csg);
+  session.jit    = compile_jit(session.tape);
+  session.tapes  = make_replicas(session.tape);
+  session.thread = std::thread{[&session]() {
+    while (true) {
+      auto lock = std::unique_lock{session.mutex};
+      session.changed.wait(lock, [&session]() {
+        return session.closed || session.view != session.rendered;
+      });
+      if (session.closed) return;
+      auto camera      = session.camera;
+      auto view        = session.view;
+      session.rendered = view;
+      session.stop     = false;
+      lock.unlock();
+      render_session_view(session, camera, view);
+    }
+  }};
+}
+
+// Asks for a view, which replaces the one being rendered. Returns its
+// number, which the tiles of the view carry.
+inline int view_session(CsgSession& session, const trace_camera& camera) {
+  auto lock      = std::lock_guard{session.mutex};
+  session.camera = camera;
+  session.view += 1;
+  session.stop = true;
+  session.changed.notify_all();
+  return session.view;
+}
+
+// Tiles rendered since the last poll, waiting up to `timeout` seconds for
+// the first one. Tiles of views older than the latest are dropped.
+inline vector<CsgSessionTile> poll_session(
+    CsgSession& session, double timeout) {
+  auto lock = std::unique_lock{session.mutex};
+  session.changed.wait_for(lock,
+      std::chrono::duration<double>(timeout),
+      [&session]() { return session.closed || !session.tiles.empty(); });
+  auto tiles = vector<CsgSessionTile>{};
+  for (auto& tile : session.tiles)
+    if (tile.view == session.view) tiles.push_back(std::move(tile));
+  session.tiles.clear();
+  return tiles;
+}
+
+// Stops the render and joins the thread of the session.
+inline void close_session(CsgSession& session) {
+  {
+    auto lock      = std::lock_guard{session.mutex};
+    session.closed = true;
+    session.stop   = true;
+    session.changed.notify_all();
+  }
+  if (session.thread.joinable()) session.thread.join();
+}
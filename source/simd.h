@@ -0,0 +1,559 @@
+#pragma once
+#include <cmath>
+#include <type_traits>
+
+#if defined(__AVX512F__)
+#include <immintrin.h>
+#define CSG_SIMD_AVX512
+#define CSG_SIMD_ABI simd_avx512
+#elif defined(__AVX__)
+#include <immintrin.h>
+#define CSG_SIMD_AVX
+#define CSG_SIMD_ABI simd_avx
+#elif defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define CSG_SIMD_SSE
+#define CSG_SIMD_ABI simd_sse2
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define CSG_SIMD_NEON
+#define CSG_SIMD_ABI simd_neon
+#else
+#define CSG_SIMD_ABI simd_scalar
+#endif
+
+// Packets of 8 and 16 floats evaluated in lock-step. The storage follows the
+// widest instruction set enabled at compile time (AVX-512, AVX, SSE2 or NEON)
+// and falls back to plain arrays elsewhere. Masks are the result of packet
+// comparisons and are only used with select(), any() and all(). Packets live
+// in the yocto namespace so that the same min/max/abs/sqrt names resolve for
+// floats and packets.
+//
+// The inline namespace depends on the instruction set, so that files built
+// with different flags (see CSG_DISPATCH) get distinct packet types and the
+// code instantiated for them does not collide when linked together.
+
+namespace yocto {
+inline namespace CSG_SIMD_ABI {
+
+// -----------------------------------------------------------------------------
+// FLOAT8
+// -----------------------------------------------------------------------------
+#if defined(CSG_SIMD_AVX) || defined(CSG_SIMD_AVX512)
+
+struct float8 {
+  __m256 m;
+  float8() {}
+  float8(float a) : m{_mm256_set1_ps(a)} {}
+  float8(__m256 m) : m{m} {}
+  float operator[](int i) const {
+    alignas(32) float v[8];
+    _mm256_store_ps(v, m);
+    return v[i];
+  }
+};
+struct mask8 {
+  __m256 m;
+};
+
+inline float8 load8(const float* a) { return _mm256_loadu_ps(a); }
+inline void   store8(float* a, const float8& b) { _mm256_storeu_ps(a, b.m); }
+
+inline float8 operator+(const float8& a, const float8& b) {
+  return _mm256_add_ps(a.m, b.m);
+}
+inline float8 operator-(const float8& a, const float8& b) {
+  return _mm256_sub_ps(a.m, b.m);
+}
+inline float8 operator*(const float8& a, const float8& b) {
+  return _mm256_mul_ps(a.m, b.m);
+}
+inline float8 operator/(const float8& a, const float8& b) {
+  return _mm256_div_ps(a.m, b.m);
+}
+inline float8 operator-(const float8& a) {
+  return _mm256_xor_ps(a.m, _mm256_set1_ps(-0.0f));
+}
+inline float8 min(const float8& a, const float8& b) {
+  return _mm256_min_ps(a.m, b.m);
+}
+inline float8 max(const float8& a, const float8& b) {
+  return _mm256_max_ps(a.m, b.m);
+}
+inline float8 abs(const float8& a) {
+  return _mm256_andnot_ps(_mm256_set1_ps(-0.0f), a.m);
+}
+inline float8 sqrt(const float8& a) { return _mm256_sqrt_ps(a.m); }
+
+inline mask8 operator<(const float8& a, const float8& b) {
+  return {_mm256_cmp_ps(a.m, b.m, _CMP_LT_OQ)};
+}
+inline mask8 operator<=(const float8& a, const float8& b) {
+  return {_mm256_cmp_ps(a.m, b.m, _CMP_LE_OQ)};
+}
+inline mask8 operator>(const float8& a, const float8& b) {
+  return {_mm256_cmp_ps(a.m, b.m, _CMP_GT_OQ)};
+}
+inline mask8 operator>=(const float8& a, const float8& b) {
+  return {_mm256_cmp_ps(a.m, b.m, _CMP_GE_OQ)};
+}
+inline mask8 operator&(const mask8& a, const mask8& b) {
+  return {_mm256_and_ps(a.m, b.m)};
+}
+inline mask8 operator|(const mask8& a, const mask8& b) {
+  return {_mm256_or_ps(a.m, b.m)};
+}
+inline float8 select(const mask8& m, const float8& a, const float8& b) {
+  return _mm256_blendv_ps(b.m, a.m, m.m);
+}
+inline bool any(const mask8& m) { return _mm256_movemask_ps(m.m) != 0; }
+inline bool all(const mask8& m) { return _mm256_movemask_ps(m.m) == 0xff; }
+
+#elif defined(CSG_SIMD_SSE)
+
+struct float8 {
+  __m128 lo, hi;
+  float8() {}
+  float8(float a) : lo{_mm_set1_ps(a)}, hi{_mm_set1_ps(a)} {}
+  float8(__m128 lo, __m128 hi) : lo{lo}, hi{hi} {}
+  float operator[](int i) const {
+    alignas(16) float v[8];
+    _mm_store_ps(v, lo);
+    _mm_store_ps(v + 4, hi);
+    return v[i];
+  }
+};
+struct mask8 {
+  __m128 lo, hi;
+};
+
+inline float8 load8(const float* a) {
+  return {_mm_loadu_ps(a), _mm_loadu_ps(a + 4)};
+}
+inline void store8(float* a, const float8& b) {
+  _mm_storeu_ps(a, b.lo);
+  _mm_storeu_ps(a + 4, b.hi);
+}
+
+inline float8 operator+(const float8& a, const float8& b) {
+  return {_mm_add_ps(a.lo, b.lo), _mm_add_ps(a.hi, b.hi)};
+}
+inline float8 operator-(const float8& a, const float8& b) {
+  return {_mm_sub_ps(a.lo, b.lo), _mm_sub_ps(a.hi, b.hi)};
+}
+inline float8 operator*(const float8& a, const float8& b) {
+  return {_mm_mul_ps(a.lo, b.lo), _mm_mul_ps(a.hi, b.hi)};
+}
+inline float8 operator/(const float8& a, const float8& b) {
+  return {_mm_div_ps(a.lo, b.lo), _mm_div_ps(a.hi, b.hi)};
+}
+inline float8 operator-(const float8& a) {
+  auto sign = _mm_set1_ps(-0.0f);
+  return {_mm_xor_ps(a.lo, sign), _mm_xor_ps(a.hi, sign)};
+}
+inline float8 min(const float8& a, const float8& b) {
+  return {_mm_min_ps(a.lo, b.lo), _mm_min_ps(a.hi, b.hi)};
+}
+inline float8 max(const float8& a, const float8& b) {
+  return {_mm_max_ps(a.lo, b.lo), _mm_max_ps(a.hi, b.hi)};
+}
+inline float8 abs(const float8& a) {
+  auto sign = _mm_set1_ps(-0.0f);
+  return {_mm_andnot_ps(sign, a.lo), _mm_andnot_ps(sign, a.hi)};
+}
+inline float8 sqrt(const float8& a) {
+  return {_mm_sqrt_ps(a.lo), _mm_sqrt_ps(a.hi)};
+}
+
+inline mask8 operator<(const float8& a, const float8& b) {
+  return {_mm_cmplt_ps(a.lo, b.lo), _mm_cmplt_ps(a.hi, b.hi)};
+}
+inline mask8 operator<=(const float8& a, const float8& b) {
+  return {_mm_cmple_ps(a.lo, b.lo), _mm_cmple_ps(a.hi, b.hi)};
+}
+inline mask8 operator>(const float8& a, const float8& b) {
+  return {_mm_cmpgt_ps(a.lo, b.lo), _mm_cmpgt_ps(a.hi, b.hi)};
+}
+inline mask8 operator>=(const float8& a, const float8& b) {
+  return {_mm_cmpge_ps(a.lo, b.lo), _mm_cmpge_ps(a.hi, b.hi)};
+}
+inline mask8 operator&(const mask8& a, const mask8& b) {
+  return {_mm_and_ps(a.lo, b.lo), _mm_and_ps(a.hi, b.hi)};
+}
+inline mask8 operator|(const mask8& a, const mask8& b) {
+  return {_mm_or_ps(a.lo, b.lo), _mm_or_ps(a.hi, b.hi)};
+}
+inline float8 select(const mask8& m, const float8& a, const float8& b) {
+  return {_mm_or_ps(_mm_and_ps(m.lo, a.lo), _mm_andnot_ps(m.lo, b.lo)),
+      _mm_or_ps(_mm_and_ps(m.hi, a.hi), _mm_andnot_ps(m.hi, b.hi))};
+}
+inline bool any(const mask8& m) {
+  return (_mm_movemask_ps(m.lo) | _mm_movemask_ps(m.hi)) != 0;
+}
+inline bool all(const mask8& m) {
+  return (_mm_movemask_ps(m.lo) & _mm_movemask_ps(m.hi)) == 0xf;
+}
+
+#elif defined(CSG_SIMD_NEON)
+
+struct float8 {
+  float32x4_t lo, hi;
+  float8() {}
+  float8(float a) : lo{vdupq_n_f32(a)}, hi{vdupq_n_f32(a)} {}
+  float8(float32x4_t lo, float32x4_t hi) : lo{lo}, hi{hi} {}
+  float operator[](int i) const {
+    float v[8];
+    vst1q_f32(v, lo);
+    vst1q_f32(v + 4, hi);
+    return v[i];
+  }
+};
+struct mask8 {
+  uint32x4_t lo, hi;
+};
+
+inline float8 load8(const float* a) { return {vld1q_f32(a), vld1q_f32(a + 4)}; }
+inline void   store8(float* a, const float8& b) {
+  vst1q_f32(a, b.lo);
+  vst1q_f32(a + 4, b.hi);
+}
+
+inline float8 operator+(const float8& a, const float8& b) {
+  return {vaddq_f32(a.lo, b.lo), vaddq_f32(a.hi, b.hi)};
+}
+inline float8 operator-(const float8& a, const float8& b) {
+  return {vsubq_f32(a.lo, b.lo), vsubq_f32(a.hi, b.hi)};
+}
+inline float8 operator*(const float8& a, const float8& b) {
+  return {vmulq_f32(a.lo, b.lo), vmulq_f32(a.hi, b.hi)};
+}
+inline float8 operator/(const float8& a, const float8& b) {
+#if defined(__aarch64__)
+  return {vdivq_f32(a.lo, b.lo), vdivq_f32(a.hi, b.hi)};
+#else
+  float x[8], y[8];
+  store8(x, a);
+  store8(y, b);
+  for (auto i = 0; i < 8; i++) x[i] /= y[i];
+  return load8(x);
+#endif
+}
+inline float8 operator-(const float8& a) {
+  return {vnegq_f32(a.lo), vnegq_f32(a.hi)};
+}
+inline float8 min(const float8& a, const float8& b) {
+  return {vminq_f32(a.lo, b.lo), vminq_f32(a.hi, b.hi)};
+}
+inline float8 max(const float8& a, const float8& b) {
+  return {vmaxq_f32(a.lo, b.lo), vmaxq_f32(a.hi, b.hi)};
+}
+inline float8 abs(const float8& a) {
+  return {vabsq_f32(a.lo), vabsq_f32(a.hi)};
+}
+inline float8 sqrt(const float8& a) {
+#if defined(__aarch64__)
+  return {vsqrtq_f32(a.lo), vsqrtq_f32(a.hi)};
+#else
+  float x[8];
+  store8(x, a);
+  for (auto i = 0; i < 8; i++) x[i] = std::sqrt(x[i]);
+  return load8(x);
+#endif
+}
+
+inline mask8 operator<(const float8& a, const float8& b) {
+  return {vcltq_f32(a.lo, b.lo), vcltq_f32(a.hi, b.hi)};
+}
+inline mask8 operator<=(const float8& a, const float8& b) {
+  return {vcleq_f32(a.lo, b.lo), vcleq_f32(a.hi, b.hi)};
+}
+inline mask8 operator>(const float8& a, const float8& b) {
+  return {vcgtq_f32(a.lo, b.lo), vcgtq_f32(a.hi, b.hi)};
+}
+inline mask8 operator>=(const float8& a, const float8& b) {
+  return {vcgeq_f32(a.lo, b.lo), vcgeq_f32(a.hi, b.hi)};
+}
+inline mask8 operator&(const mask8& a, const mask8& b) {
+  return {vandq_u32(a.lo, b.lo), vandq_u32(a.hi, b.hi)};
+}
+inline mask8 operator|(const mask8& a, const mask8& b) {
+  return {vorrq_u32(a.lo, b.lo), vorrq_u32(a.hi, b.hi)};
+}
+inline float8 select(const mask8& m, const float8& a, const float8& b) {
+  return {vbslq_f32(m.lo, a.lo, b.lo), vbslq_f32(m.hi, a.hi, b.hi)};
+}
+inline bool any(const mask8& m) {
+  auto r = vorrq_u32(m.lo, m.hi);
+  auto h = vorr_u32(vget_low_u32(r), vget_high_u32(r));
+  return (vget_lane_u32(h, 0) | vget_lane_u32(h, 1)) != 0;
+}
+inline bool all(const mask8& m) {
+  auto r = vandq_u32(m.lo, m.hi);
+  auto h = vand_u32(vget_low_u32(r), vget_high_u32(r));
+  return (vget_lane_u32(h, 0) & vget_lane_u32(h, 1)) == 0xffffffffu;
+}
+
+#else
+
+struct float8 {
+  float v[8];
+  float8() {}
+  float8(float a) {
+    for (auto i = 0; i < 8; i++) v[i] = a;
+  }
+  float operator[](int i) const { return v[i]; }
+};
+struct mask8 {
+  bool v[8];
+};
+
+inline float8 load8(const float* a) {
+  auto c = float8{};
+  for (auto i = 0; i < 8; i++) c.v[i] = a[i];
+  return c;
+}
+inline void store8(float* a, const float8& b) {
+  for (auto i = 0; i < 8; i++) a[i] = b.v[i];
+}
+
+#define CSG_FLOAT8_BINARY(OP, EXPR)                            \
+  inline float8 OP(const float8& a, const float8& b) {         \
+    auto c = float8{};                                         \
+    for (auto i = 0; i < 8; i++) c.v[i] = EXPR;                \
+    return c;                                                  \
+  }
+#define CSG_FLOAT8_COMPARE(OP)                                 \
+  inline mask8 operator OP(const float8& a, const float8& b) { \
+    auto c = mask8{};                                          \
+    for (auto i = 0; i < 8; i++) c.v[i] = a.v[i] OP b.v[i];    \
+    return c;                                                  \
+  }
+CSG_FLOAT8_BINARY(operator+, a.v[i] + b.v[i])
+CSG_FLOAT8_BINARY(operator-, a.v[i] - b.v[i])
+CSG_FLOAT8_BINARY(operator*, a.v[i] * b.v[i])
+CSG_FLOAT8_BINARY(operator/, a.v[i] / b.v[i])
+CSG_FLOAT8_BINARY(min, a.v[i] < b.v[i] ? a.v[i] : b.v[i])
+CSG_FLOAT8_BINARY(max, a.v[i] > b.v[i] ? a.v[i] : b.v[i])
+CSG_FLOAT8_COMPARE(<)
+CSG_FLOAT8_COMPARE(<=)
+CSG_FLOAT8_COMPARE(>)
+CSG_FLOAT8_COMPARE(>=)
+#undef CSG_FLOAT8_BINARY
+#undef CSG_FLOAT8_COMPARE
+
+inline float8 operator-(const float8& a) { return float8{0} - a; }
+inline float8 abs(const float8& a) { return max(a, -a); }
+inline float8 sqrt(const float8& a) {
+  auto c = float8{};
+  for (auto i = 0; i < 8; i++) c.v[i] = std::sqrt(a.v[i]);
+  return c;
+}
+inline mask8 operator&(const mask8& a, const mask8& b) {
+  auto c = mask8{};
+  for (auto i = 0; i < 8; i++) c.v[i] = a.v[i] && b.v[i];
+  return c;
+}
+inline mask8 operator|(const mask8& a, const mask8& b) {
+  auto c = mask8{};
+  for (auto i = 0; i < 8; i++) c.v[i] = a.v[i] || b.v[i];
+  return c;
+}
+inline float8 select(const mask8& m, const float8& a, const float8& b) {
+  auto c = float8{};
+  for (auto i = 0; i < 8; i++) c.v[i] = m.v[i] ? a.v[i] : b.v[i];
+  return c;
+}
+inline bool any(const mask8& m) {
+  for (auto i = 0; i < 8; i++)
+    if (m.v[i]) return true;
+  return false;
+}
+inline bool all(const mask8& m) {
+  for (auto i = 0; i < 8; i++)
+    if (!m.v[i]) return false;
+  return true;
+}
+
+#endif
+
+// -----------------------------------------------------------------------------
+// FLOAT16
+// -----------------------------------------------------------------------------
+#if defined(CSG_SIMD_AVX512)
+
+struct float16 {
+  __m512 m;
+  float16() {}
+  float16(float a) : m{_mm512_set1_ps(a)} {}
+  float16(__m512 m) : m{m} {}
+  float operator[](int i) const {
+    alignas(64) float v[16];
+    _mm512_store_ps(v, m);
+    return v[i];
+  }
+};
+struct mask16 {
+  __mmask16 m;
+};
+
+inline float16 load16(const float* a) { return _mm512_loadu_ps(a); }
+inline void    store16(float* a, const float16& b) { _mm512_storeu_ps(a, b.m); }
+
+inline float16 operator+(const float16& a, const float16& b) {
+  return _mm512_add_ps(a.m, b.m);
+}
+inline float16 operator-(const float16& a, const float16& b) {
+  return _mm512_sub_ps(a.m, b.m);
+}
+inline float16 operator*(const float16& a, const float16& b) {
+  return _mm512_mul_ps(a.m, b.m);
+}
+inline float16 operator/(const float16& a, const float16& b) {
+  return _mm512_div_ps(a.m, b.m);
+}
+inline float16 operator-(const float16& a) {
+  return _mm512_sub_ps(_mm512_setzero_ps(), a.m);
+}
+inline float16 min(const float16& a, const float16& b) {
+  return _mm512_min_ps(a.m, b.m);
+}
+inline float16 max(const float16& a, const float16& b) {
+  return _mm512_max_ps(a.m, b.m);
+}
+inline float16 abs(const float16& a) { return _mm512_abs_ps(a.m); }
+inline float16 sqrt(const float16& a) { return _mm512_sqrt_ps(a.m); }
+
+inline mask16 operator<(const float16& a, const float16& b) {
+  return {_mm512_cmp_ps_mask(a.m, b.m, _CMP_LT_OQ)};
+}
+inline mask16 operator<=(const float16& a, const float16& b) {
+  return {_mm512_cmp_ps_mask(a.m, b.m, _CMP_LE_OQ)};
+}
+inline mask16 operator>(const float16& a, const float16& b) {
+  return {_mm512_cmp_ps_mask(a.m, b.m, _CMP_GT_OQ)};
+}
+inline mask16 operator>=(const float16& a, const float16& b) {
+  return {_mm512_cmp_ps_mask(a.m, b.m, _CMP_GE_OQ)};
+}
+inline mask16 operator&(const mask16& a, const mask16& b) {
+  return {(__mmask16)(a.m & b.m)};
+}
+inline mask16 operator|(const mask16& a, const mask16& b) {
+  return {(__mmask16)(a.m | b.m)};
+}
+inline float16 select(const mask16& m, const float16& a, const float16& b) {
+  return _mm512_mask_blend_ps(m.m, b.m, a.m);
+}
+inline bool any(const mask16& m) { return m.m != 0; }
+inline bool all(const mask16& m) { return m.m == 0xffff; }
+
+#else
+
+// Without AVX-512 a 16-wide packet is a pair of 8-wide packets.
+struct float16 {
+  float8 lo, hi;
+  float16() {}
+  float16(float a) : lo{a}, hi{a} {}
+  float16(const float8& lo, const float8& hi) : lo{lo}, hi{hi} {}
+  float operator[](int i) const { return i < 8 ? lo[i] : hi[i - 8]; }
+};
+struct mask16 {
+  mask8 lo, hi;
+};
+
+inline float16 load16(const float* a) { return {load8(a), load8(a + 8)}; }
+inline void    store16(float* a, const float16& b) {
+  store8(a, b.lo);
+  store8(a + 8, b.hi);
+}
+
+inline float16 operator+(const float16& a, const float16& b) {
+  return {a.lo + b.lo, a.hi + b.hi};
+}
+inline float16 operator-(const float16& a, const float16& b) {
+  return {a.lo - b.lo, a.hi - b.hi};
+}
+inline float16 operator*(const float16& a, const float16& b) {
+  return {a.lo * b.lo, a.hi * b.hi};
+}
+inline float16 operator/(const float16& a, const float16& b) {
+  return {a.lo / b.lo, a.hi / b.hi};
+}
+inline float16 operator-(const float16& a) { return {-a.lo, -a.hi}; }
+inline float16 min(const float16& a, const float16& b) {
+  return {min(a.lo, b.lo), min(a.hi, b.hi)};
+}
+inline float16 max(const float16& a, const float16& b) {
+  return {max(a.lo, b.lo), max(a.hi, b.hi)};
+}
+inline float16 abs(const float16& a) { return {abs(a.lo), abs(a.hi)}; }
+inline float16 sqrt(const float16& a) { return {sqrt(a.lo), sqrt(a.hi)}; }
+
+inline mask16 operator<(const float16& a, const float16& b) {
+  return {a.lo < b.lo, a.hi < b.hi};
+}
+inline mask16 operator<=(const float16& a, const float16& b) {
+  return {a.lo <= b.lo, a.hi <= b.hi};
+}
+inline mask16 operator>(const float16& a, const float16& b) {
+  return {a.lo > b.lo, a.hi > b.hi};
+}
+inline mask16 operator>=(const float16& a, const float16& b) {
+  return {a.lo >= b.lo, a.hi >= b.hi};
+}
+inline mask16 operator&(const mask16& a, const mask16& b) {
+  return {a.lo & b.lo, a.hi & b.hi};
+}
+inline mask16 operator|(const mask16& a, const mask16& b) {
+  return {a.lo | b.lo, a.hi | b.hi};
+}
+inline float16 select(const mask16& m, const float16& a, const float16& b) {
+  return {select(m.lo, a.lo, b.lo), select(m.hi, a.hi, b.hi)};
+}
+inline bool any(const mask16& m) { return any(m.lo) || any(m.hi); }
+inline bool all(const mask16& m) { return all(m.lo) && all(m.hi); }
+
+#endif
+
+// -----------------------------------------------------------------------------
+// PACKET VECTORS
+// -----------------------------------------------------------------------------
+
+// Lane count and mask type of each packet, used by the generic evaluators.
+template <typename T>
+struct packet_traits {
+  static constexpr bool is_packet = false;
+};
+template <>
+struct packet_traits<float8> {
+  static constexpr bool is_packet = true;
+  static constexpr int  size      = 8;
+  using mask                      = mask8;
+};
+template <>
+struct packet_traits<float16> {
+  static constexpr bool is_packet = true;
+  static constexpr int  size      = 16;
+  using mask                      = mask16;
+};
+
+template <typename T>
+inline constexpr bool is_packet_v = packet_traits<T>::is_packet;
+
+inline float8  load_packet(const float* a, float8*) { return load8(a); }
+inline float16 load_packet(const float* a, float16*) { return load16(a); }
+inline void    store_packet(float* a, const float8& b) { store8(a, b); }
+inline void    store_packet(float* a, const float16& b) { store16(a, b); }
+
+// Structure-of-arrays packet of 3d points.
+template <typename T>
+struct packet_vec3 {
+  T x, y, z;
+};
+
+using vec3f8  = packet_vec3<float8>;
+using vec3f16 = packet_vec3<float16>;
+
+}  // namespace CSG_SIMD_ABI
+}  // namespace yocto
@@ -0,0 +1,311 @@
+#pragma once
+#include "grid.h"
+
+// Narrow-band distance grid: the grid is split in bricks of brick_size^3
+// cells, and samples are stored only for the bricks that the surface may
+// cross. Every other brick keeps a conservative bound of the distance over
+// it, i.e. a value that is not farther from zero than the distance anywhere
+// in the brick, so that marching it is safe. Memory grows with the surface
+// area instead of the volume.
+//
+// Bricks are found top down over an octree of regions, and regions that
+// interval evaluation proves to be far from the surface are not split.
+// After edits, the bricks near the changed region are rebuilt on demand.
+
+struct CsgSparseGrid {
+  bbox3f bounds     = {};
+  float  cell       = 0;
+  float  band       = 0;  // bricks within band of the surface are sampled
+  int    brick_size = 8;
+  vec3i  bricks     = {0, 0, 0};  // along each axis
+
+  // per brick, the index of its samples or -1 and the bound of its values
+  vector<int>     index = {};
+  vector<float>   far   = {};
+  vector<uint8_t> dirty = {};
+
+  // per sampled brick, (brick_size + 1)^3 samples owned by storage, either
+  // in memory or mapped from a file (see grid_io.h)
+  span<float>           values  = {};
+  std::shared_ptr<void> storage = {};
+  vector<int>           free    = {};  // samples of bricks that became far
+
+  // copies take their samples to memory of their own, so that refilling
+  // one, see refill_sparse, does not change the others
+  CsgSparseGrid() = default;
+  CsgSparseGrid(CsgSparseGrid&&) = default;
+  CsgSparseGrid& operator=(CsgSparseGrid&&) = default;
+  CsgSparseGrid(const CsgSparseGrid& other) { *this = other; }
+  CsgSparseGrid& operator=(const CsgSparseGrid& other) {
+    if (this == &other) return *this;
+    bounds     = other.bounds;
+    cell       = other.cell;
+    band       = other.band;
+    brick_size = other.brick_size;
+    bricks     = other.bricks;
+    index      = other.index;
+    far        = other.far;
+    dirty      = other.dirty;
+    free       = other.free;
+    auto copy  = std::make_shared<vector<float>>(
+        other.values.data(), other.values.data() + other.values.size());
+    values  = {copy->data(), copy->size()};
+    storage = copy;
+    return *this;
+  }
+};
+
+inline int num_samples(const CsgSparseGrid& grid) {
+  auto n = grid.brick_size + 1;
+  return n * n * n;
+}
+
+inline bbox3f brick_bounds(const CsgSparseGrid& grid, const vec3i& brick) {
+  auto size = grid.cell * grid.brick_size;
+  auto min  = grid.bounds.min +
+             size * vec3f{(float)brick.x, (float)brick.y, (float)brick.z};
+  return {min, min + size};
+}
+
+// Bound of the values over a brick when it is far from the surface, or 0
+// when the brick has to be sampled.
+inline float far_bound(const interval& range, float band) {
+  if (range.min > band) return range.min;
+  if (range.max < -band) return range.max;
+  return 0;
+}
+
+inline vec3i brick_coords(const CsgSparseGrid& grid, int brick) {
+  return {brick % grid.bricks.x, (brick / grid.bricks.x) % grid.bricks.y,
+      brick / (grid.bricks.x * grid.bricks.y)};
+}
+
+// Grows the samples to hold `count` bricks, copying them to memory.
+inline void resize_samples(CsgSparseGrid& grid, int count) {
+  auto values = std::make_shared<vector<float>>(
+      (size_t)count * num_samples(grid), 0.0f);
+  std::copy(grid.values.data(),
+      grid.values.data() + std::min(grid.values.size(), values->size()),
+      values->data());
+  grid.values  = {values->data(), values->size()};
+  grid.storage = values;
+}
+
+// Evaluates the samples of a brick into its storage.
+inline void sample_brick(CsgSparseGrid& grid, const CsgTape& tape, int brick) {
+  auto n      = grid.brick_size + 1;
+  auto origin = brick_bounds(grid, brick_coords(grid, brick)).min;
+  auto points = vector<vec3f>(num_samples(grid));
+  for (auto i = 0; i < points.size(); i++)
+    points[i] = origin + grid.cell * vec3f{(float)(i % n),
+                                         (float)((i / n) % n),
+                                         (float)(i / (n * n))};
+  get_kernel().eval(tape, points.data(),
+      grid.values.data() + grid.index[brick] * num_samples(grid),
+      (int)points.size());
+}
+
+// Bakes the grid over `bounds` with `resolution` samples along the longest
+// side. The band defaults to two cells.
+inline CsgSparseGrid bake_csg_sparse(const CsgTree& csg, const bbox3f& bounds,
+    int resolution, float band = 0, int brick_size = 8) {
+  assert(resolution >= 2);
+  auto grid       = CsgSparseGrid{};
+  auto extent     = bounds.max - bounds.min;
+  grid.cell       = yocto::max(extent) / (resolution - 1);
+  grid.band       = band > 0 ? band : 2 * grid.cell;
+  grid.brick_size = brick_size;
+  for (auto k = 0; k < 3; k++)
+    grid.bricks[k] = yocto::max(
+        (int)std::ceil(extent[k] / (grid.cell * brick_size) - 1e-3f), 1);
+  grid.bounds = {bounds.min,
+      bounds.min + grid.cell * brick_size *
+                       vec3f{(float)grid.bricks.x, (float)grid.bricks.y,
+                           (float)grid.bricks.z}};
+  auto num   = grid.bricks.x * grid.bricks.y * grid.bricks.z;
+  grid.index = vector<int>(num, -1);
+  grid.far   = vector<float>(num, 0);
+  grid.dirty = vector<uint8_t>(num, 0);
+
+  // regions of the octree as a corner and a size in bricks, split down to
+  // single bricks while they may be near the surface
+  auto size = 1;
+  while (size < yocto::max(grid.bricks)) size *= 2;
+  auto level = vector<pair<vec3i, int>>{{{0, 0, 0}, size}};
+  auto near  = vector<int>{};
+  while (!level.empty()) {
+    auto split = vector<uint8_t>(level.size(), 0);
+    parallel_for((int)level.size(), [&](int item) {
+      thread_local auto values = vector<interval>{};
+      values.resize(csg.nodes.size());
+      auto [corner, size] = level[item];
+      auto last   = min(corner + size, grid.bricks) - vec3i{1, 1, 1};
+      auto region = bbox3f{
+          brick_bounds(grid, corner).min, brick_bounds(grid, last).max};
+      auto range = eval_csg_interval(values, csg, region);
+      auto bound = far_bound(range, grid.band);
+      if (bound == 0) {
+        split[item] = 1;
+        return;
+      }
+      for (auto z = corner.z; z <= last.z; z++)
+        for (auto y = corner.y; y <= last.y; y++)
+          for (auto x = corner.x; x <= last.x; x++)
+            grid.far[(z * grid.bricks.y + y) * grid.bricks.x + x] = bound;
+    }, pool_priority());
+    auto next = vector<pair<vec3i, int>>{};
+    for (auto item = 0; item < level.size(); item++) {
+      if (!split[item]) continue;
+      auto [corner, size] = level[item];
+      if (size == 1) {
+        near.push_back(
+            (corner.z * grid.bricks.y + corner.y) * grid.bricks.x + corner.x);
+        continue;
+      }
+      auto half = size / 2;
+      for (auto k = 0; k < 8; k++) {
+        auto child = corner + half * vec3i{k & 1, (k >> 1) & 1, k >> 2};
+        if (child.x < grid.bricks.x && child.y < grid.bricks.y &&
+            child.z < grid.bricks.z)
+          next.push_back({child, half});
+      }
+    }
+    level = std::move(next);
+  }
+
+  resize_samples(grid, (int)near.size());
+  for (auto i = 0; i < near.size(); i++) grid.index[near[i]] = i;
+  auto tape = compile_csg(csg, flt_max);
+  parallel_for((int)near.size(),
+      [&](int item) { sample_brick(grid, tape, near[item]); },
+      pool_priority());
+  return grid;
+}
+
+// Box where the surface can change when a node is edited: its bounds grown
+// by the softness of its ancestors. Edits move the surface only inside the
+// union of the boxes before and after the edit.
+inline bbox3f edit_region(const CsgTree& csg, int node) {
+  assert(csg.bounds.size() == csg.nodes.size());
+  auto growth      = vector<float>(csg.nodes.size(), -1);
+  growth[csg.root] = 0;
+  for (auto i = csg.root; i > node; i--) {
+    auto& children = csg.nodes[i].children;
+    if (growth[i] < 0 || children == vec2i{-1, -1}) continue;
+    for (auto c : {children.x, children.y})
+      growth[c] = yocto::max(
+          growth[c], growth[i] + csg.nodes[i].operation.softness);
+  }
+  auto& bounds = csg.bounds[node];
+  auto  grown  = yocto::max(growth[node], 0.0f);
+  return {bounds.min - grown, bounds.max + grown};
+}
+
+// Marks the bricks near `region` for refill_sparse. The bounds of the other
+// far bricks are clamped to their distance from the region, since the
+// distance from the surface outside it is at least the smaller of the two.
+inline void invalidate_sparse(CsgSparseGrid& grid, const bbox3f& region) {
+  auto grown = bbox3f{region.min - grid.band, region.max + grid.band};
+  for (auto brick = 0; brick < grid.index.size(); brick++) {
+    auto bounds = brick_bounds(grid, brick_coords(grid, brick));
+    auto gap    = max(max(grown.min - bounds.max, bounds.min - grown.max),
+        vec3f{0, 0, 0});
+    if (gap == vec3f{0, 0, 0}) {
+      grid.dirty[brick] = 1;
+    } else if (grid.index[brick] < 0) {
+      auto distance   = length(gap);
+      grid.far[brick] = grid.far[brick] > 0
+                            ? yocto::min(grid.far[brick], distance)
+                            : yocto::max(grid.far[brick], -distance);
+    }
+  }
+}
+
+// Rebuilds the dirty bricks for the current tree. Bricks that become far
+// release their samples for reuse.
+inline void refill_sparse(CsgSparseGrid& grid, const CsgTree& csg) {
+  auto dirty = vector<int>{};
+  for (auto brick = 0; brick < grid.dirty.size(); brick++)
+    if (grid.dirty[brick]) dirty.push_back(brick);
+  if (dirty.empty()) return;
+
+  auto bounds = vector<float>(dirty.size());
+  parallel_for((int)dirty.size(), [&](int item) {
+    thread_local auto values = vector<interval>{};
+    values.resize(csg.nodes.size());
+    auto region  = brick_bounds(grid, brick_coords(grid, dirty[item]));
+    bounds[item] = far_bound(
+        eval_csg_interval(values, csg, region), grid.band);
+  }, pool_priority());
+  auto near = vector<int>{};
+  for (auto item = 0; item < dirty.size(); item++) {
+    auto  brick = dirty[item];
+    auto& index = grid.index[brick];
+    grid.dirty[brick] = 0;
+    grid.far[brick]   = bounds[item];
+    if (bounds[item] == 0) {
+      near.push_back(brick);
+    } else if (index >= 0) {
+      grid.free.push_back(index);
+      index = -1;
+    }
+  }
+  auto count = (int)(grid.values.size() / num_samples(grid));
+  auto added = 0;
+  for (auto brick : near) {
+    auto& index = grid.index[brick];
+    if (index >= 0) continue;
+    if (!grid.free.empty()) {
+      index = grid.free.back();
+      grid.free.pop_back();
+    } else {
+      index = count + added++;
+    }
+  }
+  if (added > 0) resize_samples(grid, count + added);
+  auto tape = compile_csg(csg, flt_max);
+  parallel_for((int)near.size(),
+      [&](int item) { sample_brick(grid, tape, near[item]); },
+      pool_priority());
+}
+
+// Interpolated distance in the sampled bricks and the bound elsewhere.
+// Outside the grid, the distance from the grid is added.
+inline float eval_sparse(const CsgSparseGrid& grid, const vec3f& position) {
+  auto nearest = min(max(position, grid.bounds.min), grid.bounds.max);
+  auto outside = length(position - nearest);
+  auto uvw     = (nearest - grid.bounds.min) / grid.cell;
+  auto brick   = vec3i{};
+  for (auto k = 0; k < 3; k++)
+    brick[k] = yocto::clamp(
+        (int)(uvw[k] / grid.brick_size), 0, grid.bricks[k] - 1);
+  auto b = (brick.z * grid.bricks.y + brick.y) * grid.bricks.x + brick.x;
+  assert(!grid.dirty[b]);
+  if (grid.index[b] < 0) return grid.far[b] + outside;
+
+  auto n       = grid.brick_size + 1;
+  auto samples = grid.values.data() + grid.index[b] * num_samples(grid);
+  auto ijk     = vec3i{};
+  auto t       = vec3f{};
+  for (auto k = 0; k < 3; k++) {
+    auto local = uvw[k] - brick[k] * grid.brick_size;
+    ijk[k]     = yocto::clamp((int)local, 0, grid.brick_size - 1);
+    t[k]       = local - ijk[k];
+  }
+  auto at = [samples, n](int i, int j, int k) {
+    return samples[(k * n + j) * n + i];
+  };
+  auto [i, j, k] = ijk;
+  auto x00 = lerp(at(i, j, k), at(i + 1, j, k), t.x);
+  auto x10 = lerp(at(i, j + 1, k), at(i + 1, j + 1, k), t.x);
+  auto x01 = lerp(at(i, j, k + 1), at(i + 1, j, k + 1), t.x);
+  auto x11 = lerp(at(i, j + 1, k + 1), at(i + 1, j + 1, k + 1), t.x);
+  auto value = lerp(lerp(x00, x10, t.y), lerp(x01, x11, t.y), t.z);
+  return value + outside;
+}
+
+// Bytes used by the samples and the per-brick tables.
+inline size_t memory_usage(const CsgSparseGrid& grid) {
+  return grid.values.size() * sizeof(float) +
+         grid.index.size() * (sizeof(int) + sizeof(float) + sizeof(uint8_t));
+}
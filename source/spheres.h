@@ -0,0 +1,260 @@
+#pragma once
+#include "batch.h"
+//
+#include "ext/yocto-gl/yocto/yocto_shape.h"
+
+// Trees of spheres that approximate meshes and point clouds, e.g. scans, so
+// that they can be blended, carved and fitted as trees, see fit.h. Signed
+// distances of the input are sampled on a grid over its bounds, in parallel
+// over slices: the sign of meshes comes from the parity of the crossings of
+// rays along x, and their distance from the nearest triangle in a BVH, only
+// inside, since spheres are only placed there. Point clouds take the sign
+// from the normal of their nearest point and the distance from it, which
+// overestimates the one to the surface by up to the spacing of the points.
+//
+// Spheres are the balls inscribed at the samples, chosen greedily from the
+// deepest, i.e. along the medial axis first. A sample is covered once a
+// chosen ball holds its own ball shrunk by `error`, and no balls are taken
+// at covered samples, so that the union holds the input eroded by `error`,
+// up to the spacing of the grid, and stays inside it. Spheres are returned
+// as a single group, whose BVH serves the union, see CsgGroup, or as a
+// balanced tree of hard unions, as from build_union. Groups can be saved as
+// the sphere files of load_spheres with save_spheres.
+
+struct CsgSphereFit {
+  float error       = 0.01f;  // of the surface, in the units of the input
+  int   resolution  = 128;    // samples along the longest side
+  int   max_spheres = 0;      // as many as needed if 0
+  bool  group       = true;   // a group rather than a tree of unions
+};
+
+// Signed distances, negative inside, at the samples of a grid, x fastest.
+struct CsgSphereGrid {
+  vec3f         origin    = {0, 0, 0};
+  float         cell      = 0;
+  vec3i         size      = {0, 0, 0};
+  vector<float> distances = {};
+};
+
+inline vec3f grid_position(const CsgSphereGrid& grid, const vec3i& ijk) {
+  return grid.origin + grid.cell * vec3f{(float)ijk.x, (float)ijk.y,
+                                       (float)ijk.z};
+}
+
+// Grid over the bounds of the positions, with two samples of margin.
+inline CsgSphereGrid make_sphere_grid(
+    const vector<vec3f>& positions, int resolution) {
+  if (positions.empty()) throw std::invalid_argument{"no positions"};
+  if (resolution < 2) throw std::invalid_argument{"resolution below 2"};
+  auto bounds = invalidb3f;
+  for (auto& position : positions) bounds = merge(bounds, position);
+  auto extent = yocto::max(max(bounds.max - bounds.min), flt_eps);
+  auto grid   = CsgSphereGrid{};
+  grid.cell   = extent / (resolution - 1);
+  grid.origin = bounds.min - 2 * grid.cell;
+  for (auto axis = 0; axis < 3; axis++)
+    grid.size[axis] = (int)std::ceil(
+                          (bounds.max[axis] - bounds.min[axis]) / grid.cell) +
+                      5;
+  grid.distances.assign((size_t)grid.size.x * grid.size.y * grid.size.z, 1);
+  return grid;
+}
+
+// Samples the distances of a mesh, whose rows along x are cast as rays
+// slightly off the samples, so that they do not pass through the edges of
+// meshes aligned to the grid. Meshes that are not closed may leak rows.
+inline void sample_mesh_distances(CsgSphereGrid& grid,
+    const vector<vec3f>& positions, const vector<vec3i>& triangles) {
+  auto bvh    = bvh_tree{};
+  auto radius = vector<float>(positions.size(), 0);
+  make_triangles_bvh(bvh, triangles, positions, radius);
+  auto size = grid.size;
+  parallel_for(size.z, [&](int k) {
+    auto crossings = vector<float>{};
+    for (auto j = 0; j < size.y; j++) {
+      auto start = grid_position(grid, {-1, j, k}) +
+                   grid.cell * vec3f{0, 0.000137f, 0.000271f};
+      auto ray   = ray3f{start, {1, 0, 0}, 0, grid.cell * (size.x + 1)};
+      crossings.clear();
+      while (true) {
+        auto hit = intersect_triangles_bvh(bvh, triangles, positions, ray);
+        if (!hit.hit) break;
+        crossings.push_back(hit.distance);
+        ray.tmin = hit.distance + grid.cell * 1e-5f;
+      }
+      auto row   = ((size_t)k * size.y + j) * size.x;
+      auto c     = 0;
+      auto depth = flt_max;
+      for (auto i = 0; i < size.x; i++) {
+        auto t = grid.cell * (i + 1);
+        while (c < crossings.size() && crossings[c] <= t) c++;
+        if (c % 2 == 0) {
+          depth = flt_max;
+          continue;
+        }
+        // the crossings around the sample are on the surface, and so is
+        // the nearest point of the last sample within a cell of it
+        auto bound = yocto::min(depth + grid.cell, t - crossings[c - 1]);
+        if (c < crossings.size())
+          bound = yocto::min(bound, crossings[c] - t);
+        auto position = grid_position(grid, {i, j, k});
+        auto nearest  = overlap_triangles_bvh(
+            bvh, triangles, positions, radius, position, bound * 1.001f);
+        depth = nearest.hit ? nearest.distance : bound;
+        grid.distances[row + i] = -depth;
+      }
+    }
+  }, pool_priority());
+}
+
+// Samples the distances of a point cloud, inside where they are behind the
+// normal of their nearest point.
+inline void sample_points_distances(CsgSphereGrid& grid,
+    const vector<vec3f>& positions, const vector<vec3f>& normals) {
+  if (normals.size() != positions.size())
+    throw std::invalid_argument{"point clouds need a normal per point"};
+  auto bvh    = bvh_tree{};
+  auto points = vector<int>(positions.size());
+  auto radius = vector<float>(positions.size(), 0);
+  for (auto k = 0; k < points.size(); k++) points[k] = k;
+  make_points_bvh(bvh, points, positions, radius);
+  auto size = grid.size;
+  parallel_for(size.z, [&](int k) {
+    for (auto j = 0; j < size.y; j++) {
+      auto row = ((size_t)k * size.y + j) * size.x;
+      for (auto i = 0; i < size.x; i++) {
+        auto position = grid_position(grid, {i, j, k});
+        auto nearest  = overlap_points_bvh(
+            bvh, points, positions, radius, position, flt_max);
+        if (!nearest.hit) continue;
+        auto point   = nearest.element;
+        auto outside = dot(position - positions[point], normals[point]) > 0;
+        grid.distances[row + i] = outside ? nearest.distance
+                                          : -nearest.distance;
+      }
+    }
+  }, pool_priority());
+}
+
+// Centers and radii of the spheres that cover the inside of the grid, see
+// the top of the file.
+inline CsgGroup cover_spheres(
+    const CsgSphereGrid& grid, float error, int max_spheres) {
+  auto& distances  = grid.distances;
+  auto  candidates = vector<int>{};
+  for (auto n = 0; n < distances.size(); n++)
+    if (-distances[n] > error) candidates.push_back(n);
+  std::sort(candidates.begin(), candidates.end(), [&](int a, int b) {
+    return distances[a] < distances[b] || (distances[a] == distances[b] &&
+                                              a < b);
+  });
+
+  auto size    = grid.size;
+  auto covered = vector<uint8_t>(distances.size(), 0);
+  auto spheres = CsgGroup{};
+  for (auto n : candidates) {
+    if (covered[n]) continue;
+    if (max_spheres > 0 && spheres.centers.size() >= max_spheres) break;
+    auto ijk    = vec3i{n % size.x, (n / size.x) % size.y,
+        n / (size.x * size.y)};
+    auto center = grid_position(grid, ijk);
+    auto radius = -distances[n];
+    spheres.centers.push_back(center);
+    spheres.radius.push_back(radius);
+
+    // marks the samples whose shrunk balls this one holds, in parallel over
+    // slices for large balls
+    auto reach = (int)(radius / grid.cell) + 1;
+    auto first = max(ijk - reach, vec3i{0, 0, 0});
+    auto last  = min(ijk + reach, size - 1);
+    auto mark  = [&](int k) {
+      for (auto j = first.y; j <= last.y; j++) {
+        auto row = ((size_t)k * size.y + j) * size.x;
+        for (auto i = first.x; i <= last.x; i++) {
+          auto depth = -distances[row + i];
+          if (depth <= error) continue;
+          auto offset = distance(grid_position(grid, {i, j, k}), center);
+          if (offset + depth - error <= radius) covered[row + i] = 1;
+        }
+      }
+    };
+    if (reach < 16) {
+      for (auto k = first.z; k <= last.z; k++) mark(k);
+    } else {
+      parallel_for(last.z - first.z + 1, [&](int k) { mark(first.z + k); },
+          pool_priority());
+    }
+  }
+  return spheres;
+}
+
+// Tree of the spheres that approximate a mesh, or a point cloud with
+// normals if there are no triangles.
+inline CsgTree fit_spheres(const vector<vec3f>& positions,
+    const vector<vec3i>& triangles, const vector<vec3f>& normals,
+    const CsgSphereFit& params = {}) {
+  if (params.error < 0) throw std::invalid_argument{"negative error"};
+  auto grid = make_sphere_grid(positions, params.resolution);
+  if (!triangles.empty()) {
+    sample_mesh_distances(grid, positions, triangles);
+  } else {
+    sample_points_distances(grid, positions, normals);
+  }
+  auto spheres = cover_spheres(grid, params.error, params.max_spheres);
+  if (spheres.centers.empty())
+    throw std::runtime_error{"no samples inside, raise the resolution"};
+
+  auto csg = CsgTree{};
+  if (params.group) {
+    csg.root = add_group(csg, std::move(spheres));
+  } else {
+    auto operands = vector<int>{};
+    for (auto k = 0; k < spheres.centers.size(); k++) {
+      auto primitive      = CsgPrimitve{};
+      primitive.type      = primitive_type::sphere;
+      primitive.params[0] = spheres.centers[k].x;
+      primitive.params[1] = spheres.centers[k].y;
+      primitive.params[2] = spheres.centers[k].z;
+      primitive.params[3] = spheres.radius[k];
+      operands.push_back(add_primitive(csg, primitive));
+      csg.bounds.push_back(eval_bounds(csg, csg.nodes.back()));
+    }
+    auto forward = vector<int>{};
+    csg.root     = build_union(csg, forward, operands, -1);
+  }
+  update_bounds(csg);
+  return csg;
+}
+
+// Loads a mesh or a point cloud with yocto_shape and fits spheres to it.
+// Quads are split into triangles.
+inline CsgTree fit_shape_spheres(
+    const string& filename, const CsgSphereFit& params = {}) {
+  auto points    = vector<int>{};
+  auto lines     = vector<vec2i>{};
+  auto triangles = vector<vec3i>{};
+  auto quads     = vector<vec4i>{};
+  auto positions = vector<vec3f>{};
+  auto normals   = vector<vec3f>{};
+  auto texcoords = vector<vec2f>{};
+  auto colors    = vector<vec4f>{};
+  auto radius    = vector<float>{};
+  load_shape(filename, points, lines, triangles, quads, positions, normals,
+      texcoords, colors, radius);
+  for (auto& triangle : quads_to_triangles(quads))
+    triangles.push_back(triangle);
+  return fit_spheres(positions, triangles, normals, params);
+}
+
+// Writes the spheres of a group as a file of load_spheres, a sphere per
+// line, so that scripts can place them with `spheres`.
+inline bool save_spheres(const string& filename, const CsgGroup& group) {
+  auto fs = fopen(filename.c_str(), "w");
+  if (!fs) return false;
+  for (auto k = 0; k < group.centers.size(); k++) {
+    auto& center = group.centers[k];
+    fprintf(fs, "%.9g %.9g %.9g %.9g\n", center.x, center.y, center.z,
+        group.radius[k]);
+  }
+  return fclose(fs) == 0;
+}
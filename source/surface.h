@@ -0,0 +1,138 @@
+#pragma once
+#include "batch.h"
+
+// Closest points and ray hits of a tree, for tools that need its surface
+// rather than its distances. Rays are sphere traced with the tape in the
+// box of the root, see update_bounds, where the bound guards of the tape
+// skip the subtrees that the points are far from and groups find their
+// nearest spheres with their BVH. Steps are divided by the Lipschitz bound
+// of the tape, see eval_lipschitz. Points are projected on the surface with
+// Newton steps along the gradient, which reach the closest point in one
+// step where the tree is an exact distance. Hits carry the normal and the
+// node of the primitive at the surface, see label.h. Batches run queries in
+// parallel chunks.
+
+struct CsgHit {
+  bool  hit      = false;
+  float distance = flt_max;    // along the ray, or signed from the point
+  vec3f position = {0, 0, 0};  // on the surface
+  vec3f normal   = {0, 0, 0};
+  int   node     = -1;  // of the primitive, -1 if none
+};
+
+struct CsgSurfaceOptions {
+  float epsilon    = 1e-4f;  // distance of points taken on the surface
+  int   max_steps  = 256;    // of sphere tracing
+  int   projection = 8;      // Newton steps of closest points
+  int   block_size = 256;    // queries evaluated by each task
+  bool  parallel   = true;
+};
+
+// Projects a point onto the surface with Newton steps along the gradient.
+// Points are left where the gradient vanishes.
+inline vec3f project_surface(
+    const CsgTape& tape, vec3f position, float tolerance, int steps = 8) {
+  for (auto step = 0; step < steps; step++) {
+    auto sample = eval_tape_grad(tape, position);
+    auto norm   = dot(sample.grad, sample.grad);
+    if (std::abs(sample.value) <= tolerance || norm == 0) break;
+    position -= sample.grad * (sample.value / norm);
+  }
+  return position;
+}
+
+// Fills the normal and the node of a hit at its position.
+inline void shade_hit(const CsgTape& tape, CsgHit& hit) {
+  auto grad  = eval_tape_grad(tape, hit.position).grad;
+  hit.normal = dot(grad, grad) > 0 ? normalize(grad) : vec3f{0, 0, 0};
+  hit.node   = (int)eval_tape_label(tape, hit.position).node;
+}
+
+// First hit of the ray with the surface in `bounds`. Rays that start
+// inside hit at their start.
+inline CsgHit intersect_ray(const CsgTape& tape, const ray3f& ray,
+    const bbox3f& bounds, const CsgSurfaceOptions& options = {}) {
+  auto tmin = ray.tmin, tmax = ray.tmax;
+  if (is_bounded(bounds)) {
+    auto invd = 1.0f / ray.d;
+    for (auto k = 0; k < 3; k++) {
+      auto t0 = (bounds.min[k] - ray.o[k]) * invd[k];
+      auto t1 = (bounds.max[k] - ray.o[k]) * invd[k];
+      if (invd[k] < 0) std::swap(t0, t1);
+      tmin = yocto::max(tmin, t0);
+      tmax = yocto::min(tmax, t1);
+    }
+    if (tmin > tmax) return {};
+  }
+  auto t = tmin;
+  for (auto step = 0; step < options.max_steps && t <= tmax; step++) {
+    auto position = ray.o + ray.d * t;
+    auto value    = eval_tape(tape, position) / tape.lipschitz;
+    if (value < options.epsilon) {
+      auto hit = CsgHit{true, t, position};
+      shade_hit(tape, hit);
+      return hit;
+    }
+    t += value;
+  }
+  return {};
+}
+
+// Hit of the ray in the box of the root, or anywhere if the tree has no
+// bounds.
+inline CsgHit intersect_ray(const CsgTree& csg, const CsgTape& tape,
+    const ray3f& ray, const CsgSurfaceOptions& options = {}) {
+  auto bounds = csg.bounds.size() == csg.nodes.size()
+                    ? csg.bounds[csg.root]
+                    : bbox3f{{-flt_max, -flt_max, -flt_max},
+                          {flt_max, flt_max, flt_max}};
+  return intersect_ray(tape, ray, bounds, options);
+}
+
+// Closest point of the surface to the point. Misses are points whose
+// projection does not converge, as where the gradient vanishes.
+inline CsgHit closest_point(const CsgTape& tape, const vec3f& point,
+    const CsgSurfaceOptions& options = {}) {
+  auto value    = eval_tape(tape, point);
+  auto position = project_surface(
+      tape, point, options.epsilon, options.projection);
+  auto hit = CsgHit{};
+  if (std::abs(eval_tape(tape, position)) > options.epsilon) return hit;
+  hit.hit      = true;
+  hit.position = position;
+  hit.distance = value < 0 ? -length(point - position)
+                           : length(point - position);
+  shade_hit(tape, hit);
+  return hit;
+}
+
+// Runs `func(k)` for each query, in parallel chunks if asked.
+template <typename Func>
+inline void run_surface_queries(
+    int num, const CsgSurfaceOptions& options, Func&& func) {
+  auto run = [&](int begin, int end) {
+    for (auto k = begin; k < end; k++) func(k);
+  };
+  if (options.parallel) {
+    parallel_for_chunks(num, run, options.block_size);
+  } else {
+    run(0, num);
+  }
+}
+
+// Hits of the rays, written to `hits`.
+inline void intersect_rays(const CsgTree& csg, const CsgTape& tape,
+    span<const ray3f> rays, span<CsgHit> hits,
+    const CsgSurfaceOptions& options = {}) {
+  assert(rays.size() == hits.size());
+  run_surface_queries((int)rays.size(), options,
+      [&](int k) { hits[k] = intersect_ray(csg, tape, rays[k], options); });
+}
+
+// Closest points to the points, written to `hits`.
+inline void closest_points(const CsgTape& tape, span<const vec3f> points,
+    span<CsgHit> hits, const CsgSurfaceOptions& options = {}) {
+  assert(points.size() == hits.size());
+  run_surface_queries((int)points.size(), options,
+      [&](int k) { hits[k] = closest_point(tape, points[k], options); });
+}
@@ -0,0 +1,777 @@
+#pragma once
+#include <map>
+
+#include "csg.h"
+#include "label.h"
+#include "pool.h"
+
+// Opcodes of the compiled tape. Operations are specialized on their
+// parameters, so the interpreter never inspects blend or softness values.
+// Primitives come first, in the order of primitive_type, see primitives.h.
+enum struct csg_opcode : uint8_t {
+  sphere,           // center, radius
+  box,              // center, half side
+  union_hard,       // min(f, g)
+  union_smooth,     // smin(f, g, softness)
+  union_blend,      // lerp(f, smin(f, g, softness), blend)
+  subtract_hard,    // max(f, -g)
+  subtract_smooth,  // smax(f, -g, softness)
+  subtract_blend,   // lerp(f, smax(f, -g, softness), blend)
+  bound,            // skip a subtree outside its box, use the box distance
+  cull,             // skip a subtracted subtree outside its box
+  group,            // nearest sphere of CsgTape::groups[params]
+  instance,         // tape of CsgTape::instances[params]
+  mesh,             // nearest triangle of CsgTape::meshes[params]
+  prune_min,        // skip the second operand of a min that cannot win
+  prune_max,        // skip the carver of a max that cannot win
+};
+
+static_assert((int)csg_opcode::sphere == (int)primitive_type::sphere &&
+              (int)csg_opcode::box == (int)primitive_type::box);
+
+// A single tape instruction. Operands and result are registers of a small
+// register file, allocated by compile_csg so that their number grows with
+// the depth of the tree rather than with its size.
+struct CsgInstruction {
+  csg_opcode opcode = csg_opcode::sphere;
+  uint16_t   r      = 0;
+  uint16_t   a      = 0;
+  uint16_t   b      = 0;
+  int        params = 0;  // into CsgTape::params, groups, instances, meshes
+  int        skip   = 0;  // instructions of the subtree guarded by a bound
+};
+
+struct CsgTape;
+struct CsgPyramid;
+struct CsgLods;
+struct CsgLighting;
+
+// Instance of a tree compiled once for all the instances that share it and
+// run on the registers after the ones of the tape that places it.
+struct CsgTapeInstance {
+  frame3f                        inverse = identity3x4f;
+  float                          scale   = 1;
+  std::shared_ptr<const CsgTape> tape    = {};
+  CsgFold                        fold    = {};  // see fold_point
+};
+
+// Flat evaluation program lowered from a CsgTree, with the parameters of
+// each instruction packed contiguously. The result is the register written
+// by the last instruction. Registers count the ones of the instances too.
+// The marcher skips empty space with the pyramid, if one is baked for the
+// tree, see pyramid.h, and may march simpler tapes far from the camera,
+// see CsgLods. Hits are shaded with the shadows and the occlusion of the
+// lighting volume, if one is baked, see bake_lighting.
+struct CsgTape {
+  vector<CsgInstruction>             instructions  = {};
+  vector<float>                      params        = {};
+  int                                num_registers = 0;
+  int                                own_registers = 0;  // before instances
+  vector<CsgGroup>                   groups        = {};
+  vector<CsgTapeInstance>            instances     = {};
+  vector<CsgTriangles>               meshes        = {};
+  vector<int>                        nodes         = {};  // of instructions
+  std::shared_ptr<const CsgPyramid>  pyramid       = {};
+  std::shared_ptr<const CsgLods>     lods          = {};
+  std::shared_ptr<const CsgLighting> lighting      = {};
+  float                              lipschitz     = 1;  // see eval_lipschitz
+};
+
+inline int num_params(csg_opcode opcode) {
+  switch (opcode) {
+    case csg_opcode::sphere: return csg_sphere::num_params;
+    case csg_opcode::box: return csg_box::num_params;
+    case csg_opcode::union_hard: return 0;
+    case csg_opcode::union_smooth: return 1;
+    case csg_opcode::union_blend: return 2;
+    case csg_opcode::subtract_hard: return 0;
+    case csg_opcode::subtract_smooth: return 1;
+    case csg_opcode::subtract_blend: return 2;
+    case csg_opcode::bound: return 7;
+    case csg_opcode::cull: return 7;
+    case csg_opcode::group: return 0;
+    case csg_opcode::instance: return 0;
+    case csg_opcode::mesh: return 0;
+    case csg_opcode::prune_min: return 7;
+    case csg_opcode::prune_max: return 7;
+  }
+  return 0;
+}
+
+// Guards skip the subtree that follows them, see eval_tape_range.
+inline bool is_guard(csg_opcode opcode) {
+  return opcode == csg_opcode::bound || opcode == csg_opcode::cull ||
+         opcode == csg_opcode::prune_min || opcode == csg_opcode::prune_max;
+}
+
+inline csg_opcode get_opcode(const CsgNode& node) {
+  if (node.children == vec2i{-1, -1}) {
+    auto type = node.primitive.type;
+    if (visit_primitive(type, [](auto) {})) return (csg_opcode)type;
+    if (type == primitive_type::group) return csg_opcode::group;
+    if (type == primitive_type::instance) return csg_opcode::instance;
+    if (type == primitive_type::mesh) return csg_opcode::mesh;
+    assert(0);
+    return csg_opcode::box;
+  }
+  auto& operation = node.operation;
+  if (operation.blend >= 0) {
+    if (operation.blend != 1) return csg_opcode::union_blend;
+    if (operation.softness == 0) return csg_opcode::union_hard;
+    return csg_opcode::union_smooth;
+  } else {
+    if (operation.blend != -1) return csg_opcode::subtract_blend;
+    if (operation.softness == 0) return csg_opcode::subtract_hard;
+    return csg_opcode::subtract_smooth;
+  }
+}
+
+// Writes the parameters of the instruction of a node, `num_params` of them.
+inline void write_params(
+    float* params, csg_opcode opcode, const CsgNode& node) {
+  switch (opcode) {
+    case csg_opcode::sphere:
+    case csg_opcode::box:
+      for (auto k = 0; k < num_params(opcode); k++)
+        params[k] = node.primitive.params[k];
+      break;
+    case csg_opcode::union_smooth:
+    case csg_opcode::subtract_smooth:
+      params[0] = node.operation.softness;
+      break;
+    case csg_opcode::union_blend:
+      params[0] = node.operation.blend;
+      params[1] = node.operation.softness;
+      break;
+    case csg_opcode::subtract_blend:
+      params[0] = -node.operation.blend;
+      params[1] = node.operation.softness;
+      break;
+    default: break;
+  }
+}
+
+// Writes again the parameters of an instruction from the node it was
+// compiled from, in place, after the parameters of the node were edited.
+// Instructions keep their opcode, so edits should not need another one,
+// though blend instructions take any blend of their sign and softness, and
+// guards keep their boxes.
+inline void update_tape_params(
+    CsgTape& tape, const CsgTree& csg, int instruction) {
+  auto& inst = tape.instructions[instruction];
+  auto& node = csg.nodes[tape.nodes[instruction]];
+  if (is_guard(inst.opcode) || inst.opcode == csg_opcode::group ||
+      inst.opcode == csg_opcode::instance || inst.opcode == csg_opcode::mesh)
+    return;
+  write_params(tape.params.data() + inst.params, inst.opcode, node);
+}
+
+// Lipschitz bounds of the nodes: how much faster than the points their
+// values may change, so that rays stepping by the value over the bound of
+// the root do not cross the surface. Primitives, groups and meshes are
+// distances, and so are instances, which scale their trees back, with the
+// bounds of their tapes if given. Soft or hard, unions and subtractions
+// weigh their operands by weights adding up to one, so they are no faster
+// than the faster operand, and neither are blends with their first operand.
+// Blends beyond the full operation extrapolate, and add the bounds by
+// weight.
+inline vector<float> eval_lipschitz(
+    const CsgTree& csg, const vector<CsgTapeInstance>& instances = {}) {
+  auto bounds = vector<float>(csg.nodes.size(), 1);
+  for (auto i = 0; i < csg.nodes.size(); i++) {
+    auto& node = csg.nodes[i];
+    if (is_instance(node)) {
+      bounds[i] = node.group < instances.size()
+                      ? instances[node.group].tape->lipschitz
+                      : eval_lipschitz(*csg.instances[node.group].tree)
+                            .back();
+      continue;
+    }
+    if (node.children == vec2i{-1, -1}) continue;
+    auto f = bounds[node.children.x], g = bounds[node.children.y];
+    auto w = yocto::abs(node.operation.blend);
+    bounds[i] = yocto::abs(1 - w) * f + w * yocto::max(f, g);
+  }
+  return bounds;
+}
+
+// Lowers an optimized tree (see optimize_csg) to a tape. Subtrees are
+// emitted in Sethi-Ullman order, visiting first the operand that needs more
+// registers, so that few temporaries are alive at any time. Shared nodes
+// are emitted once and keep their register until their last use.
+//
+// When the tree has bounds, each operation below the root is guarded by a
+// bound instruction that skips it for points farther than `margin` (plus
+// the softness of its ancestors) from its box. The result is then a lower
+// bound of the distance that is exact within `margin` of the surface. An
+// infinite margin gives exact values everywhere. Blends may make values
+// change faster than the points, and rays step by the values over
+// `lipschitz`, see eval_lipschitz, so that simpler tapes of the same tree,
+// e.g. the ones pruned for the tiles of the viewer, step farther.
+//
+// With `prune`, the operand of a hard union emitted second, and the carver
+// of a hard subtraction, are also guarded by a prune instruction, that
+// skips them for points where the value of the other operand is already
+// below a lower bound of theirs, so that they cannot win, see eval_prune.
+// Only subtrees used once, of 8 nodes or more or costly leaves, are pruned,
+// and the values are the same as without, since the operation then returns
+// the other operand.
+inline CsgTape compile_csg(
+    const CsgTree& csg, float margin = 0.01f, bool prune = false) {
+  assert(csg.root == csg.nodes.size() - 1);
+  auto tape   = CsgTape{};
+  tape.groups = csg.groups;
+  tape.meshes = csg.meshes;
+  tape.instructions.reserve(csg.nodes.size());
+  tape.nodes.reserve(csg.nodes.size());
+
+  // growth of the box of each node, that adds up the softness of its
+  // ancestors, and whether it is subtracted an odd number of times so that
+  // its value can only be replaced by upper bounds
+  auto bounded = csg.bounds.size() == csg.nodes.size() && margin < flt_max;
+  auto growth  = vector<float>(csg.nodes.size(), margin);
+  auto carved  = vector<bool>(csg.nodes.size(), false);
+  auto guarded = vector<bool>(csg.nodes.size(), false);
+  auto paths   = vector<int>(csg.nodes.size(), 0);  // from the root, up to 2
+  auto shared  = vector<bool>(csg.nodes.size(), false);
+  auto volume  = [&](int n) {
+    auto d = csg.bounds[n].max - csg.bounds[n].min + 2 * growth[n];
+    return d.x * d.y * d.z;
+  };
+  // shared nodes, and the subtrees that contain them, are not guarded:
+  // their values are needed by other paths, and growth and parity are only
+  // defined along a single path
+  paths[csg.root] = 1;
+  for (auto i = (int)csg.nodes.size() - 1; i >= 0; i--) {
+    auto& node = csg.nodes[i];
+    if (node.children == vec2i{-1, -1}) continue;
+    for (auto c : {node.children.x, node.children.y})
+      paths[c] = yocto::min(paths[c] + paths[i], 2);
+  }
+  for (auto i = 0; i < csg.nodes.size(); i++) {
+    auto& children = csg.nodes[i].children;
+    if (children == vec2i{-1, -1}) continue;
+    for (auto c : {children.x, children.y})
+      shared[i] = shared[i] || shared[c] || paths[c] > 1;
+  }
+  for (auto i = (int)csg.nodes.size() - 1; i >= 0; i--) {
+    auto& node = csg.nodes[i];
+    if (node.children == vec2i{-1, -1}) continue;
+    if (paths[i] != 1) continue;
+    auto [f, g] = node.children;
+    growth[f]   = growth[i] + node.operation.softness;
+    growth[g]   = growth[i] + node.operation.softness;
+    carved[f]   = carved[i];
+    carved[g]   = carved[i] != (node.operation.blend < 0);
+    if (!bounded) continue;
+    // guard operations whose box is much smaller than the parent one, so
+    // that long chains of nested boxes do not pay for useless tests
+    for (auto c : {f, g}) {
+      if (csg.nodes[c].children == vec2i{-1, -1}) continue;
+      if (!is_bounded(csg.bounds[c])) continue;
+      if (paths[c] != 1 || shared[c]) continue;
+      guarded[c] = !is_bounded(csg.bounds[i]) || volume(c) < volume(i) / 2;
+    }
+  }
+
+  // operands that the other operand of their parent can prune, found as
+  // the parents are expanded, with the Lipschitz bounds of their values
+  auto slopes   = prune && bounded ? eval_lipschitz(csg) : vector<float>{};
+  auto pruners  = vector<int>(csg.nodes.size(), -1);
+  auto sizes    = vector<int>(slopes.empty() ? 0 : csg.nodes.size(), 1);
+  for (auto i = 0; i < sizes.size(); i++) {
+    auto& children = csg.nodes[i].children;
+    if (children == vec2i{-1, -1}) continue;
+    sizes[i] += sizes[children.x] + sizes[children.y];
+  }
+  auto prunable = [&](int n, int c) {
+    auto& operation = csg.nodes[n].operation;
+    auto& child     = csg.nodes[c];
+    if (slopes.empty() || operation.softness != 0) return false;
+    if (operation.blend != 1 &&
+        (operation.blend != -1 || c != csg.nodes[n].children.y))
+      return false;
+    if (paths[c] != 1 || shared[c] || !is_bounded(csg.bounds[c]))
+      return false;
+    return sizes[c] >= 8 || is_group(child) || is_mesh(child) ||
+           is_instance(child);
+  };
+
+  // registers needed by each subtree, in post order
+  auto need = vector<int>(csg.nodes.size(), 1);
+  for (auto i = 0; i < csg.nodes.size(); i++) {
+    auto& children = csg.nodes[i].children;
+    if (children == vec2i{-1, -1}) continue;
+    auto l  = need[children.x];
+    auto r  = need[children.y];
+    need[i] = (l == r) ? l + 1 : max(l, r);
+  }
+
+  // uses of each node, so that shared nodes keep their register until the
+  // last operation that reads it
+  auto uses = vector<int>(csg.nodes.size(), 0);
+  for (auto i = 0; i < csg.nodes.size(); i++) {
+    auto& children = csg.nodes[i].children;
+    if (children == vec2i{-1, -1}) continue;
+    uses[children.x] += 1;
+    uses[children.y] += 1;
+  }
+
+  // emit with an explicit stack since parsed chains can be very deep, and
+  // each node once since optimized trees can share nodes
+  auto registers = vector<int>(csg.nodes.size(), -1);
+  auto released  = vector<int>{};
+  auto allocate  = [&]() {
+    if (released.empty()) return tape.num_registers++;
+    auto r = released.back();
+    released.pop_back();
+    return r;
+  };
+  auto guards = vector<int>(csg.nodes.size(), -1);
+  auto prunes = vector<int>(csg.nodes.size(), -1);
+  auto stack  = vector<pair<int, bool>>{{csg.root, false}};
+  while (!stack.empty()) {
+    auto [n, visited] = stack.back();
+    stack.pop_back();
+    if (registers[n] >= 0) continue;
+    auto& node = csg.nodes[n];
+    if (!visited && pruners[n] >= 0) {
+      // the other operand was emitted first and is in its register
+      auto& parent = csg.nodes[pruners[n]];
+      auto& bounds = csg.bounds[n];
+      auto  other  = parent.children.x == n ? parent.children.y
+                                            : parent.children.x;
+      auto  guard  = CsgInstruction{};
+      guard.opcode = parent.operation.blend > 0 ? csg_opcode::prune_min
+                                                : csg_opcode::prune_max;
+      guard.a      = registers[other];
+      guard.params = tape.params.size();
+      for (auto k = 0; k < 3; k++)
+        tape.params.push_back(bounds.min[k] - margin);
+      for (auto k = 0; k < 3; k++)
+        tape.params.push_back(bounds.max[k] + margin);
+      tape.params.push_back(slopes[n]);
+      prunes[n] = tape.instructions.size();
+      tape.instructions.push_back(guard);
+      tape.nodes.push_back(n);
+    }
+    if (node.children != vec2i{-1, -1} && !visited) {
+      if (guarded[n]) {
+        auto& bounds = csg.bounds[n];
+        auto  guard  = CsgInstruction{};
+        guard.opcode = carved[n] ? csg_opcode::cull : csg_opcode::bound;
+        guard.params = tape.params.size();
+        for (auto k = 0; k < 3; k++)
+          tape.params.push_back(bounds.min[k] - growth[n]);
+        for (auto k = 0; k < 3; k++)
+          tape.params.push_back(bounds.max[k] + growth[n]);
+        tape.params.push_back(growth[n]);
+        guards[n] = tape.instructions.size();
+        tape.instructions.push_back(guard);
+        tape.nodes.push_back(n);
+      }
+      auto [first, second] = node.children;
+      if (need[second] > need[first]) std::swap(first, second);
+      if (prunable(n, second)) pruners[second] = n;
+      stack.push_back({n, true});
+      stack.push_back({second, false});
+      stack.push_back({first, false});
+      continue;
+    }
+
+    auto inst   = CsgInstruction{};
+    inst.opcode = get_opcode(node);
+    inst.params = tape.params.size();
+    if (node.children != vec2i{-1, -1}) {
+      inst.a = registers[node.children.x];
+      inst.b = registers[node.children.y];
+      if (--uses[node.children.y] == 0) released.push_back(inst.b);
+      if (--uses[node.children.x] == 0) released.push_back(inst.a);
+    }
+    registers[n] = allocate();
+    inst.r       = registers[n];
+    if (inst.opcode == csg_opcode::group ||
+        inst.opcode == csg_opcode::instance ||
+        inst.opcode == csg_opcode::mesh) {
+      inst.params = node.group;
+    } else {
+      tape.params.resize(inst.params + num_params(inst.opcode));
+      write_params(tape.params.data() + inst.params, inst.opcode, node);
+    }
+    tape.instructions.push_back(inst);
+    tape.nodes.push_back(n);
+
+    // the result register is free when the subtree starts, since every
+    // register live there is still live after it
+    for (auto first : {prunes[n], guards[n]}) {
+      if (first < 0) continue;
+      auto& guard = tape.instructions[first];
+      guard.r     = inst.r;
+      guard.skip  = tape.instructions.size() - first - 1;
+    }
+  }
+
+  // trees shared by instances are compiled once per scale, with the margin
+  // taken into them, and distinct ones in parallel since they do not share
+  // nodes
+  auto compiled = std::map<pair<const CsgTree*, float>,
+      std::shared_ptr<const CsgTape>>{};
+  auto sources  = vector<const CsgInstance*>{};
+  for (auto& instance : csg.instances)
+    if (compiled.emplace(pair{instance.tree.get(), instance.scale}, nullptr)
+            .second)
+      sources.push_back(&instance);
+  auto tapes = vector<std::shared_ptr<const CsgTape>>(sources.size());
+  parallel_for(
+      (int)sources.size(),
+      [&](int k) {
+        auto& instance = *sources[k];
+        tapes[k]       = std::make_shared<const CsgTape>(
+            compile_csg(*instance.tree,
+                margin < flt_max ? margin / instance.scale : flt_max));
+      },
+      pool_priority());
+  for (auto k = 0; k < sources.size(); k++)
+    compiled[{sources[k]->tree.get(), sources[k]->scale}] = tapes[k];
+  tape.own_registers = tape.num_registers;
+  for (auto& instance : csg.instances) {
+    auto& compiled_tape = compiled[{instance.tree.get(), instance.scale}];
+    tape.instances.push_back(
+        {instance.inverse, instance.scale, compiled_tape, instance.fold});
+    tape.num_registers = yocto::max(tape.num_registers,
+        tape.own_registers + compiled_tape->num_registers);
+  }
+  tape.lipschitz = eval_lipschitz(csg, tape.instances)[csg.root];
+  return tape;
+}
+
+// Tapes of the tree at levels of detail, each simplified for points whose
+// footprint is wider than its size, see simplify_csg. Sizes double from a
+// level to the next, and levels that remove less than a quarter of the
+// nodes of the previous one are not kept. Rays march the coarsest level
+// that their pixels are wide enough for, see lod_tape.
+struct CsgLods {
+  vector<float>   sizes = {};
+  vector<CsgTape> tapes = {};
+};
+
+inline CsgLods compile_csg_lods(const CsgTree& csg, float size,
+    int levels = 6, float margin = 0.01f) {
+  auto lods = CsgLods{};
+  if (csg.bounds.size() != csg.nodes.size()) return lods;
+  // levels are simplified from the tree and compiled in parallel
+  auto trees = vector<CsgTree>(yocto::max(levels, 0));
+  parallel_for(
+      levels,
+      [&](int level) {
+        trees[level] = simplify_csg(csg, size * (float)(1 << level));
+      },
+      pool_priority());
+  auto kept  = vector<int>{};
+  auto count = csg.nodes.size();
+  for (auto level = 0; level < levels; level++) {
+    if (trees[level].nodes.size() * 4 > count * 3) continue;
+    count = trees[level].nodes.size();
+    kept.push_back(level);
+    lods.sizes.push_back(size * (float)(1 << level));
+  }
+  lods.tapes.resize(kept.size());
+  parallel_for(
+      (int)kept.size(),
+      [&](int k) { lods.tapes[k] = compile_csg(trees[kept[k]], margin); },
+      pool_priority());
+  return lods;
+}
+
+// Distance of the primitive of the registry with the parameters, see
+// primitives.h.
+template <typename Primitive>
+inline float eval_primitive(const vec3f& position, const float* params) {
+  return Primitive::load(params).eval(position.x, position.y, position.z);
+}
+
+template <typename Primitive, typename T>
+inline T eval_primitive(const packet_vec3<T>& position, const float* params) {
+  return Primitive::load(params).eval(position.x, position.y, position.z);
+}
+
+// Distance from the grown box of a bound instruction, zero inside it.
+inline float eval_guard(const vec3f& position, const float* params) {
+  auto x = max(max(params[0] - position.x, position.x - params[3]), 0.0f);
+  auto y = max(max(params[1] - position.y, position.y - params[4]), 0.0f);
+  auto z = max(max(params[2] - position.z, position.z - params[5]), 0.0f);
+  return std::sqrt(x * x + y * y + z * z);
+}
+
+template <typename T>
+inline T eval_guard(const packet_vec3<T>& position, const float* params) {
+  auto x = max(T{params[0]} - position.x, position.x - T{params[3]});
+  auto y = max(T{params[1]} - position.y, position.y - T{params[4]});
+  auto z = max(T{params[2]} - position.z, position.z - T{params[5]});
+  x      = max(x, T{0});
+  y      = max(y, T{0});
+  z      = max(z, T{0});
+  return sqrt(x * x + y * y + z * z);
+}
+
+// A subtree is skipped when all the points are outside its box.
+inline bool is_outside(float distance) { return distance > 0; }
+
+template <typename T, typename = std::enable_if_t<is_packet_v<T>>>
+inline bool is_outside(const T& distance) {
+  return all(distance > T{0});
+}
+
+inline bool is_outside(const dual& distance) { return distance.value > 0; }
+
+// Lower bound of the values of a subtree from the box of a prune guard. The
+// values are not negative outside the box, so they are no less than the
+// distance from it outside, and than its signed distance times their
+// Lipschitz bound inside, since they change no faster.
+inline float eval_prune(const vec3f& position, const float* params) {
+  auto x = max(params[0] - position.x, position.x - params[3]);
+  auto y = max(params[1] - position.y, position.y - params[4]);
+  auto z = max(params[2] - position.z, position.z - params[5]);
+  auto inside = yocto::min(max(max(x, y), z), 0.0f);
+  x = max(x, 0.0f), y = max(y, 0.0f), z = max(z, 0.0f);
+  return std::sqrt(x * x + y * y + z * z) + inside * params[6];
+}
+
+template <typename T>
+inline T eval_prune(const packet_vec3<T>& position, const float* params) {
+  auto x      = max(T{params[0]} - position.x, position.x - T{params[3]});
+  auto y      = max(T{params[1]} - position.y, position.y - T{params[4]});
+  auto z      = max(T{params[2]} - position.z, position.z - T{params[5]});
+  auto inside = min(max(max(x, y), z), T{0});
+  x           = max(x, T{0});
+  y           = max(y, T{0});
+  z           = max(z, T{0});
+  return sqrt(x * x + y * y + z * z) + inside * T{params[6]};
+}
+
+// A subtree is pruned when its bound is above the value of the other
+// operand at all the points. Ties are not pruned, so that labels go to the
+// same operand as min and max.
+inline bool is_above(float bound, float value) { return bound > value; }
+
+template <typename T, typename = std::enable_if_t<is_packet_v<T>>>
+inline bool is_above(const T& bound, const T& value) {
+  return all(bound > value);
+}
+
+inline bool is_above(const dual& bound, const dual& value) {
+  return bound.value > value.value;
+}
+
+template <typename T>
+inline bool is_above(const T& bound, const labeled<T>& value) {
+  return is_above(bound, value.value);
+}
+
+// Whether a guard skips its subtree at the point, as eval_tape_range.
+inline bool guard_skips(const float* registers, const CsgInstruction& inst,
+    const float* params, const vec3f& position) {
+  auto p = params + inst.params;
+  if (inst.opcode == csg_opcode::prune_min)
+    return is_above(eval_prune(position, p), registers[inst.a]);
+  if (inst.opcode == csg_opcode::prune_max)
+    return is_above(eval_prune(position, p), -registers[inst.a]);
+  return is_outside(eval_guard(position, p));
+}
+
+template <typename T, typename Position>
+inline T eval_tape(T* registers, const CsgTape& tape, const Position& position);
+
+// Guards of packets partly outside their box whose subtrees are running,
+// innermost last, with the distances of the lanes from the box.
+template <typename T>
+struct CsgPendingGuard {
+  int guard    = 0;
+  T   distance = {};
+};
+
+template <typename T>
+inline vector<CsgPendingGuard<T>>& tape_guards() {
+  thread_local auto guards = vector<CsgPendingGuard<T>>{};
+  return guards;
+}
+
+// Runs the instructions in [begin, end) for a point (T = float) or a packet
+// of points. Packets whose points are partly outside a box run its subtree,
+// then the outside lanes take the bound value, so that each lane gets the
+// value of the point alone. Those guards wait on a stack per thread until
+// the last instruction of their subtree, rather than recursing, since boxes
+// can nest as deep as the tree; instances run above them. Packets skip the
+// subtrees of prune guards only if all their points are pruned.
+template <typename T, typename Position>
+inline void eval_tape_range(T* registers, const CsgTape& tape,
+    const Position& position, int begin, int end) {
+  auto params  = tape.params.data();
+  auto pending = (vector<CsgPendingGuard<T>>*)nullptr;
+  auto base    = (size_t)0;
+  auto next    = -1;  // last instruction of the innermost pending guard
+  for (auto i = begin; i < end; i++) {
+    auto& inst = tape.instructions[i];
+    auto  p    = params + inst.params;
+    auto& v = registers[inst.r];
+    switch (inst.opcode) {
+      case csg_opcode::sphere:
+        v = eval_primitive<csg_sphere>(position, p);
+        label_leaf(v, tape.nodes[i]);
+        break;
+      case csg_opcode::box:
+        v = eval_primitive<csg_box>(position, p);
+        label_leaf(v, tape.nodes[i]);
+        break;
+      case csg_opcode::group:
+        v = eval_group(tape.groups[inst.params], position);
+        label_leaf(v, tape.nodes[i]);
+        break;
+      case csg_opcode::mesh:
+        v = eval_mesh(tape.meshes[inst.params], position);
+        label_leaf(v, tape.nodes[i]);
+        break;
+      case csg_opcode::instance: {
+        auto& instance = tape.instances[inst.params];
+        v = eval_tape(registers + tape.own_registers, *instance.tape,
+                fold_point(instance.fold,
+                    transform_point(instance.inverse, position))) *
+            T{instance.scale};
+        label_leaf(v, tape.nodes[i]);
+      } break;
+      case csg_opcode::union_hard:
+        v = yocto::min(registers[inst.a], registers[inst.b]);
+        break;
+      case csg_opcode::union_smooth:
+        v = smin(registers[inst.a], registers[inst.b], p[0]);
+        break;
+      case csg_opcode::union_blend: {
+        auto f = registers[inst.a];
+        v      = lerp(f, smin(f, registers[inst.b], p[1]), p[0]);
+      } break;
+      case csg_opcode::subtract_hard:
+        v = yocto::max(registers[inst.a], -registers[inst.b]);
+        break;
+      case csg_opcode::subtract_smooth:
+        v = smax(registers[inst.a], -registers[inst.b], p[0]);
+        break;
+      case csg_opcode::subtract_blend: {
+        auto f = registers[inst.a];
+        v      = lerp(f, smax(f, -registers[inst.b], p[1]), p[0]);
+      } break;
+      case csg_opcode::prune_min:
+      case csg_opcode::prune_max: {
+        auto bound = eval_prune(position, p);
+        auto other = inst.opcode == csg_opcode::prune_min ? registers[inst.a]
+                                                          : -registers[inst.a];
+        if (is_above(bound, other)) {
+          v = bound;
+          i += inst.skip;
+        }
+      } break;
+      case csg_opcode::bound:
+      case csg_opcode::cull: {
+        auto d       = eval_guard(position, p);
+        auto outside = [&]() {
+          return inst.opcode == csg_opcode::bound ? d + T{p[6]} : T{flt_max};
+        };
+        if (is_outside(d)) {
+          v = outside();
+          i += inst.skip;
+        } else if constexpr (is_packet_v<T>) {
+          if (!any(d > T{0})) break;
+          if (!pending) {
+            pending = &tape_guards<T>();
+            base    = pending->size();
+          }
+          pending->push_back({i, d});
+          next = i + inst.skip;
+        }
+      } break;
+    }
+    if constexpr (is_packet_v<T>) {
+      while (i == next) {
+        auto [guard, d] = pending->back();
+        pending->pop_back();
+        auto& bound = tape.instructions[guard];
+        auto  value = bound.opcode == csg_opcode::bound
+                          ? d + T{params[bound.params + 6]}
+                          : T{flt_max};
+        registers[bound.r] = select(d > T{0}, value, registers[bound.r]);
+        next               = -1;
+        if (pending->size() > base) {
+          auto outer = pending->back().guard;
+          next       = outer + tape.instructions[outer].skip;
+        }
+      }
+    }
+  }
+  if (pending) pending->resize(base);
+}
+
+// Runs the tape using `registers` as scratch. It must hold at least
+// tape.num_registers values.
+template <typename T, typename Position>
+inline T eval_tape(
+    T* registers, const CsgTape& tape, const Position& position) {
+  eval_tape_range(
+      registers, tape, position, 0, (int)tape.instructions.size());
+  return registers[tape.instructions.back().r];
+}
+
+template <typename T, typename Position>
+inline T eval_tape(
+    vector<T>& registers, const CsgTape& tape, const Position& position) {
+  assert(registers.size() >= tape.num_registers);
+  return eval_tape(registers.data(), tape, position);
+}
+
+// Per-thread register file, grown on demand and reused across calls.
+template <typename T>
+inline T* tape_registers(const CsgTape& tape) {
+  thread_local auto registers = vector<T>{};
+  if (registers.size() < tape.num_registers)
+    registers.resize(tape.num_registers);
+  return registers.data();
+}
+
+inline float eval_tape(const CsgTape& tape, const vec3f& position) {
+  return eval_tape(tape_registers<float>(tape), tape, position);
+}
+
+// Value and gradient with respect to the position, in a single pass.
+inline dual eval_tape_grad(const CsgTape& tape, const vec3f& position) {
+  return eval_tape(tape_registers<dual>(tape), tape, make_dual(position));
+}
+
+// Normals at up to 2 points by central differences on a tetrahedron, as in
+// the GPU backend, see glsl_march: the 4 probes of each point are lanes of
+// one packet, so that a single pass over the tape gives both normals. About
+// twice as fast as eval_tape_grad, with errors of the order of `epsilon`.
+inline void eval_tape_normals(const CsgTape& tape, const vec3f* points,
+    int count, vec3f* normals, float epsilon = 0.0005f) {
+  static const vec3f corners[4] = {
+      {1, -1, -1}, {-1, -1, 1}, {-1, 1, -1}, {1, 1, 1}};
+  assert(count >= 1 && count <= 2);
+  float x[8], y[8], z[8], values[8];
+  for (auto lane = 0; lane < 8; lane++) {
+    auto point = points[yocto::min(lane / 4, count - 1)] +
+                 corners[lane % 4] * (0.5773f * epsilon);
+    x[lane] = point.x, y[lane] = point.y, z[lane] = point.z;
+  }
+  store8(values, eval_tape(tape_registers<float8>(tape), tape,
+                     vec3f8{load8(x), load8(y), load8(z)}));
+  for (auto k = 0; k < count; k++) {
+    auto normal = vec3f{0, 0, 0};
+    for (auto lane = 0; lane < 4; lane++)
+      normal += corners[lane] * values[k * 4 + lane];
+    normals[k] = normalize(normal);
+  }
+}
+
+// Value and node of the primitive that wins at the position, see label.h.
+// Primitives of instances are labeled with the instance node.
+inline labeled<float> eval_tape_label(
+    const CsgTape& tape, const vec3f& position) {
+  return eval_tape(tape_registers<labeled<float>>(tape), tape, position);
+}
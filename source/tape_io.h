@@ -0,0 +1,209 @@
+#pragma once
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+
+#include "grid_io.h"
+#include "tape.h"
+#include "user_cache.h"
+
+// Tapes saved in a cache folder once compiled, so that reopening a scene
+// reads its tape instead of compiling it again. Files are keyed by the root
+// hash of the tree, see update_hashes, and by the margin, and hold a hash of
+// their contents that is checked when they are loaded, as are the nodes of
+// the instructions against the tree and their operands against the tape,
+// see check_tape, so that evaluators stay within it. Files are mapped and
+// copied, and written and renamed in place as grid files. Groups and meshes
+// are taken from the tree, and tapes with instances are compiled as usual.
+//
+// The hash is not keyed, so it tells files that were cut short or damaged,
+// not files that were written by others: the cache folder is the tape
+// folder of the user, see user_cache_directory, and can be changed with the
+// CSG_TAPE_CACHE environment variable.
+
+struct CsgTapeHeader {
+  char     magic[8]         = {'c', 's', 'g', 't', 'a', 'p', 'e', 0};
+  uint32_t version          = 1;
+  uint32_t instruction_size = sizeof(CsgInstruction);
+  uint64_t key              = 0;
+  uint64_t hash             = 0;  // of the sections
+  int32_t  num_registers    = 0;
+  int32_t  own_registers    = 0;
+  uint64_t sections[3][2]   = {};  // instructions, params, nodes
+};
+
+// Cache folder of the tapes, or an empty path if there is none.
+inline std::filesystem::path tape_cache_directory() {
+  return user_cache_directory("tape", "CSG_TAPE_CACHE");
+}
+
+// Key of a tape: the hash of the root mixed with the size of the tree, the
+// margin and whether the tree has bounds, which change the guards.
+inline uint64_t tape_key(const CsgTree& csg, float margin) {
+  auto hash = mix_hash(root_hash(csg), (uint64_t)csg.nodes.size());
+  hash      = mix_hash(hash, margin);
+  return mix_hash(hash, (uint64_t)(csg.bounds.size() == csg.nodes.size()));
+}
+
+// Hash of bytes, eight at a time.
+inline uint64_t hash_bytes(uint64_t hash, const void* data, size_t size) {
+  for (auto i = (size_t)0; i < size; i += 8) {
+    auto word = (uint64_t)0;
+    memcpy(&word, (const char*)data + i, std::min(size - i, (size_t)8));
+    hash = mix_hash(hash, word);
+  }
+  return hash;
+}
+
+inline bool save_tape(
+    const string& filename, const CsgTape& tape, uint64_t key) {
+  if (!tape.instances.empty()) return false;
+  auto header          = CsgTapeHeader{};
+  header.key           = key;
+  header.num_registers = tape.num_registers;
+  header.own_registers = tape.own_registers;
+  auto sections        = vector<pair<const void*, size_t>>{
+      {tape.instructions.data(),
+          tape.instructions.size() * sizeof(CsgInstruction)},
+      {tape.params.data(), tape.params.size() * sizeof(float)},
+      {tape.nodes.data(), tape.nodes.size() * sizeof(int)}};
+  auto offset = align_offset(sizeof(header));
+  for (auto k = 0; k < sections.size(); k++) {
+    header.sections[k][0] = offset;
+    header.sections[k][1] = sections[k].second;
+    header.hash = hash_bytes(header.hash, sections[k].first,
+        sections[k].second);
+    offset = align_offset(offset + sections[k].second);
+  }
+
+  auto temporary = filename + ".tmp" + std::to_string(process_id());
+  auto fs        = fopen(temporary.c_str(), "wb");
+  if (!fs) return false;
+  auto ok      = fwrite(&header, sizeof(header), 1, fs) == 1;
+  auto written = (uint64_t)sizeof(header);
+  auto padding = vector<char>(64, 0);
+  for (auto k = 0; k < sections.size(); k++) {
+    auto [data, size] = sections[k];
+    auto skip         = header.sections[k][0] - written;
+    if (skip) ok = ok && fwrite(padding.data(), skip, 1, fs) == 1;
+    if (size) ok = ok && fwrite(data, size, 1, fs) == 1;
+    written = header.sections[k][0] + size;
+  }
+  ok         = fclose(fs) == 0 && ok;
+  auto error = std::error_code{};
+  if (ok) std::filesystem::rename(temporary, filename, error);
+  if (!ok || error) std::filesystem::remove(temporary, error);
+  return ok && !error;
+}
+
+// Copies a section into `values`. Returns false if it does not fit.
+template <typename T>
+inline bool read_tape_section(const uint8_t* data, size_t size,
+    const CsgTapeHeader& header, int section, vector<T>& values) {
+  auto [offset, length] = header.sections[section];
+  if (offset > size || length > size - offset || length % sizeof(T))
+    return false;
+  values.resize(length / sizeof(T));
+  if (length) memcpy(values.data(), data + offset, length);
+  return true;
+}
+
+// Whether the registers, parameters, groups, meshes and skipped subtrees of
+// the instructions of the tape are within it, with guards nested in the
+// ones that skip them, and whether it has no instances, whose tapes are not
+// saved.
+inline bool check_tape(const CsgTape& tape) {
+  auto size = (int)tape.instructions.size();
+  if (tape.num_registers < 1 || tape.num_registers > 65536 ||
+      tape.own_registers < 0 || tape.own_registers > tape.num_registers)
+    return false;
+  auto ends = vector<int>{size - 1};  // of the guards around each
+  for (auto i = 0; i < size; i++) {
+    auto& inst = tape.instructions[i];
+    while (i > ends.back()) ends.pop_back();
+    if (inst.opcode > csg_opcode::prune_max ||
+        inst.opcode == csg_opcode::instance)
+      return false;
+    if (inst.r >= tape.num_registers || inst.a >= tape.num_registers ||
+        inst.b >= tape.num_registers)
+      return false;
+    auto count = num_params(inst.opcode);
+    if (count && (inst.params < 0 ||
+                     (size_t)inst.params + count > tape.params.size()))
+      return false;
+    if (inst.opcode == csg_opcode::group &&
+        (inst.params < 0 || (size_t)inst.params >= tape.groups.size()))
+      return false;
+    if (inst.opcode == csg_opcode::mesh &&
+        (inst.params < 0 || (size_t)inst.params >= tape.meshes.size()))
+      return false;
+    if (is_guard(inst.opcode)) {
+      if (inst.skip < 0 || inst.skip > ends.back() - i) return false;
+      ends.push_back(i + inst.skip);
+    }
+  }
+  return true;
+}
+
+// Loads the tape of the tree saved with `key`. Returns false if the file is
+// missing, of another version, or does not match its hash, the tree or
+// check_tape.
+inline bool load_tape(const string& filename, uint64_t key,
+    const CsgTree& csg, CsgTape& tape) {
+  auto size = (size_t)0;
+  auto file = map_grid_file(filename, size, false);
+  if (!file || size < sizeof(CsgTapeHeader)) return false;
+  auto data   = (const uint8_t*)file.get();
+  auto header = CsgTapeHeader{};
+  memcpy(&header, data, sizeof(header));
+  auto check = CsgTapeHeader{};
+  if (memcmp(header.magic, check.magic, sizeof(check.magic)) != 0 ||
+      header.version != check.version ||
+      header.instruction_size != check.instruction_size || header.key != key)
+    return false;
+
+  auto result = CsgTape{};
+  if (!read_tape_section(data, size, header, 0, result.instructions) ||
+      !read_tape_section(data, size, header, 1, result.params) ||
+      !read_tape_section(data, size, header, 2, result.nodes))
+    return false;
+  auto hash = (uint64_t)0;
+  hash = hash_bytes(hash, result.instructions.data(), header.sections[0][1]);
+  hash = hash_bytes(hash, result.params.data(), header.sections[1][1]);
+  hash = hash_bytes(hash, result.nodes.data(), header.sections[2][1]);
+  if (hash != header.hash) return false;
+  if (result.instructions.empty() ||
+      result.nodes.size() != result.instructions.size())
+    return false;
+  for (auto i = 0; i < result.instructions.size(); i++) {
+    auto& inst = result.instructions[i];
+    auto  node = result.nodes[i];
+    if (node < 0 || node >= csg.nodes.size()) return false;
+    if (is_guard(inst.opcode)) continue;
+    if (inst.opcode != get_opcode(csg.nodes[node])) return false;
+  }
+  result.num_registers = header.num_registers;
+  result.own_registers = header.own_registers;
+  result.groups        = csg.groups;
+  result.meshes        = csg.meshes;
+  result.lipschitz     = eval_lipschitz(csg)[csg.root];
+  if (!check_tape(result)) return false;
+  tape = std::move(result);
+  return true;
+}
+
+// Loads the tape of the tree from the cache folder, or compiles and saves
+// it if it is missing. Meant for trees as they are loaded: each edit of the
+// parameters gives a new key.
+inline CsgTape compile_csg_cached(const CsgTree& csg, float margin = 0.01f) {
+  if (!csg.instances.empty()) return compile_csg(csg, margin);
+  auto key       = tape_key(csg, margin);
+  auto directory = tape_cache_directory();
+  if (directory.empty()) return compile_csg(csg, margin);
+  auto filename = (directory / (std::to_string(key) + ".tape")).string();
+  auto tape     = CsgTape{};
+  if (load_tape(filename, key, csg, tape)) return tape;
+  tape = compile_csg(csg, margin);
+  save_tape(filename, tape, key);
+  return tape;
+}
@@ -0,0 +1,74 @@
+#pragma once
+#include <algorithm>
+#include <vector>
+
+#include "ext/yocto-gl/yocto/yocto_math.h"
+#include "pool.h"
+using namespace yocto;
+
+// Square tiles of an image, rendered as one task each, so that neighbouring
+// rays run on the same thread and share the cached tape and scratch. Tiles
+// are issued in Morton order, which keeps consecutive tiles close, or by
+// distance from the center, so that progressive renders refine the middle
+// of the screen first. Each tile counts its own samples, so tiles can be
+// culled or sampled adaptively.
+
+enum struct tile_order { morton, center };
+
+struct CsgTile {
+  vec2i min     = {0, 0};  // first pixel
+  vec2i max     = {0, 0};  // past the last pixel
+  int   samples = 0;
+  float error   = flt_max;  // noise of its pixels, for adaptive sampling
+};
+
+// Interleaves the bits of the coordinates, x in the even bits.
+inline uint32_t morton_code(int x, int y) {
+  auto spread = [](uint32_t v) {
+    v &= 0x0000ffff;
+    v = (v | (v << 8)) & 0x00ff00ff;
+    v = (v | (v << 4)) & 0x0f0f0f0f;
+    v = (v | (v << 2)) & 0x33333333;
+    v = (v | (v << 1)) & 0x55555555;
+    return v;
+  };
+  return spread(x) | (spread(y) << 1);
+}
+
+inline vector<CsgTile> make_tiles(const vec2i& size, int tile_size = 16,
+    tile_order order = tile_order::morton) {
+  auto count = (size + tile_size - 1) / tile_size;
+  auto tiles = vector<CsgTile>{};
+  auto keys  = vector<pair<float, uint32_t>>{};
+  for (auto y = 0; y < count.y; y++) {
+    for (auto x = 0; x < count.x; x++) {
+      auto tile = CsgTile{};
+      tile.min  = vec2i{x, y} * tile_size;
+      tile.max  = yocto::min(tile.min + tile_size, size);
+      auto key  = 0.0f;
+      if (order == tile_order::center) {
+        auto offset = vec2f{x + 0.5f, y + 0.5f} -
+                      vec2f{(float)count.x, (float)count.y} / 2;
+        key = dot(offset, offset);
+      }
+      keys.push_back({key, morton_code(x, y)});
+      tiles.push_back(tile);
+    }
+  }
+  auto indices = vector<int>(tiles.size());
+  for (auto i = 0; i < indices.size(); i++) indices[i] = i;
+  std::sort(indices.begin(), indices.end(),
+      [&keys](int a, int b) { return keys[a] < keys[b]; });
+  auto sorted = vector<CsgTile>(tiles.size());
+  for (auto i = 0; i < indices.size(); i++) sorted[i] = tiles[indices[i]];
+  return sorted;
+}
+
+// Calls `func` on each tile on the pool, in the order of the tiles.
+template <typename Func>
+inline void parallel_for_tiles(vector<CsgTile>& tiles, Func&& func,
+    csg_priority priority = csg_priority::interactive,
+    const std::atomic<bool>* cancel = nullptr) {
+  parallel_for(
+      (int)tiles.size(), [&](int i) { func(tiles[i]); }, priority, cancel);
+}
@@ -0,0 +1,72 @@
+#pragma once
+#include "mesh.h"
+//
+#include "ext/yocto-gl/yocto/yocto_trace.h"
+
+// Scenes of yocto_trace with the surface of a tree as a mesh, for final
+// renders with its path tracer, which follows every bounce through its BVH
+// of triangles rather than by sphere tracing. Meshes are placed in the
+// viewer's frame, i.e. moved by half the unit box as in raymarch, and their
+// normals are the gradients of the tape at their vertices. The material and
+// the lights follow eyelight: a light from above as a small emitting quad,
+// and a dim sky.
+
+// Adds the mesh of the surface with `cells` along its bounds, see mesh_csg,
+// as an instance with the material of eyelight. Returns the instance.
+inline int add_csg_shape(trace_scene& scene, const CsgTree& csg, int cells,
+    const vec3f& diffuse = {0.9, 0.3, 0.2}) {
+  auto mesh    = mesh_csg(csg, mesh_bounds(csg), cells);
+  auto tape    = compile_csg(csg, flt_max);
+  auto normals = vector<vec3f>(mesh.positions.size());
+  parallel_for_chunks((int)normals.size(), [&](int begin, int end) {
+    for (auto k = begin; k < end; k++) {
+      auto grad  = eval_tape_grad(tape, mesh.positions[k]).grad;
+      normals[k] = grad == vec3f{0, 0, 0} ? vec3f{0, 0, 1} : normalize(grad);
+    }
+  });
+  auto shape    = add_shape(
+      scene, mesh.triangles, mesh.positions, normals, {}, {}, {});
+  auto material = add_material(scene);
+  set_material_diffuse(scene, material, diffuse);
+  set_material_specular(scene, material, vec3f(0.04));
+  set_material_roughness(scene, material, 0.2);
+  return add_instance(
+      scene, translation_frame(vec3f{0.5, 0.5, 0.5}), shape, material);
+}
+
+// Scene of the tree and the lights, with its BVH. Cameras are set by the
+// caller, see render_trace.
+inline trace_scene make_trace_scene(
+    const CsgTree& csg, int cells, const trace_params& params) {
+  auto scene = trace_scene{};
+  add_csg_shape(scene, csg, cells);
+
+  // the light of eyelight, far enough to be a direction, with about the
+  // irradiance of its unit light, and the sky for its ambient term
+  auto direction = normalize(vec3f{0.2, 1, 0});
+  auto distance  = 20.0f;
+  auto light     = add_material(scene);
+  set_material_emission(scene, light, vec3f(distance * distance));
+  auto quad = add_shape(scene,
+      vector<vec4i>{{0, 1, 2, 3}},
+      vector<vec3f>{{-0.5, -0.5, 0}, {0.5, -0.5, 0}, {0.5, 0.5, 0},
+          {-0.5, 0.5, 0}},
+      {}, {}, {}, {});
+  add_instance(scene,
+      frame_fromz(vec3f{0.5, 0.5, 0.5} + distance * direction, -direction),
+      quad, light);
+  add_environment(scene, identity3x4f, vec3f(0.1));
+
+  init_bvh(scene, params);
+  init_lights(scene);
+  return scene;
+}
+
+// Path traces the view of `camera`, with the samples of `params`.
+inline image<vec4f> render_trace(trace_scene& scene,
+    const trace_camera& camera, trace_params params) {
+  scene.cameras  = {camera};
+  params.camera  = 0;
+  params.sampler = trace_sampler_type::path;
+  return trace_image(scene, params);
+}
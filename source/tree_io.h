@@ -0,0 +1,255 @@
+#pragma once
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <memory>
+#include <type_traits>
+
+#include "grid_io.h"
+
+// Binary files of optimized trees, .csgb, so that large scenes start
+// without parsing their text. Files start with a fixed header that holds
+// the hash of the tree and the offset and size of each section, i.e. the
+// node, bounds and group arrays as they are in memory and the name table,
+// aligned to 64 bytes. Loading maps the file and copies each array at once,
+// with no work per node: group BVHs are stored rather than built again, and
+// names stay in the mapped file, whose views are fixed up from their
+// offsets. The hash is checked after loading, so damaged files are not
+// used. Files are in the byte order and the layout of nodes of the machine
+// that wrote them, which are checked with the version.
+
+enum struct csgb_section {
+  nodes,
+  bounds,
+  groups,          // points, BVH nodes and BVH primitives of each group
+  centers,         // of all groups, one after the other
+  radius,          //
+  bvh_nodes,       //
+  bvh_primitives,  //
+  name_offsets,    // of each name into name_chars, and of the end
+  name_chars,
+  name_table,  // see CsgNames
+  count
+};
+
+struct CsgBinaryHeader {
+  char     magic[8]  = {'c', 's', 'g', 'b', 0, 0, 0, 0};
+  uint32_t version   = 1;
+  uint32_t node_size = sizeof(CsgNode);
+  uint64_t hash      = 0;
+  int32_t  root      = -1;
+  uint32_t named     = 0;  // if the tree has names
+  uint64_t sections[(int)csgb_section::count][2] = {};  // offset and size
+};
+
+// Writes the header and the sections of the tree with `write(data, size)`,
+// which returns false on errors, padding the sections with zeros. Returns
+// false on errors, and for trees with instances or meshes, whose trees and
+// triangles are not stored.
+template <typename Write>
+inline bool write_csgb(const CsgTree& csg, Write&& write) {
+  static_assert(std::is_trivially_copyable_v<CsgNode>);
+  if (!csg.instances.empty() || !csg.meshes.empty()) return false;
+  auto groups  = vector<uint64_t>{};
+  auto centers = vector<vec3f>{};
+  auto radius  = vector<float>{};
+  auto nodes   = vector<bvh_node>{};
+  auto points  = vector<int>{};
+  for (auto& group : csg.groups) {
+    groups.insert(groups.end(), {group.centers.size(), group.bvh.nodes.size(),
+                                    group.bvh.primitives.size()});
+    centers.insert(centers.end(), group.centers.begin(), group.centers.end());
+    radius.insert(radius.end(), group.radius.begin(), group.radius.end());
+    nodes.insert(nodes.end(), group.bvh.nodes.begin(), group.bvh.nodes.end());
+    points.insert(points.end(), group.bvh.primitives.begin(),
+        group.bvh.primitives.end());
+  }
+  auto offsets = vector<uint64_t>{0};
+  auto chars   = string{};
+  auto table   = vector<int>{};
+  if (csg.names) {
+    for (auto name : csg.names->names) {
+      chars += name;
+      offsets.push_back(chars.size());
+    }
+    table = csg.names->table;
+  }
+
+  auto header  = CsgBinaryHeader{};
+  header.hash  = hash_csg(csg);
+  header.root  = csg.root;
+  header.named = csg.names ? 1 : 0;
+  auto sections = vector<pair<const void*, size_t>>{
+      {csg.nodes.data(), csg.nodes.size() * sizeof(CsgNode)},
+      {csg.bounds.data(), csg.bounds.size() * sizeof(bbox3f)},
+      {groups.data(), groups.size() * sizeof(uint64_t)},
+      {centers.data(), centers.size() * sizeof(vec3f)},
+      {radius.data(), radius.size() * sizeof(float)},
+      {nodes.data(), nodes.size() * sizeof(bvh_node)},
+      {points.data(), points.size() * sizeof(int)},
+      {offsets.data(), offsets.size() * sizeof(uint64_t)},
+      {chars.data(), chars.size()},
+      {table.data(), table.size() * sizeof(int)},
+  };
+  auto offset = align_offset(sizeof(header));
+  for (auto k = 0; k < sections.size(); k++) {
+    header.sections[k][0] = offset;
+    header.sections[k][1] = sections[k].second;
+    offset                = align_offset(offset + sections[k].second);
+  }
+
+  auto ok      = write(&header, sizeof(header));
+  auto written = (uint64_t)sizeof(header);
+  auto padding = vector<char>(64, 0);
+  for (auto k = 0; k < sections.size(); k++) {
+    auto [data, size] = sections[k];
+    auto skip         = header.sections[k][0] - written;
+    if (skip) ok = ok && write(padding.data(), skip);
+    if (size) ok = ok && write(data, size);
+    written = header.sections[k][0] + size;
+  }
+  return ok;
+}
+
+// Writes the tree, which should be optimized, and renames the file in place
+// as save_grid_file. Returns false on errors, and for trees with instances
+// or meshes.
+inline bool save_csgb(const string& filename, const CsgTree& csg) {
+  if (!csg.instances.empty() || !csg.meshes.empty()) return false;
+  auto temporary = filename + ".tmp" + std::to_string(process_id());
+  auto fs        = fopen(temporary.c_str(), "wb");
+  if (!fs) return false;
+  auto ok = write_csgb(csg, [fs](const void* data, size_t size) {
+    return fwrite(data, size, 1, fs) == 1;
+  });
+  ok = fclose(fs) == 0 && ok;
+  auto error = std::error_code{};
+  if (ok) std::filesystem::rename(temporary, filename, error);
+  if (!ok || error) std::filesystem::remove(temporary, error);
+  return ok && !error;
+}
+
+// Bytes of the tree as in a .csgb file, e.g. to send it to other processes.
+// Returns false for trees with instances or meshes.
+inline bool encode_csgb(const CsgTree& csg, vector<uint8_t>& data) {
+  data.clear();
+  return write_csgb(csg, [&data](const void* bytes, size_t size) {
+    data.insert(data.end(), (const uint8_t*)bytes,
+        (const uint8_t*)bytes + size);
+    return true;
+  });
+}
+
+// Copies a section into `values`. Returns false if it does not fit.
+template <typename T>
+inline bool read_csgb_section(const uint8_t* data, size_t size,
+    const CsgBinaryHeader& header, csgb_section section, vector<T>& values) {
+  auto [offset, length] = header.sections[(int)section];
+  if (offset > size || length > size - offset || length % sizeof(T))
+    return false;
+  values.resize(length / sizeof(T));
+  if (length) memcpy(values.data(), data + offset, length);
+  return true;
+}
+
+// Decodes the `size` bytes of a tree written by save_csgb or encode_csgb,
+// which names keep alive and point into. Returns false if they are of
+// another version or layout, or do not match their hash.
+inline bool decode_csgb(
+    const std::shared_ptr<void>& file, size_t size, CsgTree& csg) {
+  if (!file || size < sizeof(CsgBinaryHeader)) return false;
+  auto data   = (const uint8_t*)file.get();
+  auto header = CsgBinaryHeader{};
+  memcpy(&header, data, sizeof(header));
+  auto check = CsgBinaryHeader{};
+  if (memcmp(header.magic, check.magic, sizeof(check.magic)) != 0 ||
+      header.version != check.version || header.node_size != check.node_size)
+    return false;
+
+  auto result  = CsgTree{};
+  auto groups  = vector<uint64_t>{};
+  auto centers = vector<vec3f>{};
+  auto radius  = vector<float>{};
+  auto nodes   = vector<bvh_node>{};
+  auto points  = vector<int>{};
+  auto offsets = vector<uint64_t>{};
+  auto table   = vector<int>{};
+  if (!read_csgb_section(data, size, header, csgb_section::nodes,
+          result.nodes) ||
+      !read_csgb_section(data, size, header, csgb_section::bounds,
+          result.bounds) ||
+      !read_csgb_section(data, size, header, csgb_section::groups, groups) ||
+      !read_csgb_section(data, size, header, csgb_section::centers,
+          centers) ||
+      !read_csgb_section(data, size, header, csgb_section::radius, radius) ||
+      !read_csgb_section(data, size, header, csgb_section::bvh_nodes,
+          nodes) ||
+      !read_csgb_section(data, size, header, csgb_section::bvh_primitives,
+          points) ||
+      !read_csgb_section(data, size, header, csgb_section::name_offsets,
+          offsets) ||
+      !read_csgb_section(data, size, header, csgb_section::name_table, table))
+    return false;
+  result.root = header.root;
+
+  // groups take their slices of the concatenated arrays
+  if (groups.size() % 3) return false;
+  auto next = vec3i{0, 0, 0};
+  for (auto k = 0; k < groups.size(); k += 3) {
+    auto count = vec3i{(int)groups[k], (int)groups[k + 1], (int)groups[k + 2]};
+    if (next.x + count.x > centers.size() || centers.size() != radius.size() ||
+        next.y + count.y > nodes.size() || next.z + count.z > points.size())
+      return false;
+    auto& group = result.groups.emplace_back();
+    group.centers.assign(
+        centers.begin() + next.x, centers.begin() + next.x + count.x);
+    group.radius.assign(
+        radius.begin() + next.x, radius.begin() + next.x + count.x);
+    group.bvh.nodes.assign(
+        nodes.begin() + next.y, nodes.begin() + next.y + count.y);
+    group.bvh.primitives.assign(
+        points.begin() + next.z, points.begin() + next.z + count.z);
+    next += count;
+  }
+
+  // names point into the mapped file, which they keep alive
+  if (header.named) {
+    auto [offset, length] = header.sections[(int)csgb_section::name_chars];
+    if (offset > size || length > size - offset) return false;
+    auto& names = *(result.names = std::make_shared<CsgNames>());
+    names.file  = file;
+    names.table = std::move(table);
+    auto text   = (const char*)data + offset;
+    for (auto k = 0; k + 1 < offsets.size(); k++) {
+      if (offsets[k] > offsets[k + 1] || offsets[k + 1] > length) return false;
+      names.names.push_back({text + offsets[k], offsets[k + 1] - offsets[k]});
+    }
+    for (auto index : names.table)
+      if (index >= (int)names.names.size()) return false;
+    if (names.table.size() & (names.table.size() - 1)) return false;
+  }
+  auto named = result.names ? (int)result.names->names.size() : 0;
+  for (auto& node : result.nodes)
+    if (node.name >= named) return false;
+
+  if (hash_csg(result) != header.hash) return false;
+  update_hashes(result);
+  csg = std::move(result);
+  return true;
+}
+
+// Loads a tree written by save_csgb, mapping the file. Returns false if the
+// file cannot be read or decoded.
+inline bool load_csgb(const string& filename, CsgTree& csg) {
+  auto size = (size_t)0;
+  auto file = map_grid_file(filename, size, false);
+  return decode_csgb(file, size, csg);
+}
+
+// Decodes a copy of the bytes, for buffers that may not outlive the tree.
+inline bool decode_csgb(const void* data, size_t size, CsgTree& csg) {
+  auto copy = std::make_shared<vector<uint8_t>>(
+      (const uint8_t*)data, (const uint8_t*)data + size);
+  return decode_csgb(
+      std::shared_ptr<void>(copy, copy->data()), copy->size(), csg);
+}
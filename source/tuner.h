@@ -0,0 +1,252 @@
+#pragma once
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <thread>
+
+#include "grid.h"
+#include "jit.h"
+#include "tape_io.h"
+
+// Choice of the backend that evaluates a tree, by timing the candidates on
+// points sampled in its bounds when it is loaded. Each candidate evaluates
+// the same points, as many as fit in its share of the time budget, and is
+// compared with the exact values of the batch kernel: near the surface,
+// where marching reads the distances, and everywhere, as batch queries read
+// them. Each consumer takes the fastest of the backends it can use whose
+// error is within its tolerance, relative to the size of the bounds:
+// previews accept the error of a baked grid, renders and batch queries do
+// not, and batch queries also need exact values away from the surface,
+// which bound guards replace with bounds.
+//
+// The CPU backends are made by cpu_backends; others, e.g. the GPU of gpu.h,
+// are added by callers as CsgBackend. Timings are cached in the tune folder
+// of the user, see user_cache_directory, or in CSG_TUNE_CACHE, keyed by the
+// tree, the names of the candidates and the CPU model, so that reopening a
+// scene on the same machine takes its choices without timing it again.
+
+enum struct csg_consumer { preview, render, batch };
+
+inline const auto csg_consumer_names = vector<string>{
+    "preview", "render", "batch"};
+
+// A backend that writes the values of the points to `out`.
+struct CsgBackend {
+  string                                                 name = "";
+  std::function<void(span<const vec3f>, span<float> out)> eval = {};
+};
+
+struct CsgBackendTiming {
+  string name    = "";
+  double ns      = 0;  // per point
+  float  surface = 0;  // largest error near the surface, over the size
+  float  error   = 0;  // largest error, over the size
+};
+
+struct CsgTuneParams {
+  double budget        = 0.25;    // seconds, shared by the candidates
+  int    points        = 4096;    // sampled in the bounds
+  float  band          = 0.002f;  // of the surface, over the size
+  float  tolerances[3] = {1.0f / 128, 1e-4f, 1e-4f};  // by consumer
+  bool   cached        = true;
+};
+
+struct CsgTuning {
+  vector<CsgBackendTiming> timings = {};
+  string                   choices[3] = {};  // by consumer, see tune_csg
+  bool                     cached     = false;
+};
+
+inline const string& choice(const CsgTuning& tuning, csg_consumer consumer) {
+  return tuning.choices[(int)consumer];
+}
+
+// Whether the consumer can use the backend of this name.
+inline bool consumer_uses(csg_consumer consumer, const string& name) {
+  switch (consumer) {
+    case csg_consumer::preview:
+      return name == "tape" || name == "jit" || name == "grid";
+    case csg_consumer::render:
+      return name == "tape" || name == "jit" || name == "gpu";
+    case csg_consumer::batch: return name != "grid";
+  }
+  return false;
+}
+
+// Backends of the CPU: the tree interpreted node by node, the tape one point
+// at a time, its native code if `jit` is valid, the grid if given, and the
+// batch kernel on a tape without guards, as batch queries compile it. All
+// are evaluated in parallel over the points, as their consumers run them,
+// and refer to the arguments, which must outlive them.
+inline vector<CsgBackend> cpu_backends(const CsgTree& csg,
+    const CsgTape& tape, const CsgJit& jit, const CsgGrid* grid = nullptr) {
+  auto backends = vector<CsgBackend>{};
+  auto each     = [](span<const vec3f> points, span<float> out, auto&& eval) {
+    parallel_for_chunks((int)points.size(), [&](int begin, int end) {
+      for (auto i = begin; i < end; i++) out[i] = eval(points[i]);
+    }, 256);
+  };
+  backends.push_back({"interpreter", [&csg, each](auto points, auto out) {
+    each(points, out, [&csg](const vec3f& p) { return eval_csg(csg, p); });
+  }});
+  backends.push_back({"tape", [&tape, each](auto points, auto out) {
+    each(points, out, [&tape](const vec3f& p) { return eval_tape(tape, p); });
+  }});
+  auto exact = std::make_shared<CsgTape>(compile_csg(csg, flt_max));
+  backends.push_back({"batch", [exact](auto points, auto out) {
+    auto options       = CsgBatchOptions{};
+    options.block_size = 256;
+    eval_csg_batch(*exact, points, out, options);
+  }});
+  if (is_valid(jit))
+    backends.push_back({"jit", [&tape, &jit, each](auto points, auto out) {
+      each(points, out,
+          [&](const vec3f& p) { return eval_jit(jit, tape, p); });
+    }});
+  if (grid)
+    backends.push_back({"grid", [grid, each](auto points, auto out) {
+      each(points, out,
+          [grid](const vec3f& p) { return eval_grid(*grid, p); });
+    }});
+  return backends;
+}
+
+// Model of the CPU, as Linux names it, or the number of threads elsewhere.
+inline string cpu_model() {
+  auto threads = std::to_string(std::thread::hardware_concurrency());
+  auto fs      = std::ifstream{"/proc/cpuinfo"};
+  for (auto line = string{}; std::getline(fs, line);) {
+    if (line.rfind("model name", 0) != 0) continue;
+    auto colon = line.find(':');
+    if (colon == string::npos) break;
+    return line.substr(colon + 2) + " x" + threads;
+  }
+  return "cpu x" + threads;
+}
+
+// Cache folder of the timings, or an empty path if there is none.
+inline std::filesystem::path tune_cache_directory() {
+  return user_cache_directory("tune", "CSG_TUNE_CACHE");
+}
+
+// Key of the timings: the tree, the candidates and the CPU.
+inline uint64_t tune_key(
+    const CsgTree& csg, const vector<CsgBackend>& backends) {
+  auto hash = tape_key(csg, 0);
+  auto cpu  = cpu_model();
+  hash      = hash_bytes(hash, cpu.data(), cpu.size());
+  for (auto& backend : backends)
+    hash = hash_bytes(hash, backend.name.data(), backend.name.size() + 1);
+  return hash;
+}
+
+// Timings as text, a backend per line, written and renamed in place.
+inline bool save_tuning(const string& filename, const CsgTuning& tuning,
+    uint64_t key) {
+  auto temporary = filename + ".tmp" + std::to_string(process_id());
+  auto fs        = fopen(temporary.c_str(), "w");
+  if (!fs) return false;
+  fprintf(fs, "csgtune1 %llu\n", (unsigned long long)key);
+  for (auto& timing : tuning.timings)
+    fprintf(fs, "%s %.9g %.9g %.9g\n", timing.name.c_str(), timing.ns,
+        timing.surface, timing.error);
+  auto ok    = fclose(fs) == 0;
+  auto error = std::error_code{};
+  if (ok) std::filesystem::rename(temporary, filename, error);
+  if (!ok || error) std::filesystem::remove(temporary, error);
+  return ok && !error;
+}
+
+inline bool load_tuning(const string& filename, CsgTuning& tuning,
+    uint64_t key, size_t num_backends) {
+  auto fs     = std::ifstream{filename};
+  auto magic  = string{};
+  auto stored = (unsigned long long)0;
+  if (!(fs >> magic >> stored) || magic != "csgtune1" || stored != key)
+    return false;
+  auto timings = vector<CsgBackendTiming>{};
+  for (auto timing = CsgBackendTiming{};
+       fs >> timing.name >> timing.ns >> timing.surface >> timing.error;)
+    timings.push_back(timing);
+  if (timings.size() != num_backends) return false;
+  tuning.timings = std::move(timings);
+  return true;
+}
+
+// Fastest backend of each consumer that is accurate enough, or an empty
+// name if there is none.
+inline void choose_backends(CsgTuning& tuning, const CsgTuneParams& params) {
+  for (auto consumer = 0; consumer < 3; consumer++) {
+    auto& result = tuning.choices[consumer];
+    auto  best   = flt_max;
+    result       = "";
+    for (auto& timing : tuning.timings) {
+      auto batch = consumer == (int)csg_consumer::batch;
+      auto error = batch ? timing.error : timing.surface;
+      if (!consumer_uses((csg_consumer)consumer, timing.name)) continue;
+      if (!(error <= params.tolerances[consumer])) continue;
+      if (timing.ns >= best) continue;
+      best   = timing.ns;
+      result = timing.name;
+    }
+  }
+}
+
+// Times the backends on points sampled in the bounds of the tree. Each one
+// evaluates a few points once to warm up, e.g. to load its code, then more
+// points at a time until its share of the budget is spent, and keeps its
+// best time per point. Slow backends may overrun their share by a run.
+inline CsgTuning tune_csg(const CsgTree& csg,
+    const vector<CsgBackend>& backends, const CsgTuneParams& params = {}) {
+  if (params.points < 64) throw std::invalid_argument{"too few points"};
+  auto tuning   = CsgTuning{};
+  auto key      = tune_key(csg, backends);
+  auto filename = string{};
+  auto directory = params.cached ? tune_cache_directory() : "";
+  if (!directory.empty()) {
+    filename = (directory / (std::to_string(key) + ".tune")).string();
+    tuning.cached = load_tuning(filename, tuning, key, backends.size());
+  }
+
+  if (!tuning.cached) {
+    auto bounds = csg.bounds.size() == csg.nodes.size() &&
+                          is_bounded(csg.bounds[csg.root])
+                      ? csg.bounds[csg.root]
+                      : bbox3f{{-0.5, -0.5, -0.5}, {0.5, 0.5, 0.5}};
+    auto size   = yocto::max(max(bounds.max - bounds.min), flt_eps);
+    auto rng    = make_rng(1301081);
+    auto points = vector<vec3f>(params.points);
+    for (auto& point : points)
+      point = bounds.min + rand3f(rng) * (bounds.max - bounds.min);
+
+    auto exact = vector<float>(points.size());
+    eval_csg_batch(compile_csg(csg, flt_max), points, exact);
+    auto values = vector<float>(points.size());
+    auto share  = params.budget / yocto::max((int)backends.size(), 1);
+    for (auto& backend : backends) {
+      auto timing = CsgBackendTiming{backend.name, flt_max, 0, 0};
+      auto num    = (size_t)8;
+      backend.eval({points.data(), num}, {values.data(), num});
+      auto spent = 0.0;
+      for (num = 64; spent < share; num = std::min(num * 4, points.size())) {
+        auto start = get_time();
+        backend.eval({points.data(), num}, {values.data(), num});
+        auto elapsed = (get_time() - start) * 1e-9;
+        spent += elapsed;
+        timing.ns = std::min(timing.ns, elapsed * 1e9 / num);
+        for (auto i = (size_t)0; i < num; i++) {
+          auto error = std::abs(values[i] - exact[i]) / size;
+          if (std::isnan(error)) error = flt_max;
+          timing.error = yocto::max(timing.error, error);
+          if (std::abs(exact[i]) > params.band * size) continue;
+          timing.surface = yocto::max(timing.surface, error);
+        }
+      }
+      tuning.timings.push_back(timing);
+    }
+    if (!filename.empty()) save_tuning(filename, tuning, key);
+  }
+  choose_backends(tuning, params);
+  return tuning;
+}
@@ -0,0 +1,65 @@
+#pragma once
+#include <cstdlib>
+#include <filesystem>
+#include <string>
+
+#if !defined(_WIN32)
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Folders of the caches on disk, of JIT libraries, tapes, grids and
+// timings, which are loaded, mapped or trusted as they are, so they must
+// not be shared with other users. Caches are folders of csg-explorer in the
+// cache folder of the user, $XDG_CACHE_HOME or else ~/.cache, or in the
+// temporary directory, named after the user id, if neither is set, and each
+// can be moved by an environment variable. Folders are made readable by
+// the user only, and on POSIX systems they are only used if they are owned
+// by the user, are not links, and cannot be written by others.
+
+// Whether the folder exists and only the user can write it.
+inline bool is_private_directory(const std::filesystem::path& directory) {
+#if !defined(_WIN32)
+  struct stat info;
+  if (lstat(directory.c_str(), &info) != 0) return false;
+  return S_ISDIR(info.st_mode) && info.st_uid == geteuid() &&
+         (info.st_mode & (S_IWGRP | S_IWOTH)) == 0;
+#else
+  return std::filesystem::is_directory(directory);
+#endif
+}
+
+// Folder of the cache `name`, or of the variable `env` if it is set, made
+// if needed. Returns an empty path if it cannot be made or is not private,
+// in which case callers do not cache.
+inline std::filesystem::path user_cache_directory(
+    const std::string& name, const char* env) {
+  auto directory = std::filesystem::path{};
+  if (auto path = getenv(env); path && *path) {
+    directory = path;
+  } else if (auto xdg = getenv("XDG_CACHE_HOME"); xdg && *xdg == '/') {
+    directory = std::filesystem::path{xdg} / "csg-explorer" / name;
+  } else if (auto home = getenv("HOME"); home && *home == '/') {
+    directory = std::filesystem::path{home} / ".cache" / "csg-explorer" / name;
+  } else {
+    auto error = std::error_code{};
+    auto temp  = std::filesystem::temp_directory_path(error);
+    if (error) return {};
+#if !defined(_WIN32)
+    auto user = "csg-explorer-" + std::to_string(geteuid());
+#else
+    auto user = std::string{"csg-explorer"};
+#endif
+    // the folder of the user could be made by others before it
+    std::filesystem::create_directories(temp / user, error);
+    if (!is_private_directory(temp / user)) return {};
+    directory = temp / user / name;
+  }
+  auto error = std::error_code{};
+  std::filesystem::create_directories(directory, error);
+  if (std::filesystem::is_symlink(directory, error)) return {};
+  std::filesystem::permissions(directory, std::filesystem::perms::owner_all,
+      std::filesystem::perm_options::replace, error);
+  if (!is_private_directory(directory)) return {};
+  return directory;
+}
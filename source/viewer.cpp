@@ -0,0 +1,2233 @@
+#include "viewer.h"
+//
+#include "csg.h"
+#include "denoise.h"
+#include "glsl.h"
+#include "grid_io.h"
+#include "parser.h"
+#include "jit.h"
+#include "memory.h"
+#include "mesh.h"
+#include "profile.h"
+#include "queue.h"
+#include "raymarch.h"
+#include "tape.h"
+#include "tape_io.h"
+#include "tiles.h"
+#include "tuner.h"
+#include "zones.h"
+//
+#include "ext/yocto-gl/apps/yocto_opengl.h"
+#include "ext/yocto-gl/yocto/yocto_common.h"
+#include "ext/yocto-gl/yocto/yocto_commonio.h"
+#include "ext/yocto-gl/yocto/yocto_shape.h"
+#include "ext/yocto-gl/yocto/yocto_trace.h"
+using namespace yocto;
+
+#include <fstream>
+#include <future>
+#include <list>
+#include <memory>
+#include <sstream>
+#include <thread>
+using namespace std;
+
+double get_seconds() { return get_time() * 1e-9; }
+
+// Application state
+// Everything a frame is rendered from, immutable once published, see
+// publish_request. Requests share the tree until it is edited, so that
+// moving the camera does not copy it, and `version` counts the changes of
+// anything but the camera, so that views are reprojected only if it is the
+// one of the previous frame.
+struct frame_request {
+  int                           generation = 0;
+  int                           version    = 0;
+  shared_ptr<const Csg>         csg        = {};
+  shared_ptr<const CsgTape>     tape       = {};  // of csg, if compiled on load
+  trace_camera                  camera     = {};
+  trace_params                  params     = {};
+  march_params                  march      = {};
+  shared_ptr<CsgGrid>           grid       = {};  // baked, if used
+  shared_ptr<const CsgLighting> lighting   = {};  // baked, if used
+  shared_ptr<CsgRadianceCache>  radiance   = {};  // of the paths, if used
+  bool                          footprint  = false;
+  float                         noise      = 0;
+  bool                          gpu        = false;  // drawn on the UI thread
+  bool                          native     = true;  // with the code of jit.h
+  bool                          denoise    = false;  // once it is finished
+  pair<vec2i, vec2i>            visible    = {};  // pixels shown, all if empty
+};
+
+// Edits sent to the UI thread, which applies them before publishing the
+// next request, see apply_commands. Commands are plain values, so that
+// sending them does not allocate. Parameters set between begin_edit and
+// commit_edit are applied together, with one frame and one step of the
+// history, however many updates they take to arrive.
+enum struct app_command_type {
+  set_param,
+  set_camera,
+  reload,
+  set_exposure,
+  undo,
+  redo,
+  begin_edit,
+  commit_edit
+};
+
+struct app_command {
+  app_command_type type   = app_command_type::set_param;
+  int              node   = 0;  // and parameter of set_param, see node_param
+  int              param  = 0;
+  float            value  = 0;   // of set_param and set_exposure
+  trace_camera     camera = {};  // of set_camera
+};
+
+// Edit of a parameter, undone by setting the old value back. Edits of the
+// same parameter in quick succession, e.g. the steps of a slider drag, merge
+// into one.
+struct app_edit {
+  int    node    = 0;
+  int    param   = 0;
+  float  before  = 0;
+  float  after   = 0;
+  double time    = 0;      // of the latest step, in seconds
+  bool   chained = false;  // undone with the previous one, see commit_edits
+};
+
+// Edits of the tree since it was loaded. Edits only change parameters, so
+// the history holds their values instead of copies of the tree, a few bytes
+// per edit whatever its size, and every state shares the nodes of the tree.
+// Reloads keep the history while the structure stays the same. Undone edits
+// are redone until a new edit clears them.
+struct app_history {
+  vector<app_edit> undo = {};
+  vector<app_edit> redo = {};
+};
+
+// Tree loaded in the background, with everything the viewer needs before
+// swapping it in, see update_load.
+struct loaded_tree {
+  Csg                       csg        = {};
+  shared_ptr<const Csg>     snapshot   = {};
+  shared_ptr<const CsgTape> tape       = {};  // of the snapshot
+  shared_ptr<CsgGrid>       grid       = {};  // if baked
+  int                       resolution = 0;   // of the grid
+  string                    backend    = "";  // of previews, see tune_csg
+};
+
+// Costs of the subtrees of a view, computed in the background, see
+// profile.h. The table shows the costliest ones, and graphs of the same tree
+// are drawn with their heat.
+struct app_profile {
+  shared_ptr<const Csg> csg   = {};
+  vector<CsgNodeCost>   costs = {};  // costliest first
+  vector<float>         heat  = {};
+};
+
+// Performance of the latest CPU frame, written by the render task and shown
+// by draw_glperformance. Utilization is the time of the tiles over the time
+// of the refinement times its threads.
+struct app_performance {
+  atomic<float>   latency = {0};  // ms from the start to the first image
+  atomic<int>     samples = {0};  // finished since the start
+  atomic<int64_t> time    = {0};  // ns of the refinement
+  atomic<int64_t> busy    = {0};  // ns of the tiles, summed over threads
+  atomic<size_t>  buffers = {0};  // bytes of the render buffers
+  atomic<size_t>  tape    = {0};  // bytes of the tape
+  atomic<size_t>  views   = {0};  // bytes of the cached views
+  // ms from a stop of the refinement to the render task taking the next
+  // request, the latest and the largest, and the stops over the budget
+  atomic<float> cancel      = {0};
+  atomic<float> cancel_max  = {0};
+  atomic<int>   cancel_over = {0};
+};
+
+// Render of a view, kept when another view replaces it, so that going back
+// to it, e.g. to a camera bookmark or to the values before an edit, shows it
+// at once and resumes its tiles where they stopped. Views are keyed by the
+// root hash of the tree, see update_hashes, and by the camera and the render
+// options, see view_key. The views used least recently are dropped once
+// they exceed the budget. Only the render task touches them.
+struct app_view {
+  uint64_t        key     = 0;
+  march_buffer    state   = {};
+  image<vec4f>    render  = {};
+  image<float>    moments = {};
+  march_starts    starts  = {};
+  vector<CsgTile> tiles   = {};
+  size_t          bytes   = 0;
+};
+
+struct app_view_cache {
+  std::list<app_view> views  = {};  // most recently used first
+  size_t              bytes  = 0;
+  size_t              budget = (size_t)512 << 20;
+};
+
+// Command applied by the UI thread, at seconds since the first tree was
+// swapped in, as recorded by run_viewer and replayed by replay_viewer.
+struct app_event {
+  double      time    = 0;
+  app_command command = {};
+};
+
+// Frames of the requests of a replay: the first image shown, the end of the
+// first pass over all the pixels at full resolution, and the end of the
+// refinement, and the reloads swapped in, at the ns of get_time.
+enum struct app_mark_type { preview, full, finished, loaded };
+
+struct app_mark {
+  app_mark_type type       = app_mark_type::preview;
+  int           generation = 0;  // of the frame or of the loaded tree
+  int64_t       time       = 0;
+};
+
+struct app_state {
+  // loading options
+  string filename  = "scene.csg";
+  string imagename = "out.png";
+  string graphname = "tree.png";  // drawn with G, see save_tree_png
+  string name      = "";
+
+  trace_camera camera;
+
+  // options
+  trace_params params            = {};
+  march_params march             = {};
+  bool         footprint         = false;
+  float        noise             = 0.005;  // of converged tiles, 0 to not stop
+  int          preview_downscale = 6;
+  float        preview_budget    = 16;  // milliseconds, 0 to keep downscale
+  bool         fast_preview      = true;  // approximate while moving
+  float        cancel_budget     = 2;  // milliseconds, see app_performance
+  int          interleave        = 0;  // 0 for previews, see interleave_render
+  int          interleave_phase  = 0;  // of the next interleaved frame
+  bool         denoise           = false;  // finished frames, see denoise.h
+  bool         radiance_cache    = false;  // of paths, see radiance.h
+  shared_ptr<CsgRadianceCache> radiance = {};  // made once it is used
+
+  Csg         csg      = {};  // edited on the UI thread only
+  int         selected = 0;
+  int         sphere   = 0;  // of the selected group
+  vec2i       pick     = {-1, -1};  // pixel clicked to select, see update_pick
+  app_history history  = {};
+
+  // tree of the requests, taken again when it is cleared by edits
+  shared_ptr<const Csg>     snapshot      = {};
+  shared_ptr<const CsgTape> snapshot_tape = {};  // if it is the loaded one
+  int                       version       = 0;   // see frame_request
+  string                    backend       = "";  // of the loaded tree
+
+  // tape of the tree of the latest frame, kept while only the camera moves
+  shared_ptr<const Csg> compiled      = {};
+  CsgTape               tape          = {};
+  CsgJit                jit           = {};  // of the frame, see start_jit
+  CsgJit                fast_jit      = {};  // approximate, for previews
+  shared_ptr<CsgJitTiers> jit_tiers   = {};  // built while the tape renders
+  shared_ptr<CsgJitTiers> fast_tiers  = {};
+  CsgReplicas<CsgTape>  tapes         = {};  // of tape per node
+  int                   frame_version = -1;
+  shared_ptr<const Csg> radiance_csg  = {};  // last lit in the cache
+
+  // request of the frame being refined, whose samples are kept where edits
+  // do not change the image, see dirty_pixels
+  shared_ptr<const frame_request> refined = {};
+
+  // baked preview, the tape is used while the grid is rebaked
+  bool                baked           = false;
+  int                 bake_resolution = 128;
+  bool                bake_dirty      = true;
+  shared_ptr<CsgGrid> grid            = {};
+  shared_ptr<CsgGrid> baked_grid      = {};  // written by the bake thread
+  atomic<bool>        bake_ready      = {};
+  future<void>        bake_future     = {};
+
+  // BVH of a group built again in the background, once the refits of the
+  // edits of its spheres loosened it below `group_quality`, see refit_group.
+  // Spheres edited meanwhile are refit into it when it is taken.
+  float        group_quality  = 0.5;
+  int          rebuilt_node   = -1;  // of the group, -1 to drop the build
+  CsgGroup     rebuilt        = {};  // written by the build thread
+  vector<int>  rebuilt_edits  = {};  // spheres edited during the build
+  atomic<bool> rebuild_ready  = {};
+  future<void> rebuild_future = {};
+
+  // shadows and occlusion baked in the background, see bake_lighting, and
+  // the tree of each volume. Edits are relit from the previous volume,
+  // which is shown until the new one is ready.
+  bool                          lit                 = false;
+  int                           lighting_resolution = 48;
+  shared_ptr<const CsgLighting> lighting            = {};
+  shared_ptr<const Csg>         lighting_csg        = {};
+  shared_ptr<const CsgLighting> lit_volume          = {};  // of the thread
+  shared_ptr<const Csg>         lit_csg             = {};
+  atomic<bool>                  lighting_ready      = {};
+  future<void>                  lighting_future     = {};
+
+  // mesh of the surface drawn instead of the render while the camera moves,
+  // and until it stays still for `proxy_settle` seconds, so that orbits do
+  // not wait on previews. Meshes are extracted in the background from the
+  // snapshots, and the latest one is drawn until the next is ready.
+  bool                      proxy            = true;
+  int                       proxy_resolution = 64;
+  float                     proxy_settle     = 0.3;
+  double                    camera_moved     = -1;  // seconds, see set_camera
+  shared_ptr<const Csg>     proxy_csg        = {};  // of the latest meshing
+  shared_ptr<const CsgMesh> proxy_mesh       = {};  // not uploaded yet
+  shared_ptr<const CsgMesh> proxy_meshed     = {};  // of the mesh thread
+  atomic<bool>              proxy_ready      = {};
+  future<void>              proxy_future     = {};
+  opengl_scene              glscene          = {};  // of the proxy
+
+  // reloads of the file, the old tree is rendered until the new one is
+  // ready, and reloads requested meanwhile start when it is done
+  bool                    load_pending  = false;
+  shared_ptr<loaded_tree> loaded        = {};  // written by the load thread
+  atomic<float>           load_progress = {};  // of the parse
+  atomic<bool>            load_ready    = {};
+  future<void>            load_future   = {};
+  future<void>            graph_future  = {};
+
+  // profile shown in the table, and the one being computed
+  shared_ptr<app_profile> profile        = {};
+  shared_ptr<app_profile> profiling      = {};
+  future<void>            profile_future = {};
+
+  // reloads when the file is written, checked a few times a second
+  bool                            watch         = false;
+  std::filesystem::file_time_type watched       = {};
+  double                          watch_checked = 0;
+
+  // rendering state
+  march_buffer state    = {};
+  trace_camera rendered = {};  // camera of the render and of its first hits
+  bool         moved    = false;  // only the camera changed since then
+  image<vec4f> render   = {};  // replaced under the mutex
+  mutex        display_mutex = {};
+  // parts of the display to upload, all of it when replaced
+  vector<pair<vec2i, vec2i>> display_regions = {};
+  bool                       display_all     = true;
+  atomic<bool> sleeping = {false};  // the UI waits for events, see wake_ui
+  image<float> moments  = {};  // sums of the squared samples, see tile_error
+  // passes of the first samples of the render, from which edits of the
+  // shading relight it, see relight_samples, and the key of the hits they
+  // hold, see hits_key, 0 until all of them are written
+  march_aovs gbuffer     = {};
+  uint64_t   gbuffer_key = 0;
+
+  // view scene, the render is tonemapped when drawn
+  opengl_image        glimage  = {};
+  draw_glimage_params glparams = {};
+  pair<vec2i, vec2i>  visible  = {};  // of the requests, see visible_pixels
+
+  // GPU backend, see glsl.h. Frames are marched on the UI thread, a sample
+  // per drawn frame, when the tree and the camera allow it, and on the CPU
+  // otherwise or once the shader failed to build.
+  bool        gpu        = true;
+  bool        gpu_failed = false;
+  bool        gpu_frame  = false;  // the latest frame runs on the GPU
+  int         gpu_sample = 0;
+  uint64_t    gpu_hash   = 0;  // of the tape structure of the shader
+  opengl_pass glpass     = {};
+
+  // steps of the progressive render since the last reset, the distances its
+  // rays skip, and its performance
+  march_stats     stats       = {};
+  march_starts    starts      = {};
+  app_performance performance = {};
+  app_view_cache  views       = {};  // of the frames refined before
+
+  // computation, tiles are rendered from the center out. Edits bump the
+  // generation and publish a request, which stops the refinement of the
+  // frame being rendered at its next tiles. The render task then picks up
+  // the latest request, so requests made meanwhile merge, and the UI never
+  // waits on it.
+  vector<CsgTile>                 tiles              = {};
+  vector<march_frustum>           frustums           = {};  // of the tiles
+  atomic<bool>                    render_stop        = {};  // of refinement
+  atomic<int64_t>                 stop_time          = {0};  // ns, of the stop
+  future<void>                    render_future      = {};
+  shared_ptr<const frame_request> request            = {};  // atomic access
+  int                             render_generation  = 0;  // of latest edit
+  int                             request_generation = 0;  // latest request
+  atomic<int> rendered_generation = {-1};  // of the latest frame finished
+
+  // commands sent by any thread, see apply_commands, and the parameters of
+  // the open transaction, applied by commit_edits
+  CsgQueue<app_command, 256> commands = {};
+  vector<app_command>        edits    = {};
+  int                        editing  = 0;  // depth of begin_edit
+
+  // commands applied, when recorded, and frames shown, when replayed, see
+  // replay_viewer. The marks are written under the display mutex.
+  double            started   = -1;  // seconds of the first tree swapped in
+  bool              recording = false;
+  vector<app_event> events    = {};
+  bool              timing    = false;
+  vector<app_mark>  marks     = {};
+
+  ~app_state() {
+    render_stop = true;
+    if (render_future.valid()) render_future.get();
+    if (bake_future.valid()) bake_future.get();
+    if (rebuild_future.valid()) rebuild_future.get();
+    if (lighting_future.valid()) lighting_future.get();
+    if (proxy_future.valid()) proxy_future.get();
+    if (profile_future.valid()) profile_future.get();
+  }
+};
+
+// Display of `size` pixels from a preview and the first hits of its pixels.
+// Each pixel blends the 4 nearest preview pixels bilinearly, and the hits
+// are also weighted by how close they are to the tangent plane at the hit of
+// the nearest one, so that surfaces in front do not blend with the ones
+// behind them. Distances are measured against the spacing of the hits, and
+// normals are found from the hits of the neighbours. Hits and misses blend
+// as usual, which smooths the silhouettes.
+image<vec4f> upsample_preview(const image<vec4f>& preview,
+    const march_starts& starts, const trace_camera& camera,
+    const vec2i& size) {
+  auto psize = preview.size();
+  auto index = [psize](int i, int j) {
+    return clamp(j, 0, psize.y - 1) * psize.x + clamp(i, 0, psize.x - 1);
+  };
+  auto hit       = [&starts](int k) { return starts.depth[k] > 0; };
+  auto positions = vector<vec3f>(psize.x * psize.y);
+  auto spacings  = vector<float>(psize.x * psize.y);
+  for (auto j = 0; j < psize.y; j++) {
+    for (auto i = 0; i < psize.x; i++) {
+      auto k = index(i, j);
+      if (!hit(k)) continue;
+      auto ray     = sample_camera(camera, {i, j}, psize, {0.5, 0.5}, {0, 0});
+      positions[k] = ray.o + ray.d * starts.depth[k];
+    }
+  }
+  auto normals = vector<vec3f>(psize.x * psize.y, {0, 0, 0});
+  for (auto j = 0; j < psize.y; j++) {
+    for (auto i = 0; i < psize.x; i++) {
+      auto k = index(i, j);
+      if (!hit(k)) continue;
+      // one sided differences where the other side misses
+      auto difference = [&](int a, int b) {
+        if (hit(a) && hit(b)) return positions[b] - positions[a];
+        if (hit(b)) return positions[b] - positions[k];
+        if (hit(a)) return positions[k] - positions[a];
+        return vec3f{0, 0, 0};
+      };
+      auto dx = difference(index(i - 1, j), index(i + 1, j));
+      auto dy = difference(index(i, j - 1), index(i, j + 1));
+      auto n  = cross(dy, dx);
+      if (length(n) > 0) normals[k] = normalize(n);
+      spacings[k] = yocto::max(length(dx), length(dy));
+    }
+  }
+
+  auto display = image{size, zero4f};
+  auto scale   = vec2f{(float)psize.x / size.x, (float)psize.y / size.y};
+  parallel_for(
+      size.y,
+      [&](int j) {
+        for (auto i = 0; i < size.x; i++) {
+          auto uv = vec2f{
+              (i + 0.5f) * scale.x - 0.5f, (j + 0.5f) * scale.y - 0.5f};
+          auto x = (int)floor(uv.x), y = (int)floor(uv.y);
+          auto t = uv - vec2f{(float)x, (float)y};
+          auto r = index((int)round(uv.x), (int)round(uv.y));
+          auto color  = zero4f;
+          auto weight = 0.0f;
+          for (auto c = 0; c < 4; c++) {
+            auto k = index(x + (c & 1), y + (c >> 1));
+            auto w = (c & 1 ? t.x : 1 - t.x) * (c >> 1 ? t.y : 1 - t.y);
+            if (hit(r) && hit(k) && k != r) {
+              auto plane = fabs(dot(positions[k] - positions[r], normals[r]));
+              auto sigma = yocto::max(spacings[r], 1e-6f) * 2;
+              w *= std::exp(-(plane * plane) / (sigma * sigma));
+            }
+            color += preview[k] * w;
+            weight += w;
+          }
+          display[{i, j}] = weight > 0 ? color / weight : preview[r];
+        }
+      },
+      pool_priority());
+  return display;
+}
+
+// Downscale of the next preview, so that previews take about `budget`
+// seconds. Their cost goes with their pixels, i.e. with the inverse square
+// of the downscale, and changes by less than a quarter are ignored so that
+// it does not flicker between two values.
+inline int adapt_downscale(int downscale, float elapsed, float budget) {
+  if (budget <= 0 || elapsed <= 0) return downscale;
+  auto scale = std::sqrt(elapsed / budget);
+  if (scale > 0.8f && scale < 1.25f) return downscale;
+  return clamp((int)round(downscale * scale), 1, 16);
+}
+
+inline bool same_camera(const trace_camera& a, const trace_camera& b) {
+  return a.frame == b.frame && a.orthographic == b.orthographic &&
+         a.lens == b.lens && a.film == b.film && a.focus == b.focus &&
+         a.aperture == b.aperture;
+}
+
+// Pixels, as boxes of min and max, where a frame may differ from the
+// refined one, when their trees differ only by the parameters of some
+// nodes, so that the samples of the other pixels are kept. Rays that miss
+// the regions of the edit, see changed_regions, find the same hits, and rays
+// that miss the slabs between the march boxes of the two frames leave them
+// at the same points. Returns false if the frame should be rendered as a
+// whole: when anything else changed, e.g. the camera or the structure of
+// the tree, paths bounce off other parts, or the region is unbounded, behind
+// the camera or covers more than `max_area` of the image.
+bool dirty_pixels(const frame_request& refined, const frame_request& request,
+    const vec2i& size, vector<pair<vec2i, vec2i>>& dirty,
+    float max_area = 0.25f) {
+  auto &a = refined.camera, &b = request.camera;
+  if (!same_camera(a, b) || b.orthographic) return false;
+  if (refined.params.resolution != request.params.resolution ||
+      refined.params.clamp != request.params.clamp ||
+      refined.march.relaxation != request.march.relaxation ||
+      request.march.bounces > 0 ||
+      refined.march.falsecolor != request.march.falsecolor ||
+      refined.march.sampler != request.march.sampler ||
+      refined.march.shading != request.march.shading ||
+      refined.footprint != request.footprint || refined.grid ||
+      request.grid || request.gpu || refined.lighting != request.lighting)
+    return false;
+  if (!same_structure(*refined.csg, *request.csg)) return false;
+  // boxes of the render, where the tree is moved by half
+  auto boxes = vector<bbox3f>{};
+  for (auto& region : changed_regions(*refined.csg, *request.csg)) {
+    if (!is_bounded(region)) return false;
+    boxes.push_back({region.min + vec3f(0.5), region.max + vec3f(0.5)});
+  }
+  auto bounds = [&b](const frame_request& request) {
+    return frame_march(request.march, *request.csg, b, request.params,
+        request.footprint)
+        .bounds;
+  };
+  auto from = bounds(refined), to = bounds(request);
+  auto all  = merge(from, to);
+  for (auto k = 0; k < 3; k++) {
+    auto faces = {pair{from.min[k], to.min[k]}, pair{from.max[k], to.max[k]}};
+    for (auto [x, y] : faces) {
+      if (x == y) continue;
+      auto slab   = all;
+      slab.min[k] = yocto::min(x, y);
+      slab.max[k] = yocto::max(x, y);
+      boxes.push_back(slab);
+    }
+  }
+
+  auto frame = inverse(b.frame);
+  auto area  = 0;
+  dirty.clear();
+  for (auto& box : boxes) {
+    auto min = vec2f{flt_max, flt_max}, max = vec2f{-flt_max, -flt_max};
+    for (auto k = 0; k < 8; k++) {
+      auto corner = vec3f{k & 1 ? box.max.x : box.min.x,
+          k & 2 ? box.max.y : box.min.y, k & 4 ? box.max.z : box.min.z};
+      auto uv     = project_camera(b, frame, size, corner);
+      if (uv.x < 0 || uv.y < 0) return false;
+      min = yocto::min(min, uv);
+      max = yocto::max(max, uv);
+    }
+    // a pixel around it, since rays are jittered
+    auto first = yocto::max(
+        vec2i{(int)floor(min.x), (int)floor(min.y)} - 1, vec2i{0, 0});
+    auto last = yocto::min(
+        vec2i{(int)ceil(max.x), (int)ceil(max.y)} + 1, size);
+    if (last.x <= first.x || last.y <= first.y) continue;
+    dirty.push_back({first, last});
+    area += (last.x - first.x) * (last.y - first.y);
+  }
+  return area <= max_area * size.x * size.y;
+}
+
+// Traces the tiles over the pixels again, from their first sample.
+void reset_tiles(
+    shared_ptr<app_state> app, const vector<pair<vec2i, vec2i>>& dirty) {
+  auto overlaps = [&dirty](const CsgTile& tile) {
+    for (auto [min, max] : dirty)
+      if (tile.max.x > min.x && tile.max.y > min.y && tile.min.x < max.x &&
+          tile.min.y < max.y)
+        return true;
+    return false;
+  };
+  for (auto& tile : app->tiles) {
+    if (!overlaps(tile)) continue;
+    tile.samples = 0;
+    tile.error   = flt_max;
+    for (auto j = tile.min.y; j < tile.max.y; j++) {
+      for (auto i = tile.min.x; i < tile.max.x; i++) {
+        reset_pixel(app->state, {i, j});
+        app->moments[{i, j}] = 0;
+        app->starts.depth[j * app->starts.image.x + i] = flt_max;
+      }
+    }
+  }
+}
+
+// Bytes of the buffers of the progressive render, read by the render task,
+// which is the only one that resizes them.
+inline size_t render_bytes(const march_buffer& state,
+    const image<vec4f>& render, const image<float>& moments,
+    const march_starts& starts, const vector<CsgTile>& tiles) {
+  auto pixels = [](const vec2i& size) { return (size_t)size.x * size.y; };
+  return state_bytes(state) + pixels(render.size()) * sizeof(vec4f) +
+         pixels(moments.size()) * sizeof(float) +
+         (starts.distance.size() + starts.depth.size() + starts.proxy.size()) *
+             sizeof(float) +
+         tiles.size() * sizeof(CsgTile);
+}
+
+inline size_t render_bytes(const app_state& app) {
+  return render_bytes(
+      app.state, app.render, app.moments, app.starts, app.tiles);
+}
+
+// Everything the samples of a frame depend on. Grids are taken by their
+// size, since they are baked from the tree.
+inline uint64_t view_key(const frame_request& request) {
+  auto hash = root_hash(*request.csg);
+  hash      = hash_bytes(hash, &request.camera, sizeof(request.camera));
+  hash      = hash_bytes(hash, &request.params, sizeof(request.params));
+  hash      = hash_bytes(hash, &request.march, sizeof(request.march));
+  hash      = mix_hash(hash, (uint64_t)request.footprint);
+  hash      = mix_hash(hash, (uint64_t)(uintptr_t)request.lighting.get());
+  auto size = request.grid ? request.grid->size : vec3i{0, 0, 0};
+  return hash_bytes(hash, &size, sizeof(size));
+}
+
+// Key of the hits of a frame, as view_key without the shading, 0 for frames
+// whose pixels are not shaded from their first hits alone.
+inline uint64_t hits_key(const frame_request& request) {
+  if (request.march.bounces > 0 ||
+      request.march.falsecolor != march_falsecolor::none)
+    return 0;
+  auto unshaded          = request;
+  unshaded.march.shading = {};
+  return view_key(unshaded);
+}
+
+// Moves the render of the view into the cache, replacing an older render of
+// the same view, once all its tiles have samples, so that the frames of a
+// moving camera are not kept. The render is copied, since the display shows
+// it until it is replaced.
+inline void store_view(app_state& app, uint64_t key) {
+  auto sampled = std::all_of(app.tiles.begin(), app.tiles.end(),
+      [](const CsgTile& tile) { return tile.samples > 0; });
+  if (app.tiles.empty() || !sampled) return;
+  auto& cache = app.views;
+  cache.views.remove_if([&cache, key](const app_view& view) {
+    if (view.key == key) cache.bytes -= view.bytes;
+    return view.key == key;
+  });
+  auto  view  = app_view{key, std::move(app.state), app.render,
+      std::move(app.moments), app.starts, app.tiles};
+  view.bytes  = render_bytes(
+      view.state, view.render, view.moments, view.starts, view.tiles);
+  if (view.bytes > cache.budget) return;
+  cache.views.push_front(std::move(view));
+  cache.bytes += cache.views.front().bytes;
+  while (cache.bytes > cache.budget) {
+    cache.bytes -= cache.views.back().bytes;
+    cache.views.pop_back();
+  }
+  app.performance.views = cache.bytes;
+}
+
+// Takes the render of the view out of the cache. Returns false if it is not
+// there.
+inline bool restore_view(app_state& app, uint64_t key) {
+  auto& cache = app.views;
+  auto  it    = std::find_if(cache.views.begin(), cache.views.end(),
+      [key](const app_view& view) { return view.key == key; });
+  if (it == cache.views.end()) return false;
+  app.state   = std::move(it->state);
+  app.moments = std::move(it->moments);
+  app.starts  = std::move(it->starts);
+  app.tiles   = std::move(it->tiles);
+  {
+    auto lock       = lock_guard{app.display_mutex};
+    app.render      = std::move(it->render);
+    app.display_all = true;
+  }
+  cache.bytes -= it->bytes;
+  cache.views.erase(it);
+  app.performance.views = cache.bytes;
+  return true;
+}
+
+// Shows the samples of a finished frame, denoised if it asks for it, see
+// denoise.h, with the depths of the first hits as guides. The display is
+// made again from the samples either way, so that it never keeps a
+// denoised render of other samples, as the ones of the cached views.
+// Wakes the UI if it sleeps, for work done in the background that changes
+// what it shows, see idle_wait.
+inline void wake_ui(app_state& app) {
+  if (app.sleeping.exchange(false)) wake_glwindow();
+}
+
+// Marks a frame for the report of a replay, if timed.
+inline void mark_frame(app_state& app, app_mark_type type, int generation) {
+  if (!app.timing) return;
+  auto lock = lock_guard{app.display_mutex};
+  app.marks.push_back({type, generation, get_time()});
+}
+
+void finish_display(shared_ptr<app_state> app, const frame_request& request,
+    const CsgGrid* grid) {
+  auto& state  = app->state;
+  auto  render = app->render;
+  if (render.size() != state.size()) return;
+  for (auto k = 0; k < render.count(); k++)
+    if (state.samples[k] > 0)
+      render[k] = {state.radiance[k] / (float)state.samples[k], 1};
+  if (request.denoise) {
+    CSG_ZONE("denoise");
+    auto guides = denoise_guides(app->tape, grid, request.camera, app->starts);
+    auto error  = string{};
+    if (!denoise_image(render, guides, {}, error))
+      printf("oidn disabled: %s\n", error.c_str());
+  }
+  {
+    auto lock        = lock_guard{app->display_mutex};
+    app->render      = std::move(render);
+    app->display_all = true;
+  }
+  mark_frame(*app, app_mark_type::finished, request.generation);
+  wake_ui(*app);
+}
+
+// Renders a frame on the pool: compiles the tree if it is not the one of
+// the previous frame, fills the render with the reprojected previous view or
+// with the preview, then refines it progressively until it is done or
+// stopped. Only the refinement stops for newer requests: a frame always
+// shows its preview, since continuous edits would otherwise drop every one.
+// Frames that only edit a few nodes keep the render, and trace again the
+// tiles that the edit may change, see dirty_pixels. Frames of views
+// rendered before resume from their cached render, see app_view. Tiles
+// bound the tree over their frustums when they are first traced in a frame,
+// see classify_tile.
+void render_frame(
+    shared_ptr<app_state> app, shared_ptr<const frame_request> frame) {
+  CSG_ZONE("frame");
+  auto  begin   = get_time();
+  auto& request = *frame;
+  auto& camera  = request.camera;
+  auto& params = request.params;
+  auto  grid   = request.grid.get();
+  if (request.csg != app->compiled ||
+      request.lighting != app->tape.lighting) {
+    CSG_ZONE("compile");
+    if (request.csg != app->compiled) {
+      // the tape renders until its code is built, see start_jit
+      app->tape      = request.tape ? *request.tape : compile_csg(*request.csg);
+      app->jit_tiers = request.native ? start_jit(app->tape) : nullptr;
+      app->fast_tiers = request.native && app->fast_preview
+                            ? start_jit(app->tape, true)
+                            : nullptr;
+    }
+    app->tape.lighting = request.lighting;
+    app->tapes         = make_replicas(app->tape);
+    app->compiled      = request.csg;
+  }
+  app->jit      = current_jit(app->jit_tiers);
+  app->fast_jit = current_jit(app->fast_tiers);
+  // the light of the paths is kept across views, and cleared where edits
+  // changed the tree, see clear_radiance
+  if (request.radiance) {
+    auto& radiance = *request.radiance;
+    match_radiance(radiance, request.march.bounces);
+    if (app->radiance_csg && app->radiance_csg != request.csg) {
+      if (same_structure(*app->radiance_csg, *request.csg)) {
+        clear_radiance(
+            radiance, changed_regions(*app->radiance_csg, *request.csg));
+      } else {
+        clear_radiance(radiance);
+      }
+    }
+    app->radiance_csg = request.csg;
+  }
+  auto march    = frame_march(
+      request.march, *request.csg, camera, params, request.footprint);
+  // once the code is in, the view is profiled at a low resolution to build
+  // it again for the branches its guards take, see guard_hints
+  respecialize_jit(app->jit_tiers,
+      [csg = request.csg, camera, march](const CsgTape& tape) {
+        CSG_ZONE("respecialize");
+        if (tape.nodes.size() != tape.instructions.size())
+          return vector<int8_t>{};
+        return guard_hints(tape, profile_csg(*csg, tape, camera, march, 64));
+      });
+  auto moved         = request.version == app->frame_version;
+  app->frame_version = request.version;
+
+  // frames of the same view and tree, as after zooming the display, resume
+  // the refinement as it is
+  auto size  = camera_size(camera, params.resolution);
+  auto dirty = vector<pair<vec2i, vec2i>>{};
+  auto same  = app->refined && app->refined->version == request.version &&
+              same_camera(app->refined->camera, camera);
+  auto kept  = app->refined && app->render.size() == size &&
+              app->state.size() == size && app->starts.image == size &&
+              !app->starts.depth.empty() &&
+              (same || dirty_pixels(*app->refined, request, size, dirty));
+  // frames that only change the shading relight the passes of the first
+  // samples, which the other frames write, see relight_samples
+  auto hits          = hits_key(request);
+  auto previous_hits = app->gbuffer_key;
+  auto relit         = false;
+  app->gbuffer_key   = 0;
+  auto restored      = false;
+  if (kept) {
+    reset_tiles(app, dirty);
+    app->rendered = camera;
+  } else if (app->refined) {
+    store_view(*app, view_key(*app->refined));
+    app->refined = nullptr;
+  }
+  if (!kept && restore_view(*app, view_key(request))) {
+    restored      = true;
+    app->rendered = camera;
+    app->refined  = frame;
+  } else if (!kept) {
+    // reset state
+    init_state(app->state, camera, params);
+    app->moments = image{app->state.size(), 0.0f};
+
+    // the previous view is reprojected when possible, otherwise the preview
+    // is rendered, and the render goes on from its samples
+    // interleaved frames march a set of the pixels at full resolution, and
+    // fill the others from the previous view, see interleave_render
+    auto display  = app->render;
+    auto previous = app->rendered;
+    app->rendered = camera;
+    relit         = hits && hits == previous_hits &&
+            app->gbuffer.depth.size() == app->state.size();
+    if (relit) {
+      CSG_ZONE("relight");
+      display = image{app->state.size(), zero4f};
+      relight_samples(app->gbuffer, app->tape, march, app->state, camera,
+          params, display, &app->moments);
+    } else if (app->interleave > 1) {
+      CSG_ZONE("interleave");
+      interleave_render(display, app->starts, previous, camera, app->tape,
+          app->jit, grid, march, app->state.size(), app->interleave_phase++,
+          app->interleave, moved);
+    } else if (display.size() != app->state.size() || !moved ||
+               !reproject_render(display, app->starts, previous, camera,
+                   app->tape, app->jit, grid, march)) {
+      init_depths(app->starts, app->state.size());
+      // the rays of the preview are the first samples of the pixels at the
+      // centers of its pixels, see raymarch_preview, unless the camera
+      // moves: those march with approximate math and hits, see
+      // march_params, and the render starts over from exact samples
+      auto  downscale = app->preview_downscale;
+      auto  hits      = march_starts{};
+      auto  start     = get_time();
+      auto  fast      = moved && app->fast_preview;
+      auto  fmarch    = march;
+      auto& fjit      = fast && is_valid(app->fast_jit) ? app->fast_jit
+                                                        : app->jit;
+      fmarch.approximate = fast;
+      CSG_ZONE("preview");
+      auto preview = raymarch_preview(camera, app->tape, fjit, grid, fmarch,
+          params, downscale, app->state, hits, app->starts, &app->moments);
+      if (fast) {
+        init_state(app->state, camera, params);
+        init_depths(app->starts, app->state.size());
+        app->moments = image{app->state.size(), 0.0f};
+      }
+      app->preview_downscale = adapt_downscale(
+          downscale, (get_time() - start) * 1e-9f, app->preview_budget / 1000);
+      display = upsample_preview(preview, hits, camera, app->state.size());
+    }
+    {
+      auto lock        = lock_guard{app->display_mutex};
+      app->render      = std::move(display);
+      app->display_all = true;
+    }
+    wake_ui(*app);
+  }
+  // kept frames write only the dirty pixels of the passes, so they go on
+  // from complete ones
+  auto writing = hits && !relit && !restored && (!kept || previous_hits);
+  if (relit) app->gbuffer_key = hits;
+  if (writing && app->gbuffer.depth.size() != app->render.size()) {
+    auto error = string{};
+    init_aovs(app->gbuffer, app->render.size(),
+        {"depth", "normal", "id", "steps"}, error);
+  }
+  auto& performance   = app->performance;
+  performance.latency = (get_time() - begin) * 1e-6f;
+  performance.buffers = render_bytes(*app);
+  performance.tape    = memory_bytes(app->tape);
+  mark_frame(*app, app_mark_type::preview, request.generation);
+
+  // tiles stop once their noise is below the threshold, and the render once
+  // all tiles are done
+  if (app->render_stop) return;
+  app->stats.rays     = 0;
+  app->stats.steps    = 0;
+  performance.samples = 0;
+  performance.time    = 0;
+  performance.busy    = 0;
+  if (!kept && !restored)
+    app->tiles = make_tiles(app->render.size(), 16, tile_order::center);
+  if (relit)
+    for (auto& tile : app->tiles) tile.samples = 1;
+  app->refined = frame;
+  app->frustums.assign(app->tiles.size(), {});
+  cone_march(app->starts, app->tape, app->jit, grid, camera,
+      app->render.size(), &app->stats);
+  if (grid)
+    app->starts.proxy.clear();
+  else
+    proxy_march(app->starts, *request.csg, camera, app->render.size(), march);
+  // tiles out of the visible pixels wait for the display to show them
+  auto [shown_min, shown_max] = request.visible;
+  auto done = [&, shown_min = shown_min, shown_max = shown_max](
+                  const CsgTile& tile) {
+    if (shown_min != shown_max &&
+        (tile.max.x <= shown_min.x || tile.max.y <= shown_min.y ||
+            tile.min.x >= shown_max.x || tile.min.y >= shown_max.y))
+      return true;
+    return tile.samples >= request.params.samples ||
+           (request.noise > 0 && tile.error <= request.noise);
+  };
+  // passes trace batches of samples per tile, so that the state, the
+  // scratch and the pixels of a tile stay in cache across its samples,
+  // doubling the samples up to a batch of max_batch, after which each tile
+  // is shown every max_batch samples
+  // the marches of the tiles stop at their next step once stopped, see
+  // is_cancelled, so that new requests wait for a step and not for a tile
+  const auto max_batch = 8;
+  auto       refine    = march;
+  refine.cancel        = &app->render_stop;
+  for (auto target = 1, last = 0; last < params.samples;
+       last = target, target += yocto::min(target, max_batch)) {
+    if (app->render_stop) return;
+    if (all_of(app->tiles.begin(), app->tiles.end(), done)) break;
+    CSG_ZONE("pass");
+    auto start   = get_time();
+    auto samples = yocto::min(target, params.samples);
+    parallel_for_tiles(
+        app->tiles,
+        [&](CsgTile& tile) {
+          if (done(tile)) return;
+          CSG_ZONE("tile");
+          auto  start   = get_time();
+          auto& tape    = local_replica(app->tapes);
+          auto  jit     = current_jit(app->jit_tiers);  // newest at each tile
+          auto  frustum = &app->frustums[&tile - app->tiles.data()];
+          if (grid) frustum = nullptr;
+          if (frustum && !frustum->classified)
+            classify_tile(*frustum, *request.csg, tape, camera,
+                app->render.size(), tile, march);
+          while (tile.samples < samples && !done(tile)) {
+            if (!raymarch_tile(tape, jit, grid, refine, app->state,
+                    camera, tile, params, app->render, &app->starts,
+                    &app->stats, &app->moments, frustum,
+                    writing ? &app->gbuffer : nullptr))
+              break;
+            tile.samples += 1;
+            tile.error = tile_error(tile, app->state, app->moments);
+          }
+          {
+            auto lock = lock_guard{app->display_mutex};
+            app->display_regions.push_back({tile.min, tile.max});
+          }
+          wake_ui(*app);
+          performance.busy += get_time() - start;
+        },
+        csg_priority::background, &app->render_stop);
+    performance.time += get_time() - start;
+    if (app->render_stop) return;
+    performance.samples += samples - last;
+    if (last == 0) mark_frame(*app, app_mark_type::full, request.generation);
+    if (writing && all_of(app->tiles.begin(), app->tiles.end(),
+                       [](const CsgTile& tile) { return tile.samples > 0; })) {
+      app->gbuffer_key = hits;
+      writing          = false;
+    }
+  }
+  if (!app->render_stop) finish_display(app, request, grid);
+}
+
+// Requests are swapped atomically, so that the render task reads the latest
+// one without locks and keeps the one it renders alive meanwhile.
+inline void publish_request(
+    shared_ptr<app_state> app, shared_ptr<const frame_request> request) {
+  std::atomic_store(&app->request, std::move(request));
+  app->stop_time   = get_time();
+  app->render_stop = true;
+}
+
+inline shared_ptr<const frame_request> latest_request(
+    shared_ptr<app_state> app) {
+  return std::atomic_load(&app->request);
+}
+
+// Renders the latest request until one is finished, without returning to
+// the UI between them. Frames stopped by a newer request are not finished,
+// and neither is the rare one that picks up the request stopping it, which
+// is rendered again.
+void render_frames(shared_ptr<app_state> app) {
+  while (true) {
+    if (app->render_stop) {
+      auto& performance = app->performance;
+      auto  latency     = (get_time() - app->stop_time) * 1e-6f;
+      performance.cancel     = latency;
+      performance.cancel_max = yocto::max(
+          performance.cancel_max.load(), latency);
+      if (latency > app->cancel_budget) performance.cancel_over += 1;
+    }
+    app->render_stop = false;
+    auto request     = latest_request(app);
+    if (request->generation == app->rendered_generation) return;
+    if (!request->gpu) render_frame(app, request);
+    if (!app->render_stop) app->rendered_generation = request->generation;
+  }
+}
+
+// The shader supports neither baked grids, groups, meshes, instances,
+// lenses, paths, false colors, lighting volumes nor Sobol samples.
+inline bool gpu_supported(shared_ptr<app_state> app) {
+  return app->gpu && !app->gpu_failed && !(app->baked && app->grid) &&
+         app->csg.groups.empty() && app->csg.meshes.empty() &&
+         app->csg.instances.empty() &&
+         !app->camera.orthographic && !app->camera.aperture &&
+         !app->lit && app->march.bounces == 0 &&
+         app->march.shading == CsgShading{} &&
+         app->march.falsecolor == march_falsecolor::none &&
+         app->march.sampler == march_sampler::random;
+}
+
+// Marches a sample of every pixel on the GPU and blends it with the previous
+// ones. The first sample of a frame compiles the tape, and builds the shader
+// if its structure changed, so parameter edits only upload the parameters.
+// If the shader does not build, the frame is requested again on the CPU.
+void render_gpu_sample(shared_ptr<app_state> app) {
+  if (app->gpu_sample >= app->params.samples) return;
+  CSG_ZONE("gpu_sample");
+  auto& camera = app->camera;
+  auto& pass   = app->glpass;
+  if (app->gpu_sample == 0) {
+    auto tape = compile_csg(app->csg);
+    auto hash = structure_hash(tape);
+    if (!is_initialized(pass) || hash != app->gpu_hash) {
+      auto error = string{};
+      if (!init_glpass(pass, glsl_source(tape), error)) {
+        printf("gpu backend disabled: %s\n", error.c_str());
+        app->gpu_failed = true;
+        app->gpu_frame  = false;
+        app->render_generation += 1;
+        return;
+      }
+      app->gpu_hash = hash;
+    }
+    set_glpass_buffer(pass, tape.params);
+    auto march = frame_march(
+        app->march, app->csg, camera, app->params, app->footprint);
+    auto distance = camera.focus < flt_max ? camera.lens * camera.focus /
+                                                 (camera.focus - camera.lens)
+                                           : camera.lens;
+    set_glpass_uniform(pass, "camera_x", camera.frame.x);
+    set_glpass_uniform(pass, "camera_y", camera.frame.y);
+    set_glpass_uniform(pass, "camera_z", camera.frame.z);
+    set_glpass_uniform(pass, "camera_o", camera.frame.o);
+    set_glpass_uniform(pass, "camera_film", camera.film);
+    set_glpass_uniform(pass, "camera_distance", distance);
+    set_glpass_uniform(pass, "bounds_min", march.bounds.min);
+    set_glpass_uniform(pass, "bounds_max", march.bounds.max);
+    set_glpass_uniform(pass, "relaxation", march.relaxation);
+    set_glpass_uniform(pass, "footprint", march.footprint);
+    set_glpass_uniform(pass, "lipschitz", tape.lipschitz);
+    set_glpass_uniform(pass, "max_radiance", app->params.clamp);
+    set_glimage(app->glimage, camera_size(camera, app->params.resolution),
+        opengl_image_format::rgba16f);
+    // the render on screen is not the CPU one anymore, which should not be
+    // reprojected
+    app->starts.depth.clear();
+  }
+  set_glpass_uniform(pass, "sample_index", app->gpu_sample);
+  draw_glpass(pass, app->glimage, 1.0f / (app->gpu_sample + 1));
+  app->gpu_sample += 1;
+}
+
+// Grid of the baked preview, from the cache when possible.
+inline shared_ptr<CsgGrid> bake_preview(const Csg& csg, int resolution) {
+  CSG_ZONE("bake");
+  auto bounds = bbox3f{{-0.5, -0.5, -0.5}, {0.5, 0.5, 0.5}};
+  return make_shared<CsgGrid>(bake_csg_grid_cached(csg, bounds, resolution));
+}
+
+// Takes the lighting volume once it is baked, and starts a bake when the tree
+// changed since the latest one: edits that keep the structure relight only
+// the samples near the regions they changed, see relight_lighting, and
+// edits of the light bake it again.
+inline void update_lighting(shared_ptr<app_state> app) {
+  if (app->lighting_ready.exchange(false)) {
+    app->lighting     = app->lit_volume;
+    app->lighting_csg = app->lit_csg;
+  }
+  auto lighting = app->lighting_future.valid() &&
+                  app->lighting_future.wait_for(0s) != future_status::ready;
+  // volumes of another light are baked again as a whole
+  auto light = app->march.shading.light;
+  if (app->lighting && app->lighting->light != light)
+    app->lighting_csg = nullptr;
+  if (!app->lit || lighting || app->lighting_csg == app->snapshot) return;
+  app->lighting_future = async_task(
+      [app, csg = app->snapshot, previous = app->lighting,
+          from = app->lighting_csg, resolution = app->lighting_resolution,
+          light]() {
+        CSG_ZONE("lighting");
+        auto bounds = bbox3f{{-0.5, -0.5, -0.5}, {0.5, 0.5, 0.5}};
+        auto volume = previous && from && same_structure(*from, *csg)
+                          ? relight_lighting(
+                                *previous, *csg, changed_regions(*from, *csg))
+                          : bake_lighting(*csg, bounds, resolution, light);
+        app->lit_volume     = make_shared<const CsgLighting>(std::move(volume));
+        app->lit_csg        = csg;
+        app->lighting_ready = true;
+        wake_ui(*app);
+      },
+      csg_priority::background);
+}
+
+// Takes the proxy mesh once it is extracted, and starts a meshing when the
+// tree changed since the latest one, on the snapshot as the bakes.
+inline void update_proxy(shared_ptr<app_state> app) {
+  if (app->proxy_ready.exchange(false)) app->proxy_mesh = app->proxy_meshed;
+  auto meshing = app->proxy_future.valid() &&
+                 app->proxy_future.wait_for(0s) != future_status::ready;
+  if (!app->proxy || meshing || !app->snapshot ||
+      app->proxy_csg == app->snapshot)
+    return;
+  app->proxy_csg    = app->snapshot;
+  app->proxy_future = async_task(
+      [app, csg = app->snapshot, resolution = app->proxy_resolution]() {
+        CSG_ZONE("proxy");
+        auto bounds       = bbox3f{{-0.5, -0.5, -0.5}, {0.5, 0.5, 0.5}};
+        app->proxy_meshed = make_shared<const CsgMesh>(
+            mesh_csg(*csg, bounds, resolution));
+        app->proxy_ready = true;
+        wake_ui(*app);
+      },
+      csg_priority::background);
+}
+
+// Uploads the proxy mesh, moved to render space and lit from the eye.
+inline void upload_proxy(opengl_scene& glscene, const CsgMesh& mesh) {
+  auto normals = compute_normals(mesh.triangles, mesh.positions);
+  if (is_initialized(glscene)) {
+    set_shape(glscene, 0, mesh.triangles, mesh.positions, normals, {});
+    return;
+  }
+  init_glscene(glscene);
+  add_camera(glscene, identity3x4f, 0.05, 1, 0.036, 0.01, 100);
+  auto material = add_material(glscene);
+  set_material_diffuse(glscene, material, {0.7, 0.7, 0.7});
+  auto shape = add_shape(glscene, mesh.triangles, mesh.positions, normals, {});
+  add_instance(glscene, translation_frame({0.5, 0.5, 0.5}), shape, material);
+}
+
+// Draws the proxy mesh with the camera of the render, where the render
+// would be drawn, see update_imview.
+inline void draw_proxy(shared_ptr<app_state> app) {
+  auto& camera   = app->camera;
+  auto& glparams = app->glparams;
+  auto  size     = camera_size(camera, app->params.resolution);
+  auto  extent   = vec2f{(float)size.x, (float)size.y} * glparams.scale;
+  auto  corner   = glparams.center - extent / 2;
+  auto  ratio    = vec2f{(float)glparams.framebuffer.z / glparams.window.x,
+      (float)glparams.framebuffer.w / glparams.window.y};
+  auto viewport = vec4i{glparams.framebuffer.x + (int)(corner.x * ratio.x),
+      glparams.framebuffer.y +
+          (int)((glparams.window.y - corner.y - extent.y) * ratio.y),
+      (int)(extent.x * ratio.x), (int)(extent.y * ratio.y)};
+  if (viewport.z <= 0 || viewport.w <= 0) return;
+  set_camera(app->glscene, 0, camera.frame, camera.lens,
+      camera.film.x / camera.film.y, camera.film.x, 0.01, 100);
+  auto params       = draw_glscene_params{};
+  params.eyelight   = true;
+  params.background = glparams.background;
+  draw_glscene(app->glscene, viewport, params);
+}
+
+// Whether the proxy is drawn instead of the render, see app_state.
+inline bool proxy_shown(shared_ptr<app_state> app) {
+  return app->proxy && is_initialized(app->glscene) &&
+         !app->camera.orthographic &&
+         get_seconds() - app->camera_moved < app->proxy_settle;
+}
+
+// Pixels of the render shown in the window, empty when all of them are, so
+// that zoomed views refine only what is shown. Called by the UI thread.
+inline pair<vec2i, vec2i> visible_pixels(shared_ptr<app_state> app) {
+  auto& glparams = app->glparams;
+  auto  size     = camera_size(app->camera, app->params.resolution);
+  if (glparams.fit || glparams.window == vec2i{0, 0}) return {};
+  auto min = get_image_coords(
+      {0, 0}, glparams.center, glparams.scale, size);
+  auto max = get_image_coords(
+      {(float)glparams.window.x, (float)glparams.window.y}, glparams.center,
+      glparams.scale, size);
+  min = yocto::max(min - 1, 0);
+  max = yocto::min(max + 1, size);
+  if (min == vec2i{0, 0} && max == size) return {};
+  if (min.x >= max.x || min.y >= max.y) return {min, min};
+  return {min, max};
+}
+
+// Publishes a request for the latest edits, and starts the render task if
+// it is not running. Called by the UI thread on every update, so that it
+// never waits on the render.
+void update_display(shared_ptr<app_state> app) {
+  auto running = app->render_future.valid() &&
+                 app->render_future.wait_for(0s) != future_status::ready;
+  if (!running && app->render_future.valid()) app->render_future.get();
+
+  // nothing is rendered until the first tree is loaded, see run_viewer
+  if (app->csg.nodes.empty()) return;
+  update_proxy(app);
+  if (app->request_generation != app->render_generation) {
+    // bakes run one at a time on a snapshot of the tree, and edits made
+    // meanwhile start a new bake when the current one is done
+    if (app->bake_ready.exchange(false) && !app->bake_dirty)
+      app->grid = app->baked_grid;
+    if (app->bake_dirty) app->grid = nullptr;
+    auto baking = app->bake_future.valid() &&
+                  app->bake_future.wait_for(0s) != future_status::ready;
+    if (app->baked && app->bake_dirty && !baking) {
+      app->bake_dirty  = false;
+      app->bake_future = async_task(
+          [app, csg = app->snapshot, resolution = app->bake_resolution]() {
+            app->baked_grid = bake_preview(*csg, resolution);
+            app->bake_ready = true;
+            wake_ui(*app);
+          },
+          csg_priority::background);
+    }
+    update_lighting(app);
+
+    auto request        = make_shared<frame_request>();
+    request->generation = app->render_generation;
+    request->version    = app->version;
+    request->csg        = app->snapshot;
+    request->tape       = app->snapshot_tape;
+    request->camera     = app->camera;
+    request->params     = app->params;
+    request->march      = app->march;
+    request->grid       = app->baked ? app->grid : nullptr;
+    request->lighting   = app->lit ? app->lighting : nullptr;
+    if (app->radiance_cache && app->march.bounces > 1) {
+      if (!app->radiance) app->radiance = make_radiance_cache();
+      request->radiance       = app->radiance;
+      request->march.radiance = app->radiance.get();
+    }
+    request->footprint  = app->footprint;
+    request->noise      = app->noise;
+    request->gpu        = gpu_supported(app);
+    request->native     = app->backend != "tape";
+    request->denoise    = app->denoise;
+    request->visible    = app->visible;
+    app->request_generation = app->render_generation;
+    app->gpu_frame          = false;
+    app->gpu_sample         = 0;
+    publish_request(app, request);
+  }
+
+  // the GPU draws once the CPU frame has stopped, since both write the
+  // first hits
+  auto request = latest_request(app);
+  if (request->gpu) {
+    if (!running) app->gpu_frame = true;
+  } else if (!running && request->generation != app->rendered_generation) {
+    app->render_future = async_task([app]() {
+      render_frames(app);
+      wake_ui(*app);  // the GPU or the next frame may start
+    });
+  }
+}
+
+// Requests a new frame, which stops the refinement of the current one.
+// Frames are rendered in the background, see update_display.
+void reset_display(shared_ptr<app_state> app) {
+  auto edited = !app->moved;
+  app->moved  = false;
+
+  // bounds change when parameters are edited, and the tree is copied for
+  // the requests only then
+  if (!app->snapshot) {
+    update_bounds(app->csg);
+    app->snapshot = make_shared<const Csg>(app->csg);
+  }
+  if (edited) app->version += 1;
+  app->render_generation += 1;
+  update_display(app);
+}
+
+// Refits the BVH of the group to its edited sphere, and builds it again in
+// the background when the refits made it too loose, one group at a time.
+void refit_sphere(shared_ptr<app_state> app, int node, int sphere) {
+  auto& group   = app->csg.groups[app->csg.nodes[node].group];
+  auto  quality = refit_group(group, {sphere});
+  if (app->rebuilt_node == node) app->rebuilt_edits.push_back(sphere);
+  auto building = app->rebuild_future.valid() &&
+                  app->rebuild_future.wait_for(0s) != future_status::ready;
+  if (quality >= app->group_quality || building || app->rebuild_ready) return;
+  app->rebuilt_node = node;
+  app->rebuilt_edits.clear();
+  app->rebuild_future = async_task(
+      [app, centers = group.centers, radius = group.radius]() {
+        CSG_ZONE("rebuild");
+        auto rebuilt = CsgGroup{centers, radius};
+        build_group(rebuilt);
+        app->rebuilt       = std::move(rebuilt);
+        app->rebuild_ready = true;
+        wake_ui(*app);
+      },
+      csg_priority::background);
+}
+
+// Takes the BVH built in the background, refit to the spheres edited since
+// it started. It gives the same values as the refit one, so no frame is
+// requested, and the next snapshot of the tree takes it.
+void update_rebuild(shared_ptr<app_state> app) {
+  if (!app->rebuild_ready.exchange(false)) return;
+  auto node = std::exchange(app->rebuilt_node, -1);
+  if (node < 0) return;
+  auto& group = app->csg.groups[app->csg.nodes[node].group];
+  group.bvh   = std::move(app->rebuilt.bvh);
+  group.built = app->rebuilt.built;
+  group.parents.clear();
+  refit_group(group, app->rebuilt_edits);
+  app->rebuilt_edits.clear();
+}
+
+// Sets a parameter of the tree, which is copied again for the next request.
+void set_param(shared_ptr<app_state> app, int node, int param, float value) {
+  node_param(app->csg, node, param) = value;
+  if (is_group(app->csg.nodes[node])) refit_sphere(app, node, param / 4);
+  update_hashes(app->csg, node);
+  app->snapshot      = nullptr;
+  app->snapshot_tape = nullptr;
+  app->bake_dirty    = true;
+}
+
+// Adds the edit to the history, merging it with the previous one if it sets
+// the same parameter less than a second later.
+void record_edit(app_history& history, int node, int param, float before,
+    float after) {
+  auto time = get_seconds();
+  history.redo.clear();
+  if (!history.undo.empty()) {
+    auto& last = history.undo.back();
+    if (last.node == node && last.param == param && time - last.time < 1) {
+      last.after = after;
+      last.time  = time;
+      return;
+    }
+  }
+  history.undo.push_back({node, param, before, after, time});
+}
+
+// Applies the parameters of a transaction, as edits that are undone and
+// redone together. The tree is copied, bounded, baked and compiled once for
+// all of them at the next frame, which renders again only the pixels of the
+// region they changed, see dirty_pixels. Returns whether any was applied.
+bool commit_edits(shared_ptr<app_state> app) {
+  auto& history = app->history;
+  auto  first   = true;
+  for (auto& command : app->edits) {
+    if (command.node < 0 || command.node >= app->csg.nodes.size()) continue;
+    auto before = node_param(app->csg, command.node, command.param);
+    if (first) history.redo.clear();
+    history.undo.push_back(
+        {command.node, command.param, before, command.value, 0, !first});
+    set_param(app, command.node, command.param, command.value);
+    first = false;
+  }
+  app->edits.clear();
+  return !first;
+}
+
+// Applies the commands sent since the last update, and requests a frame if
+// they changed the tree or the camera. The exposure is applied when the
+// render is drawn, and needs no frame.
+void apply_commands(shared_ptr<app_state> app) {
+  CSG_ZONE("commands");
+  auto  command = app_command{};
+  auto  edited = false, moved = false;
+  auto& history = app->history;
+  while (try_pop(app->commands, command)) {
+    if (app->recording)
+      app->events.push_back(
+          {std::max(get_seconds() - app->started, 0.0), command});
+    switch (command.type) {
+      case app_command_type::set_param: {
+        if (app->editing > 0) {
+          app->edits.push_back(command);
+          break;
+        }
+        if (command.node < 0 || command.node >= app->csg.nodes.size()) break;
+        auto before = node_param(app->csg, command.node, command.param);
+        record_edit(
+            history, command.node, command.param, before, command.value);
+        set_param(app, command.node, command.param, command.value);
+        edited = true;
+      } break;
+      case app_command_type::undo: {
+        if (history.undo.empty()) break;
+        auto chained = true;
+        while (chained && !history.undo.empty()) {
+          auto edit = history.undo.back();
+          history.undo.pop_back();
+          history.redo.push_back(edit);
+          set_param(app, edit.node, edit.param, edit.before);
+          chained = edit.chained;
+        }
+        if (!history.undo.empty()) history.undo.back().time = 0;
+        edited = true;
+      } break;
+      case app_command_type::redo: {
+        if (history.redo.empty()) break;
+        do {
+          auto edit = history.redo.back();
+          edit.time = 0;  // not merged with the next edit
+          history.redo.pop_back();
+          history.undo.push_back(edit);
+          set_param(app, edit.node, edit.param, edit.after);
+        } while (!history.redo.empty() && history.redo.back().chained);
+        edited = true;
+      } break;
+      case app_command_type::begin_edit: {
+        app->editing += 1;
+      } break;
+      case app_command_type::commit_edit: {
+        if (app->editing == 0 || --app->editing > 0) break;
+        if (commit_edits(app)) edited = true;
+      } break;
+      case app_command_type::set_camera: {
+        app->camera       = command.camera;
+        app->camera_moved = get_seconds();
+        moved             = true;
+      } break;
+      case app_command_type::reload: {
+        app->load_pending = true;
+      } break;
+      case app_command_type::set_exposure: {
+        app->glparams.exposure = command.value;
+      } break;
+    }
+  }
+  if (!edited && !moved) return;
+  app->moved = !edited;
+  reset_display(app);
+}
+
+// Starts the pending reload once the previous one is done, and swaps the
+// loaded tree in once it is ready. Loads parse, optimize, compile and bake
+// the tree on the pool, and the old tree is rendered meanwhile. The grid of
+// the load is dropped if a bake of the old tree may still replace it.
+// Trees that only change some parameters keep most of the render, see
+// dirty_pixels, and trees with the same values as the old one, e.g. files
+// saved again unchanged, are swapped in without a frame. The history of the
+// edits is cleared when the structure changes, see app_history.
+void update_load(shared_ptr<app_state> app) {
+  if (app->load_ready.exchange(false)) {
+    app->load_future.get();
+    auto loaded = std::move(app->loaded);
+    auto baking = app->bake_future.valid() &&
+                  app->bake_future.wait_for(0s) != future_status::ready;
+    auto same   = false;
+    if (app->snapshot && same_structure(*app->snapshot, *loaded->snapshot)) {
+      auto region = changed_region(*app->snapshot, *loaded->snapshot);
+      same        = region.min.x > region.max.x;
+    }
+    if (!same_structure(app->csg, loaded->csg)) {
+      app->history = {};
+      app->edits.clear();  // of nodes of the old tree
+    }
+    app->rebuilt_node  = -1;  // of a group of the old tree
+    app->csg           = std::move(loaded->csg);
+    app->snapshot      = loaded->snapshot;
+    app->snapshot_tape = loaded->tape;
+    app->backend       = loaded->backend;
+    app->selected      = yocto::min(
+        app->selected, (int)app->csg.nodes.size() - 1);
+    if (app->started < 0) app->started = get_seconds();
+    if (same) {
+      mark_frame(*app, app_mark_type::loaded, app->render_generation);
+      return;
+    }
+    if (loaded->grid && !baking &&
+        loaded->resolution == app->bake_resolution) {
+      app->grid       = loaded->grid;
+      app->bake_ready = false;
+      app->bake_dirty = false;
+    } else {
+      app->bake_dirty = true;
+    }
+    app->moved = false;
+    reset_display(app);
+    mark_frame(*app, app_mark_type::loaded, app->render_generation);
+  }
+
+  auto loading = app->load_future.valid() &&
+                 app->load_future.wait_for(0s) != future_status::ready;
+  if (!app->load_pending || loading) return;
+  app->load_pending  = false;
+  app->load_progress = 0;
+  app->load_future   = async_task(
+      [app, filename = app->filename, baked = app->baked,
+          resolution = app->bake_resolution]() {
+        auto loaded = make_shared<loaded_tree>();
+        try {
+          loaded->csg = load_csg(filename, &app->load_progress);
+        } catch (std::exception& error) {
+          printf("%s\n", error.what());
+          wake_ui(*app);  // of the progress of the load
+          return;
+        }
+        update_bounds(loaded->csg);
+        loaded->snapshot = make_shared<const Csg>(loaded->csg);
+        // the render takes the tape, read from the cache folder when the
+        // file was compiled before, and its code if it was built before:
+        // loads do not wait for builds, see start_jit
+        auto tape = compile_csg_cached(loaded->csg);
+        auto jit  = find_jit(tape);
+        if (baked) {
+          loaded->grid       = bake_preview(loaded->csg, resolution);
+          loaded->resolution = resolution;
+        }
+        // previews skip the native code when the tape is faster on this
+        // machine, see tuner.h
+        auto tuning = tune_csg(loaded->csg,
+            cpu_backends(loaded->csg, tape, jit, loaded->grid.get()));
+        loaded->backend = choice(tuning, csg_consumer::preview);
+        // the tape is not preferred to code that was not timed
+        if (!is_valid(jit) && loaded->backend == "tape") loaded->backend = "";
+        loaded->tape    = make_shared<const CsgTape>(std::move(tape));
+        app->loaded     = loaded;
+        app->load_ready = true;
+        wake_ui(*app);
+      },
+      csg_priority::background);
+}
+
+// Reloads the file when it is written, if watched. Editors may write files
+// in steps, and parse errors leave the previous tree on screen until the
+// file is written again.
+void update_watch(shared_ptr<app_state> app) {
+  if (!app->watch || get_seconds() - app->watch_checked < 0.25) return;
+  app->watch_checked = get_seconds();
+  auto error = std::error_code{};
+  auto time  = std::filesystem::last_write_time(app->filename, error);
+  if (error || time == app->watched) return;
+  app->watched = time;
+  push(app->commands, {app_command_type::reload});
+}
+
+// Selects the primitive seen at the clicked pixel once the render task is
+// idle, since it writes the tape and the first hits. The hit comes from the
+// first hits of the render, and only the labeled distance is evaluated
+// there, see label.h. Pixels that the CPU has not traced, as on GPU frames,
+// march their ray alone.
+void update_pick(shared_ptr<app_state> app) {
+  if (app->pick.x < 0 || app->csg.nodes.empty()) return;
+  if (app->render_future.valid() &&
+      app->render_future.wait_for(0s) != future_status::ready)
+    return;
+  auto pixel = app->pick;
+  app->pick  = {-1, -1};
+  auto compiled = CsgTape{};
+  auto current  = app->compiled && app->compiled == app->snapshot;
+  if (!current) compiled = compile_csg(app->csg);
+  auto& tape   = current ? app->tape : compiled;
+  auto& starts = app->starts;
+  auto  camera = app->rendered;
+  auto  size   = starts.image;
+  auto  depth  = 0.0f;
+  if (!app->gpu_frame && !starts.depth.empty() && pixel.x < size.x &&
+      pixel.y < size.y)
+    depth = starts.depth[pixel.y * size.x + pixel.x];
+  if (depth <= 0 || depth == flt_max) {
+    camera     = app->camera;
+    size       = camera_size(camera, app->params.resolution);
+    auto march = frame_march(
+        app->march, app->csg, camera, app->params, app->footprint);
+    auto rays      = vector<ray3f>{sample_camera(
+        camera, pixel, size, {0.5, 0.5}, {0, 0})};
+    auto distances = vector<float>{0};
+    auto radiance  = vector<vec3f>{};
+    auto depths    = vector<float>{};
+    raymarch_packets(tape, CsgJit{}, nullptr, march, rays, distances,
+        radiance, &depths);
+    depth = depths[0];
+  }
+  if (depth <= 0 || depth == flt_max) return;
+  auto ray  = sample_camera(camera, pixel, size, {0.5, 0.5}, {0, 0});
+  auto node = (int)eval_tape_label(tape, ray.o + ray.d * depth - 0.5f).node;
+  if (node < 0) return;
+  app->selected = node;
+  if (is_group(app->csg.nodes[node]))
+    app->sphere = nearest_sphere(app->csg.groups[app->csg.nodes[node].group],
+        ray.o + ray.d * depth - 0.5f)
+                      .first;
+}
+
+// How long the UI may sleep after drawing: until input or until work in the
+// background wakes it, see wake_ui, once nothing is left to draw. Frames
+// sampled on the GPU, uploads and loads that show their progress keep it
+// polling, watched files are checked a few times a second, and the proxy
+// gives way to the render once the camera settled.
+double idle_wait(shared_ptr<app_state> app) {
+  // set first, so that work finished while checking wakes the UI
+  app->sleeping = true;
+  auto loading  = app->load_future.valid() &&
+                 app->load_future.wait_for(0s) != future_status::ready;
+  auto sampling = app->gpu_frame && app->gpu_sample < app->params.samples;
+  auto pending  = false;
+  {
+    auto lock = lock_guard{app->display_mutex};
+    pending   = !app->gpu_frame &&
+              (app->display_all || !app->display_regions.empty());
+  }
+  if (loading || sampling || pending || app->load_ready || app->bake_ready ||
+      app->rebuild_ready || app->lighting_ready || app->proxy_ready ||
+      app->proxy_mesh) {
+    app->sleeping = false;
+    return 0;
+  }
+  auto wait = app->watch ? 0.25 : std::numeric_limits<double>::infinity();
+  // the render is drawn again once the camera settled
+  if (proxy_shown(app))
+    wait = std::min(
+        wait, app->proxy_settle - (get_seconds() - app->camera_moved));
+  return wait;
+}
+
+// Slider of a parameter of a node, whose edits are sent as commands.
+bool deferred_slider(const opengl_window& win, shared_ptr<app_state> app,
+    const char* name, int node, int param, float min, float max) {
+  auto value = node_param(app->csg, node, param);
+  if (draw_glslider(win, name, value, min, max)) {
+    push(app->commands, {app_command_type::set_param, node, param, value});
+    return 1;
+  }
+  return 0;
+}
+
+// Profiles the view of the snapshot at a low resolution in the background,
+// and shows the costliest subtrees as their share of the cost of the root
+// and their time per distance.
+void draw_glprofile(const opengl_window& win, shared_ptr<app_state> app) {
+  auto profiling = app->profile_future.valid() &&
+                   app->profile_future.wait_for(0s) != future_status::ready;
+  if (!profiling && app->profiling) {
+    app->profile   = app->profiling;
+    app->profiling = {};
+  }
+  if (draw_glbutton(win, "profile", !profiling) && app->snapshot &&
+      !app->snapshot->nodes.empty()) {
+    auto profile        = make_shared<app_profile>();
+    profile->csg        = app->snapshot;
+    app->profiling      = profile;
+    app->profile_future = async_task(
+        [profile, camera = app->camera, params = app->params,
+            march = app->march, footprint = app->footprint,
+            state = app.get()]() {
+          auto& csg   = *profile->csg;
+          auto  tape  = compile_csg(csg);
+          auto  frame = frame_march(march, csg, camera, params, footprint);
+          auto  costs = profile_csg(csg, tape, camera, frame, 128);
+          profile->costs = top_subtrees(csg, costs, 8);
+          profile->heat  = profile_heat(csg, costs);
+          wake_ui(*state);  // the app waits for the profile
+        },
+        csg_priority::background);
+  }
+  if (!app->profile) return;
+  for (auto& cost : app->profile->costs) {
+    auto name  = node_name(*app->profile->csg, cost.node);
+    auto label = to_string(cost.node) + " " + string{name};
+    char value[64];
+    snprintf(value, sizeof(value), "%.1f%% %.1f ns",
+        app->profile->heat[cost.node] * 100, cost.total);
+    draw_gllabel(win, label.c_str(), value);
+  }
+}
+
+// Performance of the latest frame, see app_performance. Frames on the GPU
+// only show their backend.
+void draw_glperformance(const opengl_window& win, shared_ptr<app_state> app) {
+  auto label = [&win](const char* name, const char* format, double value) {
+    char text[64];
+    snprintf(text, sizeof(text), format, value);
+    draw_gllabel(win, name, text);
+  };
+  draw_gllabel(win, "backend", app->gpu_frame ? "gpu" : "cpu");
+  if (!app->backend.empty()) draw_gllabel(win, "tuned", app->backend.c_str());
+  if (app->gpu_frame) return;
+  auto& performance = app->performance;
+  auto  seconds     = performance.time * 1e-9;
+  auto  rays        = app->stats.rays.load();
+  auto  threads     = pool_threads(get_pool());
+  label("preview ms", "%.1f", performance.latency);
+  draw_gllabel(win, "preview downscale",
+      std::to_string(app->preview_downscale));
+  if (seconds > 0) {
+    label("samples/s", "%.1f", performance.samples / seconds);
+    label("mrays/s", "%.2f", rays * 1e-6 / seconds);
+    label("utilization", "%.0f%%",
+        100 * performance.busy * 1e-9 / (seconds * threads));
+  } else {
+    draw_gllabel(win, "samples/s", "-");
+    draw_gllabel(win, "mrays/s", "-");
+    draw_gllabel(win, "utilization", "-");
+  }
+  if (rays) {
+    label("steps per ray", "%.1f", (double)app->stats.steps / rays);
+  } else {
+    draw_gllabel(win, "steps per ray", "-");
+  }
+  label("cancel ms", "%.2f", performance.cancel);
+  label("cancel max ms", "%.2f", performance.cancel_max);
+  draw_gllabel(win, "cancels over budget",
+      std::to_string(performance.cancel_over.load()));
+  draw_glslider(win, "cancel budget ms", app->cancel_budget, 0.5f, 20);
+}
+
+// Memory of the tree, of the tape and the buffers of the latest CPU frame,
+// and of the grids, see memory.h.
+void draw_glmemory(const opengl_window& win, shared_ptr<app_state> app) {
+  auto label = [&win](const char* name, size_t bytes) {
+    char text[64];
+    snprintf(text, sizeof(text), "%.1f mb", bytes / (1024.0 * 1024.0));
+    draw_gllabel(win, name, text);
+  };
+  label("tree", memory_bytes(app->csg));
+  label("tape", app->performance.tape);
+  label("buffers", app->performance.buffers);
+  label("grid", app->grid ? memory_bytes(*app->grid) : 0);
+  label("grid cache", cache_bytes(get_grid_cache()));
+  label("view cache", app->performance.views);
+}
+
+void draw_glwidgets(const opengl_window& win, shared_ptr<app_state> app,
+    const opengl_input& input) {
+  auto selected = app->selected;
+  int  edit     = 0;
+  if (app->csg.nodes.empty()) {
+    // the first tree is still loading
+  } else if (is_group(app->csg.nodes[selected])) {
+    // the spheres of groups are edited one at a time, see node_param
+    auto& group = app->csg.groups[app->csg.nodes[selected].group];
+    auto  count = (int)group.centers.size();
+    app->sphere = yocto::clamp(app->sphere, 0, yocto::max(count - 1, 0));
+    draw_glslider(win, "sphere", app->sphere, 0, yocto::max(count - 1, 0));
+    if (count > 0) {
+      auto param = app->sphere * 4;
+      deferred_slider(win, app, "x", selected, param + 0, -1, 1);
+      deferred_slider(win, app, "y", selected, param + 1, 0, 1);
+      deferred_slider(win, app, "z", selected, param + 2, 0, 1);
+      deferred_slider(win, app, "radius", selected, param + 3, 0, 1);
+    }
+  } else if (app->csg.nodes[selected].children == vec2i{-1, -1}) {
+    deferred_slider(win, app, "x", selected, 0, -1, 1);
+    deferred_slider(win, app, "y", selected, 1, 0, 1);
+    deferred_slider(win, app, "z", selected, 2, 0, 1);
+    deferred_slider(win, app, "radius", selected, 3, 0, 1);
+  } else {
+    deferred_slider(win, app, "blend", selected, 0, -1, 1);
+    deferred_slider(win, app, "soft", selected, 1, 0, 1);
+  }
+  if (draw_glbutton(win, "undo", !app->history.undo.empty()))
+    push(app->commands, {app_command_type::undo});
+  continue_glline(win);
+  if (draw_glbutton(win, "redo", !app->history.redo.empty()))
+    push(app->commands, {app_command_type::redo});
+  if (draw_glcheckbox(win, "baked", app->baked)) edit += 1;
+  edit += draw_glcheckbox(win, "shadows", app->lit);
+  if (draw_glslider(win, "bake resolution", app->bake_resolution, 16, 512)) {
+    app->bake_dirty = true;
+    edit += 1;
+  }
+  draw_glcheckbox(win, "proxy", app->proxy);
+  if (draw_glslider(win, "proxy resolution", app->proxy_resolution, 16, 256))
+    app->proxy_csg = nullptr;
+  draw_glslider(win, "proxy settle", app->proxy_settle, 0, 2);
+  edit += draw_glslider(win, "relaxation", app->march.relaxation, 1, 1.9);
+  edit += draw_glcheckbox(win, "footprint hits", app->footprint);
+  edit += draw_glslider(win, "bounces", app->march.bounces, 0, 8);
+  edit += draw_glcheckbox(win, "radiance cache", app->radiance_cache);
+  auto& shading = app->march.shading;
+  if (draw_glslider(win, "light", shading.light, -1, 1)) {
+    if (length(shading.light) == 0) shading.light = {0, 1, 0};
+    edit += 1;
+  }
+  edit += draw_glcoloredit(win, "diffuse", shading.diffuse);
+  edit += draw_glcoloredit(win, "specular", shading.specular);
+  edit += draw_glslider(win, "roughness", shading.roughness, 0.01, 1);
+  auto falsecolor = (int)app->march.falsecolor;
+  if (draw_glcombobox(win, "falsecolor", falsecolor, march_falsecolor_names)) {
+    app->march.falsecolor = (march_falsecolor)falsecolor;
+    edit += 1;
+  }
+  auto sampler = (int)app->march.sampler;
+  if (draw_glcombobox(win, "sampler", sampler, march_sampler_names)) {
+    app->march.sampler = (march_sampler)sampler;
+    edit += 1;
+  }
+  edit += draw_glcheckbox(win, "gpu", app->gpu);
+  draw_glcheckbox(win, "watch file", app->watch);
+  edit += draw_glslider(win, "samples", app->params.samples, 1, 256);
+  edit += draw_glslider(win, "noise", app->noise, 0, 0.05);
+  edit += draw_glcheckbox(win, "denoise", app->denoise);
+  draw_glslider(win, "preview ms", app->preview_budget, 0, 100);
+  draw_glcheckbox(win, "fast preview", app->fast_preview);
+  auto interleave = app->interleave == 4 ? 2 : app->interleave == 2 ? 1 : 0;
+  if (draw_glcombobox(win, "interleave", interleave,
+          vector<string>{"preview", "half", "quarter"}))
+    app->interleave = interleave ? 1 << interleave : 0;
+  auto exposure = app->glparams.exposure;
+  if (draw_glslider(win, "exposure", exposure, -5, 5))
+    push(app->commands, {app_command_type::set_exposure, 0, 0, exposure});
+  draw_glcheckbox(win, "filmic", app->glparams.filmic);
+  draw_glperformance(win, app);
+  draw_glmemory(win, app);
+  auto loading = app->load_future.valid() &&
+                 app->load_future.wait_for(0s) != future_status::ready;
+  if (app->load_pending || loading)
+    draw_gllabel(win, "loading",
+        std::to_string((int)(app->load_progress * 100)) + "%");
+  draw_glprofile(win, app);
+  if (edit > 0) reset_display(app);
+}
+
+// Allocates the buffers and requests the first frame.
+void start_app(shared_ptr<app_state> app) {
+  app->camera = init_camera();
+
+  // allocate buffers
+  init_state(app->state, app->camera, app->params);
+  app->render        = image{app->state.size(), zero4f};
+  app->glparams.srgb = true;
+  reset_display(app);
+  if (!app->csg.nodes.empty()) app->started = get_seconds();
+
+  app->params.samples = 4;
+}
+
+// Work of the UI thread at each update, after the input: applies the
+// commands and the loads, and publishes the frame that they request.
+void update_app(shared_ptr<app_state> app) {
+  update_watch(app);
+  apply_commands(app);
+  update_load(app);
+  update_rebuild(app);
+  if (app->bake_ready || app->lighting_ready) reset_display(app);
+  update_display(app);
+  update_pick(app);
+}
+
+void run_app(shared_ptr<app_state> app) {
+  start_app(app);
+
+  // window
+  auto win = opengl_window{};
+  init_glwindow(win, {720 + 320, 720}, "Csg Explorer", true);
+
+  // callbacks
+  set_draw_glcallback(
+      win, [app](const opengl_window& win, const opengl_input& input) {
+        if (!is_initialized(app->glimage)) init_glimage(app->glimage);
+        if (app->gpu_frame) {
+          render_gpu_sample(app);
+        } else {
+          // only the tiles rendered since the last frame are uploaded
+          CSG_ZONE("upload");
+          auto lock = lock_guard{app->display_mutex};
+          if (app->display_all) {
+            set_glimage(
+                app->glimage, app->render, opengl_image_format::rgba16f);
+          } else {
+            set_glimage_regions(
+                app->glimage, app->render, app->display_regions);
+          }
+          app->display_all = false;
+          app->display_regions.clear();
+        }
+        app->glparams.window      = input.window_size;
+        app->glparams.framebuffer = input.framebuffer_viewport;
+        update_imview(app->glparams.center, app->glparams.scale,
+            app->glimage.texture_size, app->glparams.window,
+            app->glparams.fit);
+        if (app->proxy_mesh) {
+          upload_proxy(app->glscene, *app->proxy_mesh);
+          app->proxy_mesh = nullptr;
+        }
+        CSG_ZONE("draw");
+        if (proxy_shown(app)) {
+          draw_proxy(app);
+        } else {
+          draw_glimage(app->glimage, app->glparams);
+        }
+      });
+  set_uiupdate_glcallback(
+      win, [app](const opengl_window& win, const opengl_input& input) {
+        if ((input.mouse_left || input.mouse_right) && !input.modifier_alt &&
+            !input.widgets_active) {
+          auto camera = app->camera;
+          auto dolly  = 0.0f;
+          auto pan    = zero2f;
+          auto rotate = zero2f;
+          if (input.mouse_left && !input.modifier_shift)
+            rotate = (input.mouse_pos - input.mouse_last) / 100.0f;
+          if (input.mouse_right)
+            dolly = (input.mouse_pos.x - input.mouse_last.x) / 100.0f;
+          if (input.mouse_left && input.modifier_shift)
+            pan = (input.mouse_pos - input.mouse_last) * camera.focus / 200.0f;
+          pan.x = -pan.x;
+          update_turntable(camera.frame, camera.focus, rotate, dolly, pan);
+          push(app->commands, {app_command_type::set_camera, 0, 0, 0, camera});
+        }
+        // the middle button pans the render, and frames refine the pixels
+        // shown once the view of the render changes
+        if (input.mouse_middle && !input.widgets_active) {
+          app->glparams.fit = false;
+          app->glparams.center += input.mouse_pos - input.mouse_last;
+        }
+        if (auto visible = visible_pixels(app); visible != app->visible) {
+          app->visible = visible;
+          app->moved   = true;
+          reset_display(app);
+        }
+        update_app(app);
+      });
+
+  set_widgets_glcallback(
+      win, [app](const opengl_window& win, const opengl_input& input) {
+        draw_glwidgets(win, app, input);
+      });
+  set_idle_glcallback(
+      win, [app](const opengl_window& win, const opengl_input& input) {
+        return idle_wait(app);
+      });
+
+  auto keycb = [app](const opengl_window& win, opengl_key key, bool pressed,
+                   const opengl_input& input) {
+    if (!pressed) return;
+    if (key == opengl_key::enter) {
+      push(app->commands, {app_command_type::reload});
+    }
+
+    if (key == opengl_key('F')) app->glparams.fit = true;
+
+    if (app->csg.nodes.empty()) return;
+    if (key == opengl_key('G')) {
+      // graphs are drawn from the snapshot in the background, one at a time
+      auto drawing = app->graph_future.valid() &&
+                     app->graph_future.wait_for(0s) != future_status::ready;
+      if (!drawing)
+        app->graph_future = async_task(
+            [csg = app->snapshot, filename = app->graphname,
+                profile = app->profile]() {
+              auto heat = profile && profile->csg == csg ? profile->heat
+                                                         : vector<float>{};
+              if (!save_tree_png(*csg, filename, heat))
+                printf("%s: dot failed, is graphviz installed?\n",
+                    filename.c_str());
+            },
+            csg_priority::background);
+    }
+
+    // ctrl-z undoes the latest edit, ctrl-shift-z and ctrl-y redo it
+    if (key == opengl_key('Z') && input.modifier_ctrl) {
+      push(app->commands, {input.modifier_shift ? app_command_type::redo
+                                                : app_command_type::undo});
+    }
+    if (key == opengl_key('Y') && input.modifier_ctrl) {
+      push(app->commands, {app_command_type::redo});
+    }
+
+    if (key == opengl_key::left) {
+      app->selected = yocto::max(app->selected - 1, 0);
+    }
+    if (key == opengl_key::right) {
+      app->selected = yocto::min(app->selected + 1, app->csg.nodes.size() - 1);
+    }
+  };
+
+  set_key_glcallback(win, keycb);
+
+  // scrolling zooms the render about the cursor, and F fits it again
+  set_scroll_glcallback(win, [app](const opengl_window& win, float amount,
+                                 const opengl_input& input) {
+    if (input.widgets_active) return;
+    auto& glparams  = app->glparams;
+    auto  zoom      = std::pow(1.25f, amount);
+    glparams.fit    = false;
+    glparams.center = input.mouse_pos + (glparams.center - input.mouse_pos) *
+                                            zoom;
+    glparams.scale *= zoom;
+  });
+
+  // alt-click selects the primitive under the cursor
+  set_click_glcallback(win, [app](const opengl_window& win, bool left,
+                                bool pressed, const opengl_input& input) {
+    if (!left || !pressed || !input.modifier_alt || input.widgets_active)
+      return;
+    auto pixel = get_image_coords(input.mouse_pos, app->glparams.center,
+        app->glparams.scale, app->glimage.texture_size);
+    auto size  = camera_size(app->camera, app->params.resolution);
+    if (pixel.x >= 0 && pixel.y >= 0 && pixel.x < size.x && pixel.y < size.y)
+      app->pick = pixel;
+  });
+
+  // run ui
+  run_ui(win);
+
+  // clear
+  clear_glwindow(win);
+}
+
+inline const auto app_command_names = vector<string>{"set_param",
+    "set_camera", "reload", "set_exposure", "undo", "redo", "begin_edit",
+    "commit_edit"};
+
+// Commands of a session as text, one per line with its time, its name, its
+// parameter and its camera, so that sessions can be read and edited.
+bool save_session(const string& filename, const vector<app_event>& events) {
+  auto fs = fopen(filename.c_str(), "w");
+  if (!fs) return false;
+  fprintf(fs, "csgsession1\n");
+  for (auto& event : events) {
+    auto& command = event.command;
+    auto& camera  = command.camera;
+    fprintf(fs, "%.6f %s %d %d %.9g", event.time,
+        app_command_names[(int)command.type].c_str(), command.node,
+        command.param, command.value);
+    for (auto axis : {camera.frame.x, camera.frame.y, camera.frame.z,
+             camera.frame.o})
+      fprintf(fs, " %.9g %.9g %.9g", axis.x, axis.y, axis.z);
+    fprintf(fs, " %d %.9g %.9g %.9g %.9g %.9g\n", (int)camera.orthographic,
+        camera.lens, camera.film.x, camera.film.y, camera.focus,
+        camera.aperture);
+  }
+  return fclose(fs) == 0;
+}
+
+bool load_session(
+    const string& filename, vector<app_event>& events, string& error) {
+  auto fs    = std::ifstream{filename};
+  auto magic = string{};
+  if (!std::getline(fs, magic) || magic != "csgsession1") {
+    error = filename + ": not a session";
+    return false;
+  }
+  events.clear();
+  for (auto line = string{}; std::getline(fs, line);) {
+    if (line.empty()) continue;
+    auto  stream  = std::istringstream{line};
+    auto  event   = app_event{};
+    auto  name    = string{};
+    auto  ortho   = 0;
+    auto& command = event.command;
+    auto& camera  = command.camera;
+    stream >> event.time >> name >> command.node >> command.param >>
+        command.value;
+    for (auto axis : {&camera.frame.x, &camera.frame.y, &camera.frame.z,
+             &camera.frame.o})
+      stream >> axis->x >> axis->y >> axis->z;
+    stream >> ortho >> camera.lens >> camera.film.x >> camera.film.y >>
+        camera.focus >> camera.aperture;
+    auto type = std::find(
+        app_command_names.begin(), app_command_names.end(), name);
+    if (!stream || type == app_command_names.end()) {
+      error = filename + ": bad event " + std::to_string(events.size() + 1);
+      return false;
+    }
+    command.type        = (app_command_type)(type - app_command_names.begin());
+    camera.orthographic = ortho != 0;
+    events.push_back(event);
+  }
+  return true;
+}
+
+// Entry point of viewer.h.
+void run_viewer(Csg csg, const string& filename, bool watch,
+    const string& recordname) {
+  auto app       = make_shared<app_state>();
+  app->csg       = std::move(csg);
+  app->filename  = filename;
+  app->watch     = watch;
+  app->recording = !recordname.empty();
+  if (!filename.empty()) {
+    auto error   = std::error_code{};
+    app->watched = std::filesystem::last_write_time(filename, error);
+  }
+  // the window opens at once, and the file is loaded in the background
+  if (app->csg.nodes.empty() && !filename.empty()) app->load_pending = true;
+  run_app(app);
+  if (app->recording && !save_session(recordname, app->events))
+    printf("%s: cannot write session\n", recordname.c_str());
+}
+
+// Entry point of viewer.h for replays. The UI is updated 60 times a second
+// with the steps of run_app, and the commands of the session are pushed at
+// their times, from the swap of the first tree as when recorded. Events
+// are measured from the update that applies them to the first image of the
+// frame they request, or of a later frame that replaces it, and to its
+// first pass at full resolution; reloads to the frames of the tree they
+// load. Updates that overrun their interval drop frames, and previews are
+// skipped when later events replace their frames before they show.
+bool replay_viewer(const string& filename, const string& sessionname,
+    const string& reportname, string& error) {
+  auto events = vector<app_event>{};
+  if (!load_session(sessionname, events, error)) return false;
+  auto app          = make_shared<app_state>();
+  app->filename     = filename;
+  app->load_pending = true;
+  app->gpu          = false;  // the GPU and the proxy need a window
+  app->proxy        = false;
+  app->timing       = true;
+  start_app(app);
+
+  const auto interval = 1.0 / 60;
+  auto       deadline = get_seconds();
+  auto       frames = 0, dropped = 0;
+  auto       update = [&]() {
+    update_app(app);
+    frames += 1;
+    deadline += interval;
+    auto now = get_seconds();
+    if (now > deadline) {
+      dropped += 1 + (int)((now - deadline) / interval);
+      deadline = now;
+    }
+    std::this_thread::sleep_for(std::chrono::duration<double>(deadline - now));
+  };
+  auto loading = [&]() {
+    return app->load_pending || app->load_ready ||
+           (app->load_future.valid() &&
+               app->load_future.wait_for(0s) != future_status::ready);
+  };
+  while (app->started < 0) {
+    update();
+    if (app->started < 0 && !loading()) {
+      error = filename + ": cannot load";
+      return false;
+    }
+  }
+
+  // generation requested by each event, and the ns of its update
+  auto generations = vector<int>(events.size(), -1);
+  auto applied     = vector<int64_t>(events.size(), 0);
+  auto next        = (size_t)0;
+  auto last        = events.empty() ? 0.0 : events.back().time;
+  while (true) {
+    auto now   = get_seconds() - app->started;
+    auto first = next;
+    while (next < events.size() && events[next].time <= now &&
+           try_push(app->commands, events[next].command))
+      applied[next++] = get_time();
+    update();
+    for (auto i = first; i < next; i++)
+      generations[i] = app->render_generation;
+    auto settled = next == events.size() && !loading() &&
+                   app->rendered_generation == app->render_generation;
+    if (settled || now > last + 60) break;
+  }
+
+  auto marks = vector<app_mark>{};
+  {
+    auto lock = lock_guard{app->display_mutex};
+    marks     = app->marks;
+  }
+  // first mark of these types for the generation or a later one, since
+  // the event
+  auto find_mark = [&](int generation, int64_t since,
+                       auto... types) -> const app_mark* {
+    for (auto& mark : marks)
+      if (((mark.type == types) || ...) && mark.generation >= generation &&
+          mark.time >= since)
+        return &mark;
+    return nullptr;
+  };
+  auto previews = vector<double>{}, fulls = vector<double>{};
+  auto skipped  = 0;
+  auto json     = string{};
+  for (auto i = (size_t)0; i < events.size(); i++) {
+    auto type       = events[i].command.type;
+    auto generation = generations[i];
+    auto preview = -1.0, full = -1.0;
+    if (type == app_command_type::reload) {
+      auto loaded = find_mark(0, applied[i], app_mark_type::loaded);
+      generation  = loaded ? loaded->generation : -1;
+    }
+    if (type != app_command_type::set_exposure && generation >= 0) {
+      auto shown = find_mark(generation, applied[i], app_mark_type::preview);
+      auto done  = find_mark(generation, applied[i], app_mark_type::full,
+          app_mark_type::finished);
+      if (shown) preview = (shown->time - applied[i]) * 1e-6;
+      if (done) full = (done->time - applied[i]) * 1e-6;
+      if (shown) previews.push_back(preview);
+      if (done) fulls.push_back(full);
+      auto own = std::any_of(marks.begin(), marks.end(), [&](auto& mark) {
+        return mark.type == app_mark_type::preview &&
+               mark.generation == generation;
+      });
+      if (!own) skipped += 1;
+    }
+    char buffer[256];
+    snprintf(buffer, sizeof(buffer),
+        "%s    {\"time\": %.3f, \"command\": \"%s\", \"preview_ms\": %.2f, "
+        "\"full_ms\": %.2f}",
+        json.empty() ? "" : ",\n", events[i].time,
+        app_command_names[(int)type].c_str(), preview, full);
+    json += buffer;
+  }
+
+  auto percentile = [](vector<double> values, double p) {
+    if (values.empty()) return -1.0;
+    std::sort(values.begin(), values.end());
+    return values[std::min((size_t)(p * values.size()), values.size() - 1)];
+  };
+  auto statistics = [&](const vector<double>& values) {
+    char buffer[128];
+    snprintf(buffer, sizeof(buffer),
+        "{\"p50\": %.2f, \"p95\": %.2f, \"max\": %.2f}",
+        percentile(values, 0.5), percentile(values, 0.95),
+        percentile(values, 1));
+    return string{buffer};
+  };
+  printf("%d events, preview ms p50 %.1f p95 %.1f max %.1f, full ms p50 %.1f "
+         "p95 %.1f max %.1f, %d of %d frames dropped, %d previews skipped\n",
+      (int)events.size(), percentile(previews, 0.5),
+      percentile(previews, 0.95), percentile(previews, 1),
+      percentile(fulls, 0.5), percentile(fulls, 0.95), percentile(fulls, 1),
+      dropped, frames, skipped);
+  if (reportname.empty()) return true;
+  auto fs = fopen(reportname.c_str(), "w");
+  if (!fs) {
+    error = reportname + ": cannot write report";
+    return false;
+  }
+  fprintf(fs,
+      "{\n  \"preview_ms\": %s,\n  \"full_ms\": %s,\n  \"frames\": %d,\n"
+      "  \"dropped\": %d,\n  \"skipped\": %d,\n  \"events\": [\n%s]\n}\n",
+      statistics(previews).c_str(), statistics(fulls).c_str(), frames,
+      dropped, skipped, json.c_str());
+  if (fclose(fs) != 0) {
+    error = reportname + ": cannot write report";
+    return false;
+  }
+  return true;
+}
@@ -0,0 +1,24 @@
+#pragma once
+#include <string>
+
+#include "csg.h"
+
+// The interactive viewer, built as its own library so that the tools that
+// only evaluate or render trees do not link OpenGL. See viewer.cpp.
+
+// Opens a window on the tree and returns when it is closed. With `watch`,
+// the tree is loaded again from `filename` when the file changes. An empty
+// tree is loaded from `filename` in the background, with the window showing
+// the progress, so that large files open at once. With `recordname`, the
+// edits, camera moves and reloads are saved there with their times when the
+// window is closed, to be replayed by replay_viewer.
+void run_viewer(Csg csg, const std::string& filename = {}, bool watch = false,
+    const std::string& recordname = {});
+
+// Replays a recorded session on the tree of `filename` without a window, and
+// prints the latency of its frames and the frames of the UI it drops, also
+// saved as JSON to `reportname` if given. Returns false, with `error` set,
+// if the session, the tree or the report cannot be read or written.
+bool replay_viewer(const std::string& filename,
+    const std::string& sessionname, const std::string& reportname,
+    std::string& error);
@@ -0,0 +1,131 @@
+#pragma once
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "pool.h"
+
+#ifdef CSG_TRACY
+#include <tracy/Tracy.hpp>
+#endif
+
+// Scoped timing zones of the render pipeline, e.g. the commands, previews,
+// samples and uploads of the viewer and the stages of load_csg, to see
+// where the time of a frame goes. Zones are compiled in with CSG_TRACE,
+// and CSG_ZONE expands to nothing otherwise. Each thread records its zones
+// in its own lane, under a lock that only save_trace contends for, and
+// save_trace writes them as a Chrome trace, which chrome://tracing and
+// Perfetto open. With CSG_TRACY, zones are streamed to Tracy instead.
+// Zones are kept until the process exits, a few bytes each.
+
+// whether save_trace has zones to write
+#if defined(CSG_TRACE) && !defined(CSG_TRACY)
+constexpr auto csg_tracing = true;
+#else
+constexpr auto csg_tracing = false;
+#endif
+
+struct CsgZoneEvent {
+  const char* name  = nullptr;  // a literal, not copied
+  int64_t     begin = 0;        // ns since the start of the trace
+  int64_t     end   = 0;
+};
+
+struct CsgTraceLane {
+  std::mutex                mutex  = {};
+  std::string               name   = {};
+  std::vector<CsgZoneEvent> events = {};
+};
+
+struct CsgTrace {
+  std::mutex                                 mutex = {};
+  std::vector<std::unique_ptr<CsgTraceLane>> lanes = {};
+  std::chrono::steady_clock::time_point      start = {};
+};
+
+inline CsgTrace& get_trace() {
+  static auto trace = [] {
+    auto trace   = std::make_unique<CsgTrace>();
+    trace->start = std::chrono::steady_clock::now();
+    return trace;
+  }();
+  return *trace;
+}
+
+inline int64_t trace_time() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now() - get_trace().start)
+      .count();
+}
+
+// Lane of this thread, added on its first zone and named after its worker.
+inline CsgTraceLane& trace_lane() {
+  static thread_local auto lane = (CsgTraceLane*)nullptr;
+  if (lane) return *lane;
+  auto& trace = get_trace();
+  auto  lock  = std::lock_guard{trace.mutex};
+  trace.lanes.push_back(std::make_unique<CsgTraceLane>());
+  lane       = trace.lanes.back().get();
+  auto index = (int)trace.lanes.size() - 1;
+  lane->name = pool_worker() >= 0
+                   ? "worker " + std::to_string(pool_worker())
+                   : "thread " + std::to_string(index);
+  return *lane;
+}
+
+struct CsgZone {
+  const char* name  = nullptr;
+  int64_t     begin = 0;
+
+  explicit CsgZone(const char* name) : name{name}, begin{trace_time()} {}
+  CsgZone(const CsgZone&) = delete;
+  CsgZone& operator=(const CsgZone&) = delete;
+  ~CsgZone() {
+    auto  end  = trace_time();
+    auto& lane = trace_lane();
+    auto  lock = std::lock_guard{lane.mutex};
+    lane.events.push_back({name, begin, end});
+  }
+};
+
+#define CSG_ZONE_JOIN2(a, b) a##b
+#define CSG_ZONE_JOIN(a, b) CSG_ZONE_JOIN2(a, b)
+#if defined(CSG_TRACY)
+#define CSG_ZONE(name) ZoneScopedN(name)
+#elif defined(CSG_TRACE)
+#define CSG_ZONE(name) CsgZone CSG_ZONE_JOIN(csg_zone_, __LINE__){name}
+#else
+#define CSG_ZONE(name)
+#endif
+
+// Writes the zones recorded so far as a Chrome trace, with a lane per
+// thread and times in us. Returns false if the file cannot be written.
+inline bool save_trace(const std::string& filename) {
+  auto fs = fopen(filename.c_str(), "wb");
+  if (!fs) return false;
+  auto& trace = get_trace();
+  auto  lock  = std::lock_guard{trace.mutex};
+  auto  first = true;
+  fprintf(fs, "{\"traceEvents\": [");
+  for (auto tid = 0; tid < (int)trace.lanes.size(); tid++) {
+    auto& lane = *trace.lanes[tid];
+    auto  held = std::lock_guard{lane.mutex};
+    fprintf(fs,
+        "%s\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 0, "
+        "\"tid\": %d, \"args\": {\"name\": \"%s\"}}",
+        first ? "" : ",", tid, lane.name.c_str());
+    first = false;
+    for (auto& event : lane.events) {
+      fprintf(fs,
+          ",\n{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 0, \"tid\": %d, "
+          "\"ts\": %.3f, \"dur\": %.3f}",
+          event.name, tid, event.begin * 1e-3,
+          (event.end - event.begin) * 1e-3);
+    }
+  }
+  fprintf(fs, "\n]}\n");
+  return fclose(fs) == 0;
+}